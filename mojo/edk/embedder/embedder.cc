@@ -13,7 +13,14 @@
 #include "mojo/edk/embedder/embedder_internal.h"
 #include "mojo/edk/embedder/platform_channel_pair.h"
 #include "mojo/edk/embedder/simple_platform_support.h"
+#include "mojo/edk/system/channel.h"
 #include "mojo/edk/system/core.h"
+#include "mojo/edk/system/memory_allocation.h"
+#include "mojo/edk/system/memory_placement.h"
+#include "mojo/edk/system/message_for_transit.h"
+#include "mojo/edk/system/message_tracer.h"
+#include "mojo/edk/system/node_controller.h"
+#include "mojo/edk/system/profiled_lock.h"
 
 namespace mojo {
 namespace edk {
@@ -35,6 +42,55 @@ Core* GetCore() { return g_core; }
 void SetMaxMessageSize(size_t bytes) {
 }
 
+void SetQueuedChannelWritesEnabled(bool enabled) {
+  Channel::SetQueuedWritesEnabled(enabled);
+}
+
+void SetSharedMemoryChannelsEnabled(bool enabled) {
+  Channel::SetSharedMemoryEnabled(enabled);
+}
+
+void SetChannelCompressionThreshold(size_t num_bytes) {
+  Channel::SetCompressionThreshold(num_bytes);
+}
+
+void SetSharedMemoryMessageThreshold(size_t num_bytes) {
+  MessageForTransit::SetSharedBytesThreshold(num_bytes);
+}
+
+void SetWaitSpinTime(uint64_t microseconds) {
+  Core::SetWaitSpinTime(microseconds);
+}
+
+void SetChannelBusyPollTime(uint64_t microseconds) {
+  Channel::SetBusyPollTime(microseconds);
+}
+
+void SetChannelReadBufferPlacement(bool huge_pages, bool numa_local) {
+  uint32_t placement = MEMORY_PLACEMENT_DEFAULT;
+  if (huge_pages)
+    placement |= MEMORY_PLACEMENT_HUGE_PAGES;
+  if (numa_local)
+    placement |= MEMORY_PLACEMENT_NUMA_LOCAL;
+  Channel::SetReadBufferPlacement(placement);
+}
+
+void SetChannelIoUringEnabled(bool enabled) {
+  Channel::SetIoUringEnabled(enabled);
+}
+
+bool RestoreNodeState(const base::FilePath& path,
+                      ScopedPlatformHandleVectorPtr channel_handles) {
+  CHECK(!internal::g_core);
+  return NodeController::PrepareToRestoreState(path,
+                                               std::move(channel_handles));
+}
+
+void SetMemoryAllocator(MemoryAllocator* allocator) {
+  CHECK(!internal::g_core);
+  InstallMemoryAllocator(allocator);
+}
+
 void PreInitializeParentProcess() {
 }
 
@@ -70,6 +126,60 @@ MojoResult AsyncWait(MojoHandle handle,
   return internal::g_core->AsyncWait(handle, signals, callback);
 }
 
+MojoResult AsyncWaitOnTaskRunner(
+    MojoHandle handle,
+    MojoHandleSignals signals,
+    bool persistent,
+    scoped_refptr<base::TaskRunner> task_runner,
+    const base::Callback<void(MojoResult)>& callback,
+    uintptr_t* wait_id) {
+  CHECK(internal::g_core);
+  return internal::g_core->AsyncWaitOnTaskRunner(
+      handle, signals, persistent, task_runner, callback, wait_id);
+}
+
+MojoResult CancelAsyncWait(uintptr_t wait_id) {
+  CHECK(internal::g_core);
+  return internal::g_core->CancelAsyncWait(wait_id);
+}
+
+MojoResult BindMessagePipe(MojoHandle message_pipe_handle,
+                           scoped_refptr<base::TaskRunner> executor,
+                           uint32_t max_batch_size,
+                           const MessageBatchHandler& handler,
+                           uintptr_t* binding_id) {
+  CHECK(internal::g_core);
+  return internal::g_core->BindMessagePipe(
+      message_pipe_handle, executor, max_batch_size, handler, binding_id);
+}
+
+MojoResult ReadMessageAsync(MojoHandle message_pipe_handle,
+                            scoped_refptr<base::TaskRunner> executor,
+                            const ReadMessageCallback& callback,
+                            uintptr_t* wait_id) {
+  CHECK(internal::g_core);
+  return internal::g_core->ReadMessageAsync(message_pipe_handle, executor,
+                                            callback, wait_id);
+}
+
+MojoResult WaitDataPipeAsync(MojoHandle data_pipe_handle,
+                             uint32_t num_bytes,
+                             scoped_refptr<base::TaskRunner> executor,
+                             const base::Callback<void(MojoResult)>& callback,
+                             uintptr_t* wait_id) {
+  CHECK(internal::g_core);
+  return internal::g_core->WaitDataPipeAsync(data_pipe_handle, num_bytes,
+                                             executor, callback, wait_id);
+}
+
+MojoResult CreateMessagePipes(uint32_t num_pipes,
+                              MojoHandle* message_pipe_handles0,
+                              MojoHandle* message_pipe_handles1) {
+  CHECK(internal::g_core);
+  return internal::g_core->CreateMessagePipes(
+      nullptr, num_pipes, message_pipe_handles0, message_pipe_handles1);
+}
+
 MojoResult CreatePlatformHandleWrapper(
     ScopedPlatformHandle platform_handle,
     MojoHandle* platform_handle_wrapper_handle) {
@@ -95,6 +205,17 @@ void InitIPCSupport(ProcessDelegate* process_delegate,
   internal::g_core->SetIOTaskRunner(io_thread_task_runner);
 }
 
+void AddIPCIOThread(scoped_refptr<base::TaskRunner> io_thread_task_runner) {
+  CHECK(internal::g_core);
+  CHECK(internal::g_io_thread_task_runner);
+  internal::g_core->AddIOTaskRunner(io_thread_task_runner);
+}
+
+void SetEagerIntroductionsEnabled(bool enabled) {
+  CHECK(internal::g_core);
+  internal::g_core->SetEagerIntroductionsEnabled(enabled);
+}
+
 void ShutdownIPCSupportOnIOThread() {
 }
 
@@ -123,5 +244,28 @@ std::string GenerateRandomToken() {
   return base::HexEncode(random_bytes, 16);
 }
 
+void GetMetrics(Metrics* metrics) {
+  CHECK(internal::g_core);
+  internal::g_core->GetMetrics(metrics);
+}
+
+bool SaveNodeState(const base::FilePath& path,
+                   ScopedPlatformHandleVectorPtr* channel_handles) {
+  CHECK(internal::g_core);
+  return internal::g_core->SaveNodeState(path, channel_handles);
+}
+
+void SetMessageTraceSamplingRate(uint32_t one_in_n) {
+  MessageTracer::SetSamplingRate(one_in_n);
+}
+
+void GetMessageTraceEvents(std::vector<MessageTraceEvent>* events) {
+  MessageTracer::GetEvents(events);
+}
+
+void GetLockProfiles(std::vector<LockSiteProfile>* profiles) {
+  GetLockSiteProfiles(profiles);
+}
+
 }  // namespace edk
 }  // namespace mojo
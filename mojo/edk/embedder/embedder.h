@@ -6,15 +6,24 @@
 #define MOJO_EDK_EMBEDDER_EMBEDDER_H_
 
 #include <stddef.h>
+#include <stdint.h>
 
 #include <string>
+#include <vector>
 
 #include "base/callback.h"
 #include "base/command_line.h"
+#include "base/files/file_path.h"
 #include "base/memory/ref_counted.h"
 #include "base/memory/scoped_ptr.h"
 #include "base/process/process_handle.h"
 #include "base/task_runner.h"
+#include "mojo/edk/embedder/lock_profile.h"
+#include "mojo/edk/embedder/memory_allocator.h"
+#include "mojo/edk/embedder/message_trace.h"
+#include "mojo/edk/embedder/metrics.h"
+#include "mojo/edk/embedder/platform_handle_vector.h"
+#include "mojo/edk/embedder/received_message.h"
 #include "mojo/edk/embedder/scoped_platform_handle.h"
 #include "mojo/edk/system/system_impl_export.h"
 #include "mojo/public/cpp/system/message_pipe.h"
@@ -33,6 +42,78 @@ class ProcessDelegate;
 // Allows changing the default max message size. Must be called before Init.
 MOJO_SYSTEM_IMPL_EXPORT void SetMaxMessageSize(size_t bytes);
 
+// Makes channel writes from any thread go through a queue drained by the I/O
+// thread, so that sending threads never block in write syscalls. Must be
+// called before Init.
+MOJO_SYSTEM_IMPL_EXPORT void SetQueuedChannelWritesEnabled(bool enabled);
+
+// Makes the channel between a parent process and each of its children carry
+// message data through shared memory rather than through the pipe. Must be
+// called before Init, and identically in the parent and all of its children.
+MOJO_SYSTEM_IMPL_EXPORT void SetSharedMemoryChannelsEnabled(bool enabled);
+
+// Makes the channel between a parent process and each of its children
+// compress message payloads of at least |num_bytes|, if the other process has
+// also enabled this. Worthwhile only when the channel crosses a slow link.
+// Unused on shared memory channels. Must be called before Init.
+MOJO_SYSTEM_IMPL_EXPORT void SetChannelCompressionThreshold(size_t num_bytes);
+
+// Makes MojoWriteMessage() put the contents of messages of at least
+// |num_bytes| in shared memory when they're going to another process, so that
+// they aren't copied through the channel. The reader maps them instead. Only
+// worthwhile for messages of several megabytes. Must be called before Init.
+//
+// The writer keeps the memory mapped writable, so the reader never hands out
+// contents in place: MojoReadMessage() copies them straight into the caller's
+// buffer, and MojoReadMessageNew() first copies them into private memory. A
+// writer which changes them while they're being copied can only garble its own
+// message; what the reader sees can't change once it has it.
+MOJO_SYSTEM_IMPL_EXPORT void SetSharedMemoryMessageThreshold(size_t num_bytes);
+
+// Makes MojoWait() and MojoWaitMany() poll for up to |microseconds| before
+// blocking, adapting how long they actually poll to how soon handles have
+// recently become ready. Cuts round-trip latency when waiting threads have
+// cores to themselves, at the cost of burning CPU otherwise.
+MOJO_SYSTEM_IMPL_EXPORT void SetWaitSpinTime(uint64_t microseconds);
+
+// Makes the I/O thread keep reading each channel until nothing has arrived on
+// it for |microseconds|, rather than sleeping as soon as it runs dry. Only
+// worthwhile when the I/O thread has a core to itself. Must be called before
+// Init.
+MOJO_SYSTEM_IMPL_EXPORT void SetChannelBusyPollTime(uint64_t microseconds);
+
+// Asks for the buffers channels read into to be backed by transparent huge
+// pages and/or placed on the NUMA node of the I/O thread. Only affects read
+// buffers which grow to megabytes, i.e. channels carrying very large messages.
+// Best effort, and only honored on Linux and Android. Must be called before
+// Init.
+MOJO_SYSTEM_IMPL_EXPORT void SetChannelReadBufferPlacement(bool huge_pages,
+                                                           bool numa_local);
+
+// Makes channels do their socket I/O through an io_uring per I/O thread, which
+// batches the reads and writes of all the thread's channels into shared
+// system calls. Worthwhile when many channels are busy at once. Implies
+// queued channel writes. Only honored on Linux kernels which support it.
+// Must be called before Init.
+MOJO_SYSTEM_IMPL_EXPORT void SetChannelIoUringEnabled(bool enabled);
+
+// Makes this process take over as the node whose state was saved to |path| by
+// SaveNodeState() in another process, typically the broker before it was
+// restarted. |channel_handles| are the handles SaveNodeState() returned,
+// passed on to this process, e.g. by inheritance across exec. The node keeps
+// its name, routing state and channels, so the processes connected to it
+// carry on without reconnecting. Must be called before Init. Returns false if
+// the state can't be read.
+MOJO_SYSTEM_IMPL_EXPORT bool RestoreNodeState(
+    const base::FilePath& path,
+    ScopedPlatformHandleVectorPtr channel_handles);
+
+// Makes the EDK get the memory for messages, channel read buffers and ports
+// from |allocator| instead of the heap; see MemoryAllocator. |allocator| must
+// outlive all use of Mojo in the process. Must be called before Init, and
+// before anything else in this file.
+MOJO_SYSTEM_IMPL_EXPORT void SetMemoryAllocator(MemoryAllocator* allocator);
+
 // Must be called before Init in the parent (unsandboxed) process.
 MOJO_SYSTEM_IMPL_EXPORT void PreInitializeParentProcess();
 
@@ -70,6 +151,75 @@ AsyncWait(MojoHandle handle,
           MojoHandleSignals signals,
           const base::Callback<void(MojoResult)>& callback);
 
+// Like AsyncWait(), but |callback| is posted to |task_runner|, so it may call
+// Mojo system functions and never runs on the I/O thread. If |persistent|,
+// |callback| is posted each time |handle| satisfies a signal in |signals|
+// until it's called with a result other than MOJO_RESULT_OK: when |handle| is
+// closed (MOJO_RESULT_CANCELLED) or can never satisfy |signals|. State changes
+// while a call is posted or running are coalesced into that call. On success
+// |*wait_id| may be passed to CancelAsyncWait().
+MOJO_SYSTEM_IMPL_EXPORT MojoResult
+AsyncWaitOnTaskRunner(MojoHandle handle,
+                      MojoHandleSignals signals,
+                      bool persistent,
+                      scoped_refptr<base::TaskRunner> task_runner,
+                      const base::Callback<void(MojoResult)>& callback,
+                      uintptr_t* wait_id);
+
+// Stops a wait started by AsyncWaitOnTaskRunner(). Its callback isn't called
+// again, even if a call was already posted. Returns
+// MOJO_RESULT_INVALID_ARGUMENT if the wait had already finished.
+MOJO_SYSTEM_IMPL_EXPORT MojoResult CancelAsyncWait(uintptr_t wait_id);
+
+// Binds a message pipe to |executor| so that the caller needn't wait on it and
+// read it: whenever messages arrive, a task is posted to |executor| which
+// reads up to |max_batch_size| of them and passes them to |handler|. Calls for
+// one pipe are made in order and never overlap, even if |executor| runs tasks
+// concurrently. If |executor| is null, a work-stealing thread pool shared by
+// all bindings is used. The handle shouldn't be read from while it's bound,
+// and closing it ends the binding; see MessageBatchHandler. On success
+// |*binding_id| may be passed to CancelAsyncWait() to unbind the pipe.
+MOJO_SYSTEM_IMPL_EXPORT MojoResult
+BindMessagePipe(MojoHandle message_pipe_handle,
+                scoped_refptr<base::TaskRunner> executor,
+                uint32_t max_batch_size,
+                const MessageBatchHandler& handler,
+                uintptr_t* binding_id);
+
+// Reads the next message from a message pipe without blocking a thread on it:
+// |callback| is posted to |executor| once with the message, or with the reason
+// there won't be one. Chaining reads from the callback gives a pipe a
+// continuation-style reader which holds no thread between messages. |executor|
+// defaults as for BindMessagePipe(), and |*wait_id| may be passed to
+// CancelAsyncWait().
+MOJO_SYSTEM_IMPL_EXPORT MojoResult
+ReadMessageAsync(MojoHandle message_pipe_handle,
+                 scoped_refptr<base::TaskRunner> executor,
+                 const ReadMessageCallback& callback,
+                 uintptr_t* wait_id);
+
+// Posts |callback| to |executor| once the data pipe consumer or producer
+// |data_pipe_handle| has at least |num_bytes| to read or room for at least
+// |num_bytes| to write, or never will. This sets the threshold used for
+// MOJO_HANDLE_SIGNAL_THRESHOLD_REACHED on the handle. |executor| defaults as
+// for BindMessagePipe(), and |*wait_id| may be passed to CancelAsyncWait().
+MOJO_SYSTEM_IMPL_EXPORT MojoResult
+WaitDataPipeAsync(MojoHandle data_pipe_handle,
+                  uint32_t num_bytes,
+                  scoped_refptr<base::TaskRunner> executor,
+                  const base::Callback<void(MojoResult)>& callback,
+                  uintptr_t* wait_id);
+
+// Creates |num_pipes| message pipes at once, as MojoCreateMessagePipe() would
+// one at a time, storing their ends in |message_pipe_handles0| and
+// |message_pipe_handles1|. Much cheaper per pipe for callers which need many
+// up front. Either all of the pipes are created or, if there aren't enough
+// handles left, none are and MOJO_RESULT_RESOURCE_EXHAUSTED is returned.
+MOJO_SYSTEM_IMPL_EXPORT MojoResult
+CreateMessagePipes(uint32_t num_pipes,
+                   MojoHandle* message_pipe_handles0,
+                   MojoHandle* message_pipe_handles1);
+
 // Creates a |MojoHandle| that wraps the given |PlatformHandle| (taking
 // ownership of it). This |MojoHandle| can then, e.g., be passed through message
 // pipes. Note: This takes ownership (and thus closes) |platform_handle| even on
@@ -107,6 +257,20 @@ MOJO_SYSTEM_IMPL_EXPORT void InitIPCSupport(
     ProcessDelegate* process_delegate,
     scoped_refptr<base::TaskRunner> io_thread_task_runner);
 
+// Adds another I/O thread, to be called after |InitIPCSupport()| and before any
+// connections are made. Connections to other processes are spread over this and
+// the thread given to |InitIPCSupport()|, so that their I/O is not limited to a
+// single thread. The thread must outlive the one given to |InitIPCSupport()|.
+MOJO_SYSTEM_IMPL_EXPORT void AddIPCIOThread(
+    scoped_refptr<base::TaskRunner> io_thread_task_runner);
+
+// Makes the parent process introduce two of its children to each other as
+// soon as it passes one of them a message pipe whose other end is in the
+// other, instead of waiting for them to ask. This saves the first message
+// over such a pipe a round trip through the parent. To be called in the
+// parent after |InitIPCSupport()| and before any connections are made.
+MOJO_SYSTEM_IMPL_EXPORT void SetEagerIntroductionsEnabled(bool enabled);
+
 // Shuts down the subsystem initialized by |InitIPCSupport()|. This must be
 // called on the I/O thread (given to |InitIPCSupport()|). This completes
 // synchronously and does not result in a call to the process delegate's
@@ -131,7 +295,9 @@ CreateParentMessagePipe(const std::string& token);
 
 // Creates a message pipe from a token in a child process. The parent must also
 // have this token and call CreateParentMessagePipe() with it in order for the
-// pipe to get connected.
+// pipe to get connected. Once the child's connection to the parent is set up,
+// the pipe is usually connected on return, from ports the parent has connected
+// to the child ahead of time.
 MOJO_SYSTEM_IMPL_EXPORT ScopedMessagePipeHandle
 CreateChildMessagePipe(const std::string& token);
 
@@ -140,6 +306,37 @@ CreateChildMessagePipe(const std::string& token);
 // so as to not have to worry about collisions with other generated tokens.
 MOJO_SYSTEM_IMPL_EXPORT std::string GenerateRandomToken();
 
+// Fills |metrics| with a snapshot of the system's ports, peers and traffic.
+// This walks every port, so it is meant for occasional diagnostics rather
+// than for polling at a high rate.
+MOJO_SYSTEM_IMPL_EXPORT void GetMetrics(Metrics* metrics);
+
+// Writes this process's node state to |path| and fills |channel_handles| with
+// duplicates of the handles of its channels, for a new process to take over
+// with RestoreNodeState(). Must be called on the I/O thread once everything
+// else has stopped using Mojo, after closing any message pipes this process
+// still has open: unread messages can't be saved. Returns false on failure.
+MOJO_SYSTEM_IMPL_EXPORT bool SaveNodeState(
+    const base::FilePath& path,
+    ScopedPlatformHandleVectorPtr* channel_handles);
+
+// Makes each thread trace one in every |one_in_n| messages it writes to a
+// message pipe, or none if |one_in_n| is zero, which is the default. May be
+// called at any time. Traced messages are also stamped by the process which
+// receives them, so enabling this in one process of a pair is enough.
+MOJO_SYSTEM_IMPL_EXPORT void SetMessageTraceSamplingRate(uint32_t one_in_n);
+
+// Appends the most recent message trace events recorded by each thread in this
+// process to |events|. Events from different processes can be matched up by
+// their trace IDs.
+MOJO_SYSTEM_IMPL_EXPORT void GetMessageTraceEvents(
+    std::vector<MessageTraceEvent>* events);
+
+// Appends the wait and hold times recorded for each of the EDK's main locks
+// to |profiles|. Only lock profiling builds record them; see profiled_lock.h.
+MOJO_SYSTEM_IMPL_EXPORT void GetLockProfiles(
+    std::vector<LockSiteProfile>* profiles);
+
 }  // namespace edk
 }  // namespace mojo
 
@@ -0,0 +1,31 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_EMBEDDER_LOCK_PROFILE_H_
+#define MOJO_EDK_EMBEDDER_LOCK_PROFILE_H_
+
+#include <stdint.h>
+
+#include <string>
+
+namespace mojo {
+namespace edk {
+
+// What was recorded for one lock site, i.e. all locks with the same name, in a
+// build with the GN arg mojo_edk_profile_locks set. Times are in nanoseconds.
+// An acquisition is contended if the lock was not free when first tried.
+struct LockSiteProfile {
+  std::string name;
+  uint64_t num_acquisitions;
+  uint64_t num_contended_acquisitions;
+  uint64_t total_wait_time_ns;
+  uint64_t max_wait_time_ns;
+  uint64_t total_hold_time_ns;
+  uint64_t max_hold_time_ns;
+};
+
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_EMBEDDER_LOCK_PROFILE_H_
@@ -0,0 +1,46 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_EMBEDDER_MEMORY_ALLOCATOR_H_
+#define MOJO_EDK_EMBEDDER_MEMORY_ALLOCATOR_H_
+
+#include <stddef.h>
+
+namespace mojo {
+namespace edk {
+
+// An allocator which an embedder may install with SetMemoryAllocator() to
+// provide the memory the EDK uses for messages, channel read buffers and
+// ports, e.g. from its own arenas or from a pool faulted in up front. Both
+// methods may be called on any thread, concurrently.
+class MemoryAllocator {
+ public:
+  // What an allocation is for.
+  enum class Usage {
+    // Message objects and their contents, in Channel::Message and
+    // PortsMessage. Small blocks are also cached by each thread for reuse.
+    kMessage,
+
+    // The buffers channels read into, which are usually several kilobytes
+    // and long-lived.
+    kReadBuffer,
+
+    // Chunks of ports, each holding many of them.
+    kPort,
+  };
+
+  virtual ~MemoryAllocator() {}
+
+  // Returns at least |num_bytes| bytes aligned to |alignment|, a power of two.
+  // Must not fail.
+  virtual void* Allocate(Usage usage, size_t num_bytes, size_t alignment) = 0;
+
+  // Frees a block returned by Allocate() for the same |usage|.
+  virtual void Free(Usage usage, void* ptr) = 0;
+};
+
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_EMBEDDER_MEMORY_ALLOCATOR_H_
@@ -0,0 +1,53 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_EMBEDDER_MESSAGE_TRACE_H_
+#define MOJO_EDK_EMBEDDER_MESSAGE_TRACE_H_
+
+#include <stdint.h>
+
+namespace mojo {
+namespace edk {
+
+// The points on a message's path at which a traced message is stamped, in the
+// order a message going to another process passes them. Messages between
+// pipes in the same process usually pass only kWriteMessage and kReadMessage.
+enum class MessageTracePoint : uint32_t {
+  // Written to a message pipe. This is where messages are sampled.
+  kWriteMessage,
+
+  // Handed to the channel to the receiving process.
+  kChannelWrite,
+
+  // The last of the message's bytes written out by the channel. The time
+  // since kChannelWrite was spent queued behind other messages.
+  kChannelWriteDone,
+
+  // Read off the channel by the receiving process's I/O thread.
+  kChannelRead,
+
+  // Passed to the receiving node for delivery to its port.
+  kAcceptMessage,
+
+  // Read from the receiving message pipe.
+  kReadMessage,
+};
+
+struct MessageTraceEvent {
+  // The same for every event of a message, including those recorded by other
+  // processes.
+  uint32_t trace_id;
+  MessageTracePoint point;
+
+  // The platform ID of the thread which recorded the event.
+  uint64_t thread_id;
+
+  // base::TimeTicks, in microseconds.
+  int64_t time_us;
+};
+
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_EMBEDDER_MESSAGE_TRACE_H_
@@ -0,0 +1,92 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_EMBEDDER_METRICS_H_
+#define MOJO_EDK_EMBEDDER_METRICS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+namespace mojo {
+namespace edk {
+
+// The number of buckets in each histogram below. Bucket 0 counts values below
+// 64, bucket i values in [2^(i+5), 2^(i+6)), and the last bucket everything
+// from 1 MB up.
+const size_t kMetricsHistogramBuckets = 16;
+
+// Traffic over the channel to one peer node, for finding the busiest ones.
+// Counted as for the channel totals in Metrics, but only since the channel
+// was connected.
+struct PeerMetrics {
+  // The peer's node name, as it appears in logs.
+  uint64_t node_name_v1;
+  uint64_t node_name_v2;
+
+  uint64_t messages_written;
+  uint64_t bytes_written;
+  uint64_t handles_written;
+  uint64_t messages_read;
+  uint64_t bytes_read;
+  uint64_t handles_read;
+};
+
+// A snapshot of the system's state and of its activity since startup, as
+// returned by GetMetrics(). Counters are totals over the whole process, except
+// for those in |peers|.
+struct Metrics {
+  // Ports on this node. Proxies are ports which have been sent to another
+  // node and are waiting to be removed; a count that keeps growing suggests
+  // a leak. Buffering ports have been sent but not yet accepted.
+  uint64_t num_ports;
+  uint64_t num_receiving_ports;
+  uint64_t num_proxies;
+  uint64_t num_buffering_ports;
+
+  // Unread messages and bytes over all receiving ports, and the length of the
+  // longest single queue.
+  uint64_t num_queued_messages;
+  uint64_t num_queued_bytes;
+  uint64_t max_queued_messages;
+
+  // Nodes we are connected to, and messages waiting for an introduction to a
+  // node we are not yet connected to.
+  uint64_t num_peers;
+  uint64_t num_pending_peer_messages;
+  uint64_t num_peers_dropped;
+  uint64_t num_peer_messages_dropped;
+
+  // Traffic over all channels to other processes, with a histogram of the
+  // sizes of messages written. Compressed and compacted messages are counted
+  // at their reduced size, and messages written in frames as a whole.
+  uint64_t channel_messages_written;
+  uint64_t channel_bytes_written;
+  uint64_t channel_handles_written;
+  uint64_t channel_messages_read;
+  uint64_t channel_bytes_read;
+  uint64_t channel_handles_read;
+  uint64_t channel_messages_compressed;
+  uint64_t channel_messages_fragmented;
+  uint64_t channel_messages_compacted;
+  uint64_t channel_message_sizes[kMetricsHistogramBuckets];
+
+  // Traffic through message pipe and data pipe handles.
+  uint64_t message_pipe_messages_written;
+  uint64_t message_pipe_bytes_written;
+  uint64_t message_pipe_handles_written;
+  uint64_t message_pipe_messages_read;
+  uint64_t message_pipe_bytes_read;
+  uint64_t data_pipe_bytes_written;
+  uint64_t data_pipe_bytes_read;
+
+  // Traffic to each peer node we are currently connected to.
+  std::vector<PeerMetrics> peers;
+};
+
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_EMBEDDER_METRICS_H_
@@ -0,0 +1,37 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/embedder/received_message.h"
+
+#include <utility>
+
+#include "mojo/edk/system/message_for_transit.h"
+
+namespace mojo {
+namespace edk {
+
+ReceivedMessage::ReceivedMessage() {}
+
+ReceivedMessage::ReceivedMessage(ReceivedMessage&& other)
+    : message_(std::move(other.message_)),
+      handles_(std::move(other.handles_)) {}
+
+ReceivedMessage::~ReceivedMessage() {}
+
+ReceivedMessage& ReceivedMessage::operator=(ReceivedMessage&& other) {
+  message_ = std::move(other.message_);
+  handles_ = std::move(other.handles_);
+  return *this;
+}
+
+const void* ReceivedMessage::bytes() const {
+  return message_->bytes();
+}
+
+uint32_t ReceivedMessage::num_bytes() const {
+  return message_->num_bytes();
+}
+
+}  // namespace edk
+}  // namespace mojo
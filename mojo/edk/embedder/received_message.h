@@ -0,0 +1,69 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_EMBEDDER_RECEIVED_MESSAGE_H_
+#define MOJO_EDK_EMBEDDER_RECEIVED_MESSAGE_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "base/callback.h"
+#include "base/macros.h"
+#include "base/memory/scoped_ptr.h"
+#include "mojo/edk/system/system_impl_export.h"
+#include "mojo/public/c/system/types.h"
+
+namespace mojo {
+namespace edk {
+
+class MessagePipeBinding;
+class MessageForTransit;
+
+// A message read from a message pipe bound with BindMessagePipe(), or by
+// ReadMessageAsync(). It owns the received buffer, which is never copied. The
+// handles it carries have already been added to the handle table and belong to
+// whoever handles the message; they aren't closed along with it.
+class MOJO_SYSTEM_IMPL_EXPORT ReceivedMessage {
+ public:
+  ReceivedMessage();
+  ReceivedMessage(ReceivedMessage&& other);
+  ~ReceivedMessage();
+
+  ReceivedMessage& operator=(ReceivedMessage&& other);
+
+  const void* bytes() const;
+  uint32_t num_bytes() const;
+  const std::vector<MojoHandle>& handles() const { return handles_; }
+
+ private:
+  friend class MessagePipeBinding;
+
+  scoped_ptr<MessageForTransit> message_;
+  std::vector<MojoHandle> handles_;
+
+  DISALLOW_COPY_AND_ASSIGN(ReceivedMessage);
+};
+
+// Called with MOJO_RESULT_OK and a batch of messages, in the order they were
+// received, each time a bound pipe has some to read. The handler may move
+// messages out of the batch to keep them. It's called once more with an empty
+// batch when the binding ends, with MOJO_RESULT_FAILED_PRECONDITION once the
+// peer is closed and every message has been read, or MOJO_RESULT_CANCELLED if
+// the handle is closed.
+using MessageBatchHandler =
+    base::Callback<void(MojoResult result,
+                        std::vector<ReceivedMessage>* messages)>;
+
+// Called once by ReadMessageAsync(): with MOJO_RESULT_OK and the next message
+// read from the pipe, which the callback may move out to keep, or otherwise
+// with an empty message and the reason none will be read, as for
+// MessageBatchHandler.
+using ReadMessageCallback =
+    base::Callback<void(MojoResult result, ReceivedMessage* message)>;
+
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_EMBEDDER_RECEIVED_MESSAGE_H_
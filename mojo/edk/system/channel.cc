@@ -8,9 +8,15 @@
 
 #include <algorithm>
 #include <limits>
+#include <new>
 
 #include "base/macros.h"
-#include "base/memory/aligned_memory.h"
+#include "mojo/edk/system/memory_allocation.h"
+#include "mojo/edk/system/memory_placement.h"
+#include "mojo/edk/system/message_pool.h"
+#include "mojo/edk/system/message_tracer.h"
+#include "mojo/edk/system/metrics_registry.h"
+#include "third_party/zlib/zlib.h"
 
 namespace mojo {
 namespace edk {
@@ -20,32 +26,148 @@ namespace {
 static_assert(sizeof(Channel::Message::Header) % kChannelMessageAlignment == 0,
     "Invalid Header size.");
 
+bool g_queued_writes_enabled = false;
+bool g_shared_memory_enabled = false;
+size_t g_compression_threshold = 0;
+uint64_t g_busy_poll_time = 0;
+uint32_t g_read_buffer_placement = MEMORY_PLACEMENT_DEFAULT;
+bool g_io_uring_enabled = false;
+
+// The payload of a message with Message::kFlagCompressed set is one of these
+// followed by the original payload, compressed with zlib.
+struct CompressedPayloadHeader {
+  uint32_t uncompressed_size;
+  uint32_t padding;
+};
+
+// The payload of a message with Message::kFlagFragment set is one of these
+// followed by the next bytes of the fragmented message, header included.
+// Frames of a message are written in order, and the first carries all of its
+// handles.
+struct FragmentHeader {
+  // Identifies the message among those the writing Channel is currently
+  // writing in frames.
+  uint32_t message_id;
+
+  // The size of the whole message, including its header.
+  uint32_t message_num_bytes;
+
+  // Where in the message this frame's bytes go.
+  uint32_t offset;
+  uint32_t padding;
+};
+
+static_assert(sizeof(FragmentHeader) % kChannelMessageAlignment == 0,
+              "Invalid FragmentHeader size.");
+
+// Adds to a counter which only one thread writes, without the cost of an
+// atomic read-modify-write.
+void AddUnshared(std::atomic<uint64_t>* counter, uint64_t amount) {
+  counter->store(counter->load(std::memory_order_relaxed) + amount,
+                 std::memory_order_relaxed);
+}
+
 }  // namespace
 
 const size_t kReadBufferSize = 4096;
 const size_t kMaxUnusedReadBufferCapacity = 256 * 1024;
+
+// Every this many times the ReadBuffer empties out, its size is compared with
+// the most it has held since the last check, and it's shrunk if it's much
+// larger than needed.
+const size_t kReadBufferShrinkInterval = 64;
+
+// Placement hints only apply to read buffers at least this large. That covers
+// a whole huge page, and buffers this size get a mapping of their own from the
+// allocator rather than sharing pages with other allocations.
+const size_t kMinPlacedReadBufferSize = 2 * 1024 * 1024;
 const size_t kMaxChannelMessageSize = 256 * 1024 * 1024;
 
-Channel::Message::Message(size_t payload_size,
+// Messages at least this large which don't arrive in a single read are read
+// directly into a buffer of their own, which is then handed to the delegate.
+// This avoids both growing the shared read buffer and copying the message out
+// of it again.
+const size_t kMinOwnedMessageSize = 32 * 1024;
+
+// Messages larger than this are written in frames of at most this size, so
+// that at worst a message waits for one frame of a large message, rather than
+// all of it, before it is written. See FragmentMessageNoLock().
+const size_t kMaxFrameSize = 256 * 1024;
+const size_t kMaxFrameDataSize =
+    kMaxFrameSize - sizeof(Channel::Message::Header) - sizeof(FragmentHeader);
+
+// The most messages each end of a Channel writes in frames at once. This
+// bounds how much memory the other end spends reassembling them.
+const size_t kMaxFragmentedMessages = 4;
+
+namespace {
+
+// Returns the original of a compressed message with the given payload, with
+// |handles| attached, or null if the payload is invalid.
+Channel::MessagePtr DecompressMessage(const void* payload,
+                                      size_t payload_size,
+                                      ScopedPlatformHandleVectorPtr handles) {
+  if (payload_size < sizeof(CompressedPayloadHeader))
+    return nullptr;
+  const CompressedPayloadHeader* payload_header =
+      static_cast<const CompressedPayloadHeader*>(payload);
+  if (payload_header->uncompressed_size >
+      kMaxChannelMessageSize - sizeof(Channel::Message::Header)) {
+    return nullptr;
+  }
+
+  Channel::MessagePtr message = Channel::Message::Create(
+      payload_header->uncompressed_size, std::move(handles));
+  uLongf uncompressed_size = payload_header->uncompressed_size;
+  if (uncompress(static_cast<Bytef*>(message->mutable_payload()),
+                 &uncompressed_size,
+                 reinterpret_cast<const Bytef*>(payload_header + 1),
+                 payload_size - sizeof(CompressedPayloadHeader)) != Z_OK ||
+      uncompressed_size != payload_header->uncompressed_size) {
+    return nullptr;
+  }
+  return message;
+}
+
+}  // namespace
+
+// static
+Channel::MessagePtr Channel::Message::Create(
+    size_t payload_size,
+    ScopedPlatformHandleVectorPtr handles) {
+  const size_t kMessageObjectSize =
+      (sizeof(Message) + kChannelMessageAlignment - 1) &
+      ~(kChannelMessageAlignment - 1);
+  size_t size = payload_size + sizeof(Header);
+  void* block = MessagePool::Allocate(kMessageObjectSize + size);
+  char* data = static_cast<char*>(block) + kMessageObjectSize;
+  return MessagePtr(new (block) Message(data, size, std::move(handles)));
+}
+
+Channel::Message::Message(char* data,
+                          size_t size,
                           ScopedPlatformHandleVectorPtr handles)
-    : handles_(std::move(handles)) {
-  size_ = payload_size + sizeof(Header);
-  data_ = static_cast<char*>(base::AlignedAlloc(size_,
-                                                kChannelMessageAlignment));
+    : data_(data), size_(size), handles_(std::move(handles)) {
   Header* header = reinterpret_cast<Header*>(data_);
 
-  DCHECK_LE(payload_size, std::numeric_limits<uint32_t>::max());
+  DCHECK_LE(size_, std::numeric_limits<uint32_t>::max());
   header->num_bytes = static_cast<uint32_t>(size_);
 
   size_t num_handles = handles_ ? handles_->size() : 0;
   DCHECK_LE(num_handles, std::numeric_limits<uint16_t>::max());
   header->num_handles = static_cast<uint16_t>(num_handles);
 
-  header->padding = 0;
+  header->flags = 0;
 }
 
 Channel::Message::~Message() {
-  base::AlignedFree(data_);
+  // |data_| lives in the same block as this object and is freed along with it
+  // by operator delete.
+}
+
+// static
+void Channel::Message::operator delete(void* ptr) {
+  MessagePool::Free(ptr);
 }
 
 void Channel::Message::SetHandles(ScopedPlatformHandleVectorPtr handles) {
@@ -55,6 +177,12 @@ void Channel::Message::SetHandles(ScopedPlatformHandleVectorPtr handles) {
   std::swap(handles, handles_);
 }
 
+void Channel::Message::TruncatePayload(size_t payload_size) {
+  DCHECK_LE(payload_size, this->payload_size());
+  size_ = payload_size + sizeof(Header);
+  header()->num_bytes = static_cast<uint32_t>(size_);
+}
+
 // Helper class for managing a Channel's read buffer allocations. This maintains
 // a single contiguous buffer with the layout:
 //
@@ -77,13 +205,12 @@ class Channel::ReadBuffer {
  public:
   ReadBuffer() {
     size_ = kReadBufferSize;
-    data_ = static_cast<char*>(base::AlignedAlloc(size_,
-                                                  kChannelMessageAlignment));
+    data_ = Allocate(size_);
   }
 
   ~ReadBuffer() {
     DCHECK(data_);
-    base::AlignedFree(data_);
+    Free(data_);
   }
 
   const char* occupied_bytes() const { return data_ + num_discarded_bytes_; }
@@ -97,10 +224,10 @@ class Channel::ReadBuffer {
   char* Reserve(size_t num_bytes) {
     if (num_occupied_bytes_ + num_bytes > size_) {
       size_ = std::max(size_ * 2, num_occupied_bytes_ + num_bytes);
-      void* new_data = base::AlignedAlloc(size_, kChannelMessageAlignment);
+      char* new_data = Allocate(size_);
       memcpy(new_data, data_, num_occupied_bytes_);
-      base::AlignedFree(data_);
-      data_ = static_cast<char*>(new_data);
+      Free(data_);
+      data_ = new_data;
     }
 
     return data_ + num_occupied_bytes_;
@@ -110,6 +237,7 @@ class Channel::ReadBuffer {
   void Claim(size_t num_bytes) {
     DCHECK_LE(num_occupied_bytes_ + num_bytes, size_);
     num_occupied_bytes_ += num_bytes;
+    peak_occupied_bytes_ = std::max(peak_occupied_bytes_, num_occupied_bytes_);
   }
 
   // Marks the first |num_bytes| occupied bytes as discarded. This may result in
@@ -123,6 +251,9 @@ class Channel::ReadBuffer {
       // We can just reuse the buffer from the beginning in this common case.
       num_discarded_bytes_ = 0;
       num_occupied_bytes_ = 0;
+      if (++num_empty_discards_ == kReadBufferShrinkInterval)
+        MaybeShrink();
+      return;
     }
 
     if (num_discarded_bytes_ > kMaxUnusedReadBufferCapacity) {
@@ -130,20 +261,48 @@ class Channel::ReadBuffer {
       // front of the buffer, simply move remaining data to a smaller buffer.
       size_t num_preserved_bytes = num_occupied_bytes_ - num_discarded_bytes_;
       size_ = std::max(num_preserved_bytes, kReadBufferSize);
-      char* new_data = static_cast<char*>(
-          base::AlignedAlloc(size_, kChannelMessageAlignment));
+      char* new_data = Allocate(size_);
       memcpy(new_data, data_ + num_discarded_bytes_, num_preserved_bytes);
-      base::AlignedFree(data_);
+      Free(data_);
       data_ = new_data;
       num_discarded_bytes_ = 0;
       num_occupied_bytes_ = num_preserved_bytes;
     }
-
-    // TODO: we should also adaptively shrink the buffer in case of the
-    // occasional abnormally large read.
   }
 
  private:
+  // Allocates |size| bytes, applying any placement hints set with
+  // SetReadBufferPlacement() to large enough buffers.
+  static char* Allocate(size_t size) {
+    char* data = static_cast<char*>(
+        AllocateMemory(MemoryAllocator::Usage::kReadBuffer, size,
+                       kChannelMessageAlignment));
+    if (g_read_buffer_placement != MEMORY_PLACEMENT_DEFAULT &&
+        size >= kMinPlacedReadBufferSize) {
+      ApplyMemoryPlacement(data, size, g_read_buffer_placement);
+    }
+    return data;
+  }
+
+  static void Free(char* data) {
+    FreeMemory(MemoryAllocator::Usage::kReadBuffer, data);
+  }
+
+  // Called periodically while the buffer is empty. If the buffer grew for an
+  // occasional abnormally large read, shrinks it back to what recent reads
+  // actually needed, so that idle Channels don't hold on to the memory.
+  void MaybeShrink() {
+    DCHECK_EQ(0u, num_occupied_bytes_);
+    size_t new_size = std::max(peak_occupied_bytes_, kReadBufferSize);
+    if (new_size * 2 <= size_) {
+      Free(data_);
+      size_ = new_size;
+      data_ = Allocate(size_);
+    }
+    peak_occupied_bytes_ = 0;
+    num_empty_discards_ = 0;
+  }
+
   char* data_ = nullptr;
 
   // The total size of the allocated buffer.
@@ -155,11 +314,87 @@ class Channel::ReadBuffer {
   // The total number of occupied bytes, including discarded bytes.
   size_t num_occupied_bytes_ = 0;
 
+  // The largest |num_occupied_bytes_| since the last MaybeShrink(), and the
+  // number of times the buffer has emptied out since then.
+  size_t peak_occupied_bytes_ = 0;
+  size_t num_empty_discards_ = 0;
+
   DISALLOW_COPY_AND_ASSIGN(ReadBuffer);
 };
 
+// static
+void Channel::SetQueuedWritesEnabled(bool enabled) {
+  g_queued_writes_enabled = enabled;
+}
+
+// static
+bool Channel::AreQueuedWritesEnabled() {
+  return g_queued_writes_enabled;
+}
+
+// static
+void Channel::SetSharedMemoryEnabled(bool enabled) {
+  g_shared_memory_enabled = enabled;
+}
+
+// static
+bool Channel::IsSharedMemoryEnabled() {
+  return g_shared_memory_enabled;
+}
+
+// static
+void Channel::SetCompressionThreshold(size_t num_bytes) {
+  g_compression_threshold = num_bytes;
+}
+
+// static
+size_t Channel::GetCompressionThreshold() {
+  return g_compression_threshold;
+}
+
+// static
+void Channel::SetBusyPollTime(uint64_t microseconds) {
+  g_busy_poll_time = microseconds;
+}
+
+// static
+uint64_t Channel::GetBusyPollTime() {
+  return g_busy_poll_time;
+}
+
+// static
+void Channel::SetReadBufferPlacement(uint32_t placement) {
+  g_read_buffer_placement = placement;
+}
+
+// static
+uint32_t Channel::GetReadBufferPlacement() {
+  return g_read_buffer_placement;
+}
+
+// static
+void Channel::SetIoUringEnabled(bool enabled) {
+  g_io_uring_enabled = enabled;
+}
+
+// static
+bool Channel::IsIoUringEnabled() {
+  return g_io_uring_enabled;
+}
+
+// static
+scoped_refptr<Channel> Channel::Create(
+    Delegate* delegate,
+    ScopedPlatformHandle platform_handle,
+    scoped_refptr<base::TaskRunner> io_task_runner) {
+  return Create(delegate, std::move(platform_handle),
+                Transport::PLATFORM_HANDLE, io_task_runner);
+}
+
 Channel::Channel(Delegate* delegate)
-    : delegate_(delegate), read_buffer_(new ReadBuffer) {
+    : delegate_(delegate),
+      read_buffer_(new ReadBuffer),
+      compression_threshold_(0) {
 }
 
 Channel::~Channel() {
@@ -170,7 +405,21 @@ void Channel::ShutDown() {
   ShutDownImpl();
 }
 
+void Channel::EnableCompression() {
+  compression_threshold_.store(g_compression_threshold,
+                               std::memory_order_relaxed);
+}
+
 char* Channel::GetReadBuffer(size_t *buffer_capacity) {
+  if (incoming_message_ &&
+      num_incoming_message_bytes_ < incoming_message_->data_num_bytes()) {
+    // Read the rest of the message straight into its own buffer.
+    *buffer_capacity =
+        incoming_message_->data_num_bytes() - num_incoming_message_bytes_;
+    return static_cast<char*>(incoming_message_->mutable_data()) +
+        num_incoming_message_bytes_;
+  }
+
   DCHECK(read_buffer_);
   size_t required_capacity = *buffer_capacity;
   if (!required_capacity)
@@ -182,7 +431,37 @@ char* Channel::GetReadBuffer(size_t *buffer_capacity) {
 
 bool Channel::OnReadComplete(size_t bytes_read, size_t *next_read_size_hint) {
   bool did_dispatch_message = false;
-  read_buffer_->Claim(bytes_read);
+  bool has_partial_message = false;
+
+  if (incoming_message_) {
+    const size_t message_size = incoming_message_->data_num_bytes();
+    if (num_incoming_message_bytes_ < message_size) {
+      // These bytes were read into |incoming_message_| (see GetReadBuffer).
+      DCHECK_LE(bytes_read, message_size - num_incoming_message_bytes_);
+      num_incoming_message_bytes_ += bytes_read;
+      if (num_incoming_message_bytes_ < message_size) {
+        *next_read_size_hint = message_size - num_incoming_message_bytes_;
+        return true;
+      }
+      bytes_read = 0;
+    }
+
+    read_buffer_->Claim(bytes_read);
+    bool error = false;
+    if (!DispatchIncomingMessage(&error)) {
+      if (error)
+        return false;
+
+      // Not enough handles available for this message yet. Anything read
+      // since must wait behind it.
+      *next_read_size_hint = kReadBufferSize;
+      return true;
+    }
+    did_dispatch_message = true;
+  } else {
+    read_buffer_->Claim(bytes_read);
+  }
+
   while (read_buffer_->num_occupied_bytes() >= sizeof(Message::Header)) {
     // We have at least enough data available for a MessageHeader.
     const Message::Header* header = reinterpret_cast<const Message::Header*>(
@@ -196,9 +475,23 @@ bool Channel::OnReadComplete(size_t bytes_read, size_t *next_read_size_hint) {
     if (read_buffer_->num_occupied_bytes() < header->num_bytes) {
       // Not enough data available to read the full message. Hint to the
       // implementation that it should try reading the full size of the message.
-      *next_read_size_hint =
-          header->num_bytes - read_buffer_->num_occupied_bytes();
-      return true;
+      const size_t num_bytes_available = read_buffer_->num_occupied_bytes();
+      *next_read_size_hint = header->num_bytes - num_bytes_available;
+
+      if (header->num_bytes >= kMinOwnedMessageSize) {
+        // Move what we have of the message into a buffer of its own. The
+        // header is copied verbatim, so the message's handle count is kept
+        // until the handles themselves are attached.
+        incoming_message_ = Message::Create(
+            header->num_bytes - sizeof(Message::Header), nullptr);
+        memcpy(incoming_message_->mutable_data(),
+               read_buffer_->occupied_bytes(), num_bytes_available);
+        num_incoming_message_bytes_ = num_bytes_available;
+        read_buffer_->Discard(num_bytes_available);
+      }
+
+      has_partial_message = true;
+      break;
     }
 
     ScopedPlatformHandleVectorPtr handles;
@@ -213,7 +506,27 @@ bool Channel::OnReadComplete(size_t bytes_read, size_t *next_read_size_hint) {
     // We've got a complete message! Dispatch it and try another.
     const size_t payload_size = header->num_bytes - sizeof(Message::Header);
     const void* payload = payload_size ? &header[1] : nullptr;
-    if (delegate_) {
+    if (header->flags & Message::kFlagFragment) {
+      bool dispatched = false;
+      if (!OnFrameRead(payload, payload_size, std::move(handles),
+                       &dispatched)) {
+        return false;
+      }
+      did_dispatch_message |= dispatched;
+      read_buffer_->Discard(header->num_bytes);
+      continue;
+    }
+
+    RecordMessageRead(header->num_bytes, header->num_handles);
+    ++num_messages_read_;
+    if (header->flags & Message::kFlagCompressed) {
+      if (!DispatchOwnedMessage(DecompressMessage(payload, payload_size,
+                                                  std::move(handles)))) {
+        return false;
+      }
+      if (delegate_)
+        did_dispatch_message = true;
+    } else if (delegate_) {
       delegate_->OnChannelMessage(payload, payload_size, std::move(handles));
       did_dispatch_message = true;
     }
@@ -221,7 +534,135 @@ bool Channel::OnReadComplete(size_t bytes_read, size_t *next_read_size_hint) {
     read_buffer_->Discard(header->num_bytes);
   }
 
-  *next_read_size_hint = did_dispatch_message ? 0 : kReadBufferSize;
+  if (did_dispatch_message && delegate_)
+    delegate_->OnChannelReadComplete();
+
+  if (!has_partial_message)
+    *next_read_size_hint = did_dispatch_message ? 0 : kReadBufferSize;
+  return true;
+}
+
+bool Channel::DispatchIncomingMessage(bool* error) {
+  DCHECK(incoming_message_);
+  DCHECK_EQ(num_incoming_message_bytes_, incoming_message_->data_num_bytes());
+
+  ScopedPlatformHandleVectorPtr handles;
+  if (incoming_message_->num_handles() > 0) {
+    handles = GetReadPlatformHandles(incoming_message_->num_handles());
+    if (!handles)
+      return false;
+  }
+  incoming_message_->SetHandles(std::move(handles));
+
+  MessagePtr message = std::move(incoming_message_);
+  num_incoming_message_bytes_ = 0;
+  if (message->flags() & Message::kFlagFragment) {
+    bool dispatched;
+    if (!OnFrameRead(message->payload(), message->payload_size(),
+                     message->TakeHandles(), &dispatched)) {
+      *error = true;
+      return false;
+    }
+    return true;
+  }
+
+  RecordMessageRead(message->data_num_bytes(), message->num_handles());
+  ++num_messages_read_;
+  if (!DispatchOwnedMessage(std::move(message))) {
+    *error = true;
+    return false;
+  }
+  return true;
+}
+
+bool Channel::DispatchOwnedMessage(MessagePtr message) {
+  if (message && (message->flags() & Message::kFlagCompressed)) {
+    message = DecompressMessage(message->payload(), message->payload_size(),
+                                message->TakeHandles());
+  }
+  if (!message) {
+    LOG(ERROR) << "Invalid compressed message.";
+    return false;
+  }
+  if (delegate_)
+    delegate_->OnOwnedChannelMessage(std::move(message));
+  return true;
+}
+
+bool Channel::OnFrameRead(const void* payload,
+                          size_t payload_size,
+                          ScopedPlatformHandleVectorPtr handles,
+                          bool* dispatched) {
+  *dispatched = false;
+  if (payload_size <= sizeof(FragmentHeader)) {
+    LOG(ERROR) << "Invalid frame size.";
+    return false;
+  }
+  const FragmentHeader* fragment_header =
+      static_cast<const FragmentHeader*>(payload);
+  const size_t num_data_bytes = payload_size - sizeof(FragmentHeader);
+  const size_t message_num_bytes = fragment_header->message_num_bytes;
+  if (message_num_bytes < sizeof(Message::Header) ||
+      message_num_bytes > kMaxChannelMessageSize ||
+      num_data_bytes > message_num_bytes ||
+      fragment_header->offset > message_num_bytes - num_data_bytes) {
+    LOG(ERROR) << "Invalid frame.";
+    return false;
+  }
+
+  auto it = incoming_fragmented_messages_.find(fragment_header->message_id);
+  if (fragment_header->offset == 0) {
+    if (it != incoming_fragmented_messages_.end() ||
+        incoming_fragmented_messages_.size() == kMaxFragmentedMessages) {
+      LOG(ERROR) << "Unexpected first frame.";
+      return false;
+    }
+    IncomingFragmentedMessage fragmented_message;
+    fragmented_message.message = Message::Create(
+        message_num_bytes - sizeof(Message::Header), nullptr);
+    fragmented_message.num_bytes_received = 0;
+    fragmented_message.handles = std::move(handles);
+    it = incoming_fragmented_messages_
+             .insert(std::make_pair(fragment_header->message_id,
+                                    std::move(fragmented_message)))
+             .first;
+  } else if (it == incoming_fragmented_messages_.end() ||
+             it->second.num_bytes_received != fragment_header->offset ||
+             it->second.message->data_num_bytes() != message_num_bytes ||
+             (handles && !handles->empty())) {
+    LOG(ERROR) << "Unexpected frame.";
+    return false;
+  }
+
+  IncomingFragmentedMessage& fragmented_message = it->second;
+  memcpy(static_cast<char*>(fragmented_message.message->mutable_data()) +
+             fragment_header->offset,
+         fragment_header + 1, num_data_bytes);
+  fragmented_message.num_bytes_received += num_data_bytes;
+  if (fragmented_message.num_bytes_received < message_num_bytes)
+    return true;
+
+  // The message's own header has been copied over the one it was created
+  // with, so check it against what actually arrived.
+  MessagePtr message = std::move(fragmented_message.message);
+  handles = std::move(fragmented_message.handles);
+  incoming_fragmented_messages_.erase(it);
+  const Message::Header* header =
+      static_cast<const Message::Header*>(message->data());
+  size_t num_handles = handles ? handles->size() : 0;
+  if (header->num_bytes != message_num_bytes ||
+      header->num_handles != num_handles ||
+      (header->flags & Message::kFlagFragment)) {
+    LOG(ERROR) << "Invalid fragmented message.";
+    return false;
+  }
+  message->SetHandles(std::move(handles));
+
+  RecordMessageRead(message->data_num_bytes(), message->num_handles());
+  ++num_messages_read_;
+  if (!DispatchOwnedMessage(std::move(message)))
+    return false;
+  *dispatched = delegate_ != nullptr;
   return true;
 }
 
@@ -230,5 +671,156 @@ void Channel::OnError() {
     delegate_->OnChannelError();
 }
 
+Channel::MessagePtr Channel::MaybeCompressMessage(MessagePtr message) {
+  const size_t threshold =
+      compression_threshold_.load(std::memory_order_relaxed);
+  const size_t payload_size = message->payload_size();
+  if (!threshold || payload_size < threshold)
+    return message;
+
+  uLongf compressed_size = compressBound(static_cast<uLong>(payload_size));
+  MessagePtr compressed = Message::Create(
+      sizeof(CompressedPayloadHeader) + compressed_size, nullptr);
+  CompressedPayloadHeader* payload_header =
+      static_cast<CompressedPayloadHeader*>(compressed->mutable_payload());
+  payload_header->uncompressed_size = static_cast<uint32_t>(payload_size);
+  payload_header->padding = 0;
+  if (compress2(reinterpret_cast<Bytef*>(payload_header + 1),
+                &compressed_size,
+                static_cast<const Bytef*>(message->payload()),
+                static_cast<uLong>(payload_size), Z_BEST_SPEED) != Z_OK) {
+    return message;
+  }
+
+  // Don't make the other end decompress for a small saving.
+  compressed_size += sizeof(CompressedPayloadHeader);
+  if (compressed_size > payload_size - payload_size / 8)
+    return message;
+
+  compressed->TruncatePayload(compressed_size);
+  compressed->set_flags(Message::kFlagCompressed);
+  compressed->SetHandles(message->TakeHandles());
+  compressed->set_trace_id(message->trace_id());
+  compressed->set_priority(message->priority());
+  MetricsRegistry::Increment(MetricsRegistry::kChannelMessagesCompressed);
+  return compressed;
+}
+
+Channel::MessagePtr Channel::FragmentMessageNoLock(MessagePtr message) {
+  if (message->data_num_bytes() <= kMaxFrameSize)
+    return message;
+  MetricsRegistry::Increment(MetricsRegistry::kChannelMessagesFragmented);
+  if (outgoing_fragmented_messages_.size() == kMaxFragmentedMessages) {
+    waiting_fragmented_messages_.push_back(std::move(message));
+    return nullptr;
+  }
+  return StartFragmentedMessageNoLock(std::move(message));
+}
+
+Channel::MessagePtr Channel::TakeNextFrameNoLock(const Message& message) {
+  if (!(message.flags() & Message::kFlagFragment))
+    return nullptr;
+
+  const uint32_t id =
+      static_cast<const FragmentHeader*>(message.payload())->message_id;
+  auto it = std::find_if(
+      outgoing_fragmented_messages_.begin(),
+      outgoing_fragmented_messages_.end(),
+      [id](const OutgoingFragmentedMessage& m) { return m.id == id; });
+  DCHECK(it != outgoing_fragmented_messages_.end());
+  if (it->num_bytes_sent < it->message->data_num_bytes())
+    return TakeFrameNoLock(&*it);
+
+  outgoing_fragmented_messages_.erase(it);
+  if (waiting_fragmented_messages_.empty())
+    return nullptr;
+  MessagePtr next = std::move(waiting_fragmented_messages_.front());
+  waiting_fragmented_messages_.pop_front();
+  return StartFragmentedMessageNoLock(std::move(next));
+}
+
+Channel::MessagePtr Channel::StartFragmentedMessageNoLock(MessagePtr message) {
+  DCHECK_LT(outgoing_fragmented_messages_.size(), kMaxFragmentedMessages);
+  OutgoingFragmentedMessage fragmented_message;
+  fragmented_message.id = next_fragmented_message_id_++;
+  fragmented_message.message = std::move(message);
+  fragmented_message.num_bytes_sent = 0;
+  outgoing_fragmented_messages_.push_back(std::move(fragmented_message));
+  return TakeFrameNoLock(&outgoing_fragmented_messages_.back());
+}
+
+Channel::MessagePtr Channel::TakeFrameNoLock(
+    OutgoingFragmentedMessage* fragmented_message) {
+  Message* message = fragmented_message->message.get();
+  const size_t offset = fragmented_message->num_bytes_sent;
+  const size_t num_data_bytes =
+      std::min(kMaxFrameDataSize, message->data_num_bytes() - offset);
+
+  // The first frame carries all of the message's handles.
+  MessagePtr frame = Message::Create(
+      sizeof(FragmentHeader) + num_data_bytes,
+      offset == 0 ? message->TakeHandles() : nullptr);
+  FragmentHeader* fragment_header =
+      static_cast<FragmentHeader*>(frame->mutable_payload());
+  fragment_header->message_id = fragmented_message->id;
+  fragment_header->message_num_bytes =
+      static_cast<uint32_t>(message->data_num_bytes());
+  fragment_header->offset = static_cast<uint32_t>(offset);
+  fragment_header->padding = 0;
+  memcpy(fragment_header + 1,
+         static_cast<const char*>(message->data()) + offset, num_data_bytes);
+  frame->set_flags(Message::kFlagFragment);
+  frame->set_priority(message->priority());
+
+  fragmented_message->num_bytes_sent += num_data_bytes;
+  if (fragmented_message->num_bytes_sent == message->data_num_bytes()) {
+    // The message's trace event is recorded when its last frame is written.
+    frame->set_trace_id(message->trace_id());
+  }
+  return frame;
+}
+
+void Channel::GetStats(Stats* stats) const {
+  stats->messages_written = messages_written_.load(std::memory_order_relaxed);
+  stats->bytes_written = bytes_written_.load(std::memory_order_relaxed);
+  stats->handles_written = handles_written_.load(std::memory_order_relaxed);
+  stats->messages_read = messages_read_.load(std::memory_order_relaxed);
+  stats->bytes_read = bytes_read_.load(std::memory_order_relaxed);
+  stats->handles_read = handles_read_.load(std::memory_order_relaxed);
+}
+
+void Channel::RecordMessageWritten(const Message& message) {
+  MessageTracer::Record(message.trace_id(), MessageTracePoint::kChannelWrite);
+  MetricsRegistry::Increment(MetricsRegistry::kChannelMessagesWritten);
+  MetricsRegistry::Add(MetricsRegistry::kChannelBytesWritten,
+                       message.data_num_bytes());
+  if (message.num_handles()) {
+    MetricsRegistry::Add(MetricsRegistry::kChannelHandlesWritten,
+                         message.num_handles());
+  }
+  MetricsRegistry::AddSample(MetricsRegistry::kChannelMessageSize,
+                             message.data_num_bytes());
+
+  messages_written_.fetch_add(1, std::memory_order_relaxed);
+  bytes_written_.fetch_add(message.data_num_bytes(),
+                           std::memory_order_relaxed);
+  if (message.num_handles()) {
+    handles_written_.fetch_add(message.num_handles(),
+                               std::memory_order_relaxed);
+  }
+}
+
+void Channel::RecordMessageRead(size_t num_bytes, size_t num_handles) {
+  MetricsRegistry::Increment(MetricsRegistry::kChannelMessagesRead);
+  MetricsRegistry::Add(MetricsRegistry::kChannelBytesRead, num_bytes);
+  if (num_handles)
+    MetricsRegistry::Add(MetricsRegistry::kChannelHandlesRead, num_handles);
+
+  AddUnshared(&messages_read_, 1);
+  AddUnshared(&bytes_read_, num_bytes);
+  if (num_handles)
+    AddUnshared(&handles_read_, num_handles);
+}
+
 }  // namespace edk
 }  // namespace mojo
@@ -5,9 +5,17 @@
 #ifndef MOJO_EDK_SYSTEM_CHANNEL_H_
 #define MOJO_EDK_SYSTEM_CHANNEL_H_
 
+#include <stdint.h>
+
+#include <atomic>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
 #include "base/logging.h"
 #include "base/macros.h"
 #include "base/memory/ref_counted.h"
+#include "base/memory/scoped_ptr.h"
 #include "base/task_runner.h"
 #include "mojo/edk/embedder/platform_handle_vector.h"
 #include "mojo/edk/embedder/scoped_platform_handle.h"
@@ -17,6 +25,8 @@ namespace edk {
 
 const size_t kChannelMessageAlignment = 8;
 
+class ChannelWriteQueue;
+
 // Channel provides a thread-safe interface to read and write arbitrary
 // delimited messages over an underlying I/O channel, optionally transferring
 // one or more platform handles in the process.
@@ -31,17 +41,51 @@ class Channel : public base::RefCountedThreadSafe<Channel> {
       // Number of attached handles.
       uint16_t num_handles;
 
-      // Zero
-      uint16_t padding;
+      // A combination of the Flags below.
+      uint16_t flags;
     };
 
-    // Allocates and owns a buffer for message data with enough capacity for
-    // |payload_size| bytes plus a header. Takes ownership of |handles|, which
-    // may be null.
-    Message(size_t payload_size, ScopedPlatformHandleVectorPtr handles);
+    enum Flags : uint16_t {
+      // The payload was compressed by the writing Channel. See
+      // EnableCompression().
+      kFlagCompressed = 1 << 0,
+
+      // The message is one frame of a larger message. See
+      // FragmentMessageNoLock().
+      kFlagFragment = 1 << 1,
+    };
+
+    // Where a message is queued relative to others waiting to be written. A
+    // queued message is written ahead of any queued message of a later
+    // priority which hasn't started to be written yet, and after every
+    // message of the same or an earlier one. A message is never interrupted
+    // once started, so the most a message can wait behind one of a later
+    // priority is the rest of that message.
+    enum Priority : uint8_t {
+      // Messages which other traffic depends on, e.g. ports control events.
+      kPriorityControl,
+
+      // The default.
+      kPriorityInteractive,
+
+      // Large transfers which may be delayed in favor of everything else,
+      // e.g. data pipe contents.
+      kPriorityBulk,
+    };
+
+    // Creates a message with enough capacity for |payload_size| bytes plus a
+    // header. Takes ownership of |handles|, which may be null.
+    //
+    // The Message and its data are allocated together in a single block from
+    // the MessagePool.
+    static scoped_ptr<Message> Create(size_t payload_size,
+                                      ScopedPlatformHandleVectorPtr handles);
     ~Message();
 
+    static void operator delete(void* ptr);
+
     const void* data() const { return data_; }
+    void* mutable_data() { return data_; }
     size_t data_num_bytes() const { return size_; }
 
     void* mutable_payload() { return &(header()[1]); }
@@ -50,6 +94,9 @@ class Channel : public base::RefCountedThreadSafe<Channel> {
     size_t payload_size() const { return header()->num_bytes - sizeof(Header); }
     size_t num_handles() const { return header()->num_handles; }
 
+    uint16_t flags() const { return header()->flags; }
+    void set_flags(uint16_t flags) { header()->flags = flags; }
+
     PlatformHandle* handles() {
       DCHECK(handles_);
       return static_cast<PlatformHandle*>(handles_->data());
@@ -57,9 +104,27 @@ class Channel : public base::RefCountedThreadSafe<Channel> {
 
     void SetHandles(ScopedPlatformHandleVectorPtr handles);
 
+    // Shrinks the payload to its first |payload_size| bytes. This never
+    // reallocates, so it's only useful for messages which are about to be
+    // sent.
+    void TruncatePayload(size_t payload_size);
+
     ScopedPlatformHandleVectorPtr TakeHandles() { return std::move(handles_); }
 
+    // The MessageTracer ID of the ports message this carries, if any. This is
+    // not part of the serialized message.
+    uint32_t trace_id() const { return trace_id_; }
+    void set_trace_id(uint32_t trace_id) { trace_id_ = trace_id; }
+
+    // Like the trace ID, this is not part of the serialized message.
+    Priority priority() const { return priority_; }
+    void set_priority(Priority priority) { priority_ = priority; }
+
    private:
+    friend class ChannelWriteQueue;
+
+    Message(char* data, size_t size, ScopedPlatformHandleVectorPtr handles);
+
     Header* header() { return reinterpret_cast<Header*>(data_); }
     const Header* header() const {
       return reinterpret_cast<const Header*>(data_);
@@ -69,6 +134,12 @@ class Channel : public base::RefCountedThreadSafe<Channel> {
     size_t size_;
     ScopedPlatformHandleVectorPtr handles_;
 
+    // Links messages in a ChannelWriteQueue.
+    Message* next_queued_ = nullptr;
+
+    uint32_t trace_id_ = 0;
+    Priority priority_ = kPriorityInteractive;
+
     DISALLOW_COPY_AND_ASSIGN(Message);
   };
 
@@ -87,10 +158,89 @@ class Channel : public base::RefCountedThreadSafe<Channel> {
                                   size_t payload_size,
                                   ScopedPlatformHandleVectorPtr handles) = 0;
 
+    // Notify of a received message which was read into its own buffer rather
+    // than the Channel's shared read buffer. This is done for large messages
+    // so that the delegate can take ownership of the data instead of copying
+    // it. The message's handles, if any, are attached. By default this simply
+    // forwards to OnChannelMessage.
+    virtual void OnOwnedChannelMessage(MessagePtr message) {
+      ScopedPlatformHandleVectorPtr handles = message->TakeHandles();
+      OnChannelMessage(message->payload_size() ? message->payload() : nullptr,
+                       message->payload_size(), std::move(handles));
+    }
+
+    // Notify that all complete messages from a single read have been
+    // dispatched via OnChannelMessage. Delegates which accumulate messages may
+    // use this to process them as a batch.
+    virtual void OnChannelReadComplete() {}
+
     // Notify that an error has occured and the Channel will cease operation.
     virtual void OnChannelError() = 0;
   };
 
+  // Controls whether Write() may perform I/O on the calling thread. By default
+  // a Write() to an idle Channel is attempted immediately. When writes are
+  // queued, Write() never blocks in the kernel: messages are pushed onto a
+  // lock-free queue which the I/O thread drains in batches. This trades a
+  // thread hop for keeping latency-sensitive senders out of write syscalls.
+  //
+  // Applies to Channels created after the call. Currently only honored by
+  // the POSIX implementation.
+  static void SetQueuedWritesEnabled(bool enabled);
+  static bool AreQueuedWritesEnabled();
+
+  // How message data travels between the two ends of a Channel.
+  enum class Transport {
+    // All data is written through the platform handle.
+    PLATFORM_HANDLE,
+
+    // Message data is written to a pair of rings in shared memory, and the
+    // platform handle is used only to transfer platform handles and to wake
+    // the other end when it's idle. The SHARED_MEMORY_INITIATOR end creates
+    // the shared memory and sends it to the other end, which must be created
+    // as SHARED_MEMORY_ACCEPTOR. Both ends must be in processes on the same
+    // host. Falls back to PLATFORM_HANDLE where unsupported.
+    SHARED_MEMORY_INITIATOR,
+    SHARED_MEMORY_ACCEPTOR,
+  };
+
+  // Controls whether connections between a parent process and its children
+  // use shared memory Channels. Must be set the same way in every process.
+  static void SetSharedMemoryEnabled(bool enabled);
+  static bool IsSharedMemoryEnabled();
+
+  // Sets the payload size from which messages are compressed on Channels
+  // which have EnableCompression() called. 0, the default, disables
+  // compression.
+  static void SetCompressionThreshold(size_t num_bytes);
+  static size_t GetCompressionThreshold();
+
+  // Makes the I/O thread keep reading a Channel until nothing has arrived for
+  // |microseconds|, instead of going back to the message loop as soon as the
+  // platform handle runs dry, so that a message which arrives soon is read
+  // without a wakeup. Other work on the I/O thread waits meanwhile, so this is
+  // only worthwhile when the I/O thread has a core to itself. 0, the default,
+  // disables this. Applies to Channels created after the call. Currently only
+  // honored by the POSIX implementation.
+  static void SetBusyPollTime(uint64_t microseconds);
+  static uint64_t GetBusyPollTime();
+
+  // Sets MemoryPlacement hints for the memory Channels read into. Only read
+  // buffers which have grown to megabytes are affected, since smaller ones
+  // share pages with other allocations. Applies to buffers allocated after the
+  // call.
+  static void SetReadBufferPlacement(uint32_t placement);
+  static uint32_t GetReadBufferPlacement();
+
+  // Makes PLATFORM_HANDLE Channels do their socket I/O through an io_uring
+  // shared by everything on their I/O thread, so that the reads and writes of
+  // many busy Channels cost a single system call between them. Implies queued
+  // writes. Applies to Channels created after the call. Currently only
+  // honored on Linux, and falls back to ordinary I/O where io_uring is
+  // unavailable.
+  static void SetIoUringEnabled(bool enabled);
+  static bool IsIoUringEnabled();
+
   // Creates a new Channel around a |platform_handle|, taking ownership of the
   // handle. All I/O on the handle will be performed on |io_task_runner|.
   // Note that ShutDown() MUST be called on the Channel some time before
@@ -100,6 +250,13 @@ class Channel : public base::RefCountedThreadSafe<Channel> {
       ScopedPlatformHandle platform_handle,
       scoped_refptr<base::TaskRunner> io_task_runner);
 
+  // Like above, using the given |transport|.
+  static scoped_refptr<Channel> Create(
+      Delegate* delegate,
+      ScopedPlatformHandle platform_handle,
+      Transport transport,
+      scoped_refptr<base::TaskRunner> io_task_runner);
+
   // Request that the channel be shut down. This should always be called before
   // releasing the last reference to a Channel to ensure that it's cleaned up
   // on its I/O task runner's thread.
@@ -119,6 +276,34 @@ class Channel : public base::RefCountedThreadSafe<Channel> {
   // Delegate::OnChannelError.
   virtual void Write(MessagePtr message) = 0;
 
+  // Compresses the payloads of messages written from now on which are at
+  // least GetCompressionThreshold() bytes, when that makes them meaningfully
+  // smaller. The other end must expect this (NodeChannel agrees on it in its
+  // handshake), though every Channel decompresses any message flagged as
+  // compressed. May be called from any thread.
+  void EnableCompression();
+
+  // What has been written to and read from this Channel, counted as in the
+  // MetricsRegistry's process-wide totals.
+  struct Stats {
+    uint64_t messages_written;
+    uint64_t bytes_written;
+    uint64_t handles_written;
+    uint64_t messages_read;
+    uint64_t bytes_read;
+    uint64_t handles_read;
+  };
+
+  // May be called from any thread.
+  void GetStats(Stats* stats) const;
+
+  // Returns a duplicate of the platform handle the Channel does its I/O on,
+  // so that another process may take it over, or an invalid handle if that
+  // isn't supported: on Windows, and for shared memory Channels. Only
+  // meaningful while nothing is being read or written, since data already
+  // read or still queued here is not carried over.
+  virtual ScopedPlatformHandle DuplicatePlatformHandle() = 0;
+
  protected:
   explicit Channel(Delegate* delegate);
   virtual ~Channel();
@@ -137,10 +322,46 @@ class Channel : public base::RefCountedThreadSafe<Channel> {
   // read done by the implementation.
   bool OnReadComplete(size_t bytes_read, size_t* next_read_size_hint);
 
+  // The number of messages OnReadComplete() has read so far, so that the
+  // implementation can bound how many it reads at a time.
+  size_t num_messages_read() const { return num_messages_read_; }
+
   // Called by the implementation when something goes horribly wrong. It is NOT
   // OK to call this synchronously from any public interface methods.
   void OnError();
 
+  // Called by the implementation's Write() for each message it is given,
+  // before anything else. Returns |message|, or a compressed copy of it if
+  // compression is enabled and worthwhile.
+  MessagePtr MaybeCompressMessage(MessagePtr message);
+
+  // Called by the implementation for each message it is given by Write(),
+  // after MaybeCompressMessage(), to split messages too large to be written
+  // in one piece into frames. Returns |message| if it's small enough.
+  // Otherwise returns its first frame, or null if too many other messages are
+  // being written in frames, in which case it's started once one of them is
+  // done.
+  //
+  // Each frame is no larger than could be written whole, and only the next
+  // frame of a message is handed out at a time. Since frames are queued like
+  // any other message, other messages, including frames of other messages,
+  // are interleaved with a large message's frames instead of waiting for all
+  // of it. The other end reassembles the frames into a buffer of their own.
+  //
+  // This and TakeNextFrameNoLock() must be called under the lock which guards
+  // the implementation's outgoing queue.
+  MessagePtr FragmentMessageNoLock(MessagePtr message);
+
+  // Called by the implementation as each message it queued is taken off its
+  // queue for writing. Returns the frame which should be queued next, if
+  // |message| is a frame, or null.
+  MessagePtr TakeNextFrameNoLock(const Message& message);
+
+  // Called by the implementation's Write() for each message it is given, to
+  // count it in the MetricsRegistry and this Channel's Stats, and stamp it if
+  // it is being traced.
+  void RecordMessageWritten(const Message& message);
+
   virtual ScopedPlatformHandleVectorPtr GetReadPlatformHandles(
       size_t num_handles) = 0;
 
@@ -149,9 +370,79 @@ class Channel : public base::RefCountedThreadSafe<Channel> {
 
   class ReadBuffer;
 
+  // A message being written in frames, and how many of its bytes have been
+  // handed out in frames so far.
+  struct OutgoingFragmentedMessage {
+    uint32_t id;
+    MessagePtr message;
+    size_t num_bytes_sent;
+  };
+
+  // A message whose frames are being read, and the handles sent with its first
+  // frame.
+  struct IncomingFragmentedMessage {
+    MessagePtr message;
+    size_t num_bytes_received;
+    ScopedPlatformHandleVectorPtr handles;
+  };
+
+  MessagePtr StartFragmentedMessageNoLock(MessagePtr message);
+  MessagePtr TakeFrameNoLock(OutgoingFragmentedMessage* fragmented_message);
+
+  // Passes |message| to the delegate, first decompressing it if necessary.
+  // Returns false if the message is invalid.
+  bool DispatchOwnedMessage(MessagePtr message);
+
+  // Adds a frame read from the channel to the message it belongs to, and
+  // dispatches the message if this was its last frame, in which case
+  // |*dispatched| is set. Returns false if the frame is invalid.
+  bool OnFrameRead(const void* payload,
+                   size_t payload_size,
+                   ScopedPlatformHandleVectorPtr handles,
+                   bool* dispatched);
+
+  // Attaches handles to |incoming_message_| and passes it to the delegate.
+  // Returns false if the message's handles have not arrived yet, or if the
+  // message is invalid, in which case |*error| is set.
+  bool DispatchIncomingMessage(bool* error);
+
+  // Counts a message read in the MetricsRegistry and this Channel's Stats.
+  void RecordMessageRead(size_t num_bytes, size_t num_handles);
+
   Delegate* delegate_;
   const scoped_ptr<ReadBuffer> read_buffer_;
 
+  // A large message being read directly into its own buffer, and the number of
+  // bytes of it read so far.
+  MessagePtr incoming_message_;
+  size_t num_incoming_message_bytes_ = 0;
+
+  // The payload size from which written messages are compressed, or 0 if
+  // they never are.
+  std::atomic<size_t> compression_threshold_;
+
+  // Outgoing messages being written in frames, and those which have to wait
+  // until fewer are. Guarded by the implementation's write lock.
+  uint32_t next_fragmented_message_id_ = 0;
+  std::vector<OutgoingFragmentedMessage> outgoing_fragmented_messages_;
+  std::deque<MessagePtr> waiting_fragmented_messages_;
+
+  // Only accessed on the I/O thread, like |read_buffer_|.
+  std::unordered_map<uint32_t, IncomingFragmentedMessage>
+      incoming_fragmented_messages_;
+
+  // Only accessed on the I/O thread.
+  size_t num_messages_read_ = 0;
+
+  // This Channel's Stats. Written ones are counted on any thread, and read
+  // ones on the I/O thread only, but all may be read on any thread.
+  std::atomic<uint64_t> messages_written_{0};
+  std::atomic<uint64_t> bytes_written_{0};
+  std::atomic<uint64_t> handles_written_{0};
+  std::atomic<uint64_t> messages_read_{0};
+  std::atomic<uint64_t> bytes_read_{0};
+  std::atomic<uint64_t> handles_read_{0};
+
   DISALLOW_COPY_AND_ASSIGN(Channel);
 };
 
@@ -5,10 +5,16 @@
 #include "mojo/edk/system/channel.h"
 
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/socket.h>
 #include <sys/uio.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <deque>
+#include <vector>
 
 #include "base/bind.h"
 #include "base/location.h"
@@ -17,17 +23,101 @@
 #include "base/memory/scoped_ptr.h"
 #include "base/message_loop/message_loop.h"
 #include "base/message_loop/message_pump_libevent.h"
-#include "base/synchronization/lock.h"
 #include "base/task_runner.h"
+#include "base/time/time.h"
+#include "mojo/edk/embedder/embedder_internal.h"
 #include "mojo/edk/embedder/platform_channel_utils_posix.h"
 #include "mojo/edk/embedder/platform_handle_vector.h"
+#include "mojo/edk/embedder/platform_shared_buffer.h"
+#include "mojo/edk/embedder/platform_support.h"
+#include "mojo/edk/system/channel_write_queue.h"
+#include "mojo/edk/system/io_uring_loop.h"
+#include "mojo/edk/system/message_tracer.h"
+#include "mojo/edk/system/profiled_lock.h"
+#include "mojo/edk/system/shared_memory_ring.h"
 
 namespace mojo {
 namespace edk {
 
 namespace {
 
+// Bound how much a Channel reads each time it's woken, so that one which is
+// flooded can't hold up the others on the I/O thread. Once either is reached
+// the Channel goes back to the message loop. Its handle is still readable, so
+// the loop wakes it again, but only after serving the other Channels which
+// became ready meanwhile.
 const size_t kMaxBatchReadCapacity = 256 * 1024;
+const size_t kMaxBatchReadMessages = 256;
+
+// Bounds for the size of the first read each time a Channel is woken, which
+// follows how much it has recently read per wakeup. Larger reads take more
+// messages per system call when a peer is chatty.
+const size_t kMinReadSizeHint = 4096;
+const size_t kMaxReadSizeHint = 64 * 1024;
+
+// The maximum number of queued messages gathered into a single writev() or
+// sendmsg() call.
+#if defined(IOV_MAX) && IOV_MAX < 64
+const size_t kMaxBatchWriteMessages = IOV_MAX;
+#else
+const size_t kMaxBatchWriteMessages = 64;
+#endif
+
+// The capacity of each direction's ring on a shared memory Channel.
+const size_t kSharedMemoryRingCapacity = 256 * 1024;
+
+// The maximum number of reads done to drain wakeups from a shared memory
+// Channel's platform handle in one go.
+const size_t kMaxDoorbellReads = 16;
+
+// The byte written to a shared memory Channel's platform handle to wake the
+// other end. Its value is meaningless.
+const char kDoorbell = 0;
+
+// The control buffer needed to send or receive the most handles one sendmsg()
+// may carry.
+const size_t kHandleControlBufferSize =
+    CMSG_SPACE(kPlatformChannelMaxNumHandles * sizeof(int));
+
+// Flags for sendmsg() through an IoUringLoop. Only Linux has them, where
+// MSG_NOSIGNAL suppresses SIGPIPE as in platform_channel_utils_posix.cc.
+#if defined(MSG_NOSIGNAL)
+const int kUringSendFlags = MSG_NOSIGNAL;
+#else
+const int kUringSendFlags = 0;
+#endif
+
+// Whether a Channel with |transport| should do its I/O through the I/O
+// thread's IoUringLoop.
+bool ShouldUseIoUring(Channel::Transport transport) {
+  return transport == Channel::Transport::PLATFORM_HANDLE &&
+         Channel::IsIoUringEnabled() && IoUringLoop::IsSupported();
+}
+
+// Moves the platform handles received with |message| onto |handles|.
+void TakeReceivedHandles(msghdr* message,
+                         std::deque<PlatformHandle>* handles) {
+  if (message->msg_controllen == 0)
+    return;
+  DCHECK(!(message->msg_flags & MSG_CTRUNC));
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(message); cmsg;
+       cmsg = CMSG_NXTHDR(message, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    size_t payload_length = cmsg->cmsg_len - CMSG_LEN(0);
+    DCHECK_EQ(payload_length % sizeof(int), 0u);
+    size_t num_fds = payload_length / sizeof(int);
+    const int* fds = reinterpret_cast<int*>(CMSG_DATA(cmsg));
+    for (size_t i = 0; i < num_fds; ++i)
+      handles->push_back(PlatformHandle(fds[i]));
+  }
+}
+
+size_t GetSharedMemorySize() {
+  // The initiating end's outgoing ring is first, followed by the accepting
+  // end's.
+  return 2 * SharedMemoryRing::GetRequiredMemorySize(kSharedMemoryRingCapacity);
+}
 
 // A view over a Channel::Message object. The write queue uses these since
 // large messages may need to be sent in chunks.
@@ -47,6 +137,8 @@ class MessageView {
     message_ = std::move(other.message_);
     offset_ = other.offset_;
     handles_ = std::move(other.handles_);
+    num_handles_written_ = other.num_handles_written_;
+    started_ = other.started_;
     return *this;
   }
 
@@ -62,8 +154,44 @@ class MessageView {
   void advance_data_offset(size_t num_bytes) {
     DCHECK_GT(message_->data_num_bytes(), offset_ + num_bytes);
     offset_ += num_bytes;
+    started_ = true;
   }
 
+  // The handles not yet written. A message with more handles than fit in one
+  // sendmsg() call writes them in several chunks.
+  size_t num_handles() const {
+    return handles_ ? handles_->size() - num_handles_written_ : 0;
+  }
+  PlatformHandle* handles() {
+    DCHECK(handles_);
+    return handles_->data() + num_handles_written_;
+  }
+
+  // Called once the next |num_handles| handles have been written to the
+  // channel. Ownership of those handles now belongs to the receiver.
+  void OnHandlesWritten(size_t num_handles) {
+    DCHECK_LE(num_handles, this->num_handles());
+    num_handles_written_ += num_handles;
+    if (num_handles > 0)
+      started_ = true;
+    if (handles_ && num_handles_written_ == handles_->size()) {
+      handles_->clear();
+      num_handles_written_ = 0;
+    }
+  }
+
+  uint32_t trace_id() const { return message_->trace_id(); }
+  Channel::Message::Priority priority() const { return message_->priority(); }
+
+  // Whether any of the message's data or handles have been written, or may
+  // be by a write in flight. The receiver matches handles to messages in the
+  // order they arrive, so once this is true nothing may be written ahead of
+  // the rest of the message.
+  bool started() const { return started_; }
+  void set_started() { started_ = true; }
+
+  const Channel::Message* message() const { return message_.get(); }
+
   ScopedPlatformHandleVectorPtr TakeHandles() { return std::move(handles_); }
   Channel::MessagePtr TakeMessage() { return std::move(message_); }
 
@@ -71,6 +199,8 @@ class MessageView {
   Channel::MessagePtr message_;
   size_t offset_;
   ScopedPlatformHandleVectorPtr handles_;
+  size_t num_handles_written_ = 0;
+  bool started_ = false;
 
   DISALLOW_COPY_AND_ASSIGN(MessageView);
 };
@@ -81,11 +211,19 @@ class ChannelPosix : public Channel,
  public:
   ChannelPosix(Delegate* delegate,
                ScopedPlatformHandle handle,
+               Transport transport,
                scoped_refptr<base::TaskRunner> io_task_runner)
       : Channel(delegate),
         self_(this),
         handle_(std::move(handle)),
-        io_task_runner_(io_task_runner) {
+        io_task_runner_(io_task_runner),
+        write_lock_("Channel::write_lock_"),
+        queue_writes_(AreQueuedWritesEnabled() || ShouldUseIoUring(transport)),
+        transport_(transport),
+        busy_poll_time_(GetBusyPollTime()),
+        read_size_hint_(kMinReadSizeHint),
+        uring_read_(this, &ChannelPosix::OnUringReadComplete),
+        uring_write_(this, &ChannelPosix::OnUringWriteComplete) {
   }
 
   void Start() override {
@@ -107,17 +245,29 @@ class ChannelPosix : public Channel,
   }
 
   void Write(MessagePtr message) override {
+    message = MaybeCompressMessage(std::move(message));
+    RecordMessageWritten(*message);
+    if (queue_writes_) {
+      // Only the first message pushed onto an empty queue needs to schedule a
+      // flush; later ones will be picked up by the same flush.
+      if (write_queue_.Push(std::move(message))) {
+        io_task_runner_->PostTask(
+            FROM_HERE, base::Bind(&ChannelPosix::FlushWriteQueue, this));
+      }
+      return;
+    }
+
     bool write_error = false;
     {
-      base::AutoLock lock(write_lock_);
+      ProfiledAutoLock lock(write_lock_);
       if (reject_writes_)
         return;
-      if (outgoing_messages_.empty()) {
-        if (!WriteNoLock(MessageView(std::move(message), 0)))
-          reject_writes_ = write_error = true;
-      } else {
-        outgoing_messages_.emplace_back(std::move(message), 0);
-      }
+      // If messages are already queued, a write is pending on the IO thread
+      // and this message will be flushed along with them.
+      bool was_empty = outgoing_messages_.empty();
+      EnqueueOutgoingMessageNoLock(std::move(message));
+      if (was_empty && !FlushOutgoingMessagesNoLock())
+        reject_writes_ = write_error = true;
     }
     if (write_error) {
       // Do not synchronously invoke OnError(). Write() may have been called by
@@ -127,20 +277,62 @@ class ChannelPosix : public Channel,
     }
   }
 
+  ScopedPlatformHandle DuplicatePlatformHandle() override {
+    if (transport_ != Transport::PLATFORM_HANDLE || !handle_.is_valid())
+      return ScopedPlatformHandle();
+    int fd = dup(handle_.get().handle);
+    if (fd < 0) {
+      PLOG(ERROR) << "dup";
+      return ScopedPlatformHandle();
+    }
+    return ScopedPlatformHandle(PlatformHandle(fd));
+  }
+
   ScopedPlatformHandleVectorPtr GetReadPlatformHandles(
       size_t num_handles) override {
     if (incoming_platform_handles_.size() < num_handles)
       return nullptr;
+    auto end = incoming_platform_handles_.begin() + num_handles;
     ScopedPlatformHandleVectorPtr handles(
-        new PlatformHandleVector(num_handles));
-    for (size_t i = 0; i < num_handles; ++i) {
-      (*handles)[i] = incoming_platform_handles_.front();
-      incoming_platform_handles_.pop_front();
-    }
+        new PlatformHandleVector(incoming_platform_handles_.begin(), end));
+    incoming_platform_handles_.erase(incoming_platform_handles_.begin(), end);
     return handles;
   }
 
  private:
+  // An io_uring operation of this Channel's. While one is in flight it keeps
+  // the Channel alive, along with the buffers it refers to.
+  class UringOperation : public IoUringLoop::Operation {
+   public:
+    using Callback = void (ChannelPosix::*)(int result);
+
+    UringOperation(ChannelPosix* channel, Callback callback)
+        : channel_(channel), callback_(callback) {}
+    ~UringOperation() override {}
+
+    bool in_flight() const { return keep_alive_.get() != nullptr; }
+
+    // Called as the operation is submitted.
+    void Start() {
+      DCHECK(!in_flight());
+      keep_alive_ = channel_;
+    }
+
+    // IoUringLoop::Operation:
+    void OnComplete(int result) override {
+      scoped_refptr<Channel> keep_alive;
+      keep_alive.swap(keep_alive_);
+      (channel_->*callback_)(result);
+    }
+
+   private:
+    ChannelPosix* const channel_;
+    const Callback callback_;
+    scoped_refptr<Channel> keep_alive_;
+
+    DISALLOW_COPY_AND_ASSIGN(UringOperation);
+  };
+
   ~ChannelPosix() override {
     DCHECK(!read_watcher_);
     DCHECK(!write_watcher_);
@@ -151,16 +343,264 @@ class ChannelPosix : public Channel,
   void StartOnIOThread() {
     DCHECK(!read_watcher_);
     DCHECK(!write_watcher_);
+    if (ShouldUseIoUring(transport_)) {
+      IoUringLoop* uring = IoUringLoop::GetForCurrentThread();
+      if (uring) {
+        uring_ = uring->GetWeakPtr();
+        StartUringOnIOThread();
+        return;
+      }
+    }
+
     read_watcher_.reset(new base::MessagePumpLibevent::FileDescriptorWatcher);
     write_watcher_.reset(new base::MessagePumpLibevent::FileDescriptorWatcher);
     base::MessageLoopForIO::current()->WatchFileDescriptor(
         handle_.get().handle, true /* persistent */,
         base::MessageLoopForIO::WATCH_READ, read_watcher_.get(), this);
     base::MessageLoop::current()->AddDestructionObserver(this);
+
+    if (transport_ == Transport::SHARED_MEMORY_INITIATOR) {
+      bool error = false;
+      {
+        ProfiledAutoLock lock(write_lock_);
+        if (!CreateSharedBufferNoLock() || !FlushOutgoingMessagesNoLock())
+          reject_writes_ = error = true;
+      }
+      if (error) {
+        // Start() may have been called by the delegate, so don't re-enter it.
+        io_task_runner_->PostTask(FROM_HERE,
+                                  base::Bind(&ChannelPosix::OnError, this));
+      }
+    }
+  }
+
+  void StartUringOnIOThread() {
+    base::MessageLoop::current()->AddDestructionObserver(this);
+    SubmitUringRead();
+
+    // Anything written before now was flushed without the ring, and may be
+    // waiting for the socket to drain.
+    bool write_error = false;
+    {
+      ProfiledAutoLock lock(write_lock_);
+      if (!reject_writes_ && !SubmitUringWriteNoLock())
+        reject_writes_ = write_error = true;
+    }
+    if (write_error) {
+      io_task_runner_->PostTask(FROM_HERE,
+                                base::Bind(&ChannelPosix::OnError, this));
+    }
+  }
+
+  // Keeps one recvmsg() in flight on the ring. Every Channel on the I/O thread
+  // gets one read per batch of completions, which bounds how much a flooded
+  // Channel can read ahead of the others as kMaxBatchReadCapacity does for
+  // the message loop.
+  void SubmitUringRead() {
+    size_t buffer_capacity =
+        next_read_size_ ? next_read_size_ : read_size_hint_;
+    char* buffer = GetReadBuffer(&buffer_capacity);
+    DCHECK_GT(buffer_capacity, 0u);
+    uring_read_iov_.iov_base = buffer;
+    uring_read_iov_.iov_len = buffer_capacity;
+    memset(&uring_read_message_, 0, sizeof(uring_read_message_));
+    uring_read_message_.msg_iov = &uring_read_iov_;
+    uring_read_message_.msg_iovlen = 1;
+    uring_read_message_.msg_control = uring_read_control_;
+    uring_read_message_.msg_controllen = sizeof(uring_read_control_);
+    uring_read_.Start();
+    uring_->ReceiveMessage(handle_.get().handle, &uring_read_message_, 0,
+                           &uring_read_);
+  }
+
+  void OnUringReadComplete(int result) {
+    if (uring_read_polling_) {
+      uring_read_polling_ = false;
+      if (!handle_.is_valid())
+        return;
+      if (result < 0)
+        OnError();
+      else
+        SubmitUringRead();
+      return;
+    }
+
+    // Handles which arrive after shutdown are closed along with the Channel.
+    if (result > 0)
+      TakeReceivedHandles(&uring_read_message_, &incoming_platform_handles_);
+    if (!handle_.is_valid())
+      return;
+
+    if (result == -EAGAIN) {
+      // The socket is non-blocking, which some kernels honor by failing
+      // rather than waiting. Wait for it to become readable, then retry.
+      uring_read_polling_ = true;
+      uring_read_.Start();
+      uring_->Poll(handle_.get().handle, POLLIN, &uring_read_);
+      return;
+    }
+    if (result <= 0) {
+      OnError();
+      return;
+    }
+
+    size_t bytes_read = static_cast<size_t>(result);
+    next_read_size_ = 0;
+    if (!OnReadComplete(bytes_read, &next_read_size_)) {
+      OnError();
+      return;
+    }
+
+    // As for the message loop, but per read rather than per wakeup.
+    size_t read_size =
+        std::min(std::max(bytes_read, kMinReadSizeHint), kMaxReadSizeHint);
+    read_size_hint_ = (read_size_hint_ * 3 + read_size) / 4;
+
+    // Reading may have shut the Channel down.
+    if (handle_.is_valid())
+      SubmitUringRead();
+  }
+
+  // Keeps one sendmsg() of the next batch of |outgoing_messages_| in flight on
+  // the ring. Returns false on error.
+  bool SubmitUringWriteNoLock() {
+    if (uring_write_.in_flight() || outgoing_messages_.empty())
+      return true;
+
+    size_t num_bytes;
+    uring_write_num_messages_ =
+        GatherWriteBatchNoLock(uring_write_iov_, &uring_write_handles_,
+                               &num_bytes);
+    if (!uring_write_num_messages_)
+      return false;
+
+    // Keep later messages of higher priority from being queued between those
+    // in flight.
+    for (size_t i = 0; i < uring_write_num_messages_; ++i)
+      outgoing_messages_[i].set_started();
+
+    memset(&uring_write_message_, 0, sizeof(uring_write_message_));
+    uring_write_message_.msg_iov = uring_write_iov_;
+    uring_write_message_.msg_iovlen = uring_write_num_messages_;
+    if (!uring_write_handles_.empty()) {
+      size_t num_handles = uring_write_handles_.size();
+      uring_write_message_.msg_control = uring_write_control_;
+      uring_write_message_.msg_controllen =
+          CMSG_LEN(num_handles * sizeof(int));
+      cmsghdr* cmsg = CMSG_FIRSTHDR(&uring_write_message_);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(num_handles * sizeof(int));
+      int* fds = reinterpret_cast<int*>(CMSG_DATA(cmsg));
+      for (size_t i = 0; i < num_handles; ++i)
+        fds[i] = uring_write_handles_[i].handle;
+    }
+    uring_write_.Start();
+    uring_->SendMessage(handle_.get().handle, &uring_write_message_,
+                        kUringSendFlags, &uring_write_);
+    return true;
+  }
+
+  void OnUringWriteComplete(int result) {
+    if (!handle_.is_valid())
+      return;
+
+    bool write_error = false;
+    {
+      ProfiledAutoLock lock(write_lock_);
+      if (uring_write_polling_) {
+        uring_write_polling_ = false;
+        write_error = result < 0 || !SubmitUringWriteNoLock();
+      } else if (result == -EAGAIN) {
+        // Nothing was written, so the batch is gathered again once the socket
+        // is writable.
+        uring_write_polling_ = true;
+        uring_write_.Start();
+        uring_->Poll(handle_.get().handle, POLLOUT, &uring_write_);
+      } else if (result < 0) {
+        write_error = true;
+      } else {
+        OnWriteBatchCompleteNoLock(uring_write_num_messages_,
+                                   uring_write_handles_.size(),
+                                   static_cast<size_t>(result));
+        write_error = !SubmitUringWriteNoLock();
+      }
+      if (write_error)
+        reject_writes_ = true;
+    }
+    if (write_error)
+      OnError();
+  }
+
+  // Creates the shared memory for a shared memory Channel and sends it to the
+  // other end. This is always the first platform handle sent, which is how
+  // the other end recognizes it.
+  bool CreateSharedBufferNoLock() {
+    DCHECK(!shared_buffer_);
+    shared_buffer_ =
+        internal::g_platform_support->CreateSharedBuffer(GetSharedMemorySize());
+    if (!shared_buffer_)
+      return false;
+
+    ScopedPlatformHandle buffer_handle =
+        shared_buffer_->DuplicatePlatformHandle();
+    if (!buffer_handle.is_valid())
+      return false;
+    PlatformHandle platform_handle = buffer_handle.get();
+    iovec iov = {const_cast<char*>(&kDoorbell), 1};
+    if (PlatformChannelSendmsgWithHandles(handle_.get(), &iov, 1,
+                                          &platform_handle, 1) < 0) {
+      return false;
+    }
+
+    return MapSharedBufferNoLock();
+  }
+
+  // Adopts the shared memory sent by the initiating end, which is the first
+  // platform handle received, and writes anything queued in the meantime.
+  bool AcceptSharedBuffer() {
+    DCHECK(!incoming_platform_handles_.empty());
+    ScopedPlatformHandle buffer_handle(incoming_platform_handles_.front());
+    incoming_platform_handles_.pop_front();
+
+    ProfiledAutoLock lock(write_lock_);
+    shared_buffer_ = internal::g_platform_support->CreateSharedBufferFromHandle(
+        GetSharedMemorySize(), std::move(buffer_handle));
+    if (!shared_buffer_ || !MapSharedBufferNoLock() ||
+        !FlushOutgoingMessagesNoLock()) {
+      reject_writes_ = true;
+      return false;
+    }
+    return true;
+  }
+
+  bool MapSharedBufferNoLock() {
+    shared_buffer_mapping_ = shared_buffer_->Map(0, GetSharedMemorySize());
+    if (!shared_buffer_mapping_)
+      return false;
+
+    char* initiator_ring =
+        static_cast<char*>(shared_buffer_mapping_->GetBase());
+    char* acceptor_ring = initiator_ring +
+        SharedMemoryRing::GetRequiredMemorySize(kSharedMemoryRingCapacity);
+    if (transport_ == Transport::SHARED_MEMORY_ACCEPTOR)
+      std::swap(initiator_ring, acceptor_ring);
+    outgoing_ring_.reset(
+        new SharedMemoryRing(initiator_ring, kSharedMemoryRingCapacity));
+    incoming_ring_.reset(
+        new SharedMemoryRing(acceptor_ring, kSharedMemoryRingCapacity));
+    return true;
+  }
+
+  // Wakes the other end of a shared memory Channel. If the wakeup can't be
+  // written without blocking, the other end already has unread wakeups, so
+  // it's dropped.
+  void RingDoorbell() {
+    PlatformChannelWrite(handle_.get(), &kDoorbell, 1);
   }
 
   void WaitForWriteOnIOThread() {
-    base::AutoLock lock(write_lock_);
+    ProfiledAutoLock lock(write_lock_);
     WaitForWriteOnIOThreadNoLock();
   }
 
@@ -183,6 +623,16 @@ class ChannelPosix : public Channel,
   void ShutDownOnIOThread() {
     base::MessageLoop::current()->RemoveDestructionObserver(this);
 
+    // The handle may be closed as soon as the cancellations are submitted.
+    // If the IoUringLoop has already gone with the message loop, whatever was
+    // in flight never completes.
+    if (uring_) {
+      if (uring_read_.in_flight())
+        uring_->Cancel(&uring_read_);
+      if (uring_write_.in_flight())
+        uring_->Cancel(&uring_write_);
+    }
+
     read_watcher_.reset();
     write_watcher_.reset();
     handle_.reset();
@@ -202,47 +652,189 @@ class ChannelPosix : public Channel,
   void OnFileCanReadWithoutBlocking(int fd) override {
     CHECK_EQ(fd, handle_.get().handle);
 
-    bool read_error = false;
-    {
-      size_t next_read_size = 0;
-      size_t buffer_capacity = 0;
-      size_t total_bytes_read = 0;
-      size_t bytes_read = 0;
-      do {
-        buffer_capacity = next_read_size;
-        char* buffer = GetReadBuffer(&buffer_capacity);
-        DCHECK_GT(buffer_capacity, 0u);
-
-        ssize_t read_result = PlatformChannelRecvmsg(
-            handle_.get(),
-            buffer,
-            buffer_capacity,
-            &incoming_platform_handles_);
-
-        if (read_result > 0) {
-          bytes_read = static_cast<size_t>(read_result);
-          total_bytes_read += bytes_read;
-          if (!OnReadComplete(bytes_read, &next_read_size)) {
-            read_error = true;
-            break;
-          }
-        } else if (read_result == 0 ||
-                   (errno != EAGAIN && errno != EWOULDBLOCK)) {
-          read_error = true;
+    if (transport_ != Transport::PLATFORM_HANDLE) {
+      OnSharedMemoryChannelReadable();
+      return;
+    }
+
+    wake_bytes_read_ = 0;
+    wake_first_message_ = num_messages_read();
+
+    size_t bytes_read = 0;
+    bool read_error = !ReadFromHandle(&bytes_read);
+
+    // When busy polling, keep reading until nothing has arrived for
+    // |busy_poll_time_|, so that a reply which comes soon is read without
+    // waiting to be woken by the message loop. This still stops at the read
+    // budget. Reading may shut the Channel down, so it's kept alive and the
+    // handle checked each time.
+    if (!read_error && busy_poll_time_ > 0) {
+      scoped_refptr<Channel> keep_alive(this);
+      base::TimeTicks last_read = base::TimeTicks::Now();
+      while (!read_error && handle_.is_valid() && !IsReadBudgetExhausted()) {
+        read_error = !ReadFromHandle(&bytes_read);
+        base::TimeTicks now = base::TimeTicks::Now();
+        if (bytes_read > 0) {
+          last_read = now;
+        } else if ((now - last_read).InMicroseconds() >=
+                   static_cast<int64_t>(busy_poll_time_)) {
           break;
         }
-      } while (bytes_read == buffer_capacity &&
-               total_bytes_read < kMaxBatchReadCapacity &&
-               next_read_size > 0);
+      }
+    }
+    if (read_error) {
+      OnError();
+      return;
     }
-    if (read_error)
+
+    // Move the hint a quarter of the way towards what this wakeup read.
+    size_t read_size = std::min(
+        std::max(wake_bytes_read_, kMinReadSizeHint), kMaxReadSizeHint);
+    read_size_hint_ = (read_size_hint_ * 3 + read_size) / 4;
+  }
+
+  // Whether this wakeup has read all it may. See kMaxBatchReadCapacity.
+  bool IsReadBudgetExhausted() const {
+    return wake_bytes_read_ >= kMaxBatchReadCapacity ||
+           num_messages_read() - wake_first_message_ >= kMaxBatchReadMessages;
+  }
+
+  // Reads whatever is available on the platform handle, within what is left
+  // of the read budget, and dispatches the messages it completes. Sets
+  // |*total_bytes_read| to the number of bytes read, which is 0 if nothing
+  // was available. Returns false on error.
+  bool ReadFromHandle(size_t* total_bytes_read) {
+    size_t next_read_size = 0;
+    size_t buffer_capacity = 0;
+    size_t bytes_read = 0;
+    *total_bytes_read = 0;
+    do {
+      buffer_capacity = next_read_size ? next_read_size : read_size_hint_;
+      char* buffer = GetReadBuffer(&buffer_capacity);
+      DCHECK_GT(buffer_capacity, 0u);
+
+      ssize_t read_result = PlatformChannelRecvmsg(
+          handle_.get(),
+          buffer,
+          buffer_capacity,
+          &incoming_platform_handles_);
+
+      if (read_result > 0) {
+        bytes_read = static_cast<size_t>(read_result);
+        *total_bytes_read += bytes_read;
+        wake_bytes_read_ += bytes_read;
+        if (!OnReadComplete(bytes_read, &next_read_size))
+          return false;
+      } else if (read_result == 0 ||
+                 (errno != EAGAIN && errno != EWOULDBLOCK)) {
+        return false;
+      } else {
+        // Nothing more is available.
+        bytes_read = 0;
+      }
+    } while (bytes_read == buffer_capacity && !IsReadBudgetExhausted() &&
+             next_read_size > 0);
+    return true;
+  }
+
+  // On a shared memory Channel, the platform handle carries only wakeups and
+  // platform handles. It's drained before the incoming ring so that handles
+  // are available for the messages which need them.
+  void OnSharedMemoryChannelReadable() {
+    bool error = false;
+    size_t num_handles = incoming_platform_handles_.size();
+    for (size_t i = 0; i < kMaxDoorbellReads; ++i) {
+      char buffer[64];
+      ssize_t read_result = PlatformChannelRecvmsg(
+          handle_.get(), buffer, sizeof(buffer), &incoming_platform_handles_);
+      if (read_result > 0)
+        continue;
+      // Data the other end wrote before closing is still read from the ring
+      // below before the error is reported.
+      if (read_result == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        error = true;
+      break;
+    }
+    bool received_handles = incoming_platform_handles_.size() > num_handles;
+
+    if (!incoming_ring_ && !incoming_platform_handles_.empty() &&
+        !AcceptSharedBuffer()) {
+      error = true;
+    }
+
+    if (incoming_ring_ && !ReadFromIncomingRing(received_handles))
+      error = true;
+
+    // The other end may have been waking us because it freed space in
+    // |outgoing_ring_|.
+    {
+      ProfiledAutoLock lock(write_lock_);
+      if (!reject_writes_ && !FlushOutgoingMessagesNoLock())
+        reject_writes_ = error = true;
+    }
+
+    if (error)
+      OnError();
+  }
+
+  // Reads everything available from |incoming_ring_|, then registers as
+  // waiting for more. Returns false on error.
+  bool ReadFromIncomingRing(bool received_handles) {
+    size_t next_read_size = 0;
+    size_t total_bytes_read = 0;
+    size_t first_message = num_messages_read();
+    for (;;) {
+      size_t buffer_capacity = next_read_size;
+      char* buffer = GetReadBuffer(&buffer_capacity);
+      DCHECK_GT(buffer_capacity, 0u);
+
+      size_t bytes_read;
+      if (!incoming_ring_->Read(buffer, buffer_capacity, &bytes_read)) {
+        LOG(ERROR) << "Invalid shared memory ring state.";
+        return false;
+      }
+      if (!bytes_read) {
+        if (incoming_ring_->PrepareToWaitForData())
+          break;
+        continue;
+      }
+
+      total_bytes_read += bytes_read;
+      if (!OnReadComplete(bytes_read, &next_read_size))
+        return false;
+
+      if (total_bytes_read >= kMaxBatchReadCapacity ||
+          num_messages_read() - first_message >= kMaxBatchReadMessages) {
+        // Let other work on the I/O thread run. We aren't registered as
+        // waiting, so nothing will wake us, and we have to come back here.
+        io_task_runner_->PostTask(
+            FROM_HERE, base::Bind(&ChannelPosix::ContinueReadingFromRing,
+                                  this));
+        break;
+      }
+    }
+
+    if (!total_bytes_read) {
+      // Messages already read may have been waiting on these handles.
+      if (received_handles && !OnReadComplete(0, &next_read_size))
+        return false;
+    } else if (incoming_ring_->TakeProducerWakeup()) {
+      RingDoorbell();
+    }
+    return true;
+  }
+
+  void ContinueReadingFromRing() {
+    if (!read_watcher_)
+      return;
+    if (!ReadFromIncomingRing(false))
       OnError();
   }
 
   void OnFileCanWriteWithoutBlocking(int fd) override {
     bool write_error = false;
     {
-      base::AutoLock lock(write_lock_);
+      ProfiledAutoLock lock(write_lock_);
       pending_write_ = false;
       if (!FlushOutgoingMessagesNoLock())
         reject_writes_ = write_error = true;
@@ -251,65 +843,249 @@ class ChannelPosix : public Channel,
       OnError();
   }
 
-  // Attempts to write a message directly to the channel. If the full message
-  // cannot be written, it's queued and a wait is initiated to write the message
-  // ASAP on the I/O thread.
-  bool WriteNoLock(MessageView message_view) {
-    size_t bytes_written = 0;
-    do {
-      message_view.advance_data_offset(bytes_written);
+  // Moves everything in |write_queue_| onto |outgoing_messages_| and writes as
+  // much of it as possible. Only used when writes are queued.
+  void FlushWriteQueue() {
+    DCHECK(io_task_runner_->RunsTasksOnCurrentThread());
+    std::vector<MessagePtr> messages;
+    write_queue_.PopAll(&messages);
+
+    bool write_error = false;
+    {
+      ProfiledAutoLock lock(write_lock_);
+      if (reject_writes_)
+        return;
+      // If messages are already queued, a write is pending and will flush
+      // these along with them.
+      bool was_empty = outgoing_messages_.empty();
+      for (MessagePtr& message : messages)
+        EnqueueOutgoingMessageNoLock(std::move(message));
+      if (was_empty && !FlushOutgoingMessagesNoLock())
+        reject_writes_ = write_error = true;
+    }
+    if (write_error)
+      OnError();
+  }
+
+  // Queues |message|, or its first frame, on |outgoing_messages_| behind every
+  // message of the same or an earlier priority, and behind any message
+  // already partly written.
+  void EnqueueOutgoingMessageNoLock(MessagePtr message) {
+    message = FragmentMessageNoLock(std::move(message));
+    if (!message)
+      return;
+    auto it = outgoing_messages_.end();
+    while (it != outgoing_messages_.begin()) {
+      auto prev = it - 1;
+      if (prev->started() || prev->priority() <= message->priority())
+        break;
+      it = prev;
+    }
+    outgoing_messages_.emplace(it, std::move(message), 0);
+  }
+
+  // Writes as much of |outgoing_messages_| to the channel as possible,
+  // gathering consecutive messages into a single writev() or sendmsg() call.
+  // If the queue cannot be fully written, the remainder stays queued and a wait
+  // is initiated to write it ASAP on the I/O thread.
+  bool FlushOutgoingMessagesNoLock() {
+    if (transport_ != Transport::PLATFORM_HANDLE)
+      return FlushOutgoingMessagesToRingNoLock();
+    if (uring_) {
+      DCHECK(io_task_runner_->RunsTasksOnCurrentThread());
+      return SubmitUringWriteNoLock();
+    }
+
+    iovec iov[kMaxBatchWriteMessages];
+    std::vector<PlatformHandle> handles;
+    while (!outgoing_messages_.empty()) {
+      size_t num_bytes;
+      size_t num_messages = GatherWriteBatchNoLock(iov, &handles, &num_bytes);
+      if (!num_messages)
+        return false;
 
       ssize_t result;
-      ScopedPlatformHandleVectorPtr handles = message_view.TakeHandles();
-      if (handles && handles->size()) {
-        iovec iov = {
-          const_cast<void*>(message_view.data()),
-          message_view.data_num_bytes()
-        };
-        // TODO: Handle lots of handles.
+      if (!handles.empty()) {
         result = PlatformChannelSendmsgWithHandles(
-            handle_.get(), &iov, 1, handles->data(), handles->size());
-        handles->clear();
+            handle_.get(), iov, num_messages, handles.data(), handles.size());
       } else {
-        result = PlatformChannelWrite(handle_.get(), message_view.data(),
-                                      message_view.data_num_bytes());
+        result = PlatformChannelWritev(handle_.get(), iov, num_messages);
       }
 
       if (result < 0) {
         if (errno != EAGAIN && errno != EWOULDBLOCK)
           return false;
-        outgoing_messages_.emplace_back(std::move(message_view));
+        // Nothing was written, including any handles, so the batch can simply
+        // be retried once the channel is writable.
         WaitForWriteOnIOThreadNoLock();
         return true;
       }
 
-      bytes_written = static_cast<size_t>(result);
-    } while (bytes_written < message_view.data_num_bytes());
+      OnWriteBatchCompleteNoLock(num_messages, handles.size(),
+                                 static_cast<size_t>(result));
+
+      if (static_cast<size_t>(result) < num_bytes) {
+        // The channel is full.
+        WaitForWriteOnIOThreadNoLock();
+        return true;
+      }
+    }
 
     return true;
   }
 
-  bool FlushOutgoingMessagesNoLock() {
-    std::deque<MessageView> messages;
-    std::swap(outgoing_messages_, messages);
+  // Gathers the next messages of |outgoing_messages_|, which must not be
+  // empty, into one write: their data into |iov|, which has room for
+  // kMaxBatchWriteMessages, and their handles into |handles|. Sets
+  // |*num_bytes| to the number of bytes gathered. Returns the number of
+  // messages gathered, or 0 on error.
+  size_t GatherWriteBatchNoLock(iovec* iov,
+                                std::vector<PlatformHandle>* handles,
+                                size_t* num_bytes) {
+    DCHECK(!outgoing_messages_.empty());
 
-    while (!messages.empty()) {
-      if (!WriteNoLock(std::move(messages.front())))
-        return false;
+    // Platform handles are attached to the first byte written, and the
+    // receiver consumes them in order regardless of which bytes carried them.
+    // So handles for every message in the batch can be sent together, up to
+    // the per-call limit.
+    size_t num_messages = 0;
+    *num_bytes = 0;
+    handles->clear();
+    for (MessageView& message_view : outgoing_messages_) {
+      if (num_messages == kMaxBatchWriteMessages)
+        break;
+      size_t num_handles = message_view.num_handles();
+      if (num_handles > 0 &&
+          handles->size() + num_handles > kPlatformChannelMaxNumHandles) {
+        if (num_messages > 0)
+          break;
 
-      messages.pop_front();
-      if (!outgoing_messages_.empty()) {
-        // The message was requeued by WriteNoLock(), so we have to wait for
-        // pipe to become writable again. Repopulate the message queue and exit.
-        DCHECK_EQ(outgoing_messages_.size(), 1u);
-        MessageView message_view = std::move(outgoing_messages_.front());
-        std::swap(messages, outgoing_messages_);
-        outgoing_messages_.push_front(std::move(message_view));
-        return true;
+        // Too many handles for one call. Send as many as fit with just the
+        // message's next byte. The rest follow with later bytes, and the
+        // receiver holds the message until all of them have arrived.
+        if (message_view.data_num_bytes() < 2) {
+          LOG(ERROR) << "Too many handles for message size.";
+          return 0;
+        }
+        iov[0].iov_base = const_cast<void*>(message_view.data());
+        iov[0].iov_len = 1;
+        *num_bytes = 1;
+        handles->assign(message_view.handles(),
+                        message_view.handles() +
+                            kPlatformChannelMaxNumHandles);
+        return 1;
+      }
+      iov[num_messages].iov_base = const_cast<void*>(message_view.data());
+      iov[num_messages].iov_len = message_view.data_num_bytes();
+      *num_bytes += message_view.data_num_bytes();
+      if (num_handles > 0) {
+        handles->insert(handles->end(), message_view.handles(),
+                        message_view.handles() + num_handles);
       }
+      ++num_messages;
     }
+    return num_messages;
+  }
 
-    return true;
+  // Accounts for |bytes_written| bytes and all |num_handles| handles of a
+  // batch of |num_messages| gathered by GatherWriteBatchNoLock() having been
+  // written, taking fully written messages off |outgoing_messages_|.
+  void OnWriteBatchCompleteNoLock(size_t num_messages,
+                                  size_t num_handles,
+                                  size_t bytes_written) {
+    size_t num_handles_left = num_handles;
+    for (size_t i = 0; i < num_messages && num_handles_left > 0; ++i) {
+      MessageView& message_view = outgoing_messages_[i];
+      size_t message_num_handles =
+          std::min(message_view.num_handles(), num_handles_left);
+      message_view.OnHandlesWritten(message_num_handles);
+      num_handles_left -= message_num_handles;
+    }
+
+    // The next frames of any frames written are queued once the written
+    // messages are all off the queue, since they may be queued ahead of the
+    // rest of the batch.
+    std::vector<MessagePtr> next_frames;
+    while (bytes_written > 0) {
+      MessageView& message_view = outgoing_messages_.front();
+      if (bytes_written < message_view.data_num_bytes()) {
+        message_view.advance_data_offset(bytes_written);
+        break;
+      }
+      bytes_written -= message_view.data_num_bytes();
+      MessageTracer::Record(message_view.trace_id(),
+                            MessageTracePoint::kChannelWriteDone);
+      MessagePtr next_frame = TakeNextFrameNoLock(*message_view.message());
+      if (next_frame)
+        next_frames.push_back(std::move(next_frame));
+      outgoing_messages_.pop_front();
+    }
+    for (MessagePtr& next_frame : next_frames)
+      EnqueueOutgoingMessageNoLock(std::move(next_frame));
+  }
+
+  // Writes as much of |outgoing_messages_| to |outgoing_ring_| as fits. If
+  // the ring fills up, the other end wakes us once it has made room.
+  bool FlushOutgoingMessagesToRingNoLock() {
+    // Until the shared memory has been received, messages just queue up.
+    if (!outgoing_ring_)
+      return true;
+
+    bool result = true;
+    bool wrote_data = false;
+    while (!outgoing_messages_.empty()) {
+      MessageView& message_view = outgoing_messages_.front();
+      // Send the handles before any of the message is visible in the ring,
+      // so the other end never waits on handles which aren't yet in flight.
+      // Each call carries a doorbell byte and as many handles as fit.
+      bool handles_written = true;
+      while (message_view.num_handles() > 0) {
+        size_t num_handles = std::min(message_view.num_handles(),
+                                      kPlatformChannelMaxNumHandles);
+        iovec iov = {const_cast<char*>(&kDoorbell), 1};
+        ssize_t send_result = PlatformChannelSendmsgWithHandles(
+            handle_.get(), &iov, 1, message_view.handles(), num_handles);
+        if (send_result < 0) {
+          if (errno != EAGAIN && errno != EWOULDBLOCK)
+            result = false;
+          else
+            WaitForWriteOnIOThreadNoLock();
+          handles_written = false;
+          break;
+        }
+        message_view.OnHandlesWritten(num_handles);
+      }
+      if (!handles_written)
+        break;
+
+      size_t bytes_written;
+      if (!outgoing_ring_->Write(message_view.data(),
+                                 message_view.data_num_bytes(),
+                                 &bytes_written)) {
+        LOG(ERROR) << "Invalid shared memory ring state.";
+        result = false;
+        break;
+      }
+      if (bytes_written > 0)
+        wrote_data = true;
+      if (bytes_written < message_view.data_num_bytes()) {
+        if (bytes_written > 0)
+          message_view.advance_data_offset(bytes_written);
+        if (outgoing_ring_->PrepareToWaitForSpace())
+          break;
+        continue;
+      }
+      MessageTracer::Record(message_view.trace_id(),
+                            MessageTracePoint::kChannelWriteDone);
+      MessagePtr next_frame = TakeNextFrameNoLock(*message_view.message());
+      outgoing_messages_.pop_front();
+      if (next_frame)
+        EnqueueOutgoingMessageNoLock(std::move(next_frame));
+    }
+
+    if (wrote_data && outgoing_ring_->TakeConsumerWakeup())
+      RingDoorbell();
+    return result;
   }
 
   // Keeps the Channel alive at least until explicit shutdown on the IO thread.
@@ -325,11 +1101,57 @@ class ChannelPosix : public Channel,
   std::deque<PlatformHandle> incoming_platform_handles_;
 
   // Protects |pending_write_| and |outgoing_messages_|.
-  base::Lock write_lock_;
+  ProfiledLock write_lock_;
   bool pending_write_ = false;
   bool reject_writes_ = false;
   std::deque<MessageView> outgoing_messages_;
 
+  // If true, Write() pushes onto |write_queue_| and all writes happen on the
+  // I/O thread.
+  const bool queue_writes_;
+  ChannelWriteQueue write_queue_;
+
+  const Transport transport_;
+
+  // See Channel::SetBusyPollTime(). Only used for the PLATFORM_HANDLE
+  // transport.
+  const uint64_t busy_poll_time_;
+
+  // Read state for the PLATFORM_HANDLE transport, only used on the I/O
+  // thread. The budget for each wakeup is counted from the bytes and messages
+  // read since it began; see kMaxBatchReadCapacity.
+  size_t read_size_hint_;
+  size_t wake_bytes_read_ = 0;
+  size_t wake_first_message_ = 0;
+
+  // io_uring state, used instead of the watchers when Channel::
+  // SetIoUringEnabled() was in effect at creation and the I/O thread has an
+  // IoUringLoop. The read state is only used on the I/O thread, the write
+  // state under |write_lock_| on the I/O thread.
+  base::WeakPtr<IoUringLoop> uring_;
+  UringOperation uring_read_;
+  bool uring_read_polling_ = false;
+  size_t next_read_size_ = 0;
+  msghdr uring_read_message_;
+  iovec uring_read_iov_;
+  char uring_read_control_[kHandleControlBufferSize];
+  UringOperation uring_write_;
+  bool uring_write_polling_ = false;
+  size_t uring_write_num_messages_ = 0;
+  std::vector<PlatformHandle> uring_write_handles_;
+  msghdr uring_write_message_;
+  iovec uring_write_iov_[kMaxBatchWriteMessages];
+  char uring_write_control_[kHandleControlBufferSize];
+
+  // Shared memory Channel state, set up by StartOnIOThread() on the initiating
+  // end and once the shared memory arrives on the accepting end. Both rings
+  // are set together under |write_lock_|. |outgoing_ring_| is only used under
+  // |write_lock_|, and |incoming_ring_| only on the I/O thread.
+  scoped_refptr<PlatformSharedBuffer> shared_buffer_;
+  scoped_ptr<PlatformSharedBufferMapping> shared_buffer_mapping_;
+  scoped_ptr<SharedMemoryRing> incoming_ring_;
+  scoped_ptr<SharedMemoryRing> outgoing_ring_;
+
   DISALLOW_COPY_AND_ASSIGN(ChannelPosix);
 };
 
@@ -339,8 +1161,10 @@ class ChannelPosix : public Channel,
 scoped_refptr<Channel> Channel::Create(
     Delegate* delegate,
     ScopedPlatformHandle platform_handle,
+    Transport transport,
     scoped_refptr<base::TaskRunner> io_task_runner) {
-  return new ChannelPosix(delegate, std::move(platform_handle), io_task_runner);
+  return new ChannelPosix(delegate, std::move(platform_handle), transport,
+                          io_task_runner);
 }
 
 }  // namespace edk
@@ -0,0 +1,635 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/channel.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "base/bind.h"
+#include "base/bind_helpers.h"
+#include "base/location.h"
+#include "base/macros.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/synchronization/condition_variable.h"
+#include "base/synchronization/lock.h"
+#include "base/synchronization/waitable_event.h"
+#include "base/test/test_io_thread.h"
+#include "base/threading/platform_thread.h"
+#include "base/time/time.h"
+#include "build/build_config.h"
+#include "mojo/edk/embedder/platform_channel_pair.h"
+#include "mojo/edk/embedder/platform_handle_vector.h"
+#include "mojo/edk/system/metrics_registry.h"
+#include "testing/gtest/include/gtest/gtest.h"
+#include "third_party/zlib/zlib.h"
+
+#if defined(OS_POSIX)
+#include <sys/uio.h>
+
+#include "mojo/edk/embedder/embedder_internal.h"
+#include "mojo/edk/embedder/platform_channel_utils_posix.h"
+#include "mojo/edk/embedder/platform_shared_buffer.h"
+#include "mojo/edk/embedder/platform_support.h"
+#include "mojo/edk/system/io_uring_loop.h"
+#include "mojo/edk/system/shared_memory_ring.h"
+#endif
+
+namespace mojo {
+namespace edk {
+namespace {
+
+// Mirrors the CompressedPayloadHeader in channel.cc.
+struct TestCompressedPayloadHeader {
+  uint32_t uncompressed_size;
+  uint32_t padding;
+};
+
+const size_t kCompressionThreshold = 1024;
+
+// A payload above the threshold which compresses well.
+std::string NewCompressiblePayload() {
+  std::string payload;
+  while (payload.size() < 64 * 1024)
+    payload += "The quick brown fox jumps over the lazy dog. ";
+  return payload;
+}
+
+std::string Compress(const std::string& data) {
+  uLongf compressed_size = compressBound(static_cast<uLong>(data.size()));
+  std::vector<Bytef> compressed(compressed_size);
+  EXPECT_EQ(Z_OK, compress2(compressed.data(), &compressed_size,
+                            reinterpret_cast<const Bytef*>(data.data()),
+                            static_cast<uLong>(data.size()), Z_BEST_SPEED));
+  return std::string(reinterpret_cast<const char*>(compressed.data()),
+                     compressed_size);
+}
+
+// Returns a payload as the writing Channel would compress it, with the given
+// declared uncompressed size and zlib data.
+std::string NewCompressedPayload(uint32_t uncompressed_size,
+                                 const std::string& compressed_data) {
+  TestCompressedPayloadHeader header;
+  header.uncompressed_size = uncompressed_size;
+  header.padding = 0;
+  return std::string(reinterpret_cast<const char*>(&header), sizeof(header)) +
+         compressed_data;
+}
+
+Channel::MessagePtr NewMessage(const std::string& payload, uint16_t flags) {
+  Channel::MessagePtr message =
+      Channel::Message::Create(payload.size(), nullptr);
+  if (!payload.empty())
+    memcpy(message->mutable_payload(), payload.data(), payload.size());
+  message->set_flags(flags);
+  return message;
+}
+
+// Returns a message carrying |num_handles| handles, each one end of a new
+// PlatformChannelPair.
+Channel::MessagePtr NewMessageWithHandles(const std::string& payload,
+                                          size_t num_handles) {
+  ScopedPlatformHandleVectorPtr handles;
+  if (num_handles) {
+    handles.reset(new PlatformHandleVector);
+    for (size_t i = 0; i < num_handles; ++i) {
+      PlatformChannelPair channel_pair;
+      handles->push_back(channel_pair.PassServerHandle().release());
+    }
+  }
+  Channel::MessagePtr message =
+      Channel::Message::Create(payload.size(), std::move(handles));
+  if (!payload.empty())
+    memcpy(message->mutable_payload(), payload.data(), payload.size());
+  return message;
+}
+
+// Returns a distinct payload for the |index|th of a series of messages.
+std::string NewIndexedPayload(size_t index, size_t size) {
+  std::string payload(size, static_cast<char>('a' + index % 26));
+  memcpy(&payload[0], &index, std::min(size, sizeof(index)));
+  return payload;
+}
+
+// Waits until nothing but the caller holds a reference to |channel|, which is
+// the case once it has shut down and all I/O it had in flight has completed.
+void WaitForLastReference(base::TestIOThread* io_thread, Channel* channel) {
+  while (!channel->HasOneRef()) {
+    io_thread->PostTaskAndWait(FROM_HERE, base::Bind(&base::DoNothing));
+    base::PlatformThread::Sleep(base::TimeDelta::FromMilliseconds(1));
+  }
+}
+
+// Holds up an I/O thread, and so every Channel on it, for as long as it
+// exists.
+class ScopedBlockIOThread {
+ public:
+  explicit ScopedBlockIOThread(base::TestIOThread* io_thread)
+      : blocked_(true, false), release_(new base::WaitableEvent(true, false)) {
+    io_thread->PostTask(FROM_HERE,
+                        base::Bind(&ScopedBlockIOThread::Block, &blocked_,
+                                   base::Owned(release_)));
+    blocked_.Wait();
+  }
+
+  ~ScopedBlockIOThread() { release_->Signal(); }
+
+ private:
+  static void Block(base::WaitableEvent* blocked,
+                    base::WaitableEvent* release) {
+    blocked->Signal();
+    release->Wait();
+  }
+
+  base::WaitableEvent blocked_;
+
+  // Owned by the blocking task, since the I/O thread may still be waking from
+  // it when this is destroyed.
+  base::WaitableEvent* release_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedBlockIOThread);
+};
+
+// Records the messages and errors a Channel gives its delegate. Called on the
+// I/O thread, and waited on from the test's.
+class TestChannelDelegate : public Channel::Delegate {
+ public:
+  TestChannelDelegate() : condition_(&lock_) {}
+  ~TestChannelDelegate() override {}
+
+  std::vector<std::string> WaitForMessages(size_t count) {
+    base::AutoLock lock(lock_);
+    while (messages_.size() < count)
+      condition_.Wait();
+    return messages_;
+  }
+
+  // Returns the messages received before the error.
+  std::vector<std::string> WaitForError() {
+    base::AutoLock lock(lock_);
+    while (!error_)
+      condition_.Wait();
+    return messages_;
+  }
+
+  // Returns the number of handles each message received so far came with.
+  std::vector<size_t> GetHandleCounts() {
+    base::AutoLock lock(lock_);
+    return handle_counts_;
+  }
+
+  // Channel::Delegate:
+  void OnChannelMessage(const void* payload,
+                        size_t payload_size,
+                        ScopedPlatformHandleVectorPtr handles) override {
+    base::AutoLock lock(lock_);
+    messages_.push_back(
+        std::string(static_cast<const char*>(payload), payload_size));
+    handle_counts_.push_back(handles ? handles->size() : 0);
+    condition_.Broadcast();
+  }
+  void OnChannelError() override {
+    base::AutoLock lock(lock_);
+    error_ = true;
+    condition_.Broadcast();
+  }
+
+ private:
+  base::Lock lock_;
+  base::ConditionVariable condition_;
+  std::vector<std::string> messages_;
+  std::vector<size_t> handle_counts_;
+  bool error_ = false;
+
+  DISALLOW_COPY_AND_ASSIGN(TestChannelDelegate);
+};
+
+// Runs a writer and a reader Channel, each on its own I/O thread so that
+// either can be held up while the other carries on.
+class ChannelTest : public testing::Test {
+ public:
+  ChannelTest()
+      : writer_io_thread_(base::TestIOThread::kAutoStart),
+        reader_io_thread_(base::TestIOThread::kAutoStart) {}
+  ~ChannelTest() override {}
+
+  void SetUp() override {
+    CreateChannels(Channel::Transport::PLATFORM_HANDLE,
+                   Channel::Transport::PLATFORM_HANDLE);
+    StartWriter();
+    StartReader();
+  }
+
+  void TearDown() override {
+    Channel::SetCompressionThreshold(0);
+    if (writer_)
+      writer_->ShutDown();
+    if (reader_)
+      reader_->ShutDown();
+    writer_io_thread_.PostTaskAndWait(FROM_HERE, base::Bind(&base::DoNothing));
+    reader_io_thread_.PostTaskAndWait(FROM_HERE, base::Bind(&base::DoNothing));
+  }
+
+ protected:
+  void CreateChannels(Channel::Transport writer_transport,
+                      Channel::Transport reader_transport) {
+    PlatformChannelPair channel_pair;
+    writer_ = Channel::Create(&writer_delegate_,
+                              channel_pair.PassServerHandle(),
+                              writer_transport,
+                              writer_io_thread_.task_runner());
+    reader_ = Channel::Create(&reader_delegate_,
+                              channel_pair.PassClientHandle(),
+                              reader_transport,
+                              reader_io_thread_.task_runner());
+  }
+
+  void StartWriter() {
+    writer_io_thread_.PostTaskAndWait(FROM_HERE,
+                                      base::Bind(&Channel::Start, writer_));
+  }
+
+  void StartReader() {
+    reader_io_thread_.PostTaskAndWait(FROM_HERE,
+                                      base::Bind(&Channel::Start, reader_));
+  }
+
+  // Writes a message flagged as compressed, which the writer doesn't touch
+  // since it hasn't enabled compression, and expects the reader to fail on it
+  // rather than pass anything on.
+  void ExpectCompressedPayloadRejected(const std::string& payload) {
+    writer_->Write(NewMessage(payload, Channel::Message::kFlagCompressed));
+    EXPECT_TRUE(reader_delegate_.WaitForError().empty());
+  }
+
+  // Writes |num_messages| messages of |payload_size| bytes each and expects
+  // the reader to receive them all, in order.
+  void WriteAndExpectMessages(size_t num_messages, size_t payload_size) {
+    for (size_t i = 0; i < num_messages; ++i)
+      writer_->Write(NewMessage(NewIndexedPayload(i, payload_size), 0));
+    ExpectMessages(num_messages, payload_size);
+  }
+
+  void ExpectMessages(size_t num_messages, size_t payload_size) {
+    std::vector<std::string> messages =
+        reader_delegate_.WaitForMessages(num_messages);
+    ASSERT_EQ(num_messages, messages.size());
+    for (size_t i = 0; i < num_messages; ++i)
+      EXPECT_EQ(NewIndexedPayload(i, payload_size), messages[i]);
+  }
+
+  base::TestIOThread writer_io_thread_;
+  base::TestIOThread reader_io_thread_;
+  TestChannelDelegate writer_delegate_;
+  TestChannelDelegate reader_delegate_;
+  scoped_refptr<Channel> writer_;
+  scoped_refptr<Channel> reader_;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(ChannelTest);
+};
+
+TEST_F(ChannelTest, CompressedMessageRoundTrip) {
+  Channel::SetCompressionThreshold(kCompressionThreshold);
+  writer_->EnableCompression();
+
+  MetricsRegistry::Snapshot before;
+  MetricsRegistry::GetSnapshot(&before);
+
+  const std::string kSmallPayload = "below the threshold";
+  const std::string large_payload = NewCompressiblePayload();
+  writer_->Write(NewMessage(large_payload, 0));
+  writer_->Write(NewMessage(kSmallPayload, 0));
+
+  std::vector<std::string> messages = reader_delegate_.WaitForMessages(2);
+  ASSERT_EQ(2u, messages.size());
+  EXPECT_EQ(large_payload, messages[0]);
+  EXPECT_EQ(kSmallPayload, messages[1]);
+
+  // Only the large message was compressed.
+  MetricsRegistry::Snapshot after;
+  MetricsRegistry::GetSnapshot(&after);
+  const MetricsRegistry::Counter kCounter =
+      MetricsRegistry::kChannelMessagesCompressed;
+  EXPECT_EQ(1u, after.counters[kCounter] - before.counters[kCounter]);
+}
+
+TEST_F(ChannelTest, Stats) {
+  const std::string kPayload = "hello";
+  writer_->Write(NewMessage(kPayload, 0));
+  writer_->Write(NewMessage(kPayload + kPayload, 0));
+  ASSERT_EQ(2u, reader_delegate_.WaitForMessages(2).size());
+
+  Channel::Stats writer_stats;
+  writer_->GetStats(&writer_stats);
+  EXPECT_EQ(2u, writer_stats.messages_written);
+  EXPECT_EQ(0u, writer_stats.handles_written);
+  EXPECT_EQ(0u, writer_stats.messages_read);
+
+  Channel::Stats reader_stats;
+  reader_->GetStats(&reader_stats);
+  EXPECT_EQ(0u, reader_stats.messages_written);
+  EXPECT_EQ(2u, reader_stats.messages_read);
+  EXPECT_EQ(writer_stats.bytes_written, reader_stats.bytes_read);
+  EXPECT_GE(reader_stats.bytes_read, 3 * kPayload.size());
+  EXPECT_EQ(0u, reader_stats.handles_read);
+}
+
+TEST_F(ChannelTest, CompressedPayloadTooShortForHeader) {
+  ExpectCompressedPayloadRejected("abc");
+}
+
+TEST_F(ChannelTest, CorruptCompressedPayload) {
+  const std::string payload = NewCompressiblePayload();
+  std::string compressed = Compress(payload);
+  for (size_t i = compressed.size() / 4; i < compressed.size(); i += 7)
+    compressed[i] = static_cast<char>(~compressed[i]);
+  ExpectCompressedPayloadRejected(NewCompressedPayload(
+      static_cast<uint32_t>(payload.size()), compressed));
+}
+
+TEST_F(ChannelTest, TruncatedCompressedPayload) {
+  const std::string payload = NewCompressiblePayload();
+  const std::string compressed = Compress(payload);
+  ExpectCompressedPayloadRejected(NewCompressedPayload(
+      static_cast<uint32_t>(payload.size()),
+      compressed.substr(0, compressed.size() / 2)));
+}
+
+TEST_F(ChannelTest, CompressedPayloadLargerThanDeclared) {
+  const std::string payload = NewCompressiblePayload();
+  ExpectCompressedPayloadRejected(NewCompressedPayload(
+      static_cast<uint32_t>(payload.size() - 1), Compress(payload)));
+}
+
+TEST_F(ChannelTest, CompressedPayloadSmallerThanDeclared) {
+  const std::string payload = NewCompressiblePayload();
+  ExpectCompressedPayloadRejected(NewCompressedPayload(
+      static_cast<uint32_t>(payload.size() + 1), Compress(payload)));
+}
+
+TEST_F(ChannelTest, CompressedPayloadDeclaredTooLarge) {
+  ExpectCompressedPayloadRejected(NewCompressedPayload(
+      std::numeric_limits<uint32_t>::max(), Compress("abc")));
+}
+
+#if defined(OS_POSIX)
+
+// Runs both Channels on io_uring where the kernel supports it. Each test
+// returns early otherwise.
+class ChannelIoUringTest : public ChannelTest {
+ public:
+  ChannelIoUringTest() {}
+  ~ChannelIoUringTest() override {}
+
+  void SetUp() override {
+    Channel::SetIoUringEnabled(true);
+    ChannelTest::SetUp();
+  }
+
+  void TearDown() override {
+    ChannelTest::TearDown();
+    Channel::SetIoUringEnabled(false);
+  }
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(ChannelIoUringTest);
+};
+
+void StartChannels(const std::vector<scoped_refptr<Channel>>* channels) {
+  for (const scoped_refptr<Channel>& channel : *channels)
+    channel->Start();
+}
+
+TEST_F(ChannelIoUringTest, MessagesWithHandles) {
+  if (!IoUringLoop::IsSupported())
+    return;
+
+  const size_t kNumMessages = 8;
+  for (size_t i = 0; i < kNumMessages; ++i)
+    writer_->Write(NewMessageWithHandles(NewIndexedPayload(i, 16), i % 4));
+  std::vector<std::string> messages =
+      reader_delegate_.WaitForMessages(kNumMessages);
+  std::vector<size_t> handle_counts = reader_delegate_.GetHandleCounts();
+  ASSERT_EQ(kNumMessages, messages.size());
+  ASSERT_EQ(kNumMessages, handle_counts.size());
+  for (size_t i = 0; i < kNumMessages; ++i) {
+    EXPECT_EQ(NewIndexedPayload(i, 16), messages[i]);
+    EXPECT_EQ(i % 4, handle_counts[i]);
+  }
+
+  // And the other way.
+  reader_->Write(NewMessageWithHandles("reply", 2));
+  messages = writer_delegate_.WaitForMessages(1);
+  handle_counts = writer_delegate_.GetHandleCounts();
+  ASSERT_EQ(1u, messages.size());
+  ASSERT_EQ(1u, handle_counts.size());
+  EXPECT_EQ("reply", messages[0]);
+  EXPECT_EQ(2u, handle_counts[0]);
+}
+
+TEST_F(ChannelIoUringTest, FallBackToPollWhenSocketFull) {
+  if (!IoUringLoop::IsSupported())
+    return;
+
+  // With the reader held up, the writes fill the socket buffer, the writer's
+  // sends return EAGAIN, and it has to wait for POLLOUT to carry on. The
+  // reader's receives likewise wait for POLLIN whenever it has drained the
+  // socket.
+  const size_t kNumMessages = 64;
+  const size_t kPayloadSize = 64 * 1024;
+  {
+    ScopedBlockIOThread block_reader(&reader_io_thread_);
+    for (size_t i = 0; i < kNumMessages; ++i)
+      writer_->Write(NewMessage(NewIndexedPayload(i, kPayloadSize), 0));
+    writer_io_thread_.PostTaskAndWait(FROM_HERE, base::Bind(&base::DoNothing));
+  }
+  ExpectMessages(kNumMessages, kPayloadSize);
+}
+
+TEST_F(ChannelIoUringTest, ShutDownWithOperationsInFlight) {
+  if (!IoUringLoop::IsSupported())
+    return;
+
+  // The reader always has a receive in flight, and with the reader held up
+  // the writer is left with a send or a poll in flight too. Shutting down must
+  // cancel both, and each Channel must be released once they complete.
+  {
+    ScopedBlockIOThread block_reader(&reader_io_thread_);
+    for (size_t i = 0; i < 64; ++i)
+      writer_->Write(NewMessage(NewIndexedPayload(i, 64 * 1024), 0));
+    writer_io_thread_.PostTaskAndWait(FROM_HERE, base::Bind(&base::DoNothing));
+    writer_->ShutDown();
+    reader_->ShutDown();
+  }
+  WaitForLastReference(&writer_io_thread_, writer_.get());
+  WaitForLastReference(&reader_io_thread_, reader_.get());
+  writer_ = nullptr;
+  reader_ = nullptr;
+}
+
+TEST_F(ChannelIoUringTest, MoreOperationsThanQueueEntries) {
+  if (!IoUringLoop::IsSupported())
+    return;
+
+  // Starting this many Channels in a single task queues more receives than
+  // the submission queue has entries (512), all before the I/O thread gets
+  // back to its message loop.
+  const size_t kNumChannelPairs = 300;
+  std::vector<scoped_ptr<TestChannelDelegate>> delegates;
+  std::vector<scoped_refptr<Channel>> channels;
+  for (size_t i = 0; i < kNumChannelPairs; ++i) {
+    PlatformChannelPair channel_pair;
+    delegates.push_back(make_scoped_ptr(new TestChannelDelegate));
+    channels.push_back(Channel::Create(delegates.back().get(),
+                                       channel_pair.PassServerHandle(),
+                                       writer_io_thread_.task_runner()));
+    delegates.push_back(make_scoped_ptr(new TestChannelDelegate));
+    channels.push_back(Channel::Create(delegates.back().get(),
+                                       channel_pair.PassClientHandle(),
+                                       writer_io_thread_.task_runner()));
+  }
+  writer_io_thread_.PostTaskAndWait(FROM_HERE,
+                                    base::Bind(&StartChannels, &channels));
+
+  for (size_t i = 0; i < channels.size(); i += 2)
+    channels[i]->Write(NewMessage(NewIndexedPayload(i, 16), 0));
+  for (size_t i = 0; i < channels.size(); i += 2) {
+    std::vector<std::string> messages = delegates[i + 1]->WaitForMessages(1);
+    ASSERT_EQ(1u, messages.size());
+    EXPECT_EQ(NewIndexedPayload(i, 16), messages[0]);
+  }
+
+  for (const scoped_refptr<Channel>& channel : channels)
+    channel->ShutDown();
+  for (const scoped_refptr<Channel>& channel : channels)
+    WaitForLastReference(&writer_io_thread_, channel.get());
+}
+
+// Mirror the shared memory transport in channel_posix.cc.
+const size_t kSharedMemoryRingCapacity = 256 * 1024;
+const char kDoorbell = 0;
+
+// Runs a shared memory writer which accepts the buffer, so that it has to
+// queue anything written before the reader, which creates the buffer, starts.
+// Each test starts the Channels itself.
+class SharedMemoryChannelTest : public ChannelTest {
+ public:
+  SharedMemoryChannelTest() {}
+  ~SharedMemoryChannelTest() override {}
+
+  void SetUp() override {}
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(SharedMemoryChannelTest);
+};
+
+TEST_F(SharedMemoryChannelTest, WritesQueuedBeforeBufferArrives) {
+  CreateChannels(Channel::Transport::SHARED_MEMORY_ACCEPTOR,
+                 Channel::Transport::SHARED_MEMORY_INITIATOR);
+  StartWriter();
+  for (size_t i = 0; i < 3; ++i)
+    writer_->Write(NewMessage(NewIndexedPayload(i, 100), 0));
+  writer_io_thread_.PostTaskAndWait(FROM_HERE, base::Bind(&base::DoNothing));
+
+  StartReader();
+  ExpectMessages(3, 100);
+
+  // Once the buffer is in place, writes go straight to the ring.
+  writer_->Write(NewMessage("after", 0));
+  std::vector<std::string> messages = reader_delegate_.WaitForMessages(4);
+  ASSERT_EQ(4u, messages.size());
+  EXPECT_EQ("after", messages[3]);
+}
+
+TEST_F(SharedMemoryChannelTest, FullRingWaitsForDoorbell) {
+  CreateChannels(Channel::Transport::SHARED_MEMORY_ACCEPTOR,
+                 Channel::Transport::SHARED_MEMORY_INITIATOR);
+  StartWriter();
+  StartReader();
+
+  // With the reader held up, the writer fills the ring and has to wait for
+  // the reader to ring the doorbell once it has made space.
+  const size_t kPayloadSize = 64 * 1024;
+  const size_t kNumMessages = 4 * kSharedMemoryRingCapacity / kPayloadSize;
+  {
+    ScopedBlockIOThread block_reader(&reader_io_thread_);
+    for (size_t i = 0; i < kNumMessages; ++i)
+      writer_->Write(NewMessage(NewIndexedPayload(i, kPayloadSize), 0));
+    writer_io_thread_.PostTaskAndWait(FROM_HERE, base::Bind(&base::DoNothing));
+  }
+  ExpectMessages(kNumMessages, kPayloadSize);
+}
+
+TEST_F(SharedMemoryChannelTest, HandlesArriveBeforeRingBytes) {
+  CreateChannels(Channel::Transport::SHARED_MEMORY_ACCEPTOR,
+                 Channel::Transport::SHARED_MEMORY_INITIATOR);
+  StartWriter();
+  StartReader();
+
+  // The handles go over the socket ahead of the messages' bytes in the ring.
+  // Holding up the reader lets them all pile up before it reads either.
+  const size_t kNumMessages = 8;
+  {
+    ScopedBlockIOThread block_reader(&reader_io_thread_);
+    for (size_t i = 0; i < kNumMessages; ++i)
+      writer_->Write(NewMessageWithHandles(NewIndexedPayload(i, 16), i % 4));
+    writer_io_thread_.PostTaskAndWait(FROM_HERE, base::Bind(&base::DoNothing));
+  }
+  std::vector<std::string> messages =
+      reader_delegate_.WaitForMessages(kNumMessages);
+  std::vector<size_t> handle_counts = reader_delegate_.GetHandleCounts();
+  ASSERT_EQ(kNumMessages, messages.size());
+  ASSERT_EQ(kNumMessages, handle_counts.size());
+  for (size_t i = 0; i < kNumMessages; ++i) {
+    EXPECT_EQ(NewIndexedPayload(i, 16), messages[i]);
+    EXPECT_EQ(i % 4, handle_counts[i]);
+  }
+}
+
+TEST_F(SharedMemoryChannelTest, CorruptRingOffset) {
+  // The test plays the initiator, handing the reader a buffer whose ring
+  // claims to hold more than its capacity.
+  PlatformChannelPair channel_pair;
+  ScopedPlatformHandle initiator_handle = channel_pair.PassServerHandle();
+  reader_ = Channel::Create(&reader_delegate_, channel_pair.PassClientHandle(),
+                            Channel::Transport::SHARED_MEMORY_ACCEPTOR,
+                            reader_io_thread_.task_runner());
+  StartReader();
+
+  const size_t kMemorySize =
+      2 * SharedMemoryRing::GetRequiredMemorySize(kSharedMemoryRingCapacity);
+  scoped_refptr<PlatformSharedBuffer> buffer =
+      internal::g_platform_support->CreateSharedBuffer(kMemorySize);
+  ASSERT_TRUE(buffer);
+  scoped_ptr<PlatformSharedBufferMapping> mapping =
+      buffer->Map(0, kMemorySize);
+  ASSERT_TRUE(mapping);
+
+  // The initiator's ring comes first, and starts with its write offset.
+  uint32_t* write_offset = static_cast<uint32_t*>(mapping->GetBase());
+  *write_offset = static_cast<uint32_t>(kSharedMemoryRingCapacity + 1);
+
+  ScopedPlatformHandle buffer_handle = buffer->DuplicatePlatformHandle();
+  ASSERT_TRUE(buffer_handle.is_valid());
+  PlatformHandle platform_handle = buffer_handle.get();
+  iovec iov = {const_cast<char*>(&kDoorbell), 1};
+  ASSERT_EQ(1, PlatformChannelSendmsgWithHandles(initiator_handle.get(), &iov,
+                                                 1, &platform_handle, 1));
+  ASSERT_EQ(1, PlatformChannelWrite(initiator_handle.get(), &kDoorbell, 1));
+
+  EXPECT_TRUE(reader_delegate_.WaitForError().empty());
+}
+
+#endif  // defined(OS_POSIX)
+
+}  // namespace
+}  // namespace edk
+}  // namespace mojo
@@ -8,6 +8,7 @@
 
 #include <algorithm>
 #include <deque>
+#include <vector>
 
 #include "base/bind.h"
 #include "base/location.h"
@@ -15,63 +16,51 @@
 #include "base/memory/ref_counted.h"
 #include "base/memory/scoped_ptr.h"
 #include "base/message_loop/message_loop.h"
-#include "base/synchronization/lock.h"
 #include "base/task_runner.h"
 #include "mojo/edk/embedder/platform_handle_vector.h"
+#include "mojo/edk/system/message_tracer.h"
+#include "mojo/edk/system/profiled_lock.h"
 
 namespace mojo {
 namespace edk {
 
 namespace {
 
+// Reads start at this size, and grow towards kMaxBatchReadCapacity while they
+// keep filling the buffer.
+const size_t kInitialReadSize = 4096;
 const size_t kMaxBatchReadCapacity = 256 * 1024;
 
-// A view over a Channel::Message object. The write queue uses these since
-// large messages may need to be sent in chunks.
-class MessageView {
- public:
-  // Owns |message|. |offset| indexes the first unsent byte in the message.
-  MessageView(Channel::MessagePtr message, size_t offset)
-      : message_(std::move(message)),
-        offset_(offset),
-        handles_(message_->TakeHandles()) {
-    DCHECK_GT(message_->data_num_bytes(), offset_);
-  }
-
-  MessageView(MessageView&& other) { *this = std::move(other); }
-
-  MessageView& operator=(MessageView&& other) {
-    message_ = std::move(other.message_);
-    offset_ = other.offset_;
-    handles_ = std::move(other.handles_);
-    return *this;
-  }
+// The number of WriteFile calls which may be in flight at once. While they all
+// are, further messages queue up and are coalesced into the next write.
+const size_t kMaxPendingWrites = 4;
 
-  ~MessageView() {}
+// Once all but one of the writes are in flight, messages smaller than this
+// are copied together into the last one, up to this many bytes. Until then,
+// and for larger messages, each is written straight from its own buffer.
+const size_t kMaxCoalescedWriteSize = 64 * 1024;
 
-  const void* data() const {
-    return static_cast<const char*>(message_->data()) + offset_;
-  }
-
-  size_t data_num_bytes() const { return message_->data_num_bytes() - offset_; }
+// An overlapped WriteFile in flight, and the bytes it is writing.
+struct PendingWrite {
+  PendingWrite() { memset(&context, 0, sizeof(context)); }
 
-  size_t data_offset() const { return offset_; }
-  void advance_data_offset(size_t num_bytes) {
-    DCHECK_GE(message_->data_num_bytes(), offset_ + num_bytes);
-    offset_ += num_bytes;
+  void Reset() {
+    in_use = false;
+    buffer.clear();
+    message.reset();
+    trace_ids.clear();
   }
 
-  bool has_handles() const { return handles_; }
+  base::MessageLoopForIO::IOContext context;
+  bool in_use = false;
 
-  ScopedPlatformHandleVectorPtr TakeHandles() { return std::move(handles_); }
-  Channel::MessagePtr TakeMessage() { return std::move(message_); }
+  // Either the messages copied into |buffer|, or |message| alone.
+  std::vector<char> buffer;
+  Channel::MessagePtr message;
+  size_t num_bytes = 0;
 
- private:
-  Channel::MessagePtr message_;
-  size_t offset_;
-  ScopedPlatformHandleVectorPtr handles_;
-
-  DISALLOW_COPY_AND_ASSIGN(MessageView);
+  // Of the messages written, for MessageTracePoint::kChannelWriteDone.
+  std::vector<uint32_t> trace_ids;
 };
 
 class ChannelWin : public Channel,
@@ -84,12 +73,13 @@ class ChannelWin : public Channel,
       : Channel(delegate),
         self_(this),
         handle_(std::move(handle)),
-        io_task_runner_(io_task_runner) {
+        io_task_runner_(io_task_runner),
+        write_lock_("Channel::write_lock_") {
     memset(&read_context_, 0, sizeof(read_context_));
     read_context_.handler = this;
 
-    memset(&write_context_, 0, sizeof(write_context_));
-    write_context_.handler = this;
+    for (PendingWrite& write : pending_writes_)
+      write.context.handler = this;
   }
 
   void Start() override {
@@ -107,16 +97,16 @@ class ChannelWin : public Channel,
   }
 
   void Write(MessagePtr message) override {
+    message = MaybeCompressMessage(std::move(message));
+    RecordMessageWritten(*message);
     bool write_error = false;
     {
-      base::AutoLock lock(write_lock_);
+      ProfiledAutoLock lock(write_lock_);
       if (reject_writes_)
         return;
 
-      bool write_now = !delay_writes_ && outgoing_messages_.empty();
-      outgoing_messages_.emplace_back(std::move(message), 0);
-
-      if (write_now && !WriteNoLock(outgoing_messages_.front()))
+      EnqueueOutgoingMessageNoLock(std::move(message));
+      if (!delay_writes_ && !WriteNextNoLock())
         reject_writes_ = write_error = true;
     }
     if (write_error) {
@@ -127,6 +117,10 @@ class ChannelWin : public Channel,
     }
   }
 
+  ScopedPlatformHandle DuplicatePlatformHandle() override {
+    return ScopedPlatformHandle();
+  }
+
   ScopedPlatformHandleVectorPtr GetReadPlatformHandles(
       size_t num_handles) override {
     if (incoming_platform_handles_.size() < num_handles)
@@ -154,7 +148,7 @@ class ChannelWin : public Channel,
 
     // Now that we have registered our IOHandler, we can start writing.
     {
-      base::AutoLock lock(write_lock_);
+      ProfiledAutoLock lock(write_lock_);
       if (delay_writes_) {
         delay_writes_ = false;
         WriteNextNoLock();
@@ -187,18 +181,29 @@ class ChannelWin : public Channel,
   void OnIOCompleted(base::MessageLoopForIO::IOContext* context,
                      DWORD bytes_transfered,
                      DWORD error) override {
-    if (error != ERROR_SUCCESS) {
-      OnError();
-    } else if (context == &read_context_) {
-      OnReadDone(static_cast<size_t>(bytes_transfered));
+    if (context == &read_context_) {
+      if (error == ERROR_SUCCESS)
+        OnReadDone(static_cast<size_t>(bytes_transfered));
+      else
+        OnError();
     } else {
-      CHECK(context == &write_context_);
-      OnWriteDone(static_cast<size_t>(bytes_transfered));
+      size_t bytes_written =
+          error == ERROR_SUCCESS ? static_cast<size_t>(bytes_transfered) : 0;
+      OnWriteDone(GetPendingWrite(context), bytes_written);
     }
     Release();  // Balancing reference taken after ReadFile / WriteFile.
   }
 
   void OnReadDone(size_t bytes_read) {
+    // Reads go straight into the read buffer unless they are for the rest of
+    // a large message, in which case they don't tell us much.
+    if (read_capacity_ == read_size_) {
+      if (bytes_read == read_capacity_)
+        read_size_ = std::min(read_size_ * 2, kMaxBatchReadCapacity);
+      else if (bytes_read < read_size_ / 4)
+        read_size_ = std::max(read_size_ / 2, kInitialReadSize);
+    }
+
     if (bytes_read > 0) {
       size_t next_read_size = 0;
       if (OnReadComplete(bytes_read, &next_read_size)) {
@@ -211,22 +216,36 @@ class ChannelWin : public Channel,
     }
   }
 
-  void OnWriteDone(size_t bytes_written) {
-    if (bytes_written == 0)
-      return;
+  PendingWrite* GetPendingWrite(base::MessageLoopForIO::IOContext* context) {
+    for (PendingWrite& write : pending_writes_) {
+      if (context == &write.context)
+        return &write;
+    }
+    NOTREACHED();
+    return nullptr;
+  }
 
+  // |bytes_written| is zero if the write failed.
+  void OnWriteDone(PendingWrite* write, size_t bytes_written) {
     bool write_error = false;
     {
-      base::AutoLock lock(write_lock_);
-
-      DCHECK(!outgoing_messages_.empty());
-
-      MessageView& message_view = outgoing_messages_.front();
-      message_view.advance_data_offset(bytes_written);
-      if (message_view.data_num_bytes() == 0)
-        outgoing_messages_.pop_front();
+      ProfiledAutoLock lock(write_lock_);
+      DCHECK(write->in_use);
+
+      // Overlapped writes to a pipe complete in full or not at all. Anything
+      // else would leave a gap in the stream, since later writes may already
+      // be in flight.
+      if (bytes_written == write->num_bytes) {
+        for (uint32_t trace_id : write->trace_ids)
+          MessageTracer::Record(trace_id, MessageTracePoint::kChannelWriteDone);
+      } else {
+        write_error = !reject_writes_;
+        reject_writes_ = true;
+      }
+      write->Reset();
+      --num_pending_writes_;
 
-      if (!WriteNextNoLock())
+      if (!reject_writes_ && !WriteNextNoLock())
         reject_writes_ = write_error = true;
     }
     if (write_error)
@@ -234,9 +253,10 @@ class ChannelWin : public Channel,
   }
 
   void ReadMore(size_t next_read_size_hint) {
-    size_t buffer_capacity = next_read_size_hint;
+    size_t buffer_capacity = std::max(next_read_size_hint, read_size_);
     char* buffer = GetReadBuffer(&buffer_capacity);
     DCHECK_GT(buffer_capacity, 0u);
+    read_capacity_ = buffer_capacity;
 
     BOOL ok = ReadFile(handle_.get().handle,
                        buffer,
@@ -251,32 +271,95 @@ class ChannelWin : public Channel,
     }
   }
 
-  // Attempts to write a message directly to the channel. If the full message
-  // cannot be written, it's queued and a wait is initiated to write the message
-  // ASAP on the I/O thread.
-  bool WriteNoLock(const MessageView& message_view) {
-    if (message_view.has_handles()) {
-      DCHECK(false) << "not implemented";
-      return false;
+  // Queues |message|, or its first frame, on |outgoing_messages_| behind every
+  // message of the same or an earlier priority. Messages already handed to
+  // WriteFile have left the queue, so anything still on it may be overtaken.
+  void EnqueueOutgoingMessageNoLock(MessagePtr message) {
+    message = FragmentMessageNoLock(std::move(message));
+    if (!message)
+      return;
+    auto it = outgoing_messages_.end();
+    while (it != outgoing_messages_.begin() &&
+           (*(it - 1))->priority() > message->priority()) {
+      --it;
     }
+    outgoing_messages_.insert(it, std::move(message));
+  }
 
-    BOOL ok = WriteFile(handle_.get().handle,
-                        message_view.data(),
-                        static_cast<DWORD>(message_view.data_num_bytes()),
-                        NULL,
-                        &write_context_.overlapped);
-
-    if (ok || GetLastError() == ERROR_IO_PENDING) {
+  // Starts writes of queued messages for as long as there are any and fewer
+  // than kMaxPendingWrites writes are in flight. Returns false on error.
+  bool WriteNextNoLock() {
+    while (!outgoing_messages_.empty() &&
+           num_pending_writes_ < kMaxPendingWrites) {
+      PendingWrite* write = nullptr;
+      for (PendingWrite& pending_write : pending_writes_) {
+        if (!pending_write.in_use) {
+          write = &pending_write;
+          break;
+        }
+      }
+      DCHECK(write);
+
+      if (!PrepareWriteNoLock(write))
+        return false;
+
+      const void* data = write->message ? write->message->data()
+                                        : write->buffer.data();
+      write->in_use = true;
+      ++num_pending_writes_;
+      BOOL ok = WriteFile(handle_.get().handle,
+                          data,
+                          static_cast<DWORD>(write->num_bytes),
+                          NULL,
+                          &write->context.overlapped);
+      if (!ok && GetLastError() != ERROR_IO_PENDING) {
+        write->Reset();
+        --num_pending_writes_;
+        return false;
+      }
       AddRef();  // Will be balanced in OnIOCompleted.
-      return true;
     }
-    return false;
+    return true;
   }
 
-  bool WriteNextNoLock() {
-    if (outgoing_messages_.empty())
-      return true;
-    return WriteNoLock(outgoing_messages_.front());
+  // Moves the next message from |outgoing_messages_| into |write|, or if it's
+  // the last write not in flight, as many small ones as fit in
+  // kMaxCoalescedWriteSize bytes. Copying them only pays off when they would
+  // otherwise wait for a write to complete.
+  bool PrepareWriteNoLock(PendingWrite* write) {
+    const bool coalesce = num_pending_writes_ + 1 == kMaxPendingWrites;
+    while (!outgoing_messages_.empty()) {
+      MessagePtr& message = outgoing_messages_.front();
+      if (message->num_handles()) {
+        DCHECK(false) << "not implemented";
+        return false;
+      }
+
+      size_t num_bytes = message->data_num_bytes();
+      if (write->buffer.empty() &&
+          (!coalesce || num_bytes >= kMaxCoalescedWriteSize)) {
+        write->trace_ids.push_back(message->trace_id());
+        write->num_bytes = num_bytes;
+        MessagePtr next_frame = TakeNextFrameNoLock(*message);
+        write->message = std::move(message);
+        outgoing_messages_.pop_front();
+        if (next_frame)
+          EnqueueOutgoingMessageNoLock(std::move(next_frame));
+        return true;
+      }
+      if (write->buffer.size() + num_bytes > kMaxCoalescedWriteSize)
+        break;
+
+      const char* data = static_cast<const char*>(message->data());
+      write->buffer.insert(write->buffer.end(), data, data + num_bytes);
+      write->trace_ids.push_back(message->trace_id());
+      MessagePtr next_frame = TakeNextFrameNoLock(*message);
+      outgoing_messages_.pop_front();
+      if (next_frame)
+        EnqueueOutgoingMessageNoLock(std::move(next_frame));
+    }
+    write->num_bytes = write->buffer.size();
+    return true;
   }
 
   // Keeps the Channel alive at least until explicit shutdown on the IO thread.
@@ -286,17 +369,27 @@ class ChannelWin : public Channel,
   scoped_refptr<base::TaskRunner> io_task_runner_;
 
   base::MessageLoopForIO::IOContext read_context_;
-  base::MessageLoopForIO::IOContext write_context_;
+
+  // These must only be accessed on the IO thread. |read_size_| is the size of
+  // the next read into the read buffer, and |read_capacity_| that of the read
+  // in flight.
+  size_t read_size_ = kInitialReadSize;
+  size_t read_capacity_ = 0;
 
   std::deque<PlatformHandle> incoming_platform_handles_;
 
-  // Protects |reject_writes_| and |outgoing_messages_|.
-  base::Lock write_lock_;
+  // Protects the fields below.
+  ProfiledLock write_lock_;
 
   bool delay_writes_ = true;
 
   bool reject_writes_ = false;
-  std::deque<MessageView> outgoing_messages_;
+
+  // Messages not yet handed to WriteFile.
+  std::deque<MessagePtr> outgoing_messages_;
+
+  PendingWrite pending_writes_[kMaxPendingWrites];
+  size_t num_pending_writes_ = 0;
 
   DISALLOW_COPY_AND_ASSIGN(ChannelWin);
 };
@@ -307,7 +400,11 @@ class ChannelWin : public Channel,
 scoped_refptr<Channel> Channel::Create(
     Delegate* delegate,
     ScopedPlatformHandle platform_handle,
+    Transport transport,
     scoped_refptr<base::TaskRunner> io_task_runner) {
+  // Shared memory transport isn't implemented here, so every Channel goes
+  // through the platform handle. Since this applies to both ends, the ends
+  // always agree.
   return new ChannelWin(delegate, std::move(platform_handle), io_task_runner);
 }
 
@@ -0,0 +1,70 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/channel_write_queue.h"
+
+#include <algorithm>
+
+namespace mojo {
+namespace edk {
+
+namespace {
+
+using base::subtle::AtomicWord;
+
+Channel::Message* ToMessage(AtomicWord word) {
+  return reinterpret_cast<Channel::Message*>(word);
+}
+
+AtomicWord ToAtomicWord(Channel::Message* message) {
+  return reinterpret_cast<AtomicWord>(message);
+}
+
+}  // namespace
+
+ChannelWriteQueue::ChannelWriteQueue() {}
+
+ChannelWriteQueue::~ChannelWriteQueue() {
+  std::vector<Channel::MessagePtr> messages;
+  PopAll(&messages);
+}
+
+bool ChannelWriteQueue::Push(Channel::MessagePtr message) {
+  Channel::Message* new_head = message.release();
+  AtomicWord head = base::subtle::NoBarrier_Load(&head_);
+  for (;;) {
+    new_head->next_queued_ = ToMessage(head);
+    AtomicWord previous_head = base::subtle::Release_CompareAndSwap(
+        &head_, head, ToAtomicWord(new_head));
+    if (previous_head == head)
+      return head == 0;
+    head = previous_head;
+  }
+}
+
+void ChannelWriteQueue::PopAll(std::vector<Channel::MessagePtr>* messages) {
+  // The acquire pairs with the release in Push() so that the contents of
+  // every message are visible here. Producers only ever add to the stack, so
+  // the swap can only fail because a new message was pushed.
+  AtomicWord head = base::subtle::NoBarrier_Load(&head_);
+  while (head) {
+    AtomicWord previous_head =
+        base::subtle::Acquire_CompareAndSwap(&head_, head, 0);
+    if (previous_head == head)
+      break;
+    head = previous_head;
+  }
+
+  size_t first_new_message = messages->size();
+  for (Channel::Message* message = ToMessage(head); message;) {
+    Channel::Message* next = message->next_queued_;
+    message->next_queued_ = nullptr;
+    messages->emplace_back(message);
+    message = next;
+  }
+  std::reverse(messages->begin() + first_new_message, messages->end());
+}
+
+}  // namespace edk
+}  // namespace mojo
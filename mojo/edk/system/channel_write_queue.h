@@ -0,0 +1,51 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_SYSTEM_CHANNEL_WRITE_QUEUE_H_
+#define MOJO_EDK_SYSTEM_CHANNEL_WRITE_QUEUE_H_
+
+#include <vector>
+
+#include "base/atomicops.h"
+#include "base/macros.h"
+#include "mojo/edk/system/channel.h"
+
+namespace mojo {
+namespace edk {
+
+// A lock-free queue of outgoing Channel messages. Any number of threads may
+// push messages concurrently, while a single consumer (the Channel's I/O
+// thread) drains everything queued so far in one go.
+//
+// Messages are linked through an intrusive pointer, so pushing never
+// allocates. Producers push onto a stack with a single compare-and-swap; the
+// consumer atomically takes the whole stack and reverses it, which restores
+// the order in which messages were pushed.
+class ChannelWriteQueue {
+ public:
+  ChannelWriteQueue();
+
+  // Destroys any messages which were never popped.
+  ~ChannelWriteQueue();
+
+  // Pushes |message| onto the queue. May be called from any thread. Returns
+  // true if the queue was empty, in which case the caller is responsible for
+  // arranging for the consumer to call PopAll().
+  bool Push(Channel::MessagePtr message);
+
+  // Removes every queued message and appends them to |messages| in the order
+  // they were pushed. Must only be called by the consumer.
+  void PopAll(std::vector<Channel::MessagePtr>* messages);
+
+ private:
+  // The most recently pushed message, or null if the queue is empty.
+  base::subtle::AtomicWord head_ = 0;
+
+  DISALLOW_COPY_AND_ASSIGN(ChannelWriteQueue);
+};
+
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_SYSTEM_CHANNEL_WRITE_QUEUE_H_
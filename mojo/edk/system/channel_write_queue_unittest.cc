@@ -0,0 +1,116 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/channel_write_queue.h"
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "base/bind.h"
+#include "base/location.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/threading/thread.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace mojo {
+namespace edk {
+namespace {
+
+struct TestPayload {
+  uint32_t producer;
+  uint32_t index;
+};
+
+Channel::MessagePtr NewMessage(uint32_t producer, uint32_t index) {
+  Channel::MessagePtr message =
+      Channel::Message::Create(sizeof(TestPayload), nullptr);
+  TestPayload* payload =
+      static_cast<TestPayload*>(message->mutable_payload());
+  payload->producer = producer;
+  payload->index = index;
+  return message;
+}
+
+const TestPayload* GetPayload(const Channel::MessagePtr& message) {
+  return static_cast<const TestPayload*>(message->payload());
+}
+
+TEST(ChannelWriteQueueTest, PushAndPopAll) {
+  ChannelWriteQueue queue;
+  std::vector<Channel::MessagePtr> messages;
+  queue.PopAll(&messages);
+  EXPECT_TRUE(messages.empty());
+
+  EXPECT_TRUE(queue.Push(NewMessage(0, 0)));
+  EXPECT_FALSE(queue.Push(NewMessage(0, 1)));
+  EXPECT_FALSE(queue.Push(NewMessage(0, 2)));
+
+  queue.PopAll(&messages);
+  ASSERT_EQ(3u, messages.size());
+  for (uint32_t i = 0; i < 3; ++i)
+    EXPECT_EQ(i, GetPayload(messages[i])->index);
+
+  // The queue is empty again, so the next push must report it.
+  EXPECT_TRUE(queue.Push(NewMessage(0, 3)));
+  queue.PopAll(&messages);
+  ASSERT_EQ(4u, messages.size());
+  EXPECT_EQ(3u, GetPayload(messages[3])->index);
+}
+
+TEST(ChannelWriteQueueTest, DestroyWithQueuedMessages) {
+  // Messages left in the queue are freed along with it.
+  ChannelWriteQueue queue;
+  for (uint32_t i = 0; i < 10; ++i)
+    queue.Push(NewMessage(0, i));
+}
+
+const uint32_t kNumProducers = 4;
+const uint32_t kNumMessagesPerProducer = 10000;
+
+void PushMessages(ChannelWriteQueue* queue, uint32_t producer) {
+  for (uint32_t i = 0; i < kNumMessagesPerProducer; ++i)
+    queue->Push(NewMessage(producer, i));
+}
+
+TEST(ChannelWriteQueueTest, ConcurrentProducers) {
+  ChannelWriteQueue queue;
+  std::vector<scoped_ptr<base::Thread>> threads;
+  for (uint32_t i = 0; i < kNumProducers; ++i) {
+    threads.emplace_back(new base::Thread("ChannelWriteQueueTest"));
+    ASSERT_TRUE(threads.back()->Start());
+    threads.back()->task_runner()->PostTask(
+        FROM_HERE, base::Bind(&PushMessages, base::Unretained(&queue), i));
+  }
+
+  // Drain concurrently with the producers. Each producer's messages must come
+  // out in the order it pushed them.
+  std::vector<uint32_t> next_index(kNumProducers, 0);
+  size_t num_messages = 0;
+  std::vector<Channel::MessagePtr> messages;
+  while (num_messages < kNumProducers * kNumMessagesPerProducer) {
+    messages.clear();
+    queue.PopAll(&messages);
+    for (const Channel::MessagePtr& message : messages) {
+      const TestPayload* payload = GetPayload(message);
+      ASSERT_LT(payload->producer, kNumProducers);
+      EXPECT_EQ(next_index[payload->producer], payload->index);
+      next_index[payload->producer] = payload->index + 1;
+    }
+    num_messages += messages.size();
+  }
+
+  for (auto& thread : threads)
+    thread->Stop();
+
+  messages.clear();
+  queue.PopAll(&messages);
+  EXPECT_TRUE(messages.empty());
+  for (uint32_t index : next_index)
+    EXPECT_EQ(kNumMessagesPerProducer, index);
+}
+
+}  // namespace
+}  // namespace edk
+}  // namespace mojo
@@ -6,6 +6,8 @@
 
 #include <string.h>
 
+#include <algorithm>
+#include <atomic>
 #include <utility>
 
 #include "base/bind.h"
@@ -14,6 +16,7 @@
 #include "base/logging.h"
 #include "base/macros.h"
 #include "base/message_loop/message_loop.h"
+#include "base/sys_info.h"
 #include "base/thread_task_runner_handle.h"
 #include "base/time/time.h"
 #include "crypto/random.h"
@@ -24,12 +27,14 @@
 #include "mojo/edk/system/data_pipe_consumer_dispatcher.h"
 #include "mojo/edk/system/data_pipe_producer_dispatcher.h"
 #include "mojo/edk/system/handle_signals_state.h"
+#include "mojo/edk/system/message_pipe_binding.h"
 #include "mojo/edk/system/message_pipe_dispatcher.h"
 #include "mojo/edk/system/platform_handle_dispatcher.h"
 #include "mojo/edk/system/ports/node.h"
 #include "mojo/edk/system/shared_buffer_dispatcher.h"
 #include "mojo/edk/system/wait_set_dispatcher.h"
 #include "mojo/edk/system/waiter.h"
+#include "mojo/edk/system/work_stealing_thread_pool.h"
 
 namespace mojo {
 namespace edk {
@@ -39,18 +44,141 @@ namespace {
 // This is an unnecessarily large limit that is relatively easy to enforce.
 const uint32_t kMaxHandlesPerMessage = 1024 * 1024;
 
+// The longest Wait() and WaitMany() poll for before blocking, in
+// microseconds. 0, the default, disables polling.
+std::atomic<uint64_t> g_max_wait_spin_time{0};
+
+// A running average of how long polling took when it found a handle ready.
+// Waits poll for twice that plus a little, so they stop spinning much longer
+// than handles usually take to become ready. Waits which end up blocking
+// decay it, so that polling backs off while handles are slow.
+std::atomic<uint64_t> g_wait_spin_estimate{0};
+
+uint64_t GetWaitSpinTime(uint64_t max_spin_time) {
+  uint64_t estimate = g_wait_spin_estimate.load(std::memory_order_relaxed);
+  return std::min(max_spin_time, 2 * estimate + max_spin_time / 8);
+}
+
+void UpdateWaitSpinEstimate(bool ready, uint64_t spin_time) {
+  int64_t estimate = static_cast<int64_t>(
+      g_wait_spin_estimate.load(std::memory_order_relaxed));
+  if (ready)
+    estimate += (static_cast<int64_t>(spin_time) - estimate) / 8;
+  else
+    estimate -= estimate / 8;
+  g_wait_spin_estimate.store(static_cast<uint64_t>(estimate),
+                             std::memory_order_relaxed);
+}
+
+// Polls |dispatchers| for up to |spin_time| microseconds until one satisfies
+// its signals, in which case this returns true and fills in the outputs as
+// WaitManyInternal() would. Gives up early if a handle can never satisfy its
+// signals, leaving the details for AddAwakable() to report.
+bool SpinWait(const DispatcherVector& dispatchers,
+              const MojoHandleSignals* signals,
+              uint64_t spin_time,
+              uint32_t* result_index,
+              HandleSignalsState* signals_states) {
+  base::TimeTicks start = base::TimeTicks::Now();
+  uint64_t elapsed = 0;
+  for (;;) {
+    for (size_t i = 0; i < dispatchers.size(); ++i) {
+      HandleSignalsState state = dispatchers[i]->GetHandleSignalsState();
+      if (!state.can_satisfy(signals[i]))
+        return false;
+      if (!state.satisfies(signals[i]))
+        continue;
+
+      UpdateWaitSpinEstimate(true, elapsed);
+      if (result_index)
+        *result_index = static_cast<uint32_t>(i);
+      if (signals_states) {
+        for (size_t j = 0; j < dispatchers.size(); ++j) {
+          signals_states[j] =
+              j == i ? state : dispatchers[j]->GetHandleSignalsState();
+        }
+      }
+      return true;
+    }
+
+    elapsed = static_cast<uint64_t>(
+        (base::TimeTicks::Now() - start).InMicroseconds());
+    if (elapsed >= spin_time)
+      break;
+  }
+  UpdateWaitSpinEstimate(false, elapsed);
+  return false;
+}
+
+// Creates a shared buffer of |num_bytes| bytes for a data pipe's ring buffer,
+// with a dispatcher and a mapping of the whole buffer for each end of the
+// pipe. Returns false, leaving the outputs untouched, on failure.
+bool CreateDataPipeRingBuffer(
+    uint32_t num_bytes,
+    scoped_refptr<SharedBufferDispatcher>* producer_ring_buffer,
+    scoped_ptr<PlatformSharedBufferMapping>* producer_ring_buffer_mapping,
+    scoped_refptr<SharedBufferDispatcher>* consumer_ring_buffer,
+    scoped_ptr<PlatformSharedBufferMapping>* consumer_ring_buffer_mapping) {
+  scoped_refptr<SharedBufferDispatcher> producer_dispatcher;
+  if (SharedBufferDispatcher::Create(
+          internal::g_platform_support,
+          SharedBufferDispatcher::kDefaultCreateOptions, num_bytes,
+          &producer_dispatcher) != MOJO_RESULT_OK) {
+    return false;
+  }
+
+  scoped_refptr<Dispatcher> consumer_dispatcher;
+  if (producer_dispatcher->DuplicateBufferHandle(
+          nullptr, &consumer_dispatcher) != MOJO_RESULT_OK) {
+    producer_dispatcher->Close();
+    return false;
+  }
+
+  scoped_ptr<PlatformSharedBufferMapping> producer_mapping;
+  scoped_ptr<PlatformSharedBufferMapping> consumer_mapping;
+  if (producer_dispatcher->MapBuffer(0, num_bytes, MOJO_MAP_BUFFER_FLAG_NONE,
+                                     &producer_mapping) != MOJO_RESULT_OK ||
+      consumer_dispatcher->MapBuffer(0, num_bytes, MOJO_MAP_BUFFER_FLAG_NONE,
+                                     &consumer_mapping) != MOJO_RESULT_OK) {
+    producer_dispatcher->Close();
+    consumer_dispatcher->Close();
+    return false;
+  }
+
+  *producer_ring_buffer = std::move(producer_dispatcher);
+  *producer_ring_buffer_mapping = std::move(producer_mapping);
+  *consumer_ring_buffer =
+      static_cast<SharedBufferDispatcher*>(consumer_dispatcher.get());
+  *consumer_ring_buffer_mapping = std::move(consumer_mapping);
+  return true;
+}
+
 }  // namespace
 
-Core::Core() : node_controller_(this) {}
+Core::Core()
+    : node_controller_(this), handles_lock_("Core::handles_lock_") {}
 
 Core::~Core() {}
 
+// static
+void Core::SetWaitSpinTime(MojoDeadline max_spin_time) {
+  g_max_wait_spin_time.store(max_spin_time, std::memory_order_relaxed);
+}
+
 void Core::SetIOTaskRunner(scoped_refptr<base::TaskRunner> io_task_runner) {
   node_controller_.SetIOTaskRunner(io_task_runner);
 }
 
+void Core::AddIOTaskRunner(scoped_refptr<base::TaskRunner> io_task_runner) {
+  node_controller_.AddIOTaskRunner(io_task_runner);
+}
+
+void Core::SetEagerIntroductionsEnabled(bool enabled) {
+  node_controller_.SetEagerIntroductionsEnabled(enabled);
+}
+
 scoped_refptr<Dispatcher> Core::GetDispatcher(MojoHandle handle) {
-  base::AutoLock lock(handles_lock_);
+  // Lookups don't need |handles_lock_|. See HandleTable.
   return handles_.GetDispatcher(handle);
 }
 
@@ -63,7 +191,7 @@ void Core::InitChild(ScopedPlatformHandle platform_handle) {
 }
 
 MojoHandle Core::AddDispatcher(scoped_refptr<Dispatcher> dispatcher) {
-  base::AutoLock lock(handles_lock_);
+  ProfiledAutoLock lock(handles_lock_);
   return handles_.AddDispatcher(dispatcher);
 }
 
@@ -79,21 +207,25 @@ bool Core::AddDispatchersForReceivedPorts(const ports::Message& message,
     d.dispatcher = new MessagePipeDispatcher(&node_controller_, port,
                                              true /* connected */);
   }
-  return AddDispatchersFromTransit(dispatchers, handles);
+  return AddDispatchersFromTransit(dispatchers.data(), dispatchers.size(),
+                                   handles);
 }
 
 bool Core::AddDispatchersFromTransit(
-    const std::vector<Dispatcher::DispatcherInTransit>& dispatchers,
+    const Dispatcher::DispatcherInTransit* dispatchers,
+    size_t num_dispatchers,
     MojoHandle* handles) {
   bool failed = false;
   {
-    base::AutoLock lock(handles_lock_);
-    if (!handles_.AddDispatchersFromTransit(dispatchers, handles))
+    ProfiledAutoLock lock(handles_lock_);
+    if (!handles_.AddDispatchersFromTransit(dispatchers, num_dispatchers,
+                                            handles))
       failed = true;
   }
   if (failed) {
-    for (auto d : dispatchers)
-      d.dispatcher->Close();
+    NodeController::ScopedPortClosureBatch batch(node_controller());
+    for (size_t i = 0; i < num_dispatchers; ++i)
+      dispatchers[i].dispatcher->Close();
     return false;
   }
   return true;
@@ -113,7 +245,7 @@ MojoResult Core::CreatePlatformHandleWrapper(
 MojoResult Core::PassWrappedPlatformHandle(
     MojoHandle wrapper_handle,
     ScopedPlatformHandle* platform_handle) {
-  base::AutoLock lock(handles_lock_);
+  ProfiledAutoLock lock(handles_lock_);
   scoped_refptr<Dispatcher> d;
   MojoResult result = handles_.GetAndRemoveDispatcher(wrapper_handle, &d);
   if (result != MOJO_RESULT_OK)
@@ -138,6 +270,15 @@ ScopedMessagePipeHandle Core::CreateParentMessagePipe(
 ScopedMessagePipeHandle Core::CreateChildMessagePipe(
     const std::string& token) {
   ports::PortRef port;
+  if (node_controller_.ClaimPooledParentPort(token, &port)) {
+    // The port is already connected, and nothing is sent to it until the
+    // parent has seen the claim, so the MPD can't miss anything.
+    MojoHandle handle = AddDispatcher(
+        new MessagePipeDispatcher(&node_controller_, port,
+                                  true /* connected */));
+    return ScopedMessagePipeHandle(MessagePipeHandle(handle));
+  }
+
   node_controller_.node()->CreateUninitializedPort(&port);
 
   MojoHandle handle = AddDispatcher(
@@ -153,6 +294,15 @@ ScopedMessagePipeHandle Core::CreateChildMessagePipe(
   return ScopedMessagePipeHandle(MessagePipeHandle(handle));
 }
 
+void Core::GetMetrics(Metrics* metrics) {
+  node_controller_.GetMetrics(metrics);
+}
+
+bool Core::SaveNodeState(const base::FilePath& path,
+                         ScopedPlatformHandleVectorPtr* channel_handles) {
+  return node_controller_.SaveState(path, channel_handles);
+}
+
 MojoResult Core::AsyncWait(MojoHandle handle,
                            MojoHandleSignals signals,
                            const base::Callback<void(MojoResult)>& callback) {
@@ -166,6 +316,113 @@ MojoResult Core::AsyncWait(MojoHandle handle,
   return rv;
 }
 
+MojoResult Core::AsyncWaitOnTaskRunner(
+    MojoHandle handle,
+    MojoHandleSignals signals,
+    bool persistent,
+    scoped_refptr<base::TaskRunner> task_runner,
+    const base::Callback<void(MojoResult)>& callback,
+    uintptr_t* wait_id) {
+  scoped_refptr<Dispatcher> dispatcher = GetDispatcher(handle);
+  if (!dispatcher)
+    return MOJO_RESULT_INVALID_ARGUMENT;
+
+  return StartTaskRunnerWaiter(dispatcher, signals, persistent, task_runner,
+                               TaskRunnerWaiter::Unconditionally(callback),
+                               wait_id);
+}
+
+MojoResult Core::BindMessagePipe(MojoHandle message_pipe_handle,
+                                 scoped_refptr<base::TaskRunner> executor,
+                                 uint32_t max_batch_size,
+                                 const MessageBatchHandler& handler,
+                                 uintptr_t* binding_id) {
+  scoped_refptr<Dispatcher> dispatcher = GetDispatcher(message_pipe_handle);
+  if (!dispatcher || dispatcher->GetType() != Dispatcher::Type::MESSAGE_PIPE ||
+      max_batch_size == 0) {
+    return MOJO_RESULT_INVALID_ARGUMENT;
+  }
+
+  if (!executor)
+    executor = GetDefaultExecutor();
+
+  // Only READABLE is watched, so the waiter finishes by itself once the peer
+  // is closed and the last message has been read.
+  scoped_refptr<MessagePipeBinding> binding =
+      new MessagePipeBinding(dispatcher, max_batch_size, handler);
+  return StartTaskRunnerWaiter(
+      dispatcher, MOJO_HANDLE_SIGNAL_READABLE, true /* persistent */, executor,
+      TaskRunnerWaiter::Unconditionally(
+          base::Bind(&MessagePipeBinding::OnReadable, binding)),
+      binding_id);
+}
+
+MojoResult Core::ReadMessageAsync(MojoHandle message_pipe_handle,
+                                  scoped_refptr<base::TaskRunner> executor,
+                                  const ReadMessageCallback& callback,
+                                  uintptr_t* wait_id) {
+  scoped_refptr<Dispatcher> dispatcher = GetDispatcher(message_pipe_handle);
+  if (!dispatcher || dispatcher->GetType() != Dispatcher::Type::MESSAGE_PIPE)
+    return MOJO_RESULT_INVALID_ARGUMENT;
+
+  if (!executor)
+    executor = GetDefaultExecutor();
+
+  // The waiter is persistent only so that it can wait again after losing a
+  // race for the message; AsyncMessageRead stops it once a read completes.
+  scoped_refptr<AsyncMessageRead> read =
+      new AsyncMessageRead(dispatcher, callback);
+  return StartTaskRunnerWaiter(
+      dispatcher, MOJO_HANDLE_SIGNAL_READABLE, true /* persistent */, executor,
+      base::Bind(&AsyncMessageRead::OnReadable, read), wait_id);
+}
+
+MojoResult Core::SetDataPipeThreshold(MojoHandle data_pipe_handle,
+                                      uint32_t num_bytes) {
+  scoped_refptr<Dispatcher> dispatcher(GetDispatcher(data_pipe_handle));
+  if (!dispatcher)
+    return MOJO_RESULT_INVALID_ARGUMENT;
+
+  return dispatcher->SetDataPipeThreshold(num_bytes);
+}
+
+MojoResult Core::WaitDataPipeAsync(
+    MojoHandle data_pipe_handle,
+    uint32_t num_bytes,
+    scoped_refptr<base::TaskRunner> executor,
+    const base::Callback<void(MojoResult)>& callback,
+    uintptr_t* wait_id) {
+  scoped_refptr<Dispatcher> dispatcher(GetDispatcher(data_pipe_handle));
+  if (!dispatcher || num_bytes == 0)
+    return MOJO_RESULT_INVALID_ARGUMENT;
+
+  MojoResult rv = dispatcher->SetDataPipeThreshold(num_bytes);
+  if (rv != MOJO_RESULT_OK)
+    return rv;
+
+  if (!executor)
+    executor = GetDefaultExecutor();
+
+  return StartTaskRunnerWaiter(dispatcher, MOJO_HANDLE_SIGNAL_THRESHOLD_REACHED,
+                               false /* persistent */, executor,
+                               TaskRunnerWaiter::Unconditionally(callback),
+                               wait_id);
+}
+
+MojoResult Core::CancelAsyncWait(uintptr_t wait_id) {
+  scoped_refptr<TaskRunnerWaiter> waiter;
+  {
+    base::AutoLock lock(task_runner_waiters_lock_);
+    auto it = task_runner_waiters_.find(wait_id);
+    if (it == task_runner_waiters_.end())
+      return MOJO_RESULT_INVALID_ARGUMENT;
+    waiter = it->second;
+    task_runner_waiters_.erase(it);
+  }
+  waiter->Cancel();
+  return MOJO_RESULT_OK;
+}
+
 MojoTimeTicks Core::GetTimeTicksNow() {
   return base::TimeTicks::Now().ToInternalValue();
 }
@@ -173,7 +430,7 @@ MojoTimeTicks Core::GetTimeTicksNow() {
 MojoResult Core::Close(MojoHandle handle) {
   scoped_refptr<Dispatcher> dispatcher;
   {
-    base::AutoLock lock(handles_lock_);
+    ProfiledAutoLock lock(handles_lock_);
     MojoResult rv = handles_.GetAndRemoveDispatcher(handle, &dispatcher);
     if (rv != MOJO_RESULT_OK)
       return rv;
@@ -182,6 +439,29 @@ MojoResult Core::Close(MojoHandle handle) {
   return MOJO_RESULT_OK;
 }
 
+MojoResult Core::CloseHandles(const MojoHandle* handles, uint32_t num_handles) {
+  MojoResult result = MOJO_RESULT_OK;
+  std::vector<scoped_refptr<Dispatcher>> dispatchers;
+  dispatchers.reserve(num_handles);
+  {
+    ProfiledAutoLock lock(handles_lock_);
+    for (uint32_t i = 0; i < num_handles; ++i) {
+      scoped_refptr<Dispatcher> dispatcher;
+      if (handles_.GetAndRemoveDispatcher(handles[i], &dispatcher) ==
+          MOJO_RESULT_OK) {
+        dispatchers.push_back(std::move(dispatcher));
+      } else {
+        result = MOJO_RESULT_INVALID_ARGUMENT;
+      }
+    }
+  }
+
+  NodeController::ScopedPortClosureBatch batch(node_controller());
+  for (const scoped_refptr<Dispatcher>& dispatcher : dispatchers)
+    dispatcher->Close();
+  return result;
+}
+
 MojoResult Core::Wait(MojoHandle handle,
                       MojoHandleSignals signals,
                       MojoDeadline deadline,
@@ -299,6 +579,12 @@ MojoResult Core::CreateMessagePipe(
     const MojoCreateMessagePipeOptions* options,
     MojoHandle* message_pipe_handle0,
     MojoHandle* message_pipe_handle1) {
+  MojoCreateMessagePipeOptions validated_options = {};
+  MojoResult result = MessagePipeDispatcher::ValidateCreateOptions(
+      options, &validated_options);
+  if (result != MOJO_RESULT_OK)
+    return result;
+
   ports::PortRef port0, port1;
   node_controller_.node()->CreatePortPair(&port0, &port1);
   CHECK(message_pipe_handle0);
@@ -314,14 +600,77 @@ MojoResult Core::CreateMessagePipe(
                                 true /* connected */));
   if (*message_pipe_handle1 == MOJO_HANDLE_INVALID) {
     scoped_refptr<Dispatcher> unused;
+    {
+      ProfiledAutoLock lock(handles_lock_);
+      handles_.GetAndRemoveDispatcher(*message_pipe_handle0, &unused);
+    }
     unused->Close();
-    handles_.GetAndRemoveDispatcher(*message_pipe_handle0, &unused);
     return MOJO_RESULT_RESOURCE_EXHAUSTED;
   }
 
   return MOJO_RESULT_OK;
 }
 
+MojoResult Core::CreateMessagePipes(
+    const MojoCreateMessagePipeOptions* options,
+    uint32_t num_pipes,
+    MojoHandle* message_pipe_handles0,
+    MojoHandle* message_pipe_handles1) {
+  MojoCreateMessagePipeOptions validated_options = {};
+  MojoResult result = MessagePipeDispatcher::ValidateCreateOptions(
+      options, &validated_options);
+  if (result != MOJO_RESULT_OK)
+    return result;
+
+  if (num_pipes == 0)
+    return MOJO_RESULT_OK;
+  CHECK(message_pipe_handles0);
+  CHECK(message_pipe_handles1);
+
+  // Fail before creating any ports if the handles couldn't all be added.
+  // AddDispatchers() checks again below, since handles may be added in the
+  // meantime.
+  const size_t num_handles = 2 * static_cast<size_t>(num_pipes);
+  {
+    ProfiledAutoLock lock(handles_lock_);
+    if (num_handles > handles_.GetNumAvailableSlots())
+      return MOJO_RESULT_RESOURCE_EXHAUSTED;
+  }
+
+  std::vector<ports::PortRef> ports;
+  if (node_controller_.node()->CreatePortPairs(num_pipes, &ports) !=
+      ports::OK) {
+    return MOJO_RESULT_UNKNOWN;
+  }
+
+  DCHECK_EQ(num_handles, ports.size());
+  std::vector<scoped_refptr<Dispatcher>> dispatchers(num_handles);
+  for (size_t i = 0; i < num_handles; ++i) {
+    dispatchers[i] = new MessagePipeDispatcher(&node_controller_, ports[i],
+                                               true /* connected */);
+  }
+
+  std::vector<MojoHandle> handles(num_handles);
+  bool added;
+  {
+    ProfiledAutoLock lock(handles_lock_);
+    added = handles_.AddDispatchers(dispatchers.data(), num_handles,
+                                    handles.data());
+  }
+  if (!added) {
+    NodeController::ScopedPortClosureBatch batch(node_controller());
+    for (const auto& dispatcher : dispatchers)
+      dispatcher->Close();
+    return MOJO_RESULT_RESOURCE_EXHAUSTED;
+  }
+
+  for (uint32_t i = 0; i < num_pipes; ++i) {
+    message_pipe_handles0[i] = handles[2 * i];
+    message_pipe_handles1[i] = handles[2 * i + 1];
+  }
+  return MOJO_RESULT_OK;
+}
+
 MojoResult Core::WriteMessage(MojoHandle message_pipe_handle,
                               const void* bytes,
                               uint32_t num_bytes,
@@ -347,7 +696,7 @@ MojoResult Core::WriteMessage(MojoHandle message_pipe_handle,
 
   std::vector<Dispatcher::DispatcherInTransit> dispatchers;
   {
-    base::AutoLock lock(handles_lock_);
+    ProfiledAutoLock lock(handles_lock_);
     MojoResult rv = handles_.BeginTransit(handles, num_handles, &dispatchers);
     if (rv != MOJO_RESULT_OK) {
       handles_.CancelTransit(dispatchers);
@@ -360,7 +709,7 @@ MojoResult Core::WriteMessage(MojoHandle message_pipe_handle,
       bytes, num_bytes, dispatchers.data(), num_handles, flags);
 
   {
-    base::AutoLock lock(handles_lock_);
+    ProfiledAutoLock lock(handles_lock_);
     if (rv == MOJO_RESULT_OK) {
       handles_.CompleteTransit(dispatchers);
     } else {
@@ -371,6 +720,69 @@ MojoResult Core::WriteMessage(MojoHandle message_pipe_handle,
   return rv;
 }
 
+MojoResult Core::SetQuota(MojoHandle message_pipe_handle,
+                          uint64_t max_queued_messages,
+                          uint64_t max_queued_bytes) {
+  auto dispatcher = GetDispatcher(message_pipe_handle);
+  if (!dispatcher)
+    return MOJO_RESULT_INVALID_ARGUMENT;
+  return dispatcher->SetQuota(max_queued_messages, max_queued_bytes);
+}
+
+MojoResult Core::AllocMessage(uint32_t num_bytes,
+                              const MojoHandle* handles,
+                              uint32_t num_handles,
+                              MessageForTransit** message) {
+  CHECK(message);
+  // The pipe the message will be written to isn't known yet, so its contents
+  // are never put in a shared buffer and its dispatchers are all serialized.
+  if (num_handles == 0) {  // Fast path: no handles.
+    *message = MessageForTransit::Create(
+        node_controller(), nullptr, 0, num_bytes,
+        MessageForTransit::Destination::kUnknown).release();
+    return MOJO_RESULT_OK;
+  }
+
+  CHECK(handles);
+
+  if (num_handles > kMaxHandlesPerMessage)
+    return MOJO_RESULT_RESOURCE_EXHAUSTED;
+
+  std::vector<Dispatcher::DispatcherInTransit> dispatchers;
+  {
+    ProfiledAutoLock lock(handles_lock_);
+    MojoResult rv = handles_.BeginTransit(handles, num_handles, &dispatchers);
+    if (rv != MOJO_RESULT_OK) {
+      handles_.CancelTransit(dispatchers);
+      return rv;
+    }
+  }
+  DCHECK_EQ(num_handles, dispatchers.size());
+
+  *message = MessageForTransit::Create(
+      node_controller(), dispatchers.data(), num_handles, num_bytes,
+      MessageForTransit::Destination::kUnknown).release();
+
+  {
+    ProfiledAutoLock lock(handles_lock_);
+    handles_.CompleteTransit(dispatchers);
+  }
+
+  return MOJO_RESULT_OK;
+}
+
+MojoResult Core::WriteMessageNew(MojoHandle message_pipe_handle,
+                                 MessageForTransit* message,
+                                 MojoWriteMessageFlags flags) {
+  if (!message)
+    return MOJO_RESULT_INVALID_ARGUMENT;
+  scoped_ptr<MessageForTransit> message_for_transit(message);
+  auto dispatcher = GetDispatcher(message_pipe_handle);
+  if (!dispatcher)
+    return MOJO_RESULT_INVALID_ARGUMENT;
+  return dispatcher->WriteMessageNew(std::move(message_for_transit), flags);
+}
+
 MojoResult Core::ReadMessage(MojoHandle message_pipe_handle,
                              void* bytes,
                              uint32_t* num_bytes,
@@ -385,20 +797,118 @@ MojoResult Core::ReadMessage(MojoHandle message_pipe_handle,
   return dispatcher->ReadMessage(bytes, num_bytes, handles, num_handles, flags);
 }
 
+MojoResult Core::ReadMessageNew(MojoHandle message_pipe_handle,
+                                MessageForTransit** message,
+                                uint32_t* num_bytes,
+                                MojoHandle* handles,
+                                uint32_t* num_handles,
+                                MojoReadMessageFlags flags) {
+  CHECK(message);
+  CHECK(!num_handles || !*num_handles || handles);
+  auto dispatcher = GetDispatcher(message_pipe_handle);
+  if (!dispatcher)
+    return MOJO_RESULT_INVALID_ARGUMENT;
+  scoped_ptr<MessageForTransit> message_for_transit;
+  MojoResult rv = dispatcher->ReadMessageNew(&message_for_transit, num_bytes,
+                                             handles, num_handles, flags);
+  if (rv != MOJO_RESULT_OK)
+    return rv;
+  *message = message_for_transit.release();
+  return MOJO_RESULT_OK;
+}
+
+MojoResult Core::GetMessageBuffer(MessageForTransit* message, void** buffer) {
+  if (!message)
+    return MOJO_RESULT_INVALID_ARGUMENT;
+  *buffer = message->mutable_bytes();
+  return MOJO_RESULT_OK;
+}
+
+MojoResult Core::TakeMessageHandles(MessageForTransit* message,
+                                    MojoHandle* handles,
+                                    uint32_t* num_handles) {
+  if (!message || !num_handles)
+    return MOJO_RESULT_INVALID_ARGUMENT;
+  if (!message->has_deferred_dispatchers()) {
+    *num_handles = 0;
+    return MOJO_RESULT_OK;
+  }
+
+  uint32_t capacity = *num_handles;
+  *num_handles = message->num_dispatchers();
+  if (capacity < *num_handles)
+    return MOJO_RESULT_RESOURCE_EXHAUSTED;
+  return message->DeserializeDispatchers(node_controller(), handles);
+}
+
+MojoResult Core::FreeMessage(MessageForTransit* message) {
+  if (!message)
+    return MOJO_RESULT_INVALID_ARGUMENT;
+  delete message;
+  return MOJO_RESULT_OK;
+}
+
+MojoResult Core::ReadMessages(MojoHandle message_pipe_handle,
+                              void* bytes,
+                              uint32_t num_bytes,
+                              uint32_t* message_num_bytes,
+                              MojoHandle* handles,
+                              uint32_t num_handles,
+                              uint32_t* message_num_handles,
+                              uint32_t* num_messages,
+                              MojoReadMessageFlags flags) {
+  CHECK((!num_handles || handles) && (!num_bytes || bytes));
+  if (!num_messages || !*num_messages || !message_num_bytes ||
+      !message_num_handles)
+    return MOJO_RESULT_INVALID_ARGUMENT;
+  auto dispatcher = GetDispatcher(message_pipe_handle);
+  if (!dispatcher)
+    return MOJO_RESULT_INVALID_ARGUMENT;
+  return dispatcher->ReadMessages(bytes, num_bytes, message_num_bytes, handles,
+                                  num_handles, message_num_handles,
+                                  num_messages, flags);
+}
+
 MojoResult Core::CreateDataPipe(
     const MojoCreateDataPipeOptions* options,
     MojoHandle* data_pipe_producer_handle,
     MojoHandle* data_pipe_consumer_handle) {
-  // TODO: Use the new data pipe impl when it's ready.
-
-  MojoCreateDataPipeOptions default_options;
-  default_options.struct_size = sizeof(MojoCreateDataPipeOptions);
-  default_options.flags = 0;
-  default_options.element_num_bytes = 1;
-  default_options.capacity_num_bytes = 64 * 1024;
+  const uint32_t kDefaultCapacityNumBytes = 64 * 1024;
+
+  MojoCreateDataPipeOptions create_options;
+  create_options.struct_size = sizeof(MojoCreateDataPipeOptions);
+  create_options.flags = 0;
+  create_options.element_num_bytes = 1;
+  create_options.capacity_num_bytes = kDefaultCapacityNumBytes;
+  if (options) {
+    create_options = *options;
+    if (!create_options.element_num_bytes)
+      return MOJO_RESULT_INVALID_ARGUMENT;
+    if (!create_options.capacity_num_bytes) {
+      create_options.capacity_num_bytes = std::max(
+          kDefaultCapacityNumBytes -
+              kDefaultCapacityNumBytes % create_options.element_num_bytes,
+          create_options.element_num_bytes);
+    }
+    if (create_options.capacity_num_bytes %
+            create_options.element_num_bytes != 0) {
+      return MOJO_RESULT_INVALID_ARGUMENT;
+    }
+  }
 
-  const MojoCreateDataPipeOptions* create_options =
-      options ? options : &default_options;
+  // Both ends share a ring buffer for the data if one can be created.
+  // Otherwise the data is sent in messages.
+  scoped_refptr<SharedBufferDispatcher> producer_ring_buffer;
+  scoped_refptr<SharedBufferDispatcher> consumer_ring_buffer;
+  scoped_ptr<PlatformSharedBufferMapping> producer_ring_buffer_mapping;
+  scoped_ptr<PlatformSharedBufferMapping> consumer_ring_buffer_mapping;
+  if (!CreateDataPipeRingBuffer(create_options.capacity_num_bytes,
+                                &producer_ring_buffer,
+                                &producer_ring_buffer_mapping,
+                                &consumer_ring_buffer,
+                                &consumer_ring_buffer_mapping)) {
+    DVLOG(1) << "Creating a data pipe without a ring buffer.";
+  }
 
   ports::PortRef port0, port1;
   node_controller_.node()->CreatePortPair(&port0, &port1);
@@ -406,17 +916,24 @@ MojoResult Core::CreateDataPipe(
   CHECK(data_pipe_consumer_handle);
   *data_pipe_producer_handle = AddDispatcher(
       new DataPipeProducerDispatcher(&node_controller_, port0,
-                                     *create_options));
+                                     std::move(producer_ring_buffer),
+                                     std::move(producer_ring_buffer_mapping),
+                                     create_options, true /* initialized */));
   if (*data_pipe_producer_handle == MOJO_HANDLE_INVALID)
     return MOJO_RESULT_RESOURCE_EXHAUSTED;
 
   *data_pipe_consumer_handle = AddDispatcher(
       new DataPipeConsumerDispatcher(&node_controller_, port1,
-                                     *create_options));
+                                     std::move(consumer_ring_buffer),
+                                     std::move(consumer_ring_buffer_mapping),
+                                     create_options, true /* initialized */));
   if (*data_pipe_consumer_handle == MOJO_HANDLE_INVALID) {
     scoped_refptr<Dispatcher> unused;
+    {
+      ProfiledAutoLock lock(handles_lock_);
+      handles_.GetAndRemoveDispatcher(*data_pipe_producer_handle, &unused);
+    }
     unused->Close();
-    handles_.GetAndRemoveDispatcher(*data_pipe_producer_handle, &unused);
     return MOJO_RESULT_RESOURCE_EXHAUSTED;
   }
 
@@ -577,10 +1094,54 @@ MojoResult Core::UnmapBuffer(void* buffer) {
 }
 
 void Core::GetActiveHandlesForTest(std::vector<MojoHandle>* handles) {
-  base::AutoLock lock(handles_lock_);
+  ProfiledAutoLock lock(handles_lock_);
   handles_.GetActiveHandlesForTest(handles);
 }
 
+scoped_refptr<base::TaskRunner> Core::GetDefaultExecutor() {
+  base::AutoLock lock(task_runner_waiters_lock_);
+  if (!binding_thread_pool_) {
+    binding_thread_pool_.reset(new WorkStealingThreadPool(
+        "MojoBindingWorker",
+        static_cast<size_t>(base::SysInfo::NumberOfProcessors())));
+  }
+  return binding_thread_pool_->task_runner();
+}
+
+MojoResult Core::StartTaskRunnerWaiter(
+    scoped_refptr<Dispatcher> dispatcher,
+    MojoHandleSignals signals,
+    bool persistent,
+    scoped_refptr<base::TaskRunner> task_runner,
+    const TaskRunnerWaiter::ConditionalCallback& callback,
+    uintptr_t* wait_id) {
+  // The waiter is tracked before it starts, since its first call may already
+  // be running by the time Start() returns.
+  uintptr_t id;
+  scoped_refptr<TaskRunnerWaiter> waiter;
+  {
+    base::AutoLock lock(task_runner_waiters_lock_);
+    id = next_wait_id_++;
+    waiter = new TaskRunnerWaiter(
+        dispatcher, signals, persistent, task_runner, callback,
+        base::Bind(&Core::OnTaskRunnerWaiterDone, base::Unretained(this), id));
+    task_runner_waiters_[id] = waiter;
+  }
+
+  MojoResult rv = waiter->Start();
+  if (rv != MOJO_RESULT_OK) {
+    OnTaskRunnerWaiterDone(id);
+    return rv;
+  }
+  *wait_id = id;
+  return MOJO_RESULT_OK;
+}
+
+void Core::OnTaskRunnerWaiterDone(uintptr_t wait_id) {
+  base::AutoLock lock(task_runner_waiters_lock_);
+  task_runner_waiters_.erase(wait_id);
+}
+
 MojoResult Core::WaitManyInternal(const MojoHandle* handles,
                                   const MojoHandleSignals* signals,
                                   uint32_t num_handles,
@@ -606,6 +1167,26 @@ MojoResult Core::WaitManyInternal(const MojoHandle* handles,
     dispatchers.push_back(dispatcher);
   }
 
+  // Poll for a while first if enabled, since a handle which becomes ready
+  // soon is noticed sooner than a blocked thread is woken. Any time spent
+  // comes out of the deadline.
+  uint64_t max_spin_time =
+      g_max_wait_spin_time.load(std::memory_order_relaxed);
+  if (max_spin_time && deadline != 0) {
+    base::TimeTicks spin_start = base::TimeTicks::Now();
+    uint64_t spin_time = std::min<uint64_t>(GetWaitSpinTime(max_spin_time),
+                                            deadline);
+    if (SpinWait(dispatchers, signals, spin_time, result_index,
+                 signals_states)) {
+      return MOJO_RESULT_OK;
+    }
+    if (deadline != MOJO_DEADLINE_INDEFINITE) {
+      uint64_t elapsed = static_cast<uint64_t>(
+          (base::TimeTicks::Now() - spin_start).InMicroseconds());
+      deadline -= std::min<uint64_t>(deadline, elapsed);
+    }
+  }
+
   // TODO(vtl): Should make the waiter live (permanently) in TLS.
   Waiter waiter;
   waiter.Init();
@@ -5,21 +5,28 @@
 #ifndef MOJO_EDK_SYSTEM_CORE_H_
 #define MOJO_EDK_SYSTEM_CORE_H_
 
+#include <unordered_map>
 #include <vector>
 
 #include "base/callback.h"
+#include "base/files/file_path.h"
 #include "base/macros.h"
 #include "base/memory/ref_counted.h"
 #include "base/memory/scoped_ptr.h"
 #include "base/synchronization/lock.h"
 #include "base/task_runner.h"
+#include "mojo/edk/embedder/platform_handle_vector.h"
+#include "mojo/edk/embedder/received_message.h"
 #include "mojo/edk/embedder/scoped_platform_handle.h"
 #include "mojo/edk/system/dispatcher.h"
 #include "mojo/edk/system/handle_signals_state.h"
 #include "mojo/edk/system/handle_table.h"
 #include "mojo/edk/system/mapping_table.h"
+#include "mojo/edk/system/message_for_transit.h"
 #include "mojo/edk/system/node_controller.h"
+#include "mojo/edk/system/profiled_lock.h"
 #include "mojo/edk/system/system_impl_export.h"
+#include "mojo/edk/system/task_runner_waiter.h"
 #include "mojo/public/c/system/buffer.h"
 #include "mojo/public/c/system/data_pipe.h"
 #include "mojo/public/c/system/message_pipe.h"
@@ -29,6 +36,9 @@
 namespace mojo {
 namespace edk {
 
+struct Metrics;
+class WorkStealingThreadPool;
+
 // |Core| is an object that implements the Mojo system calls. All public methods
 // are thread-safe.
 class MOJO_SYSTEM_IMPL_EXPORT Core {
@@ -42,6 +52,19 @@ class MOJO_SYSTEM_IMPL_EXPORT Core {
   // methods are called on this object.
   void SetIOTaskRunner(scoped_refptr<base::TaskRunner> io_task_runner);
 
+  // Adds another thread for channel I/O. See NodeController::AddIOTaskRunner.
+  void AddIOTaskRunner(scoped_refptr<base::TaskRunner> io_task_runner);
+
+  // See NodeController::SetEagerIntroductionsEnabled.
+  void SetEagerIntroductionsEnabled(bool enabled);
+
+  // Makes Wait() and WaitMany() poll their handles' signals for up to
+  // |max_spin_time| microseconds before blocking. The time actually spent
+  // polling adapts to how long handles have recently taken to become ready.
+  // 0, the default, disables polling. Only worthwhile when waiting threads
+  // have cores to themselves.
+  static void SetWaitSpinTime(MojoDeadline max_spin_time);
+
   scoped_refptr<Dispatcher> GetDispatcher(MojoHandle handle);
 
   // Called in the parent process any time a new child is launched.
@@ -59,6 +82,13 @@ class MOJO_SYSTEM_IMPL_EXPORT Core {
   // to it.
   ScopedMessagePipeHandle CreateChildMessagePipe(const std::string& token);
 
+  // See GetMetrics in embedder.h.
+  void GetMetrics(Metrics* metrics);
+
+  // See SaveNodeState in embedder.h.
+  bool SaveNodeState(const base::FilePath& path,
+                     ScopedPlatformHandleVectorPtr* channel_handles);
+
   MojoHandle AddDispatcher(scoped_refptr<Dispatcher> dispatcher);
 
   // Adds new message pipe dispatchers for every port contained in |message|.
@@ -67,9 +97,11 @@ class MOJO_SYSTEM_IMPL_EXPORT Core {
                                       MojoHandle* handles);
 
   // Adds new dispatchers for non-message-pipe handles received in a message.
-  // |dispatchers| and |handles| should be the same size.
+  // |dispatchers| and |handles| should both be arrays of size
+  // |num_dispatchers|. The handle table is locked once for all of them.
   bool AddDispatchersFromTransit(
-      const std::vector<Dispatcher::DispatcherInTransit>& dispatchers,
+      const Dispatcher::DispatcherInTransit* dispatchers,
+      size_t num_dispatchers,
       MojoHandle* handles);
 
   MojoResult CreatePlatformHandleWrapper(ScopedPlatformHandle platform_handle,
@@ -86,6 +118,72 @@ class MOJO_SYSTEM_IMPL_EXPORT Core {
                        MojoHandleSignals signals,
                        const base::Callback<void(MojoResult)>& callback);
 
+  // Like AsyncWait, but |callback| is posted to |task_runner|, so it may call
+  // Mojo functions. With |persistent| it's posted each time the handle
+  // satisfies |signals|, until the handle is closed or can never satisfy them.
+  // State changes while a call is posted or running are coalesced into it.
+  // On success |*wait_id| identifies the wait for CancelAsyncWait.
+  MojoResult AsyncWaitOnTaskRunner(
+      MojoHandle handle,
+      MojoHandleSignals signals,
+      bool persistent,
+      scoped_refptr<base::TaskRunner> task_runner,
+      const base::Callback<void(MojoResult)>& callback,
+      uintptr_t* wait_id);
+
+  // Cancels a wait started by AsyncWaitOnTaskRunner, so that its callback
+  // isn't called again, even if a call has already been posted. Returns
+  // MOJO_RESULT_INVALID_ARGUMENT if the wait has already finished.
+  MojoResult CancelAsyncWait(uintptr_t wait_id);
+
+  // Binds a message pipe handle to |executor|: whenever messages arrive, a
+  // task is posted there which reads up to |max_batch_size| of them and passes
+  // them to |handler|, in order, with no more than one call at a time. If
+  // |executor| is null, a work-stealing thread pool shared by all bindings is
+  // used. The handle stays valid and may still be written to and closed, but
+  // shouldn't be read from; closing it ends the binding. On success
+  // |*binding_id| may be passed to CancelAsyncWait() to unbind the pipe.
+  // Returns MOJO_RESULT_FAILED_PRECONDITION, without calling |handler|, if
+  // there's nothing left to read and the peer is already closed.
+  MojoResult BindMessagePipe(MojoHandle message_pipe_handle,
+                             scoped_refptr<base::TaskRunner> executor,
+                             uint32_t max_batch_size,
+                             const MessageBatchHandler& handler,
+                             uintptr_t* binding_id);
+
+  // Reads the next message from a message pipe without blocking a thread on
+  // it: once one arrives, |callback| is posted to |executor| with it, or with
+  // the reason there won't be one. |executor| defaults as for
+  // BindMessagePipe(). The pipe may still be read from meanwhile; a message
+  // read by someone else first is simply waited past. |*wait_id| may be
+  // passed to CancelAsyncWait() to drop the read. Returns
+  // MOJO_RESULT_FAILED_PRECONDITION, without calling |callback|, if there's
+  // nothing left to read and the peer is already closed.
+  MojoResult ReadMessageAsync(MojoHandle message_pipe_handle,
+                              scoped_refptr<base::TaskRunner> executor,
+                              const ReadMessageCallback& callback,
+                              uintptr_t* wait_id);
+
+  // Sets how many bytes a data pipe consumer must have available to read, or
+  // a producer to write, before it satisfies
+  // MOJO_HANDLE_SIGNAL_THRESHOLD_REACHED. Until a threshold is set, or after
+  // it's set to zero, the handle never reports that signal. Returns
+  // MOJO_RESULT_INVALID_ARGUMENT if |num_bytes| is more than the pipe's
+  // capacity or not a whole number of elements.
+  MojoResult SetDataPipeThreshold(MojoHandle data_pipe_handle,
+                                  uint32_t num_bytes);
+
+  // Sets the threshold of a data pipe consumer or producer to |num_bytes|,
+  // which mustn't be zero, and posts |callback| to |executor| once it's
+  // reached, or can't be any more.
+  // |executor| defaults as for BindMessagePipe(). |*wait_id| may be passed to
+  // CancelAsyncWait().
+  MojoResult WaitDataPipeAsync(MojoHandle data_pipe_handle,
+                               uint32_t num_bytes,
+                               scoped_refptr<base::TaskRunner> executor,
+                               const base::Callback<void(MojoResult)>& callback,
+                               uintptr_t* wait_id);
+
   // ---------------------------------------------------------------------------
 
   // The following methods are essentially implementations of the Mojo Core
@@ -98,6 +196,10 @@ class MOJO_SYSTEM_IMPL_EXPORT Core {
   // "mojo/public/c/system/functions.h":
   MojoTimeTicks GetTimeTicksNow();
   MojoResult Close(MojoHandle handle);
+  // Like Close() for each of |handles|, except that the peers of any pipes on
+  // the same node are told of the closures together. Every valid handle is
+  // closed; MOJO_RESULT_INVALID_ARGUMENT is returned if any was invalid.
+  MojoResult CloseHandles(const MojoHandle* handles, uint32_t num_handles);
   MojoResult Wait(MojoHandle handle,
                   MojoHandleSignals signals,
                   MojoDeadline deadline,
@@ -129,6 +231,16 @@ class MOJO_SYSTEM_IMPL_EXPORT Core {
       const MojoCreateMessagePipeOptions* options,
       MojoHandle* message_pipe_handle0,
       MojoHandle* message_pipe_handle1);
+  // Like CreateMessagePipe for each of |num_pipes| pipes, whose ends are
+  // stored in |message_pipe_handles0| and |message_pipe_handles1|, but with
+  // one handle table reservation and one batch of ports for them all.
+  // |options| are validated as for CreateMessagePipe. Returns
+  // MOJO_RESULT_RESOURCE_EXHAUSTED, creating none of them, if there aren't
+  // enough handles left.
+  MojoResult CreateMessagePipes(const MojoCreateMessagePipeOptions* options,
+                                uint32_t num_pipes,
+                                MojoHandle* message_pipe_handles0,
+                                MojoHandle* message_pipe_handles1);
   MojoResult WriteMessage(MojoHandle message_pipe_handle,
                           const void* bytes,
                           uint32_t num_bytes,
@@ -142,6 +254,78 @@ class MOJO_SYSTEM_IMPL_EXPORT Core {
                          uint32_t* num_handles,
                          MojoReadMessageFlags flags);
 
+  // Limits the unread messages and bytes which may queue up at a message pipe
+  // handle, where zero means unlimited. Messages are never refused, but while
+  // either limit is exceeded the peer handle is signaled with
+  // MOJO_HANDLE_SIGNAL_PEER_OVER_QUOTA instead of MOJO_HANDLE_SIGNAL_WRITABLE,
+  // so that its writer can wait for the reader to catch up.
+  MojoResult SetQuota(MojoHandle message_pipe_handle,
+                      uint64_t max_queued_messages,
+                      uint64_t max_queued_bytes);
+
+  // Allocates a message with room for |num_bytes| of contents, which the
+  // caller fills in through GetMessageBuffer() and then sends with
+  // WriteMessageNew(), or releases with FreeMessage(). |handles| are attached
+  // to the message and closed immediately, as if the message had been
+  // written; they are lost if the message is freed without being sent.
+  MojoResult AllocMessage(uint32_t num_bytes,
+                          const MojoHandle* handles,
+                          uint32_t num_handles,
+                          MessageForTransit** message);
+
+  // Sends a message from AllocMessage(). |message| is consumed whether or not
+  // this succeeds. Results are as for WriteMessage.
+  MojoResult WriteMessageNew(MojoHandle message_pipe_handle,
+                             MessageForTransit* message,
+                             MojoWriteMessageFlags flags);
+
+  // Reads the next message from a message pipe without copying its contents.
+  // On success, |*message| is set to an opaque message object which owns the
+  // received buffer; its contents are retrieved with GetMessageBuffer() and it
+  // must be released with FreeMessage(). |*num_bytes|, if |num_bytes| is
+  // non-null, is set to the size of the contents. The message's handles must
+  // still fit in |handles|; otherwise results are as for ReadMessage.
+  MojoResult ReadMessageNew(MojoHandle message_pipe_handle,
+                            MessageForTransit** message,
+                            uint32_t* num_bytes,
+                            MojoHandle* handles,
+                            uint32_t* num_handles,
+                            MojoReadMessageFlags flags);
+  MojoResult GetMessageBuffer(MessageForTransit* message, void** buffer);
+  // Opens the handles of a message read with
+  // MOJO_READ_MESSAGE_FLAG_DEFER_HANDLES, adding them to the handle table
+  // together. |*num_handles| is set to the number of handles; if that's more
+  // than it was, nothing is opened and MOJO_RESULT_RESOURCE_EXHAUSTED is
+  // returned. A message whose handles were already opened has none left.
+  MojoResult TakeMessageHandles(MessageForTransit* message,
+                                MojoHandle* handles,
+                                uint32_t* num_handles);
+  MojoResult FreeMessage(MessageForTransit* message);
+
+  // Reads up to |*num_messages| messages from a message pipe at once, which is
+  // cheaper than reading them one by one. Their contents are packed back to
+  // back into |bytes| (of size |num_bytes|) and their handles into |handles|
+  // (of size |num_handles|). The size and handle count of each message are
+  // stored in |message_num_bytes| and |message_num_handles|, which must each
+  // have room for |*num_messages| entries. On success, |*num_messages| is set
+  // to the number of messages read.
+  //
+  // Reading stops before the first message which doesn't fit in what is left
+  // of the buffers. If not even the first message fits, this returns
+  // MOJO_RESULT_RESOURCE_EXHAUSTED with its requirements in
+  // |message_num_bytes[0]| and |message_num_handles[0]|, and also discards it
+  // if |flags| has MOJO_READ_MESSAGE_FLAG_MAY_DISCARD. Otherwise, results are
+  // as for ReadMessage.
+  MojoResult ReadMessages(MojoHandle message_pipe_handle,
+                          void* bytes,
+                          uint32_t num_bytes,
+                          uint32_t* message_num_bytes,
+                          MojoHandle* handles,
+                          uint32_t num_handles,
+                          uint32_t* message_num_handles,
+                          uint32_t* num_messages,
+                          MojoReadMessageFlags flags);
+
   // These methods correspond to the API functions defined in
   // "mojo/public/c/system/data_pipe.h":
   MojoResult CreateDataPipe(
@@ -196,14 +380,39 @@ class MOJO_SYSTEM_IMPL_EXPORT Core {
                               uint32_t *result_index,
                               HandleSignalsState* signals_states);
 
+  // Returns the shared executor used when none is given to BindMessagePipe()
+  // and the other async operations.
+  scoped_refptr<base::TaskRunner> GetDefaultExecutor();
+
+  MojoResult StartTaskRunnerWaiter(
+      scoped_refptr<Dispatcher> dispatcher,
+      MojoHandleSignals signals,
+      bool persistent,
+      scoped_refptr<base::TaskRunner> task_runner,
+      const TaskRunnerWaiter::ConditionalCallback& callback,
+      uintptr_t* wait_id);
+  void OnTaskRunnerWaiterDone(uintptr_t wait_id);
+
   NodeController node_controller_;
 
-  base::Lock handles_lock_;
+  // Serializes changes to |handles_|. Lookups are lock-free and don't take it.
+  ProfiledLock handles_lock_;
   HandleTable handles_;
 
   base::Lock mapping_table_lock_;  // Protects |mapping_table_|.
   MappingTable mapping_table_;
 
+  // Unfinished waits started by AsyncWaitOnTaskRunner.
+  base::Lock task_runner_waiters_lock_;
+  uintptr_t next_wait_id_ = 1;
+  std::unordered_map<uintptr_t, scoped_refptr<TaskRunnerWaiter>>
+      task_runner_waiters_;
+
+  // The default executor for async operations, created on first use under
+  // |task_runner_waiters_lock_|. It's declared last so that it finishes its
+  // tasks and stops while the rest of Core is still intact.
+  scoped_ptr<WorkStealingThreadPool> binding_thread_pool_;
+
   DISALLOW_COPY_AND_ASSIGN(Core);
 };
 
@@ -5,14 +5,21 @@
 #include "mojo/edk/system/core.h"
 
 #include <stdint.h>
+#include <string.h>
 
 #include <limits>
+#include <string>
+#include <vector>
 
 #include "base/bind.h"
+#include "base/synchronization/waitable_event.h"
+#include "base/test/test_simple_task_runner.h"
 #include "mojo/edk/embedder/embedder_internal.h"
 #include "mojo/edk/system/awakable.h"
 #include "mojo/edk/system/core_test_base.h"
+#include "mojo/edk/system/message_pipe_dispatcher.h"
 #include "mojo/edk/system/test_utils.h"
+#include "mojo/edk/system/work_stealing_thread_pool.h"
 #include "mojo/public/cpp/system/macros.h"
 
 #if defined(OS_WIN)
@@ -668,6 +675,395 @@ TEST_F(CoreTest, MessagePipe) {
   ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h[1]));
 }
 
+TEST_F(CoreTest, MessagePipeReadMessages) {
+  MojoHandle h[2];
+  ASSERT_EQ(MOJO_RESULT_OK, core()->CreateMessagePipe(nullptr, &h[0], &h[1]));
+
+  char buffer[8];
+  uint32_t message_num_bytes[4];
+  uint32_t message_num_handles[4];
+  uint32_t num_messages = 4;
+  ASSERT_EQ(MOJO_RESULT_SHOULD_WAIT,
+            core()->ReadMessages(h[0], buffer, sizeof(buffer),
+                                 message_num_bytes, nullptr, 0,
+                                 message_num_handles, &num_messages,
+                                 MOJO_READ_MESSAGE_FLAG_NONE));
+
+  const char* kMessages[] = {"a", "bb", "ccc", "dddd"};
+  for (const char* message : kMessages) {
+    ASSERT_EQ(MOJO_RESULT_OK,
+              core()->WriteMessage(h[1], message,
+                                   static_cast<uint32_t>(strlen(message)),
+                                   nullptr, 0, MOJO_WRITE_MESSAGE_FLAG_NONE));
+  }
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Wait(h[0], MOJO_HANDLE_SIGNAL_READABLE,
+                                         MOJO_DEADLINE_INDEFINITE, nullptr));
+
+  // Without space for the first message, only its size is reported.
+  num_messages = 4;
+  ASSERT_EQ(MOJO_RESULT_RESOURCE_EXHAUSTED,
+            core()->ReadMessages(h[0], nullptr, 0, message_num_bytes, nullptr,
+                                 0, message_num_handles, &num_messages,
+                                 MOJO_READ_MESSAGE_FLAG_NONE));
+  EXPECT_EQ(1u, message_num_bytes[0]);
+  EXPECT_EQ(0u, message_num_handles[0]);
+
+  // Messages are read for as long as they fit.
+  num_messages = 4;
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->ReadMessages(h[0], buffer, 5, message_num_bytes, nullptr,
+                                 0, message_num_handles, &num_messages,
+                                 MOJO_READ_MESSAGE_FLAG_NONE));
+  ASSERT_EQ(2u, num_messages);
+  EXPECT_EQ(1u, message_num_bytes[0]);
+  EXPECT_EQ(2u, message_num_bytes[1]);
+  EXPECT_EQ(0u, message_num_handles[0]);
+  EXPECT_EQ(0u, message_num_handles[1]);
+  EXPECT_EQ(0, memcmp("abb", buffer, 3));
+
+  // At most |num_messages| are read.
+  num_messages = 1;
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->ReadMessages(h[0], buffer, sizeof(buffer),
+                                 message_num_bytes, nullptr, 0,
+                                 message_num_handles, &num_messages,
+                                 MOJO_READ_MESSAGE_FLAG_NONE));
+  ASSERT_EQ(1u, num_messages);
+  EXPECT_EQ(3u, message_num_bytes[0]);
+  EXPECT_EQ(0, memcmp("ccc", buffer, 3));
+
+  num_messages = 4;
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->ReadMessages(h[0], buffer, sizeof(buffer),
+                                 message_num_bytes, nullptr, 0,
+                                 message_num_handles, &num_messages,
+                                 MOJO_READ_MESSAGE_FLAG_NONE));
+  ASSERT_EQ(1u, num_messages);
+  EXPECT_EQ(4u, message_num_bytes[0]);
+  EXPECT_EQ(0, memcmp("dddd", buffer, 4));
+
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h[1]));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Wait(h[0], MOJO_HANDLE_SIGNAL_PEER_CLOSED,
+                                         MOJO_DEADLINE_INDEFINITE, nullptr));
+  num_messages = 4;
+  ASSERT_EQ(MOJO_RESULT_FAILED_PRECONDITION,
+            core()->ReadMessages(h[0], buffer, sizeof(buffer),
+                                 message_num_bytes, nullptr, 0,
+                                 message_num_handles, &num_messages,
+                                 MOJO_READ_MESSAGE_FLAG_NONE));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h[0]));
+}
+
+TEST_F(CoreTest, MessagePipeQuota) {
+  MojoHandle h[2];
+  ASSERT_EQ(MOJO_RESULT_OK, core()->CreateMessagePipe(nullptr, &h[0], &h[1]));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->SetQuota(h[0], 1, 0));
+
+  // Going over the quota doesn't fail any writes, but it takes WRITABLE away
+  // from the writer.
+  const char kHello[] = "hello";
+  for (size_t i = 0; i < 2; ++i) {
+    ASSERT_EQ(MOJO_RESULT_OK,
+              core()->WriteMessage(h[1], kHello, sizeof(kHello), nullptr, 0,
+                                   MOJO_WRITE_MESSAGE_FLAG_NONE));
+  }
+  MojoHandleSignalsState hss;
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->Wait(h[1], MOJO_HANDLE_SIGNAL_PEER_OVER_QUOTA,
+                         MOJO_DEADLINE_INDEFINITE, &hss));
+  EXPECT_FALSE(hss.satisfied_signals & MOJO_HANDLE_SIGNAL_WRITABLE);
+  EXPECT_TRUE(hss.satisfiable_signals & MOJO_HANDLE_SIGNAL_WRITABLE);
+
+  // Once the reader catches up, the writer may carry on.
+  char buffer[sizeof(kHello)];
+  uint32_t num_bytes = sizeof(buffer);
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->ReadMessage(h[0], buffer, &num_bytes, nullptr, nullptr,
+                                MOJO_READ_MESSAGE_FLAG_NONE));
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->Wait(h[1], MOJO_HANDLE_SIGNAL_WRITABLE,
+                         MOJO_DEADLINE_INDEFINITE, &hss));
+  EXPECT_FALSE(hss.satisfied_signals & MOJO_HANDLE_SIGNAL_PEER_OVER_QUOTA);
+
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h[0]));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h[1]));
+}
+
+TEST_F(CoreTest, CreateMessagePipes) {
+  const uint32_t kNumPipes = 64;
+  MojoHandle h0[kNumPipes], h1[kNumPipes];
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->CreateMessagePipes(nullptr, kNumPipes, h0, h1));
+
+  // Each pair of handles is connected to each other, and nothing else.
+  for (uint32_t i = 0; i < kNumPipes; ++i) {
+    ASSERT_EQ(MOJO_RESULT_OK,
+              core()->WriteMessage(h0[i], &i, sizeof(i), nullptr, 0,
+                                   MOJO_WRITE_MESSAGE_FLAG_NONE));
+  }
+  for (uint32_t i = 0; i < kNumPipes; ++i) {
+    ASSERT_EQ(MOJO_RESULT_OK, core()->Wait(h1[i], MOJO_HANDLE_SIGNAL_READABLE,
+                                           MOJO_DEADLINE_INDEFINITE, nullptr));
+    uint32_t value = 0;
+    uint32_t num_bytes = sizeof(value);
+    ASSERT_EQ(MOJO_RESULT_OK,
+              core()->ReadMessage(h1[i], &value, &num_bytes, nullptr, nullptr,
+                                  MOJO_READ_MESSAGE_FLAG_NONE));
+    EXPECT_EQ(sizeof(value), num_bytes);
+    EXPECT_EQ(i, value);
+    EXPECT_EQ(MOJO_RESULT_SHOULD_WAIT,
+              core()->ReadMessage(h0[i], nullptr, nullptr, nullptr, nullptr,
+                                  MOJO_READ_MESSAGE_FLAG_NONE));
+  }
+
+  ASSERT_EQ(MOJO_RESULT_OK, core()->CloseHandles(h0, kNumPipes));
+  for (uint32_t i = 0; i < kNumPipes; ++i) {
+    ASSERT_EQ(MOJO_RESULT_OK,
+              core()->Wait(h1[i], MOJO_HANDLE_SIGNAL_PEER_CLOSED,
+                           MOJO_DEADLINE_INDEFINITE, nullptr));
+  }
+  ASSERT_EQ(MOJO_RESULT_OK, core()->CloseHandles(h1, kNumPipes));
+
+  // Creating none does nothing.
+  EXPECT_EQ(MOJO_RESULT_OK,
+            core()->CreateMessagePipes(nullptr, 0, nullptr, nullptr));
+}
+
+TEST_F(CoreTest, CreateMessagePipesInvalidOptions) {
+  MojoHandle h0[2], h1[2];
+  MojoCreateMessagePipeOptions options;
+
+  // Too small to be valid.
+  options.struct_size = 1;
+  options.flags = MOJO_CREATE_MESSAGE_PIPE_OPTIONS_FLAG_NONE;
+  EXPECT_EQ(MOJO_RESULT_INVALID_ARGUMENT,
+            core()->CreateMessagePipes(&options, 2, h0, h1));
+  EXPECT_EQ(MOJO_RESULT_INVALID_ARGUMENT,
+            core()->CreateMessagePipe(&options, &h0[0], &h1[0]));
+
+  // Unknown flags.
+  options.struct_size = sizeof(MojoCreateMessagePipeOptions);
+  options.flags = ~MOJO_CREATE_MESSAGE_PIPE_OPTIONS_FLAG_TRANSFERABLE;
+  EXPECT_EQ(MOJO_RESULT_UNIMPLEMENTED,
+            core()->CreateMessagePipes(&options, 2, h0, h1));
+  EXPECT_EQ(MOJO_RESULT_UNIMPLEMENTED,
+            core()->CreateMessagePipe(&options, &h0[0], &h1[0]));
+
+  // Invalid options are rejected even when no pipes are asked for.
+  EXPECT_EQ(MOJO_RESULT_UNIMPLEMENTED,
+            core()->CreateMessagePipes(&options, 0, nullptr, nullptr));
+
+  options.flags = MOJO_CREATE_MESSAGE_PIPE_OPTIONS_FLAG_NONE;
+  ASSERT_EQ(MOJO_RESULT_OK, core()->CreateMessagePipes(&options, 2, h0, h1));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->CloseHandles(h0, 2));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->CloseHandles(h1, 2));
+}
+
+TEST_F(CoreTest, CloseHandles) {
+  MojoHandle h[4];
+  ASSERT_EQ(MOJO_RESULT_OK, core()->CreateMessagePipe(nullptr, &h[0], &h[1]));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->CreateMessagePipe(nullptr, &h[2], &h[3]));
+
+  // The valid handles are closed even though one isn't.
+  MojoHandle handles[] = {h[0], MOJO_HANDLE_INVALID, h[2]};
+  EXPECT_EQ(MOJO_RESULT_INVALID_ARGUMENT, core()->CloseHandles(handles, 3));
+
+  MojoHandleSignalsState hss;
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->Wait(h[1], MOJO_HANDLE_SIGNAL_PEER_CLOSED,
+                         MOJO_DEADLINE_INDEFINITE, &hss));
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->Wait(h[3], MOJO_HANDLE_SIGNAL_PEER_CLOSED,
+                         MOJO_DEADLINE_INDEFINITE, &hss));
+
+  MojoHandle remaining[] = {h[1], h[3]};
+  EXPECT_EQ(MOJO_RESULT_OK, core()->CloseHandles(remaining, 2));
+  EXPECT_EQ(MOJO_RESULT_INVALID_ARGUMENT, core()->Close(h[1]));
+}
+
+TEST_F(CoreTest, MessagePipeAllocMessage) {
+  MojoHandle h[2];
+  ASSERT_EQ(MOJO_RESULT_OK, core()->CreateMessagePipe(nullptr, &h[0], &h[1]));
+  MojoHandle h_passed[2];
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->CreateMessagePipe(nullptr, &h_passed[0], &h_passed[1]));
+
+  const char kHello[] = "hello";
+  const uint32_t kHelloSize = static_cast<uint32_t>(sizeof(kHello));
+  MessageForTransit* message = nullptr;
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->AllocMessage(kHelloSize, &h_passed[1], 1, &message));
+  ASSERT_TRUE(message);
+
+  // Attached handles are closed right away.
+  EXPECT_EQ(MOJO_RESULT_INVALID_ARGUMENT, core()->Close(h_passed[1]));
+
+  void* buffer = nullptr;
+  ASSERT_EQ(MOJO_RESULT_OK, core()->GetMessageBuffer(message, &buffer));
+  memcpy(buffer, kHello, kHelloSize);
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->WriteMessageNew(h[1], message,
+                                    MOJO_WRITE_MESSAGE_FLAG_NONE));
+
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Wait(h[0], MOJO_HANDLE_SIGNAL_READABLE,
+                                         MOJO_DEADLINE_INDEFINITE, nullptr));
+  char read_buffer[kHelloSize];
+  uint32_t num_bytes = kHelloSize;
+  MojoHandle received_handle = MOJO_HANDLE_INVALID;
+  uint32_t num_handles = 1;
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->ReadMessage(h[0], read_buffer, &num_bytes,
+                                &received_handle, &num_handles,
+                                MOJO_READ_MESSAGE_FLAG_NONE));
+  EXPECT_EQ(kHelloSize, num_bytes);
+  EXPECT_STREQ(kHello, read_buffer);
+  ASSERT_EQ(1u, num_handles);
+
+  // The attached handle made it across.
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->WriteMessage(h_passed[0], kHello, kHelloSize, nullptr, 0,
+                                 MOJO_WRITE_MESSAGE_FLAG_NONE));
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->Wait(received_handle, MOJO_HANDLE_SIGNAL_READABLE,
+                         MOJO_DEADLINE_INDEFINITE, nullptr));
+
+  // Messages without handles can be freed without being sent.
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->AllocMessage(kHelloSize, nullptr, 0, &message));
+  EXPECT_EQ(MOJO_RESULT_OK, core()->FreeMessage(message));
+
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(received_handle));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h_passed[0]));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h[0]));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h[1]));
+}
+
+TEST_F(CoreTest, MessagePipeReadMessageNew) {
+  MojoHandle h[2];
+  ASSERT_EQ(MOJO_RESULT_OK, core()->CreateMessagePipe(nullptr, &h[0], &h[1]));
+  MojoHandle h_passed[2];
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->CreateMessagePipe(nullptr, &h_passed[0], &h_passed[1]));
+
+  MessageForTransit* message = nullptr;
+  ASSERT_EQ(MOJO_RESULT_SHOULD_WAIT,
+            core()->ReadMessageNew(h[0], &message, nullptr, nullptr, nullptr,
+                                   MOJO_READ_MESSAGE_FLAG_NONE));
+
+  const char kHello[] = "hello";
+  const uint32_t kHelloSize = static_cast<uint32_t>(sizeof(kHello));
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->WriteMessage(h[1], kHello, kHelloSize, &h_passed[1], 1,
+                                 MOJO_WRITE_MESSAGE_FLAG_NONE));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Wait(h[0], MOJO_HANDLE_SIGNAL_READABLE,
+                                         MOJO_DEADLINE_INDEFINITE, nullptr));
+
+  // The message's handles must still fit.
+  uint32_t num_bytes = 0;
+  uint32_t num_handles = 0;
+  ASSERT_EQ(MOJO_RESULT_RESOURCE_EXHAUSTED,
+            core()->ReadMessageNew(h[0], &message, &num_bytes, nullptr,
+                                   &num_handles, MOJO_READ_MESSAGE_FLAG_NONE));
+  EXPECT_EQ(kHelloSize, num_bytes);
+  EXPECT_EQ(1u, num_handles);
+
+  // The contents don't need to fit anywhere.
+  MojoHandle received_handle = MOJO_HANDLE_INVALID;
+  num_bytes = 0;
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->ReadMessageNew(h[0], &message, &num_bytes,
+                                   &received_handle, &num_handles,
+                                   MOJO_READ_MESSAGE_FLAG_NONE));
+  ASSERT_TRUE(message);
+  EXPECT_EQ(kHelloSize, num_bytes);
+  EXPECT_EQ(1u, num_handles);
+  EXPECT_NE(MOJO_HANDLE_INVALID, received_handle);
+
+  void* buffer = nullptr;
+  ASSERT_EQ(MOJO_RESULT_OK, core()->GetMessageBuffer(message, &buffer));
+  EXPECT_STREQ(kHello, static_cast<char*>(buffer));
+  EXPECT_EQ(MOJO_RESULT_OK, core()->FreeMessage(message));
+
+  // The received handle still works after its message is freed.
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->WriteMessage(h_passed[0], kHello, kHelloSize, nullptr, 0,
+                                 MOJO_WRITE_MESSAGE_FLAG_NONE));
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->Wait(received_handle, MOJO_HANDLE_SIGNAL_READABLE,
+                         MOJO_DEADLINE_INDEFINITE, nullptr));
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->ReadMessageNew(received_handle, &message, &num_bytes,
+                                   nullptr, nullptr,
+                                   MOJO_READ_MESSAGE_FLAG_NONE));
+  EXPECT_EQ(kHelloSize, num_bytes);
+  ASSERT_EQ(MOJO_RESULT_OK, core()->GetMessageBuffer(message, &buffer));
+  EXPECT_STREQ(kHello, static_cast<char*>(buffer));
+  EXPECT_EQ(MOJO_RESULT_OK, core()->FreeMessage(message));
+
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(received_handle));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h_passed[0]));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h[0]));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h[1]));
+}
+
+TEST_F(CoreTest, MessagePipeReadMessageNewDeferHandles) {
+  MojoHandle h[2];
+  ASSERT_EQ(MOJO_RESULT_OK, core()->CreateMessagePipe(nullptr, &h[0], &h[1]));
+  MojoHandle h_passed[2];
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->CreateMessagePipe(nullptr, &h_passed[0], &h_passed[1]));
+
+  const char kHello[] = "hello";
+  const uint32_t kHelloSize = static_cast<uint32_t>(sizeof(kHello));
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->WriteMessage(h[1], kHello, kHelloSize, &h_passed[1], 1,
+                                 MOJO_WRITE_MESSAGE_FLAG_NONE));
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->WriteMessage(h[1], kHello, kHelloSize, &h_passed[0], 1,
+                                 MOJO_WRITE_MESSAGE_FLAG_NONE));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Wait(h[0], MOJO_HANDLE_SIGNAL_READABLE,
+                                         MOJO_DEADLINE_INDEFINITE, nullptr));
+
+  // The handles needn't fit, and are taken once the message is accepted.
+  MessageForTransit* message = nullptr;
+  uint32_t num_handles = 0;
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->ReadMessageNew(h[0], &message, nullptr, nullptr,
+                                   &num_handles,
+                                   MOJO_READ_MESSAGE_FLAG_DEFER_HANDLES));
+  ASSERT_TRUE(message);
+  EXPECT_EQ(1u, num_handles);
+  num_handles = 0;
+  EXPECT_EQ(MOJO_RESULT_RESOURCE_EXHAUSTED,
+            core()->TakeMessageHandles(message, nullptr, &num_handles));
+  EXPECT_EQ(1u, num_handles);
+  MojoHandle received_handle = MOJO_HANDLE_INVALID;
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->TakeMessageHandles(message, &received_handle,
+                                       &num_handles));
+  EXPECT_EQ(1u, num_handles);
+  EXPECT_NE(MOJO_HANDLE_INVALID, received_handle);
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->TakeMessageHandles(message, nullptr, &num_handles));
+  EXPECT_EQ(0u, num_handles);
+  EXPECT_EQ(MOJO_RESULT_OK, core()->FreeMessage(message));
+
+  // Freeing a message without taking its handles closes them.
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Wait(h[0], MOJO_HANDLE_SIGNAL_READABLE,
+                                         MOJO_DEADLINE_INDEFINITE, nullptr));
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->ReadMessageNew(h[0], &message, nullptr, nullptr, nullptr,
+                                   MOJO_READ_MESSAGE_FLAG_DEFER_HANDLES));
+  EXPECT_EQ(MOJO_RESULT_OK, core()->FreeMessage(message));
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->Wait(received_handle, MOJO_HANDLE_SIGNAL_PEER_CLOSED,
+                         MOJO_DEADLINE_INDEFINITE, nullptr));
+
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(received_handle));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h[0]));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h[1]));
+}
+
 // Tests passing a message pipe handle.
 TEST_F(CoreTest, MessagePipeBasicLocalHandlePassing1) {
   const char kHello[] = "hello";
@@ -1267,6 +1663,465 @@ TEST_F(CoreTest, AsyncWait) {
   ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h));
 }
 
+TEST_F(CoreTest, WaitSpin) {
+  Core::SetWaitSpinTime(10000);
+  MojoHandle h[2];
+  ASSERT_EQ(MOJO_RESULT_OK, core()->CreateMessagePipe(nullptr, &h[0], &h[1]));
+
+  // Polling counts against the deadline.
+  MojoHandleSignals signals[2] = {MOJO_HANDLE_SIGNAL_READABLE,
+                                  MOJO_HANDLE_SIGNAL_READABLE};
+  MojoHandleSignalsState hss[2];
+  uint32_t result_index = static_cast<uint32_t>(-1);
+  EXPECT_EQ(MOJO_RESULT_DEADLINE_EXCEEDED,
+            core()->WaitMany(h, signals, 2, 1000, &result_index, hss));
+  EXPECT_EQ(static_cast<uint32_t>(-1), result_index);
+  EXPECT_EQ(MOJO_HANDLE_SIGNAL_WRITABLE, hss[1].satisfied_signals);
+
+  // A handle found ready while polling is reported as if it had been waited
+  // on.
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->WriteMessage(h[0], "a", 1, nullptr, 0,
+                                 MOJO_WRITE_MESSAGE_FLAG_NONE));
+  result_index = static_cast<uint32_t>(-1);
+  EXPECT_EQ(MOJO_RESULT_OK,
+            core()->WaitMany(h, signals, 2, MOJO_DEADLINE_INDEFINITE,
+                             &result_index, hss));
+  EXPECT_EQ(1u, result_index);
+  EXPECT_EQ(MOJO_HANDLE_SIGNAL_WRITABLE, hss[0].satisfied_signals);
+  EXPECT_EQ(MOJO_HANDLE_SIGNAL_READABLE | MOJO_HANDLE_SIGNAL_WRITABLE,
+            hss[1].satisfied_signals);
+
+  // Signals which can never be satisfied are still reported.
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h[0]));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Wait(h[1], MOJO_HANDLE_SIGNAL_PEER_CLOSED,
+                                         MOJO_DEADLINE_INDEFINITE, nullptr));
+  EXPECT_EQ(MOJO_RESULT_FAILED_PRECONDITION,
+            core()->Wait(h[1], MOJO_HANDLE_SIGNAL_WRITABLE,
+                         MOJO_DEADLINE_INDEFINITE, &hss[1]));
+  EXPECT_EQ(MOJO_RESULT_INVALID_ARGUMENT,
+            core()->Wait(h[0], MOJO_HANDLE_SIGNAL_READABLE,
+                         MOJO_DEADLINE_INDEFINITE, nullptr));
+
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h[1]));
+  Core::SetWaitSpinTime(0);
+}
+
+struct TestTaskRunnerWaiter {
+  void Awake(MojoResult r) { results.push_back(r); }
+
+  std::vector<MojoResult> results;
+};
+
+TEST_F(CoreTest, AsyncWaitOnTaskRunner) {
+  scoped_refptr<base::TestSimpleTaskRunner> task_runner(
+      new base::TestSimpleTaskRunner);
+  MojoHandle h[2];
+  ASSERT_EQ(MOJO_RESULT_OK, core()->CreateMessagePipe(nullptr, &h[0], &h[1]));
+
+  TestTaskRunnerWaiter waiter;
+  uintptr_t wait_id;
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->AsyncWaitOnTaskRunner(
+                h[1], MOJO_HANDLE_SIGNAL_READABLE, false, task_runner,
+                base::Bind(&TestTaskRunnerWaiter::Awake,
+                           base::Unretained(&waiter)),
+                &wait_id));
+
+  // The writer doesn't run the callback, and repeated signals are coalesced.
+  char buffer[1] = {'a'};
+  for (int i = 0; i < 3; ++i) {
+    ASSERT_EQ(MOJO_RESULT_OK,
+              core()->WriteMessage(h[0], buffer, 1, nullptr, 0,
+                                   MOJO_WRITE_MESSAGE_FLAG_NONE));
+  }
+  EXPECT_TRUE(waiter.results.empty());
+  EXPECT_EQ(1u, task_runner->GetPendingTasks().size());
+  task_runner->RunPendingTasks();
+  ASSERT_EQ(1u, waiter.results.size());
+  EXPECT_EQ(MOJO_RESULT_OK, waiter.results[0]);
+
+  // It was a one-shot wait, so that's it.
+  EXPECT_FALSE(task_runner->HasPendingTask());
+  EXPECT_EQ(MOJO_RESULT_INVALID_ARGUMENT, core()->CancelAsyncWait(wait_id));
+
+  // Signals which are already satisfied post a call right away.
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->AsyncWaitOnTaskRunner(
+                h[1], MOJO_HANDLE_SIGNAL_READABLE, false, task_runner,
+                base::Bind(&TestTaskRunnerWaiter::Awake,
+                           base::Unretained(&waiter)),
+                &wait_id));
+  EXPECT_EQ(1u, task_runner->GetPendingTasks().size());
+
+  // Cancelling stops the posted call.
+  ASSERT_EQ(MOJO_RESULT_OK, core()->CancelAsyncWait(wait_id));
+  task_runner->RunPendingTasks();
+  EXPECT_EQ(1u, waiter.results.size());
+
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h[0]));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h[1]));
+}
+
+struct DrainingTaskRunnerWaiter {
+  void Awake(MojoResult r) {
+    results.push_back(r);
+    if (r != MOJO_RESULT_OK)
+      return;
+    char buffer[1];
+    uint32_t num_bytes = 1;
+    while (core->ReadMessage(h, buffer, &num_bytes, nullptr, nullptr,
+                             MOJO_READ_MESSAGE_FLAG_NONE) == MOJO_RESULT_OK) {
+      ++num_messages;
+    }
+  }
+
+  Core* core;
+  MojoHandle h;
+  std::vector<MojoResult> results;
+  int num_messages = 0;
+};
+
+TEST_F(CoreTest, PersistentAsyncWaitOnTaskRunner) {
+  scoped_refptr<base::TestSimpleTaskRunner> task_runner(
+      new base::TestSimpleTaskRunner);
+  MojoHandle h[2];
+  ASSERT_EQ(MOJO_RESULT_OK, core()->CreateMessagePipe(nullptr, &h[0], &h[1]));
+
+  // The callback reads from the pipe, which it may since it's posted.
+  DrainingTaskRunnerWaiter waiter;
+  waiter.core = core();
+  waiter.h = h[1];
+  uintptr_t wait_id;
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->AsyncWaitOnTaskRunner(
+                h[1], MOJO_HANDLE_SIGNAL_READABLE, true, task_runner,
+                base::Bind(&DrainingTaskRunnerWaiter::Awake,
+                           base::Unretained(&waiter)),
+                &wait_id));
+
+  char buffer[1] = {'a'};
+  for (int round = 1; round <= 2; ++round) {
+    for (int i = 0; i < 3; ++i) {
+      ASSERT_EQ(MOJO_RESULT_OK,
+                core()->WriteMessage(h[0], buffer, 1, nullptr, 0,
+                                     MOJO_WRITE_MESSAGE_FLAG_NONE));
+    }
+    EXPECT_EQ(1u, task_runner->GetPendingTasks().size());
+    task_runner->RunPendingTasks();
+    EXPECT_EQ(static_cast<size_t>(round), waiter.results.size());
+    EXPECT_EQ(round * 3, waiter.num_messages);
+
+    // The pipe was drained, so the waiter registered again.
+    EXPECT_FALSE(task_runner->HasPendingTask());
+  }
+
+  // Closing the handle finishes the wait.
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h[1]));
+  task_runner->RunPendingTasks();
+  ASSERT_EQ(3u, waiter.results.size());
+  EXPECT_EQ(MOJO_RESULT_CANCELLED, waiter.results[2]);
+  EXPECT_EQ(MOJO_RESULT_INVALID_ARGUMENT, core()->CancelAsyncWait(wait_id));
+
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h[0]));
+}
+
+struct TestMessageBatchHandler {
+  void OnMessages(MojoResult result, std::vector<ReceivedMessage>* messages) {
+    results.push_back(result);
+    batch_sizes.push_back(messages->size());
+    for (const ReceivedMessage& message : *messages) {
+      contents.append(static_cast<const char*>(message.bytes()),
+                      message.num_bytes());
+      handles.insert(handles.end(), message.handles().begin(),
+                     message.handles().end());
+    }
+  }
+
+  std::vector<MojoResult> results;
+  std::vector<size_t> batch_sizes;
+  std::string contents;
+  std::vector<MojoHandle> handles;
+};
+
+TEST_F(CoreTest, BindMessagePipe) {
+  scoped_refptr<base::TestSimpleTaskRunner> task_runner(
+      new base::TestSimpleTaskRunner);
+  MojoHandle h[2];
+  ASSERT_EQ(MOJO_RESULT_OK, core()->CreateMessagePipe(nullptr, &h[0], &h[1]));
+
+  TestMessageBatchHandler handler;
+  uintptr_t binding_id;
+  EXPECT_EQ(MOJO_RESULT_INVALID_ARGUMENT,
+            core()->BindMessagePipe(
+                h[1], task_runner, 0,
+                base::Bind(&TestMessageBatchHandler::OnMessages,
+                           base::Unretained(&handler)),
+                &binding_id));
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->BindMessagePipe(
+                h[1], task_runner, 2,
+                base::Bind(&TestMessageBatchHandler::OnMessages,
+                           base::Unretained(&handler)),
+                &binding_id));
+
+  // A message carrying a handle, then two more.
+  MojoHandle p[2];
+  ASSERT_EQ(MOJO_RESULT_OK, core()->CreateMessagePipe(nullptr, &p[0], &p[1]));
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->WriteMessage(h[0], "a", 1, &p[1], 1,
+                                 MOJO_WRITE_MESSAGE_FLAG_NONE));
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->WriteMessage(h[0], "bc", 2, nullptr, 0,
+                                 MOJO_WRITE_MESSAGE_FLAG_NONE));
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->WriteMessage(h[0], "d", 1, nullptr, 0,
+                                 MOJO_WRITE_MESSAGE_FLAG_NONE));
+  EXPECT_TRUE(handler.results.empty());
+
+  // Each task reads at most two messages, and posts another while any are
+  // left.
+  EXPECT_EQ(1u, task_runner->GetPendingTasks().size());
+  task_runner->RunPendingTasks();
+  ASSERT_EQ(1u, handler.results.size());
+  EXPECT_EQ(2u, handler.batch_sizes[0]);
+  EXPECT_EQ(1u, task_runner->GetPendingTasks().size());
+  task_runner->RunPendingTasks();
+  ASSERT_EQ(2u, handler.results.size());
+  EXPECT_EQ(1u, handler.batch_sizes[1]);
+  EXPECT_FALSE(task_runner->HasPendingTask());
+  EXPECT_EQ("abcd", handler.contents);
+  ASSERT_EQ(1u, handler.handles.size());
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(handler.handles[0]));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(p[0]));
+
+  // Messages still queued when the peer closes are read before the binding
+  // ends.
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->WriteMessage(h[0], "e", 1, nullptr, 0,
+                                 MOJO_WRITE_MESSAGE_FLAG_NONE));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h[0]));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Wait(h[1], MOJO_HANDLE_SIGNAL_PEER_CLOSED,
+                                         MOJO_DEADLINE_INDEFINITE, nullptr));
+  task_runner->RunUntilIdle();
+  ASSERT_EQ(4u, handler.results.size());
+  EXPECT_EQ(MOJO_RESULT_OK, handler.results[2]);
+  EXPECT_EQ(MOJO_RESULT_FAILED_PRECONDITION, handler.results[3]);
+  EXPECT_EQ(0u, handler.batch_sizes[3]);
+  EXPECT_EQ("abcde", handler.contents);
+  EXPECT_EQ(MOJO_RESULT_INVALID_ARGUMENT,
+            core()->CancelAsyncWait(binding_id));
+
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h[1]));
+}
+
+TEST_F(CoreTest, BindMessagePipeOnThreadPool) {
+  const size_t kNumPipes = 64;
+  const int kNumMessages = 20;
+  WorkStealingThreadPool pool("CoreTest", 4);
+
+  // Each pipe is read on whichever worker picks up its task, but its messages
+  // are still handled in order.
+  struct PipeHandler {
+    void OnMessages(MojoResult result,
+                    std::vector<ReceivedMessage>* messages) {
+      if (result != MOJO_RESULT_OK) {
+        done->Signal();
+        return;
+      }
+      for (const ReceivedMessage& message : *messages) {
+        ASSERT_EQ(sizeof(int), message.num_bytes());
+        EXPECT_EQ(next, *static_cast<const int*>(message.bytes()));
+        ++next;
+      }
+    }
+
+    int next = 0;
+    base::WaitableEvent* done;
+  };
+
+  std::vector<MojoHandle> writers(kNumPipes);
+  std::vector<MojoHandle> readers(kNumPipes);
+  std::vector<PipeHandler> handlers(kNumPipes);
+  std::vector<scoped_ptr<base::WaitableEvent>> done(kNumPipes);
+  for (size_t i = 0; i < kNumPipes; ++i) {
+    ASSERT_EQ(MOJO_RESULT_OK,
+              core()->CreateMessagePipe(nullptr, &writers[i], &readers[i]));
+    done[i].reset(new base::WaitableEvent(false, false));
+    handlers[i].done = done[i].get();
+    uintptr_t binding_id;
+    ASSERT_EQ(MOJO_RESULT_OK,
+              core()->BindMessagePipe(
+                  readers[i], pool.task_runner(), 4,
+                  base::Bind(&PipeHandler::OnMessages,
+                             base::Unretained(&handlers[i])),
+                  &binding_id));
+  }
+
+  for (int n = 0; n < kNumMessages; ++n) {
+    for (size_t i = 0; i < kNumPipes; ++i) {
+      ASSERT_EQ(MOJO_RESULT_OK,
+                core()->WriteMessage(writers[i], &n, sizeof(n), nullptr, 0,
+                                     MOJO_WRITE_MESSAGE_FLAG_NONE));
+    }
+  }
+  for (size_t i = 0; i < kNumPipes; ++i)
+    ASSERT_EQ(MOJO_RESULT_OK, core()->Close(writers[i]));
+
+  for (size_t i = 0; i < kNumPipes; ++i) {
+    done[i]->Wait();
+    EXPECT_EQ(kNumMessages, handlers[i].next);
+    ASSERT_EQ(MOJO_RESULT_OK, core()->Close(readers[i]));
+  }
+}
+
+TEST_F(CoreTest, ReadMessageAsync) {
+  scoped_refptr<base::TestSimpleTaskRunner> task_runner(
+      new base::TestSimpleTaskRunner);
+  MojoHandle h[2];
+  ASSERT_EQ(MOJO_RESULT_OK, core()->CreateMessagePipe(nullptr, &h[0], &h[1]));
+
+  struct Reader {
+    void OnMessage(MojoResult result, ReceivedMessage* message) {
+      results.push_back(result);
+      if (result == MOJO_RESULT_OK) {
+        contents.append(static_cast<const char*>(message->bytes()),
+                        message->num_bytes());
+      }
+    }
+
+    std::vector<MojoResult> results;
+    std::string contents;
+  };
+
+  Reader reader;
+  uintptr_t wait_id;
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->ReadMessageAsync(
+                h[1], task_runner,
+                base::Bind(&Reader::OnMessage, base::Unretained(&reader)),
+                &wait_id));
+  EXPECT_FALSE(task_runner->HasPendingTask());
+
+  // A message read by someone else before the posted read runs is skipped
+  // over, and the read waits for the next one.
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->WriteMessage(h[0], "a", 1, nullptr, 0,
+                                 MOJO_WRITE_MESSAGE_FLAG_NONE));
+  EXPECT_EQ(1u, task_runner->GetPendingTasks().size());
+  char buffer[1];
+  uint32_t num_bytes = 1;
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->ReadMessage(h[1], buffer, &num_bytes, nullptr, nullptr,
+                                MOJO_READ_MESSAGE_FLAG_NONE));
+  task_runner->RunPendingTasks();
+  EXPECT_TRUE(reader.results.empty());
+
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->WriteMessage(h[0], "bc", 2, nullptr, 0,
+                                 MOJO_WRITE_MESSAGE_FLAG_NONE));
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->WriteMessage(h[0], "d", 1, nullptr, 0,
+                                 MOJO_WRITE_MESSAGE_FLAG_NONE));
+  task_runner->RunUntilIdle();
+  ASSERT_EQ(1u, reader.results.size());
+  EXPECT_EQ(MOJO_RESULT_OK, reader.results[0]);
+  EXPECT_EQ("bc", reader.contents);
+  EXPECT_EQ(MOJO_RESULT_INVALID_ARGUMENT, core()->CancelAsyncWait(wait_id));
+
+  // A read pending when the peer closes is told there's nothing more to read,
+  // and a read started after that fails at once.
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->ReadMessageAsync(
+                h[1], task_runner,
+                base::Bind(&Reader::OnMessage, base::Unretained(&reader)),
+                &wait_id));
+  task_runner->RunUntilIdle();
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->ReadMessageAsync(
+                h[1], task_runner,
+                base::Bind(&Reader::OnMessage, base::Unretained(&reader)),
+                &wait_id));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h[0]));
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Wait(h[1], MOJO_HANDLE_SIGNAL_PEER_CLOSED,
+                                         MOJO_DEADLINE_INDEFINITE, nullptr));
+  task_runner->RunUntilIdle();
+  ASSERT_EQ(3u, reader.results.size());
+  EXPECT_EQ(MOJO_RESULT_OK, reader.results[1]);
+  EXPECT_EQ(MOJO_RESULT_FAILED_PRECONDITION, reader.results[2]);
+  EXPECT_EQ("bcd", reader.contents);
+  EXPECT_EQ(MOJO_RESULT_FAILED_PRECONDITION,
+            core()->ReadMessageAsync(
+                h[1], task_runner,
+                base::Bind(&Reader::OnMessage, base::Unretained(&reader)),
+                &wait_id));
+
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(h[1]));
+}
+
+TEST_F(CoreTest, WaitDataPipeAsync) {
+  scoped_refptr<base::TestSimpleTaskRunner> task_runner(
+      new base::TestSimpleTaskRunner);
+  const MojoCreateDataPipeOptions options = {
+      static_cast<uint32_t>(sizeof(MojoCreateDataPipeOptions)),
+      MOJO_CREATE_DATA_PIPE_OPTIONS_FLAG_NONE,
+      2,    // |element_num_bytes|.
+      16};  // |capacity_num_bytes|.
+  MojoHandle ph, ch;
+  ASSERT_EQ(MOJO_RESULT_OK, core()->CreateDataPipe(&options, &ph, &ch));
+
+  // The signal isn't reported until a threshold is set.
+  EXPECT_EQ(MOJO_RESULT_FAILED_PRECONDITION,
+            core()->Wait(ch, MOJO_HANDLE_SIGNAL_THRESHOLD_REACHED, 0, nullptr));
+
+  TestTaskRunnerWaiter waiter;
+  const std::vector<MojoResult>& results = waiter.results;
+  base::Callback<void(MojoResult)> on_done = base::Bind(
+      &TestTaskRunnerWaiter::Awake, base::Unretained(&waiter));
+  uintptr_t wait_id;
+  EXPECT_EQ(MOJO_RESULT_INVALID_ARGUMENT,
+            core()->WaitDataPipeAsync(ch, 0, task_runner, on_done, &wait_id));
+  EXPECT_EQ(MOJO_RESULT_INVALID_ARGUMENT,
+            core()->WaitDataPipeAsync(ch, 3, task_runner, on_done, &wait_id));
+  EXPECT_EQ(MOJO_RESULT_INVALID_ARGUMENT,
+            core()->WaitDataPipeAsync(ch, 18, task_runner, on_done, &wait_id));
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->WaitDataPipeAsync(ch, 6, task_runner, on_done, &wait_id));
+
+  // Fewer bytes than the threshold don't wake the wait.
+  uint32_t num_bytes = 4;
+  ASSERT_EQ(MOJO_RESULT_OK, core()->WriteData(ph, "abcd", &num_bytes,
+                                              MOJO_WRITE_DATA_FLAG_NONE));
+  task_runner->RunUntilIdle();
+  EXPECT_TRUE(results.empty());
+
+  num_bytes = 2;
+  ASSERT_EQ(MOJO_RESULT_OK, core()->WriteData(ph, "ef", &num_bytes,
+                                              MOJO_WRITE_DATA_FLAG_NONE));
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->Wait(ch, MOJO_HANDLE_SIGNAL_THRESHOLD_REACHED,
+                         MOJO_DEADLINE_INDEFINITE, nullptr));
+  task_runner->RunUntilIdle();
+  ASSERT_EQ(1u, results.size());
+  EXPECT_EQ(MOJO_RESULT_OK, results[0]);
+
+  // Once the producer is gone, a threshold above what's left can't be
+  // reached.
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(ph));
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->Wait(ch, MOJO_HANDLE_SIGNAL_PEER_CLOSED,
+                         MOJO_DEADLINE_INDEFINITE, nullptr));
+  EXPECT_EQ(MOJO_RESULT_FAILED_PRECONDITION,
+            core()->WaitDataPipeAsync(ch, 8, task_runner, on_done, &wait_id));
+  ASSERT_EQ(MOJO_RESULT_OK,
+            core()->WaitDataPipeAsync(ch, 6, task_runner, on_done, &wait_id));
+  task_runner->RunUntilIdle();
+  ASSERT_EQ(2u, results.size());
+  EXPECT_EQ(MOJO_RESULT_OK, results[1]);
+
+  ASSERT_EQ(MOJO_RESULT_OK, core()->Close(ch));
+}
+
 // TODO(vtl): Test |DuplicateBufferHandle()| and |MapBuffer()|.
 
 }  // namespace
@@ -6,6 +6,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 #include <algorithm>
 #include <utility>
@@ -18,16 +19,23 @@
 #include "mojo/edk/embedder/platform_support.h"
 #include "mojo/edk/system/core.h"
 #include "mojo/edk/system/data_pipe.h"
+#include "mojo/edk/system/data_pipe_control_message.h"
+#include "mojo/edk/system/metrics_registry.h"
 #include "mojo/edk/system/node_controller.h"
+#include "mojo/edk/system/shared_buffer_dispatcher.h"
 
 namespace mojo {
 namespace edk {
 
 namespace {
 
+// This is followed by the serialized SharedBufferDispatcher for the ring
+// buffer if the pipe has one, or by the unread data if it doesn't.
 struct SerializedState {
   MojoCreateDataPipeOptions options;
   bool error;
+  uint32_t read_offset;
+  uint32_t bytes_available;
 };
 
 }  // namespace
@@ -54,15 +62,23 @@ class DataPipeConsumerDispatcher::PortObserverThunk
 DataPipeConsumerDispatcher::DataPipeConsumerDispatcher(
     NodeController* node_controller,
     const ports::PortRef& port,
-    const MojoCreateDataPipeOptions& options)
+    scoped_refptr<SharedBufferDispatcher> ring_buffer,
+    scoped_ptr<PlatformSharedBufferMapping> ring_buffer_mapping,
+    const MojoCreateDataPipeOptions& options,
+    bool initialized)
     : options_(options),
       node_controller_(node_controller),
-      port_(port) {
-  // OnPortStatusChanged (via PortObserverThunk) may be called before this
-  // constructor returns. Hold a lock here to prevent signal races.
-  base::AutoLock lock(lock_);
-  node_controller_->SetPortObserver(port_,
-                                    std::make_shared<PortObserverThunk>(this));
+      port_(port),
+      lock_("DataPipeConsumerDispatcher::lock_"),
+      ring_buffer_(std::move(ring_buffer)),
+      ring_buffer_mapping_(std::move(ring_buffer_mapping)) {
+  DCHECK_EQ(!!ring_buffer_, !!ring_buffer_mapping_);
+  if (ring_buffer_mapping_)
+    data_ = static_cast<char*>(ring_buffer_mapping_->GetBase());
+  if (initialized) {
+    ProfiledAutoLock lock(lock_);
+    InitializeNoLock();
+  }
 }
 
 Dispatcher::Type DataPipeConsumerDispatcher::GetType() const {
@@ -70,14 +86,32 @@ Dispatcher::Type DataPipeConsumerDispatcher::GetType() const {
 }
 
 MojoResult DataPipeConsumerDispatcher::Close() {
-  base::AutoLock lock(lock_);
+  ProfiledAutoLock lock(lock_);
   return CloseNoLock();
 }
 
 MojoResult DataPipeConsumerDispatcher::ReadData(void* elements,
                                                 uint32_t* num_bytes,
                                                 MojoReadDataFlags flags) {
-  base::AutoLock lock(lock_);
+  {
+    ProfiledAutoLock lock(lock_);
+    MojoResult rv = ReadDataNoLock(elements, num_bytes, flags);
+    if (rv != MOJO_RESULT_OK || !HasRingBuffer() ||
+        (flags & MOJO_READ_DATA_FLAG_QUERY) ||
+        (flags & MOJO_READ_DATA_FLAG_PEEK)) {
+      return rv;
+    }
+    ++num_pending_notifications_;
+  }
+
+  NotifyRead(*num_bytes);
+  return MOJO_RESULT_OK;
+}
+
+MojoResult DataPipeConsumerDispatcher::ReadDataNoLock(void* elements,
+                                                      uint32_t* num_bytes,
+                                                      MojoReadDataFlags flags) {
+  lock_.AssertAcquired();
   if (port_closed_)
     return MOJO_RESULT_INVALID_ARGUMENT;
 
@@ -91,7 +125,7 @@ MojoResult DataPipeConsumerDispatcher::ReadData(void* elements,
     DCHECK(!(flags & MOJO_READ_DATA_FLAG_DISCARD));  // Handled above.
     DVLOG_IF(2, elements)
         << "Query mode: ignoring non-null |elements|";
-    *num_bytes = static_cast<uint32_t>(data_.size());
+    *num_bytes = num_data_bytes_;
     return MOJO_RESULT_OK;
   }
 
@@ -113,21 +147,22 @@ MojoResult DataPipeConsumerDispatcher::ReadData(void* elements,
   uint32_t min_num_bytes_to_read =
       all_or_none ? max_num_bytes_to_read : 0;
 
-  if (min_num_bytes_to_read > data_.size())
+  if (min_num_bytes_to_read > num_data_bytes_)
     return error_ ? MOJO_RESULT_FAILED_PRECONDITION : MOJO_RESULT_OUT_OF_RANGE;
 
-  uint32_t bytes_to_read = std::min(max_num_bytes_to_read,
-                                    static_cast<uint32_t>(data_.size()));
+  uint32_t bytes_to_read = std::min(max_num_bytes_to_read, num_data_bytes_);
   if (bytes_to_read == 0)
     return error_ ? MOJO_RESULT_FAILED_PRECONDITION : MOJO_RESULT_SHOULD_WAIT;
 
   if (!discard)
-    memcpy(elements, &data_[0], bytes_to_read);
+    PeekDataNoLock(elements, bytes_to_read);
   *num_bytes = bytes_to_read;
 
   bool peek = !!(flags & MOJO_READ_DATA_FLAG_PEEK);
-  if (discard || !peek)
-    data_.erase(data_.begin(), data_.begin() + bytes_to_read);
+  if (discard || !peek) {
+    DiscardDataNoLock(bytes_to_read);
+    MetricsRegistry::Add(MetricsRegistry::kDataPipeBytesRead, bytes_to_read);
+  }
 
   return MOJO_RESULT_OK;
 }
@@ -135,7 +170,7 @@ MojoResult DataPipeConsumerDispatcher::ReadData(void* elements,
 MojoResult DataPipeConsumerDispatcher::BeginReadData(const void** buffer,
                                                      uint32_t* buffer_num_bytes,
                                                      MojoReadDataFlags flags) {
-  base::AutoLock lock(lock_);
+  ProfiledAutoLock lock(lock_);
   if (port_closed_)
     return MOJO_RESULT_INVALID_ARGUMENT;
 
@@ -148,12 +183,16 @@ MojoResult DataPipeConsumerDispatcher::BeginReadData(const void** buffer,
       (flags & MOJO_READ_DATA_FLAG_PEEK))
     return MOJO_RESULT_INVALID_ARGUMENT;
 
-  uint32_t max_num_bytes_to_read = static_cast<uint32_t>(data_.size());
-  if (max_num_bytes_to_read == 0)
+  if (num_data_bytes_ == 0)
     return error_ ? MOJO_RESULT_FAILED_PRECONDITION : MOJO_RESULT_SHOULD_WAIT;
 
+  // Only the contiguous part of the data up to the end of the buffer can be
+  // handed out. Any data which wraps around is available once this read ends.
+  uint32_t max_num_bytes_to_read = std::min(
+      num_data_bytes_, options_.capacity_num_bytes - data_offset_);
+
   in_two_phase_read_ = true;
-  *buffer = &data_[0];
+  *buffer = data_ + data_offset_;
   *buffer_num_bytes = max_num_bytes_to_read;
   two_phase_max_bytes_read_ = max_num_bytes_to_read;
 
@@ -161,44 +200,60 @@ MojoResult DataPipeConsumerDispatcher::BeginReadData(const void** buffer,
 }
 
 MojoResult DataPipeConsumerDispatcher::EndReadData(uint32_t num_bytes_read) {
-  base::AutoLock lock(lock_);
-  if (port_closed_)
-    return MOJO_RESULT_INVALID_ARGUMENT;
-
-  if (!in_two_phase_read_)
-    return MOJO_RESULT_FAILED_PRECONDITION;
-
-  HandleSignalsState old_state = GetHandleSignalsStateNoLock();
   MojoResult rv;
-  if (num_bytes_read > two_phase_max_bytes_read_ ||
-      num_bytes_read % options_.element_num_bytes != 0) {
-    rv = MOJO_RESULT_INVALID_ARGUMENT;
-  } else {
-    rv = MOJO_RESULT_OK;
-    data_.erase(data_.begin(), data_.begin() + num_bytes_read);
-  }
+  {
+    ProfiledAutoLock lock(lock_);
+    if (port_closed_)
+      return MOJO_RESULT_INVALID_ARGUMENT;
+
+    if (!in_two_phase_read_)
+      return MOJO_RESULT_FAILED_PRECONDITION;
 
-  in_two_phase_read_ = false;
-  two_phase_max_bytes_read_ = 0;
-  if (!data_received_during_two_phase_read_.empty()) {
-    if (data_.empty()) {
-      data_received_during_two_phase_read_.swap(data_);
+    HandleSignalsState old_state = GetHandleSignalsStateNoLock();
+    if (num_bytes_read > two_phase_max_bytes_read_ ||
+        num_bytes_read % options_.element_num_bytes != 0) {
+      rv = MOJO_RESULT_INVALID_ARGUMENT;
     } else {
-      data_.insert(data_.end(), data_received_during_two_phase_read_.begin(),
-                   data_received_during_two_phase_read_.end());
-      data_received_during_two_phase_read_.clear();
+      rv = MOJO_RESULT_OK;
+      DiscardDataNoLock(num_bytes_read);
+      MetricsRegistry::Add(MetricsRegistry::kDataPipeBytesRead,
+                           num_bytes_read);
     }
+
+    in_two_phase_read_ = false;
+    two_phase_max_bytes_read_ = 0;
+
+    HandleSignalsState new_state = GetHandleSignalsStateNoLock();
+    if (!new_state.equals(old_state))
+      awakable_list_.AwakeForStateChange(new_state);
+
+    if (rv != MOJO_RESULT_OK || !HasRingBuffer() || !num_bytes_read)
+      return rv;
+    ++num_pending_notifications_;
   }
 
+  NotifyRead(num_bytes_read);
+  return rv;
+}
+
+MojoResult DataPipeConsumerDispatcher::SetDataPipeThreshold(
+    uint32_t num_bytes) {
+  ProfiledAutoLock lock(lock_);
+  if (port_closed_ || num_bytes > options_.capacity_num_bytes ||
+      num_bytes % options_.element_num_bytes != 0) {
+    return MOJO_RESULT_INVALID_ARGUMENT;
+  }
+
+  HandleSignalsState old_state = GetHandleSignalsStateNoLock();
+  threshold_num_bytes_ = num_bytes;
   HandleSignalsState new_state = GetHandleSignalsStateNoLock();
   if (!new_state.equals(old_state))
     awakable_list_.AwakeForStateChange(new_state);
-
-  return rv;
+  return MOJO_RESULT_OK;
 }
 
 HandleSignalsState DataPipeConsumerDispatcher::GetHandleSignalsState() const {
-  base::AutoLock lock(lock_);
+  ProfiledAutoLock lock(lock_);
   return GetHandleSignalsStateNoLock();
 }
 
@@ -207,7 +262,7 @@ MojoResult DataPipeConsumerDispatcher::AddAwakable(
     MojoHandleSignals signals,
     uintptr_t context,
     HandleSignalsState* signals_state) {
-  base::AutoLock lock(lock_);
+  ProfiledAutoLock lock(lock_);
   HandleSignalsState state = GetHandleSignalsStateNoLock();
   if (state.satisfies(signals)) {
     if (signals_state)
@@ -227,7 +282,7 @@ MojoResult DataPipeConsumerDispatcher::AddAwakable(
 void DataPipeConsumerDispatcher::RemoveAwakable(
     Awakable* awakable,
     HandleSignalsState* signals_state) {
-  base::AutoLock lock(lock_);
+  ProfiledAutoLock lock(lock_);
   awakable_list_.Remove(awakable);
   if (signals_state)
     *signals_state = GetHandleSignalsStateNoLock();
@@ -236,9 +291,18 @@ void DataPipeConsumerDispatcher::RemoveAwakable(
 void DataPipeConsumerDispatcher::StartSerialize(uint32_t* num_bytes,
                                                 uint32_t* num_ports,
                                                 uint32_t* num_handles) {
-  *num_bytes = static_cast<uint32_t>(sizeof(SerializedState) + data_.size());
   *num_ports = 1;
-  *num_handles = 0;
+  if (ring_buffer_) {
+    uint32_t ring_buffer_num_bytes, ring_buffer_num_ports;
+    ring_buffer_->StartSerialize(&ring_buffer_num_bytes, &ring_buffer_num_ports,
+                                 num_handles);
+    DCHECK_EQ(0u, ring_buffer_num_ports);
+    *num_bytes = sizeof(SerializedState) + ring_buffer_num_bytes;
+  } else {
+    *num_bytes =
+        static_cast<uint32_t>(sizeof(SerializedState) + num_data_bytes_);
+    *num_handles = 0;
+  }
 }
 
 bool DataPipeConsumerDispatcher::EndSerializeAndClose(
@@ -248,8 +312,20 @@ bool DataPipeConsumerDispatcher::EndSerializeAndClose(
   SerializedState* state = static_cast<SerializedState*>(destination);
   memcpy(&state->options, &options_, sizeof(MojoCreateDataPipeOptions));
   state->error = error_;
+  state->read_offset = data_offset_;
+  state->bytes_available = num_data_bytes_;
 
-  memcpy(state + 1, data_.data(), data_.size());
+  if (ring_buffer_) {
+    if (!ring_buffer_->EndSerializeAndClose(state + 1, nullptr,
+                                            platform_handles)) {
+      return false;
+    }
+    ring_buffer_ = nullptr;
+    ring_buffer_mapping_.reset();
+    data_ = nullptr;
+  } else {
+    PeekDataNoLock(state + 1, num_data_bytes_);
+  }
 
   ports[0] = port_.name();
 
@@ -261,7 +337,7 @@ bool DataPipeConsumerDispatcher::EndSerializeAndClose(
 
 bool DataPipeConsumerDispatcher::BeginTransit() {
   lock_.Acquire();
-  return !in_two_phase_read_;
+  return !in_two_phase_read_ && num_pending_notifications_ == 0;
 }
 
 void DataPipeConsumerDispatcher::CompleteTransit() {
@@ -278,14 +354,38 @@ DataPipeConsumerDispatcher::Deserialize(const void* data,
                                         size_t num_ports,
                                         PlatformHandle* handles,
                                         size_t num_handles) {
-  if (num_ports != 1 || num_handles != 0)
+  if (num_ports != 1 || num_handles > 1)
     return nullptr;
 
   if (num_bytes < sizeof(SerializedState))
     return nullptr;
 
   const SerializedState* state = static_cast<const SerializedState*>(data);
+  const MojoCreateDataPipeOptions& options = state->options;
+  if (!options.element_num_bytes || !options.capacity_num_bytes ||
+      options.capacity_num_bytes % options.element_num_bytes != 0 ||
+      state->read_offset >= options.capacity_num_bytes ||
+      state->read_offset % options.element_num_bytes != 0 ||
+      state->bytes_available > options.capacity_num_bytes ||
+      state->bytes_available % options.element_num_bytes != 0) {
+    return nullptr;
+  }
+
   size_t data_buffer_size = num_bytes - sizeof(SerializedState);
+  scoped_refptr<SharedBufferDispatcher> ring_buffer;
+  scoped_ptr<PlatformSharedBufferMapping> ring_buffer_mapping;
+  if (num_handles) {
+    ring_buffer = SharedBufferDispatcher::Deserialize(
+        state + 1, data_buffer_size, nullptr, 0, handles, num_handles);
+    if (!ring_buffer ||
+        ring_buffer->MapBuffer(0, options.capacity_num_bytes,
+                               MOJO_MAP_BUFFER_FLAG_NONE,
+                               &ring_buffer_mapping) != MOJO_RESULT_OK) {
+      return nullptr;
+    }
+  } else if (data_buffer_size != state->bytes_available) {
+    return nullptr;
+  }
 
   NodeController* node_controller = internal::g_core->node_controller();
   ports::PortRef port;
@@ -293,11 +393,21 @@ DataPipeConsumerDispatcher::Deserialize(const void* data,
     return nullptr;
 
   scoped_refptr<DataPipeConsumerDispatcher> dispatcher =
-      new DataPipeConsumerDispatcher(node_controller, port, state->options);
-
-  dispatcher->error_ = state->error;
-  dispatcher->data_.resize(data_buffer_size);
-  memcpy(dispatcher->data_.data(), state + 1, data_buffer_size);
+      new DataPipeConsumerDispatcher(node_controller, port,
+                                     std::move(ring_buffer),
+                                     std::move(ring_buffer_mapping), options,
+                                     false /* initialized */);
+  {
+    ProfiledAutoLock lock(dispatcher->lock_);
+    dispatcher->error_ = state->error;
+    if (dispatcher->HasRingBuffer()) {
+      dispatcher->data_offset_ = state->read_offset;
+      dispatcher->num_data_bytes_ = state->bytes_available;
+    } else {
+      dispatcher->AppendDataNoLock(state + 1, data_buffer_size);
+    }
+    dispatcher->InitializeNoLock();
+  }
 
   dispatcher->OnPortStatusChanged();
 
@@ -306,6 +416,14 @@ DataPipeConsumerDispatcher::Deserialize(const void* data,
 
 DataPipeConsumerDispatcher::~DataPipeConsumerDispatcher() {}
 
+void DataPipeConsumerDispatcher::InitializeNoLock() {
+  lock_.AssertAcquired();
+  // OnPortStatusChanged (via PortObserverThunk) may be called as soon as the
+  // observer is set, but it will block on |lock_| until we're done.
+  node_controller_->SetPortObserver(port_,
+                                    std::make_shared<PortObserverThunk>(this));
+}
+
 MojoResult DataPipeConsumerDispatcher::CloseNoLock() {
   lock_.AssertAcquired();
   if (port_closed_)
@@ -313,9 +431,17 @@ MojoResult DataPipeConsumerDispatcher::CloseNoLock() {
   port_closed_ = true;
 
   if (!port_transferred_)
-    node_controller_->node()->ClosePort(port_);
+    node_controller_->ClosePort(port_);
   awakable_list_.CancelAll();
 
+  data_ = nullptr;
+  num_data_bytes_ = 0;
+  ring_buffer_mapping_.reset();
+  if (ring_buffer_) {
+    ring_buffer_->Close();
+    ring_buffer_ = nullptr;
+  }
+
   return MOJO_RESULT_OK;
 }
 
@@ -324,7 +450,7 @@ DataPipeConsumerDispatcher::GetHandleSignalsStateNoLock() const {
   lock_.AssertAcquired();
 
   HandleSignalsState rv;
-  if (!data_.empty()) {
+  if (num_data_bytes_ > 0) {
     if (!in_two_phase_read_)
       rv.satisfied_signals |= MOJO_HANDLE_SIGNAL_READABLE;
     rv.satisfiable_signals |= MOJO_HANDLE_SIGNAL_READABLE;
@@ -332,6 +458,17 @@ DataPipeConsumerDispatcher::GetHandleSignalsStateNoLock() const {
     rv.satisfiable_signals |= MOJO_HANDLE_SIGNAL_READABLE;
   }
 
+  // Bytes already received can still be read after the producer is gone.
+  if (threshold_num_bytes_ > 0) {
+    if (num_data_bytes_ >= threshold_num_bytes_) {
+      if (!in_two_phase_read_)
+        rv.satisfied_signals |= MOJO_HANDLE_SIGNAL_THRESHOLD_REACHED;
+      rv.satisfiable_signals |= MOJO_HANDLE_SIGNAL_THRESHOLD_REACHED;
+    } else if (!error_) {
+      rv.satisfiable_signals |= MOJO_HANDLE_SIGNAL_THRESHOLD_REACHED;
+    }
+  }
+
   if (error_)
     rv.satisfied_signals |= MOJO_HANDLE_SIGNAL_PEER_CLOSED;
   rv.satisfiable_signals |= MOJO_HANDLE_SIGNAL_PEER_CLOSED;
@@ -342,7 +479,7 @@ void DataPipeConsumerDispatcher::UpdateSignalsStateNoLock() {
   lock_.AssertAcquired();
 
   bool had_error = error_;
-  size_t data_size = data_.size();
+  uint32_t num_data_bytes = num_data_bytes_;
 
   ports::PortStatus port_status;
   if (node_controller_->node()->GetStatus(port_, &port_status) != ports::OK ||
@@ -353,44 +490,98 @@ void DataPipeConsumerDispatcher::UpdateSignalsStateNoLock() {
   if (port_status.has_messages) {
     ports::ScopedMessage message;
     do {
-      int rv = node_controller_->node()->GetMessageIf(port_, nullptr, &message);
+      int rv = node_controller_->node()->GetMessage(port_, &message);
       if (rv != ports::OK)
         error_ = true;
-      if (message) {
-        if (in_two_phase_read_) {
-          size_t data_size = data_received_during_two_phase_read_.size();
-          DCHECK_GE(options_.capacity_num_bytes, data_.size() + data_size);
-          size_t bytes_to_read =
-              std::min(options_.capacity_num_bytes - data_size - data_.size(),
-                       message->num_payload_bytes());
-          if (bytes_to_read > 0) {
-            data_received_during_two_phase_read_.resize(
-                data_size + bytes_to_read);
-            memcpy(data_received_during_two_phase_read_.data() + data_size,
-                   message->payload_bytes(), bytes_to_read);
-          }
-        } else {
-          size_t data_size = data_.size();
-          DCHECK_GE(options_.capacity_num_bytes, data_size);
-          size_t bytes_to_read =
-              std::min(options_.capacity_num_bytes - data_size,
-                       message->num_payload_bytes());
-          if (bytes_to_read > 0) {
-            data_.resize(data_size + bytes_to_read);
-            memcpy(data_.data() + data_size, message->payload_bytes(),
-                   bytes_to_read);
-          }
-        }
+      if (!message)
+        break;
+
+      if (!HasRingBuffer()) {
+        AppendDataNoLock(message->payload_bytes(),
+                         message->num_payload_bytes());
+        continue;
+      }
+
+      DataPipeControlMessage control_message;
+      if (!ParseDataPipeControlMessage(*message, &control_message) ||
+          control_message.command !=
+              DataPipeControlMessage::Command::DATA_WAS_WRITTEN ||
+          control_message.num_bytes >
+              options_.capacity_num_bytes - num_data_bytes_ ||
+          control_message.num_bytes % options_.element_num_bytes != 0) {
+        DLOG(ERROR) << "Invalid data pipe control message.";
+        error_ = true;
+        break;
       }
+      num_data_bytes_ += control_message.num_bytes;
     } while (message);
   }
 
-  if (error_ != had_error || data_size != data_.size())
+  if (error_ != had_error || num_data_bytes != num_data_bytes_)
     awakable_list_.AwakeForStateChange(GetHandleSignalsStateNoLock());
 }
 
+void DataPipeConsumerDispatcher::PeekDataNoLock(void* buffer,
+                                                uint32_t num_bytes) const {
+  DCHECK_LE(num_bytes, num_data_bytes_);
+  if (!num_bytes)
+    return;
+  uint32_t num_bytes_before_wrap =
+      std::min(num_bytes, options_.capacity_num_bytes - data_offset_);
+  memcpy(buffer, data_ + data_offset_, num_bytes_before_wrap);
+  memcpy(static_cast<char*>(buffer) + num_bytes_before_wrap, data_,
+         num_bytes - num_bytes_before_wrap);
+}
+
+void DataPipeConsumerDispatcher::DiscardDataNoLock(uint32_t num_bytes) {
+  DCHECK_LE(num_bytes, num_data_bytes_);
+  num_data_bytes_ -= num_bytes;
+  data_offset_ = (data_offset_ + num_bytes) % options_.capacity_num_bytes;
+
+  // The producer's write offset follows ours around a shared ring, so only a
+  // local buffer can be rewound when it empties.
+  if (!num_data_bytes_ && !HasRingBuffer())
+    data_offset_ = 0;
+}
+
+void DataPipeConsumerDispatcher::AppendDataNoLock(const void* bytes,
+                                                  size_t num_bytes) {
+  DCHECK_GE(options_.capacity_num_bytes, num_data_bytes_);
+  uint32_t bytes_to_append = static_cast<uint32_t>(std::min(
+      static_cast<size_t>(options_.capacity_num_bytes - num_data_bytes_),
+      num_bytes));
+  if (!bytes_to_append)
+    return;
+
+  if (!data_) {
+    local_data_.reset(new char[options_.capacity_num_bytes]);
+    data_ = local_data_;
+  }
+
+  uint32_t end_offset =
+      (data_offset_ + num_data_bytes_) % options_.capacity_num_bytes;
+  uint32_t num_bytes_before_wrap =
+      std::min(bytes_to_append, options_.capacity_num_bytes - end_offset);
+  memcpy(data_ + end_offset, bytes, num_bytes_before_wrap);
+  memcpy(data_, static_cast<const char*>(bytes) + num_bytes_before_wrap,
+         bytes_to_append - num_bytes_before_wrap);
+  num_data_bytes_ += bytes_to_append;
+}
+
+void DataPipeConsumerDispatcher::NotifyRead(uint32_t num_bytes) {
+  // The producer may already be gone, in which case there's nobody left to
+  // tell. Any remaining data can still be read.
+  SendDataPipeControlMessage(node_controller_, port_,
+                             DataPipeControlMessage::Command::DATA_WAS_READ,
+                             num_bytes);
+
+  ProfiledAutoLock lock(lock_);
+  DCHECK_GT(num_pending_notifications_, 0u);
+  --num_pending_notifications_;
+}
+
 void DataPipeConsumerDispatcher::OnPortStatusChanged() {
-  base::AutoLock lock(lock_);
+  ProfiledAutoLock lock(lock_);
   UpdateSignalsStateNoLock();
 }
 
@@ -10,26 +10,41 @@
 
 #include "base/macros.h"
 #include "base/memory/ref_counted.h"
-#include "base/synchronization/lock.h"
+#include "base/memory/scoped_ptr.h"
+#include "mojo/edk/embedder/platform_shared_buffer.h"
 #include "mojo/edk/system/awakable_list.h"
 #include "mojo/edk/system/dispatcher.h"
 #include "mojo/edk/system/ports/port_ref.h"
+#include "mojo/edk/system/profiled_lock.h"
 #include "mojo/edk/system/system_impl_export.h"
 
 namespace mojo {
 namespace edk {
 
 class NodeController;
+class SharedBufferDispatcher;
 
 // This is the Dispatcher implementation for the consumer handle for data
 // pipes created by the Mojo primitive MojoCreateDataPipe(). This class is
 // thread-safe.
+//
+// If the pipe has a ring buffer, data is read straight out of it and the
+// producer is told how much was read with DataPipeControlMessages over
+// |port|. Without a ring buffer, data arrives in ports messages.
 class MOJO_SYSTEM_IMPL_EXPORT DataPipeConsumerDispatcher final
     : public Dispatcher {
  public:
-  DataPipeConsumerDispatcher(NodeController* node_controller,
-                             const ports::PortRef& port,
-                             const MojoCreateDataPipeOptions& options);
+  // |ring_buffer| and |ring_buffer_mapping| are either both null, or a buffer
+  // of |options.capacity_num_bytes| bytes shared with the producer and a
+  // mapping of all of it. If |initialized| is false, |port| is not observed
+  // until InitializeNoLock() is called.
+  DataPipeConsumerDispatcher(
+      NodeController* node_controller,
+      const ports::PortRef& port,
+      scoped_refptr<SharedBufferDispatcher> ring_buffer,
+      scoped_ptr<PlatformSharedBufferMapping> ring_buffer_mapping,
+      const MojoCreateDataPipeOptions& options,
+      bool initialized);
 
   // Dispatcher:
   Type GetType() const override;
@@ -41,6 +56,7 @@ class MOJO_SYSTEM_IMPL_EXPORT DataPipeConsumerDispatcher final
                            uint32_t* buffer_num_bytes,
                            MojoReadDataFlags flags) override;
   MojoResult EndReadData(uint32_t num_bytes_read) override;
+  MojoResult SetDataPipeThreshold(uint32_t num_bytes) override;
   HandleSignalsState GetHandleSignalsState() const override;
   MojoResult AddAwakable(Awakable* awakable,
                          MojoHandleSignals signals,
@@ -72,27 +88,69 @@ class MOJO_SYSTEM_IMPL_EXPORT DataPipeConsumerDispatcher final
 
   ~DataPipeConsumerDispatcher() override;
 
+  void InitializeNoLock();
   MojoResult CloseNoLock();
+  MojoResult ReadDataNoLock(void* elements,
+                            uint32_t* num_bytes,
+                            MojoReadDataFlags flags);
   HandleSignalsState GetHandleSignalsStateNoLock() const;
   void OnPortStatusChanged();
   void UpdateSignalsStateNoLock();
 
+  // Copies up to |num_bytes| bytes from the front of |data_| into |buffer|,
+  // without removing them.
+  void PeekDataNoLock(void* buffer, uint32_t num_bytes) const;
+
+  // Removes |num_bytes| bytes from the front of |data_|.
+  void DiscardDataNoLock(uint32_t num_bytes);
+
+  // Appends as much of |bytes| to |data_| as there is space for. Only used
+  // without a ring buffer.
+  void AppendDataNoLock(const void* bytes, size_t num_bytes);
+
+  // Tells the producer that |num_bytes| bytes of the ring buffer are free.
+  // Must be called without |lock_| held, since the producer may be notified
+  // synchronously and its writes notify us in turn. The caller increments
+  // |num_pending_notifications_| while it still holds |lock_|.
+  void NotifyRead(uint32_t num_bytes);
+
+  bool HasRingBuffer() const { return !!ring_buffer_mapping_; }
+
   const MojoCreateDataPipeOptions options_;
   NodeController* const node_controller_;
   const ports::PortRef port_;
 
-  mutable base::Lock lock_;
+  mutable ProfiledLock lock_;
+
+  scoped_refptr<SharedBufferDispatcher> ring_buffer_;
+  scoped_ptr<PlatformSharedBufferMapping> ring_buffer_mapping_;
 
-  // Queue of incoming messages.
-  std::vector<char> data_;
+  // Without a ring buffer, received data is copied into |local_data_|, which
+  // is allocated when data first arrives.
+  scoped_ptr<char[]> local_data_;
+
+  // Received data, in a circular buffer of |options_.capacity_num_bytes|
+  // bytes: either the ring buffer's mapping or |local_data_|. |data_| holds
+  // |num_data_bytes_| bytes starting at |data_offset_|, possibly wrapping
+  // around the end of the buffer. Data which arrives during a two-phase read
+  // goes into the free part of the buffer, so it never disturbs the bytes
+  // handed out by BeginReadData.
+  char* data_ = nullptr;
+  uint32_t data_offset_ = 0;
+  uint32_t num_data_bytes_ = 0;
   AwakableList awakable_list_;
 
   bool in_two_phase_read_ = false;
   uint32_t two_phase_max_bytes_read_ = 0;
 
-  // If we get data from the port while we're in two-phase read, we can't
-  // resize data_ since it's being used. So instead we store it temporarly.
-  std::vector<char> data_received_during_two_phase_read_;
+  // Reads which NotifyRead hasn't yet told the producer about. The dispatcher
+  // can't be sent anywhere until they're sent, or the notifications would go
+  // out on a port it no longer owns.
+  uint32_t num_pending_notifications_ = 0;
+
+  // See Core::SetDataPipeThreshold. Zero means none is set. It isn't carried
+  // along when the handle is sent to another process.
+  uint32_t threshold_num_bytes_ = 0;
 
   bool error_ = false;
   bool port_closed_ = false;
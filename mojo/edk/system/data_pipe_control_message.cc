@@ -0,0 +1,52 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/data_pipe_control_message.h"
+
+#include <string.h>
+
+#include <utility>
+
+#include "mojo/edk/system/node_controller.h"
+#include "mojo/edk/system/ports_message.h"
+
+namespace mojo {
+namespace edk {
+
+bool SendDataPipeControlMessage(NodeController* node_controller,
+                                const ports::PortRef& port,
+                                DataPipeControlMessage::Command command,
+                                uint32_t num_bytes) {
+  scoped_ptr<PortsMessage> message =
+      node_controller->AllocMessage(sizeof(DataPipeControlMessage), 0);
+  if (!message)
+    return false;
+
+  DataPipeControlMessage* data =
+      static_cast<DataPipeControlMessage*>(message->mutable_payload_bytes());
+  data->command = command;
+  data->num_bytes = num_bytes;
+
+  return node_controller->SendMessage(port, std::move(message)) == ports::OK;
+}
+
+bool ParseDataPipeControlMessage(const ports::Message& message,
+                                 DataPipeControlMessage* control_message) {
+  if (message.num_payload_bytes() != sizeof(DataPipeControlMessage) ||
+      message.num_ports() != 0) {
+    return false;
+  }
+
+  memcpy(control_message, message.payload_bytes(),
+         sizeof(DataPipeControlMessage));
+  switch (control_message->command) {
+    case DataPipeControlMessage::Command::DATA_WAS_WRITTEN:
+    case DataPipeControlMessage::Command::DATA_WAS_READ:
+      return true;
+  }
+  return false;
+}
+
+}  // namespace edk
+}  // namespace mojo
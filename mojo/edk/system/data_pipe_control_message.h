@@ -0,0 +1,51 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_SYSTEM_DATA_PIPE_CONTROL_MESSAGE_H_
+#define MOJO_EDK_SYSTEM_DATA_PIPE_CONTROL_MESSAGE_H_
+
+#include <stdint.h>
+
+#include "mojo/edk/system/ports/message.h"
+#include "mojo/edk/system/ports/port_ref.h"
+
+namespace mojo {
+namespace edk {
+
+class NodeController;
+
+// When the two ends of a data pipe share a ring buffer, the data itself is
+// written to and read from the buffer directly, and only these messages travel
+// over the pipe's port to move the ends' cursors along.
+struct DataPipeControlMessage {
+  enum class Command : uint32_t {
+    // Sent by the producer: |num_bytes| more bytes follow the data the consumer
+    // already knows about.
+    DATA_WAS_WRITTEN,
+
+    // Sent by the consumer: |num_bytes| bytes have been consumed and may be
+    // overwritten by the producer.
+    DATA_WAS_READ,
+  };
+
+  Command command;
+  uint32_t num_bytes;
+};
+
+// Sends a control message to the peer of |port|. Returns false if the message
+// could not be sent, e.g. because the peer is closed.
+bool SendDataPipeControlMessage(NodeController* node_controller,
+                                const ports::PortRef& port,
+                                DataPipeControlMessage::Command command,
+                                uint32_t num_bytes);
+
+// Extracts a control message from |message|. Returns false if |message| is not
+// a well-formed control message.
+bool ParseDataPipeControlMessage(const ports::Message& message,
+                                 DataPipeControlMessage* control_message);
+
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_SYSTEM_DATA_PIPE_CONTROL_MESSAGE_H_
@@ -0,0 +1,177 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <string>
+
+#include "base/logging.h"
+#include "base/strings/stringprintf.h"
+#include "base/test/perf_time_logger.h"
+#include "base/time/time.h"
+#include "mojo/edk/system/handle_signals_state.h"
+#include "mojo/edk/test/multiprocess_test_base.h"
+#include "mojo/public/c/system/data_pipe.h"
+#include "mojo/public/c/system/functions.h"
+#include "mojo/public/c/system/message_pipe.h"
+#include "testing/gtest/include/gtest/gtest.h"
+#include "testing/perf/perf_test.h"
+
+namespace mojo {
+namespace edk {
+namespace {
+
+// The amount of data streamed through the pipe for each measurement.
+const uint64_t kNumBytesPerMeasurement = 64 * 1024 * 1024;
+
+class MultiprocessDataPipePerfTest : public test::MultiprocessTestBase {
+ protected:
+  // Creates a data pipe with the given capacity, sends its consumer to the
+  // child over |mp|, and times writing kNumBytesPerMeasurement bytes into it
+  // in |write_size| chunks until the child reports that it read them all.
+  void Measure(MojoHandle mp, uint32_t capacity, uint32_t write_size) {
+    MojoCreateDataPipeOptions options;
+    options.struct_size = sizeof(options);
+    options.flags = MOJO_CREATE_DATA_PIPE_OPTIONS_FLAG_NONE;
+    options.element_num_bytes = 1;
+    options.capacity_num_bytes = capacity;
+
+    MojoHandle producer, consumer;
+    CHECK_EQ(MojoCreateDataPipe(&options, &producer, &consumer),
+             MOJO_RESULT_OK);
+    CHECK_EQ(MojoWriteMessage(mp, nullptr, 0, &consumer, 1,
+                              MOJO_WRITE_MESSAGE_FLAG_NONE),
+             MOJO_RESULT_OK);
+
+    std::string payload(write_size, '*');
+    std::string test_name = base::StringPrintf(
+        "DataPipe_Throughput_%uMB_capacity%u_write%u",
+        static_cast<unsigned>(kNumBytesPerMeasurement / (1024 * 1024)),
+        capacity, write_size);
+    base::PerfTimeLogger logger(test_name.c_str());
+    base::TimeTicks start = base::TimeTicks::Now();
+
+    uint64_t num_bytes_written = 0;
+    while (num_bytes_written < kNumBytesPerMeasurement) {
+      uint32_t num_bytes = static_cast<uint32_t>(std::min<uint64_t>(
+          write_size, kNumBytesPerMeasurement - num_bytes_written));
+      MojoResult result = MojoWriteData(producer, payload.data(), &num_bytes,
+                                        MOJO_WRITE_DATA_FLAG_NONE);
+      if (result == MOJO_RESULT_SHOULD_WAIT) {
+        CHECK_EQ(MojoWait(producer, MOJO_HANDLE_SIGNAL_WRITABLE,
+                          MOJO_DEADLINE_INDEFINITE, nullptr),
+                 MOJO_RESULT_OK);
+        continue;
+      }
+      CHECK_EQ(result, MOJO_RESULT_OK);
+      num_bytes_written += num_bytes;
+    }
+    CHECK_EQ(MojoClose(producer), MOJO_RESULT_OK);
+
+    // The child replies with the number of bytes it read once it sees the
+    // producer close.
+    CHECK_EQ(MojoWait(mp, MOJO_HANDLE_SIGNAL_READABLE,
+                      MOJO_DEADLINE_INDEFINITE, nullptr),
+             MOJO_RESULT_OK);
+    uint64_t num_bytes_read = 0;
+    uint32_t reply_size = sizeof(num_bytes_read);
+    CHECK_EQ(MojoReadMessage(mp, &num_bytes_read, &reply_size, nullptr,
+                             nullptr, MOJO_READ_MESSAGE_FLAG_NONE),
+             MOJO_RESULT_OK);
+
+    logger.Done();
+    double seconds = (base::TimeTicks::Now() - start).InSecondsF();
+
+    CHECK_EQ(reply_size, sizeof(num_bytes_read));
+    CHECK_EQ(num_bytes_read, kNumBytesPerMeasurement);
+
+    perf_test::PrintResult(
+        "DataPipe_Bandwidth", "",
+        base::StringPrintf("capacity%u_write%u", capacity, write_size),
+        kNumBytesPerMeasurement / seconds / (1024 * 1024), "MB/s", true);
+  }
+
+  void SendQuitMessage(MojoHandle mp) {
+    CHECK_EQ(MojoWriteMessage(mp, "", 0, nullptr, 0,
+                              MOJO_WRITE_MESSAGE_FLAG_NONE),
+             MOJO_RESULT_OK);
+  }
+};
+
+// For each data pipe consumer received, reads until the producer is closed and
+// then replies with the number of bytes read. A message carrying no handle
+// tells it to quit.
+DEFINE_TEST_CLIENT_WITH_PIPE(DataPipeReaderClient, MultiprocessDataPipePerfTest,
+                             h) {
+  std::string buffer(1024 * 1024, '\0');
+  while (true) {
+    HandleSignalsState hss;
+    MojoResult result = MojoWait(h, MOJO_HANDLE_SIGNAL_READABLE,
+                                 MOJO_DEADLINE_INDEFINITE, &hss);
+    if (result != MOJO_RESULT_OK)
+      return result;
+
+    MojoHandle consumer = MOJO_HANDLE_INVALID;
+    uint32_t num_handles = 1;
+    CHECK_EQ(MojoReadMessage(h, nullptr, nullptr, &consumer, &num_handles,
+                             MOJO_READ_MESSAGE_FLAG_NONE),
+             MOJO_RESULT_OK);
+    if (num_handles == 0)
+      break;
+
+    uint64_t num_bytes_read = 0;
+    while (true) {
+      uint32_t num_bytes = static_cast<uint32_t>(buffer.size());
+      result = MojoReadData(consumer, &buffer[0], &num_bytes,
+                            MOJO_READ_DATA_FLAG_NONE);
+      if (result == MOJO_RESULT_OK) {
+        num_bytes_read += num_bytes;
+        continue;
+      }
+      if (result == MOJO_RESULT_FAILED_PRECONDITION)
+        break;
+
+      CHECK_EQ(result, MOJO_RESULT_SHOULD_WAIT);
+      result = MojoWait(consumer, MOJO_HANDLE_SIGNAL_READABLE,
+                        MOJO_DEADLINE_INDEFINITE, nullptr);
+      CHECK(result == MOJO_RESULT_OK ||
+            result == MOJO_RESULT_FAILED_PRECONDITION);
+    }
+    CHECK_EQ(MojoClose(consumer), MOJO_RESULT_OK);
+
+    CHECK_EQ(MojoWriteMessage(h, &num_bytes_read, sizeof(num_bytes_read),
+                              nullptr, 0, MOJO_WRITE_MESSAGE_FLAG_NONE),
+             MOJO_RESULT_OK);
+  }
+
+  return 0;
+}
+
+// Streams data to the child through data pipes of various capacities, using
+// writes both smaller and larger than the capacity.
+#if defined(OS_ANDROID)
+// Android multi-process tests are not executing the new process. This is flaky.
+#define MAYBE_Throughput DISABLED_Throughput
+#else
+#define MAYBE_Throughput Throughput
+#endif  // defined(OS_ANDROID)
+TEST_F(MultiprocessDataPipePerfTest, MAYBE_Throughput) {
+  RUN_CHILD_ON_PIPE(DataPipeReaderClient, h)
+    const uint32_t kCapacities[] = {64 * 1024, 1024 * 1024};
+    const uint32_t kWriteSizes[] = {4 * 1024, 64 * 1024, 1024 * 1024};
+
+    for (uint32_t capacity : kCapacities) {
+      for (uint32_t write_size : kWriteSizes)
+        Measure(h, capacity, write_size);
+    }
+
+    SendQuitMessage(h);
+  END_CHILD()
+}
+
+}  // namespace
+}  // namespace edk
+}  // namespace mojo
@@ -6,8 +6,12 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
+#include <algorithm>
+#include <limits>
 #include <utility>
+#include <vector>
 
 #include "base/bind.h"
 #include "base/logging.h"
@@ -18,17 +22,24 @@
 #include "mojo/edk/system/configuration.h"
 #include "mojo/edk/system/core.h"
 #include "mojo/edk/system/data_pipe.h"
+#include "mojo/edk/system/data_pipe_control_message.h"
+#include "mojo/edk/system/metrics_registry.h"
 #include "mojo/edk/system/node_controller.h"
 #include "mojo/edk/system/ports_message.h"
+#include "mojo/edk/system/shared_buffer_dispatcher.h"
 
 namespace mojo {
 namespace edk {
 
 namespace {
 
+// If the pipe has a ring buffer, this is followed by the serialized
+// SharedBufferDispatcher for it.
 struct SerializedState {
   MojoCreateDataPipeOptions options;
   bool error;
+  uint32_t write_offset;
+  uint32_t available_capacity;
 };
 
 }  // namespace
@@ -55,15 +66,22 @@ class DataPipeProducerDispatcher::PortObserverThunk
 DataPipeProducerDispatcher::DataPipeProducerDispatcher(
     NodeController* node_controller,
     const ports::PortRef& port,
-    const MojoCreateDataPipeOptions& options)
+    scoped_refptr<SharedBufferDispatcher> ring_buffer,
+    scoped_ptr<PlatformSharedBufferMapping> ring_buffer_mapping,
+    const MojoCreateDataPipeOptions& options,
+    bool initialized)
     : options_(options),
       node_controller_(node_controller),
-      port_(port) {
-  // OnPortStatusChanged (via PortObserverThunk) may be called before this
-  // constructor returns. Hold a lock here to prevent signal races.
-  base::AutoLock lock(lock_);
-  node_controller_->SetPortObserver(port_,
-                                    std::make_shared<PortObserverThunk>(this));
+      port_(port),
+      lock_("DataPipeProducerDispatcher::lock_"),
+      ring_buffer_(std::move(ring_buffer)),
+      ring_buffer_mapping_(std::move(ring_buffer_mapping)),
+      available_capacity_(options.capacity_num_bytes) {
+  DCHECK_EQ(!!ring_buffer_, !!ring_buffer_mapping_);
+  if (initialized) {
+    ProfiledAutoLock lock(lock_);
+    InitializeNoLock();
+  }
 }
 
 Dispatcher::Type DataPipeProducerDispatcher::GetType() const {
@@ -71,52 +89,67 @@ Dispatcher::Type DataPipeProducerDispatcher::GetType() const {
 }
 
 MojoResult DataPipeProducerDispatcher::Close() {
-  base::AutoLock lock(lock_);
+  ProfiledAutoLock lock(lock_);
   return CloseNoLock();
 }
 
 MojoResult DataPipeProducerDispatcher::WriteData(const void* elements,
                                                  uint32_t* num_bytes,
                                                  MojoWriteDataFlags flags) {
-  base::AutoLock lock(lock_);
-  if (port_closed_)
-    return MOJO_RESULT_INVALID_ARGUMENT;
+  {
+    ProfiledAutoLock lock(lock_);
+    if (port_closed_)
+      return MOJO_RESULT_INVALID_ARGUMENT;
+
+    if (InTwoPhaseWrite())
+      return MOJO_RESULT_BUSY;
+    if (error_)
+      return MOJO_RESULT_FAILED_PRECONDITION;
+    if (*num_bytes % options_.element_num_bytes != 0)
+      return MOJO_RESULT_INVALID_ARGUMENT;
+    if (*num_bytes == 0)
+      return MOJO_RESULT_OK;  // Nothing to do.
+
+    // Without a ring buffer, we ignore options.capacity_num_bytes as a total
+    // of all pending writes (and just treat it per message), since there is
+    // no way to know how much the consumer has read.
+    uint32_t num_bytes_available = HasRingBuffer()
+                                       ? available_capacity_
+                                       : options_.capacity_num_bytes;
+    bool all_or_none = flags & MOJO_WRITE_DATA_FLAG_ALL_OR_NONE;
+    uint32_t min_num_bytes_to_write = all_or_none ? *num_bytes : 0;
+    if (min_num_bytes_to_write > num_bytes_available) {
+      // Don't return "should wait" since you can't wait for a specified amount
+      // of data.
+      return MOJO_RESULT_OUT_OF_RANGE;
+    }
 
-  if (InTwoPhaseWrite())
-    return MOJO_RESULT_BUSY;
-  if (error_)
-    return MOJO_RESULT_FAILED_PRECONDITION;
-  if (*num_bytes % options_.element_num_bytes != 0)
-    return MOJO_RESULT_INVALID_ARGUMENT;
-  if (*num_bytes == 0)
-    return MOJO_RESULT_OK;  // Nothing to do.
-
-  // For now, we ignore options.capacity_num_bytes as a total of all pending
-  // writes (and just treat it per message). We will implement that later if
-  // we need to. All current uses want all their data to be sent, and it's not
-  // clear that this backpressure should be done at the mojo layer or at a
-  // higher application layer.
-  bool all_or_none = flags & MOJO_WRITE_DATA_FLAG_ALL_OR_NONE;
-  uint32_t min_num_bytes_to_write = all_or_none ? *num_bytes : 0;
-  if (min_num_bytes_to_write > options_.capacity_num_bytes) {
-    // Don't return "should wait" since you can't wait for a specified amount of
-    // data.
-    return MOJO_RESULT_OUT_OF_RANGE;
-  }
+    uint32_t num_bytes_to_write = std::min(*num_bytes, num_bytes_available);
+    if (num_bytes_to_write == 0)
+      return MOJO_RESULT_SHOULD_WAIT;
 
-  uint32_t num_bytes_to_write =
-      std::min(*num_bytes, options_.capacity_num_bytes);
-  if (num_bytes_to_write == 0)
-    return MOJO_RESULT_SHOULD_WAIT;
+    HandleSignalsState old_state = GetHandleSignalsStateNoLock();
 
-  HandleSignalsState old_state = GetHandleSignalsStateNoLock();
+    *num_bytes = num_bytes_to_write;
+    if (!HasRingBuffer()) {
+      WriteDataIntoMessagesNoLock(elements, num_bytes_to_write);
+    } else {
+      WriteDataIntoRingNoLock(elements, num_bytes_to_write);
+      CommitRingDataNoLock(num_bytes_to_write);
+    }
+    MetricsRegistry::Add(MetricsRegistry::kDataPipeBytesWritten,
+                         num_bytes_to_write);
 
-  *num_bytes = num_bytes_to_write;
-  WriteDataIntoMessagesNoLock(elements, num_bytes_to_write);
+    HandleSignalsState new_state = GetHandleSignalsStateNoLock();
+    if (!new_state.equals(old_state))
+      awakable_list_.AwakeForStateChange(new_state);
 
-  HandleSignalsState new_state = GetHandleSignalsStateNoLock();
-  if (!new_state.equals(old_state))
-    awakable_list_.AwakeForStateChange(new_state);
+    if (!HasRingBuffer())
+      return MOJO_RESULT_OK;
+    ++num_pending_notifications_;
+  }
+
+  NotifyWrite(*num_bytes);
   return MOJO_RESULT_OK;
 }
 
@@ -124,7 +157,7 @@ MojoResult DataPipeProducerDispatcher::BeginWriteData(
     void** buffer,
     uint32_t* buffer_num_bytes,
     MojoWriteDataFlags flags) {
-  base::AutoLock lock(lock_);
+  ProfiledAutoLock lock(lock_);
   if (port_closed_)
     return MOJO_RESULT_INVALID_ARGUMENT;
 
@@ -133,52 +166,115 @@ MojoResult DataPipeProducerDispatcher::BeginWriteData(
   if (error_)
     return MOJO_RESULT_FAILED_PRECONDITION;
 
-  // See comment in WriteData about ignoring capacity_num_bytes.
-  if (*buffer_num_bytes == 0)
-    *buffer_num_bytes = options_.capacity_num_bytes;
-
-  two_phase_data_.resize(*buffer_num_bytes);
-  *buffer = &two_phase_data_[0];
-
-  // TODO: if buffer_num_bytes.Get() > GetConfiguration().max_message_num_bytes
-  // we can construct a MessageInTransit here. But then we need to make
-  // MessageInTransit support changing its data size later.
+  if (HasRingBuffer()) {
+    if (available_capacity_ == 0)
+      return MOJO_RESULT_SHOULD_WAIT;
+
+    // Only the contiguous free space up to the end of the ring can be handed
+    // out. Any free space which wraps around is available once this write
+    // ends.
+    two_phase_max_bytes_written_ = std::min(
+        available_capacity_, options_.capacity_num_bytes - write_offset_);
+    *buffer = static_cast<char*>(ring_buffer_mapping_->GetBase()) +
+              write_offset_;
+    *buffer_num_bytes = two_phase_max_bytes_written_;
+  } else {
+    // See comment in WriteData about ignoring capacity_num_bytes. The data
+    // must still fit in a single message, though.
+    uint32_t max_num_bytes_to_write = std::min(
+        options_.capacity_num_bytes,
+        static_cast<uint32_t>(std::min<size_t>(
+            GetConfiguration().max_message_num_bytes,
+            std::numeric_limits<uint32_t>::max())));
+    max_num_bytes_to_write -=
+        max_num_bytes_to_write % options_.element_num_bytes;
+    DCHECK_GT(max_num_bytes_to_write, 0u);
+    if (*buffer_num_bytes == 0 || *buffer_num_bytes > max_num_bytes_to_write)
+      *buffer_num_bytes = max_num_bytes_to_write;
+
+    // The caller writes straight into the payload of the message which will
+    // carry the data, and EndWriteData trims it to the amount written.
+    two_phase_message_ = node_controller_->AllocMessage(*buffer_num_bytes, 0);
+    if (!two_phase_message_)
+      return MOJO_RESULT_RESOURCE_EXHAUSTED;
+    two_phase_message_->MarkBulk();
+    *buffer = two_phase_message_->mutable_payload_bytes();
+    two_phase_max_bytes_written_ = *buffer_num_bytes;
+  }
 
+  in_two_phase_write_ = true;
   return MOJO_RESULT_OK;
 }
 
 MojoResult DataPipeProducerDispatcher::EndWriteData(
     uint32_t num_bytes_written) {
-  base::AutoLock lock(lock_);
-  if (port_closed_)
-    return MOJO_RESULT_INVALID_ARGUMENT;
+  MojoResult rv = MOJO_RESULT_OK;
+  uint32_t num_bytes_to_notify = 0;
+  {
+    ProfiledAutoLock lock(lock_);
+    if (port_closed_)
+      return MOJO_RESULT_INVALID_ARGUMENT;
 
-  if (!InTwoPhaseWrite())
-    return MOJO_RESULT_FAILED_PRECONDITION;
+    if (!InTwoPhaseWrite())
+      return MOJO_RESULT_FAILED_PRECONDITION;
+
+    // Note: Allow successful completion of the two-phase write even if the
+    // other side has been closed.
+    if (num_bytes_written > two_phase_max_bytes_written_ ||
+        num_bytes_written % options_.element_num_bytes != 0) {
+      rv = MOJO_RESULT_INVALID_ARGUMENT;
+    } else if (HasRingBuffer()) {
+      CommitRingDataNoLock(num_bytes_written);
+      num_bytes_to_notify = num_bytes_written;
+      if (num_bytes_to_notify)
+        ++num_pending_notifications_;
+    } else if (num_bytes_written) {
+      two_phase_message_->TruncatePayload(num_bytes_written);
+      if (node_controller_->SendMessage(port_, std::move(two_phase_message_)) !=
+          ports::OK) {
+        error_ = true;
+      }
+    }
 
-  // Note: Allow successful completion of the two-phase write even if the other
-  // side has been closed.
-  MojoResult rv = MOJO_RESULT_OK;
-  if (num_bytes_written > two_phase_data_.size() ||
-      num_bytes_written % options_.element_num_bytes != 0) {
-    rv = MOJO_RESULT_INVALID_ARGUMENT;
-  } else {
-    WriteDataIntoMessagesNoLock(&two_phase_data_[0], num_bytes_written);
+    if (rv == MOJO_RESULT_OK) {
+      MetricsRegistry::Add(MetricsRegistry::kDataPipeBytesWritten,
+                           num_bytes_written);
+    }
+
+    // Two-phase write ended even on failure.
+    in_two_phase_write_ = false;
+    two_phase_max_bytes_written_ = 0;
+    two_phase_message_.reset();
+    // If we're now writable, we *became* writable (since we weren't writable
+    // during the two-phase write), so awake producer awakables.
+    HandleSignalsState new_state = GetHandleSignalsStateNoLock();
+    if (new_state.satisfies(MOJO_HANDLE_SIGNAL_WRITABLE))
+      awakable_list_.AwakeForStateChange(new_state);
   }
 
-  // Two-phase write ended even on failure.
-  two_phase_data_.clear();
-  // If we're now writable, we *became* writable (since we weren't writable
-  // during the two-phase write), so awake producer awakables.
+  if (num_bytes_to_notify)
+    NotifyWrite(num_bytes_to_notify);
+  return rv;
+}
+
+MojoResult DataPipeProducerDispatcher::SetDataPipeThreshold(
+    uint32_t num_bytes) {
+  ProfiledAutoLock lock(lock_);
+  if (port_closed_ || num_bytes > options_.capacity_num_bytes ||
+      num_bytes % options_.element_num_bytes != 0) {
+    return MOJO_RESULT_INVALID_ARGUMENT;
+  }
+
+  HandleSignalsState old_state = GetHandleSignalsStateNoLock();
+  threshold_num_bytes_ = num_bytes;
   HandleSignalsState new_state = GetHandleSignalsStateNoLock();
-  if (new_state.satisfies(MOJO_HANDLE_SIGNAL_WRITABLE))
+  if (!new_state.equals(old_state))
     awakable_list_.AwakeForStateChange(new_state);
-
-  return rv;
+  return MOJO_RESULT_OK;
 }
 
 HandleSignalsState DataPipeProducerDispatcher::GetHandleSignalsState() const {
-  base::AutoLock lock(lock_);
+  ProfiledAutoLock lock(lock_);
   return GetHandleSignalsStateNoLock();
 }
 
@@ -187,7 +283,7 @@ MojoResult DataPipeProducerDispatcher::AddAwakable(
     MojoHandleSignals signals,
     uintptr_t context,
     HandleSignalsState* signals_state) {
-  base::AutoLock lock(lock_);
+  ProfiledAutoLock lock(lock_);
   HandleSignalsState state = GetHandleSignalsStateNoLock();
   if (state.satisfies(signals)) {
     if (signals_state)
@@ -207,7 +303,7 @@ MojoResult DataPipeProducerDispatcher::AddAwakable(
 void DataPipeProducerDispatcher::RemoveAwakable(
     Awakable* awakable,
     HandleSignalsState* signals_state) {
-  base::AutoLock lock(lock_);
+  ProfiledAutoLock lock(lock_);
   awakable_list_.Remove(awakable);
   if (signals_state)
     *signals_state = GetHandleSignalsStateNoLock();
@@ -219,6 +315,13 @@ void DataPipeProducerDispatcher::StartSerialize(uint32_t* num_bytes,
   *num_bytes = sizeof(SerializedState);
   *num_ports = 1;
   *num_handles = 0;
+  if (ring_buffer_) {
+    uint32_t ring_buffer_num_bytes, ring_buffer_num_ports;
+    ring_buffer_->StartSerialize(&ring_buffer_num_bytes, &ring_buffer_num_ports,
+                                 num_handles);
+    DCHECK_EQ(0u, ring_buffer_num_ports);
+    *num_bytes += ring_buffer_num_bytes;
+  }
 }
 
 bool DataPipeProducerDispatcher::EndSerializeAndClose(
@@ -227,6 +330,18 @@ bool DataPipeProducerDispatcher::EndSerializeAndClose(
     PlatformHandleVector* platform_handles) {
   SerializedState* state = static_cast<SerializedState*>(destination);
   memcpy(&state->options, &options_, sizeof(MojoCreateDataPipeOptions));
+  state->error = error_;
+  state->write_offset = write_offset_;
+  state->available_capacity = available_capacity_;
+
+  if (ring_buffer_) {
+    if (!ring_buffer_->EndSerializeAndClose(state + 1, nullptr,
+                                            platform_handles)) {
+      return false;
+    }
+    ring_buffer_ = nullptr;
+    ring_buffer_mapping_.reset();
+  }
 
   ports[0] = port_.name();
 
@@ -238,7 +353,7 @@ bool DataPipeProducerDispatcher::EndSerializeAndClose(
 
 bool DataPipeProducerDispatcher::BeginTransit() {
   lock_.Acquire();
-  return !InTwoPhaseWrite();
+  return !InTwoPhaseWrite() && num_pending_notifications_ == 0;
 }
 
 void DataPipeProducerDispatcher::CompleteTransit() {
@@ -255,24 +370,71 @@ DataPipeProducerDispatcher::Deserialize(const void* data,
                                         size_t num_ports,
                                         PlatformHandle* handles,
                                         size_t num_handles) {
-  if (num_ports != 1 || num_handles != 0)
+  if (num_ports != 1 || num_handles > 1)
     return nullptr;
 
   if (num_bytes < sizeof(SerializedState))
     return nullptr;
 
   const SerializedState* state = static_cast<const SerializedState*>(data);
+  const MojoCreateDataPipeOptions& options = state->options;
+  if (!options.element_num_bytes || !options.capacity_num_bytes ||
+      options.capacity_num_bytes % options.element_num_bytes != 0 ||
+      state->write_offset >= options.capacity_num_bytes ||
+      state->write_offset % options.element_num_bytes != 0 ||
+      state->available_capacity > options.capacity_num_bytes ||
+      state->available_capacity % options.element_num_bytes != 0) {
+    return nullptr;
+  }
+
+  scoped_refptr<SharedBufferDispatcher> ring_buffer;
+  scoped_ptr<PlatformSharedBufferMapping> ring_buffer_mapping;
+  if (num_handles) {
+    ring_buffer = SharedBufferDispatcher::Deserialize(
+        state + 1, num_bytes - sizeof(SerializedState), nullptr, 0, handles,
+        num_handles);
+    if (!ring_buffer ||
+        ring_buffer->MapBuffer(0, options.capacity_num_bytes,
+                               MOJO_MAP_BUFFER_FLAG_NONE,
+                               &ring_buffer_mapping) != MOJO_RESULT_OK) {
+      return nullptr;
+    }
+  }
 
   NodeController* node_controller = internal::g_core->node_controller();
   ports::PortRef port;
   if (node_controller->node()->GetPort(ports[0], &port) != ports::OK)
     return nullptr;
 
-  return new DataPipeProducerDispatcher(node_controller, port, state->options);
+  scoped_refptr<DataPipeProducerDispatcher> dispatcher =
+      new DataPipeProducerDispatcher(node_controller, port,
+                                     std::move(ring_buffer),
+                                     std::move(ring_buffer_mapping), options,
+                                     false /* initialized */);
+  {
+    ProfiledAutoLock lock(dispatcher->lock_);
+    dispatcher->error_ = state->error;
+    dispatcher->write_offset_ = state->write_offset;
+    dispatcher->available_capacity_ = state->available_capacity;
+    dispatcher->InitializeNoLock();
+  }
+
+  // Pick up any control messages which arrived before the dispatcher existed.
+  dispatcher->OnPortStatusChanged();
+
+  return dispatcher;
 }
 
 DataPipeProducerDispatcher::~DataPipeProducerDispatcher() {}
 
+void DataPipeProducerDispatcher::InitializeNoLock() {
+  lock_.AssertAcquired();
+  // OnPortStatusChanged (via PortObserverThunk) may be called as soon as the
+  // observer is set, but it will block on |lock_| until we're done.
+  node_controller_->SetPortObserver(port_,
+                                    std::make_shared<PortObserverThunk>(this));
+}
+
 MojoResult DataPipeProducerDispatcher::CloseNoLock() {
   lock_.AssertAcquired();
   if (port_closed_)
@@ -280,9 +442,15 @@ MojoResult DataPipeProducerDispatcher::CloseNoLock() {
   port_closed_ = true;
 
   if (!port_transferred_)
-    node_controller_->node()->ClosePort(port_);
+    node_controller_->ClosePort(port_);
   awakable_list_.CancelAll();
 
+  ring_buffer_mapping_.reset();
+  if (ring_buffer_) {
+    ring_buffer_->Close();
+    ring_buffer_ = nullptr;
+  }
+
   return MOJO_RESULT_OK;
 }
 
@@ -291,9 +459,18 @@ HandleSignalsState DataPipeProducerDispatcher::GetHandleSignalsStateNoLock()
   lock_.AssertAcquired();
   HandleSignalsState rv;
   if (!error_) {
-    if (!InTwoPhaseWrite())
+    if (!InTwoPhaseWrite() && (!HasRingBuffer() || available_capacity_ > 0))
       rv.satisfied_signals |= MOJO_HANDLE_SIGNAL_WRITABLE;
     rv.satisfiable_signals |= MOJO_HANDLE_SIGNAL_WRITABLE;
+
+    if (threshold_num_bytes_ > 0) {
+      // As in WriteData(), without a ring buffer the capacity is per write.
+      uint32_t num_bytes_available =
+          HasRingBuffer() ? available_capacity_ : options_.capacity_num_bytes;
+      if (!InTwoPhaseWrite() && num_bytes_available >= threshold_num_bytes_)
+        rv.satisfied_signals |= MOJO_HANDLE_SIGNAL_THRESHOLD_REACHED;
+      rv.satisfiable_signals |= MOJO_HANDLE_SIGNAL_THRESHOLD_REACHED;
+    }
   } else {
     rv.satisfied_signals |= MOJO_HANDLE_SIGNAL_PEER_CLOSED;
   }
@@ -310,6 +487,11 @@ bool DataPipeProducerDispatcher::WriteDataIntoMessagesNoLock(
   max_message_num_bytes -= max_message_num_bytes % options_.element_num_bytes;
   DCHECK_GT(max_message_num_bytes, 0u);
 
+  // Each message is sized to its own chunk, and the chunks are sent together
+  // so that the port is only locked, and the peer only notified, once.
+  std::vector<ports::ScopedMessage> messages;
+  messages.reserve((num_bytes + max_message_num_bytes - 1) /
+                   max_message_num_bytes);
   uint32_t offset = 0;
   while (offset < num_bytes) {
     uint32_t message_num_bytes =
@@ -317,23 +499,64 @@ bool DataPipeProducerDispatcher::WriteDataIntoMessagesNoLock(
                  num_bytes - offset);
 
     scoped_ptr<PortsMessage> message =
-        node_controller_->AllocMessage(num_bytes, 0);
-    memcpy(message->mutable_payload_bytes(),
-           static_cast<const char*>(elements) + offset, message_num_bytes);
-    int rv = node_controller_->SendMessage(port_, std::move(message));
-    if (rv != ports::OK) {
+        node_controller_->AllocMessage(message_num_bytes, 0);
+    if (!message) {
       error_ = true;
       return false;
     }
+    // Data pipe contents shouldn't hold up other traffic on the channel.
+    message->MarkBulk();
+    memcpy(message->mutable_payload_bytes(),
+           static_cast<const char*>(elements) + offset, message_num_bytes);
+    messages.emplace_back(message.release());
 
     offset += message_num_bytes;
   }
 
+  int rv = node_controller_->SendMessages(port_, std::move(messages));
+  if (rv != ports::OK) {
+    error_ = true;
+    return false;
+  }
+
   return true;
 }
 
+void DataPipeProducerDispatcher::WriteDataIntoRingNoLock(const void* elements,
+                                                         uint32_t num_bytes) {
+  lock_.AssertAcquired();
+  DCHECK_LE(num_bytes, available_capacity_);
+  char* data = static_cast<char*>(ring_buffer_mapping_->GetBase());
+  uint32_t num_bytes_before_wrap =
+      std::min(num_bytes, options_.capacity_num_bytes - write_offset_);
+  memcpy(data + write_offset_, elements, num_bytes_before_wrap);
+  memcpy(data, static_cast<const char*>(elements) + num_bytes_before_wrap,
+         num_bytes - num_bytes_before_wrap);
+}
+
+void DataPipeProducerDispatcher::CommitRingDataNoLock(uint32_t num_bytes) {
+  lock_.AssertAcquired();
+  DCHECK_LE(num_bytes, available_capacity_);
+  write_offset_ = (write_offset_ + num_bytes) % options_.capacity_num_bytes;
+  available_capacity_ -= num_bytes;
+}
+
+void DataPipeProducerDispatcher::NotifyWrite(uint32_t num_bytes) {
+  bool sent = SendDataPipeControlMessage(
+      node_controller_, port_,
+      DataPipeControlMessage::Command::DATA_WAS_WRITTEN, num_bytes);
+
+  ProfiledAutoLock lock(lock_);
+  DCHECK_GT(num_pending_notifications_, 0u);
+  --num_pending_notifications_;
+  if (!sent) {
+    error_ = true;
+    awakable_list_.AwakeForStateChange(GetHandleSignalsStateNoLock());
+  }
+}
+
 void DataPipeProducerDispatcher::OnPortStatusChanged() {
-  base::AutoLock lock(lock_);
+  ProfiledAutoLock lock(lock_);
 
   ports::PortStatus port_status;
   if (node_controller_->node()->GetStatus(port_, &port_status) != ports::OK ||
@@ -341,16 +564,38 @@ void DataPipeProducerDispatcher::OnPortStatusChanged() {
     error_ = true;
   }
 
-  if (port_status.has_messages) {
+  if (port_status.has_messages && !HasRingBuffer()) {
     LOG(ERROR) << "Data pipe producers should never receive messages.";
     error_ = true;
+  } else if (port_status.has_messages) {
+    ports::ScopedMessage message;
+    do {
+      int rv = node_controller_->node()->GetMessage(port_, &message);
+      if (rv != ports::OK)
+        error_ = true;
+      if (!message)
+        break;
+
+      DataPipeControlMessage control_message;
+      if (!ParseDataPipeControlMessage(*message, &control_message) ||
+          control_message.command !=
+              DataPipeControlMessage::Command::DATA_WAS_READ ||
+          control_message.num_bytes >
+              options_.capacity_num_bytes - available_capacity_ ||
+          control_message.num_bytes % options_.element_num_bytes != 0) {
+        DLOG(ERROR) << "Invalid data pipe control message.";
+        error_ = true;
+        break;
+      }
+      available_capacity_ += control_message.num_bytes;
+    } while (message);
   }
 
   awakable_list_.AwakeForStateChange(GetHandleSignalsStateNoLock());
 }
 
 bool DataPipeProducerDispatcher::InTwoPhaseWrite() const {
-  return !two_phase_data_.empty();
+  return in_two_phase_write_;
 }
 
 }  // namespace edk
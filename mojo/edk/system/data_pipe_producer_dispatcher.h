@@ -10,26 +10,43 @@
 
 #include "base/macros.h"
 #include "base/memory/ref_counted.h"
-#include "base/synchronization/lock.h"
+#include "base/memory/scoped_ptr.h"
+#include "mojo/edk/embedder/platform_shared_buffer.h"
 #include "mojo/edk/system/awakable_list.h"
 #include "mojo/edk/system/dispatcher.h"
 #include "mojo/edk/system/ports/port_ref.h"
+#include "mojo/edk/system/profiled_lock.h"
 #include "mojo/edk/system/system_impl_export.h"
 
 namespace mojo {
 namespace edk {
 
 class NodeController;
+class PortsMessage;
+class SharedBufferDispatcher;
 
 // This is the Dispatcher implementation for the producer handle for data
 // pipes created by the Mojo primitive MojoCreateDataPipe(). This class is
 // thread-safe.
+//
+// If the pipe has a ring buffer, data is written straight into it and only
+// DataPipeControlMessages travel over |port|; the producer is writable only
+// while the consumer has left free space in the ring. Without a ring buffer,
+// data is sent in ports messages and the producer is always writable.
 class MOJO_SYSTEM_IMPL_EXPORT DataPipeProducerDispatcher final
     : public Dispatcher {
  public:
-  DataPipeProducerDispatcher(NodeController* node_controller,
-                             const ports::PortRef& port,
-                             const MojoCreateDataPipeOptions& options);
+  // |ring_buffer| and |ring_buffer_mapping| are either both null, or a buffer
+  // of |options.capacity_num_bytes| bytes shared with the consumer and a
+  // mapping of all of it. If |initialized| is false, |port| is not observed
+  // until InitializeNoLock() is called.
+  DataPipeProducerDispatcher(
+      NodeController* node_controller,
+      const ports::PortRef& port,
+      scoped_refptr<SharedBufferDispatcher> ring_buffer,
+      scoped_ptr<PlatformSharedBufferMapping> ring_buffer_mapping,
+      const MojoCreateDataPipeOptions& options,
+      bool initialized);
 
   // Dispatcher:
   Type GetType() const override;
@@ -41,6 +58,7 @@ class MOJO_SYSTEM_IMPL_EXPORT DataPipeProducerDispatcher final
                             uint32_t* buffer_num_bytes,
                             MojoWriteDataFlags flags) override;
   MojoResult EndWriteData(uint32_t num_bytes_written) override;
+  MojoResult SetDataPipeThreshold(uint32_t num_bytes) override;
   HandleSignalsState GetHandleSignalsState() const override;
   MojoResult AddAwakable(Awakable* awakable,
                          MojoHandleSignals signals,
@@ -72,21 +90,60 @@ class MOJO_SYSTEM_IMPL_EXPORT DataPipeProducerDispatcher final
 
   ~DataPipeProducerDispatcher() override;
 
+  void InitializeNoLock();
   MojoResult CloseNoLock();
   HandleSignalsState GetHandleSignalsStateNoLock() const;
   bool WriteDataIntoMessagesNoLock(const void* elements, uint32_t num_bytes);
+
+  // Copies |num_bytes| bytes into the ring buffer at |write_offset_|, wrapping
+  // around its end if necessary.
+  void WriteDataIntoRingNoLock(const void* elements, uint32_t num_bytes);
+
+  // Marks |num_bytes| bytes at |write_offset_| as written.
+  void CommitRingDataNoLock(uint32_t num_bytes);
+
+  // Tells the consumer about |num_bytes| bytes committed to the ring buffer.
+  // Must be called without |lock_| held, since the consumer may be notified
+  // synchronously and its reads notify us in turn. The caller increments
+  // |num_pending_notifications_| while it still holds |lock_|.
+  void NotifyWrite(uint32_t num_bytes);
+
   void OnPortStatusChanged();
   bool InTwoPhaseWrite() const;
 
+  bool HasRingBuffer() const { return !!ring_buffer_mapping_; }
+
   const MojoCreateDataPipeOptions options_;
   NodeController* const node_controller_;
   const ports::PortRef port_;
 
-  mutable base::Lock lock_;
+  mutable ProfiledLock lock_;
 
   AwakableList awakable_list_;
 
-  std::vector<char> two_phase_data_;
+  scoped_refptr<SharedBufferDispatcher> ring_buffer_;
+  scoped_ptr<PlatformSharedBufferMapping> ring_buffer_mapping_;
+
+  // The offset in the ring buffer at which the next byte will be written, and
+  // the number of bytes after it which the consumer has freed.
+  uint32_t write_offset_ = 0;
+  uint32_t available_capacity_;
+
+  bool in_two_phase_write_ = false;
+  uint32_t two_phase_max_bytes_written_ = 0;
+
+  // Writes committed to the ring buffer which NotifyWrite hasn't yet told the
+  // consumer about. The dispatcher can't be sent anywhere until they're sent,
+  // or the notifications would go out on a port it no longer owns.
+  uint32_t num_pending_notifications_ = 0;
+
+  // See Core::SetDataPipeThreshold. Zero means none is set. It isn't carried
+  // along when the handle is sent to another process.
+  uint32_t threshold_num_bytes_ = 0;
+
+  // Without a ring buffer, a two-phase write fills in the payload of this
+  // message, which is then sent as-is.
+  scoped_ptr<PortsMessage> two_phase_message_;
 
   bool error_ = false;
   bool port_closed_ = false;
@@ -787,6 +787,89 @@ void Seq(int32_t start, size_t count, int32_t* out) {
     out[i] = start + static_cast<int32_t>(i);
 }
 
+// Tests that the producer is only writable while the consumer has left free
+// space in the pipe, and that data wraps around the end of the pipe's buffer.
+TEST_F(DataPipeTest, ProducerWritableReflectsFreeSpace) {
+  const MojoCreateDataPipeOptions options = {
+      kSizeOfOptions,                           // |struct_size|.
+      MOJO_CREATE_DATA_PIPE_OPTIONS_FLAG_NONE,  // |flags|.
+      static_cast<uint32_t>(sizeof(int32_t)),   // |element_num_bytes|.
+      4 * sizeof(int32_t)                       // |capacity_num_bytes|.
+  };
+  ASSERT_EQ(MOJO_RESULT_OK, Create(&options));
+  MojoHandleSignalsState hss;
+
+  // Fill the pipe.
+  int32_t elements[4] = {1, 2, 3, 4};
+  uint32_t num_bytes = static_cast<uint32_t>(sizeof(elements));
+  ASSERT_EQ(MOJO_RESULT_OK, WriteData(elements, &num_bytes, true));
+  ASSERT_EQ(static_cast<uint32_t>(sizeof(elements)), num_bytes);
+
+  // The producer can't write any more until the consumer reads.
+  hss = MojoHandleSignalsState();
+  ASSERT_EQ(MOJO_RESULT_DEADLINE_EXCEEDED,
+            MojoWait(producer_, MOJO_HANDLE_SIGNAL_WRITABLE, 0, &hss));
+  ASSERT_EQ(0u, hss.satisfied_signals);
+  ASSERT_EQ(MOJO_HANDLE_SIGNAL_WRITABLE | MOJO_HANDLE_SIGNAL_PEER_CLOSED,
+            hss.satisfiable_signals);
+  num_bytes = static_cast<uint32_t>(sizeof(elements[0]));
+  ASSERT_EQ(MOJO_RESULT_SHOULD_WAIT, WriteData(elements, &num_bytes));
+  void* write_buffer = nullptr;
+  num_bytes = 0u;
+  ASSERT_EQ(MOJO_RESULT_SHOULD_WAIT, BeginWriteData(&write_buffer, &num_bytes));
+
+  // Read one element.
+  ASSERT_EQ(MOJO_RESULT_OK,
+            MojoWait(consumer_, MOJO_HANDLE_SIGNAL_READABLE,
+                     MOJO_DEADLINE_INDEFINITE, &hss));
+  int32_t element = -1;
+  num_bytes = static_cast<uint32_t>(sizeof(element));
+  ASSERT_EQ(MOJO_RESULT_OK, ReadData(&element, &num_bytes, true));
+  ASSERT_EQ(1, element);
+
+  // That leaves room for exactly one more element, at the start of the buffer.
+  hss = MojoHandleSignalsState();
+  ASSERT_EQ(MOJO_RESULT_OK,
+            MojoWait(producer_, MOJO_HANDLE_SIGNAL_WRITABLE,
+                     MOJO_DEADLINE_INDEFINITE, &hss));
+  ASSERT_EQ(MOJO_HANDLE_SIGNAL_WRITABLE, hss.satisfied_signals);
+  elements[0] = 5;
+  elements[1] = 6;
+  num_bytes = static_cast<uint32_t>(2u * sizeof(elements[0]));
+  ASSERT_EQ(MOJO_RESULT_OUT_OF_RANGE, WriteData(elements, &num_bytes, true));
+  ASSERT_EQ(MOJO_RESULT_OK, WriteData(elements, &num_bytes));
+  ASSERT_EQ(static_cast<uint32_t>(1u * sizeof(elements[0])), num_bytes);
+
+  // TODO(vtl): (See corresponding TODO in AllOrNone.)
+  for (size_t i = 0; i < kMaxPoll; i++) {
+    num_bytes = 0u;
+    ASSERT_EQ(MOJO_RESULT_OK, QueryData(&num_bytes));
+    if (num_bytes >= 4u * sizeof(int32_t))
+      break;
+
+    test::Sleep(test::EpsilonDeadline());
+  }
+  ASSERT_EQ(4u * sizeof(int32_t), num_bytes);
+
+  // Read everything, across the end of the buffer.
+  int32_t read_elements[4] = {};
+  num_bytes = static_cast<uint32_t>(sizeof(read_elements));
+  ASSERT_EQ(MOJO_RESULT_OK, ReadData(read_elements, &num_bytes, true));
+  ASSERT_EQ(static_cast<uint32_t>(sizeof(read_elements)), num_bytes);
+  ASSERT_EQ(2, read_elements[0]);
+  ASSERT_EQ(3, read_elements[1]);
+  ASSERT_EQ(4, read_elements[2]);
+  ASSERT_EQ(5, read_elements[3]);
+
+  // The whole pipe is free again.
+  hss = MojoHandleSignalsState();
+  ASSERT_EQ(MOJO_RESULT_OK,
+            MojoWait(producer_, MOJO_HANDLE_SIGNAL_WRITABLE,
+                     MOJO_DEADLINE_INDEFINITE, &hss));
+  num_bytes = static_cast<uint32_t>(sizeof(elements));
+  ASSERT_EQ(MOJO_RESULT_OK, WriteData(elements, &num_bytes, true));
+}
+
 TEST_F(DataPipeTest, AllOrNone) {
   const MojoCreateDataPipeOptions options = {
       kSizeOfOptions,                           // |struct_size|.
@@ -832,12 +915,10 @@ TEST_F(DataPipeTest, AllOrNone) {
   ASSERT_EQ(MOJO_RESULT_OK, QueryData(&num_bytes));
   ASSERT_EQ(5u * sizeof(int32_t), num_bytes);
 
-  /* TODO(jam): enable if we end up observing max capacity
   // Too much.
   num_bytes = 6u * sizeof(int32_t);
   Seq(200, MOJO_ARRAYSIZE(buffer), buffer);
   ASSERT_EQ(MOJO_RESULT_OUT_OF_RANGE, WriteData(buffer, &num_bytes, true));
-  */
 
   // Try reading too much.
   num_bytes = 11u * sizeof(int32_t);
@@ -8,6 +8,7 @@
 #include "mojo/edk/system/configuration.h"
 #include "mojo/edk/system/data_pipe_consumer_dispatcher.h"
 #include "mojo/edk/system/data_pipe_producer_dispatcher.h"
+#include "mojo/edk/system/message_for_transit.h"
 #include "mojo/edk/system/message_pipe_dispatcher.h"
 #include "mojo/edk/system/platform_handle_dispatcher.h"
 #include "mojo/edk/system/shared_buffer_dispatcher.h"
@@ -35,6 +36,35 @@ MojoResult Dispatcher::ReadMessage(void* bytes,
   return MOJO_RESULT_INVALID_ARGUMENT;
 }
 
+MojoResult Dispatcher::SetQuota(uint64_t max_queued_messages,
+                                uint64_t max_queued_bytes) {
+  return MOJO_RESULT_INVALID_ARGUMENT;
+}
+
+MojoResult Dispatcher::WriteMessageNew(scoped_ptr<MessageForTransit> message,
+                                       MojoWriteMessageFlags flags) {
+  return MOJO_RESULT_INVALID_ARGUMENT;
+}
+
+MojoResult Dispatcher::ReadMessageNew(scoped_ptr<MessageForTransit>* message,
+                                      uint32_t* num_bytes,
+                                      MojoHandle* handles,
+                                      uint32_t* num_handles,
+                                      MojoReadMessageFlags flags) {
+  return MOJO_RESULT_INVALID_ARGUMENT;
+}
+
+MojoResult Dispatcher::ReadMessages(void* bytes,
+                                    uint32_t num_bytes,
+                                    uint32_t* message_num_bytes,
+                                    MojoHandle* handles,
+                                    uint32_t num_handles,
+                                    uint32_t* message_num_handles,
+                                    uint32_t* num_messages,
+                                    MojoReadMessageFlags flags) {
+  return MOJO_RESULT_INVALID_ARGUMENT;
+}
+
 MojoResult Dispatcher::DuplicateBufferHandle(
     const MojoDuplicateBufferHandleOptions* options,
     scoped_refptr<Dispatcher>* new_dispatcher) {
@@ -81,6 +111,10 @@ MojoResult Dispatcher::EndWriteData(uint32_t num_bytes_written) {
   return MOJO_RESULT_INVALID_ARGUMENT;
 }
 
+MojoResult Dispatcher::SetDataPipeThreshold(uint32_t num_bytes) {
+  return MOJO_RESULT_INVALID_ARGUMENT;
+}
+
 MojoResult Dispatcher::AddWaitingDispatcher(
     const scoped_refptr<Dispatcher>& dispatcher,
     MojoHandleSignals signals,
@@ -25,11 +25,25 @@
 #include "mojo/public/c/system/message_pipe.h"
 #include "mojo/public/c/system/types.h"
 
+// Satisfied on a message pipe handle while its peer has more unread messages
+// queued than the quota set on it with Core::SetQuota() allows, or while the
+// process its peer is in is falling behind in reading what's been sent to it.
+// The handle is not WRITABLE for as long as this is. This extends the signals
+// in "mojo/public/c/system/types.h".
+#define MOJO_HANDLE_SIGNAL_PEER_OVER_QUOTA ((MojoHandleSignals)1 << 5)
+
+// Satisfied on a data pipe consumer handle while at least its threshold of
+// bytes can be read, or on a producer handle while at least its threshold of
+// bytes can be written. See Core::SetDataPipeThreshold(). This extends the
+// signals in "mojo/public/c/system/types.h".
+#define MOJO_HANDLE_SIGNAL_THRESHOLD_REACHED ((MojoHandleSignals)1 << 6)
+
 namespace mojo {
 namespace edk {
 
 class Awakable;
 class Dispatcher;
+class MessageForTransit;
 
 using DispatcherVector = std::vector<scoped_refptr<Dispatcher>>;
 
@@ -72,12 +86,37 @@ class MOJO_SYSTEM_IMPL_EXPORT Dispatcher
                                   uint32_t num_dispatchers,
                                   MojoWriteMessageFlags flags);
 
+  // See Core::WriteMessageNew.
+  virtual MojoResult WriteMessageNew(scoped_ptr<MessageForTransit> message,
+                                     MojoWriteMessageFlags flags);
+
+  // See Core::SetQuota.
+  virtual MojoResult SetQuota(uint64_t max_queued_messages,
+                              uint64_t max_queued_bytes);
+
   virtual MojoResult ReadMessage(void* bytes,
                                  uint32_t* num_bytes,
                                  MojoHandle* handles,
                                  uint32_t* num_handles,
                                  MojoReadMessageFlags flags);
 
+  // See Core::ReadMessageNew.
+  virtual MojoResult ReadMessageNew(scoped_ptr<MessageForTransit>* message,
+                                    uint32_t* num_bytes,
+                                    MojoHandle* handles,
+                                    uint32_t* num_handles,
+                                    MojoReadMessageFlags flags);
+
+  // See Core::ReadMessages.
+  virtual MojoResult ReadMessages(void* bytes,
+                                  uint32_t num_bytes,
+                                  uint32_t* message_num_bytes,
+                                  MojoHandle* handles,
+                                  uint32_t num_handles,
+                                  uint32_t* message_num_handles,
+                                  uint32_t* num_messages,
+                                  MojoReadMessageFlags flags);
+
   ///////////// Shared buffer API /////////////
 
   // |options| may be null. |new_dispatcher| must not be null, but
@@ -117,6 +156,9 @@ class MOJO_SYSTEM_IMPL_EXPORT Dispatcher
 
   virtual MojoResult EndWriteData(uint32_t num_bytes_written);
 
+  // See Core::SetDataPipeThreshold. Applies to both ends of a data pipe.
+  virtual MojoResult SetDataPipeThreshold(uint32_t num_bytes);
+
   ///////////// Wait set API /////////////
 
   // Adds a dispatcher to wait on. When the dispatcher satisfies |signals|, it
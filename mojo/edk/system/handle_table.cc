@@ -6,68 +6,117 @@
 
 #include <stdint.h>
 
-#include <limits>
+#include <utility>
+
+#include "base/logging.h"
+#include "base/threading/platform_thread.h"
 
 namespace mojo {
 namespace edk {
 
-HandleTable::HandleTable() {}
+namespace {
+
+const uint32_t kIndexMask = (1u << 20) - 1;
+const uint32_t kGenerationShift = 20;
+const uint32_t kGenerationMask = 0xFFFu;
+const uint32_t kLive = 1u << 19;
+const uint32_t kBusy = 1u << 18;
+const uint32_t kReaderMask = kBusy - 1;
+
+uint32_t LoadState(const base::subtle::Atomic32* state) {
+  return static_cast<uint32_t>(base::subtle::Acquire_Load(state));
+}
+
+// Atomically replaces |old_state| with |new_state|. Returns false if the state
+// was changed by someone else in the meantime.
+bool UpdateState(base::subtle::Atomic32* state,
+                 uint32_t old_state,
+                 uint32_t new_state) {
+  return base::subtle::Acquire_CompareAndSwap(
+             state, static_cast<base::subtle::Atomic32>(old_state),
+             static_cast<base::subtle::Atomic32>(new_state)) ==
+         static_cast<base::subtle::Atomic32>(old_state);
+}
+
+uint32_t GetGeneration(uint32_t handle_or_state) {
+  return handle_or_state >> kGenerationShift;
+}
+
+}  // namespace
 
-HandleTable::~HandleTable() {}
+HandleTable::HandleTable() : chunks_() {}
+
+HandleTable::~HandleTable() {
+  for (size_t i = 0; i < kMaxChunks; ++i)
+    delete[] reinterpret_cast<Slot*>(chunks_[i]);
+}
 
 MojoHandle HandleTable::AddDispatcher(scoped_refptr<Dispatcher> dispatcher) {
-  // Oops, we're out of handles.
-  if (next_available_handle_ == MOJO_HANDLE_INVALID)
-    return MOJO_HANDLE_INVALID;
+  return AllocateSlot(dispatcher);
+}
+
+bool HandleTable::AddDispatchers(const scoped_refptr<Dispatcher>* dispatchers,
+                                 size_t num_dispatchers,
+                                 MojoHandle* handles) {
+  if (num_dispatchers > GetNumAvailableSlots())
+    return false;
 
-  MojoHandle handle = next_available_handle_++;
-  auto result = handles_.insert(std::make_pair(handle, Entry(dispatcher)));
-  DCHECK(result.second);
+  for (size_t i = 0; i < num_dispatchers; ++i) {
+    handles[i] = AllocateSlot(dispatchers[i]);
+    DCHECK_NE(handles[i], MOJO_HANDLE_INVALID);
+  }
 
-  return handle;
+  return true;
 }
 
 bool HandleTable::AddDispatchersFromTransit(
-    const std::vector<Dispatcher::DispatcherInTransit>& dispatchers,
+    const Dispatcher::DispatcherInTransit* dispatchers,
+    size_t num_dispatchers,
     MojoHandle* handles) {
-  // Oops, we're out of handles.
-  if (next_available_handle_ == MOJO_HANDLE_INVALID)
-    return false;
-
-  DCHECK_LE(dispatchers.size(), std::numeric_limits<uint32_t>::max());
-  // If this insertion would cause handle overflow, we're out of handles.
-  if (next_available_handle_ + dispatchers.size() < next_available_handle_)
+  // If this insertion would use up more than the remaining slots, we're out of
+  // handles.
+  if (num_dispatchers > GetNumAvailableSlots())
     return false;
 
-  for (size_t i = 0; i < dispatchers.size(); ++i) {
-    MojoHandle handle = next_available_handle_++;
-    auto result = handles_.insert(
-        std::make_pair(handle, Entry(dispatchers[i].dispatcher)));
-    DCHECK(result.second);
-    handles[i] = handle;
+  for (size_t i = 0; i < num_dispatchers; ++i) {
+    handles[i] = AllocateSlot(dispatchers[i].dispatcher);
+    DCHECK_NE(handles[i], MOJO_HANDLE_INVALID);
   }
 
   return true;
 }
 
 scoped_refptr<Dispatcher> HandleTable::GetDispatcher(MojoHandle handle) const {
-  auto it = handles_.find(handle);
-  if (it == handles_.end())
+  Slot* slot = GetSlot(handle & kIndexMask);
+  if (!slot)
     return nullptr;
-  return it->second.dispatcher;
+
+  // Register as a reader so that the slot can't be cleared while we take our
+  // reference to its dispatcher.
+  for (;;) {
+    uint32_t state = LoadState(&slot->state);
+    if (!(state & kLive) || GetGeneration(state) != GetGeneration(handle))
+      return nullptr;
+    DCHECK_NE(state & kReaderMask, kReaderMask);
+    if (UpdateState(&slot->state, state, state + 1))
+      break;
+  }
+
+  scoped_refptr<Dispatcher> dispatcher = slot->dispatcher;
+  base::subtle::Barrier_AtomicIncrement(&slot->state, -1);
+  return dispatcher;
 }
 
 MojoResult HandleTable::GetAndRemoveDispatcher(
     MojoHandle handle,
     scoped_refptr<Dispatcher>* dispatcher) {
-  auto it = handles_.find(handle);
-  if (it == handles_.end())
+  uint32_t state;
+  if (!GetLiveSlot(handle, &state))
     return MOJO_RESULT_INVALID_ARGUMENT;
-  if (it->second.busy)
+  if (state & kBusy)
     return MOJO_RESULT_BUSY;
 
-  *dispatcher = it->second.dispatcher;
-  handles_.erase(it);
+  *dispatcher = ReleaseSlot(handle);
   return MOJO_RESULT_OK;
 }
 
@@ -78,17 +127,18 @@ MojoResult HandleTable::BeginTransit(
   dispatchers->clear();
   dispatchers->reserve(num_handles);
   for (size_t i = 0; i < num_handles; ++i) {
-    auto it = handles_.find(handles[i]);
-    if (it == handles_.end())
+    uint32_t state;
+    Slot* slot = GetLiveSlot(handles[i], &state);
+    if (!slot)
       return MOJO_RESULT_INVALID_ARGUMENT;
-    if (it->second.busy)
+    if (state & kBusy)
       return MOJO_RESULT_BUSY;
-    it->second.busy = true;
+    SetBusy(handles[i], true);
 
     dispatchers->emplace_back();
     Dispatcher::DispatcherInTransit& d = dispatchers->back();
     d.local_handle = handles[i];
-    d.dispatcher = it->second.dispatcher;
+    d.dispatcher = slot->dispatcher;
     if (!d.dispatcher->BeginTransit())
       return MOJO_RESULT_BUSY;
   }
@@ -98,9 +148,9 @@ MojoResult HandleTable::BeginTransit(
 void HandleTable::CompleteTransit(
     const std::vector<Dispatcher::DispatcherInTransit>& dispatchers) {
   for (const auto& dispatcher : dispatchers) {
-    auto it = handles_.find(dispatcher.local_handle);
-    DCHECK(it != handles_.end() && it->second.busy);
-    handles_.erase(it);
+    uint32_t state;
+    DCHECK(GetLiveSlot(dispatcher.local_handle, &state) && (state & kBusy));
+    ReleaseSlot(dispatcher.local_handle);
     dispatcher.dispatcher->CompleteTransit();
   }
 }
@@ -108,25 +158,116 @@ void HandleTable::CompleteTransit(
 void HandleTable::CancelTransit(
     const std::vector<Dispatcher::DispatcherInTransit>& dispatchers) {
   for (const auto& dispatcher : dispatchers) {
-    auto it = handles_.find(dispatcher.local_handle);
-    DCHECK(it != handles_.end() && it->second.busy);
-    it->second.busy = false;
+    SetBusy(dispatcher.local_handle, false);
     dispatcher.dispatcher->CancelTransit();
   }
 }
 
 void HandleTable::GetActiveHandlesForTest(std::vector<MojoHandle>* handles) {
   handles->clear();
-  for (const auto& entry : handles_)
-    handles->push_back(entry.first);
+  for (uint32_t index = 1; index < next_unused_index_; ++index) {
+    uint32_t state = LoadState(&GetSlot(index)->state);
+    if (state & kLive)
+      handles->push_back((GetGeneration(state) << kGenerationShift) | index);
+  }
 }
 
-HandleTable::Entry::Entry() {}
+HandleTable::Slot::Slot() : state(0) {}
 
-HandleTable::Entry::Entry(scoped_refptr<Dispatcher> dispatcher)
-    : dispatcher(dispatcher) {}
+HandleTable::Slot::~Slot() {}
 
-HandleTable::Entry::~Entry() {}
+size_t HandleTable::GetNumAvailableSlots() const {
+  return free_indices_.size() + (kMaxSlots - next_unused_index_);
+}
+
+HandleTable::Slot* HandleTable::GetSlot(uint32_t index) const {
+  if (index == 0 || index >= kMaxSlots)
+    return nullptr;
+  Slot* chunk = reinterpret_cast<Slot*>(
+      base::subtle::Acquire_Load(&chunks_[index / kSlotsPerChunk]));
+  if (!chunk)
+    return nullptr;
+  return &chunk[index % kSlotsPerChunk];
+}
+
+MojoHandle HandleTable::AllocateSlot(scoped_refptr<Dispatcher> dispatcher) {
+  uint32_t index;
+  if (!free_indices_.empty()) {
+    index = free_indices_.front();
+    free_indices_.pop_front();
+  } else if (next_unused_index_ < kMaxSlots) {
+    index = next_unused_index_++;
+    base::subtle::AtomicWord* chunk = &chunks_[index / kSlotsPerChunk];
+    if (!*chunk) {
+      base::subtle::Release_Store(
+          chunk, reinterpret_cast<base::subtle::AtomicWord>(
+                     new Slot[kSlotsPerChunk]));
+    }
+  } else {
+    // Oops, we're out of handles.
+    return MOJO_HANDLE_INVALID;
+  }
+
+  Slot* slot = GetSlot(index);
+  uint32_t state = LoadState(&slot->state);
+  // A free slot has no readers, since readers only register with live slots.
+  DCHECK_EQ(state & ~(kGenerationMask << kGenerationShift), 0u);
+  slot->dispatcher = dispatcher;
+  base::subtle::Release_Store(&slot->state,
+                              static_cast<base::subtle::Atomic32>(
+                                  state | kLive));
+
+  return (GetGeneration(state) << kGenerationShift) | index;
+}
+
+scoped_refptr<Dispatcher> HandleTable::ReleaseSlot(MojoHandle handle) {
+  Slot* slot = GetSlot(handle & kIndexMask);
+  DCHECK(slot);
+
+  // Bumping the generation invalidates |handle| and turns away any further
+  // readers.
+  for (;;) {
+    uint32_t state = LoadState(&slot->state);
+    DCHECK(state & kLive);
+    uint32_t generation = (GetGeneration(state) + 1) & kGenerationMask;
+    if (UpdateState(&slot->state, state,
+                    (generation << kGenerationShift) | (state & kReaderMask))) {
+      break;
+    }
+  }
+
+  // Readers only hold on for as long as it takes to copy a reference.
+  while (LoadState(&slot->state) & kReaderMask)
+    base::PlatformThread::YieldCurrentThread();
+
+  scoped_refptr<Dispatcher> dispatcher = std::move(slot->dispatcher);
+  free_indices_.push_back(handle & kIndexMask);
+  return dispatcher;
+}
+
+HandleTable::Slot* HandleTable::GetLiveSlot(MojoHandle handle,
+                                            uint32_t* state) const {
+  Slot* slot = GetSlot(handle & kIndexMask);
+  if (!slot)
+    return nullptr;
+  *state = LoadState(&slot->state);
+  if (!(*state & kLive) || GetGeneration(*state) != GetGeneration(handle))
+    return nullptr;
+  return slot;
+}
+
+void HandleTable::SetBusy(MojoHandle handle, bool busy) {
+  Slot* slot = GetSlot(handle & kIndexMask);
+  DCHECK(slot);
+  for (;;) {
+    uint32_t state = LoadState(&slot->state);
+    DCHECK(state & kLive);
+    DCHECK_NE(busy, !!(state & kBusy));
+    uint32_t new_state = busy ? state | kBusy : state & ~kBusy;
+    if (UpdateState(&slot->state, state, new_state))
+      break;
+  }
+}
 
 }  // namespace edk
 }  // namespace mojo
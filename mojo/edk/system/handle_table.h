@@ -5,11 +5,13 @@
 #ifndef MOJO_EDK_SYSTEM_HANDLE_TABLE_H_
 #define MOJO_EDK_SYSTEM_HANDLE_TABLE_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include <deque>
 #include <vector>
 
-#include "base/containers/hash_tables.h"
+#include "base/atomicops.h"
 #include "base/macros.h"
 #include "mojo/edk/system/dispatcher.h"
 #include "mojo/public/c/system/types.h"
@@ -17,6 +19,12 @@
 namespace mojo {
 namespace edk {
 
+// Maps MojoHandles to dispatchers. Handles index into an array of slots, and
+// also carry the generation of the slot they were allocated from so that a
+// stale handle does not resolve to a dispatcher which later reused its slot.
+//
+// GetDispatcher() may be called concurrently with anything else and does not
+// take a lock. All other methods must be externally synchronized.
 class HandleTable {
  public:
   HandleTable();
@@ -24,10 +32,22 @@ class HandleTable {
 
   MojoHandle AddDispatcher(scoped_refptr<Dispatcher> dispatcher);
 
-  // Inserts multiple dispatchers received from message transit, populating
-  // |handles| with their newly allocated handles. Returns |true| on success.
+  // Adds each of |num_dispatchers| dispatchers, populating |handles| with
+  // their handles, or adds none and returns |false| if there aren't enough
+  // handles left for all of them.
+  bool AddDispatchers(const scoped_refptr<Dispatcher>* dispatchers,
+                      size_t num_dispatchers,
+                      MojoHandle* handles);
+
+  // Returns how many more handles can be added.
+  size_t GetNumAvailableSlots() const;
+
+  // Inserts |num_dispatchers| dispatchers received from message transit,
+  // populating |handles| with their newly allocated handles. Returns |true| on
+  // success.
   bool AddDispatchersFromTransit(
-      const std::vector<Dispatcher::DispatcherInTransit>& dispatchers,
+      const Dispatcher::DispatcherInTransit* dispatchers,
+      size_t num_dispatchers,
       MojoHandle* handles);
 
   scoped_refptr<Dispatcher> GetDispatcher(MojoHandle handle) const;
@@ -50,20 +70,50 @@ class HandleTable {
   void GetActiveHandlesForTest(std::vector<MojoHandle> *handles);
 
  private:
-  struct Entry {
-   Entry();
-   explicit Entry(scoped_refptr<Dispatcher> dispatcher);
-   ~Entry();
-
-   scoped_refptr<Dispatcher> dispatcher;
-   bool busy = false;
+  // Each slot's state is a single atomic word, laid out as
+  //   [31:20] generation | [19] live | [18] busy | [17:0] reader count
+  // A handle is the slot's generation in its upper 12 bits and the slot's
+  // index in its lower 20 bits. Index 0 is never used, so no handle is
+  // MOJO_HANDLE_INVALID.
+  struct Slot {
+    Slot();
+    ~Slot();
+
+    base::subtle::Atomic32 state;
+    scoped_refptr<Dispatcher> dispatcher;
   };
 
-  using HandleMap = base::hash_map<MojoHandle, Entry>;
+  // Slots are allocated in fixed-size chunks which are never moved or freed
+  // until the table is destroyed, so readers can access them without a lock.
+  static const size_t kSlotsPerChunk = 1024;
+  static const size_t kMaxSlots = 1 << 20;
+  static const size_t kMaxChunks = kMaxSlots / kSlotsPerChunk;
+
+  Slot* GetSlot(uint32_t index) const;
+
+  // Allocates a slot for |dispatcher| and returns its handle, or
+  // MOJO_HANDLE_INVALID if the table is full.
+  MojoHandle AllocateSlot(scoped_refptr<Dispatcher> dispatcher);
+
+  // Clears the slot for |handle|, waiting for any concurrent GetDispatcher()
+  // calls on it to finish, and returns the dispatcher it held.
+  scoped_refptr<Dispatcher> ReleaseSlot(MojoHandle handle);
+
+  // Looks up the current state of the slot for |handle|. Returns null if the
+  // handle is not live.
+  Slot* GetLiveSlot(MojoHandle handle, uint32_t* state) const;
+
+  // Sets or clears the busy bit of the live slot for |handle|.
+  void SetBusy(MojoHandle handle, bool busy);
+
+  base::subtle::AtomicWord chunks_[kMaxChunks];
 
-  HandleMap handles_;
+  // The next index which has never been used.
+  uint32_t next_unused_index_ = 1;
 
-  uint32_t next_available_handle_ = 1;
+  // Indices of released slots. These are reused oldest first, which makes it
+  // less likely for a stale handle to alias a new one.
+  std::deque<uint32_t> free_indices_;
 
   DISALLOW_COPY_AND_ASSIGN(HandleTable);
 };
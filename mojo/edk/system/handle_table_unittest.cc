@@ -0,0 +1,146 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/handle_table.h"
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "base/bind.h"
+#include "base/location.h"
+#include "base/macros.h"
+#include "base/synchronization/waitable_event.h"
+#include "base/threading/thread.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace mojo {
+namespace edk {
+namespace {
+
+class FakeDispatcher : public Dispatcher {
+ public:
+  FakeDispatcher() {}
+
+  Type GetType() const override { return Type::UNKNOWN; }
+  MojoResult Close() override { return MOJO_RESULT_OK; }
+
+ private:
+  ~FakeDispatcher() override {}
+
+  DISALLOW_COPY_AND_ASSIGN(FakeDispatcher);
+};
+
+TEST(HandleTableTest, AddGetRemove) {
+  HandleTable table;
+  scoped_refptr<Dispatcher> dispatcher = new FakeDispatcher;
+  MojoHandle handle = table.AddDispatcher(dispatcher);
+  ASSERT_NE(MOJO_HANDLE_INVALID, handle);
+  EXPECT_EQ(dispatcher, table.GetDispatcher(handle));
+
+  scoped_refptr<Dispatcher> removed;
+  EXPECT_EQ(MOJO_RESULT_OK, table.GetAndRemoveDispatcher(handle, &removed));
+  EXPECT_EQ(dispatcher, removed);
+  EXPECT_FALSE(table.GetDispatcher(handle));
+  EXPECT_EQ(MOJO_RESULT_INVALID_ARGUMENT,
+            table.GetAndRemoveDispatcher(handle, &removed));
+
+  EXPECT_FALSE(table.GetDispatcher(MOJO_HANDLE_INVALID));
+  EXPECT_FALSE(table.GetDispatcher(0xFFFFFFFF));
+}
+
+TEST(HandleTableTest, StaleHandlesStayInvalid) {
+  HandleTable table;
+
+  // Keep freeing and allocating handles so that slots get reused. None of the
+  // handles which were freed may ever resolve again.
+  std::vector<MojoHandle> stale_handles;
+  for (size_t i = 0; i < 3000; ++i) {
+    MojoHandle handle = table.AddDispatcher(new FakeDispatcher);
+    ASSERT_NE(MOJO_HANDLE_INVALID, handle);
+    for (MojoHandle stale_handle : stale_handles)
+      ASSERT_NE(stale_handle, handle);
+
+    scoped_refptr<Dispatcher> removed;
+    ASSERT_EQ(MOJO_RESULT_OK, table.GetAndRemoveDispatcher(handle, &removed));
+    if (i % 100 == 0)
+      stale_handles.push_back(handle);
+  }
+
+  scoped_refptr<Dispatcher> dispatcher = new FakeDispatcher;
+  MojoHandle handle = table.AddDispatcher(dispatcher);
+  for (MojoHandle stale_handle : stale_handles)
+    EXPECT_FALSE(table.GetDispatcher(stale_handle));
+  EXPECT_EQ(dispatcher, table.GetDispatcher(handle));
+
+  std::vector<MojoHandle> active_handles;
+  table.GetActiveHandlesForTest(&active_handles);
+  ASSERT_EQ(1u, active_handles.size());
+  EXPECT_EQ(handle, active_handles[0]);
+}
+
+TEST(HandleTableTest, Transit) {
+  HandleTable table;
+  MojoHandle handles[2];
+  handles[0] = table.AddDispatcher(new FakeDispatcher);
+  handles[1] = table.AddDispatcher(new FakeDispatcher);
+
+  std::vector<Dispatcher::DispatcherInTransit> dispatchers;
+  ASSERT_EQ(MOJO_RESULT_OK, table.BeginTransit(handles, 2, &dispatchers));
+
+  // Busy handles can still be looked up, but not removed or sent again.
+  EXPECT_TRUE(table.GetDispatcher(handles[0]));
+  scoped_refptr<Dispatcher> removed;
+  EXPECT_EQ(MOJO_RESULT_BUSY,
+            table.GetAndRemoveDispatcher(handles[0], &removed));
+  std::vector<Dispatcher::DispatcherInTransit> other_dispatchers;
+  EXPECT_EQ(MOJO_RESULT_BUSY,
+            table.BeginTransit(handles + 1, 1, &other_dispatchers));
+
+  table.CancelTransit(dispatchers);
+  EXPECT_TRUE(table.GetDispatcher(handles[0]));
+  EXPECT_TRUE(table.GetDispatcher(handles[1]));
+
+  ASSERT_EQ(MOJO_RESULT_OK, table.BeginTransit(handles, 2, &dispatchers));
+  table.CompleteTransit(dispatchers);
+  EXPECT_FALSE(table.GetDispatcher(handles[0]));
+  EXPECT_FALSE(table.GetDispatcher(handles[1]));
+}
+
+void LookUpRepeatedly(HandleTable* table,
+                      MojoHandle handle,
+                      base::WaitableEvent* done) {
+  while (!done->IsSignaled())
+    table->GetDispatcher(handle);
+}
+
+TEST(HandleTableTest, ConcurrentLookups) {
+  HandleTable table;
+  MojoHandle handle = table.AddDispatcher(new FakeDispatcher);
+
+  // Look up a handle on other threads while its slot is freed and reused.
+  base::WaitableEvent done(true, false);
+  base::Thread thread1("lookup1");
+  base::Thread thread2("lookup2");
+  thread1.Start();
+  thread2.Start();
+  thread1.task_runner()->PostTask(
+      FROM_HERE, base::Bind(&LookUpRepeatedly, &table, handle, &done));
+  thread2.task_runner()->PostTask(
+      FROM_HERE, base::Bind(&LookUpRepeatedly, &table, handle, &done));
+
+  for (size_t i = 0; i < 10000; ++i) {
+    scoped_refptr<Dispatcher> removed;
+    ASSERT_EQ(MOJO_RESULT_OK, table.GetAndRemoveDispatcher(handle, &removed));
+    handle = table.AddDispatcher(new FakeDispatcher);
+  }
+
+  done.Signal();
+  thread1.Stop();
+  thread2.Stop();
+}
+
+}  // namespace
+}  // namespace edk
+}  // namespace mojo
@@ -0,0 +1,440 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/io_uring_loop.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include "base/bind.h"
+#include "base/lazy_instance.h"
+#include "base/logging.h"
+#include "base/threading/thread_local_storage.h"
+#include "build/build_config.h"
+
+#if defined(OS_LINUX)
+#include <sys/syscall.h>
+#endif
+
+#if defined(OS_LINUX) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+
+#define MOJO_EDK_HAS_IO_URING
+#endif
+
+namespace mojo {
+namespace edk {
+
+#if defined(MOJO_EDK_HAS_IO_URING)
+
+namespace {
+
+// Enough for the reads and writes of a few hundred channels at once. Entries
+// which don't fit are submitted early to make room.
+const uint32_t kNumEntries = 512;
+
+struct LoopSlot {
+  base::ThreadLocalStorage::Slot slot;
+};
+
+base::LazyInstance<LoopSlot>::Leaky g_loop_slot = LAZY_INSTANCE_INITIALIZER;
+
+int IoUringSetup(uint32_t entries, io_uring_params* params) {
+  return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+int IoUringEnter(int fd, uint32_t to_submit, uint32_t min_complete,
+                 uint32_t flags) {
+  return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit,
+                                  min_complete, flags, nullptr, 0));
+}
+
+int IoUringRegister(int fd, uint32_t opcode, void* arg, uint32_t num_args) {
+  return static_cast<int>(
+      syscall(__NR_io_uring_register, fd, opcode, arg, num_args));
+}
+
+// Whether the kernel has every opcode IoUringLoop uses. Sendmsg and recvmsg
+// arrived in 5.3, cancellation in 5.5; probing needs 5.6, by which point all
+// three are there.
+bool ProbeOpcodes(int fd) {
+  const size_t kProbeSize =
+      sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+  scoped_ptr<char[]> storage(new char[kProbeSize]);
+  memset(storage.get(), 0, kProbeSize);
+  io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(storage.get());
+  if (IoUringRegister(fd, IORING_REGISTER_PROBE, probe, 256) != 0)
+    return false;
+
+  const uint8_t kOpcodes[] = {IORING_OP_SENDMSG, IORING_OP_RECVMSG,
+                              IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL};
+  for (uint8_t opcode : kOpcodes) {
+    if (opcode > probe->last_op ||
+        !(probe->ops[opcode].flags & IO_URING_OP_SUPPORTED)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool ProbeSupport() {
+  io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = IoUringSetup(1, &params);
+  if (fd < 0)
+    return false;
+  bool supported = ProbeOpcodes(fd);
+  close(fd);
+  return supported;
+}
+
+struct Support {
+  Support() : supported(ProbeSupport()) {}
+
+  const bool supported;
+};
+
+base::LazyInstance<Support>::Leaky g_support = LAZY_INSTANCE_INITIALIZER;
+
+}  // namespace
+
+// The memory shared with the kernel.
+struct IoUringLoop::Ring {
+  using Index = std::atomic<uint32_t>;
+
+  Ring() {}
+
+  ~Ring() {
+    if (sqes)
+      munmap(sqes, sqes_size);
+    if (cq_memory && cq_memory != sq_memory)
+      munmap(cq_memory, cq_size);
+    if (sq_memory)
+      munmap(sq_memory, sq_size);
+    if (fd >= 0)
+      close(fd);
+  }
+
+  bool Init(uint32_t entries) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    fd = IoUringSetup(entries, &params);
+    if (fd < 0) {
+      DPLOG(ERROR) << "io_uring_setup";
+      return false;
+    }
+
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap)
+      sq_size = cq_size = std::max(sq_size, cq_size);
+
+    sq_memory = Map(sq_size, IORING_OFF_SQ_RING);
+    if (!sq_memory)
+      return false;
+    if (single_mmap) {
+      cq_memory = sq_memory;
+    } else {
+      cq_memory = Map(cq_size, IORING_OFF_CQ_RING);
+      if (!cq_memory)
+        return false;
+    }
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe*>(Map(sqes_size, IORING_OFF_SQES));
+    if (!sqes)
+      return false;
+
+    char* sq = static_cast<char*>(sq_memory);
+    sq_head = reinterpret_cast<Index*>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<Index*>(sq + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    sq_array = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+
+    char* cq = static_cast<char*>(cq_memory);
+    cq_head = reinterpret_cast<Index*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<Index*>(cq + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+  }
+
+  void* Map(size_t size, off_t offset) {
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, fd, offset);
+    if (memory == MAP_FAILED) {
+      DPLOG(ERROR) << "mmap";
+      return nullptr;
+    }
+    return memory;
+  }
+
+  int fd = -1;
+
+  void* sq_memory = nullptr;
+  size_t sq_size = 0;
+  void* cq_memory = nullptr;
+  size_t cq_size = 0;
+  io_uring_sqe* sqes = nullptr;
+  size_t sqes_size = 0;
+
+  // Only this side moves |sq_tail| and |cq_head|; the kernel moves the others.
+  Index* sq_head = nullptr;
+  Index* sq_tail = nullptr;
+  uint32_t sq_mask = 0;
+  uint32_t sq_entries = 0;
+  uint32_t* sq_array = nullptr;
+
+  Index* cq_head = nullptr;
+  Index* cq_tail = nullptr;
+  uint32_t cq_mask = 0;
+  io_uring_cqe* cqes = nullptr;
+};
+
+// static
+bool IoUringLoop::IsSupported() {
+  return g_support.Get().supported;
+}
+
+// static
+IoUringLoop* IoUringLoop::GetForCurrentThread() {
+  if (!IsSupported())
+    return nullptr;
+
+  base::ThreadLocalStorage::Slot& slot = g_loop_slot.Get().slot;
+  IoUringLoop* loop = static_cast<IoUringLoop*>(slot.Get());
+  if (loop)
+    return loop;
+
+  DCHECK(base::MessageLoopForIO::IsCurrent());
+  loop = new IoUringLoop;
+  if (!loop->Init()) {
+    delete loop;
+    return nullptr;
+  }
+  base::MessageLoop::current()->AddDestructionObserver(loop);
+  slot.Set(loop);
+  return loop;
+}
+
+IoUringLoop::IoUringLoop() : weak_factory_(this) {}
+
+IoUringLoop::~IoUringLoop() {
+  event_watcher_.StopWatchingFileDescriptor();
+  ring_.reset();
+  if (event_fd_ >= 0)
+    close(event_fd_);
+}
+
+bool IoUringLoop::Init() {
+  ring_.reset(new Ring);
+  if (!ring_->Init(kNumEntries))
+    return false;
+
+  event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd_ < 0) {
+    DPLOG(ERROR) << "eventfd";
+    return false;
+  }
+  if (IoUringRegister(ring_->fd, IORING_REGISTER_EVENTFD, &event_fd_, 1) !=
+      0) {
+    DPLOG(ERROR) << "io_uring_register";
+    return false;
+  }
+  return base::MessageLoopForIO::current()->WatchFileDescriptor(
+      event_fd_, true /* persistent */, base::MessageLoopForIO::WATCH_READ,
+      &event_watcher_, this);
+}
+
+void IoUringLoop::SendMessage(int fd, const msghdr* message, int flags,
+                              Operation* operation) {
+  Queue(IORING_OP_SENDMSG, fd, reinterpret_cast<uintptr_t>(message), 1,
+        static_cast<uint32_t>(flags), operation);
+}
+
+void IoUringLoop::ReceiveMessage(int fd, msghdr* message, int flags,
+                                 Operation* operation) {
+  Queue(IORING_OP_RECVMSG, fd, reinterpret_cast<uintptr_t>(message), 1,
+        static_cast<uint32_t>(flags), operation);
+}
+
+void IoUringLoop::Poll(int fd, uint32_t events, Operation* operation) {
+  Queue(IORING_OP_POLL_ADD, fd, 0, 0, events, operation);
+}
+
+void IoUringLoop::Cancel(Operation* operation) {
+  // The cancellation's own completion carries no operation.
+  Queue(IORING_OP_ASYNC_CANCEL, -1, reinterpret_cast<uintptr_t>(operation), 0,
+        0, nullptr);
+  Flush();
+}
+
+void IoUringLoop::Queue(uint8_t opcode,
+                        int fd,
+                        uint64_t address,
+                        uint32_t length,
+                        uint32_t op_flags,
+                        Operation* operation) {
+  // Flush() may reap completions whose callbacks queue more entries, so the
+  // tail is only read once there's room and nothing else can run before it's
+  // advanced.
+  Ring* ring = ring_.get();
+  uint32_t tail;
+  for (;;) {
+    tail = ring->sq_tail->load(std::memory_order_relaxed);
+    if (tail - ring->sq_head->load(std::memory_order_acquire) <
+        ring->sq_entries) {
+      break;
+    }
+    Flush();
+  }
+
+  uint32_t index = tail & ring->sq_mask;
+  io_uring_sqe* sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->addr = address;
+  sqe->len = length;
+  // Shares a union with the other opcodes' flags, poll events included.
+  sqe->msg_flags = op_flags;
+  sqe->user_data = reinterpret_cast<uintptr_t>(operation);
+  ring->sq_array[index] = index;
+  ring->sq_tail->store(tail + 1, std::memory_order_release);
+  ++num_queued_;
+
+  if (!flush_posted_) {
+    flush_posted_ = true;
+    base::MessageLoop::current()->task_runner()->PostTask(
+        FROM_HERE,
+        base::Bind(&IoUringLoop::Flush, weak_factory_.GetWeakPtr()));
+  }
+}
+
+void IoUringLoop::Flush() {
+  flush_posted_ = false;
+  while (num_queued_ > 0) {
+    int result = IoUringEnter(ring_->fd, num_queued_, 0, 0);
+    if (result >= 0) {
+      num_queued_ -= static_cast<uint32_t>(result);
+      continue;
+    }
+    if (errno == EINTR)
+      continue;
+    if (errno == EBUSY || errno == EAGAIN) {
+      // The completion queue is full; make room and retry.
+      ReapCompletions();
+      continue;
+    }
+    PLOG(FATAL) << "io_uring_enter";
+  }
+}
+
+void IoUringLoop::ReapCompletions() {
+  Ring* ring = ring_.get();
+  for (;;) {
+    // Callbacks may queue more work, and a flush for it may reap completions
+    // itself, so the head is read afresh for each entry.
+    uint32_t head = ring->cq_head->load(std::memory_order_relaxed);
+    if (head == ring->cq_tail->load(std::memory_order_acquire))
+      break;
+
+    // Release each entry before its callback runs, so that a nested reap
+    // doesn't see it again.
+    const io_uring_cqe& cqe = ring->cqes[head & ring->cq_mask];
+    Operation* operation = reinterpret_cast<Operation*>(cqe.user_data);
+    int result = cqe.res;
+    ring->cq_head->store(head + 1, std::memory_order_release);
+    if (operation)
+      operation->OnComplete(result);
+  }
+}
+
+void IoUringLoop::OnFileCanReadWithoutBlocking(int fd) {
+  DCHECK_EQ(fd, event_fd_);
+  uint64_t value;
+  ssize_t result = read(event_fd_, &value, sizeof(value));
+  DCHECK(result == sizeof(value) || errno == EAGAIN);
+  ReapCompletions();
+}
+
+void IoUringLoop::OnFileCanWriteWithoutBlocking(int fd) {
+  NOTREACHED();
+}
+
+void IoUringLoop::WillDestroyCurrentMessageLoop() {
+  g_loop_slot.Get().slot.Set(nullptr);
+  delete this;
+}
+
+#else  // defined(MOJO_EDK_HAS_IO_URING)
+
+struct IoUringLoop::Ring {};
+
+// static
+bool IoUringLoop::IsSupported() {
+  return false;
+}
+
+// static
+IoUringLoop* IoUringLoop::GetForCurrentThread() {
+  return nullptr;
+}
+
+IoUringLoop::IoUringLoop() : weak_factory_(this) {}
+
+IoUringLoop::~IoUringLoop() {}
+
+bool IoUringLoop::Init() {
+  return false;
+}
+
+void IoUringLoop::SendMessage(int fd, const msghdr* message, int flags,
+                              Operation* operation) {
+  NOTREACHED();
+}
+
+void IoUringLoop::ReceiveMessage(int fd, msghdr* message, int flags,
+                                 Operation* operation) {
+  NOTREACHED();
+}
+
+void IoUringLoop::Poll(int fd, uint32_t events, Operation* operation) {
+  NOTREACHED();
+}
+
+void IoUringLoop::Cancel(Operation* operation) {
+  NOTREACHED();
+}
+
+void IoUringLoop::Queue(uint8_t opcode,
+                        int fd,
+                        uint64_t address,
+                        uint32_t length,
+                        uint32_t op_flags,
+                        Operation* operation) {
+  NOTREACHED();
+}
+
+void IoUringLoop::Flush() {}
+
+void IoUringLoop::ReapCompletions() {}
+
+void IoUringLoop::OnFileCanReadWithoutBlocking(int fd) {}
+
+void IoUringLoop::OnFileCanWriteWithoutBlocking(int fd) {}
+
+void IoUringLoop::WillDestroyCurrentMessageLoop() {}
+
+#endif  // defined(MOJO_EDK_HAS_IO_URING)
+
+}  // namespace edk
+}  // namespace mojo
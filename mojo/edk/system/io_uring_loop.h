@@ -0,0 +1,121 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_SYSTEM_IO_URING_LOOP_H_
+#define MOJO_EDK_SYSTEM_IO_URING_LOOP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "base/macros.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/memory/weak_ptr.h"
+#include "base/message_loop/message_loop.h"
+#include "base/message_loop/message_pump_libevent.h"
+
+namespace mojo {
+namespace edk {
+
+// Runs socket I/O for an I/O thread through an io_uring, so that the sends and
+// receives of every Channel on the thread are submitted together and their
+// completions reaped together, rather than each costing a readiness wakeup
+// and a system call of its own. Linux only; elsewhere, and on kernels without
+// io_uring, GetForCurrentThread() returns null.
+//
+// Operations queued while a task runs are submitted with a single
+// io_uring_enter() once it finishes. Completions are signalled through an
+// eventfd which the thread's message loop watches.
+class IoUringLoop : public base::MessagePumpLibevent::Watcher,
+                    public base::MessageLoop::DestructionObserver {
+ public:
+  // An operation in flight. It must stay alive, along with any buffers it
+  // refers to, until OnComplete() is called.
+  class Operation {
+   public:
+    // |result| is what the corresponding system call would have returned, or
+    // minus the errno on failure. A cancelled operation completes with
+    // -ECANCELED, unless it completed before the cancellation took effect.
+    virtual void OnComplete(int result) = 0;
+
+   protected:
+    virtual ~Operation() {}
+  };
+
+  // Whether io_uring is usable on this system.
+  static bool IsSupported();
+
+  // Returns the IoUringLoop for the current thread, which must run a
+  // MessageLoopForIO, creating it if need be. Returns null if io_uring isn't
+  // supported. The loop lives until the thread's message loop is destroyed,
+  // at which point any operations still in flight never complete; users
+  // which may outlive it should hold a WeakPtr.
+  static IoUringLoop* GetForCurrentThread();
+
+  base::WeakPtr<IoUringLoop> GetWeakPtr() {
+    return weak_factory_.GetWeakPtr();
+  }
+
+  // Queue a sendmsg() or recvmsg() on |fd|. |message| must stay valid until
+  // |operation| completes.
+  void SendMessage(int fd, const msghdr* message, int flags,
+                   Operation* operation);
+  void ReceiveMessage(int fd, msghdr* message, int flags,
+                      Operation* operation);
+
+  // Queues a wait for |fd| to satisfy the poll(2) |events|.
+  void Poll(int fd, uint32_t events, Operation* operation);
+
+  // Asks for |operation| to complete as soon as possible. Submits at once,
+  // along with everything queued, so the file descriptor |operation| is on
+  // may be closed as soon as this returns.
+  void Cancel(Operation* operation);
+
+ private:
+  struct Ring;
+
+  IoUringLoop();
+  ~IoUringLoop() override;
+
+  bool Init();
+
+  // Fills in the next submission queue entry for |operation| and queues it,
+  // scheduling a flush if none is pending.
+  void Queue(uint8_t opcode,
+             int fd,
+             uint64_t address,
+             uint32_t length,
+             uint32_t op_flags,
+             Operation* operation);
+
+  // Submits everything queued.
+  void Flush();
+
+  // Runs the completion callbacks for everything which has completed.
+  void ReapCompletions();
+
+  // base::MessagePumpLibevent::Watcher:
+  void OnFileCanReadWithoutBlocking(int fd) override;
+  void OnFileCanWriteWithoutBlocking(int fd) override;
+
+  // base::MessageLoop::DestructionObserver:
+  void WillDestroyCurrentMessageLoop() override;
+
+  scoped_ptr<Ring> ring_;
+  int event_fd_ = -1;
+  base::MessagePumpLibevent::FileDescriptorWatcher event_watcher_;
+
+  // Entries queued but not yet submitted, and whether a flush is posted.
+  uint32_t num_queued_ = 0;
+  bool flush_posted_ = false;
+
+  base::WeakPtrFactory<IoUringLoop> weak_factory_;
+
+  DISALLOW_COPY_AND_ASSIGN(IoUringLoop);
+};
+
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_SYSTEM_IO_URING_LOOP_H_
@@ -0,0 +1,45 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/memory_allocation.h"
+
+#include <stdint.h>
+
+#include "base/logging.h"
+#include "base/memory/aligned_memory.h"
+
+namespace mojo {
+namespace edk {
+
+namespace {
+
+MemoryAllocator* g_allocator = nullptr;
+
+}  // namespace
+
+void InstallMemoryAllocator(MemoryAllocator* allocator) {
+  g_allocator = allocator;
+}
+
+void* AllocateMemory(MemoryAllocator::Usage usage,
+                     size_t num_bytes,
+                     size_t alignment) {
+  if (!g_allocator)
+    return base::AlignedAlloc(num_bytes, alignment);
+
+  void* ptr = g_allocator->Allocate(usage, num_bytes, alignment);
+  CHECK(ptr);
+  DCHECK_EQ(0u, reinterpret_cast<uintptr_t>(ptr) % alignment);
+  return ptr;
+}
+
+void FreeMemory(MemoryAllocator::Usage usage, void* ptr) {
+  if (!g_allocator)
+    base::AlignedFree(ptr);
+  else if (ptr)
+    g_allocator->Free(usage, ptr);
+}
+
+}  // namespace edk
+}  // namespace mojo
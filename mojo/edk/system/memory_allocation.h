@@ -0,0 +1,32 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_SYSTEM_MEMORY_ALLOCATION_H_
+#define MOJO_EDK_SYSTEM_MEMORY_ALLOCATION_H_
+
+#include <stddef.h>
+
+#include "mojo/edk/embedder/memory_allocator.h"
+
+namespace mojo {
+namespace edk {
+
+// Where the EDK's message, read buffer and port memory comes from: the
+// embedder's MemoryAllocator if it set one, and otherwise the heap.
+
+// Installs the allocator used from now on, or with null goes back to the
+// heap. Blocks must be freed by the allocator they came from, so this may only
+// be called before anything has been allocated, or with an allocator which
+// can free what the previous one allocated. Not thread-safe.
+void InstallMemoryAllocator(MemoryAllocator* allocator);
+
+void* AllocateMemory(MemoryAllocator::Usage usage,
+                     size_t num_bytes,
+                     size_t alignment);
+void FreeMemory(MemoryAllocator::Usage usage, void* ptr);
+
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_SYSTEM_MEMORY_ALLOCATION_H_
@@ -0,0 +1,76 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/memory_placement.h"
+
+#include "build/build_config.h"
+
+#if defined(OS_LINUX) || defined(OS_ANDROID)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "base/logging.h"
+
+namespace mojo {
+namespace edk {
+
+namespace {
+
+#if defined(OS_LINUX) || defined(OS_ANDROID)
+
+// From <linux/mempolicy.h>, which not every sysroot has.
+const int kMpolPreferred = 1;
+
+// Prefers |node| for the pages in [|begin|, |end|).
+void PreferNode(uintptr_t begin, uintptr_t end, unsigned node) {
+  const unsigned long kBitsPerMask = sizeof(unsigned long) * 8;
+  if (node >= kBitsPerMask)
+    return;
+  unsigned long node_mask = 1ul << node;
+  if (syscall(SYS_mbind, reinterpret_cast<void*>(begin), end - begin,
+              kMpolPreferred, &node_mask, kBitsPerMask, 0) != 0) {
+    DPLOG(WARNING) << "mbind";
+  }
+}
+
+#endif
+
+}  // namespace
+
+void ApplyMemoryPlacement(void* address, size_t num_bytes, uint32_t placement) {
+#if defined(OS_LINUX) || defined(OS_ANDROID)
+  if (placement == MEMORY_PLACEMENT_DEFAULT)
+    return;
+
+  // Both system calls need page-aligned ranges, so only whole pages within the
+  // buffer are affected.
+  uintptr_t page_size = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+  uintptr_t begin =
+      (reinterpret_cast<uintptr_t>(address) + page_size - 1) & ~(page_size - 1);
+  uintptr_t end =
+      (reinterpret_cast<uintptr_t>(address) + num_bytes) & ~(page_size - 1);
+  if (begin >= end)
+    return;
+
+#if defined(MADV_HUGEPAGE)
+  if ((placement & MEMORY_PLACEMENT_HUGE_PAGES) &&
+      madvise(reinterpret_cast<void*>(begin), end - begin, MADV_HUGEPAGE) !=
+          0) {
+    DPLOG(WARNING) << "madvise";
+  }
+#endif
+
+  if (placement & MEMORY_PLACEMENT_NUMA_LOCAL) {
+    unsigned cpu;
+    unsigned node;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0)
+      PreferNode(begin, end, node);
+  }
+#endif
+}
+
+}  // namespace edk
+}  // namespace mojo
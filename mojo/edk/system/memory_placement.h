@@ -0,0 +1,36 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_SYSTEM_MEMORY_PLACEMENT_H_
+#define MOJO_EDK_SYSTEM_MEMORY_PLACEMENT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace mojo {
+namespace edk {
+
+// Hints for where the kernel should place the pages backing a buffer. They
+// are only honored on Linux and Android, and even there are best effort.
+enum MemoryPlacement : uint32_t {
+  MEMORY_PLACEMENT_DEFAULT = 0,
+
+  // Back the buffer with transparent huge pages where possible, which cuts TLB
+  // misses when large buffers are accessed all over.
+  MEMORY_PLACEMENT_HUGE_PAGES = 1 << 0,
+
+  // Prefer the NUMA node of the CPU the calling thread is running on for pages
+  // which haven't been faulted in yet.
+  MEMORY_PLACEMENT_NUMA_LOCAL = 1 << 1,
+};
+
+// Applies |placement| to the whole pages within |num_bytes| from |address|.
+// Must be called before the memory is first touched to have any effect on
+// pages which are already resident.
+void ApplyMemoryPlacement(void* address, size_t num_bytes, uint32_t placement);
+
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_SYSTEM_MEMORY_PLACEMENT_H_
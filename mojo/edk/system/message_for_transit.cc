@@ -0,0 +1,368 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/message_for_transit.h"
+
+#include <string.h>
+
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "base/containers/stack_container.h"
+#include "base/logging.h"
+#include "mojo/edk/embedder/embedder_internal.h"
+#include "mojo/edk/system/core.h"
+#include "mojo/edk/system/node_controller.h"
+#include "mojo/edk/system/shared_buffer_dispatcher.h"
+
+namespace mojo {
+namespace edk {
+
+namespace {
+
+size_t g_shared_bytes_threshold = 0;
+
+// Whether |dispatcher| can go in a message to this node as it is. Dispatchers
+// carrying ports can't, since the ports must be sent with the message for the
+// node to route them.
+bool CanAttachLocalDispatcher(const Dispatcher& dispatcher) {
+  switch (dispatcher.GetType()) {
+    case Dispatcher::Type::SHARED_BUFFER:
+    case Dispatcher::Type::PLATFORM_HANDLE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+}  // namespace
+
+MessageForTransit::MessageForTransit(scoped_ptr<PortsMessage> message)
+    : MessageForTransit(std::move(message), nullptr) {}
+
+MessageForTransit::MessageForTransit(
+    scoped_ptr<PortsMessage> message,
+    scoped_ptr<PlatformSharedBufferMapping> shared_bytes)
+    : message_(std::move(message)), shared_bytes_(std::move(shared_bytes)) {
+  DCHECK_GE(message_->num_payload_bytes(), sizeof(MessageHeader));
+  DCHECK_LE(header()->header_size, message_->num_payload_bytes());
+  DCHECK_EQ(!!header()->num_shared_bytes, !!shared_bytes_);
+}
+
+MessageForTransit::~MessageForTransit() {
+  if (deferred_node_controller_ && message_)
+    DiscardDispatchers(deferred_node_controller_, message_.get());
+}
+
+// static
+void MessageForTransit::SetSharedBytesThreshold(size_t num_bytes) {
+  g_shared_bytes_threshold = num_bytes;
+}
+
+// static
+bool MessageForTransit::ShouldShareBytes(uint32_t num_bytes) {
+  return g_shared_bytes_threshold && num_bytes >= g_shared_bytes_threshold;
+}
+
+// static
+scoped_ptr<MessageForTransit> MessageForTransit::Create(
+    NodeController* node_controller,
+    const Dispatcher::DispatcherInTransit* dispatchers,
+    uint32_t num_dispatchers,
+    uint32_t num_bytes,
+    Destination destination) {
+  struct DispatcherInfo {
+    uint32_t num_bytes;
+    uint32_t num_ports;
+    uint32_t num_handles;
+    bool is_local;
+  };
+
+  // If the contents go in a shared buffer, it's serialized after the other
+  // dispatchers. Failing to create it just means they're sent inline.
+  scoped_refptr<Dispatcher> shared_buffer;
+  scoped_ptr<PlatformSharedBufferMapping> shared_bytes;
+  if (destination == Destination::kRemoteNode && ShouldShareBytes(num_bytes)) {
+    scoped_refptr<SharedBufferDispatcher> buffer;
+    if (SharedBufferDispatcher::Create(
+            internal::g_platform_support,
+            SharedBufferDispatcher::kDefaultCreateOptions, num_bytes,
+            &buffer) == MOJO_RESULT_OK &&
+        buffer->MapBuffer(0, num_bytes, MOJO_MAP_BUFFER_FLAG_NONE,
+                          &shared_bytes) == MOJO_RESULT_OK) {
+      shared_buffer = buffer;
+    } else {
+      shared_bytes.reset();
+    }
+  }
+  const uint32_t num_serialized = num_dispatchers + (shared_buffer ? 1 : 0);
+  auto get_dispatcher = [dispatchers, num_dispatchers, &shared_buffer](
+      size_t i) {
+    return i < num_dispatchers ? dispatchers[i].dispatcher.get()
+                               : shared_buffer.get();
+  };
+
+  size_t header_size = sizeof(MessageHeader) +
+      num_serialized * sizeof(DispatcherHeader);
+  size_t num_ports = 0;
+  size_t num_handles = 0;
+  bool has_local_dispatchers = false;
+
+  base::StackVector<DispatcherInfo, kMaxInlineDispatchers> dispatcher_info;
+  dispatcher_info->resize(num_serialized);
+  for (size_t i = 0; i < num_serialized; ++i) {
+    Dispatcher* d = get_dispatcher(i);
+    DispatcherInfo& info = dispatcher_info[i];
+    info.is_local = destination == Destination::kLocalNode &&
+                    CanAttachLocalDispatcher(*d);
+    if (info.is_local) {
+      // Its header is written with no bytes, ports or handles.
+      info.num_bytes = 0;
+      info.num_ports = 0;
+      info.num_handles = 0;
+      has_local_dispatchers = true;
+      continue;
+    }
+    d->StartSerialize(&info.num_bytes, &info.num_ports, &info.num_handles);
+    header_size += info.num_bytes;
+    num_ports += info.num_ports;
+    num_handles += info.num_handles;
+  }
+
+  const uint32_t num_inline_bytes = shared_buffer ? 0 : num_bytes;
+  scoped_ptr<PortsMessage> message =
+      node_controller->AllocMessage(header_size + num_inline_bytes, num_ports);
+  DCHECK(message);
+
+  // Populate the message header with information about serialized dispatchers.
+
+  MessageHeader* header =
+      static_cast<MessageHeader*>(message->mutable_payload_bytes());
+  DispatcherHeader* dispatcher_headers =
+      reinterpret_cast<DispatcherHeader*>(reinterpret_cast<char*>(header) +
+                                          sizeof(MessageHeader));
+  void* dispatcher_data = &dispatcher_headers[num_serialized];
+
+  header->num_dispatchers = num_dispatchers;
+
+  DCHECK_LE(header_size, std::numeric_limits<uint32_t>::max());
+  header->header_size = static_cast<uint32_t>(header_size);
+  header->num_shared_bytes = shared_buffer ? num_bytes : 0;
+  header->padding = 0;
+
+  if (num_serialized > 0) {
+    // Dispatchers without platform handles never touch |handles|, so it's
+    // only allocated for messages which will carry some.
+    ScopedPlatformHandleVectorPtr handles;
+    if (num_handles > 0) {
+      handles.reset(new PlatformHandleVector);
+      handles->reserve(num_handles);
+    }
+    std::vector<scoped_refptr<Dispatcher>> local_dispatchers;
+    if (has_local_dispatchers)
+      local_dispatchers.resize(num_dispatchers);
+    size_t port_index = 0;
+    for (size_t i = 0; i < num_serialized; ++i) {
+      Dispatcher* d = get_dispatcher(i);
+
+      DispatcherHeader* dh = &dispatcher_headers[i];
+      dh->type = static_cast<int32_t>(d->GetType());
+      dh->num_bytes = dispatcher_info[i].num_bytes;
+      dh->num_ports = dispatcher_info[i].num_ports;
+      dh->num_platform_handles = dispatcher_info[i].num_handles;
+
+      if (dispatcher_info[i].is_local) {
+        local_dispatchers[i] = d;
+        continue;
+      }
+
+      // Ports are written straight into the message.
+      if (!d->EndSerializeAndClose(dispatcher_data,
+                                   message->mutable_ports() + port_index,
+                                   handles.get())) {
+        // TODO: fail in a more useful manner?
+        LOG(ERROR) << "Failed to serialize dispatcher.";
+      }
+      port_index += dh->num_ports;
+
+      dispatcher_data = static_cast<void*>(
+          static_cast<char*>(dispatcher_data) + dh->num_bytes);
+    }
+
+    message->SetHandles(std::move(handles));
+    if (has_local_dispatchers)
+      message->SetLocalDispatchers(std::move(local_dispatchers));
+  }
+
+  return make_scoped_ptr(
+      new MessageForTransit(std::move(message), std::move(shared_bytes)));
+}
+
+// static
+void MessageForTransit::SerializeLocalDispatchers(PortsMessage* message) {
+  std::vector<scoped_refptr<Dispatcher>> local_dispatchers =
+      message->TakeLocalDispatchers();
+
+  // The payload is rebuilt from a copy of its old contents, with the local
+  // dispatchers' data inserted.
+  const char* old_payload =
+      static_cast<const char*>(message->payload_bytes());
+  std::vector<char> old_payload_copy(
+      old_payload, old_payload + message->num_payload_bytes());
+  const MessageHeader* old_header =
+      reinterpret_cast<const MessageHeader*>(old_payload_copy.data());
+  const DispatcherHeader* old_dispatcher_headers =
+      reinterpret_cast<const DispatcherHeader*>(old_header + 1);
+  const size_t num_serialized =
+      old_header->num_dispatchers + (old_header->num_shared_bytes ? 1 : 0);
+  DCHECK_EQ(local_dispatchers.size(), old_header->num_dispatchers);
+
+  base::StackVector<DispatcherHeader, kMaxInlineDispatchers>
+      dispatcher_headers;
+  dispatcher_headers->assign(old_dispatcher_headers,
+                             old_dispatcher_headers + num_serialized);
+  size_t header_size = old_header->header_size;
+  for (size_t i = 0; i < local_dispatchers.size(); ++i) {
+    if (!local_dispatchers[i])
+      continue;
+    DispatcherHeader& dh = dispatcher_headers[i];
+    local_dispatchers[i]->StartSerialize(&dh.num_bytes, &dh.num_ports,
+                                         &dh.num_platform_handles);
+    DCHECK_EQ(0u, dh.num_ports);
+    header_size += dh.num_bytes;
+  }
+  const size_t num_inline_bytes =
+      old_payload_copy.size() - old_header->header_size;
+
+  MessageHeader* header = static_cast<MessageHeader*>(
+      message->ReplaceLocalPayload(header_size + num_inline_bytes));
+  *header = *old_header;
+  DCHECK_LE(header_size, std::numeric_limits<uint32_t>::max());
+  header->header_size = static_cast<uint32_t>(header_size);
+  memcpy(header + 1, dispatcher_headers->data(),
+         num_serialized * sizeof(DispatcherHeader));
+
+  // Handles of the dispatchers which were already serialized move to the new
+  // vector, in order. Their old slots are left invalid.
+  ScopedPlatformHandleVectorPtr handles(new PlatformHandleVector);
+  PlatformHandle* old_handles = message->handles();
+  size_t old_handle_index = 0;
+  const char* old_data = reinterpret_cast<const char*>(
+      old_dispatcher_headers + num_serialized);
+  char* data = reinterpret_cast<char*>(header + 1) +
+               num_serialized * sizeof(DispatcherHeader);
+  for (size_t i = 0; i < num_serialized; ++i) {
+    const DispatcherHeader& dh = dispatcher_headers[i];
+    if (i < local_dispatchers.size() && local_dispatchers[i]) {
+      if (!local_dispatchers[i]->EndSerializeAndClose(data, nullptr,
+                                                      handles.get())) {
+        LOG(ERROR) << "Failed to serialize dispatcher.";
+      }
+    } else {
+      memcpy(data, old_data, dh.num_bytes);
+      old_data += dh.num_bytes;
+      for (size_t j = 0; j < dh.num_platform_handles; ++j) {
+        DCHECK_LT(old_handle_index, message->num_handles());
+        handles->push_back(PlatformHandle());
+        std::swap(handles->back(), old_handles[old_handle_index++]);
+      }
+    }
+    data += dh.num_bytes;
+  }
+  DCHECK_EQ(old_handle_index, message->num_handles());
+  memcpy(data, old_data, num_inline_bytes);
+
+  message->SetHandles(std::move(handles));
+}
+
+// static
+void MessageForTransit::DiscardDispatchers(NodeController* node_controller,
+                                           PortsMessage* message) {
+  if (message->num_ports() == 0)
+    return;
+
+  NodeController::ScopedPortClosureBatch batch(node_controller);
+  for (size_t i = 0; i < message->num_ports(); ++i) {
+    ports::PortRef port;
+    if (node_controller->node()->GetPort(message->ports()[i], &port) ==
+        ports::OK) {
+      node_controller->ClosePort(port);
+    }
+  }
+}
+
+MojoResult MessageForTransit::DeserializeDispatchers(
+    NodeController* node_controller,
+    MojoHandle* handles) {
+  deferred_node_controller_ = nullptr;
+
+  const MessageHeader* header = this->header();
+  if (header->num_dispatchers == 0)
+    return MOJO_RESULT_OK;
+
+  CHECK(handles);
+  const DispatcherHeader* dispatcher_headers =
+      reinterpret_cast<const DispatcherHeader*>(header + 1);
+  const size_t num_serialized =
+      header->num_dispatchers + (header->num_shared_bytes ? 1 : 0);
+  const void* dispatcher_data = &dispatcher_headers[num_serialized];
+
+  // Dispatchers attached as they are by a writer on this node.
+  const std::vector<scoped_refptr<Dispatcher>>& local_dispatchers =
+      message_->local_dispatchers();
+  DCHECK(local_dispatchers.empty() ||
+         local_dispatchers.size() == header->num_dispatchers);
+
+  base::StackVector<Dispatcher::DispatcherInTransit, kMaxInlineDispatchers>
+      dispatchers;
+  dispatchers->resize(header->num_dispatchers);
+  size_t port_index = 0;
+  size_t platform_handle_index = 0;
+  for (size_t i = 0; i < header->num_dispatchers; ++i) {
+    const DispatcherHeader& dh = dispatcher_headers[i];
+    Dispatcher::Type type = static_cast<Dispatcher::Type>(dh.type);
+
+    DCHECK_GE(message_->num_ports(), port_index + dh.num_ports);
+    DCHECK_GE(message_->num_handles(),
+              platform_handle_index + dh.num_platform_handles);
+
+    if (!local_dispatchers.empty() && local_dispatchers[i]) {
+      dispatchers[i].dispatcher = local_dispatchers[i];
+      continue;
+    }
+
+    PlatformHandle* out_handles =
+        message_->num_handles() ? message_->handles() + platform_handle_index
+                                : nullptr;
+    dispatchers[i].dispatcher = Dispatcher::Deserialize(
+        type, dispatcher_data, dh.num_bytes, message_->ports() + port_index,
+        dh.num_ports, out_handles, dh.num_platform_handles);
+    if (!dispatchers[i].dispatcher)
+      return MOJO_RESULT_UNKNOWN;
+
+    dispatcher_data = static_cast<const char*>(dispatcher_data) + dh.num_bytes;
+    port_index += dh.num_ports;
+    platform_handle_index += dh.num_platform_handles;
+  }
+
+  // Either way the local dispatchers are no longer the message's to close.
+  bool added = node_controller->core()->AddDispatchersFromTransit(
+      dispatchers->data(), dispatchers->size(), handles);
+  message_->TakeLocalDispatchers();
+  if (!added)
+    return MOJO_RESULT_UNKNOWN;
+  return MOJO_RESULT_OK;
+}
+
+void MessageForTransit::CopySharedBytes() {
+  if (!shared_bytes_)
+    return;
+  private_bytes_.reset(new char[num_bytes()]);
+  memcpy(private_bytes_.get(), shared_bytes_->GetBase(), num_bytes());
+  shared_bytes_.reset();
+}
+
+}  // namespace edk
+}  // namespace mojo
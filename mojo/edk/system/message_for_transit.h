@@ -0,0 +1,189 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_SYSTEM_MESSAGE_FOR_TRANSIT_H_
+#define MOJO_EDK_SYSTEM_MESSAGE_FOR_TRANSIT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <utility>
+
+#include "base/macros.h"
+#include "base/memory/scoped_ptr.h"
+#include "mojo/edk/embedder/platform_shared_buffer.h"
+#include "mojo/edk/system/dispatcher.h"
+#include "mojo/edk/system/ports_message.h"
+#include "mojo/public/c/system/macros.h"
+
+namespace mojo {
+namespace edk {
+
+class NodeController;
+
+// A message pipe message which is handed to or from the caller as an opaque
+// object rather than copied. Its contents live in the underlying PortsMessage,
+// directly after the headers describing any attached dispatchers, so a message
+// read this way gives the caller the received bytes without a copy, and one
+// allocated up front can be filled in by the caller and sent as is.
+class MessageForTransit {
+ public:
+  // Header attached to every message sent over a message pipe.
+  struct MOJO_ALIGNAS(8) MessageHeader {
+    // The number of serialized dispatchers included in this header.
+    uint32_t num_dispatchers;
+
+    // Total size of the header, including serialized dispatcher data.
+    uint32_t header_size;
+
+    // If non-zero, the message's contents are this many bytes in a shared
+    // buffer rather than following the header. The buffer is serialized after
+    // the message's dispatchers, but isn't counted in |num_dispatchers|.
+    uint32_t num_shared_bytes;
+    uint32_t padding;
+  };
+
+  // Header for each dispatcher, immediately following the message header.
+  struct MOJO_ALIGNAS(8) DispatcherHeader {
+    // The type of the dispatcher, correpsonding to the Dispatcher::Type enum.
+    int32_t type;
+
+    // The size of the serialized dispatcher, not including this header.
+    uint32_t num_bytes;
+
+    // The number of ports needed to deserialize this dispatcher.
+    uint32_t num_ports;
+
+    // The number of platform handles needed to deserialize this dispatcher.
+    uint32_t num_platform_handles;
+  };
+
+  // Serializing or deserializing up to this many dispatchers needs no heap
+  // storage beyond the message itself.
+  static const size_t kMaxInlineDispatchers = 16;
+
+  // Where a message is known to be going when it's created.
+  enum class Destination {
+    // E.g. a message allocated before the pipe it's written to is known.
+    kUnknown,
+
+    // A port on this node. Dispatchers which don't carry ports are attached to
+    // the message as they are, rather than serialized. See
+    // PortsMessage::SetLocalDispatchers.
+    kLocalNode,
+
+    // A port on another node. The contents may be put in a shared buffer.
+    kRemoteNode,
+  };
+
+  // |message| must begin with a valid MessageHeader. If its contents are in a
+  // shared buffer, |shared_bytes| must map them.
+  explicit MessageForTransit(scoped_ptr<PortsMessage> message);
+  MessageForTransit(scoped_ptr<PortsMessage> message,
+                    scoped_ptr<PlatformSharedBufferMapping> shared_bytes);
+  ~MessageForTransit();
+
+  // Sets the size from which the contents of messages created for a
+  // Destination::kRemoteNode are put in a shared buffer. The reader then maps
+  // the buffer instead of the contents being copied through the channel. 0,
+  // the default, disables this.
+  static void SetSharedBytesThreshold(size_t num_bytes);
+
+  // Whether a message with |num_bytes| of contents would be given a shared
+  // buffer if created for a Destination::kRemoteNode.
+  static bool ShouldShareBytes(uint32_t num_bytes);
+
+  // Allocates a message with room for |num_bytes| of contents, serializing
+  // and closing |dispatchers| into it, or for a Destination::kLocalNode
+  // attaching those it can. The dispatchers must be in transit.
+  static scoped_ptr<MessageForTransit> Create(
+      NodeController* node_controller,
+      const Dispatcher::DispatcherInTransit* dispatchers,
+      uint32_t num_dispatchers,
+      uint32_t num_bytes,
+      Destination destination);
+
+  // Serializes and closes the dispatchers attached as they are to |message|,
+  // a user message in local storage, rewriting its payload to include them.
+  // Called before such a message leaves this node.
+  static void SerializeLocalDispatchers(PortsMessage* message);
+
+  // Closes the ports carried by the dispatchers serialized in |message|, a
+  // received user message which is being discarded without them having been
+  // deserialized.
+  static void DiscardDispatchers(NodeController* node_controller,
+                                 PortsMessage* message);
+
+  // Deserializes the dispatchers of a received message and adds them to the
+  // handle table in one go, filling in |handles|, which must have room for
+  // num_dispatchers() of them.
+  MojoResult DeserializeDispatchers(NodeController* node_controller,
+                                    MojoHandle* handles);
+
+  // Leaves the dispatchers of a received message serialized until
+  // DeserializeDispatchers() is called. If the message is freed first, they
+  // are discarded without ever being created.
+  void DeferDispatchers(NodeController* node_controller) {
+    deferred_node_controller_ = node_controller;
+  }
+  bool has_deferred_dispatchers() const { return !!deferred_node_controller_; }
+
+  // Replaces the mapping of contents in a shared buffer with a private copy.
+  // The process which wrote them still has the buffer mapped, so they must be
+  // copied before anything which may check them and then rely on them not
+  // changing gets to see them.
+  void CopySharedBytes();
+
+  const void* bytes() const {
+    if (private_bytes_)
+      return private_bytes_.get();
+    if (shared_bytes_)
+      return shared_bytes_->GetBase();
+    return static_cast<const char*>(message_->payload_bytes()) +
+           header()->header_size;
+  }
+  void* mutable_bytes() {
+    if (private_bytes_)
+      return private_bytes_.get();
+    if (shared_bytes_)
+      return shared_bytes_->GetBase();
+    return static_cast<char*>(message_->mutable_payload_bytes()) +
+           header()->header_size;
+  }
+  uint32_t num_bytes() const {
+    if (header()->num_shared_bytes)
+      return header()->num_shared_bytes;
+    return static_cast<uint32_t>(message_->num_payload_bytes()) -
+           header()->header_size;
+  }
+
+  uint32_t num_dispatchers() const { return header()->num_dispatchers; }
+
+  const PortsMessage& ports_message() const { return *message_; }
+
+  scoped_ptr<PortsMessage> TakePortsMessage() { return std::move(message_); }
+
+ private:
+  const MessageHeader* header() const {
+    return static_cast<const MessageHeader*>(message_->payload_bytes());
+  }
+
+  scoped_ptr<PortsMessage> message_;
+
+  // Maps the contents, if they're in a shared buffer.
+  scoped_ptr<PlatformSharedBufferMapping> shared_bytes_;
+
+  // The contents copied out of |shared_bytes_|. See CopySharedBytes().
+  scoped_ptr<char[]> private_bytes_;
+
+  // Set while the dispatchers are deferred. See DeferDispatchers().
+  NodeController* deferred_node_controller_ = nullptr;
+
+  DISALLOW_COPY_AND_ASSIGN(MessageForTransit);
+};
+
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_SYSTEM_MESSAGE_FOR_TRANSIT_H_
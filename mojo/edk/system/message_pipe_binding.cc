@@ -0,0 +1,90 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/message_pipe_binding.h"
+
+#include <utility>
+
+#include "base/logging.h"
+#include "mojo/edk/system/message_for_transit.h"
+
+namespace mojo {
+namespace edk {
+
+MessagePipeBinding::MessagePipeBinding(scoped_refptr<Dispatcher> dispatcher,
+                                       uint32_t max_batch_size,
+                                       const MessageBatchHandler& handler)
+    : dispatcher_(dispatcher),
+      max_batch_size_(max_batch_size),
+      handler_(handler) {
+  DCHECK_GT(max_batch_size_, 0u);
+}
+
+void MessagePipeBinding::OnReadable(MojoResult result) {
+  DCHECK(messages_.empty());
+  if (result != MOJO_RESULT_OK) {
+    // The waiter is done: either the peer is closed and there's nothing left
+    // to read, or the handle was closed.
+    handler_.Run(result, &messages_);
+    messages_.clear();
+    return;
+  }
+
+  while (messages_.size() < max_batch_size_) {
+    ReceivedMessage message;
+    if (ReadMessage(dispatcher_.get(), &message) != MOJO_RESULT_OK)
+      break;
+    messages_.push_back(std::move(message));
+  }
+
+  // Failures to read are left to the waiter, which finds out when it watches
+  // the pipe again.
+  if (!messages_.empty())
+    handler_.Run(MOJO_RESULT_OK, &messages_);
+  messages_.clear();
+}
+
+MessagePipeBinding::~MessagePipeBinding() {}
+
+// static
+MojoResult MessagePipeBinding::ReadMessage(Dispatcher* dispatcher,
+                                           ReceivedMessage* message) {
+  // Most messages carry few handles, if any, so they're read onto the stack
+  // first and only go to the heap if there are more.
+  MojoHandle handles[MessageForTransit::kMaxInlineDispatchers];
+  uint32_t num_handles = arraysize(handles);
+  MojoResult rv = dispatcher->ReadMessageNew(&message->message_, nullptr,
+                                             handles, &num_handles,
+                                             MOJO_READ_MESSAGE_FLAG_NONE);
+  if (rv == MOJO_RESULT_RESOURCE_EXHAUSTED) {
+    message->handles_.resize(num_handles);
+    return dispatcher->ReadMessageNew(&message->message_, nullptr,
+                                      message->handles_.data(), &num_handles,
+                                      MOJO_READ_MESSAGE_FLAG_NONE);
+  }
+  if (rv == MOJO_RESULT_OK && num_handles > 0)
+    message->handles_.assign(handles, handles + num_handles);
+  return rv;
+}
+
+AsyncMessageRead::AsyncMessageRead(scoped_refptr<Dispatcher> dispatcher,
+                                   const ReadMessageCallback& callback)
+    : dispatcher_(dispatcher), callback_(callback) {}
+
+bool AsyncMessageRead::OnReadable(MojoResult result) {
+  ReceivedMessage message;
+  if (result == MOJO_RESULT_OK) {
+    result = MessagePipeBinding::ReadMessage(dispatcher_.get(), &message);
+    // Someone else read the message first.
+    if (result == MOJO_RESULT_SHOULD_WAIT)
+      return true;
+  }
+  callback_.Run(result, &message);
+  return false;
+}
+
+AsyncMessageRead::~AsyncMessageRead() {}
+
+}  // namespace edk
+}  // namespace mojo
@@ -0,0 +1,86 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_SYSTEM_MESSAGE_PIPE_BINDING_H_
+#define MOJO_EDK_SYSTEM_MESSAGE_PIPE_BINDING_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "base/macros.h"
+#include "base/memory/ref_counted.h"
+#include "mojo/edk/embedder/received_message.h"
+#include "mojo/edk/system/dispatcher.h"
+#include "mojo/public/c/system/types.h"
+
+namespace mojo {
+namespace edk {
+
+// Reads batches of messages from a message pipe for Core::BindMessagePipe().
+// The binding is driven by a persistent TaskRunnerWaiter, which only has one
+// call posted at a time and waits for it to return before watching the pipe
+// again, so batches are handled in order even on an executor which runs tasks
+// concurrently.
+class MessagePipeBinding
+    : public base::RefCountedThreadSafe<MessagePipeBinding> {
+ public:
+  MessagePipeBinding(scoped_refptr<Dispatcher> dispatcher,
+                     uint32_t max_batch_size,
+                     const MessageBatchHandler& handler);
+
+  // Called by the waiter with MOJO_RESULT_OK whenever the pipe is readable,
+  // or with its final result. Reads at most |max_batch_size| messages per
+  // call; the waiter posts another call right away if any are left, which
+  // lets other tasks on the executor run in between.
+  void OnReadable(MojoResult result);
+
+  // Reads the next message from |dispatcher|, with results as for
+  // ReadMessageNew.
+  static MojoResult ReadMessage(Dispatcher* dispatcher,
+                                ReceivedMessage* message);
+
+ private:
+  friend class base::RefCountedThreadSafe<MessagePipeBinding>;
+
+  ~MessagePipeBinding();
+
+  const scoped_refptr<Dispatcher> dispatcher_;
+  const uint32_t max_batch_size_;
+  const MessageBatchHandler handler_;
+
+  // Reused for each batch. Only touched by OnReadable(), which never runs
+  // concurrently with itself.
+  std::vector<ReceivedMessage> messages_;
+
+  DISALLOW_COPY_AND_ASSIGN(MessagePipeBinding);
+};
+
+// Reads a single message from a message pipe for Core::ReadMessageAsync(). It's
+// driven by a persistent TaskRunnerWaiter which stops once a message has been
+// read, so a read which loses a race for the message just waits again.
+class AsyncMessageRead : public base::RefCountedThreadSafe<AsyncMessageRead> {
+ public:
+  AsyncMessageRead(scoped_refptr<Dispatcher> dispatcher,
+                   const ReadMessageCallback& callback);
+
+  // Called by the waiter whenever the pipe is readable, or with its final
+  // result. Returns whether to go on waiting.
+  bool OnReadable(MojoResult result);
+
+ private:
+  friend class base::RefCountedThreadSafe<AsyncMessageRead>;
+
+  ~AsyncMessageRead();
+
+  const scoped_refptr<Dispatcher> dispatcher_;
+  const ReadMessageCallback callback_;
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncMessageRead);
+};
+
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_SYSTEM_MESSAGE_PIPE_BINDING_H_
@@ -4,47 +4,201 @@
 
 #include "mojo/edk/system/message_pipe_dispatcher.h"
 
-#include <limits>
+#include <utility>
+#include <vector>
 
 #include "base/macros.h"
 #include "base/memory/scoped_ptr.h"
 #include "mojo/edk/embedder/embedder_internal.h"
 #include "mojo/edk/system/core.h"
+#include "mojo/edk/system/message_for_transit.h"
+#include "mojo/edk/system/message_tracer.h"
+#include "mojo/edk/system/metrics_registry.h"
 #include "mojo/edk/system/node_controller.h"
+#include "mojo/edk/system/options_validation.h"
 #include "mojo/edk/system/ports_message.h"
-#include "mojo/public/c/system/macros.h"
 
 namespace mojo {
 namespace edk {
 
 namespace {
 
-// Header attached to every message sent over a message pipe.
-struct MOJO_ALIGNAS(8) MessageHeader {
-  // The number of serialized dispatchers included in this header.
-  uint32_t num_dispatchers;
+using MessageHeader = MessageForTransit::MessageHeader;
+using DispatcherHeader = MessageForTransit::DispatcherHeader;
 
-  // Total size of the header, including serialized dispatcher data.
-  uint32_t header_size;
-};
+// Returns the number of bytes and handles a reader needs in order to take
+// |ports_message|.
+void GetMessageSize(const ports::Message& ports_message,
+                    uint32_t* num_bytes,
+                    uint32_t* num_handles) {
+  const PortsMessage& message = static_cast<const PortsMessage&>(ports_message);
+  DCHECK_GE(message.num_payload_bytes(), sizeof(MessageHeader));
+  const MessageHeader* header =
+      static_cast<const MessageHeader*>(message.payload_bytes());
+  DCHECK_LE(header->header_size, message.num_payload_bytes());
+  DCHECK_EQ(header->num_dispatchers + (header->num_shared_bytes ? 1 : 0),
+            message.num_ports() + message.num_handles());
+
+  if (header->num_shared_bytes) {
+    *num_bytes = header->num_shared_bytes;
+  } else {
+    *num_bytes = static_cast<uint32_t>(message.num_payload_bytes()) -
+                 header->header_size;
+  }
+  *num_handles = header->num_dispatchers;
+}
+
+// The filter GetNextMessage() reads through. It takes the next message only if
+// it fits in the caller's buffers, or may be discarded if it doesn't, and
+// reports the message's size either way. With |defer_handles| the handles need
+// not fit, since they aren't read yet.
+struct FitsFilter {
+  uint32_t* num_bytes;
+  uint32_t* num_handles;
+  bool read_any_size;
+  bool defer_handles;
+  bool may_discard;
+  bool no_space;
+
+  static bool Select(const ports::Message& next_message, void* context) {
+    FitsFilter* filter = static_cast<FitsFilter*>(context);
+
+    uint32_t bytes_available;
+    uint32_t handles_available;
+    GetMessageSize(next_message, &bytes_available, &handles_available);
+
+    uint32_t bytes_to_read = 0;
+    if (filter->read_any_size) {
+      bytes_to_read = bytes_available;
+      if (filter->num_bytes)
+        *filter->num_bytes = bytes_available;
+    } else if (filter->num_bytes) {
+      bytes_to_read = std::min(*filter->num_bytes, bytes_available);
+      *filter->num_bytes = bytes_available;
+    }
+
+    uint32_t handles_to_read = 0;
+    if (filter->defer_handles) {
+      handles_to_read = handles_available;
+      if (filter->num_handles)
+        *filter->num_handles = handles_available;
+    } else if (filter->num_handles) {
+      handles_to_read = std::min(*filter->num_handles, handles_available);
+      *filter->num_handles = handles_available;
+    }
 
-// Header for each dispatcher, immediately following the message header.
-struct MOJO_ALIGNAS(8) DispatcherHeader {
-  // The type of the dispatcher, correpsonding to the Dispatcher::Type enum.
-  int32_t type;
+    if (bytes_to_read < bytes_available ||
+        handles_to_read < handles_available) {
+      filter->no_space = true;
+      return filter->may_discard;
+    }
 
-  // The size of the serialized dispatcher, not including this header.
-  uint32_t num_bytes;
+    return true;
+  }
+};
 
-  // The number of ports needed to deserialize this dispatcher.
-  uint32_t num_ports;
+// The filter ReadMessages() reads through. It takes messages for as long as
+// they fit in what is left of the caller's buffers, recording each one's size.
+struct BatchFitsFilter {
+  uint32_t* message_num_bytes;
+  uint32_t* message_num_handles;
+  bool may_discard;
+  bool no_space;
+  uint32_t num_selected;
+  uint32_t bytes_left;
+  uint32_t handles_left;
+
+  static bool Select(const ports::Message& next_message, void* context) {
+    BatchFitsFilter* filter = static_cast<BatchFitsFilter*>(context);
+    if (filter->no_space)
+      return false;
+
+    uint32_t bytes_available;
+    uint32_t handles_available;
+    GetMessageSize(next_message, &bytes_available, &handles_available);
+    if (bytes_available > filter->bytes_left ||
+        handles_available > filter->handles_left) {
+      if (filter->num_selected > 0)
+        return false;
+      // Report what the first message needs.
+      filter->message_num_bytes[0] = bytes_available;
+      filter->message_num_handles[0] = handles_available;
+      filter->no_space = true;
+      return filter->may_discard;
+    }
 
-  // The number of platform handles needed to deserialize this dispatcher.
-  uint32_t num_platform_handles;
+    filter->message_num_bytes[filter->num_selected] = bytes_available;
+    filter->message_num_handles[filter->num_selected] = handles_available;
+    filter->bytes_left -= bytes_available;
+    filter->handles_left -= handles_available;
+    ++filter->num_selected;
+    return true;
+  }
 };
 
+// If we aren't connected yet, treat the pipe like it's in a normal state with
+// no messages available.
+HandleSignalsState GetUnconnectedSignalsState() {
+  HandleSignalsState rv;
+  rv.satisfiable_signals = MOJO_HANDLE_SIGNAL_READABLE |
+      MOJO_HANDLE_SIGNAL_WRITABLE | MOJO_HANDLE_SIGNAL_PEER_CLOSED;
+  rv.satisfied_signals = MOJO_HANDLE_SIGNAL_WRITABLE;
+  return rv;
+}
+
+HandleSignalsState GetSignalsStateForPortStatus(
+    const ports::PortStatus& port_status) {
+  HandleSignalsState rv;
+  if (port_status.has_messages) {
+    rv.satisfied_signals |= MOJO_HANDLE_SIGNAL_READABLE;
+    rv.satisfiable_signals |= MOJO_HANDLE_SIGNAL_READABLE;
+  }
+  if (!port_status.peer_closed) {
+    // While the peer is over its quota, writers can wait for the pipe to
+    // become writable again before sending any more.
+    if (port_status.peer_over_quota) {
+      rv.satisfied_signals |= MOJO_HANDLE_SIGNAL_PEER_OVER_QUOTA;
+      rv.satisfiable_signals |= MOJO_HANDLE_SIGNAL_PEER_OVER_QUOTA;
+    } else {
+      rv.satisfied_signals |= MOJO_HANDLE_SIGNAL_WRITABLE;
+    }
+    rv.satisfiable_signals |= MOJO_HANDLE_SIGNAL_WRITABLE;
+    rv.satisfiable_signals |= MOJO_HANDLE_SIGNAL_READABLE;
+  } else {
+    rv.satisfied_signals |= MOJO_HANDLE_SIGNAL_PEER_CLOSED;
+  }
+  rv.satisfiable_signals |= MOJO_HANDLE_SIGNAL_PEER_CLOSED;
+  return rv;
+}
+
 }  // namespace
 
+// static
+MojoResult MessagePipeDispatcher::ValidateCreateOptions(
+    const MojoCreateMessagePipeOptions* in_options,
+    MojoCreateMessagePipeOptions* out_options) {
+  const MojoCreateMessagePipeOptionsFlags kKnownFlags =
+      MOJO_CREATE_MESSAGE_PIPE_OPTIONS_FLAG_TRANSFERABLE;
+
+  out_options->struct_size =
+      static_cast<uint32_t>(sizeof(MojoCreateMessagePipeOptions));
+  out_options->flags = MOJO_CREATE_MESSAGE_PIPE_OPTIONS_FLAG_NONE;
+  if (!in_options)
+    return MOJO_RESULT_OK;
+
+  UserOptionsReader<MojoCreateMessagePipeOptions> reader(in_options);
+  if (!reader.is_valid())
+    return MOJO_RESULT_INVALID_ARGUMENT;
+
+  if (!OPTIONS_STRUCT_HAS_MEMBER(MojoCreateMessagePipeOptions, flags, reader))
+    return MOJO_RESULT_OK;
+  if ((reader.options().flags & ~kKnownFlags))
+    return MOJO_RESULT_UNIMPLEMENTED;
+  out_options->flags = reader.options().flags;
+
+  return MOJO_RESULT_OK;
+}
+
 // A PortObserver which forwards to a MessagePipeDispatcher. This owns a
 // reference to the MPD to ensure it lives as long as the observed port.
 class MessagePipeDispatcher::PortObserverThunk
@@ -68,13 +222,14 @@ MessagePipeDispatcher::MessagePipeDispatcher(NodeController* node_controller,
                                              bool connected)
     : node_controller_(node_controller),
       port_(port),
+      signal_lock_("MessagePipeDispatcher::signal_lock_"),
       port_connected_(connected) {
   DVLOG(2) << "Creating new MessagePipeDispatcher for port " << port.name()
            << " [connected=" << connected << "]";
 
   // OnPortStatusChanged (via PortObserverThunk) may be called before this
   // constructor returns. Hold a lock here to prevent signal races.
-  base::AutoLock lock(signal_lock_);
+  ProfiledCompactAutoLock lock(signal_lock_);
   node_controller_->SetPortObserver(port_,
                                     std::make_shared<PortObserverThunk>(this));
 }
@@ -84,7 +239,7 @@ Dispatcher::Type MessagePipeDispatcher::GetType() const {
 }
 
 MojoResult MessagePipeDispatcher::Close() {
-  base::AutoLock lock(signal_lock_);
+  ProfiledCompactAutoLock lock(signal_lock_);
   return CloseNoLock();
 }
 
@@ -95,87 +250,56 @@ MojoResult MessagePipeDispatcher::WriteMessage(
     uint32_t num_dispatchers,
     MojoWriteMessageFlags flags) {
   {
-    base::AutoLock lock(signal_lock_);
+    ProfiledCompactAutoLock lock(signal_lock_);
     if (port_closed_)
       return MOJO_RESULT_INVALID_ARGUMENT;
   }
 
-  struct DispatcherInfo {
-    uint32_t num_bytes;
-    uint32_t num_ports;
-    uint32_t num_handles;
-  };
-
-  size_t header_size = sizeof(MessageHeader) +
-      num_dispatchers * sizeof(DispatcherHeader);
-  size_t num_ports = 0;
-
-  std::vector<DispatcherInfo> dispatcher_info(num_dispatchers);
-  for (size_t i = 0; i < num_dispatchers; ++i) {
-    Dispatcher* d = dispatchers[i].dispatcher.get();
-    d->StartSerialize(&dispatcher_info[i].num_bytes,
-                      &dispatcher_info[i].num_ports,
-                      &dispatcher_info[i].num_handles);
-    header_size += dispatcher_info[i].num_bytes;
-    num_ports += dispatcher_info[i].num_ports;
+  // Large contents are only worth putting in shared memory if they're going
+  // to another process, and dispatchers can only be attached without being
+  // serialized if they're not.
+  MessageForTransit::Destination destination =
+      MessageForTransit::Destination::kUnknown;
+  if (num_dispatchers > 0 || MessageForTransit::ShouldShareBytes(num_bytes)) {
+    ports::PortStatus port_status;
+    if (node_controller_->node()->GetStatus(port_, &port_status) ==
+        ports::OK) {
+      destination = port_status.peer_remote
+                        ? MessageForTransit::Destination::kRemoteNode
+                        : MessageForTransit::Destination::kLocalNode;
+    }
   }
 
-  scoped_ptr<PortsMessage> message =
-      node_controller_->AllocMessage(header_size + num_bytes, num_ports);
-  DCHECK(message);
-
-  // Populate the message header with information about serialized dispatchers.
-
-  MessageHeader* header =
-      static_cast<MessageHeader*>(message->mutable_payload_bytes());
-  DispatcherHeader* dispatcher_headers =
-      reinterpret_cast<DispatcherHeader*>(reinterpret_cast<char*>(header) +
-                                          sizeof(MessageHeader));
-  void* dispatcher_data = &dispatcher_headers[num_dispatchers];
-
-  header->num_dispatchers = num_dispatchers;
-
-  DCHECK_LE(header_size, std::numeric_limits<uint32_t>::max());
-  header->header_size = static_cast<uint32_t>(header_size);
-
-  if (num_dispatchers > 0) {
-    ScopedPlatformHandleVectorPtr handles(new PlatformHandleVector);
-    size_t port_index = 0;
-    for (size_t i = 0; i < num_dispatchers; ++i) {
-      Dispatcher* d = dispatchers[i].dispatcher.get();
-
-      DispatcherHeader* dh = &dispatcher_headers[i];
-      dh->type = static_cast<int32_t>(d->GetType());
-      dh->num_bytes = dispatcher_info[i].num_bytes;
-      dh->num_ports = dispatcher_info[i].num_ports;
-      dh->num_platform_handles = dispatcher_info[i].num_handles;
-
-      std::vector<ports::PortName> ports(dispatcher_info[i].num_ports);
-      if (!d->EndSerializeAndClose(dispatcher_data, ports.data(),
-                                   handles.get())) {
-        // TODO: fail in a more useful manner?
-        LOG(ERROR) << "Failed to serialize dispatcher.";
-      }
-
-      if (!ports.empty()) {
-        std::copy(ports.begin(), ports.end(),
-                  message->mutable_ports() + port_index);
-        port_index += ports.size();
-      }
-
-      dispatcher_data = static_cast<void*>(
-          static_cast<char*>(dispatcher_data) + dh->num_bytes);
-    }
+  scoped_ptr<MessageForTransit> message = MessageForTransit::Create(
+      node_controller_, dispatchers, num_dispatchers, num_bytes, destination);
+
+  // Copy the message body.
+  memcpy(message->mutable_bytes(), bytes, num_bytes);
+
+  return WriteMessageNew(std::move(message), flags);
+}
 
-    message->SetHandles(std::move(handles));
+MojoResult MessagePipeDispatcher::WriteMessageNew(
+    scoped_ptr<MessageForTransit> message,
+    MojoWriteMessageFlags flags) {
+  {
+    ProfiledCompactAutoLock lock(signal_lock_);
+    if (port_closed_)
+      return MOJO_RESULT_INVALID_ARGUMENT;
   }
 
-  // Copy the message body.
-  void* message_body = static_cast<void*>(
-      static_cast<char*>(message->mutable_payload_bytes()) + header_size);
-  memcpy(message_body, bytes, num_bytes);
+  uint32_t num_bytes = message->num_bytes();
+  uint32_t num_dispatchers = message->num_dispatchers();
+  scoped_ptr<PortsMessage> ports_message = message->TakePortsMessage();
+  uint32_t trace_id = MessageTracer::SampleMessage();
+  if (trace_id) {
+    ports::GetMutableEventHeader(ports_message.get())->trace_id = trace_id;
+    MessageTracer::Record(trace_id, MessageTracePoint::kWriteMessage);
+  }
+  if (flags & MOJO_WRITE_MESSAGE_FLAG_BULK)
+    ports_message->MarkBulk();
 
-  int rv = node_controller_->SendMessage(port_, std::move(message));
+  int rv = node_controller_->SendMessage(port_, std::move(ports_message));
 
   if (rv != ports::OK) {
     if (rv == ports::ERROR_PORT_UNKNOWN ||
@@ -184,7 +308,7 @@ MojoResult MessagePipeDispatcher::WriteMessage(
       return MOJO_RESULT_INVALID_ARGUMENT;
 
     if (rv == ports::ERROR_PORT_PEER_CLOSED) {
-      base::AutoLock lock(signal_lock_);
+      ProfiledCompactAutoLock lock(signal_lock_);
       awakables_.AwakeForStateChange(GetHandleSignalsStateNoLock());
       return MOJO_RESULT_FAILED_PRECONDITION;
     }
@@ -193,6 +317,26 @@ MojoResult MessagePipeDispatcher::WriteMessage(
     return MOJO_RESULT_UNKNOWN;
   }
 
+  MetricsRegistry::Increment(MetricsRegistry::kMessagePipeMessagesWritten);
+  MetricsRegistry::Add(MetricsRegistry::kMessagePipeBytesWritten, num_bytes);
+  if (num_dispatchers) {
+    MetricsRegistry::Add(MetricsRegistry::kMessagePipeHandlesWritten,
+                         num_dispatchers);
+  }
+  return MOJO_RESULT_OK;
+}
+
+MojoResult MessagePipeDispatcher::SetQuota(uint64_t max_queued_messages,
+                                           uint64_t max_queued_bytes) {
+  ProfiledCompactAutoLock lock(signal_lock_);
+  if (port_closed_)
+    return MOJO_RESULT_INVALID_ARGUMENT;
+
+  int rv = node_controller_->node()->SetQuota(
+      port_, static_cast<size_t>(max_queued_messages),
+      static_cast<size_t>(max_queued_bytes));
+  if (rv != ports::OK)
+    return MOJO_RESULT_INVALID_ARGUMENT;
   return MOJO_RESULT_OK;
 }
 
@@ -201,8 +345,50 @@ MojoResult MessagePipeDispatcher::ReadMessage(void* bytes,
                                               MojoHandle* handles,
                                               uint32_t* num_handles,
                                               MojoReadMessageFlags flags) {
+  ports::ScopedMessage ports_message;
+  MojoResult result = GetNextMessage(num_bytes, num_handles, flags,
+                                     false /* read_any_size */,
+                                     &ports_message);
+  if (result != MOJO_RESULT_OK)
+    return result;
+
+  return ReadMessageContents(std::move(ports_message), bytes, handles);
+}
+
+MojoResult MessagePipeDispatcher::ReadMessageNew(
+    scoped_ptr<MessageForTransit>* message,
+    uint32_t* num_bytes,
+    MojoHandle* handles,
+    uint32_t* num_handles,
+    MojoReadMessageFlags flags) {
+  ports::ScopedMessage ports_message;
+  MojoResult result = GetNextMessage(num_bytes, num_handles, flags,
+                                     true /* read_any_size */, &ports_message);
+  if (result != MOJO_RESULT_OK)
+    return result;
+
+  result = DeserializeMessage(
+      std::move(ports_message), handles,
+      (flags & MOJO_READ_MESSAGE_FLAG_DEFER_HANDLES) != 0, message);
+  if (result != MOJO_RESULT_OK)
+    return result;
+
+  // The caller reads the contents in place, so they mustn't be left in memory
+  // the writer can still change.
+  (*message)->CopySharedBytes();
+  return MOJO_RESULT_OK;
+}
+
+MojoResult MessagePipeDispatcher::ReadMessages(void* bytes,
+                                               uint32_t num_bytes,
+                                               uint32_t* message_num_bytes,
+                                               MojoHandle* handles,
+                                               uint32_t num_handles,
+                                               uint32_t* message_num_handles,
+                                               uint32_t* num_messages,
+                                               MojoReadMessageFlags flags) {
   {
-    base::AutoLock lock(signal_lock_);
+    ProfiledCompactAutoLock lock(signal_lock_);
     if (port_closed_)
       return MOJO_RESULT_INVALID_ARGUMENT;
 
@@ -210,54 +396,92 @@ MojoResult MessagePipeDispatcher::ReadMessage(void* bytes,
       return MOJO_RESULT_SHOULD_WAIT;
   }
 
-  bool no_space = false;
-  bool may_discard = flags & MOJO_READ_MESSAGE_FLAG_MAY_DISCARD;
+  uint32_t max_messages = *num_messages;
+  *num_messages = 0;
+
+  // Take messages for as long as they fit in what is left of the caller's
+  // buffers. As with ReadMessage, a message which doesn't fit stays queued
+  // unless it is the first one and may be discarded.
+  BatchFitsFilter filter = {message_num_bytes,
+                            message_num_handles,
+                            (flags & MOJO_READ_MESSAGE_FLAG_MAY_DISCARD) != 0,
+                            false,
+                            0,
+                            num_bytes,
+                            num_handles};
+  std::vector<ports::ScopedMessage> ports_messages;
+  int rv = node_controller_->node()->GetMessagesIf(
+      port_, &BatchFitsFilter::Select, &filter, max_messages, &ports_messages);
+
+  if (rv != ports::OK && rv != ports::ERROR_PORT_PEER_CLOSED) {
+    if (rv == ports::ERROR_PORT_UNKNOWN ||
+        rv == ports::ERROR_PORT_STATE_UNEXPECTED)
+      return MOJO_RESULT_INVALID_ARGUMENT;
+
+    NOTREACHED();
+    return MOJO_RESULT_UNKNOWN;
+  }
+
+  if (filter.no_space) {
+    for (const auto& ports_message : ports_messages) {
+      MessageForTransit::DiscardDispatchers(
+          node_controller_, static_cast<PortsMessage*>(ports_message.get()));
+    }
+    return MOJO_RESULT_RESOURCE_EXHAUSTED;
+  }
+
+  if (ports_messages.empty()) {
+    if (rv == ports::OK)
+      return MOJO_RESULT_SHOULD_WAIT;
+
+    // Peer is closed and there are no more messages to read.
+    DCHECK_EQ(rv, ports::ERROR_PORT_PEER_CLOSED);
+    ProfiledCompactAutoLock lock(signal_lock_);
+    awakables_.AwakeForStateChange(GetHandleSignalsStateNoLock());
+    return MOJO_RESULT_FAILED_PRECONDITION;
+  }
+
+  char* next_bytes = static_cast<char*>(bytes);
+  MojoHandle* next_handles = handles;
+  for (auto& ports_message : ports_messages) {
+    MojoResult result = ReadMessageContents(std::move(ports_message),
+                                            next_bytes, next_handles);
+    if (result != MOJO_RESULT_OK)
+      return result;
+
+    next_bytes += message_num_bytes[*num_messages];
+    next_handles += message_num_handles[*num_messages];
+    ++*num_messages;
+  }
+
+  return MOJO_RESULT_OK;
+}
+
+MojoResult MessagePipeDispatcher::GetNextMessage(
+    uint32_t* num_bytes,
+    uint32_t* num_handles,
+    MojoReadMessageFlags flags,
+    bool read_any_size,
+    ports::ScopedMessage* message) {
+  {
+    ProfiledCompactAutoLock lock(signal_lock_);
+    if (port_closed_)
+      return MOJO_RESULT_INVALID_ARGUMENT;
+
+    if (!port_connected_)
+      return MOJO_RESULT_SHOULD_WAIT;
+  }
 
   // Ensure the provided buffers are large enough to hold the next message.
   // GetMessageIf provides an atomic way to test the next message without
   // committing to removing it from the port's underlying message queue until
   // we are sure we can consume it.
-
-  ports::ScopedMessage ports_message;
+  FitsFilter filter = {
+      num_bytes, num_handles, read_any_size,
+      read_any_size && (flags & MOJO_READ_MESSAGE_FLAG_DEFER_HANDLES) != 0,
+      (flags & MOJO_READ_MESSAGE_FLAG_MAY_DISCARD) != 0, false};
   int rv = node_controller_->node()->GetMessageIf(
-      port_,
-      [num_bytes, num_handles, &no_space, &may_discard](
-          const ports::Message& next_message) {
-        const PortsMessage& message =
-            static_cast<const PortsMessage&>(next_message);
-        DCHECK_GE(message.num_payload_bytes(), sizeof(MessageHeader));
-        const MessageHeader* header =
-            static_cast<const MessageHeader*>(message.payload_bytes());
-        DCHECK_LE(header->header_size, message.num_payload_bytes());
-
-        uint32_t bytes_to_read = 0;
-        uint32_t bytes_available =
-            static_cast<uint32_t>(message.num_payload_bytes()) -
-            header->header_size;
-        if (num_bytes) {
-          bytes_to_read = std::min(*num_bytes, bytes_available);
-          *num_bytes = bytes_available;
-        }
-
-        DCHECK_EQ(header->num_dispatchers,
-                  message.num_ports() + message.num_handles());
-
-        uint32_t handles_to_read = 0;
-        uint32_t handles_available = header->num_dispatchers;
-        if (num_handles) {
-          handles_to_read = std::min(*num_handles, handles_available);
-          *num_handles = handles_available;
-        }
-
-        if (bytes_to_read < bytes_available ||
-            handles_to_read < handles_available) {
-          no_space = true;
-          return may_discard;
-        }
-
-        return true;
-      },
-      &ports_message);
+      port_, &FitsFilter::Select, &filter, message);
 
   if (rv != ports::OK && rv != ports::ERROR_PORT_PEER_CLOSED) {
     if (rv == ports::ERROR_PORT_UNKNOWN ||
@@ -268,20 +492,53 @@ MojoResult MessagePipeDispatcher::ReadMessage(void* bytes,
     return MOJO_RESULT_UNKNOWN;  // TODO: Add a better error code here?
   }
 
-  if (no_space)
+  if (filter.no_space) {
+    if (*message) {
+      MessageForTransit::DiscardDispatchers(
+          node_controller_, static_cast<PortsMessage*>(message->get()));
+      message->reset();
+    }
     return MOJO_RESULT_RESOURCE_EXHAUSTED;
+  }
 
-  if (!ports_message) {
+  if (!*message) {
     if (rv == ports::OK)
       return MOJO_RESULT_SHOULD_WAIT;
 
     // Peer is closed and there are no more messages to read.
     DCHECK_EQ(rv, ports::ERROR_PORT_PEER_CLOSED);
-    base::AutoLock lock(signal_lock_);
+    ProfiledCompactAutoLock lock(signal_lock_);
     awakables_.AwakeForStateChange(GetHandleSignalsStateNoLock());
     return MOJO_RESULT_FAILED_PRECONDITION;
   }
 
+  return MOJO_RESULT_OK;
+}
+
+MojoResult MessagePipeDispatcher::ReadMessageContents(
+    ports::ScopedMessage ports_message,
+    void* bytes,
+    MojoHandle* handles) {
+  scoped_ptr<MessageForTransit> message;
+  MojoResult result =
+      DeserializeMessage(std::move(ports_message), handles,
+                         false /* defer_handles */, &message);
+  if (result != MOJO_RESULT_OK)
+    return result;
+
+  // Copy message bytes. If they're in a shared buffer, this is the one copy
+  // out of memory the writer can still change.
+  memcpy(bytes, message->bytes(), message->num_bytes());
+  return MOJO_RESULT_OK;
+}
+
+MojoResult MessagePipeDispatcher::DeserializeMessage(
+    ports::ScopedMessage ports_message,
+    MojoHandle* handles,
+    bool defer_handles,
+    scoped_ptr<MessageForTransit>* message_for_transit) {
+  MessageTracer::RecordMessage(*ports_message,
+                               MessageTracePoint::kReadMessage);
   scoped_ptr<PortsMessage> message(
       static_cast<PortsMessage*>(ports_message.release()));
   const MessageHeader* header =
@@ -289,61 +546,79 @@ MojoResult MessagePipeDispatcher::ReadMessage(void* bytes,
   const DispatcherHeader* dispatcher_headers =
       reinterpret_cast<const DispatcherHeader*>(
           reinterpret_cast<const char*>(header) + sizeof(MessageHeader));
+  // A shared buffer holding the message's contents is serialized after its
+  // dispatchers.
+  const bool has_shared_bytes = header->num_shared_bytes != 0;
+  const size_t num_serialized =
+      header->num_dispatchers + (has_shared_bytes ? 1 : 0);
   size_t header_size = sizeof(MessageHeader) +
-      header->num_dispatchers * sizeof(DispatcherHeader);
+      num_serialized * sizeof(DispatcherHeader);
   DCHECK_GE(message->num_payload_bytes(), header_size);
-  DCHECK_EQ(message->num_ports() + message->num_handles(),
-            header->num_dispatchers);
-
-  const void* dispatcher_data = &dispatcher_headers[header->num_dispatchers];
-
-  // Deserialize dispatchers.
-  if (header->num_dispatchers > 0) {
-    CHECK(handles);
-    std::vector<DispatcherInTransit> dispatchers(header->num_dispatchers);
-    size_t port_index = 0;
-    size_t platform_handle_index = 0;
-    for (size_t i = 0; i < header->num_dispatchers; ++i) {
-      const DispatcherHeader& dh = dispatcher_headers[i];
-      Type type = static_cast<Type>(dh.type);
-
-      DCHECK_GE(message->num_ports(),
-                port_index + dh.num_ports);
-      DCHECK_GE(message->num_handles(),
-                platform_handle_index + dh.num_platform_handles);
-
-      PlatformHandle* out_handles =
-          message->num_handles() ? message->handles() + platform_handle_index
-                                 : nullptr;
-      dispatchers[i].dispatcher = Dispatcher::Deserialize(
-          type, dispatcher_data, dh.num_bytes, message->ports() + port_index,
-          dh.num_ports, out_handles, dh.num_platform_handles);
-      if (!dispatchers[i].dispatcher)
-        return MOJO_RESULT_UNKNOWN;
-
-      header_size += dh.num_bytes;
-      port_index += dh.num_ports;
-      platform_handle_index += dh.num_platform_handles;
+  for (size_t i = 0; i < num_serialized; ++i)
+    header_size += dispatcher_headers[i].num_bytes;
+  DCHECK_EQ(header->header_size, header_size);
+
+  // Map the contents first if they're in a shared buffer, so that nothing has
+  // been added to the handle table if that fails. The mapping outlives the
+  // buffer's handle, which is closed right away.
+  scoped_ptr<PlatformSharedBufferMapping> shared_bytes;
+  if (has_shared_bytes) {
+    const char* shared_buffer_data =
+        reinterpret_cast<const char*>(&dispatcher_headers[num_serialized]);
+    for (size_t i = 0; i < header->num_dispatchers; ++i)
+      shared_buffer_data += dispatcher_headers[i].num_bytes;
+    const DispatcherHeader& dh = dispatcher_headers[header->num_dispatchers];
+    if (static_cast<Type>(dh.type) != Type::SHARED_BUFFER ||
+        dh.num_ports != 0 || dh.num_platform_handles != 1 ||
+        message->num_handles() == 0) {
+      return MOJO_RESULT_UNKNOWN;
     }
-
-    if (!node_controller_->core()->AddDispatchersFromTransit(dispatchers,
-                                                             handles))
+    scoped_refptr<Dispatcher> shared_buffer = Dispatcher::Deserialize(
+        Type::SHARED_BUFFER, shared_buffer_data, dh.num_bytes, nullptr, 0,
+        message->handles() + message->num_handles() - 1, 1);
+    if (!shared_buffer)
+      return MOJO_RESULT_UNKNOWN;
+    MojoResult result = shared_buffer->MapBuffer(
+        0, header->num_shared_bytes, MOJO_MAP_BUFFER_FLAG_NONE, &shared_bytes);
+    shared_buffer->Close();
+    if (result != MOJO_RESULT_OK)
       return MOJO_RESULT_UNKNOWN;
   }
 
-  // Copy message bytes.
-  DCHECK_GE(message->num_payload_bytes(), header_size);
-  const void* message_body = static_cast<const void*>(
-      reinterpret_cast<const char*>(message->payload_bytes()) + header_size);
-  memcpy(bytes, message_body, message->num_payload_bytes() - header_size);
+  message_for_transit->reset(
+      new MessageForTransit(std::move(message), std::move(shared_bytes)));
+  if (defer_handles) {
+    (*message_for_transit)->DeferDispatchers(node_controller_);
+  } else {
+    MojoResult result =
+        (*message_for_transit)->DeserializeDispatchers(node_controller_,
+                                                       handles);
+    if (result != MOJO_RESULT_OK) {
+      message_for_transit->reset();
+      return result;
+    }
+  }
 
+  MetricsRegistry::Increment(MetricsRegistry::kMessagePipeMessagesRead);
+  MetricsRegistry::Add(MetricsRegistry::kMessagePipeBytesRead,
+                       (*message_for_transit)->num_bytes());
   return MOJO_RESULT_OK;
 }
 
 HandleSignalsState
 MessagePipeDispatcher::GetHandleSignalsState() const {
-  base::AutoLock lock(signal_lock_);
-  return GetHandleSignalsStateNoLock();
+  // This is called for every handle on every wait, so it avoids the signal
+  // lock: |port_connected_| only ever goes from false to true, and the port's
+  // status is published atomically by the node. A racing state change is
+  // always followed by OnPortStatusChanged(), which wakes any waiters.
+  if (!port_connected_.load(std::memory_order_acquire))
+    return GetUnconnectedSignalsState();
+
+  // Failure means the port was closed or transferred underneath us.
+  ports::PortStatus port_status;
+  if (node_controller_->node()->GetStatus(port_, &port_status) != ports::OK)
+    return HandleSignalsState();
+  return GetSignalsStateForPortStatus(port_status);
 }
 
 MojoResult MessagePipeDispatcher::AddAwakable(
@@ -351,7 +626,7 @@ MojoResult MessagePipeDispatcher::AddAwakable(
     MojoHandleSignals signals,
     uintptr_t context,
     HandleSignalsState* signals_state) {
-  base::AutoLock lock(signal_lock_);
+  ProfiledCompactAutoLock lock(signal_lock_);
 
   if (port_closed_) {
     if (signals_state)
@@ -377,7 +652,7 @@ MojoResult MessagePipeDispatcher::AddAwakable(
 
 void MessagePipeDispatcher::RemoveAwakable(Awakable* awakable,
                                            HandleSignalsState* signals_state) {
-  base::AutoLock lock(signal_lock_);
+  ProfiledCompactAutoLock lock(signal_lock_);
   if (port_closed_) {
     if (signals_state)
       *signals_state = HandleSignalsState();
@@ -456,7 +731,7 @@ MojoResult MessagePipeDispatcher::CloseNoLock() {
   awakables_.CancelAll();
 
   if (!port_transferred_ && port_connected_) {
-    int rv = node_controller_->node()->ClosePort(port_);
+    int rv = node_controller_->ClosePort(port_);
     DCHECK_EQ(ports::OK, rv);
   }
 
@@ -464,43 +739,23 @@ MojoResult MessagePipeDispatcher::CloseNoLock() {
 }
 
 HandleSignalsState MessagePipeDispatcher::GetHandleSignalsStateNoLock() const {
-  HandleSignalsState rv;
-  if (!port_connected_) {
-    // If we aren't connected yet, treat the pipe like it's in a normal
-    // state with no messages available.
-    rv.satisfiable_signals = MOJO_HANDLE_SIGNAL_READABLE |
-        MOJO_HANDLE_SIGNAL_WRITABLE | MOJO_HANDLE_SIGNAL_PEER_CLOSED;
-    rv.satisfied_signals = MOJO_HANDLE_SIGNAL_WRITABLE;
-    return rv;
-  }
+  if (!port_connected_)
+    return GetUnconnectedSignalsState();
 
   ports::PortStatus port_status;
   if (node_controller_->node()->GetStatus(port_, &port_status) != ports::OK) {
     CHECK(port_transferred_ || port_closed_);
     return HandleSignalsState();
   }
-
-  if (port_status.has_messages) {
-    rv.satisfied_signals |= MOJO_HANDLE_SIGNAL_READABLE;
-    rv.satisfiable_signals |= MOJO_HANDLE_SIGNAL_READABLE;
-  }
-  if (!port_status.peer_closed) {
-    rv.satisfied_signals |= MOJO_HANDLE_SIGNAL_WRITABLE;
-    rv.satisfiable_signals |= MOJO_HANDLE_SIGNAL_WRITABLE;
-    rv.satisfiable_signals |= MOJO_HANDLE_SIGNAL_READABLE;
-  } else {
-    rv.satisfied_signals |= MOJO_HANDLE_SIGNAL_PEER_CLOSED;
-  }
-  rv.satisfiable_signals |= MOJO_HANDLE_SIGNAL_PEER_CLOSED;
-  return rv;
+  return GetSignalsStateForPortStatus(port_status);
 }
 
 void MessagePipeDispatcher::OnPortStatusChanged() {
-  base::AutoLock lock(signal_lock_);
+  ProfiledCompactAutoLock lock(signal_lock_);
   if (!port_connected_) {
-    port_connected_ = true;
+    port_connected_.store(true, std::memory_order_release);
     if (port_closed_) {
-      int rv = node_controller_->node()->ClosePort(port_);
+      int rv = node_controller_->ClosePort(port_);
       DCHECK_EQ(rv, ports::OK);
     }
   }
@@ -5,17 +5,33 @@
 #ifndef MOJO_EDK_SYSTEM_MESSAGE_PIPE_DISPATCHER_H_
 #define MOJO_EDK_SYSTEM_MESSAGE_PIPE_DISPATCHER_H_
 
+#include <atomic>
 #include <queue>
 
 #include "base/macros.h"
 #include "base/memory/scoped_ptr.h"
 #include "mojo/edk/system/awakable_list.h"
 #include "mojo/edk/system/dispatcher.h"
+#include "mojo/edk/system/ports/message.h"
 #include "mojo/edk/system/ports/port_ref.h"
+#include "mojo/edk/system/profiled_lock.h"
+
+// Marks a message as part of a large transfer which may be delayed in favor
+// of other messages being written to the same process. Messages written with
+// it are still received in order with the pipe's other messages. This extends
+// the flags in "mojo/public/c/system/message_pipe.h".
+#define MOJO_WRITE_MESSAGE_FLAG_BULK ((MojoWriteMessageFlags)1 << 0)
+
+// Has MojoReadMessageNew() leave the message's handles unopened, so that they
+// need not fit and cost nothing if the message is freed. They're opened with
+// Core::TakeMessageHandles(). Other reads ignore it. This extends the flags in
+// "mojo/public/c/system/message_pipe.h".
+#define MOJO_READ_MESSAGE_FLAG_DEFER_HANDLES ((MojoReadMessageFlags)1 << 1)
 
 namespace mojo {
 namespace edk {
 
+class MessageForTransit;
 class NodeController;
 class PortsMessage;
 
@@ -32,6 +48,14 @@ class MessagePipeDispatcher : public Dispatcher {
                         const ports::PortRef& port,
                         bool connected);
 
+  // Validates and/or sets default options for |MojoCreateMessagePipeOptions|.
+  // If non-null, |in_options| must point to a struct of at least
+  // |in_options->struct_size| bytes. |out_options| will be entirely
+  // overwritten on success (it may be partly overwritten on failure).
+  static MojoResult ValidateCreateOptions(
+      const MojoCreateMessagePipeOptions* in_options,
+      MojoCreateMessagePipeOptions* out_options);
+
   // Dispatcher:
   Type GetType() const override;
   MojoResult Close() override;
@@ -40,11 +64,28 @@ class MessagePipeDispatcher : public Dispatcher {
                           const DispatcherInTransit* dispatchers,
                           uint32_t num_dispatchers,
                           MojoWriteMessageFlags flags) override;
+  MojoResult WriteMessageNew(scoped_ptr<MessageForTransit> message,
+                             MojoWriteMessageFlags flags) override;
+  MojoResult SetQuota(uint64_t max_queued_messages,
+                      uint64_t max_queued_bytes) override;
   MojoResult ReadMessage(void* bytes,
                          uint32_t* num_bytes,
                          MojoHandle* handles,
                          uint32_t* num_handles,
                          MojoReadMessageFlags flags) override;
+  MojoResult ReadMessageNew(scoped_ptr<MessageForTransit>* message,
+                            uint32_t* num_bytes,
+                            MojoHandle* handles,
+                            uint32_t* num_handles,
+                            MojoReadMessageFlags flags) override;
+  MojoResult ReadMessages(void* bytes,
+                          uint32_t num_bytes,
+                          uint32_t* message_num_bytes,
+                          MojoHandle* handles,
+                          uint32_t num_handles,
+                          uint32_t* message_num_handles,
+                          uint32_t* num_messages,
+                          MojoReadMessageFlags flags) override;
   HandleSignalsState GetHandleSignalsState() const override;
   MojoResult AddAwakable(Awakable* awakable,
                          MojoHandleSignals signals,
@@ -80,14 +121,41 @@ class MessagePipeDispatcher : public Dispatcher {
   HandleSignalsState GetHandleSignalsStateNoLock() const;
   void OnPortStatusChanged();
 
+  // Takes the next message from the port if the caller has room for it, with
+  // the same size checks and results as ReadMessage. If |read_any_size| is
+  // true, only the handles need to fit.
+  MojoResult GetNextMessage(uint32_t* num_bytes,
+                            uint32_t* num_handles,
+                            MojoReadMessageFlags flags,
+                            bool read_any_size,
+                            ports::ScopedMessage* message);
+
+  // Deserializes any dispatchers attached to |ports_message| into |handles|
+  // and copies its contents to |bytes|, which must be large enough.
+  MojoResult ReadMessageContents(ports::ScopedMessage ports_message,
+                                 void* bytes,
+                                 MojoHandle* handles);
+
+  // Deserializes any dispatchers attached to |ports_message| into |handles|
+  // and wraps the message in |message_for_transit| without copying it. With
+  // |defer_handles| the dispatchers are left serialized in the message; see
+  // MessageForTransit::DeferDispatchers().
+  MojoResult DeserializeMessage(
+      ports::ScopedMessage ports_message,
+      MojoHandle* handles,
+      bool defer_handles,
+      scoped_ptr<MessageForTransit>* message_for_transit);
+
   // These are safe to access from any thread without locking.
   NodeController* const node_controller_;
   const ports::PortRef port_;
 
   // Guards access to all the fields below.
-  mutable base::Lock signal_lock_;
+  mutable ProfiledCompactLock signal_lock_;
 
-  bool port_connected_ = false;
+  // Only written under |signal_lock_|, but atomic so that
+  // GetHandleSignalsState() can read it without the lock.
+  std::atomic<bool> port_connected_{false};
   bool port_transferred_ = false;
   bool port_closed_ = false;
   AwakableList awakables_;
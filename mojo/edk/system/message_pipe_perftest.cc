@@ -5,26 +5,104 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include <algorithm>
+#include <string>
 #include <utility>
+#include <vector>
 
+#include "base/atomic_ref_count.h"
 #include "base/bind.h"
 #include "base/logging.h"
 #include "base/strings/stringprintf.h"
+#include "base/synchronization/waitable_event.h"
 #include "base/test/perf_time_logger.h"
+#include "base/time/time.h"
 #include "mojo/edk/embedder/embedder.h"
 #include "mojo/edk/embedder/scoped_platform_handle.h"
 #include "mojo/edk/system/handle_signals_state.h"
 #include "mojo/edk/system/test_utils.h"
+#include "mojo/edk/system/work_stealing_thread_pool.h"
 #include "mojo/edk/test/multiprocess_test_base.h"
 #include "mojo/edk/test/test_utils.h"
 #include "mojo/public/c/system/functions.h"
 #include "mojo/public/cpp/system/message_pipe.h"
 #include "testing/gtest/include/gtest/gtest.h"
+#include "testing/perf/perf_test.h"
 
 namespace mojo {
 namespace edk {
 namespace {
 
+// Large enough for any message sent by these tests.
+const size_t kMaxMessageSize = 1000000;
+
+// The first byte of each message sent to StreamSinkClient. Message payloads
+// are filled with kDataTag, and a kReportTag message asks for the number of
+// messages received since the last report.
+const char kDataTag = '*';
+const char kReportTag = 'r';
+
+// Results are reported with perf_test::PrintResult so that they can be
+// collected and tracked by the perf dashboards, with the message size or
+// configuration as the trace name.
+std::string MessageSizeTrace(size_t message_size) {
+  return base::StringPrintf("%ubytes", static_cast<unsigned>(message_size));
+}
+
+// Runs |num_rounds| round trips on one pipe without holding a thread while
+// waiting: each reply is read by ReadMessageAsync(), whose callback sends the
+// next message and starts the next read on |executor|.
+class AsyncPingPong {
+ public:
+  AsyncPingPong(MojoHandle pipe,
+                scoped_refptr<base::TaskRunner> executor,
+                const std::string& payload,
+                int num_rounds,
+                base::AtomicRefCount* num_running,
+                base::WaitableEvent* all_done)
+      : pipe_(pipe),
+        executor_(executor),
+        payload_(payload),
+        num_rounds_left_(num_rounds),
+        num_running_(num_running),
+        all_done_(all_done) {}
+
+  void Start() { SendAndRead(); }
+
+ private:
+  void SendAndRead() {
+    CHECK_EQ(MojoWriteMessage(pipe_, payload_.data(),
+                              static_cast<uint32_t>(payload_.size()), nullptr,
+                              0, MOJO_WRITE_MESSAGE_FLAG_NONE),
+             MOJO_RESULT_OK);
+    uintptr_t wait_id;
+    CHECK_EQ(ReadMessageAsync(pipe_, executor_,
+                              base::Bind(&AsyncPingPong::OnReply,
+                                         base::Unretained(this)),
+                              &wait_id),
+             MOJO_RESULT_OK);
+  }
+
+  void OnReply(MojoResult result, ReceivedMessage* message) {
+    CHECK_EQ(result, MOJO_RESULT_OK);
+    CHECK_EQ(message->num_bytes(), static_cast<uint32_t>(payload_.size()));
+    if (--num_rounds_left_ > 0) {
+      SendAndRead();
+    } else if (!base::AtomicRefCountDec(num_running_)) {
+      all_done_->Signal();
+    }
+  }
+
+  const MojoHandle pipe_;
+  const scoped_refptr<base::TaskRunner> executor_;
+  const std::string& payload_;
+  int num_rounds_left_;
+  base::AtomicRefCount* const num_running_;
+  base::WaitableEvent* const all_done_;
+
+  DISALLOW_COPY_AND_ASSIGN(AsyncPingPong);
+};
+
 class MultiprocessMessagePipePerfTest : public test::MultiprocessTestBase {
  public:
   MultiprocessMessagePipePerfTest()
@@ -76,6 +154,274 @@ class MultiprocessMessagePipePerfTest : public test::MultiprocessTestBase {
     logger.Done();
   }
 
+  // Writes |message_count| messages back to back with no replies, then waits
+  // for StreamSinkClient to confirm it received them all.
+  static void StreamMessages(MojoHandle mp,
+                             uint32_t message_count,
+                             size_t message_size) {
+    std::string payload(message_size, kDataTag);
+    for (uint32_t i = 0; i < message_count; ++i) {
+      CHECK_EQ(MojoWriteMessage(mp, payload.data(),
+                                static_cast<uint32_t>(payload.size()), nullptr,
+                                0, MOJO_WRITE_MESSAGE_FLAG_NONE),
+               MOJO_RESULT_OK);
+    }
+    WriteString(mp, std::string(1, kReportTag));
+
+    uint32_t num_received = 0;
+    ReadString(mp, reinterpret_cast<char*>(&num_received),
+               sizeof(num_received));
+    CHECK_EQ(num_received, message_count);
+  }
+
+  void MeasureStreaming(MojoHandle mp,
+                        uint32_t message_count,
+                        size_t message_size) {
+    StreamMessages(mp, 1, message_size);
+
+    base::TimeTicks start = base::TimeTicks::Now();
+    StreamMessages(mp, message_count, message_size);
+    double seconds = (base::TimeTicks::Now() - start).InSecondsF();
+
+    std::string trace = MessageSizeTrace(message_size);
+    perf_test::PrintResult("MessagePipe_Streaming", "", trace,
+                           message_count / seconds, "messages/s", true);
+    perf_test::PrintResult(
+        "MessagePipe_StreamingBandwidth", "", trace,
+        message_count * message_size / seconds / (1024 * 1024), "MB/s", false);
+  }
+
+  // Times each of |message_count| round trips to PingPongClient individually
+  // and reports the latency distribution.
+  void MeasureLatency(MojoHandle mp, int message_count, size_t message_size) {
+    SetUpMeasurement(message_count, message_size);
+    WriteWaitThenRead(mp);
+
+    std::vector<double> latencies(message_count);
+    for (int i = 0; i < message_count; ++i) {
+      base::TimeTicks start = base::TimeTicks::Now();
+      WriteWaitThenRead(mp);
+      latencies[i] = (base::TimeTicks::Now() - start).InMicrosecondsF();
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    struct Percentile {
+      const char* name;
+      size_t per_mille;
+    };
+    const Percentile kPercentiles[] = {{"_p50", 500}, {"_p99", 990},
+                                       {"_p999", 999}};
+    std::string trace = MessageSizeTrace(message_size);
+    for (const Percentile& percentile : kPercentiles) {
+      size_t index = std::min(latencies.size() - 1,
+                              latencies.size() * percentile.per_mille / 1000);
+      perf_test::PrintResult("MessagePipe_RoundTripLatency", percentile.name,
+                             trace, latencies[index], "us", true);
+    }
+  }
+
+  // Asks each of the FanInSenderClients on |pipes| to send |message_count|
+  // messages of |message_size| bytes, and waits until all have arrived.
+  static void RunFanIn(const std::vector<MojoHandle>& pipes,
+                       uint32_t message_count,
+                       uint32_t message_size) {
+    uint32_t command[] = {message_count, message_size};
+    for (MojoHandle pipe : pipes) {
+      CHECK_EQ(MojoWriteMessage(pipe, command, sizeof(command), nullptr, 0,
+                                MOJO_WRITE_MESSAGE_FLAG_NONE),
+               MOJO_RESULT_OK);
+    }
+
+    std::vector<MojoHandleSignals> signals(pipes.size(),
+                                           MOJO_HANDLE_SIGNAL_READABLE);
+    std::string buffer(kMaxMessageSize, '\0');
+    size_t num_remaining = pipes.size() * message_count;
+    while (num_remaining > 0) {
+      uint32_t index;
+      CHECK_EQ(MojoWaitMany(pipes.data(), signals.data(),
+                            static_cast<uint32_t>(pipes.size()),
+                            MOJO_DEADLINE_INDEFINITE, &index, nullptr),
+               MOJO_RESULT_OK);
+      uint32_t read_size = static_cast<uint32_t>(buffer.size());
+      while (MojoReadMessage(pipes[index], &buffer[0], &read_size, nullptr,
+                             nullptr, MOJO_READ_MESSAGE_FLAG_NONE) ==
+             MOJO_RESULT_OK) {
+        CHECK_EQ(read_size, message_size);
+        CHECK_GT(num_remaining, 0u);
+        --num_remaining;
+        read_size = static_cast<uint32_t>(buffer.size());
+      }
+    }
+  }
+
+  // Times |num_clients| child processes all streaming messages to this one,
+  // as children do to a broker.
+  void MeasureFanIn(size_t num_clients,
+                    uint32_t messages_per_client,
+                    uint32_t message_size) {
+    std::vector<ClientController*> clients =
+        StartClients("FanInSenderClient", num_clients);
+    std::vector<MojoHandle> pipes;
+    for (ClientController* client : clients)
+      pipes.push_back(client->pipe());
+
+    // Make sure every channel is established before timing.
+    RunFanIn(pipes, 1, message_size);
+
+    base::TimeTicks start = base::TimeTicks::Now();
+    RunFanIn(pipes, messages_per_client, message_size);
+    double seconds = (base::TimeTicks::Now() - start).InSecondsF();
+
+    perf_test::PrintResult(
+        "MessagePipe_FanIn", "",
+        base::StringPrintf("%uclients_%ubytes",
+                           static_cast<unsigned>(num_clients), message_size),
+        num_clients * messages_per_client / seconds, "messages/s", true);
+
+    for (MojoHandle pipe : pipes)
+      SendQuitMessage(pipe);
+    for (ClientController* client : clients)
+      EXPECT_EQ(0, client->WaitForShutdown());
+  }
+
+  // Sends one end of each of |num_pipes| new message pipes to
+  // MultiPipeEchoClient over |mp|, so that they all share |mp|'s channel, then
+  // times rounds of one message in each direction on every pipe.
+  void MeasureManyPipes(MojoHandle mp, uint32_t num_pipes, int num_rounds) {
+    std::vector<MojoHandle> local_pipes(num_pipes);
+    std::vector<MojoHandle> remote_pipes(num_pipes);
+    for (uint32_t i = 0; i < num_pipes; ++i)
+      CreatePipe(&local_pipes[i], &remote_pipes[i]);
+    WriteStringWithHandles(mp, "pipes", remote_pipes.data(), num_pipes);
+
+    SetUpMeasurement(num_rounds, 12);
+    for (MojoHandle pipe : local_pipes)
+      WriteWaitThenRead(pipe);
+
+    base::TimeTicks start = base::TimeTicks::Now();
+    for (int round = 0; round < num_rounds; ++round) {
+      for (MojoHandle pipe : local_pipes) {
+        CHECK_EQ(MojoWriteMessage(pipe, payload_.data(),
+                                  static_cast<uint32_t>(payload_.size()),
+                                  nullptr, 0, MOJO_WRITE_MESSAGE_FLAG_NONE),
+                 MOJO_RESULT_OK);
+      }
+      for (MojoHandle pipe : local_pipes) {
+        CHECK_EQ(MojoWait(pipe, MOJO_HANDLE_SIGNAL_READABLE,
+                          MOJO_DEADLINE_INDEFINITE, nullptr),
+                 MOJO_RESULT_OK);
+        uint32_t read_size = static_cast<uint32_t>(read_buffer_.size());
+        CHECK_EQ(MojoReadMessage(pipe, &read_buffer_[0], &read_size, nullptr,
+                                 nullptr, MOJO_READ_MESSAGE_FLAG_NONE),
+                 MOJO_RESULT_OK);
+        CHECK_EQ(read_size, static_cast<uint32_t>(payload_.size()));
+      }
+    }
+    double seconds = (base::TimeTicks::Now() - start).InSecondsF();
+
+    perf_test::PrintResult(
+        "MessagePipe_ManyPipes", "", base::StringPrintf("%upipes", num_pipes),
+        num_rounds * num_pipes / seconds, "roundtrips/s", true);
+
+    for (MojoHandle pipe : local_pipes)
+      CHECK_EQ(MojoClose(pipe), MOJO_RESULT_OK);
+  }
+
+  // Like MeasureManyPipes(), but every pipe runs its rounds independently as
+  // an AsyncPingPong on a pool of |num_threads| threads, so no thread blocks
+  // on any one pipe.
+  void MeasureManyPipesAsync(MojoHandle mp,
+                             uint32_t num_pipes,
+                             int num_rounds,
+                             size_t num_threads) {
+    std::vector<MojoHandle> local_pipes(num_pipes);
+    std::vector<MojoHandle> remote_pipes(num_pipes);
+    for (uint32_t i = 0; i < num_pipes; ++i)
+      CreatePipe(&local_pipes[i], &remote_pipes[i]);
+    WriteStringWithHandles(mp, "pipes", remote_pipes.data(), num_pipes);
+
+    SetUpMeasurement(num_rounds, 12);
+    for (MojoHandle pipe : local_pipes)
+      WriteWaitThenRead(pipe);
+
+    WorkStealingThreadPool pool("AsyncPingPong", num_threads);
+    base::AtomicRefCount num_running = num_pipes;
+    base::WaitableEvent all_done(false, false);
+    std::vector<scoped_ptr<AsyncPingPong>> conversations;
+    for (MojoHandle pipe : local_pipes) {
+      conversations.push_back(make_scoped_ptr(
+          new AsyncPingPong(pipe, pool.task_runner(), payload_, num_rounds,
+                            &num_running, &all_done)));
+    }
+
+    base::TimeTicks start = base::TimeTicks::Now();
+    for (const scoped_ptr<AsyncPingPong>& conversation : conversations)
+      conversation->Start();
+    all_done.Wait();
+    double seconds = (base::TimeTicks::Now() - start).InSecondsF();
+
+    perf_test::PrintResult(
+        "MessagePipe_ManyPipesAsync", "",
+        base::StringPrintf("%upipes_%uthreads", num_pipes,
+                           static_cast<unsigned>(num_threads)),
+        num_rounds * num_pipes / seconds, "roundtrips/s", true);
+
+    for (MojoHandle pipe : local_pipes)
+      CHECK_EQ(MojoClose(pipe), MOJO_RESULT_OK);
+  }
+
+  // Connects |num_clients| SiblingPingClients to each other and has the first
+  // one time round trips to each of the others, first the one which causes
+  // their nodes to be introduced and then |num_round_trips| more.
+  void MeasureSiblingLatency(size_t num_clients, uint32_t num_round_trips) {
+    std::vector<ClientController*> clients =
+        StartClients("SiblingPingClient", num_clients);
+    ConnectClients(clients);
+
+    MojoHandle pinger = clients[0]->pipe();
+    CHECK_EQ(MojoWriteMessage(pinger, &num_round_trips,
+                              sizeof(num_round_trips), nullptr, 0,
+                              MOJO_WRITE_MESSAGE_FLAG_NONE),
+             MOJO_RESULT_OK);
+    double latencies[2];
+    ReadString(pinger, reinterpret_cast<char*>(latencies), sizeof(latencies));
+
+    std::string trace = base::StringPrintf(
+        "%uclients", static_cast<unsigned>(num_clients));
+    perf_test::PrintResult("MessagePipe_SiblingFirstRoundTrip", "", trace,
+                           latencies[0], "us", true);
+    perf_test::PrintResult("MessagePipe_SiblingRoundTripLatency", "", trace,
+                           latencies[1], "us", true);
+
+    SendQuitMessage(pinger);
+    for (ClientController* client : clients)
+      EXPECT_EQ(0, client->WaitForShutdown());
+  }
+
+  // Sends a new message pipe handle to HandleEchoClient and gets it back.
+  static void TransferHandle(MojoHandle mp) {
+    MojoHandle local_pipe, remote_pipe;
+    CreatePipe(&local_pipe, &remote_pipe);
+    WriteStringWithHandles(mp, "handle", &remote_pipe, 1);
+    ReadStringWithOptionalHandle(mp, &remote_pipe);
+    CHECK_NE(remote_pipe, MOJO_HANDLE_INVALID);
+    CHECK_EQ(MojoClose(local_pipe), MOJO_RESULT_OK);
+    CHECK_EQ(MojoClose(remote_pipe), MOJO_RESULT_OK);
+  }
+
+  void MeasureHandleTransfer(MojoHandle mp, int num_transfers) {
+    TransferHandle(mp);
+
+    base::TimeTicks start = base::TimeTicks::Now();
+    for (int i = 0; i < num_transfers; ++i)
+      TransferHandle(mp);
+    double seconds = (base::TimeTicks::Now() - start).InSecondsF();
+
+    perf_test::PrintResult("MessagePipe_HandleTransfer", "", "message_pipe",
+                           seconds * 1000000 / num_transfers,
+                           "us/roundtrip", true);
+  }
+
  private:
   int message_count_;
   size_t message_size_;
@@ -146,6 +492,301 @@ TEST_F(MultiprocessMessagePipePerfTest, MAYBE_PingPong) {
   END_CHILD()
 }
 
+// Counts the messages it receives, replying with the count to each kReportTag
+// message, until it receives an empty message.
+DEFINE_TEST_CLIENT_WITH_PIPE(StreamSinkClient, MultiprocessMessagePipePerfTest,
+                             h) {
+  std::string buffer(kMaxMessageSize, '\0');
+  uint32_t num_received = 0;
+  while (true) {
+    MojoResult result = MojoWait(h, MOJO_HANDLE_SIGNAL_READABLE,
+                                 MOJO_DEADLINE_INDEFINITE, nullptr);
+    if (result != MOJO_RESULT_OK)
+      return result;
+
+    // Drain everything which has arrived before waiting again.
+    uint32_t read_size = static_cast<uint32_t>(buffer.size());
+    while (MojoReadMessage(h, &buffer[0], &read_size, nullptr, nullptr,
+                           MOJO_READ_MESSAGE_FLAG_NONE) == MOJO_RESULT_OK) {
+      if (read_size == 0)
+        return 0;
+
+      if (buffer[0] == kReportTag) {
+        CHECK_EQ(MojoWriteMessage(h, &num_received, sizeof(num_received),
+                                  nullptr, 0, MOJO_WRITE_MESSAGE_FLAG_NONE),
+                 MOJO_RESULT_OK);
+        num_received = 0;
+      } else {
+        ++num_received;
+      }
+      read_size = static_cast<uint32_t>(buffer.size());
+    }
+  }
+}
+
+// For each command received, sends the requested number of messages of the
+// requested size, until it receives an empty message.
+DEFINE_TEST_CLIENT_WITH_PIPE(FanInSenderClient,
+                             MultiprocessMessagePipePerfTest, h) {
+  while (true) {
+    MojoResult result = MojoWait(h, MOJO_HANDLE_SIGNAL_READABLE,
+                                 MOJO_DEADLINE_INDEFINITE, nullptr);
+    if (result != MOJO_RESULT_OK)
+      return result;
+
+    uint32_t command[2];
+    uint32_t read_size = sizeof(command);
+    CHECK_EQ(MojoReadMessage(h, command, &read_size, nullptr, nullptr,
+                             MOJO_READ_MESSAGE_FLAG_NONE),
+             MOJO_RESULT_OK);
+    if (read_size == 0)
+      break;
+    CHECK_EQ(read_size, sizeof(command));
+
+    std::string payload(command[1], kDataTag);
+    for (uint32_t i = 0; i < command[0]; ++i) {
+      CHECK_EQ(MojoWriteMessage(h, payload.data(), command[1], nullptr, 0,
+                                MOJO_WRITE_MESSAGE_FLAG_NONE),
+               MOJO_RESULT_OK);
+    }
+  }
+
+  return 0;
+}
+
+// Receives a set of message pipes in its first message, then echoes every
+// message received on any of them until it receives a message on |h|.
+DEFINE_TEST_CLIENT_WITH_PIPE(MultiPipeEchoClient,
+                             MultiprocessMessagePipePerfTest, h) {
+  const uint32_t kMaxPipes = 1024;
+  std::vector<MojoHandle> handles(kMaxPipes);
+  uint32_t num_pipes = kMaxPipes;
+  CHECK_EQ(MojoWait(h, MOJO_HANDLE_SIGNAL_READABLE, MOJO_DEADLINE_INDEFINITE,
+                    nullptr),
+           MOJO_RESULT_OK);
+  std::string buffer(kMaxMessageSize, '\0');
+  uint32_t read_size = static_cast<uint32_t>(buffer.size());
+  CHECK_EQ(MojoReadMessage(h, &buffer[0], &read_size, handles.data(),
+                           &num_pipes, MOJO_READ_MESSAGE_FLAG_NONE),
+           MOJO_RESULT_OK);
+
+  // The control pipe goes last, so that its index marks the end.
+  handles.resize(num_pipes);
+  handles.push_back(h);
+  std::vector<MojoHandleSignals> signals(handles.size(),
+                                         MOJO_HANDLE_SIGNAL_READABLE);
+  while (true) {
+    uint32_t index;
+    MojoResult result = MojoWaitMany(
+        handles.data(), signals.data(), static_cast<uint32_t>(handles.size()),
+        MOJO_DEADLINE_INDEFINITE, &index, nullptr);
+    if (result != MOJO_RESULT_OK || index == num_pipes)
+      break;
+
+    read_size = static_cast<uint32_t>(buffer.size());
+    while (MojoReadMessage(handles[index], &buffer[0], &read_size, nullptr,
+                           nullptr, MOJO_READ_MESSAGE_FLAG_NONE) ==
+           MOJO_RESULT_OK) {
+      CHECK_EQ(MojoWriteMessage(handles[index], &buffer[0], read_size,
+                                nullptr, 0, MOJO_WRITE_MESSAGE_FLAG_NONE),
+               MOJO_RESULT_OK);
+      read_size = static_cast<uint32_t>(buffer.size());
+    }
+  }
+
+  for (uint32_t i = 0; i < num_pipes; ++i)
+    CHECK_EQ(MojoClose(handles[i]), MOJO_RESULT_OK);
+  return 0;
+}
+
+// Connected to its siblings with ConnectClients(). The first client waits for
+// a round trip count from the parent, then times round trips to each sibling
+// in turn and replies with the mean latency, in microseconds, of the first
+// round trip to each and of the rest. The others echo whatever the first
+// sends them until it closes its pipe to them.
+DEFINE_TEST_CLIENT_WITH_PIPE(SiblingPingClient,
+                             MultiprocessMessagePipePerfTest, h) {
+  std::vector<MojoHandle> siblings;
+  uint32_t index = ReceiveSiblingPipes(h, &siblings);
+  const char kPayload[] = "hello world";
+  char buffer[sizeof(kPayload)];
+
+  if (index != 0) {
+    while (MojoWait(siblings[0], MOJO_HANDLE_SIGNAL_READABLE,
+                    MOJO_DEADLINE_INDEFINITE, nullptr) == MOJO_RESULT_OK) {
+      uint32_t read_size = sizeof(buffer);
+      CHECK_EQ(MojoReadMessage(siblings[0], buffer, &read_size, nullptr,
+                               nullptr, MOJO_READ_MESSAGE_FLAG_NONE),
+               MOJO_RESULT_OK);
+      CHECK_EQ(MojoWriteMessage(siblings[0], buffer, read_size, nullptr, 0,
+                                MOJO_WRITE_MESSAGE_FLAG_NONE),
+               MOJO_RESULT_OK);
+    }
+  } else {
+    uint32_t num_round_trips;
+    ReadString(h, reinterpret_cast<char*>(&num_round_trips),
+               sizeof(num_round_trips));
+
+    base::TimeDelta first_round_trips;
+    base::TimeDelta other_round_trips;
+    for (size_t i = 1; i < siblings.size(); ++i) {
+      for (uint32_t n = 0; n <= num_round_trips; ++n) {
+        base::TimeTicks start = base::TimeTicks::Now();
+        CHECK_EQ(MojoWriteMessage(siblings[i], kPayload, sizeof(kPayload),
+                                  nullptr, 0, MOJO_WRITE_MESSAGE_FLAG_NONE),
+                 MOJO_RESULT_OK);
+        CHECK_EQ(MojoWait(siblings[i], MOJO_HANDLE_SIGNAL_READABLE,
+                          MOJO_DEADLINE_INDEFINITE, nullptr),
+                 MOJO_RESULT_OK);
+        uint32_t read_size = sizeof(buffer);
+        CHECK_EQ(MojoReadMessage(siblings[i], buffer, &read_size, nullptr,
+                                 nullptr, MOJO_READ_MESSAGE_FLAG_NONE),
+                 MOJO_RESULT_OK);
+        CHECK_EQ(read_size, sizeof(kPayload));
+        if (n == 0)
+          first_round_trips += base::TimeTicks::Now() - start;
+        else
+          other_round_trips += base::TimeTicks::Now() - start;
+      }
+    }
+
+    double num_siblings = static_cast<double>(siblings.size() - 1);
+    double latencies[] = {
+        first_round_trips.InMicrosecondsF() / num_siblings,
+        other_round_trips.InMicrosecondsF() / num_siblings / num_round_trips};
+    CHECK_EQ(MojoWriteMessage(h, latencies, sizeof(latencies), nullptr, 0,
+                              MOJO_WRITE_MESSAGE_FLAG_NONE),
+             MOJO_RESULT_OK);
+
+    // Wait for the parent to finish with its results.
+    CHECK_EQ(MojoWait(h, MOJO_HANDLE_SIGNAL_READABLE,
+                      MOJO_DEADLINE_INDEFINITE, nullptr),
+             MOJO_RESULT_OK);
+  }
+
+  for (MojoHandle sibling : siblings) {
+    if (sibling != MOJO_HANDLE_INVALID)
+      CHECK_EQ(MojoClose(sibling), MOJO_RESULT_OK);
+  }
+  return 0;
+}
+
+// Sends back every handle it receives, until it receives a message without
+// one. Unlike the other clients, it can't be sent an empty message to quit.
+DEFINE_TEST_CLIENT_WITH_PIPE(HandleEchoClient, MultiprocessMessagePipePerfTest,
+                             h) {
+  while (true) {
+    MojoHandle handle;
+    std::string message = ReadStringWithOptionalHandle(h, &handle);
+    if (handle == MOJO_HANDLE_INVALID)
+      break;
+    WriteStringWithHandles(h, message, &handle, 1);
+  }
+
+  return 0;
+}
+
+// As the other tests here, these are disabled on Android where multi-process
+// tests are flaky.
+#if defined(OS_ANDROID)
+#define MAYBE_Streaming DISABLED_Streaming
+#define MAYBE_Latency DISABLED_Latency
+#define MAYBE_FanIn DISABLED_FanIn
+#define MAYBE_SiblingLatency DISABLED_SiblingLatency
+#define MAYBE_ManyPipes DISABLED_ManyPipes
+#define MAYBE_ManyPipesAsync DISABLED_ManyPipesAsync
+#define MAYBE_HandleTransfer DISABLED_HandleTransfer
+#else
+#define MAYBE_Streaming Streaming
+#define MAYBE_Latency Latency
+#define MAYBE_FanIn FanIn
+#define MAYBE_SiblingLatency SiblingLatency
+#define MAYBE_ManyPipes ManyPipes
+#define MAYBE_ManyPipesAsync ManyPipesAsync
+#define MAYBE_HandleTransfer HandleTransfer
+#endif  // defined(OS_ANDROID)
+
+// Measures one-way throughput, with the sender never waiting for the reader.
+TEST_F(MultiprocessMessagePipePerfTest, MAYBE_Streaming) {
+  RUN_CHILD_ON_PIPE(StreamSinkClient, h)
+    // Everything sent is queued at the reader if it falls behind, so the
+    // counts are kept low enough for that to fit comfortably in memory.
+    const size_t kMsgSize[4] = {12, 144, 1728, 20736};
+    const uint32_t kMessageCount[4] = {100000, 100000, 50000, 5000};
+
+    for (size_t i = 0; i < 4; i++)
+      MeasureStreaming(h, kMessageCount[i], kMsgSize[i]);
+
+    SendQuitMessage(h);
+  END_CHILD()
+}
+
+// Measures the round-trip latency distribution rather than its mean.
+TEST_F(MultiprocessMessagePipePerfTest, MAYBE_Latency) {
+  RUN_CHILD_ON_PIPE(PingPongClient, h)
+    const size_t kMsgSize[3] = {12, 1728, 248832};
+    const int kMessageCount[3] = {20000, 20000, 1000};
+
+    for (size_t i = 0; i < 3; i++)
+      MeasureLatency(h, kMessageCount[i], kMsgSize[i]);
+
+    SendQuitMessage(h);
+  END_CHILD()
+}
+
+// Measures many children sending to a single parent at once.
+TEST_F(MultiprocessMessagePipePerfTest, MAYBE_FanIn) {
+  // The larger counts model a broker with a couple of hundred children, with
+  // fewer messages from each to keep the total in check.
+  const size_t kNumClients[] = {1, 2, 4, 8, 32, 200};
+  for (size_t num_clients : kNumClients) {
+    uint32_t messages_per_client = static_cast<uint32_t>(
+        std::min<size_t>(20000, 160000 / num_clients));
+    MeasureFanIn(num_clients, messages_per_client, 144);
+  }
+}
+
+// Measures round trips between children which were introduced to each other
+// by the broker, including the first, which waits for the introduction.
+TEST_F(MultiprocessMessagePipePerfTest, MAYBE_SiblingLatency) {
+  const size_t kNumClients[] = {2, 8, 32};
+  for (size_t num_clients : kNumClients)
+    MeasureSiblingLatency(num_clients, 10000);
+}
+
+// Measures traffic spread over many message pipes sharing one channel.
+TEST_F(MultiprocessMessagePipePerfTest, MAYBE_ManyPipes) {
+  const uint32_t kNumPipes[] = {1, 16, 128};
+  for (uint32_t num_pipes : kNumPipes) {
+    RUN_CHILD_ON_PIPE(MultiPipeEchoClient, h)
+      MeasureManyPipes(h, num_pipes, 100000 / num_pipes);
+      SendQuitMessage(h);
+    END_CHILD()
+  }
+}
+
+// Measures the same traffic as ManyPipes, with each pipe's round trips chained
+// through ReadMessageAsync() callbacks on a few threads instead of one thread
+// waiting on each pipe in turn.
+TEST_F(MultiprocessMessagePipePerfTest, MAYBE_ManyPipesAsync) {
+  const uint32_t kNumPipes[] = {1, 16, 128};
+  for (uint32_t num_pipes : kNumPipes) {
+    RUN_CHILD_ON_PIPE(MultiPipeEchoClient, h)
+      MeasureManyPipesAsync(h, num_pipes, 100000 / num_pipes, 2);
+      SendQuitMessage(h);
+    END_CHILD()
+  }
+}
+
+// Measures the cost of passing a message pipe handle to another process and
+// back.
+TEST_F(MultiprocessMessagePipePerfTest, MAYBE_HandleTransfer) {
+  RUN_CHILD_ON_PIPE(HandleEchoClient, h)
+    MeasureHandleTransfer(h, 10000);
+    WriteString(h, "quit");
+  END_CHILD()
+}
+
 }  // namespace
 }  // namespace edk
 }  // namespace mojo
@@ -0,0 +1,142 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/message_pool.h"
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "base/lazy_instance.h"
+#include "base/logging.h"
+#include "base/threading/thread_local_storage.h"
+#include "mojo/edk/system/channel.h"
+#include "mojo/edk/system/memory_allocation.h"
+
+namespace mojo {
+namespace edk {
+
+namespace {
+
+// Usable sizes of each size class. Messages in the 12-144 byte range are by
+// far the most common, so the classes are skewed towards small blocks.
+const size_t kSizeClasses[] = {64, 128, 256, 512, 1024, 2048, 4096};
+const size_t kNumSizeClasses = arraysize(kSizeClasses);
+
+// The maximum number of free blocks each thread keeps for each size class.
+// This bounds the cache at about 128 kB per thread.
+const size_t kMaxFreeBlocksPerSizeClass = 16;
+
+// Identifies blocks which are too large for any size class.
+const uint32_t kUnpooled = 0xFFFFFFFF;
+
+// Every block is prefixed with the index of its size class, padded to preserve
+// alignment of the usable bytes which follow.
+struct BlockPrefix {
+  uint32_t size_class;
+  uint32_t padding;
+};
+
+static_assert(sizeof(BlockPrefix) % kChannelMessageAlignment == 0,
+              "Invalid BlockPrefix size.");
+
+struct ThreadCache {
+  ThreadCache() {
+    for (auto& blocks : free_blocks)
+      blocks.reserve(kMaxFreeBlocksPerSizeClass);
+  }
+
+  ~ThreadCache() {
+    for (auto& blocks : free_blocks) {
+      for (void* block : blocks)
+        FreeMemory(MemoryAllocator::Usage::kMessage, block);
+    }
+  }
+
+  std::vector<void*> free_blocks[kNumSizeClasses];
+};
+
+void DestroyThreadCache(void* cache) {
+  delete static_cast<ThreadCache*>(cache);
+}
+
+struct ThreadCacheSlot {
+  ThreadCacheSlot() : slot(&DestroyThreadCache) {}
+
+  base::ThreadLocalStorage::Slot slot;
+};
+
+base::LazyInstance<ThreadCacheSlot>::Leaky g_thread_cache_slot =
+    LAZY_INSTANCE_INITIALIZER;
+
+ThreadCache* GetThreadCache() {
+  base::ThreadLocalStorage::Slot& slot = g_thread_cache_slot.Get().slot;
+  ThreadCache* cache = static_cast<ThreadCache*>(slot.Get());
+  if (!cache) {
+    cache = new ThreadCache;
+    slot.Set(cache);
+  }
+  return cache;
+}
+
+uint32_t GetSizeClass(size_t num_bytes) {
+  for (size_t i = 0; i < kNumSizeClasses; ++i) {
+    if (num_bytes <= kSizeClasses[i])
+      return static_cast<uint32_t>(i);
+  }
+  return kUnpooled;
+}
+
+void* NewBlock(size_t num_bytes, uint32_t size_class) {
+  BlockPrefix* prefix = static_cast<BlockPrefix*>(AllocateMemory(
+      MemoryAllocator::Usage::kMessage, sizeof(BlockPrefix) + num_bytes,
+      kChannelMessageAlignment));
+  prefix->size_class = size_class;
+  prefix->padding = 0;
+  return prefix;
+}
+
+}  // namespace
+
+// static
+void* MessagePool::Allocate(size_t num_bytes) {
+  uint32_t size_class = GetSizeClass(num_bytes);
+  BlockPrefix* prefix;
+  if (size_class == kUnpooled) {
+    prefix = static_cast<BlockPrefix*>(NewBlock(num_bytes, kUnpooled));
+  } else {
+    std::vector<void*>& free_blocks =
+        GetThreadCache()->free_blocks[size_class];
+    if (free_blocks.empty()) {
+      prefix = static_cast<BlockPrefix*>(
+          NewBlock(kSizeClasses[size_class], size_class));
+    } else {
+      prefix = static_cast<BlockPrefix*>(free_blocks.back());
+      free_blocks.pop_back();
+      DCHECK_EQ(size_class, prefix->size_class);
+    }
+  }
+  return prefix + 1;
+}
+
+// static
+void MessagePool::Free(void* ptr) {
+  if (!ptr)
+    return;
+
+  BlockPrefix* prefix = static_cast<BlockPrefix*>(ptr) - 1;
+  if (prefix->size_class != kUnpooled) {
+    DCHECK_LT(prefix->size_class, kNumSizeClasses);
+    std::vector<void*>& free_blocks =
+        GetThreadCache()->free_blocks[prefix->size_class];
+    if (free_blocks.size() < kMaxFreeBlocksPerSizeClass) {
+      free_blocks.push_back(prefix);
+      return;
+    }
+  }
+  FreeMemory(MemoryAllocator::Usage::kMessage, prefix);
+}
+
+}  // namespace edk
+}  // namespace mojo
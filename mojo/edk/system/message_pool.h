@@ -0,0 +1,41 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_SYSTEM_MESSAGE_POOL_H_
+#define MOJO_EDK_SYSTEM_MESSAGE_POOL_H_
+
+#include <stddef.h>
+
+#include "base/macros.h"
+
+namespace mojo {
+namespace edk {
+
+// A per-thread cache of memory blocks in a handful of small size classes, used
+// for objects which are allocated and freed at a high rate on the message send
+// and receive paths (Channel::Message and PortsMessage). In the steady state
+// small messages are served from the cache without touching the heap.
+//
+// A block may be freed on a different thread than the one which allocated it,
+// in which case it joins the freeing thread's cache. Each thread caches a
+// bounded number of blocks per size class; anything beyond that, and any
+// allocation larger than the largest size class, goes to the heap, or to the
+// embedder's MemoryAllocator if it has set one.
+class MessagePool {
+ public:
+  // Returns a block with room for at least |num_bytes| bytes, aligned to
+  // kChannelMessageAlignment.
+  static void* Allocate(size_t num_bytes);
+
+  // Frees a block returned by Allocate. |ptr| may be null.
+  static void Free(void* ptr);
+
+ private:
+  DISALLOW_IMPLICIT_CONSTRUCTORS(MessagePool);
+};
+
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_SYSTEM_MESSAGE_POOL_H_
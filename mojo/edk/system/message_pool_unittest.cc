@@ -0,0 +1,121 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/message_pool.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+#include "base/bind.h"
+#include "base/location.h"
+#include "base/memory/aligned_memory.h"
+#include "base/threading/thread.h"
+#include "mojo/edk/system/channel.h"
+#include "mojo/edk/system/memory_allocation.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace mojo {
+namespace edk {
+namespace {
+
+TEST(MessagePoolTest, AllocateAndFree) {
+  const size_t kSizes[] = {0, 1, 12, 64, 65, 144, 1728, 4096, 4097, 20736};
+  std::vector<void*> blocks;
+  for (size_t size : kSizes) {
+    void* block = MessagePool::Allocate(size);
+    ASSERT_TRUE(block);
+    EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(block) %
+                      kChannelMessageAlignment);
+    memset(block, 0xAB, size);
+    blocks.push_back(block);
+  }
+
+  for (void* block : blocks)
+    MessagePool::Free(block);
+
+  MessagePool::Free(nullptr);
+}
+
+TEST(MessagePoolTest, ReusesFreedBlocks) {
+  void* block = MessagePool::Allocate(100);
+  MessagePool::Free(block);
+
+  // A block of the same size class should come straight back out of the
+  // thread's cache.
+  void* reused_block = MessagePool::Allocate(120);
+  EXPECT_EQ(block, reused_block);
+  MessagePool::Free(reused_block);
+}
+
+void FreeBlocks(std::vector<void*>* blocks) {
+  for (void* block : *blocks)
+    MessagePool::Free(block);
+  blocks->clear();
+}
+
+TEST(MessagePoolTest, FreeOnAnotherThread) {
+  std::vector<void*> blocks;
+  for (size_t i = 0; i < 100; ++i)
+    blocks.push_back(MessagePool::Allocate(i * 50));
+
+  base::Thread thread("MessagePoolTest");
+  ASSERT_TRUE(thread.Start());
+  thread.task_runner()->PostTask(
+      FROM_HERE, base::Bind(&FreeBlocks, base::Unretained(&blocks)));
+  thread.Stop();
+
+  EXPECT_TRUE(blocks.empty());
+}
+
+TEST(MessagePoolTest, ChannelMessage) {
+  const char kPayload[] = "hello";
+  Channel::MessagePtr message =
+      Channel::Message::Create(sizeof(kPayload), nullptr);
+  EXPECT_EQ(sizeof(kPayload), message->payload_size());
+  EXPECT_EQ(0u, message->num_handles());
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(message->data()) %
+                    kChannelMessageAlignment);
+  memcpy(message->mutable_payload(), kPayload, sizeof(kPayload));
+  EXPECT_EQ(0, memcmp(kPayload, message->payload(), sizeof(kPayload)));
+}
+
+// Counts what goes through it, but gets the memory from the heap like the
+// default, so blocks cached before it was installed can still be freed.
+class CountingAllocator : public MemoryAllocator {
+ public:
+  void* Allocate(Usage usage, size_t num_bytes, size_t alignment) override {
+    if (usage == Usage::kMessage)
+      ++num_allocations;
+    return base::AlignedAlloc(num_bytes, alignment);
+  }
+
+  void Free(Usage usage, void* ptr) override {
+    if (usage == Usage::kMessage)
+      ++num_frees;
+    base::AlignedFree(ptr);
+  }
+
+  size_t num_allocations = 0;
+  size_t num_frees = 0;
+};
+
+TEST(MessagePoolTest, EmbedderAllocator) {
+  CountingAllocator allocator;
+  InstallMemoryAllocator(&allocator);
+
+  // Too large for any size class, so it's never cached.
+  void* block = MessagePool::Allocate(20736);
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(block) % kChannelMessageAlignment);
+  EXPECT_EQ(1u, allocator.num_allocations);
+  MessagePool::Free(block);
+  EXPECT_EQ(1u, allocator.num_frees);
+
+  InstallMemoryAllocator(nullptr);
+}
+
+}  // namespace
+}  // namespace edk
+}  // namespace mojo
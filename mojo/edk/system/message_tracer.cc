@@ -0,0 +1,171 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/message_tracer.h"
+
+#include <algorithm>
+
+#include "base/atomicops.h"
+#include "base/lazy_instance.h"
+#include "base/rand_util.h"
+#include "base/synchronization/lock.h"
+#include "base/threading/platform_thread.h"
+#include "base/threading/thread_local_storage.h"
+#include "base/time/time.h"
+
+namespace mojo {
+namespace edk {
+
+namespace {
+
+// The number of most recent events each thread keeps. Must be a power of two.
+const size_t kRingSize = 4096;
+
+static_assert((kRingSize & (kRingSize - 1)) == 0,
+              "kRingSize must be a power of two.");
+
+base::subtle::Atomic32 g_sampling_rate = 0;
+
+struct ThreadRing {
+  explicit ThreadRing(uint64_t thread_id)
+      : thread_id(thread_id), num_unsampled(0), num_events(0) {}
+
+  const uint64_t thread_id;
+
+  // Messages written by this thread since the last one sampled. Only used by
+  // the owning thread.
+  uint32_t num_unsampled;
+
+  // The number of events ever recorded. Event i is in |events[i % kRingSize]|.
+  // Published with a release store once the event is written.
+  base::subtle::AtomicWord num_events;
+  MessageTraceEvent events[kRingSize];
+};
+
+void DestroyThreadRing(void* ring);
+
+class Tracer {
+ public:
+  Tracer()
+      : slot_(&DestroyThreadRing),
+        next_trace_id_(static_cast<base::subtle::Atomic32>(base::RandUint64())) {
+  }
+
+  ThreadRing* GetThreadRing() {
+    ThreadRing* ring = static_cast<ThreadRing*>(slot_.Get());
+    if (!ring) {
+      ring = new ThreadRing(
+          static_cast<uint64_t>(base::PlatformThread::CurrentId()));
+      {
+        base::AutoLock lock(lock_);
+        rings_.push_back(ring);
+      }
+      slot_.Set(ring);
+    }
+    return ring;
+  }
+
+  uint32_t NewTraceId() {
+    // Starting from a random value makes IDs from different processes
+    // unlikely to collide. Zero means untraced, so skip it.
+    uint32_t trace_id;
+    do {
+      trace_id = static_cast<uint32_t>(
+          base::subtle::NoBarrier_AtomicIncrement(&next_trace_id_, 1));
+    } while (!trace_id);
+    return trace_id;
+  }
+
+  void GetEvents(std::vector<MessageTraceEvent>* events) {
+    base::AutoLock lock(lock_);
+    for (const ThreadRing* ring : rings_) {
+      size_t end = static_cast<size_t>(
+          base::subtle::Acquire_Load(&ring->num_events));
+      size_t begin = end > kRingSize ? end - kRingSize : 0;
+      size_t first_copied = events->size();
+      for (size_t i = begin; i < end; ++i)
+        events->push_back(ring->events[i % kRingSize]);
+
+      // The owner may have overwritten the oldest events while they were being
+      // copied, and may be part way through overwriting one more.
+      size_t new_end = static_cast<size_t>(
+          base::subtle::Acquire_Load(&ring->num_events));
+      if (new_end + 1 > begin + kRingSize) {
+        size_t num_stale =
+            std::min(new_end + 1 - (begin + kRingSize), end - begin);
+        events->erase(events->begin() + first_copied,
+                      events->begin() + first_copied + num_stale);
+      }
+    }
+  }
+
+  void RemoveThreadRing(ThreadRing* ring) {
+    {
+      base::AutoLock lock(lock_);
+      rings_.erase(std::find(rings_.begin(), rings_.end(), ring));
+    }
+    delete ring;
+  }
+
+ private:
+  base::ThreadLocalStorage::Slot slot_;
+  base::subtle::Atomic32 next_trace_id_;
+
+  // Guards |rings_|. Held while rings are read, so that a thread which exits
+  // meanwhile can't free its ring.
+  base::Lock lock_;
+  std::vector<ThreadRing*> rings_;
+
+  DISALLOW_COPY_AND_ASSIGN(Tracer);
+};
+
+base::LazyInstance<Tracer>::Leaky g_tracer = LAZY_INSTANCE_INITIALIZER;
+
+void DestroyThreadRing(void* ring) {
+  g_tracer.Get().RemoveThreadRing(static_cast<ThreadRing*>(ring));
+}
+
+}  // namespace
+
+// static
+void MessageTracer::SetSamplingRate(uint32_t one_in_n) {
+  base::subtle::NoBarrier_Store(
+      &g_sampling_rate, static_cast<base::subtle::Atomic32>(one_in_n));
+}
+
+// static
+uint32_t MessageTracer::SampleMessage() {
+  uint32_t sampling_rate =
+      static_cast<uint32_t>(base::subtle::NoBarrier_Load(&g_sampling_rate));
+  if (!sampling_rate)
+    return 0;
+
+  Tracer& tracer = g_tracer.Get();
+  ThreadRing* ring = tracer.GetThreadRing();
+  if (++ring->num_unsampled < sampling_rate)
+    return 0;
+  ring->num_unsampled = 0;
+  return tracer.NewTraceId();
+}
+
+// static
+void MessageTracer::GetEvents(std::vector<MessageTraceEvent>* events) {
+  g_tracer.Get().GetEvents(events);
+}
+
+// static
+void MessageTracer::RecordEvent(uint32_t trace_id, MessageTracePoint point) {
+  ThreadRing* ring = g_tracer.Get().GetThreadRing();
+  base::subtle::AtomicWord index =
+      base::subtle::NoBarrier_Load(&ring->num_events);
+  MessageTraceEvent& event = ring->events[index % kRingSize];
+  event.trace_id = trace_id;
+  event.point = point;
+  event.thread_id = ring->thread_id;
+  event.time_us = base::TimeTicks::Now().ToInternalValue();
+  base::subtle::Release_Store(&ring->num_events, index + 1);
+}
+
+}  // namespace edk
+}  // namespace mojo
@@ -0,0 +1,63 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_SYSTEM_MESSAGE_TRACER_H_
+#define MOJO_EDK_SYSTEM_MESSAGE_TRACER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "base/macros.h"
+#include "mojo/edk/embedder/message_trace.h"
+#include "mojo/edk/system/ports/event.h"
+
+namespace mojo {
+namespace edk {
+
+// Stamps a sampled subset of messages as they pass through the system. A
+// message is sampled when it is written to a message pipe, and its trace ID
+// then travels in its ports::EventHeader, so that the receiving process stamps
+// it too.
+//
+// Each thread records into its own ring of the most recent events, with no
+// locking or atomic read-modify-writes. Reading the rings while they are
+// being written is best effort: events which may have been overwritten during
+// the read are left out.
+class MessageTracer {
+ public:
+  // Samples one in every |one_in_n| messages written by each thread. Zero
+  // disables sampling, which is the default. Messages which were sampled
+  // elsewhere are recorded regardless.
+  static void SetSamplingRate(uint32_t one_in_n);
+
+  // Returns a new trace ID if the next message written by this thread should
+  // be traced, or zero.
+  static uint32_t SampleMessage();
+
+  static void Record(uint32_t trace_id, MessageTracePoint point) {
+    if (trace_id)
+      RecordEvent(trace_id, point);
+  }
+
+  static void RecordMessage(const ports::Message& message,
+                            MessageTracePoint point) {
+    Record(ports::GetEventHeader(message)->trace_id, point);
+  }
+
+  // Appends the events currently held by every thread's ring to |events|.
+  // Each thread's events are in the order recorded.
+  static void GetEvents(std::vector<MessageTraceEvent>* events);
+
+ private:
+  static void RecordEvent(uint32_t trace_id, MessageTracePoint point);
+
+  DISALLOW_IMPLICIT_CONSTRUCTORS(MessageTracer);
+};
+
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_SYSTEM_MESSAGE_TRACER_H_
@@ -0,0 +1,80 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/message_tracer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <set>
+#include <vector>
+
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace mojo {
+namespace edk {
+namespace {
+
+std::vector<MessageTraceEvent> GetEventsForTrace(uint32_t trace_id) {
+  std::vector<MessageTraceEvent> events;
+  MessageTracer::GetEvents(&events);
+  std::vector<MessageTraceEvent> matching_events;
+  for (const MessageTraceEvent& event : events) {
+    if (event.trace_id == trace_id)
+      matching_events.push_back(event);
+  }
+  return matching_events;
+}
+
+TEST(MessageTracerTest, Sampling) {
+  EXPECT_EQ(0u, MessageTracer::SampleMessage());
+
+  MessageTracer::SetSamplingRate(3);
+  std::set<uint32_t> trace_ids;
+  for (size_t i = 0; i < 9; ++i) {
+    uint32_t trace_id = MessageTracer::SampleMessage();
+    if (trace_id)
+      trace_ids.insert(trace_id);
+  }
+  EXPECT_EQ(3u, trace_ids.size());
+
+  MessageTracer::SetSamplingRate(0);
+  for (size_t i = 0; i < 9; ++i)
+    EXPECT_EQ(0u, MessageTracer::SampleMessage());
+}
+
+TEST(MessageTracerTest, RecordAndGetEvents) {
+  MessageTracer::SetSamplingRate(1);
+  uint32_t trace_id = MessageTracer::SampleMessage();
+  MessageTracer::SetSamplingRate(0);
+  ASSERT_NE(0u, trace_id);
+
+  MessageTracer::Record(trace_id, MessageTracePoint::kWriteMessage);
+  MessageTracer::Record(0, MessageTracePoint::kChannelWrite);
+  MessageTracer::Record(trace_id, MessageTracePoint::kReadMessage);
+
+  std::vector<MessageTraceEvent> events = GetEventsForTrace(trace_id);
+  ASSERT_EQ(2u, events.size());
+  EXPECT_EQ(MessageTracePoint::kWriteMessage, events[0].point);
+  EXPECT_EQ(MessageTracePoint::kReadMessage, events[1].point);
+  EXPECT_EQ(events[0].thread_id, events[1].thread_id);
+  EXPECT_LE(events[0].time_us, events[1].time_us);
+}
+
+TEST(MessageTracerTest, RingKeepsMostRecentEvents) {
+  const size_t kNumEvents = 100000;
+  const uint32_t kTraceId = 0xC0FFEE;
+  for (size_t i = 0; i < kNumEvents; ++i)
+    MessageTracer::Record(kTraceId, MessageTracePoint::kAcceptMessage);
+  MessageTracer::Record(kTraceId, MessageTracePoint::kReadMessage);
+
+  std::vector<MessageTraceEvent> events = GetEventsForTrace(kTraceId);
+  ASSERT_FALSE(events.empty());
+  EXPECT_LT(events.size(), kNumEvents);
+  EXPECT_EQ(MessageTracePoint::kReadMessage, events.back().point);
+}
+
+}  // namespace
+}  // namespace edk
+}  // namespace mojo
@@ -0,0 +1,149 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/metrics_registry.h"
+
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "base/atomicops.h"
+#include "base/lazy_instance.h"
+#include "base/synchronization/lock.h"
+#include "base/threading/thread_local_storage.h"
+
+namespace mojo {
+namespace edk {
+
+namespace {
+
+const size_t kNumValues =
+    MetricsRegistry::kNumCounters +
+    MetricsRegistry::kNumHistograms * MetricsRegistry::kNumHistogramBuckets;
+
+// A thread's value is folded into the registry's totals once it reaches this,
+// so that word-sized values cannot overflow on 32-bit platforms.
+const base::subtle::AtomicWord kFlushThreshold = 1 << 30;
+
+// Only the owning thread writes |values|, but snapshots read them from other
+// threads.
+struct ThreadValues {
+  base::subtle::AtomicWord values[kNumValues];
+};
+
+void DestroyThreadValues(void* values);
+
+class Registry {
+ public:
+  Registry() : slot_(&DestroyThreadValues) {
+    memset(totals_, 0, sizeof(totals_));
+  }
+
+  void Add(size_t index, size_t amount) {
+    base::subtle::AtomicWord* value = &GetThreadValues()->values[index];
+    if (amount < static_cast<size_t>(kFlushThreshold)) {
+      base::subtle::AtomicWord new_value =
+          base::subtle::NoBarrier_Load(value) +
+          static_cast<base::subtle::AtomicWord>(amount);
+      if (new_value < kFlushThreshold) {
+        base::subtle::NoBarrier_Store(value, new_value);
+        return;
+      }
+    }
+
+    base::AutoLock lock(lock_);
+    totals_[index] += base::subtle::NoBarrier_Load(value);
+    totals_[index] += amount;
+    base::subtle::NoBarrier_Store(value, 0);
+  }
+
+  void GetSnapshot(uint64_t* values) {
+    base::AutoLock lock(lock_);
+    for (size_t i = 0; i < kNumValues; ++i)
+      values[i] = totals_[i];
+    for (const ThreadValues* thread : threads_) {
+      for (size_t i = 0; i < kNumValues; ++i)
+        values[i] += base::subtle::NoBarrier_Load(&thread->values[i]);
+    }
+  }
+
+  void RemoveThread(ThreadValues* thread) {
+    {
+      base::AutoLock lock(lock_);
+      for (size_t i = 0; i < kNumValues; ++i)
+        totals_[i] += base::subtle::NoBarrier_Load(&thread->values[i]);
+      threads_.erase(std::find(threads_.begin(), threads_.end(), thread));
+    }
+    delete thread;
+  }
+
+ private:
+  ThreadValues* GetThreadValues() {
+    ThreadValues* thread = static_cast<ThreadValues*>(slot_.Get());
+    if (!thread) {
+      thread = new ThreadValues;
+      memset(thread, 0, sizeof(*thread));
+      {
+        base::AutoLock lock(lock_);
+        threads_.push_back(thread);
+      }
+      slot_.Set(thread);
+    }
+    return thread;
+  }
+
+  base::ThreadLocalStorage::Slot slot_;
+
+  // Guards |threads_| and |totals_|, and serializes flushes with snapshots so
+  // that a flushed value is never counted twice.
+  base::Lock lock_;
+  std::vector<ThreadValues*> threads_;
+
+  // Everything flushed by live threads, plus the final values of exited ones.
+  uint64_t totals_[kNumValues];
+
+  DISALLOW_COPY_AND_ASSIGN(Registry);
+};
+
+base::LazyInstance<Registry>::Leaky g_registry = LAZY_INSTANCE_INITIALIZER;
+
+void DestroyThreadValues(void* values) {
+  g_registry.Get().RemoveThread(static_cast<ThreadValues*>(values));
+}
+
+}  // namespace
+
+// static
+const size_t MetricsRegistry::kNumHistogramBuckets;
+
+// static
+void MetricsRegistry::Add(Counter counter, size_t amount) {
+  g_registry.Get().Add(counter, amount);
+}
+
+// static
+void MetricsRegistry::AddSample(Histogram histogram, size_t sample) {
+  g_registry.Get().Add(kNumCounters + histogram * kNumHistogramBuckets +
+                           GetHistogramBucket(sample),
+                       1);
+}
+
+// static
+void MetricsRegistry::GetSnapshot(Snapshot* snapshot) {
+  static_assert(sizeof(Snapshot) == kNumValues * sizeof(uint64_t),
+                "Snapshot must hold exactly the registry's values.");
+  g_registry.Get().GetSnapshot(reinterpret_cast<uint64_t*>(snapshot));
+}
+
+// static
+size_t MetricsRegistry::GetHistogramBucket(size_t sample) {
+  size_t bucket = 0;
+  for (sample >>= 6; sample && bucket < kNumHistogramBuckets - 1; sample >>= 1)
+    ++bucket;
+  return bucket;
+}
+
+}  // namespace edk
+}  // namespace mojo
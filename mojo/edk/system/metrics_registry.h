@@ -0,0 +1,74 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_SYSTEM_METRICS_REGISTRY_H_
+#define MOJO_EDK_SYSTEM_METRICS_REGISTRY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "base/macros.h"
+
+namespace mojo {
+namespace edk {
+
+// Process-wide counters and histograms, cheap enough to update on every
+// message. Each thread adds to its own copy of the values with plain stores;
+// the copies are only summed, under a lock, when a snapshot is taken.
+class MetricsRegistry {
+ public:
+  enum Counter {
+    kChannelMessagesWritten,
+    kChannelBytesWritten,
+    kChannelHandlesWritten,
+    kChannelMessagesRead,
+    kChannelBytesRead,
+    kChannelHandlesRead,
+    kChannelMessagesCompressed,
+    kChannelMessagesFragmented,
+    kChannelMessagesCompacted,
+    kMessagePipeMessagesWritten,
+    kMessagePipeBytesWritten,
+    kMessagePipeHandlesWritten,
+    kMessagePipeMessagesRead,
+    kMessagePipeBytesRead,
+    kDataPipeBytesWritten,
+    kDataPipeBytesRead,
+    kPeersDropped,
+    kPeerMessagesDropped,
+    kNumCounters
+  };
+
+  enum Histogram {
+    kChannelMessageSize,
+    kNumHistograms
+  };
+
+  // Bucket 0 counts samples below 64, bucket i samples in [2^(i+5), 2^(i+6)),
+  // and the last bucket everything from 2^20 up.
+  static const size_t kNumHistogramBuckets = 16;
+
+  struct Snapshot {
+    uint64_t counters[kNumCounters];
+    uint64_t histograms[kNumHistograms][kNumHistogramBuckets];
+  };
+
+  static void Add(Counter counter, size_t amount);
+  static void Increment(Counter counter) { Add(counter, 1); }
+  static void AddSample(Histogram histogram, size_t sample);
+
+  // Returns the totals over all threads, including ones which have exited.
+  static void GetSnapshot(Snapshot* snapshot);
+
+  // Returns the bucket |sample| falls into.
+  static size_t GetHistogramBucket(size_t sample);
+
+ private:
+  DISALLOW_IMPLICIT_CONSTRUCTORS(MetricsRegistry);
+};
+
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_SYSTEM_METRICS_REGISTRY_H_
@@ -0,0 +1,84 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/metrics_registry.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "base/bind.h"
+#include "base/location.h"
+#include "base/threading/thread.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace mojo {
+namespace edk {
+namespace {
+
+// The registry is shared by the whole process, so tests only look at how
+// values change.
+uint64_t GetCounter(MetricsRegistry::Counter counter) {
+  MetricsRegistry::Snapshot snapshot;
+  MetricsRegistry::GetSnapshot(&snapshot);
+  return snapshot.counters[counter];
+}
+
+void AddToCounter(MetricsRegistry::Counter counter, size_t amount) {
+  MetricsRegistry::Add(counter, amount);
+}
+
+TEST(MetricsRegistryTest, Counters) {
+  const MetricsRegistry::Counter kCounter = MetricsRegistry::kPeersDropped;
+  uint64_t start = GetCounter(kCounter);
+
+  MetricsRegistry::Increment(kCounter);
+  MetricsRegistry::Add(kCounter, 41);
+  EXPECT_EQ(start + 42, GetCounter(kCounter));
+
+  // Large amounts bypass the thread's value but are still counted.
+  MetricsRegistry::Add(kCounter, 1u << 30);
+  MetricsRegistry::Add(kCounter, (1u << 30) - 1);
+  EXPECT_EQ(start + 42 + (1u << 31) - 1, GetCounter(kCounter));
+}
+
+TEST(MetricsRegistryTest, SurvivesThreadExit) {
+  const MetricsRegistry::Counter kCounter =
+      MetricsRegistry::kPeerMessagesDropped;
+  uint64_t start = GetCounter(kCounter);
+
+  base::Thread thread("MetricsRegistryTest");
+  ASSERT_TRUE(thread.Start());
+  thread.task_runner()->PostTask(
+      FROM_HERE, base::Bind(&AddToCounter, kCounter, 7));
+  thread.task_runner()->PostTask(
+      FROM_HERE, base::Bind(&AddToCounter, kCounter, 3));
+  thread.Stop();
+
+  EXPECT_EQ(start + 10, GetCounter(kCounter));
+}
+
+TEST(MetricsRegistryTest, HistogramBuckets) {
+  EXPECT_EQ(0u, MetricsRegistry::GetHistogramBucket(0));
+  EXPECT_EQ(0u, MetricsRegistry::GetHistogramBucket(63));
+  EXPECT_EQ(1u, MetricsRegistry::GetHistogramBucket(64));
+  EXPECT_EQ(1u, MetricsRegistry::GetHistogramBucket(127));
+  EXPECT_EQ(2u, MetricsRegistry::GetHistogramBucket(128));
+  EXPECT_EQ(MetricsRegistry::kNumHistogramBuckets - 1,
+            MetricsRegistry::GetHistogramBucket(1 << 20));
+  EXPECT_EQ(MetricsRegistry::kNumHistogramBuckets - 1,
+            MetricsRegistry::GetHistogramBucket(1 << 30));
+
+  MetricsRegistry::Snapshot before;
+  MetricsRegistry::GetSnapshot(&before);
+  MetricsRegistry::AddSample(MetricsRegistry::kChannelMessageSize, 100);
+  MetricsRegistry::AddSample(MetricsRegistry::kChannelMessageSize, 100);
+  MetricsRegistry::Snapshot after;
+  MetricsRegistry::GetSnapshot(&after);
+  EXPECT_EQ(before.histograms[MetricsRegistry::kChannelMessageSize][1] + 2,
+            after.histograms[MetricsRegistry::kChannelMessageSize][1]);
+}
+
+}  // namespace
+}  // namespace edk
+}  // namespace mojo
@@ -5,6 +5,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <string>
 #include <utility>
@@ -19,8 +20,13 @@
 #include "base/location.h"
 #include "base/logging.h"
 #include "base/strings/string_split.h"
+#include "base/synchronization/waitable_event.h"
+#include "base/test/test_io_thread.h"
+#include "base/threading/platform_thread.h"
+#include "base/time/time.h"
 #include "build/build_config.h"
 #include "mojo/edk/embedder/embedder.h"
+#include "mojo/edk/embedder/embedder_internal.h"
 #include "mojo/edk/embedder/platform_channel_pair.h"
 #include "mojo/edk/embedder/platform_shared_buffer.h"
 #include "mojo/edk/embedder/scoped_platform_handle.h"
@@ -69,8 +75,55 @@ class MultiprocessMessagePipeTest : public test::MultiprocessTestBase {
    private:
     MojoHandle h_;
   };
+
+  // Waits until this process has no proxies left, so that a port it sends
+  // next tells the receiver which node the port's peer is really on.
+  static void WaitForNoProxies() {
+    for (;;) {
+      Metrics metrics;
+      GetMetrics(&metrics);
+      if (!metrics.num_proxies)
+        return;
+      base::PlatformThread::Sleep(base::TimeDelta::FromMilliseconds(1));
+    }
+  }
+
+  // Holds up this process's I/O thread, where introductions are requested and
+  // received, for as long as it exists.
+  class ScopedBlockIOThread {
+   public:
+    ScopedBlockIOThread()
+        : blocked_(true, false),
+          release_(new base::WaitableEvent(true, false)) {
+      internal::g_io_thread_task_runner->PostTask(
+          FROM_HERE, base::Bind(&ScopedBlockIOThread::Block, &blocked_,
+                                base::Owned(release_)));
+      blocked_.Wait();
+    }
+
+    ~ScopedBlockIOThread() { release_->Signal(); }
+
+   private:
+    static void Block(base::WaitableEvent* blocked,
+                      base::WaitableEvent* release) {
+      blocked->Signal();
+      release->Wait();
+    }
+
+    base::WaitableEvent blocked_;
+
+    // Owned by the blocking task, since the I/O thread may still be waking
+    // from it when this is destroyed.
+    base::WaitableEvent* release_;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedBlockIOThread);
+  };
 };
 
+// NodeController's limit on messages queued for a node it's waiting to be
+// introduced to.
+const size_t kMaxPendingPeerMessages = 16384;
+
 // For each message received, sends a reply message with the same contents
 // repeated twice, until the other end is closed or it receives "quitquitquit"
 // (which it doesn't reply to). It'll return the number of messages received,
@@ -133,6 +186,23 @@ DEFINE_TEST_CLIENT_WITH_PIPE(ChannelEchoClient, MultiprocessMessagePipeTest,
   return 0;
 }
 
+// Reads tokens from the primordial channel until "exit", connecting a child
+// message pipe for each. It greets the parent on the new pipe at once, then
+// echos one message on it.
+DEFINE_TEST_CLIENT_WITH_PIPE(TokenPipeEchoClient, MultiprocessMessagePipeTest,
+                             h) {
+  for (;;) {
+    std::string token = ReadString(h);
+    if (token == "exit")
+      break;
+    ScopedMessagePipeHandle pipe = CreateChildMessagePipe(token);
+    MojoHandle p = pipe.get().value();
+    WriteString(p, "hi " + token);
+    WriteString(p, ReadString(p));
+  }
+  return 0;
+}
+
 // Receives a pipe handle from the primordial channel and echos on it until
 // "exit". Used to test simple pipe transfer across processes via channels.
 DEFINE_TEST_CLIENT_WITH_PIPE(EchoServiceClient, MultiprocessMessagePipeTest,
@@ -226,6 +296,18 @@ DEFINE_TEST_CLIENT_WITH_PIPE(CommandDrivenClient, MultiprocessMessagePipeTest,
       CHECK(!parts[2].empty());
       CHECK_EQ(parts[2], ReadString(p));
       WriteString(h, "ok");
+    } else if (command == "none") {
+      // Expect nothing to have arrived on a named pipe.
+      CHECK_EQ(parts.size(), 2u);
+      CHECK_EQ(p, MOJO_HANDLE_INVALID);
+      p = named_pipes[parts[1]];
+      CHECK_NE(p, MOJO_HANDLE_INVALID);
+      uint32_t num_bytes = 0;
+      MojoResult rv = MojoReadMessage(p, nullptr, &num_bytes, nullptr, nullptr,
+                                      MOJO_READ_MESSAGE_FLAG_NONE);
+      CHECK(rv == MOJO_RESULT_SHOULD_WAIT ||
+            rv == MOJO_RESULT_FAILED_PRECONDITION);
+      WriteString(h, "ok");
     } else if (command == "pass") {
       // Pass one named pipe over another named pipe.
       CHECK_EQ(parts.size(), 3u);
@@ -527,7 +609,7 @@ DEFINE_TEST_CLIENT_WITH_PIPE(CheckPlatformHandleFile,
 
   std::string read_buffer(100, '\0');
   uint32_t num_bytes = static_cast<uint32_t>(read_buffer.size());
-  MojoHandle handles[255];  // Maximum number to receive.
+  MojoHandle handles[512];  // Maximum number to receive.
   uint32_t num_handlers = MOJO_ARRAYSIZE(handles);
 
   CHECK_EQ(MojoReadMessage(h, &read_buffer[0],
@@ -612,9 +694,8 @@ TEST_P(MultiprocessMessagePipeTestWithPipeCount, PlatformHandlePassing) {
 #if !defined(OS_ANDROID)
 INSTANTIATE_TEST_CASE_P(PipeCount,
                         MultiprocessMessagePipeTestWithPipeCount,
-                        // TODO: Re-enable the 140-pipe case when ChannelPosix
-                        // has support for sending lots of handles.
-                        testing::Values(1u, 128u/*, 140u*/));
+                        // More than 128 handles take several sendmsg() calls.
+                        testing::Values(1u, 128u, 140u, 400u));
 #endif
 
 DEFINE_TEST_CLIENT_WITH_PIPE(CheckMessagePipe, MultiprocessMessagePipeTest, h) {
@@ -887,6 +968,74 @@ TEST_F(MultiprocessMessagePipeTest, PassMessagePipeLocal) {
   VerifyTransmission(p3, p2, "Bismillah! NO! We will not let you go!");
 }
 
+TEST_F(MultiprocessMessagePipeTest, PassSharedBufferLocal) {
+  // The buffer goes through the pipe without being serialized.
+  MojoHandle buffer;
+  ASSERT_EQ(MOJO_RESULT_OK, MojoCreateSharedBuffer(nullptr, 100, &buffer));
+  void* data;
+  ASSERT_EQ(MOJO_RESULT_OK, MojoMapBuffer(buffer, 0, 100, &data,
+                                          MOJO_MAP_BUFFER_FLAG_NONE));
+  static const char kHello[] = "hello";
+  memcpy(data, kHello, sizeof(kHello));
+
+  CREATE_PIPE(p0, p1);
+  WriteStringWithHandles(p0, "buffer", &buffer, 1);
+  EXPECT_EQ("buffer", ReadStringWithHandles(p1, &buffer, 1));
+
+  void* received_data;
+  ASSERT_EQ(MOJO_RESULT_OK, MojoMapBuffer(buffer, 0, 100, &received_data,
+                                          MOJO_MAP_BUFFER_FLAG_NONE));
+  EXPECT_EQ(0, memcmp(received_data, kHello, sizeof(kHello)));
+
+  ASSERT_EQ(MOJO_RESULT_OK, MojoUnmapBuffer(received_data));
+  ASSERT_EQ(MOJO_RESULT_OK, MojoUnmapBuffer(data));
+  ASSERT_EQ(MOJO_RESULT_OK, MojoClose(buffer));
+  ASSERT_EQ(MOJO_RESULT_OK, MojoClose(p1));
+  ASSERT_EQ(MOJO_RESULT_OK, MojoClose(p0));
+}
+
+// Receives a pipe from the parent, then a shared buffer from that pipe, and
+// replies on the parent pipe with the string at the start of the buffer.
+DEFINE_TEST_CLIENT_WITH_PIPE(ReadForwardedSharedBuffer,
+                             MultiprocessMessagePipeTest, h) {
+  MojoHandle p;
+  ReadStringWithHandles(h, &p, 1);
+  MojoHandle buffer;
+  CHECK_EQ(std::string("buffer"), ReadStringWithHandles(p, &buffer, 1));
+
+  void* data;
+  CHECK_EQ(MOJO_RESULT_OK, MojoMapBuffer(buffer, 0, 100, &data,
+                                         MOJO_MAP_BUFFER_FLAG_NONE));
+  WriteString(h, std::string(static_cast<const char*>(data)));
+  CHECK_EQ(MOJO_RESULT_OK, MojoUnmapBuffer(data));
+  CHECK_EQ(MOJO_RESULT_OK, MojoClose(buffer));
+  CHECK_EQ(MOJO_RESULT_OK, MojoClose(p));
+  return 0;
+}
+
+TEST_F(MultiprocessMessagePipeTest, PassLocalSharedBufferCrossProcess) {
+  RUN_CHILD_ON_PIPE(ReadForwardedSharedBuffer, h)
+    MojoHandle buffer;
+    ASSERT_EQ(MOJO_RESULT_OK, MojoCreateSharedBuffer(nullptr, 100, &buffer));
+    void* data;
+    ASSERT_EQ(MOJO_RESULT_OK, MojoMapBuffer(buffer, 0, 100, &data,
+                                            MOJO_MAP_BUFFER_FLAG_NONE));
+    static const char kHello[] = "hello";
+    memcpy(data, kHello, sizeof(kHello));
+
+    // The buffer is written to a pipe whose other end is on this node, so it
+    // isn't serialized. Passing that end to the child forwards the message,
+    // which must then serialize it after all.
+    CREATE_PIPE(p0, p1);
+    WriteStringWithHandles(p0, "buffer", &buffer, 1);
+    WriteStringWithHandles(h, "take this", &p1, 1);
+    EXPECT_EQ("hello", ReadString(h));
+
+    ASSERT_EQ(MOJO_RESULT_OK, MojoUnmapBuffer(data));
+    ASSERT_EQ(MOJO_RESULT_OK, MojoClose(p0));
+  END_CHILD()
+}
+
 TEST_F(MultiprocessMessagePipeTest, MultiprocessChannelPipe) {
   RUN_CHILD_ON_PIPE(ChannelEchoClient, h)
     VerifyEcho(h, "in an interstellar burst");
@@ -897,6 +1046,25 @@ TEST_F(MultiprocessMessagePipeTest, MultiprocessChannelPipe) {
   END_CHILD()
 }
 
+TEST_F(MultiprocessMessagePipeTest, LargeMessagesInterleavedWithSmall) {
+  // More large messages than a Channel writes in frames at once, each
+  // followed by a small one which may overtake it on the wire. The pipe must
+  // still deliver all of them in order.
+  RUN_CHILD_ON_PIPE(ChannelEchoClient, h)
+    std::vector<std::string> messages;
+    for (char c = 'a'; c < 'k'; ++c) {
+      messages.push_back(std::string(3 * 1024 * 1024 + c, c));
+      messages.push_back(std::string(1, c));
+    }
+    for (const std::string& message : messages)
+      WriteString(h, message);
+    for (const std::string& message : messages)
+      EXPECT_EQ(message, ReadString(h));
+
+    WriteString(h, "exit");
+  END_CHILD()
+}
+
 TEST_F(MultiprocessMessagePipeTest, PassMessagePipeCrossProcess) {
   RUN_CHILD_ON_PIPE(EchoServiceClient, h)
     CREATE_PIPE(p0, p1);
@@ -912,6 +1080,22 @@ TEST_F(MultiprocessMessagePipeTest, PassMessagePipeCrossProcess) {
   END_CHILD()
 }
 
+TEST_F(MultiprocessMessagePipeTest, SharedMemoryMessages) {
+  // Large messages from this process go through shared memory, including one
+  // which also carries a handle. The child's replies don't.
+  SetSharedMemoryMessageThreshold(1024 * 1024);
+  RUN_CHILD_ON_PIPE(EchoServiceClient, h)
+    CREATE_PIPE(p0, p1);
+    WriteStringWithHandles(h, std::string(2 * 1024 * 1024, 'h'), &p1, 1);
+
+    VerifyEcho(p0, "small enough to send inline");
+    VerifyEcho(p0, std::string(4 * 1024 * 1024, 's'));
+
+    WriteString(p0, "exit");
+  END_CHILD()
+  SetSharedMemoryMessageThreshold(0);
+}
+
 TEST_F(MultiprocessMessagePipeTest, PassMoarMessagePipesCrossProcess) {
   RUN_CHILD_ON_PIPE(EchoServiceFactoryClient, h)
     CREATE_PIPE(echo_factory_proxy, echo_factory_request);
@@ -946,6 +1130,26 @@ TEST_F(MultiprocessMessagePipeTest, PassMoarMessagePipesCrossProcess) {
   END_CHILD()
 }
 
+TEST_F(MultiprocessMessagePipeTest, TokenPipesAfterStartup) {
+  RUN_CHILD_ON_PIPE(TokenPipeEchoClient, h)
+    // More pipes than the parent keeps pooled for the child, so that some are
+    // connected from ports replenishing the pool.
+    for (int i = 0; i < 20; ++i) {
+      std::string token = GenerateRandomToken();
+      ScopedMessagePipeHandle pipe = CreateParentMessagePipe(token);
+      MojoHandle p = pipe.get().value();
+
+      // This may be written before the child has its end of the pipe.
+      WriteString(p, "hello " + token);
+      WriteString(h, token);
+      EXPECT_EQ("hi " + token, ReadString(p));
+      EXPECT_EQ("hello " + token, ReadString(p));
+    }
+
+    WriteString(h, "exit");
+  END_CHILD()
+}
+
 TEST_F(MultiprocessMessagePipeTest, ChannelPipesWithMultipleChildren) {
   RUN_CHILD_ON_PIPE(ChannelEchoClient, a)
     RUN_CHILD_ON_PIPE(ChannelEchoClient, b)
@@ -982,6 +1186,32 @@ TEST_F(MultiprocessMessagePipeTest, ChildToChildPipes) {
   END_CHILD()
 }
 
+TEST_F(MultiprocessMessagePipeTest, ChildToChildPipesWithEagerIntroductions) {
+  SetEagerIntroductionsEnabled(true);
+  RUN_CHILD_ON_PIPE(CommandDrivenClient, h0)
+    RUN_CHILD_ON_PIPE(CommandDrivenClient, h1)
+      CommandDrivenClientController a(h0);
+      CommandDrivenClientController b(h1);
+
+      // The clients are introduced to each other while their ends of the pipe
+      // are in flight, so neither has to ask.
+      CREATE_PIPE(p0, p1);
+      a.SendHandle("x", p0);
+      b.SendHandle("y", p1);
+
+      a.Send("say:x:hello sir");
+      b.Send("hear:y:hello sir");
+
+      b.Send("say:y:i love multiprocess pipes!");
+      a.Send("hear:x:i love multiprocess pipes!");
+
+      a.Exit();
+      b.Exit();
+    END_CHILD()
+  END_CHILD()
+  SetEagerIntroductionsEnabled(false);
+}
+
 TEST_F(MultiprocessMessagePipeTest, MoreChildToChildPipes) {
   RUN_CHILD_ON_PIPE(CommandDrivenClient, h0)
     RUN_CHILD_ON_PIPE(CommandDrivenClient, h1)
@@ -1050,6 +1280,251 @@ TEST_F(MultiprocessMessagePipeTest, MoreChildToChildPipes) {
   END_CHILD()
 }
 
+// Writes to a pipe whose peer is on a node this process hasn't been introduced
+// to, until the queue of messages waiting for the introduction overflows.
+DEFINE_TEST_CLIENT_TEST_WITH_PIPE(PendingPeerOverflowClient,
+                                  MultiprocessMessagePipeTest, h) {
+  MojoHandle p;
+  EXPECT_EQ("go", ReadStringWithHandles(h, &p, 1));
+
+  Metrics before;
+  GetMetrics(&before);
+  {
+    // The introduction can't even be requested until the I/O thread runs, so
+    // everything written until then is queued.
+    ScopedBlockIOThread block_io_thread;
+    for (size_t i = 0; i < kMaxPendingPeerMessages; ++i)
+      WriteString(p, "queued");
+    Metrics metrics;
+    GetMetrics(&metrics);
+    EXPECT_EQ(kMaxPendingPeerMessages, metrics.num_pending_peer_messages);
+
+    // One more is accepted by the pipe, but overflows the queue. It's dropped
+    // along with everything queued before it, and so is the peer.
+    WriteString(p, "overflow");
+    GetMetrics(&metrics);
+    EXPECT_EQ(0u, metrics.num_pending_peer_messages);
+    EXPECT_EQ(1u, metrics.num_peers_dropped - before.num_peers_dropped);
+    EXPECT_EQ(kMaxPendingPeerMessages + 1,
+              metrics.num_peer_messages_dropped -
+                  before.num_peer_messages_dropped);
+  }
+
+  // Once the I/O thread has dropped the peer, the pipe is closed and further
+  // writes are rejected.
+  EXPECT_EQ(MOJO_RESULT_OK, MojoWait(p, MOJO_HANDLE_SIGNAL_PEER_CLOSED,
+                                     MOJO_DEADLINE_INDEFINITE, nullptr));
+  EXPECT_EQ(MOJO_RESULT_FAILED_PRECONDITION,
+            MojoWriteMessage(p, "late", 4, nullptr, 0,
+                             MOJO_WRITE_MESSAGE_FLAG_NONE));
+  EXPECT_EQ(MOJO_RESULT_OK, MojoClose(p));
+
+  WriteString(h, "done");
+  EXPECT_EQ("exit", ReadString(h));
+}
+
+TEST_F(MultiprocessMessagePipeTest, PendingPeerQueueOverflow) {
+  RUN_CHILD_ON_PIPE(PendingPeerOverflowClient, h0)
+    RUN_CHILD_ON_PIPE(CommandDrivenClient, h1)
+      CommandDrivenClientController b(h1);
+
+      // Once b has its end, the other end goes to the overflow client naming
+      // b's node as its peer's, rather than this one's.
+      CREATE_PIPE(p0, p1);
+      b.SendHandle("a_pipe", p1);
+      WaitForNoProxies();
+      WriteStringWithHandles(h0, "go", &p0, 1);
+      EXPECT_EQ("done", ReadString(h0));
+
+      // None of the messages ever reach b.
+      b.Send("none:a_pipe");
+
+      WriteString(h0, "exit");
+      b.Exit();
+    END_CHILD()
+  END_CHILD()
+}
+
+// Writes to pipes whose peers are on three nodes this process hasn't been
+// introduced to, while its I/O thread is held up so that all three
+// introductions are requested at once.
+DEFINE_TEST_CLIENT_TEST_WITH_PIPE(BatchedIntroductionsClient,
+                                  MultiprocessMessagePipeTest, h) {
+  MojoHandle pipes[3];
+  EXPECT_EQ("go", ReadStringWithHandles(h, pipes, 3));
+
+  {
+    // Only the first message queued posts the task which requests
+    // introductions, so the names of all three nodes are waiting for it when
+    // it runs, and go to the parent as one REQUEST_INTRODUCTIONS message.
+    ScopedBlockIOThread block_io_thread;
+    for (MojoHandle pipe : pipes)
+      WriteString(pipe, "hello");
+    Metrics metrics;
+    GetMetrics(&metrics);
+    EXPECT_EQ(3u, metrics.num_pending_peer_messages);
+  }
+
+  EXPECT_EQ("exit", ReadString(h));
+  Metrics metrics;
+  GetMetrics(&metrics);
+  EXPECT_EQ(0u, metrics.num_pending_peer_messages);
+  for (MojoHandle pipe : pipes)
+    EXPECT_EQ(MOJO_RESULT_OK, MojoClose(pipe));
+}
+
+TEST_F(MultiprocessMessagePipeTest, BatchedIntroductionRequests) {
+  RUN_CHILD_ON_PIPE(BatchedIntroductionsClient, h)
+    RUN_CHILD_ON_PIPE(CommandDrivenClient, h0)
+      RUN_CHILD_ON_PIPE(CommandDrivenClient, h1)
+        RUN_CHILD_ON_PIPE(CommandDrivenClient, h2)
+          CommandDrivenClientController b(h0), c(h1), d(h2);
+
+          CREATE_PIPE(p0, p1);
+          CREATE_PIPE(p2, p3);
+          CREATE_PIPE(p4, p5);
+          b.SendHandle("a_pipe", p1);
+          c.SendHandle("a_pipe", p3);
+          d.SendHandle("a_pipe", p5);
+          WaitForNoProxies();
+          MojoHandle ends[] = {p0, p2, p4};
+          WriteStringWithHandles(h, "go", ends, 3);
+
+          // Each message arrives once its node has been introduced.
+          b.Send("hear:a_pipe:hello");
+          c.Send("hear:a_pipe:hello");
+          d.Send("hear:a_pipe:hello");
+
+          WriteString(h, "exit");
+          b.Exit();
+          c.Exit();
+          d.Exit();
+        END_CHILD()
+      END_CHILD()
+    END_CHILD()
+  END_CHILD()
+}
+
+const size_t kNumPeerMetricsMessages = 100;
+
+DEFINE_TEST_CLIENT_TEST_WITH_PIPE(PeerMetricsClient,
+                                  MultiprocessMessagePipeTest, h) {
+  for (size_t i = 0; i < kNumPeerMetricsMessages; ++i)
+    EXPECT_EQ("hello", ReadString(h));
+  WriteString(h, "done");
+  EXPECT_EQ("exit", ReadString(h));
+}
+
+TEST_F(MultiprocessMessagePipeTest, PeerMetrics) {
+  RUN_CHILD_ON_PIPE(PeerMetricsClient, h)
+    for (size_t i = 0; i < kNumPeerMetricsMessages; ++i)
+      WriteString(h, "hello");
+    EXPECT_EQ("done", ReadString(h));
+
+    // Everything above went over the channel to the child. Children of
+    // earlier tests may still be listed too.
+    Metrics metrics;
+    GetMetrics(&metrics);
+    bool found_child = false;
+    for (const PeerMetrics& peer : metrics.peers) {
+      EXPECT_LE(peer.bytes_written, metrics.channel_bytes_written);
+      EXPECT_LE(peer.bytes_read, metrics.channel_bytes_read);
+      if (peer.bytes_written >= kNumPeerMetricsMessages * strlen("hello") &&
+          peer.messages_read > 0) {
+        found_child = true;
+      }
+    }
+    EXPECT_TRUE(found_child);
+
+    WriteString(h, "exit");
+  END_CHILD()
+}
+
+// Adds a second I/O thread for this process's channels to other processes,
+// once per test process. It's leaked, since it has to outlive the primary I/O
+// thread.
+void AddSecondaryIOThread() {
+  static base::TestIOThread* io_thread = nullptr;
+  if (io_thread)
+    return;
+  io_thread = new base::TestIOThread(base::TestIOThread::kAutoStart);
+  AddIPCIOThread(io_thread->task_runner());
+}
+
+const int kKilledClientExitCode = 42;
+
+// Swaps pipes with the parent and a sibling over them, then dies without
+// closing anything when the parent says so.
+DEFINE_TEST_CLIENT_WITH_PIPE(SecondaryIOThreadClient,
+                             MultiprocessMessagePipeTest, h) {
+  MojoHandle p;
+  EXPECT_EQ("pipe", ReadStringWithHandles(h, &p, 1));
+  WriteString(p, "hello from child");
+
+  CREATE_PIPE(q0, q1);
+  WriteStringWithHandles(h, "pipe", &q1, 1);
+  EXPECT_EQ("hello from parent", ReadString(q0));
+  WriteString(q0, "hello from child");
+
+  MojoHandle sibling;
+  EXPECT_EQ("sibling", ReadStringWithHandles(h, &sibling, 1));
+  WriteString(sibling, "hello sibling");
+  EXPECT_EQ("hello sibling", ReadString(sibling));
+  WriteString(h, "ready");
+
+  EXPECT_EQ("die", ReadString(h));
+  _Exit(::testing::Test::HasFailure() ? 1 : kKilledClientExitCode);
+}
+
+TEST_F(MultiprocessMessagePipeTest, SecondaryIOThread) {
+  AddSecondaryIOThread();
+
+  // Channels to new children alternate between the two I/O threads, so one of
+  // these children is connected on each.
+  RUN_CHILD_ON_PIPE(SecondaryIOThreadClient, h0)
+    RUN_CHILD_ON_PIPE(SecondaryIOThreadClient, h1)
+      MojoHandle children[] = {h0, h1};
+      std::vector<MojoHandle> child_pipes;
+      for (MojoHandle h : children) {
+        CREATE_PIPE(p0, p1);
+        WriteStringWithHandles(h, "pipe", &p1, 1);
+        EXPECT_EQ("hello from child", ReadString(p0));
+
+        MojoHandle q;
+        EXPECT_EQ("pipe", ReadStringWithHandles(h, &q, 1));
+        WriteString(q, "hello from parent");
+        EXPECT_EQ("hello from child", ReadString(q));
+
+        child_pipes.push_back(p0);
+        child_pipes.push_back(q);
+      }
+
+      // The children have to be introduced to each other, whichever threads
+      // their channels to this process are on.
+      CREATE_PIPE(s0, s1);
+      WriteStringWithHandles(h0, "sibling", &s0, 1);
+      WriteStringWithHandles(h1, "sibling", &s1, 1);
+
+      for (MojoHandle h : children)
+        EXPECT_EQ("ready", ReadString(h));
+
+      // Neither child closes anything before it dies, so its pipes are only
+      // closed once its channel's error reaches the primary I/O thread.
+      for (MojoHandle h : children)
+        WriteString(h, "die");
+      for (MojoHandle h : children) {
+        EXPECT_EQ(MOJO_RESULT_OK, MojoWait(h, MOJO_HANDLE_SIGNAL_PEER_CLOSED,
+                                           MOJO_DEADLINE_INDEFINITE, nullptr));
+      }
+      for (MojoHandle pipe : child_pipes) {
+        EXPECT_EQ(MOJO_RESULT_OK, MojoWait(pipe, MOJO_HANDLE_SIGNAL_PEER_CLOSED,
+                                           MOJO_DEADLINE_INDEFINITE, nullptr));
+        EXPECT_EQ(MOJO_RESULT_OK, MojoClose(pipe));
+      }
+    END_CHILD_AND_EXPECT_EXIT_CODE(kKilledClientExitCode);
+  END_CHILD_AND_EXPECT_EXIT_CODE(kKilledClientExitCode);
+}
+
 }  // namespace
 }  // namespace edk
 }  // namespace mojo
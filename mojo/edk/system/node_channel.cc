@@ -4,12 +4,19 @@
 
 #include "mojo/edk/system/node_channel.h"
 
+#include <algorithm>
 #include <cstring>
 #include <limits>
 #include <sstream>
 
+#include "base/bind.h"
+#include "base/location.h"
 #include "base/logging.h"
 #include "mojo/edk/system/channel.h"
+#include "mojo/edk/system/message_for_transit.h"
+#include "mojo/edk/system/metrics_registry.h"
+#include "mojo/edk/system/ports/event.h"
+#include "mojo/edk/system/ports_message.h"
 
 namespace mojo {
 namespace edk {
@@ -24,24 +31,66 @@ enum class MessageType : uint32_t {
   CONNECT_TO_PORT,
   REQUEST_INTRODUCTION,
   INTRODUCE,
+  REQUEST_INTRODUCTIONS,
+  PROVIDE_PORT_POOL,
+  CLAIM_POOLED_PORT,
+  COMPACT_PORTS_MESSAGE,
+  GRANT_CREDIT,
 };
 
 struct Header {
   MessageType type;
-  uint32_t padding;
+
+  // A combination of the kHeaderFlags below. Zero for anything but a
+  // PORTS_MESSAGE.
+  uint32_t flags;
 };
 
 static_assert(sizeof(Header) % kChannelMessageAlignment == 0,
     "Invalid header size.");
 
+// Set in the |flags| of AcceptChildData and AcceptParentData by a node which
+// wants the Channel compressed. Each end enables compression only if both
+// set it.
+const uint32_t kAcceptFlagCompression = 1 << 0;
+
+// Set likewise by a node which can read COMPACT_PORTS_MESSAGEs. Each end
+// writes them only once the other has set it.
+const uint32_t kAcceptFlagCompactPortsMessages = 1 << 1;
+
+// Set likewise by a node which grants credit for the ports messages it
+// consumes. Each end counts what it writes against the credit it's granted,
+// marking those messages as counted, only once the other has set it.
+const uint32_t kAcceptFlagCreditFlowControl = 1 << 2;
+
+// Set on a PORTS_MESSAGE which its writer counts against the credit it's
+// granted, as it does every ports message written once the other end has set
+// kAcceptFlagCreditFlowControl. Only these are granted credit for, so that
+// both ends count the same messages, however those written around the time
+// the flag took effect are ordered.
+const uint32_t kHeaderFlagCounted = 1 << 0;
+
+// How many bytes of ports messages may be written to a channel before the
+// other end has said it consumed them. Beyond this the remote node is
+// reported congested, until enough credit comes back to bring it under half.
+const size_t kCreditWindowBytes = 8 * 1024 * 1024;
+
+// How many bytes of ports messages a node consumes before granting credit
+// for them. Must be well below the window, or a sender could wait forever.
+const size_t kCreditGrantThresholdBytes = kCreditWindowBytes / 4;
+
 struct AcceptChildData {
   ports::NodeName parent_name;
   ports::NodeName token;
+  uint32_t flags;
+  uint32_t padding;
 };
 
 struct AcceptParentData {
   ports::NodeName token;
   ports::NodeName child_name;
+  uint32_t flags;
+  uint32_t padding;
 };
 
 // This is followed by arbitrary payload data which is interpreted as a token
@@ -64,16 +113,107 @@ struct IntroductionData {
   ports::NodeName name;
 };
 
+// This is followed by |num_names| NodeNames, each to be handled as a separate
+// REQUEST_INTRODUCTION.
+struct RequestIntroductionsData {
+  uint32_t num_names;
+  uint32_t padding;
+};
+
+// This is followed by |num_ports| NodeChannel::PooledPortNames.
+struct ProvidePortPoolData {
+  uint32_t num_ports;
+  uint32_t padding;
+};
+
+// This is followed by arbitrary payload data which is interpreted as a token
+// string for port location, as in RequestPortConnectionData.
+struct ClaimPooledPortData {
+  ports::PortName pooled_port_name;
+};
+
+// Tells the recipient that |num_bytes| more bytes of the counted ports messages
+// it wrote have been consumed, measured by their Channel payload size.
+struct GrantCreditData {
+  uint64_t num_bytes;
+};
+
+// A user message with no ports, platform handles, dispatchers or shared buffer,
+// small enough for a PortsMessage to keep inline, may be written as a
+// COMPACT_PORTS_MESSAGE rather than a PORTS_MESSAGE. Its MessageType isn't
+// padded, and is followed by:
+//
+//   uint8_t flags, a combination of the kCompactFlags below
+//   varint ID of the destination port
+//   PortName of the destination port, if kCompactFlagDefinesPort is set
+//   varint sequence number
+//   varint trace ID, if kCompactFlagHasTraceId is set
+//   the payload, without its MessageForTransit::MessageHeader
+//
+// Varints are little-endian base 128. Port IDs are local to the channel and
+// direction: the writer assigns an ID to a port name the first time it sends
+// to it, and says so by setting kCompactFlagDefinesPort. An ID may later be
+// redefined to stand for a different port.
+const uint8_t kCompactFlagDefinesPort = 1 << 0;
+const uint8_t kCompactFlagHasTraceId = 1 << 1;
+// Like kHeaderFlagCounted, for a compact message.
+const uint8_t kCompactFlagCounted = 1 << 2;
+
+// The most port IDs in use in each direction of a channel. Kept small so that
+// IDs fit in one or two bytes.
+const uint32_t kMaxCompactPortIds = 256;
+
+const size_t kMaxVarintBytes = 10;
+
+// What a compact message leaves out of the PORTS_MESSAGE it stands for.
+const size_t kCompactedPrefixBytes =
+    sizeof(ports::EventHeader) + sizeof(ports::UserEventData) +
+    sizeof(MessageForTransit::MessageHeader);
+
+// What it puts in their place, at most.
+const size_t kMaxCompactPrefixBytes =
+    sizeof(MessageType) + 1 + kMaxVarintBytes + sizeof(ports::PortName) +
+    2 * kMaxVarintBytes;
+
+static_assert(kMaxCompactPrefixBytes < sizeof(Header) + kCompactedPrefixBytes,
+              "Compact messages must be smaller than what they stand for.");
+
+size_t WriteVarint(uint64_t value, uint8_t* bytes) {
+  size_t num_bytes = 0;
+  while (value >= 0x80) {
+    bytes[num_bytes++] = static_cast<uint8_t>(value | 0x80);
+    value >>= 7;
+  }
+  bytes[num_bytes++] = static_cast<uint8_t>(value);
+  return num_bytes;
+}
+
+bool ReadVarint(const uint8_t** bytes, const uint8_t* end, uint64_t* value) {
+  uint64_t result = 0;
+  for (size_t shift = 0; shift < 64; shift += 7) {
+    if (*bytes == end)
+      return false;
+    uint8_t byte = *(*bytes)++;
+    result |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      *value = result;
+      return true;
+    }
+  }
+  return false;
+}
+
 template <typename DataType>
 Channel::MessagePtr CreateMessage(MessageType type,
                                   size_t payload_size,
                                   ScopedPlatformHandleVectorPtr handles,
                                   DataType** out_data) {
-  Channel::MessagePtr message(
-      new Channel::Message(sizeof(Header) + payload_size, std::move(handles)));
+  Channel::MessagePtr message =
+      Channel::Message::Create(sizeof(Header) + payload_size,
+                               std::move(handles));
   Header* header = reinterpret_cast<Header*>(message->mutable_payload());
   header->type = type;
-  header->padding = 0;
+  header->flags = 0;
   *out_data = reinterpret_cast<DataType*>(&header[1]);
   return message;
 };
@@ -90,8 +230,11 @@ void GetMessagePayload(const void* bytes, DataType** out_data) {
 scoped_refptr<NodeChannel> NodeChannel::Create(
     Delegate* delegate,
     ScopedPlatformHandle platform_handle,
-    scoped_refptr<base::TaskRunner> io_task_runner) {
-  return new NodeChannel(delegate, std::move(platform_handle), io_task_runner);
+    Channel::Transport transport,
+    scoped_refptr<base::TaskRunner> io_task_runner,
+    scoped_refptr<base::TaskRunner> delegate_task_runner) {
+  return new NodeChannel(delegate, std::move(platform_handle), transport,
+                         io_task_runner, delegate_task_runner);
 }
 
 // static
@@ -103,6 +246,15 @@ Channel::MessagePtr NodeChannel::CreatePortsMessage(
                        std::move(platform_handles), payload);
 }
 
+// static
+void NodeChannel::GetPortsMessageData(Channel::Message* message,
+                                      void** data,
+                                      size_t* num_data_bytes) {
+  DCHECK_GE(message->payload_size(), sizeof(Header));
+  *data = reinterpret_cast<Header*>(message->mutable_payload()) + 1;
+  *num_data_bytes = message->payload_size() - sizeof(Header);
+}
+
 void NodeChannel::Start() {
   base::AutoLock lock(channel_lock_);
   DCHECK(channel_);
@@ -117,8 +269,25 @@ void NodeChannel::ShutDown() {
   }
 }
 
+ScopedPlatformHandle NodeChannel::DuplicatePlatformHandle() {
+  base::AutoLock lock(channel_lock_);
+  if (!channel_)
+    return ScopedPlatformHandle();
+  return channel_->DuplicatePlatformHandle();
+}
+
+void NodeChannel::GetChannelStats(Channel::Stats* stats) {
+  base::AutoLock lock(channel_lock_);
+  if (!channel_) {
+    *stats = Channel::Stats();
+    return;
+  }
+  channel_->GetStats(stats);
+}
+
 void NodeChannel::SetRemoteNodeName(const ports::NodeName& name) {
-  DCHECK(io_task_runner_->RunsTasksOnCurrentThread());
+  DCHECK(delegate_task_runner_->RunsTasksOnCurrentThread());
+  base::AutoLock lock(remote_node_name_lock_);
   remote_node_name_ = name;
 }
 
@@ -135,6 +304,8 @@ void NodeChannel::AcceptChild(const ports::NodeName& parent_name,
       MessageType::ACCEPT_CHILD, sizeof(AcceptChildData), nullptr, &data);
   data->parent_name = parent_name;
   data->token = token;
+  data->flags = GetAcceptFlags();
+  data->padding = 0;
   channel_->Write(std::move(message));
 }
 
@@ -151,6 +322,8 @@ void NodeChannel::AcceptParent(const ports::NodeName& token,
       MessageType::ACCEPT_PARENT, sizeof(AcceptParentData), nullptr, &data);
   data->token = token;
   data->child_name = child_name;
+  data->flags = GetAcceptFlags();
+  data->padding = 0;
   channel_->Write(std::move(message));
 }
 
@@ -161,6 +334,16 @@ void NodeChannel::PortsMessage(Channel::MessagePtr message) {
     return;
   }
 
+  if (compact_ports_messages_enabled_)
+    MaybeCompactPortsMessage(message.get());
+  if (credit_flow_control_enabled_) {
+    MarkCounted(message.get());
+    unconsumed_bytes_ += message->payload_size();
+    if (!congested_ && unconsumed_bytes_ > kCreditWindowBytes) {
+      congested_ = true;
+      PostCongestionChange();
+    }
+  }
   channel_->Write(std::move(message));
 }
 
@@ -213,6 +396,67 @@ void NodeChannel::RequestIntroduction(const ports::NodeName& name) {
   channel_->Write(std::move(message));
 }
 
+void NodeChannel::RequestIntroductions(
+    const std::vector<ports::NodeName>& names) {
+  DCHECK_LE(names.size(), std::numeric_limits<uint32_t>::max());
+
+  base::AutoLock lock(channel_lock_);
+  if (!channel_) {
+    DVLOG(2) << "Not sending RequestIntroductions on closed Channel.";
+    return;
+  }
+
+  RequestIntroductionsData* data;
+  Channel::MessagePtr message = CreateMessage(
+      MessageType::REQUEST_INTRODUCTIONS,
+      sizeof(RequestIntroductionsData) + names.size() * sizeof(ports::NodeName),
+      nullptr, &data);
+  data->num_names = static_cast<uint32_t>(names.size());
+  data->padding = 0;
+  std::copy(names.begin(), names.end(),
+            reinterpret_cast<ports::NodeName*>(data + 1));
+  channel_->Write(std::move(message));
+}
+
+void NodeChannel::ProvidePortPool(
+    const std::vector<PooledPortNames>& port_names) {
+  DCHECK_LE(port_names.size(), std::numeric_limits<uint32_t>::max());
+
+  base::AutoLock lock(channel_lock_);
+  if (!channel_) {
+    DVLOG(2) << "Not sending ProvidePortPool on closed Channel.";
+    return;
+  }
+
+  ProvidePortPoolData* data;
+  Channel::MessagePtr message = CreateMessage(
+      MessageType::PROVIDE_PORT_POOL,
+      sizeof(ProvidePortPoolData) + port_names.size() * sizeof(PooledPortNames),
+      nullptr, &data);
+  data->num_ports = static_cast<uint32_t>(port_names.size());
+  data->padding = 0;
+  std::copy(port_names.begin(), port_names.end(),
+            reinterpret_cast<PooledPortNames*>(data + 1));
+  channel_->Write(std::move(message));
+}
+
+void NodeChannel::ClaimPooledPort(const ports::PortName& pooled_port_name,
+                                  const std::string& token) {
+  base::AutoLock lock(channel_lock_);
+  if (!channel_) {
+    DVLOG(2) << "Not sending ClaimPooledPort on closed Channel.";
+    return;
+  }
+
+  ClaimPooledPortData* data;
+  Channel::MessagePtr message = CreateMessage(
+      MessageType::CLAIM_POOLED_PORT,
+      sizeof(ClaimPooledPortData) + token.size(), nullptr, &data);
+  data->pooled_port_name = pooled_port_name;
+  memcpy(data + 1, token.data(), token.size());
+  channel_->Write(std::move(message));
+}
+
 void NodeChannel::Introduce(const ports::NodeName& name,
                             ScopedPlatformHandle handle) {
   base::AutoLock lock(channel_lock_);
@@ -236,11 +480,16 @@ void NodeChannel::Introduce(const ports::NodeName& name,
 
 NodeChannel::NodeChannel(Delegate* delegate,
                          ScopedPlatformHandle platform_handle,
-                         scoped_refptr<base::TaskRunner> io_task_runner)
+                         Channel::Transport transport,
+                         scoped_refptr<base::TaskRunner> io_task_runner,
+                         scoped_refptr<base::TaskRunner> delegate_task_runner)
     : delegate_(delegate),
       io_task_runner_(io_task_runner),
-      channel_(
-          Channel::Create(this, std::move(platform_handle), io_task_runner_)) {
+      delegate_task_runner_(delegate_task_runner),
+      compression_allowed_(transport == Channel::Transport::PLATFORM_HANDLE &&
+                           Channel::GetCompressionThreshold() > 0),
+      channel_(Channel::Create(this, std::move(platform_handle), transport,
+                               io_task_runner_)) {
 }
 
 NodeChannel::~NodeChannel() {
@@ -252,12 +501,51 @@ void NodeChannel::OnChannelMessage(const void* payload,
                                    ScopedPlatformHandleVectorPtr handles) {
   DCHECK(io_task_runner_->RunsTasksOnCurrentThread());
 
+  // Credit is as good as it'll ever be as soon as it arrives, so it isn't
+  // made to wait behind the delegate's other work.
+  const Header* header = static_cast<const Header*>(payload);
+  if (header->type != MessageType::PORTS_MESSAGE &&
+      header->type != MessageType::COMPACT_PORTS_MESSAGE &&
+      header->type != MessageType::GRANT_CREDIT) {
+    // Make sure any ports messages the delegate may be holding on to are
+    // processed before anything else from the same channel.
+    FlushPortsMessages();
+
+    if (!delegate_task_runner_->RunsTasksOnCurrentThread()) {
+      // Everything but ports messages is handled on the delegate's thread,
+      // in the order received.
+      Channel::MessagePtr message =
+          Channel::Message::Create(payload_size, std::move(handles));
+      memcpy(message->mutable_payload(), payload, payload_size);
+      delegate_task_runner_->PostTask(
+          FROM_HERE, base::Bind(&NodeChannel::DispatchControlMessage, this,
+                                base::Passed(&message)));
+      return;
+    }
+  }
+
+  ProcessMessage(payload, payload_size, std::move(handles));
+}
+
+void NodeChannel::DispatchControlMessage(Channel::MessagePtr message) {
+  DCHECK(delegate_task_runner_->RunsTasksOnCurrentThread());
+  ScopedPlatformHandleVectorPtr handles = message->TakeHandles();
+  ProcessMessage(message->payload(), message->payload_size(),
+                  std::move(handles));
+}
+
+void NodeChannel::ProcessMessage(const void* payload,
+                                 size_t payload_size,
+                                 ScopedPlatformHandleVectorPtr handles) {
   const Header* header = static_cast<const Header*>(payload);
+  const ports::NodeName remote_node_name = GetRemoteNodeName();
+
   switch (header->type) {
     case MessageType::ACCEPT_CHILD: {
       const AcceptChildData* data;
       GetMessagePayload(payload, &data);
-      delegate_->OnAcceptChild(remote_node_name_, data->parent_name,
+      ApplyRemoteAcceptFlags(data->flags);
+      delegate_->OnAcceptChild(remote_node_name, data->parent_name,
                                data->token);
       break;
     }
@@ -265,7 +553,8 @@ void NodeChannel::OnChannelMessage(const void* payload,
     case MessageType::ACCEPT_PARENT: {
       const AcceptParentData* data;
       GetMessagePayload(payload, &data);
-      delegate_->OnAcceptParent(remote_node_name_, data->token,
+      ApplyRemoteAcceptFlags(data->flags);
+      delegate_->OnAcceptParent(remote_node_name, data->token,
                                 data->child_name);
       break;
     }
@@ -273,9 +562,41 @@ void NodeChannel::OnChannelMessage(const void* payload,
     case MessageType::PORTS_MESSAGE: {
       const void* data;
       GetMessagePayload(payload, &data);
-      delegate_->OnPortsMessage(remote_node_name_, data,
+      delegate_->OnPortsMessage(remote_node_name, data,
                                 payload_size - sizeof(Header),
                                 std::move(handles));
+      has_undispatched_ports_messages_ = true;
+      if (header->flags & kHeaderFlagCounted)
+        DidReceiveCountedMessage(payload_size);
+      break;
+    }
+
+    case MessageType::COMPACT_PORTS_MESSAGE: {
+      if (!ProcessCompactPortsMessage(remote_node_name, payload,
+                                      payload_size)) {
+        DLOG(ERROR) << "Received invalid compact ports message from node "
+                    << remote_node_name;
+        delegate_->OnChannelError(remote_node_name);
+        break;
+      }
+      // The flags follow the unpadded MessageType, as validated above.
+      const uint8_t flags =
+          static_cast<const uint8_t*>(payload)[sizeof(MessageType)];
+      if (flags & kCompactFlagCounted)
+        DidReceiveCountedMessage(payload_size);
+      break;
+    }
+
+    case MessageType::GRANT_CREDIT: {
+      if (payload_size < sizeof(Header) + sizeof(GrantCreditData)) {
+        DLOG(ERROR) << "Received invalid credit grant from node "
+                    << remote_node_name;
+        delegate_->OnChannelError(remote_node_name);
+        break;
+      }
+      const GrantCreditData* data;
+      GetMessagePayload(payload, &data);
+      OnGrantCredit(data->num_bytes);
       break;
     }
 
@@ -287,7 +608,7 @@ void NodeChannel::OnChannelMessage(const void* payload,
       const size_t token_size = payload_size - sizeof(*data) - sizeof(Header);
       std::string token(token_data, token_size);
 
-      delegate_->OnRequestPortConnection(remote_node_name_,
+      delegate_->OnRequestPortConnection(remote_node_name,
                                          data->connector_port_name, token);
       break;
     }
@@ -295,7 +616,7 @@ void NodeChannel::OnChannelMessage(const void* payload,
     case MessageType::CONNECT_TO_PORT: {
       const ConnectToPortData* data;
       GetMessagePayload(payload, &data);
-      delegate_->OnConnectToPort(remote_node_name_, data->connector_port_name,
+      delegate_->OnConnectToPort(remote_node_name, data->connector_port_name,
                                  data->connectee_port_name);
       break;
     }
@@ -303,7 +624,26 @@ void NodeChannel::OnChannelMessage(const void* payload,
     case MessageType::REQUEST_INTRODUCTION: {
       const IntroductionData* data;
       GetMessagePayload(payload, &data);
-      delegate_->OnRequestIntroduction(remote_node_name_, data->name);
+      delegate_->OnRequestIntroduction(remote_node_name, data->name);
+      break;
+    }
+
+    case MessageType::REQUEST_INTRODUCTIONS: {
+      const RequestIntroductionsData* data;
+      GetMessagePayload(payload, &data);
+      if (payload_size < sizeof(Header) + sizeof(*data) ||
+          data->num_names > (payload_size - sizeof(Header) - sizeof(*data)) /
+                                sizeof(ports::NodeName)) {
+        DLOG(ERROR) << "Received invalid RequestIntroductions message from "
+                    << "node " << remote_node_name;
+        delegate_->OnChannelError(remote_node_name);
+        break;
+      }
+
+      const ports::NodeName* names =
+          reinterpret_cast<const ports::NodeName*>(data + 1);
+      for (uint32_t i = 0; i < data->num_names; ++i)
+        delegate_->OnRequestIntroduction(remote_node_name, names[i]);
       break;
     }
 
@@ -315,24 +655,350 @@ void NodeChannel::OnChannelMessage(const void* payload,
         handle = ScopedPlatformHandle(handles->at(0));
         handles->clear();
       }
-      delegate_->OnIntroduce(remote_node_name_, data->name, std::move(handle));
+      delegate_->OnIntroduce(remote_node_name, data->name, std::move(handle));
+      break;
+    }
+
+    case MessageType::PROVIDE_PORT_POOL: {
+      const ProvidePortPoolData* data;
+      GetMessagePayload(payload, &data);
+      if (payload_size < sizeof(Header) + sizeof(*data) ||
+          data->num_ports > (payload_size - sizeof(Header) - sizeof(*data)) /
+                                sizeof(PooledPortNames)) {
+        DLOG(ERROR) << "Received invalid ProvidePortPool message from "
+                    << "node " << remote_node_name;
+        delegate_->OnChannelError(remote_node_name);
+        break;
+      }
+
+      const PooledPortNames* port_names =
+          reinterpret_cast<const PooledPortNames*>(data + 1);
+      delegate_->OnProvidePortPool(
+          remote_node_name,
+          std::vector<PooledPortNames>(port_names,
+                                       port_names + data->num_ports));
+      break;
+    }
+
+    case MessageType::CLAIM_POOLED_PORT: {
+      const ClaimPooledPortData* data;
+      GetMessagePayload(payload, &data);
+      if (payload_size < sizeof(Header) + sizeof(*data)) {
+        DLOG(ERROR) << "Received invalid ClaimPooledPort message from "
+                    << "node " << remote_node_name;
+        delegate_->OnChannelError(remote_node_name);
+        break;
+      }
+
+      const char* token_data = reinterpret_cast<const char*>(data + 1);
+      const size_t token_size = payload_size - sizeof(*data) - sizeof(Header);
+      std::string token(token_data, token_size);
+
+      delegate_->OnClaimPooledPort(remote_node_name, data->pooled_port_name,
+                                   token);
       break;
     }
 
     default:
       DLOG(ERROR) << "Received unknown message type "
                   << static_cast<uint32_t>(header->type) << " from node "
-                  << remote_node_name_;
-      delegate_->OnChannelError(remote_node_name_);
+                  << remote_node_name;
+      delegate_->OnChannelError(remote_node_name);
       break;
   }
 }
 
+void NodeChannel::OnOwnedChannelMessage(Channel::MessagePtr message) {
+  DCHECK(io_task_runner_->RunsTasksOnCurrentThread());
+
+  const Header* header = static_cast<const Header*>(message->payload());
+  if (header->type != MessageType::PORTS_MESSAGE) {
+    // Nothing else benefits from owning its buffer.
+    ScopedPlatformHandleVectorPtr handles = message->TakeHandles();
+    OnChannelMessage(message->payload(), message->payload_size(),
+                     std::move(handles));
+    return;
+  }
+
+  const size_t payload_size = message->payload_size();
+  const bool counted = (header->flags & kHeaderFlagCounted) != 0;
+  delegate_->OnPortsChannelMessage(GetRemoteNodeName(), std::move(message));
+  has_undispatched_ports_messages_ = true;
+  if (counted)
+    DidReceiveCountedMessage(payload_size);
+}
+
+void NodeChannel::OnChannelReadComplete() {
+  DCHECK(io_task_runner_->RunsTasksOnCurrentThread());
+  FlushPortsMessages();
+}
+
 void NodeChannel::OnChannelError() {
   DCHECK(io_task_runner_->RunsTasksOnCurrentThread());
 
+  FlushPortsMessages();
   ShutDown();
-  delegate_->OnChannelError(remote_node_name_);
+  delegate_->OnChannelError(GetRemoteNodeName());
+}
+
+void NodeChannel::FlushPortsMessages() {
+  if (!has_undispatched_ports_messages_)
+    return;
+  has_undispatched_ports_messages_ = false;
+  delegate_->OnPortsMessagesDispatched(GetRemoteNodeName());
+
+  // The delegate has accepted everything it was holding on to by now, so the
+  // sender can be told it's been consumed.
+  if (ungranted_bytes_ >= kCreditGrantThresholdBytes)
+    GrantCredit();
+}
+
+void NodeChannel::DidReceiveCountedMessage(size_t payload_size) {
+  DCHECK(io_task_runner_->RunsTasksOnCurrentThread());
+  ungranted_bytes_ += payload_size;
+}
+
+void NodeChannel::GrantCredit() {
+  DCHECK(io_task_runner_->RunsTasksOnCurrentThread());
+
+  // Only a writer which has agreed to credit flow control marks messages as
+  // counted, so credit is granted for them whether or not this end has seen
+  // its AcceptChild or AcceptParent yet.
+  base::AutoLock lock(channel_lock_);
+  if (!channel_)
+    return;
+
+  GrantCreditData* data;
+  Channel::MessagePtr message = CreateMessage(
+      MessageType::GRANT_CREDIT, sizeof(GrantCreditData), nullptr, &data);
+  data->num_bytes = ungranted_bytes_;
+  channel_->Write(std::move(message));
+  ungranted_bytes_ = 0;
+}
+
+void NodeChannel::OnGrantCredit(uint64_t num_bytes) {
+  base::AutoLock lock(channel_lock_);
+  if (num_bytes > unconsumed_bytes_) {
+    DLOG(ERROR) << "Received more credit than was outstanding.";
+    num_bytes = unconsumed_bytes_;
+  }
+  unconsumed_bytes_ -= num_bytes;
+  if (congested_ && unconsumed_bytes_ <= kCreditWindowBytes / 2) {
+    congested_ = false;
+    PostCongestionChange();
+  }
+}
+
+void NodeChannel::PostCongestionChange() {
+  channel_lock_.AssertAcquired();
+  delegate_task_runner_->PostTask(
+      FROM_HERE, base::Bind(&NodeChannel::NotifyCongestionChange, this));
+}
+
+void NodeChannel::NotifyCongestionChange() {
+  DCHECK(delegate_task_runner_->RunsTasksOnCurrentThread());
+
+  // Changes may be posted from more than one thread, so rather than say what
+  // each one was, this says what the state is now if the delegate was last
+  // told otherwise.
+  bool congested;
+  {
+    base::AutoLock lock(channel_lock_);
+    congested = congested_;
+  }
+  if (congested == reported_congested_)
+    return;
+  reported_congested_ = congested;
+  delegate_->OnPeerCongestionChanged(GetRemoteNodeName(), congested);
+}
+
+uint32_t NodeChannel::GetAcceptFlags() const {
+  return (compression_allowed_ ? kAcceptFlagCompression : 0) |
+         kAcceptFlagCompactPortsMessages | kAcceptFlagCreditFlowControl;
+}
+
+void NodeChannel::ApplyRemoteAcceptFlags(uint32_t remote_accept_flags) {
+  base::AutoLock lock(channel_lock_);
+  if (remote_accept_flags & kAcceptFlagCompactPortsMessages)
+    compact_ports_messages_enabled_ = true;
+  if (remote_accept_flags & kAcceptFlagCreditFlowControl)
+    credit_flow_control_enabled_ = true;
+  if (channel_ && compression_allowed_ &&
+      (remote_accept_flags & kAcceptFlagCompression)) {
+    channel_->EnableCompression();
+  }
+}
+
+void NodeChannel::MarkCounted(Channel::Message* message) {
+  channel_lock_.AssertAcquired();
+
+  Header* header = static_cast<Header*>(message->mutable_payload());
+  if (header->type == MessageType::PORTS_MESSAGE) {
+    header->flags |= kHeaderFlagCounted;
+  } else {
+    DCHECK(header->type == MessageType::COMPACT_PORTS_MESSAGE);
+    static_cast<uint8_t*>(message->mutable_payload())[sizeof(MessageType)] |=
+        kCompactFlagCounted;
+  }
+}
+
+void NodeChannel::MaybeCompactPortsMessage(Channel::Message* message) {
+  channel_lock_.AssertAcquired();
+
+  const size_t payload_size = message->payload_size();
+  if (message->num_handles() > 0 || message->flags() != 0 ||
+      payload_size < sizeof(Header) + kCompactedPrefixBytes ||
+      payload_size - sizeof(Header) > PortsMessage::kMaxInlineBytes) {
+    return;
+  }
+
+  char* payload = static_cast<char*>(message->mutable_payload());
+  const Header* header = reinterpret_cast<const Header*>(payload);
+  const ports::EventHeader* event =
+      reinterpret_cast<const ports::EventHeader*>(header + 1);
+  const ports::UserEventData* event_data =
+      reinterpret_cast<const ports::UserEventData*>(event + 1);
+  const MessageForTransit::MessageHeader* message_header =
+      reinterpret_cast<const MessageForTransit::MessageHeader*>(
+          event_data + 1);
+  // Bulk messages are left alone as well, because the Channel may write them
+  // after compact messages written later, which might then use a port ID
+  // before its definition.
+  if (header->type != MessageType::PORTS_MESSAGE ||
+      event->type != ports::EventType::kUser || event_data->num_ports != 0 ||
+      event_data->priority != 0 || message_header->num_dispatchers != 0 ||
+      message_header->header_size != sizeof(*message_header) ||
+      message_header->num_shared_bytes != 0 || message_header->padding != 0) {
+    return;
+  }
+
+  uint8_t prefix[kMaxCompactPrefixBytes];
+  const MessageType type = MessageType::COMPACT_PORTS_MESSAGE;
+  memcpy(prefix, &type, sizeof(type));
+  size_t num_prefix_bytes = sizeof(type);
+  uint8_t* flags = &prefix[num_prefix_bytes++];
+  *flags = 0;
+
+  uint32_t port_id;
+  auto it = sent_port_ids_.find(event->port_name);
+  if (it != sent_port_ids_.end()) {
+    port_id = it->second;
+    num_prefix_bytes += WriteVarint(port_id, &prefix[num_prefix_bytes]);
+  } else {
+    port_id = next_sent_port_id_;
+    next_sent_port_id_ = (next_sent_port_id_ + 1) % kMaxCompactPortIds;
+    if (port_id < sent_port_names_.size()) {
+      sent_port_ids_.erase(sent_port_names_[port_id]);
+      sent_port_names_[port_id] = event->port_name;
+    } else {
+      sent_port_names_.push_back(event->port_name);
+    }
+    sent_port_ids_[event->port_name] = port_id;
+
+    *flags |= kCompactFlagDefinesPort;
+    num_prefix_bytes += WriteVarint(port_id, &prefix[num_prefix_bytes]);
+    memcpy(&prefix[num_prefix_bytes], &event->port_name,
+           sizeof(event->port_name));
+    num_prefix_bytes += sizeof(event->port_name);
+  }
+
+  num_prefix_bytes +=
+      WriteVarint(event_data->sequence_num, &prefix[num_prefix_bytes]);
+  if (event->trace_id) {
+    *flags |= kCompactFlagHasTraceId;
+    num_prefix_bytes += WriteVarint(event->trace_id, &prefix[num_prefix_bytes]);
+  }
+
+  const size_t num_data_bytes =
+      payload_size - sizeof(Header) - kCompactedPrefixBytes;
+  memmove(payload + num_prefix_bytes,
+          payload + sizeof(Header) + kCompactedPrefixBytes, num_data_bytes);
+  memcpy(payload, prefix, num_prefix_bytes);
+  message->TruncatePayload(num_prefix_bytes + num_data_bytes);
+  MetricsRegistry::Increment(MetricsRegistry::kChannelMessagesCompacted);
+}
+
+bool NodeChannel::ProcessCompactPortsMessage(
+    const ports::NodeName& remote_node_name,
+    const void* payload,
+    size_t payload_size) {
+  DCHECK(io_task_runner_->RunsTasksOnCurrentThread());
+
+  const uint8_t* bytes = static_cast<const uint8_t*>(payload);
+  const uint8_t* end = bytes + payload_size;
+  if (payload_size < sizeof(MessageType) + 1)
+    return false;
+  bytes += sizeof(MessageType);
+
+  const uint8_t flags = *bytes++;
+  if (flags &
+      ~(kCompactFlagDefinesPort | kCompactFlagHasTraceId | kCompactFlagCounted))
+    return false;
+
+  uint64_t port_id;
+  if (!ReadVarint(&bytes, end, &port_id) || port_id >= kMaxCompactPortIds)
+    return false;
+  if (flags & kCompactFlagDefinesPort) {
+    if (static_cast<size_t>(end - bytes) < sizeof(ports::PortName) ||
+        port_id > received_port_names_.size()) {
+      return false;
+    }
+    ports::PortName port_name;
+    memcpy(&port_name, bytes, sizeof(port_name));
+    bytes += sizeof(port_name);
+    if (port_id == received_port_names_.size()) {
+      received_port_names_.push_back(port_name);
+      received_ports_.push_back(ports::PortRef());
+    } else {
+      received_port_names_[port_id] = port_name;
+      received_ports_[port_id] = ports::PortRef();
+    }
+  } else if (port_id >= received_port_names_.size()) {
+    return false;
+  }
+
+  uint64_t sequence_num;
+  if (!ReadVarint(&bytes, end, &sequence_num))
+    return false;
+  uint64_t trace_id = 0;
+  if ((flags & kCompactFlagHasTraceId) &&
+      (!ReadVarint(&bytes, end, &trace_id) ||
+       trace_id > std::numeric_limits<uint32_t>::max())) {
+    return false;
+  }
+
+  const size_t num_data_bytes = end - bytes;
+  const size_t num_bytes = kCompactedPrefixBytes + num_data_bytes;
+  if (num_bytes > PortsMessage::kMaxInlineBytes)
+    return false;
+
+  uint64_t buffer[PortsMessage::kMaxInlineBytes / sizeof(uint64_t)];
+  ports::EventHeader* event = reinterpret_cast<ports::EventHeader*>(buffer);
+  event->type = ports::EventType::kUser;
+  event->trace_id = static_cast<uint32_t>(trace_id);
+  event->port_name = received_port_names_[port_id];
+  ports::UserEventData* event_data =
+      reinterpret_cast<ports::UserEventData*>(event + 1);
+  event_data->sequence_num = sequence_num;
+  event_data->num_ports = 0;
+  event_data->priority = 0;
+  MessageForTransit::MessageHeader* message_header =
+      reinterpret_cast<MessageForTransit::MessageHeader*>(event_data + 1);
+  message_header->num_dispatchers = 0;
+  message_header->header_size = sizeof(*message_header);
+  message_header->num_shared_bytes = 0;
+  message_header->padding = 0;
+  memcpy(message_header + 1, bytes, num_data_bytes);
+
+  delegate_->OnCompactPortsMessage(remote_node_name, buffer, num_bytes,
+                                   &received_ports_[port_id]);
+  has_undispatched_ports_messages_ = true;
+  return true;
+}
+
+ports::NodeName NodeChannel::GetRemoteNodeName() {
+  base::AutoLock lock(remote_node_name_lock_);
+  return remote_node_name_;
 }
 
 }  // namespace edk
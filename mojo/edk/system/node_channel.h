@@ -5,6 +5,9 @@
 #ifndef MOJO_EDK_SYSTEM_NODE_CHANNEL_H_
 #define MOJO_EDK_SYSTEM_NODE_CHANNEL_H_
 
+#include <unordered_map>
+#include <vector>
+
 #include "base/macros.h"
 #include "base/memory/ref_counted.h"
 #include "base/synchronization/lock.h"
@@ -12,7 +15,9 @@
 #include "mojo/edk/embedder/platform_handle_vector.h"
 #include "mojo/edk/embedder/scoped_platform_handle.h"
 #include "mojo/edk/system/channel.h"
+#include "mojo/edk/system/ports/hash_functions.h"
 #include "mojo/edk/system/ports/name.h"
+#include "mojo/edk/system/ports/port_ref.h"
 
 namespace mojo {
 namespace edk {
@@ -21,6 +26,13 @@ namespace edk {
 class NodeChannel : public base::RefCountedThreadSafe<NodeChannel>,
                     public Channel::Delegate {
  public:
+  // A port on the sending node, already initialized with a peer on the
+  // receiving node which the receiver is to create with |peer_port_name|.
+  struct PooledPortNames {
+    ports::PortName port_name;
+    ports::PortName peer_port_name;
+  };
+
   class Delegate {
    public:
     virtual ~Delegate() {}
@@ -30,11 +42,32 @@ class NodeChannel : public base::RefCountedThreadSafe<NodeChannel>,
     virtual void OnAcceptParent(const ports::NodeName& from_node,
                                 const ports::NodeName& token,
                                 const ports::NodeName& child_name) = 0;
+    // The delegate may defer processing of ports messages until
+    // OnPortsMessagesDispatched is called.
     virtual void OnPortsMessage(
         const ports::NodeName& from_node,
         const void* payload,
         size_t payload_size,
         ScopedPlatformHandleVectorPtr platform_handles) = 0;
+    // Like OnPortsMessage, but for a message which was received in its own
+    // buffer. The delegate takes ownership of |message|, including any
+    // attached handles, and may adopt its storage rather than copying it.
+    virtual void OnPortsChannelMessage(const ports::NodeName& from_node,
+                                       Channel::MessagePtr message) = 0;
+    // Like OnPortsMessage, for a user message which arrived in compact form.
+    // |destination_port| is the channel's cache of the port the message is
+    // addressed to, which the delegate may fill in if it isn't already that
+    // port. It's reset to a null PortRef whenever the channel is told the
+    // port it stands for has changed.
+    virtual void OnCompactPortsMessage(const ports::NodeName& from_node,
+                                       const void* payload,
+                                       size_t payload_size,
+                                       ports::PortRef* destination_port) = 0;
+    // Called after a run of one or more OnPortsMessage calls, once the
+    // channel has no more messages immediately available or before it
+    // dispatches any other kind of message or error.
+    virtual void OnPortsMessagesDispatched(
+        const ports::NodeName& from_node) = 0;
     virtual void OnRequestPortConnection(
         const ports::NodeName& from_node,
         const ports::PortName& connector_port_name,
@@ -48,27 +81,57 @@ class NodeChannel : public base::RefCountedThreadSafe<NodeChannel>,
     virtual void OnIntroduce(const ports::NodeName& from_name,
                              const ports::NodeName& name,
                              ScopedPlatformHandle channel_handle) = 0;
+    virtual void OnProvidePortPool(
+        const ports::NodeName& from_node,
+        const std::vector<PooledPortNames>& port_names) = 0;
+    virtual void OnClaimPooledPort(const ports::NodeName& from_node,
+                                   const ports::PortName& pooled_port_name,
+                                   const std::string& token) = 0;
+    // Called when more ports messages have been written to |node| than it
+    // has said it consumed, beyond what the channel allows, and again once
+    // it has caught up.
+    virtual void OnPeerCongestionChanged(const ports::NodeName& node,
+                                         bool congested) = 0;
 
     virtual void OnChannelError(const ports::NodeName& node) = 0;
   };
 
+  // The channel does its I/O on |io_task_runner|, which is also where the
+  // delegate is given ports messages, read completions and errors. All other
+  // messages are passed to the delegate on |delegate_task_runner|, which may
+  // be the same.
   static scoped_refptr<NodeChannel> Create(
       Delegate* delegate,
       ScopedPlatformHandle platform_handle,
-      scoped_refptr<base::TaskRunner> io_task_runner);
+      Channel::Transport transport,
+      scoped_refptr<base::TaskRunner> io_task_runner,
+      scoped_refptr<base::TaskRunner> delegate_task_runner);
 
   static Channel::MessagePtr CreatePortsMessage(
       size_t payload_size,
       void** payload,
       ScopedPlatformHandleVectorPtr platform_handles);
 
+  // Locates the ports message data within a Channel message created by
+  // CreatePortsMessage, or received as a PORTS_MESSAGE.
+  static void GetPortsMessageData(Channel::Message* message,
+                                  void** data,
+                                  size_t* num_data_bytes);
+
   // Start receiving messages.
   void Start();
 
   // Permanently stop the channel from sending or receiving messages.
   void ShutDown();
 
-  // Used for context in Delegate calls (via |from_node| arguments.)
+  // See Channel::DuplicatePlatformHandle.
+  ScopedPlatformHandle DuplicatePlatformHandle();
+
+  // See Channel::GetStats. Fills |stats| with zeros once shut down.
+  void GetChannelStats(Channel::Stats* stats);
+
+  // Used for context in Delegate calls (via |from_node| arguments.) Must be
+  // called on the delegate's thread.
   void SetRemoteNodeName(const ports::NodeName& name);
 
   void AcceptChild(const ports::NodeName& parent_name,
@@ -81,31 +144,125 @@ class NodeChannel : public base::RefCountedThreadSafe<NodeChannel>,
   void ConnectToPort(const ports::PortName& connector_port_name,
                      const ports::PortName& connectee_port_name);
   void RequestIntroduction(const ports::NodeName& name);
+  // Asks for introductions to each of |names| in a single message. The
+  // recipient handles it as one RequestIntroduction per name.
+  void RequestIntroductions(const std::vector<ports::NodeName>& names);
   void Introduce(const ports::NodeName& name, ScopedPlatformHandle handle);
+  // Gives the recipient ports it may use as peers of |port_names|, without
+  // waiting for a ConnectToPort. See NodeController::ClaimPooledParentPort.
+  void ProvidePortPool(const std::vector<PooledPortNames>& port_names);
+  // Tells the recipient that the peer of its pooled port |pooled_port_name| is
+  // now in use for the connection identified by |token|.
+  void ClaimPooledPort(const ports::PortName& pooled_port_name,
+                       const std::string& token);
 
  private:
   friend class base::RefCountedThreadSafe<NodeChannel>;
 
   NodeChannel(Delegate* delegate,
               ScopedPlatformHandle platform_handle,
-              scoped_refptr<base::TaskRunner> io_task_runner);
+              Channel::Transport transport,
+              scoped_refptr<base::TaskRunner> io_task_runner,
+              scoped_refptr<base::TaskRunner> delegate_task_runner);
   ~NodeChannel() override;
 
   // Channel::Delegate:
   void OnChannelMessage(const void* payload,
                         size_t payload_size,
                         ScopedPlatformHandleVectorPtr handles) override;
+  void OnOwnedChannelMessage(Channel::MessagePtr message) override;
+  void OnChannelReadComplete() override;
   void OnChannelError() override;
 
+  void DispatchControlMessage(Channel::MessagePtr message);
+  void ProcessMessage(const void* payload,
+                      size_t payload_size,
+                      ScopedPlatformHandleVectorPtr handles);
+  void FlushPortsMessages();
+  // Counts a ports message received which its writer counted towards the
+  // credit to be granted for it.
+  void DidReceiveCountedMessage(size_t payload_size);
+  // Tells the other end that the ports messages counted so far are consumed.
+  void GrantCredit();
+  void OnGrantCredit(uint64_t num_bytes);
+  // Has the delegate told whether the other end is congested, on its thread.
+  // Must be called with |channel_lock_| held.
+  void PostCongestionChange();
+  void NotifyCongestionChange();
+  // The flags this end sends in AcceptChild and AcceptParent.
+  uint32_t GetAcceptFlags() const;
+  // Enables compression on |channel_|, compact ports messages and credit flow
+  // control, if both ends of it want them, as indicated by the flags of an
+  // AcceptChild or AcceptParent received.
+  void ApplyRemoteAcceptFlags(uint32_t remote_accept_flags);
+  // Marks |message|, a PORTS_MESSAGE or COMPACT_PORTS_MESSAGE about to be
+  // written, as counted against the credit granted. Must be called with
+  // |channel_lock_| held.
+  void MarkCounted(Channel::Message* message);
+  // Rewrites |message|, a PORTS_MESSAGE about to be written, as a
+  // COMPACT_PORTS_MESSAGE if it's eligible. Must be called with
+  // |channel_lock_| held.
+  void MaybeCompactPortsMessage(Channel::Message* message);
+  // Expands a COMPACT_PORTS_MESSAGE and passes it to the delegate. Returns
+  // false if the message is invalid.
+  bool ProcessCompactPortsMessage(const ports::NodeName& remote_node_name,
+                                  const void* payload,
+                                  size_t payload_size);
+  ports::NodeName GetRemoteNodeName();
+
   Delegate* const delegate_;
   const scoped_refptr<base::TaskRunner> io_task_runner_;
+  const scoped_refptr<base::TaskRunner> delegate_task_runner_;
+
+  // Whether this end wants |channel_| compressed. Compression isn't worth it
+  // for shared memory Channels.
+  const bool compression_allowed_;
 
   base::Lock channel_lock_;
   scoped_refptr<Channel> channel_;
 
-  // Must only be accessed from |io_task_runner_|'s thread.
+  // Whether ports messages written may be compacted, which the other end has
+  // agreed to. Along with the IDs given to the destination ports of compact
+  // messages written, and the port each ID currently stands for, this is
+  // guarded by |channel_lock_|. IDs are reused round-robin once there are
+  // too many to assign a new one.
+  bool compact_ports_messages_enabled_ = false;
+  std::unordered_map<ports::PortName, uint32_t> sent_port_ids_;
+  std::vector<ports::PortName> sent_port_names_;
+  uint32_t next_sent_port_id_ = 0;
+
+  // Whether the other end grants credit for the ports messages it consumes.
+  // If so, the bytes of the ports messages written which it hasn't granted
+  // credit for yet, and whether they've gone over the window, are kept. All
+  // guarded by |channel_lock_|.
+  bool credit_flow_control_enabled_ = false;
+  uint64_t unconsumed_bytes_ = 0;
+  bool congested_ = false;
+
+  // What the delegate was last told |congested_| was. Only accessed from
+  // |delegate_task_runner_|'s thread.
+  bool reported_congested_ = false;
+
+  // The bytes of counted ports messages received which haven't been granted
+  // credit for yet. Only accessed from |io_task_runner_|'s thread.
+  uint64_t ungranted_bytes_ = 0;
+
+  // The port each ID in a compact message received stands for, by name and
+  // as the delegate last looked it up. Only accessed from |io_task_runner_|'s
+  // thread.
+  std::vector<ports::PortName> received_port_names_;
+  std::vector<ports::PortRef> received_ports_;
+
+  // Guards |remote_node_name_|, which is set on the delegate's thread but also
+  // read on |io_task_runner_|'s.
+  base::Lock remote_node_name_lock_;
   ports::NodeName remote_node_name_;
 
+  // Indicates that we've dispatched ports messages to the delegate since the
+  // last call to OnPortsMessagesDispatched. Only accessed from
+  // |io_task_runner_|'s thread.
+  bool has_undispatched_ports_messages_ = false;
+
   DISALLOW_COPY_AND_ASSIGN(NodeChannel);
 };
 
@@ -0,0 +1,545 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/node_channel.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "base/bind.h"
+#include "base/bind_helpers.h"
+#include "base/location.h"
+#include "base/macros.h"
+#include "base/synchronization/condition_variable.h"
+#include "base/synchronization/lock.h"
+#include "base/test/test_io_thread.h"
+#include "mojo/edk/embedder/platform_channel_pair.h"
+#include "mojo/edk/system/channel.h"
+#include "mojo/edk/system/message_for_transit.h"
+#include "mojo/edk/system/ports/event.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace mojo {
+namespace edk {
+namespace {
+
+// Wire values from node_channel.cc, which these tests write and check by hand
+// at the far end of a NodeChannel.
+const uint32_t kMessageTypeAcceptParent = 1;
+const uint32_t kMessageTypePortsMessage = 2;
+const uint32_t kMessageTypeCompactPortsMessage = 10;
+const uint32_t kMessageTypeGrantCredit = 11;
+const uint32_t kAcceptFlagCompactPortsMessages = 1 << 1;
+const uint32_t kAcceptFlagCreditFlowControl = 1 << 2;
+const uint32_t kHeaderFlagCounted = 1 << 0;
+const uint8_t kCompactFlagDefinesPort = 1 << 0;
+const uint8_t kCompactFlagHasTraceId = 1 << 1;
+
+struct RawHeader {
+  uint32_t type;
+  uint32_t flags;
+};
+
+struct RawAcceptParentData {
+  ports::NodeName token;
+  ports::NodeName child_name;
+  uint32_t flags;
+  uint32_t padding;
+};
+
+// Large enough that a few dozen of them cross the credit thresholds.
+const size_t kLargePayloadBytes = 64 * 1024;
+
+Channel::MessagePtr NewRawMessage(uint32_t type,
+                                  uint32_t flags,
+                                  const void* data,
+                                  size_t num_data_bytes) {
+  Channel::MessagePtr message =
+      Channel::Message::Create(sizeof(RawHeader) + num_data_bytes, nullptr);
+  RawHeader* header = static_cast<RawHeader*>(message->mutable_payload());
+  header->type = type;
+  header->flags = flags;
+  if (num_data_bytes)
+    memcpy(header + 1, data, num_data_bytes);
+  return message;
+}
+
+Channel::MessagePtr NewRawAcceptParent(uint32_t accept_flags) {
+  RawAcceptParentData data;
+  data.token = ports::NodeName(1, 2);
+  data.child_name = ports::NodeName(3, 4);
+  data.flags = accept_flags;
+  data.padding = 0;
+  return NewRawMessage(kMessageTypeAcceptParent, 0, &data, sizeof(data));
+}
+
+Channel::MessagePtr NewRawMessageFromBytes(const std::string& bytes) {
+  Channel::MessagePtr message =
+      Channel::Message::Create(bytes.size(), nullptr);
+  memcpy(message->mutable_payload(), bytes.data(), bytes.size());
+  return message;
+}
+
+const RawHeader* GetRawHeader(const std::string& message) {
+  return reinterpret_cast<const RawHeader*>(message.data());
+}
+
+// Creates a PORTS_MESSAGE carrying a user message with no ports or
+// dispatchers, as a message pipe would. |data| is set to what the delegate at
+// the far end should be given for it.
+Channel::MessagePtr NewUserPortsMessage(const ports::PortName& port_name,
+                                        uint64_t sequence_num,
+                                        uint32_t trace_id,
+                                        const std::string& contents,
+                                        std::string* data) {
+  const size_t num_data_bytes =
+      sizeof(ports::EventHeader) + sizeof(ports::UserEventData) +
+      sizeof(MessageForTransit::MessageHeader) + contents.size();
+  void* payload;
+  Channel::MessagePtr message =
+      NodeChannel::CreatePortsMessage(num_data_bytes, &payload, nullptr);
+  memset(payload, 0, num_data_bytes);
+
+  ports::EventHeader* event = static_cast<ports::EventHeader*>(payload);
+  event->type = ports::EventType::kUser;
+  event->trace_id = trace_id;
+  event->port_name = port_name;
+  ports::UserEventData* event_data =
+      reinterpret_cast<ports::UserEventData*>(event + 1);
+  event_data->sequence_num = sequence_num;
+  MessageForTransit::MessageHeader* message_header =
+      reinterpret_cast<MessageForTransit::MessageHeader*>(event_data + 1);
+  message_header->header_size = sizeof(*message_header);
+  memcpy(message_header + 1, contents.data(), contents.size());
+
+  data->assign(static_cast<const char*>(payload), num_data_bytes);
+  return message;
+}
+
+// The flags and port ID of a COMPACT_PORTS_MESSAGE whose ID fits in one byte.
+uint8_t GetCompactFlags(const std::string& message) {
+  return static_cast<uint8_t>(message[sizeof(uint32_t)]);
+}
+
+uint8_t GetCompactPortId(const std::string& message) {
+  return static_cast<uint8_t>(message[sizeof(uint32_t) + 1]);
+}
+
+// Builds a COMPACT_PORTS_MESSAGE by hand: its unpadded type, then |bytes|.
+std::string NewRawCompactMessage(const std::vector<uint8_t>& bytes) {
+  const uint32_t type = kMessageTypeCompactPortsMessage;
+  std::string message(reinterpret_cast<const char*>(&type), sizeof(type));
+  message.append(bytes.begin(), bytes.end());
+  return message;
+}
+
+// Records what a NodeChannel gives its delegate. Called on the I/O thread,
+// and waited on from the test's.
+class TestNodeChannelDelegate : public NodeChannel::Delegate {
+ public:
+  TestNodeChannelDelegate() : condition_(&lock_) {}
+  ~TestNodeChannelDelegate() override {}
+
+  void WaitForAcceptParent() {
+    base::AutoLock lock(lock_);
+    while (!accepted_parent_)
+      condition_.Wait();
+  }
+
+  // Returns the payloads of the first |count| ports messages received.
+  std::vector<std::string> WaitForPortsMessages(size_t count) {
+    base::AutoLock lock(lock_);
+    while (ports_messages_.size() < count)
+      condition_.Wait();
+    return std::vector<std::string>(ports_messages_.begin(),
+                                    ports_messages_.begin() + count);
+  }
+
+  bool WaitForCongestionChange() {
+    base::AutoLock lock(lock_);
+    while (congestion_changes_.empty())
+      condition_.Wait();
+    bool congested = congestion_changes_.front();
+    congestion_changes_.pop_front();
+    return congested;
+  }
+
+  bool HasCongestionChanges() {
+    base::AutoLock lock(lock_);
+    return !congestion_changes_.empty();
+  }
+
+  void WaitForError() {
+    base::AutoLock lock(lock_);
+    while (!error_)
+      condition_.Wait();
+  }
+
+  // NodeChannel::Delegate:
+  void OnAcceptChild(const ports::NodeName& from_node,
+                     const ports::NodeName& parent_name,
+                     const ports::NodeName& token) override {}
+  void OnAcceptParent(const ports::NodeName& from_node,
+                      const ports::NodeName& token,
+                      const ports::NodeName& child_name) override {
+    base::AutoLock lock(lock_);
+    accepted_parent_ = true;
+    condition_.Broadcast();
+  }
+  void OnPortsMessage(const ports::NodeName& from_node,
+                      const void* payload,
+                      size_t payload_size,
+                      ScopedPlatformHandleVectorPtr platform_handles) override {
+    AddPortsMessage(payload, payload_size);
+  }
+  void OnPortsChannelMessage(const ports::NodeName& from_node,
+                             Channel::MessagePtr message) override {
+    void* data;
+    size_t num_data_bytes;
+    NodeChannel::GetPortsMessageData(message.get(), &data, &num_data_bytes);
+    AddPortsMessage(data, num_data_bytes);
+  }
+  void OnCompactPortsMessage(const ports::NodeName& from_node,
+                             const void* payload,
+                             size_t payload_size,
+                             ports::PortRef* destination_port) override {
+    AddPortsMessage(payload, payload_size);
+  }
+  void OnPortsMessagesDispatched(const ports::NodeName& from_node) override {}
+  void OnRequestPortConnection(const ports::NodeName& from_node,
+                               const ports::PortName& connector_port_name,
+                               const std::string& token) override {}
+  void OnConnectToPort(const ports::NodeName& from_node,
+                       const ports::PortName& connector_port_name,
+                       const ports::PortName& connectee_port_name) override {}
+  void OnRequestIntroduction(const ports::NodeName& from_node,
+                             const ports::NodeName& name) override {}
+  void OnIntroduce(const ports::NodeName& from_name,
+                   const ports::NodeName& name,
+                   ScopedPlatformHandle channel_handle) override {}
+  void OnProvidePortPool(
+      const ports::NodeName& from_node,
+      const std::vector<NodeChannel::PooledPortNames>& port_names) override {}
+  void OnClaimPooledPort(const ports::NodeName& from_node,
+                         const ports::PortName& pooled_port_name,
+                         const std::string& token) override {}
+  void OnPeerCongestionChanged(const ports::NodeName& node,
+                               bool congested) override {
+    base::AutoLock lock(lock_);
+    congestion_changes_.push_back(congested);
+    condition_.Broadcast();
+  }
+  void OnChannelError(const ports::NodeName& node) override {
+    base::AutoLock lock(lock_);
+    error_ = true;
+    condition_.Broadcast();
+  }
+
+ private:
+  void AddPortsMessage(const void* data, size_t num_bytes) {
+    base::AutoLock lock(lock_);
+    ports_messages_.push_back(
+        std::string(static_cast<const char*>(data), num_bytes));
+    condition_.Broadcast();
+  }
+
+  base::Lock lock_;
+  base::ConditionVariable condition_;
+  bool accepted_parent_ = false;
+  std::vector<std::string> ports_messages_;
+  std::deque<bool> congestion_changes_;
+  bool error_ = false;
+
+  DISALLOW_COPY_AND_ASSIGN(TestNodeChannelDelegate);
+};
+
+// Records every message read by a plain Channel, which stands in for the
+// remote node.
+class TestChannelDelegate : public Channel::Delegate {
+ public:
+  TestChannelDelegate() : condition_(&lock_) {}
+  ~TestChannelDelegate() override {}
+
+  // Returns the first |count| messages received, header and all.
+  std::vector<std::string> WaitForMessages(size_t count) {
+    base::AutoLock lock(lock_);
+    while (messages_.size() < count)
+      condition_.Wait();
+    return std::vector<std::string>(messages_.begin(),
+                                    messages_.begin() + count);
+  }
+
+  // Channel::Delegate:
+  void OnChannelMessage(const void* payload,
+                        size_t payload_size,
+                        ScopedPlatformHandleVectorPtr handles) override {
+    base::AutoLock lock(lock_);
+    messages_.push_back(
+        std::string(static_cast<const char*>(payload), payload_size));
+    condition_.Broadcast();
+  }
+  void OnChannelError() override {}
+
+ private:
+  base::Lock lock_;
+  base::ConditionVariable condition_;
+  std::vector<std::string> messages_;
+
+  DISALLOW_COPY_AND_ASSIGN(TestChannelDelegate);
+};
+
+class NodeChannelTest : public testing::Test {
+ public:
+  NodeChannelTest() : io_thread_(base::TestIOThread::kAutoStart) {}
+  ~NodeChannelTest() override {}
+
+  void SetUp() override {
+    PlatformChannelPair channel_pair;
+    node_channel_ = NodeChannel::Create(
+        &node_channel_delegate_, channel_pair.PassServerHandle(),
+        Channel::Transport::PLATFORM_HANDLE, io_thread_.task_runner(),
+        io_thread_.task_runner());
+    node_channel_->SetRemoteNodeName(ports::NodeName(3, 4));
+    remote_channel_ = Channel::Create(&remote_delegate_,
+                                      channel_pair.PassClientHandle(),
+                                      io_thread_.task_runner());
+    io_thread_.PostTaskAndWait(
+        FROM_HERE, base::Bind(&NodeChannel::Start, node_channel_));
+    io_thread_.PostTaskAndWait(
+        FROM_HERE, base::Bind(&Channel::Start, remote_channel_));
+  }
+
+  void TearDown() override {
+    node_channel_->ShutDown();
+    remote_channel_->ShutDown();
+    // Let anything the channels already posted to their delegates run first.
+    WaitForIOThread();
+  }
+
+ protected:
+  // Runs everything already posted to the I/O thread.
+  void WaitForIOThread() {
+    io_thread_.PostTaskAndWait(FROM_HERE, base::Bind(&base::DoNothing));
+  }
+
+  void WriteLargePortsMessages(size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      void* data;
+      Channel::MessagePtr message =
+          NodeChannel::CreatePortsMessage(kLargePayloadBytes, &data, nullptr);
+      memset(data, 'x', kLargePayloadBytes);
+      node_channel_->PortsMessage(std::move(message));
+    }
+  }
+
+  void EnableCompactPortsMessages() {
+    remote_channel_->Write(
+        NewRawAcceptParent(kAcceptFlagCompactPortsMessages));
+    node_channel_delegate_.WaitForAcceptParent();
+  }
+
+  void ExpectCompactMessageRejected(const std::vector<uint8_t>& bytes) {
+    remote_channel_->Write(NewRawMessageFromBytes(NewRawCompactMessage(bytes)));
+    node_channel_delegate_.WaitForError();
+    EXPECT_TRUE(node_channel_delegate_.WaitForPortsMessages(0).empty());
+  }
+
+  // Returns the total payload size of the messages written.
+  size_t WriteRawLargePortsMessages(size_t count, uint32_t flags) {
+    std::string data(kLargePayloadBytes, 'x');
+    size_t num_bytes = 0;
+    for (size_t i = 0; i < count; ++i) {
+      Channel::MessagePtr message = NewRawMessage(
+          kMessageTypePortsMessage, flags, data.data(), data.size());
+      num_bytes += message->payload_size();
+      remote_channel_->Write(std::move(message));
+    }
+    return num_bytes;
+  }
+
+  base::TestIOThread io_thread_;
+  TestNodeChannelDelegate node_channel_delegate_;
+  TestChannelDelegate remote_delegate_;
+  scoped_refptr<NodeChannel> node_channel_;
+  scoped_refptr<Channel> remote_channel_;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(NodeChannelTest);
+};
+
+TEST_F(NodeChannelTest, CreditCountsOnlyMessagesWrittenOnceEnabled) {
+  // 6 MB is in flight when the remote end enables flow control. None of it may
+  // be counted, or the 3 MB written next would put the channel over its 8 MB
+  // window.
+  const size_t kNumUncounted = 96;
+  WriteLargePortsMessages(kNumUncounted);
+  remote_channel_->Write(NewRawAcceptParent(kAcceptFlagCreditFlowControl));
+  node_channel_delegate_.WaitForAcceptParent();
+
+  const size_t kNumUnderWindow = 48;
+  WriteLargePortsMessages(kNumUnderWindow);
+  WaitForIOThread();
+  EXPECT_FALSE(node_channel_delegate_.HasCongestionChanges());
+
+  const size_t kNumOverWindow = 96;
+  WriteLargePortsMessages(kNumOverWindow);
+  EXPECT_TRUE(node_channel_delegate_.WaitForCongestionChange());
+
+  // Exactly the messages written after the AcceptParent are marked counted.
+  std::vector<std::string> messages = remote_delegate_.WaitForMessages(
+      kNumUncounted + kNumUnderWindow + kNumOverWindow);
+  uint64_t num_counted_bytes = 0;
+  for (size_t i = 0; i < messages.size(); ++i) {
+    const RawHeader* header = GetRawHeader(messages[i]);
+    ASSERT_EQ(kMessageTypePortsMessage, header->type);
+    EXPECT_EQ(i >= kNumUncounted, (header->flags & kHeaderFlagCounted) != 0);
+    if (header->flags & kHeaderFlagCounted)
+      num_counted_bytes += messages[i].size();
+  }
+
+  // Credit for all of them clears the congestion.
+  remote_channel_->Write(NewRawMessage(kMessageTypeGrantCredit, 0,
+                                       &num_counted_bytes,
+                                       sizeof(num_counted_bytes)));
+  EXPECT_FALSE(node_channel_delegate_.WaitForCongestionChange());
+}
+
+TEST_F(NodeChannelTest, CreditGrantedOnlyForCountedMessages) {
+  // Enough uncounted bytes to cross the grant threshold if they were counted.
+  const size_t kNumUncounted = 48;
+  WriteRawLargePortsMessages(kNumUncounted, 0);
+  node_channel_delegate_.WaitForPortsMessages(kNumUncounted);
+
+  // Anything the NodeChannel wrote in response to those reaches the remote end
+  // before this.
+  void* data;
+  Channel::MessagePtr marker =
+      NodeChannel::CreatePortsMessage(sizeof(uint32_t), &data, nullptr);
+  memset(data, 0, sizeof(uint32_t));
+  node_channel_->PortsMessage(std::move(marker));
+  std::vector<std::string> messages = remote_delegate_.WaitForMessages(1);
+  EXPECT_EQ(kMessageTypePortsMessage, GetRawHeader(messages[0])->type);
+
+  const size_t kNumCounted = 40;
+  const size_t num_counted_bytes =
+      WriteRawLargePortsMessages(kNumCounted, kHeaderFlagCounted);
+  node_channel_delegate_.WaitForPortsMessages(kNumUncounted + kNumCounted);
+
+  // The grant threshold is a quarter of the 8 MB window.
+  const uint64_t kGrantThresholdBytes = 2 * 1024 * 1024;
+  uint64_t num_granted_bytes = 0;
+  for (size_t i = 1; num_granted_bytes < kGrantThresholdBytes; ++i) {
+    messages = remote_delegate_.WaitForMessages(i + 1);
+    const std::string& message = messages[i];
+    ASSERT_EQ(kMessageTypeGrantCredit, GetRawHeader(message)->type);
+    ASSERT_EQ(sizeof(RawHeader) + sizeof(uint64_t), message.size());
+    uint64_t num_bytes;
+    memcpy(&num_bytes, message.data() + sizeof(RawHeader), sizeof(num_bytes));
+    num_granted_bytes += num_bytes;
+  }
+  EXPECT_LE(num_granted_bytes, num_counted_bytes);
+}
+
+TEST_F(NodeChannelTest, CompactPortsMessagesRoundTrip) {
+  EnableCompactPortsMessages();
+
+  const ports::PortName kPortA(5, 6);
+  const ports::PortName kPortB(7, 8);
+  std::vector<std::string> expected_data(4);
+  node_channel_->PortsMessage(
+      NewUserPortsMessage(kPortA, 1, 0, "hello", &expected_data[0]));
+  node_channel_->PortsMessage(
+      NewUserPortsMessage(kPortA, 300, 77, "world!", &expected_data[1]));
+  node_channel_->PortsMessage(
+      NewUserPortsMessage(kPortB, 1, 0, std::string(), &expected_data[2]));
+  // Too large to be kept inline, so it's left as a PORTS_MESSAGE.
+  node_channel_->PortsMessage(NewUserPortsMessage(
+      kPortB, 2, 0, std::string(200, 'x'), &expected_data[3]));
+
+  std::vector<std::string> messages = remote_delegate_.WaitForMessages(4);
+  for (size_t i = 0; i < 3; ++i) {
+    ASSERT_EQ(kMessageTypeCompactPortsMessage, GetRawHeader(messages[i])->type);
+    EXPECT_LT(messages[i].size(), sizeof(RawHeader) + expected_data[i].size());
+  }
+  EXPECT_EQ(kCompactFlagDefinesPort, GetCompactFlags(messages[0]));
+  EXPECT_EQ(kCompactFlagHasTraceId, GetCompactFlags(messages[1]));
+  EXPECT_EQ(kCompactFlagDefinesPort, GetCompactFlags(messages[2]));
+  EXPECT_EQ(0u, GetCompactPortId(messages[0]));
+  EXPECT_EQ(0u, GetCompactPortId(messages[1]));
+  EXPECT_EQ(1u, GetCompactPortId(messages[2]));
+  EXPECT_EQ(kMessageTypePortsMessage, GetRawHeader(messages[3])->type);
+
+  // Reading them back gives exactly what was written.
+  for (const std::string& message : messages)
+    remote_channel_->Write(NewRawMessageFromBytes(message));
+  EXPECT_EQ(expected_data, node_channel_delegate_.WaitForPortsMessages(4));
+}
+
+TEST_F(NodeChannelTest, CompactPortIdsAreRedefined) {
+  EnableCompactPortsMessages();
+
+  // One more port than there are IDs, then the first port again, whose ID has
+  // been taken over, and a port whose ID hasn't.
+  const uint64_t kNumPorts = 257;
+  std::vector<std::string> expected_data(kNumPorts + 2);
+  for (uint64_t i = 0; i < kNumPorts; ++i) {
+    node_channel_->PortsMessage(NewUserPortsMessage(
+        ports::PortName(i + 1, 1), 1, 0, "x", &expected_data[i]));
+  }
+  node_channel_->PortsMessage(NewUserPortsMessage(
+      ports::PortName(1, 1), 2, 0, "y", &expected_data[kNumPorts]));
+  node_channel_->PortsMessage(NewUserPortsMessage(
+      ports::PortName(3, 1), 2, 0, "z", &expected_data[kNumPorts + 1]));
+
+  std::vector<std::string> messages =
+      remote_delegate_.WaitForMessages(expected_data.size());
+  for (const std::string& message : messages)
+    ASSERT_EQ(kMessageTypeCompactPortsMessage, GetRawHeader(message)->type);
+  EXPECT_EQ(kCompactFlagDefinesPort, GetCompactFlags(messages[kNumPorts - 1]));
+  EXPECT_EQ(0u, GetCompactPortId(messages[kNumPorts - 1]));
+  EXPECT_EQ(kCompactFlagDefinesPort, GetCompactFlags(messages[kNumPorts]));
+  EXPECT_EQ(1u, GetCompactPortId(messages[kNumPorts]));
+  EXPECT_EQ(0u, GetCompactFlags(messages[kNumPorts + 1]));
+  EXPECT_EQ(2u, GetCompactPortId(messages[kNumPorts + 1]));
+
+  for (const std::string& message : messages)
+    remote_channel_->Write(NewRawMessageFromBytes(message));
+  EXPECT_EQ(expected_data,
+            node_channel_delegate_.WaitForPortsMessages(expected_data.size()));
+}
+
+TEST_F(NodeChannelTest, CompactPortsMessageWithTruncatedVarint) {
+  // The port ID's continuation bit is set on the last byte.
+  ExpectCompactMessageRejected({0, 0x80});
+}
+
+TEST_F(NodeChannelTest, CompactPortsMessageWithOverlongVarint) {
+  // A sequence number with more than 64 bits' worth of bytes.
+  std::vector<uint8_t> bytes = {kCompactFlagDefinesPort, 0};
+  bytes.insert(bytes.end(), sizeof(ports::PortName), 1);
+  bytes.insert(bytes.end(), 10, 0xff);
+  bytes.push_back(0);
+  ExpectCompactMessageRejected(bytes);
+}
+
+TEST_F(NodeChannelTest, CompactPortsMessageWithUndefinedPortId) {
+  ExpectCompactMessageRejected({0, 5, 1});
+}
+
+TEST_F(NodeChannelTest, CompactPortsMessageTooLarge) {
+  // Too large for a PortsMessage to keep inline once expanded.
+  std::vector<uint8_t> bytes = {kCompactFlagDefinesPort, 0};
+  bytes.insert(bytes.end(), sizeof(ports::PortName), 1);
+  bytes.push_back(1);
+  bytes.insert(bytes.end(), 200, 'x');
+  ExpectCompactMessageRejected(bytes);
+}
+
+}  // namespace
+}  // namespace edk
+}  // namespace mojo
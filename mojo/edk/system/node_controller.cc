@@ -4,25 +4,167 @@
 
 #include "mojo/edk/system/node_controller.h"
 
+#include <stdint.h>
+#include <string.h>
+
 #include <algorithm>
+#include <atomic>
 
 #include "base/bind.h"
+#include "base/files/file_util.h"
+#include "base/files/memory_mapped_file.h"
+#include "base/lazy_instance.h"
 #include "base/location.h"
 #include "base/logging.h"
 #include "base/macros.h"
 #include "base/message_loop/message_loop.h"
+#include "base/threading/thread_local_storage.h"
+#include "build/build_config.h"
 #include "crypto/random.h"
+#include "mojo/edk/embedder/metrics.h"
 #include "mojo/edk/embedder/platform_channel_pair.h"
 #include "mojo/edk/system/core.h"
+#include "mojo/edk/system/memory_allocation.h"
+#include "mojo/edk/system/message_tracer.h"
+#include "mojo/edk/system/metrics_registry.h"
+#include "mojo/edk/system/ports/event.h"
 #include "mojo/edk/system/ports_message.h"
 
+#if defined(OS_POSIX)
+#include <pthread.h>
+#endif
+
 namespace mojo {
 namespace edk {
 
 namespace {
 
+// Random names are taken from a per-thread buffer of CSPRNG output, which is
+// refilled in one call once exhausted, rather than costing a call each. Bytes
+// are cleared as they're handed out, so each is used for at most one name, and
+// a buffer inherited across fork() is discarded.
+const size_t kRandomNameBufferSize = 4096;
+
+// Limits on the messages queued for a single peer while waiting to be
+// introduced to it.
+const size_t kMaxPendingPeerMessages = 16384;
+const size_t kMaxPendingPeerBytes = 64 * 1024 * 1024;
+
+// The number of ports each parent keeps connected to each child ahead of
+// time, so that the child's token-based connections need not wait for a
+// ConnectToPort. Each claimed port is replaced.
+const size_t kPortPoolSize = 8;
+
+// Ports are allocated from the embedder's MemoryAllocator, if it has set one.
+void* AllocatePortMemory(size_t num_bytes, size_t alignment) {
+  return AllocateMemory(MemoryAllocator::Usage::kPort, num_bytes, alignment);
+}
+
+void FreePortMemory(void* ptr) {
+  FreeMemory(MemoryAllocator::Usage::kPort, ptr);
+}
+
+const ports::SlabMemoryFunctions kPortMemoryFunctions = {&AllocatePortMemory,
+                                                         &FreePortMemory};
+
+// Incremented in the child after each fork(). A forked child would otherwise
+// hand out the same names from its copy of a thread's buffer as its parent.
+std::atomic<uint32_t> g_fork_generation(0);
+
+#if defined(OS_POSIX)
+void OnForkInChild() {
+  g_fork_generation.fetch_add(1, std::memory_order_relaxed);
+}
+#endif
+
+class RandomNameBuffer {
+ public:
+  RandomNameBuffer() : offset_(kRandomNameBufferSize), fork_generation_(0) {}
+
+  void GetBytes(void* out, size_t num_bytes) {
+    DCHECK_LE(num_bytes, kRandomNameBufferSize);
+    uint32_t fork_generation =
+        g_fork_generation.load(std::memory_order_relaxed);
+    if (kRandomNameBufferSize - offset_ < num_bytes ||
+        fork_generation != fork_generation_) {
+      crypto::RandBytes(buffer_, kRandomNameBufferSize);
+      offset_ = 0;
+      fork_generation_ = fork_generation;
+    }
+    memcpy(out, buffer_ + offset_, num_bytes);
+    memset(buffer_ + offset_, 0, num_bytes);
+    offset_ += num_bytes;
+  }
+
+ private:
+  uint8_t buffer_[kRandomNameBufferSize];
+  size_t offset_;
+
+  // The value of |g_fork_generation| when |buffer_| was filled.
+  uint32_t fork_generation_;
+
+  DISALLOW_COPY_AND_ASSIGN(RandomNameBuffer);
+};
+
+class ThreadLocalRandomNameBuffer {
+ public:
+  ThreadLocalRandomNameBuffer() : slot_(&DeleteBuffer) {
+#if defined(OS_POSIX)
+    // This is a leaky singleton, so the handler is only registered once.
+    CHECK_EQ(0, pthread_atfork(nullptr, nullptr, &OnForkInChild));
+#endif
+  }
+
+  RandomNameBuffer* Get() {
+    RandomNameBuffer* buffer = static_cast<RandomNameBuffer*>(slot_.Get());
+    if (!buffer) {
+      buffer = new RandomNameBuffer;
+      slot_.Set(buffer);
+    }
+    return buffer;
+  }
+
+ private:
+  static void DeleteBuffer(void* buffer) {
+    delete static_cast<RandomNameBuffer*>(buffer);
+  }
+
+  base::ThreadLocalStorage::Slot slot_;
+
+  DISALLOW_COPY_AND_ASSIGN(ThreadLocalRandomNameBuffer);
+};
+
+base::LazyInstance<ThreadLocalRandomNameBuffer>::Leaky g_random_name_buffer =
+    LAZY_INSTANCE_INITIALIZER;
+
 template <typename T>
-void GenerateRandomName(T* out) { crypto::RandBytes(out, sizeof(T)); }
+void GenerateRandomName(T* out) {
+  g_random_name_buffer.Get().Get()->GetBytes(out, sizeof(T));
+}
+
+void DeletePendingPortsMessages(void* messages) {
+  delete static_cast<std::vector<ports::ScopedMessage>*>(messages);
+}
+
+// The ports whose closure is deferred by ScopedPortClosureBatches on a thread.
+struct PendingPortClosures {
+  int batch_depth = 0;
+  std::vector<ports::PortRef> ports;
+};
+
+void DeletePendingPortClosures(void* closures) {
+  delete static_cast<PendingPortClosures*>(closures);
+}
+
+PendingPortClosures* GetPendingPortClosures(
+    base::ThreadLocalStorage::Slot* slot) {
+  auto* closures = static_cast<PendingPortClosures*>(slot->Get());
+  if (!closures) {
+    closures = new PendingPortClosures;
+    slot->Set(closures);
+  }
+  return closures;
+}
 
 ports::NodeName GetRandomNodeName() {
   ports::NodeName name;
@@ -30,6 +172,21 @@ ports::NodeName GetRandomNodeName() {
   return name;
 }
 
+// The layout of a file written by NodeController::SaveState(): a
+// SavedStateHeader, then the names of |num_peers| peers, then the Node's
+// state.
+const uint32_t kSavedStateMagic = 0x4e4f4445;  // 'NODE'
+const uint32_t kSavedStateVersion = 1;
+
+struct SavedStateHeader {
+  uint32_t magic;
+  uint32_t version;
+  ports::NodeName node_name;
+  ports::NodeName parent_name;
+  uint32_t num_peers;
+  uint32_t padding;
+};
+
 // Used by NodeController to watch for shutdown. Since no IO can happen once
 // the IO thread is killed, the NodeController can cleanly drop all its peers
 // at that time.
@@ -70,21 +227,70 @@ class ThreadDestructionObserver :
 
 }  // namespace
 
+// What NodeController::PrepareToRestoreState() read.
+struct RestoredNodeState {
+  ports::NodeName node_name;
+  ports::NodeName parent_name;
+  std::vector<ports::NodeName> peer_names;
+  ScopedPlatformHandleVectorPtr channel_handles;
+  std::vector<char> node_state;
+};
+
+namespace {
+
+// Set by PrepareToRestoreState() before the Core is created, and taken by its
+// NodeController.
+RestoredNodeState* g_restored_state = nullptr;
+
+ports::NodeName GetInitialNodeName() {
+  return g_restored_state ? g_restored_state->node_name : GetRandomNodeName();
+}
+
+}  // namespace
+
+NodeController::PendingPeerMessages::PendingPeerMessages() : num_bytes(0) {}
+
+NodeController::PendingPeerMessages::~PendingPeerMessages() {}
+
 NodeController::~NodeController() {}
 
 NodeController::NodeController(Core* core)
     : core_(core),
-      name_(GetRandomNodeName()),
-      node_(new ports::Node(name_, this)) {
+      name_(GetInitialNodeName()),
+      node_(new ports::Node(name_, this, kPortMemoryFunctions)),
+      peers_lock_("NodeController::peers_lock_"),
+      eager_introductions_enabled_(false),
+      next_channel_task_runner_(0),
+      pending_ports_messages_(&DeletePendingPortsMessages),
+      pending_port_closures_(&DeletePendingPortClosures),
+      messages_lock_("NodeController::messages_lock_") {
   DVLOG(1) << "Initializing node " << name_;
+  restored_state_.reset(g_restored_state);
+  g_restored_state = nullptr;
 }
 
 void NodeController::SetIOTaskRunner(
     scoped_refptr<base::TaskRunner> task_runner) {
   io_task_runner_ = task_runner;
+  channel_task_runners_.push_back(task_runner);
   ThreadDestructionObserver::Create(
       io_task_runner_,
       base::Bind(&NodeController::DropAllPeers, base::Unretained(this)));
+  if (restored_state_) {
+    io_task_runner_->PostTask(
+        FROM_HERE, base::Bind(&NodeController::RestoreStateOnIOThread,
+                              base::Unretained(this)));
+  }
+}
+
+void NodeController::AddIOTaskRunner(
+    scoped_refptr<base::TaskRunner> io_task_runner) {
+  DCHECK(io_task_runner_);
+  channel_task_runners_.push_back(io_task_runner);
+}
+
+void NodeController::SetEagerIntroductionsEnabled(bool enabled) {
+  eager_introductions_enabled_.store(enabled, std::memory_order_relaxed);
 }
 
 void NodeController::ConnectToChild(ScopedPlatformHandle platform_handle) {
@@ -107,7 +313,7 @@ void NodeController::SetPortObserver(
     const ports::PortRef& port,
     std::shared_ptr<PortObserver> observer) {
   DCHECK(observer);
-  node_->SetUserData(port, std::move(observer));
+  node_->SetPortObserver(port, std::move(observer));
 }
 
 scoped_ptr<PortsMessage> NodeController::AllocMessage(size_t num_payload_bytes,
@@ -121,12 +327,55 @@ scoped_ptr<PortsMessage> NodeController::AllocMessage(size_t num_payload_bytes,
   return make_scoped_ptr(static_cast<PortsMessage*>(m.release()));
 }
 
+int NodeController::ClosePort(const ports::PortRef& port_ref) {
+  PendingPortClosures* closures =
+      GetPendingPortClosures(&pending_port_closures_);
+  if (closures->batch_depth > 0) {
+    closures->ports.push_back(port_ref);
+    return ports::OK;
+  }
+  return node_->ClosePort(port_ref);
+}
+
+NodeController::ScopedPortClosureBatch::ScopedPortClosureBatch(
+    NodeController* node_controller)
+    : node_controller_(node_controller) {
+  GetPendingPortClosures(&node_controller_->pending_port_closures_)
+      ->batch_depth++;
+}
+
+NodeController::ScopedPortClosureBatch::~ScopedPortClosureBatch() {
+  PendingPortClosures* closures =
+      GetPendingPortClosures(&node_controller_->pending_port_closures_);
+  DCHECK_GT(closures->batch_depth, 0);
+  if (--closures->batch_depth > 0 || closures->ports.empty())
+    return;
+
+  std::vector<ports::PortRef> ports;
+  std::swap(ports, closures->ports);
+  node_controller_->node_->ClosePorts(ports);
+}
+
 int NodeController::SendMessage(const ports::PortRef& port,
                                 scoped_ptr<PortsMessage> message) {
   ports::ScopedMessage ports_message(message.release());
   return node_->SendMessage(port, std::move(ports_message));
 }
 
+int NodeController::SendMessages(const ports::PortRef& port,
+                                 std::vector<ports::ScopedMessage> messages) {
+  return node_->SendMessages(port, std::move(messages));
+}
+
+int NodeController::BroadcastMessage(
+    const std::vector<ports::PortRef>& port_refs,
+    scoped_ptr<PortsMessage> message) {
+  DCHECK_EQ(0u, message->num_handles());
+  DCHECK(message->local_dispatchers().empty());
+  ports::ScopedMessage ports_message(message.release());
+  return node_->BroadcastMessage(port_refs, std::move(ports_message));
+}
+
 void NodeController::ReservePort(const std::string& token,
                                  ports::PortRef* port_ref) {
   node_->CreateUninitializedPort(port_ref);
@@ -146,12 +395,247 @@ void NodeController::ConnectToParentPort(const ports::PortRef& local_port,
                  base::Unretained(this), local_port, token));
 }
 
+bool NodeController::ClaimPooledParentPort(const std::string& token,
+                                           ports::PortRef* port_ref) {
+  PooledPort pooled_port;
+  {
+    base::AutoLock lock(port_pools_lock_);
+    if (parent_port_pool_.empty())
+      return false;
+    pooled_port = parent_port_pool_.back();
+    parent_port_pool_.pop_back();
+  }
+
+  // Messages written to the port before the parent sees the claim wait at
+  // its pooled port, which forwards them on once it has been spliced in.
+  io_task_runner_->PostTask(
+      FROM_HERE,
+      base::Bind(&NodeController::ClaimPooledParentPortOnIOThread,
+                 base::Unretained(this), pooled_port.peer_port_name, token));
+
+  *port_ref = pooled_port.port;
+  return true;
+}
+
+void NodeController::GetMetrics(Metrics* metrics) {
+  static_assert(MetricsRegistry::kNumHistogramBuckets ==
+                    kMetricsHistogramBuckets,
+                "Histogram bucket counts must match.");
+
+  ports::NodeStats node_stats;
+  node_->GetStats(&node_stats);
+  metrics->num_ports = node_stats.num_ports;
+  metrics->num_receiving_ports = node_stats.num_receiving_ports;
+  metrics->num_proxies = node_stats.num_proxies;
+  metrics->num_buffering_ports = node_stats.num_buffering_ports;
+  metrics->num_queued_messages = node_stats.num_queued_messages;
+  metrics->num_queued_bytes = node_stats.num_queued_bytes;
+  metrics->max_queued_messages = node_stats.max_queued_messages;
+
+  std::vector<std::pair<ports::NodeName, scoped_refptr<NodeChannel>>> peers;
+  {
+    ProfiledAutoLock lock(peers_lock_);
+    metrics->num_peers = peers_.size();
+    metrics->num_pending_peer_messages = 0;
+    for (const auto& entry : pending_peer_messages_)
+      metrics->num_pending_peer_messages += entry.second.messages.size();
+    for (const auto& entry : peers_)
+      peers.push_back(entry);
+  }
+
+  // Each channel's stats are taken outside |peers_lock_|, since they need
+  // the channel's own lock.
+  metrics->peers.clear();
+  for (const auto& peer : peers) {
+    Channel::Stats stats;
+    peer.second->GetChannelStats(&stats);
+    PeerMetrics peer_metrics;
+    peer_metrics.node_name_v1 = peer.first.v1;
+    peer_metrics.node_name_v2 = peer.first.v2;
+    peer_metrics.messages_written = stats.messages_written;
+    peer_metrics.bytes_written = stats.bytes_written;
+    peer_metrics.handles_written = stats.handles_written;
+    peer_metrics.messages_read = stats.messages_read;
+    peer_metrics.bytes_read = stats.bytes_read;
+    peer_metrics.handles_read = stats.handles_read;
+    metrics->peers.push_back(peer_metrics);
+  }
+
+  MetricsRegistry::Snapshot snapshot;
+  MetricsRegistry::GetSnapshot(&snapshot);
+  const uint64_t* counters = snapshot.counters;
+  metrics->num_peers_dropped = counters[MetricsRegistry::kPeersDropped];
+  metrics->num_peer_messages_dropped =
+      counters[MetricsRegistry::kPeerMessagesDropped];
+  metrics->channel_messages_written =
+      counters[MetricsRegistry::kChannelMessagesWritten];
+  metrics->channel_bytes_written =
+      counters[MetricsRegistry::kChannelBytesWritten];
+  metrics->channel_handles_written =
+      counters[MetricsRegistry::kChannelHandlesWritten];
+  metrics->channel_messages_read =
+      counters[MetricsRegistry::kChannelMessagesRead];
+  metrics->channel_bytes_read = counters[MetricsRegistry::kChannelBytesRead];
+  metrics->channel_handles_read =
+      counters[MetricsRegistry::kChannelHandlesRead];
+  metrics->channel_messages_compressed =
+      counters[MetricsRegistry::kChannelMessagesCompressed];
+  metrics->channel_messages_fragmented =
+      counters[MetricsRegistry::kChannelMessagesFragmented];
+  metrics->channel_messages_compacted =
+      counters[MetricsRegistry::kChannelMessagesCompacted];
+  memcpy(metrics->channel_message_sizes,
+         snapshot.histograms[MetricsRegistry::kChannelMessageSize],
+         sizeof(metrics->channel_message_sizes));
+  metrics->message_pipe_messages_written =
+      counters[MetricsRegistry::kMessagePipeMessagesWritten];
+  metrics->message_pipe_bytes_written =
+      counters[MetricsRegistry::kMessagePipeBytesWritten];
+  metrics->message_pipe_handles_written =
+      counters[MetricsRegistry::kMessagePipeHandlesWritten];
+  metrics->message_pipe_messages_read =
+      counters[MetricsRegistry::kMessagePipeMessagesRead];
+  metrics->message_pipe_bytes_read =
+      counters[MetricsRegistry::kMessagePipeBytesRead];
+  metrics->data_pipe_bytes_written =
+      counters[MetricsRegistry::kDataPipeBytesWritten];
+  metrics->data_pipe_bytes_read =
+      counters[MetricsRegistry::kDataPipeBytesRead];
+}
+
+bool NodeController::SaveState(const base::FilePath& path,
+                               ScopedPlatformHandleVectorPtr* channel_handles) {
+  DCHECK(io_task_runner_->RunsTasksOnCurrentThread());
+
+  std::vector<char> node_state;
+  int rv = node_->SaveState(&node_state);
+  if (rv != ports::OK) {
+    LOG(ERROR) << "Can't save node state: " << rv;
+    return false;
+  }
+
+  std::vector<ports::NodeName> peer_names;
+  ScopedPlatformHandleVectorPtr handles(new PlatformHandleVector);
+  {
+    ProfiledAutoLock lock(peers_lock_);
+    for (const auto& peer : peers_) {
+      ScopedPlatformHandle handle = peer.second->DuplicatePlatformHandle();
+      if (!handle.is_valid()) {
+        LOG(ERROR) << "Can't hand over the channel to " << peer.first;
+        return false;
+      }
+      peer_names.push_back(peer.first);
+      handles->push_back(handle.release());
+    }
+  }
+
+  SavedStateHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kSavedStateMagic;
+  header.version = kSavedStateVersion;
+  header.node_name = name_;
+  header.parent_name = parent_name_;
+  header.num_peers = static_cast<uint32_t>(peer_names.size());
+
+  std::vector<char> data(sizeof(header));
+  memcpy(data.data(), &header, sizeof(header));
+  const char* names = reinterpret_cast<const char*>(peer_names.data());
+  data.insert(data.end(), names,
+              names + peer_names.size() * sizeof(ports::NodeName));
+  data.insert(data.end(), node_state.begin(), node_state.end());
+
+  int size = static_cast<int>(data.size());
+  if (base::WriteFile(path, data.data(), size) != size) {
+    LOG(ERROR) << "Can't write node state to " << path.value();
+    return false;
+  }
+
+  *channel_handles = std::move(handles);
+  return true;
+}
+
+// static
+bool NodeController::PrepareToRestoreState(
+    const base::FilePath& path,
+    ScopedPlatformHandleVectorPtr channel_handles) {
+  base::MemoryMappedFile file;
+  if (!file.Initialize(path)) {
+    LOG(ERROR) << "Can't map node state from " << path.value();
+    return false;
+  }
+
+  SavedStateHeader header;
+  if (file.length() < sizeof(header))
+    return false;
+  memcpy(&header, file.data(), sizeof(header));
+  size_t names_size = header.num_peers * sizeof(ports::NodeName);
+  if (header.magic != kSavedStateMagic ||
+      header.version != kSavedStateVersion ||
+      file.length() - sizeof(header) < names_size ||
+      !channel_handles || channel_handles->size() != header.num_peers) {
+    LOG(ERROR) << "Invalid node state in " << path.value();
+    return false;
+  }
+
+  scoped_ptr<RestoredNodeState> state(new RestoredNodeState);
+  state->node_name = header.node_name;
+  state->parent_name = header.parent_name;
+  state->peer_names.resize(header.num_peers);
+  const uint8_t* names = file.data() + sizeof(header);
+  if (names_size > 0)
+    memcpy(state->peer_names.data(), names, names_size);
+  state->node_state.assign(names + names_size, file.data() + file.length());
+  state->channel_handles = std::move(channel_handles);
+
+  delete g_restored_state;
+  g_restored_state = state.release();
+  return true;
+}
+
+void NodeController::RestoreStateOnIOThread() {
+  DCHECK(io_task_runner_->RunsTasksOnCurrentThread());
+  scoped_ptr<RestoredNodeState> state = std::move(restored_state_);
+
+  // The ports go first, so that they're there for the first messages the
+  // channels read.
+  std::vector<ports::PortRef> receiving_ports;
+  int rv = node_->RestoreState(state->node_state.data(),
+                               state->node_state.size(), &receiving_ports);
+  if (rv != ports::OK) {
+    LOG(ERROR) << "Can't restore node state: " << rv;
+    return;
+  }
+
+  PlatformHandleVector& handles = *state->channel_handles;
+  for (size_t i = 0; i < state->peer_names.size(); ++i) {
+    const ports::NodeName& peer_name = state->peer_names[i];
+    ScopedPlatformHandle handle(handles[i]);
+    handles[i] = PlatformHandle();
+    scoped_refptr<NodeChannel> channel = NodeChannel::Create(
+        this, std::move(handle), Channel::Transport::PLATFORM_HANDLE,
+        GetChannelTaskRunner(), io_task_runner_);
+    if (peer_name == state->parent_name) {
+      parent_name_ = peer_name;
+      parent_channel_ = channel;
+    }
+    AddPeer(peer_name, channel, true /* start_channel */);
+  }
+
+  for (const ports::PortRef& port : receiving_ports)
+    node_->ClosePort(port);
+}
+
 void NodeController::ConnectToChildOnIOThread(
     ScopedPlatformHandle platform_handle) {
   DCHECK(io_task_runner_->RunsTasksOnCurrentThread());
 
+  // The parent always creates the shared memory for a shared memory Channel.
+  Channel::Transport transport = Channel::IsSharedMemoryEnabled()
+      ? Channel::Transport::SHARED_MEMORY_INITIATOR
+      : Channel::Transport::PLATFORM_HANDLE;
   scoped_refptr<NodeChannel> channel =
-      NodeChannel::Create(this, std::move(platform_handle), io_task_runner_);
+      NodeChannel::Create(this, std::move(platform_handle), transport,
+                          GetChannelTaskRunner(), io_task_runner_);
 
   ports::NodeName token;
   GenerateRandomName(&token);
@@ -172,8 +656,12 @@ void NodeController::ConnectToParentOnIOThread(
   // At this point we don't know the parent's name, so we can't yet insert it
   // into our |peers_| map. That will happen as soon as we receive an
   // AcceptChild message from them.
-  parent_channel_ = NodeChannel::Create(this, std::move(platform_handle),
-                                        io_task_runner_);
+  Channel::Transport transport = Channel::IsSharedMemoryEnabled()
+      ? Channel::Transport::SHARED_MEMORY_ACCEPTOR
+      : Channel::Transport::PLATFORM_HANDLE;
+  parent_channel_ =
+      NodeChannel::Create(this, std::move(platform_handle), transport,
+                          GetChannelTaskRunner(), io_task_runner_);
   parent_channel_->Start();
 }
 
@@ -198,9 +686,54 @@ void NodeController::RequestParentPortConnectionOnIOThread(
   parent_channel_->RequestPortConnection(local_port.name(), token);
 }
 
+void NodeController::ClaimPooledParentPortOnIOThread(
+    const ports::PortName& pooled_port_name,
+    const std::string& token) {
+  DCHECK(io_task_runner_->RunsTasksOnCurrentThread());
+
+  if (!parent_channel_) {
+    DVLOG(1) << "Lost parent node connection.";
+    return;
+  }
+
+  parent_channel_->ClaimPooledPort(pooled_port_name, token);
+}
+
+void NodeController::ProvidePortPool(const ports::NodeName& name,
+                                     size_t num_ports) {
+  DCHECK(io_task_runner_->RunsTasksOnCurrentThread());
+
+  scoped_refptr<NodeChannel> peer = GetPeerChannel(name);
+  if (!peer)
+    return;
+
+  std::vector<PooledPort> pooled_ports(num_ports);
+  std::vector<NodeChannel::PooledPortNames> port_names(num_ports);
+  for (size_t i = 0; i < num_ports; ++i) {
+    PooledPort& pooled_port = pooled_ports[i];
+    node_->CreateUninitializedPort(&pooled_port.port);
+    GenerateRandomPortName(&pooled_port.peer_port_name);
+    CHECK_EQ(ports::OK, node_->InitializePort(pooled_port.port, name,
+                                              pooled_port.peer_port_name));
+
+    port_names[i].port_name = pooled_port.port.name();
+    port_names[i].peer_port_name = pooled_port.peer_port_name;
+  }
+
+  {
+    base::AutoLock lock(port_pools_lock_);
+    std::vector<PooledPort>& pool = child_port_pools_[name];
+    pool.insert(pool.end(), pooled_ports.begin(), pooled_ports.end());
+  }
+
+  // Nothing is sent to the pooled ports' peers until they're claimed, so the
+  // peers are sure to have been created by then.
+  peer->ProvidePortPool(port_names);
+}
+
 scoped_refptr<NodeChannel> NodeController::GetPeerChannel(
     const ports::NodeName& name) {
-  base::AutoLock lock(peers_lock_);
+  ProfiledAutoLock lock(peers_lock_);
   auto it = peers_.find(name);
   if (it == peers_.end())
     return nullptr;
@@ -217,7 +750,7 @@ void NodeController::AddPeer(const ports::NodeName& name,
 
   channel->SetRemoteNodeName(name);
 
-  base::AutoLock lock(peers_lock_);
+  ProfiledAutoLock lock(peers_lock_);
   if (peers_.find(name) != peers_.end()) {
     // This can happen normally if two nodes race to be introduced to each
     // other. The losing pipe will be silently closed and introduction should
@@ -238,7 +771,7 @@ void NodeController::AddPeer(const ports::NodeName& name,
   OutgoingMessageQueue pending_messages;
   auto it = pending_peer_messages_.find(name);
   if (it != pending_peer_messages_.end()) {
-    auto& message_queue = it->second;
+    auto& message_queue = it->second.messages;
     while (!message_queue.empty()) {
       ports::ScopedMessage message = std::move(message_queue.front());
       channel->PortsMessage(
@@ -252,27 +785,60 @@ void NodeController::AddPeer(const ports::NodeName& name,
 void NodeController::DropPeer(const ports::NodeName& name) {
   DCHECK(io_task_runner_->RunsTasksOnCurrentThread());
 
+  // Anything already received from the peer is delivered before the Node
+  // learns that its connection is gone. A channel on another I/O thread has
+  // delivered its own before reporting an error.
+  AcceptPendingPortsMessages();
+
   {
-    base::AutoLock lock(peers_lock_);
+    ProfiledAutoLock lock(peers_lock_);
     auto it = peers_.find(name);
 
     if (it != peers_.end()) {
       ports::NodeName peer = it->first;
       peers_.erase(it);
+      MetricsRegistry::Increment(MetricsRegistry::kPeersDropped);
       DVLOG(1) << "Dropped peer " << peer;
     }
 
     pending_peer_messages_.erase(name);
     pending_children_.erase(name);
+
+    for (auto it = introduced_peers_.begin(); it != introduced_peers_.end();) {
+      if (it->first == name || it->second == name)
+        it = introduced_peers_.erase(it);
+      else
+        ++it;
+    }
+  }
+
+  std::vector<PooledPort> unclaimed_ports;
+  {
+    base::AutoLock lock(port_pools_lock_);
+    auto it = child_port_pools_.find(name);
+    if (it != child_port_pools_.end()) {
+      unclaimed_ports.swap(it->second);
+      child_port_pools_.erase(it);
+    }
+    if (name == parent_name_) {
+      unclaimed_ports.insert(unclaimed_ports.end(), parent_port_pool_.begin(),
+                             parent_port_pool_.end());
+      parent_port_pool_.clear();
+    }
   }
 
   node_->LostConnectionToNode(name);
+
+  // Nobody else knows of these ports, so they would otherwise never be closed.
+  for (const PooledPort& pooled_port : unclaimed_ports)
+    node_->ClosePort(pooled_port.port);
 }
 
 void NodeController::SendPeerMessage(const ports::NodeName& name,
                                      ports::ScopedMessage message) {
   scoped_refptr<NodeChannel> peer = GetPeerChannel(name);
   if (peer) {
+    IntroducePortPeers(name, *message);
     peer->PortsMessage(
         static_cast<PortsMessage*>(message.get())->TakeChannelMessage());
     return;
@@ -280,11 +846,13 @@ void NodeController::SendPeerMessage(const ports::NodeName& name,
 
   if (parent_name_ == ports::kInvalidNodeName) {
     DVLOG(1) << "Dropping message for unknown peer: " << name;
+    MetricsRegistry::Increment(MetricsRegistry::kPeerMessagesDropped);
     return;
   }
 
   if (!parent_channel_) {
     DVLOG(1) << "Lost connection to parent.";
+    MetricsRegistry::Increment(MetricsRegistry::kPeerMessagesDropped);
     return;
   }
 
@@ -292,29 +860,180 @@ void NodeController::SendPeerMessage(const ports::NodeName& name,
   // is the first message queued for the peer, we also ask the parent to
   // introduce us to them.
 
-  bool needs_introduction = false;
+  size_t num_bytes = message->num_header_bytes() +
+                     message->num_ports_bytes() +
+                     message->num_payload_bytes();
+  bool post_introduction_task = false;
+  bool overflowed = false;
+  size_t num_dropped = 0;
   {
-    base::AutoLock lock(peers_lock_);
-    auto& queue = pending_peer_messages_[name];
-    needs_introduction = queue.empty();
-    queue.emplace(std::move(message));
+    ProfiledAutoLock lock(peers_lock_);
+    PendingPeerMessages& pending = pending_peer_messages_[name];
+    if (pending.messages.size() >= kMaxPendingPeerMessages ||
+        pending.num_bytes + num_bytes > kMaxPendingPeerBytes) {
+      num_dropped = pending.messages.size() + 1;
+      pending_peer_messages_.erase(name);
+      overflowed = true;
+    } else {
+      if (pending.messages.empty()) {
+        // Only the first of a batch of introduction requests posts the task
+        // which sends them.
+        post_introduction_task = pending_introductions_.empty();
+        pending_introductions_.push_back(name);
+      }
+      pending.messages.emplace(std::move(message));
+      pending.num_bytes += num_bytes;
+    }
+  }
+
+  if (overflowed) {
+    // The peer isn't being introduced, or can't keep up. Treat it as lost
+    // rather than queueing without bound; the Node must not be re-entered
+    // from here, so this happens on the I/O thread.
+    DLOG(ERROR) << "Dropping peer " << name << " with too many messages "
+                << "pending introduction.";
+    MetricsRegistry::Increment(MetricsRegistry::kPeersDropped);
+    MetricsRegistry::Add(MetricsRegistry::kPeerMessagesDropped, num_dropped);
+    io_task_runner_->PostTask(
+        FROM_HERE,
+        base::Bind(&NodeController::DropPeer, base::Unretained(this), name));
+    return;
+  }
+
+  if (post_introduction_task) {
+    io_task_runner_->PostTask(
+        FROM_HERE,
+        base::Bind(&NodeController::RequestPendingIntroductions,
+                   base::Unretained(this)));
+  }
+}
+
+void NodeController::IntroducePortPeers(const ports::NodeName& to_node,
+                                        const ports::Message& message) {
+  if (!eager_introductions_enabled_.load(std::memory_order_relaxed) ||
+      parent_name_ != ports::kInvalidNodeName) {
+    return;
+  }
+
+  // Either way |to_node| is about to send to a port on the other node, and
+  // will hear back from it.
+  std::vector<ports::NodeName> peer_node_names;
+  switch (ports::GetEventHeader(message)->type) {
+    case ports::EventType::kUser: {
+      // The peers of ports carried by the message.
+      const ports::UserEventData* event =
+          ports::GetEventData<ports::UserEventData>(message);
+      const ports::PortDescriptor* descriptors =
+          ports::GetPortDescriptors(event);
+      for (uint32_t i = 0; i < event->num_ports; ++i)
+        peer_node_names.push_back(descriptors[i].peer_node_name);
+      break;
+    }
+
+    case ports::EventType::kObserveProxy:
+      // The new peer of a port whose peer was a proxy.
+      peer_node_names.push_back(
+          ports::GetEventData<ports::ObserveProxyEventData>(message)
+              ->proxy_to_node_name);
+      break;
+
+    default:
+      return;
   }
 
-  if (needs_introduction)
-    parent_channel_->RequestIntroduction(name);
+  for (const ports::NodeName& peer_node_name : peer_node_names) {
+    if (peer_node_name != name_ && peer_node_name != to_node &&
+        peer_node_name != ports::kInvalidNodeName) {
+      IntroducePeers(to_node, peer_node_name);
+    }
+  }
+}
+
+void NodeController::IntroducePeers(const ports::NodeName& a,
+                                    const ports::NodeName& b) {
+  scoped_refptr<NodeChannel> a_channel;
+  scoped_refptr<NodeChannel> b_channel;
+  {
+    ProfiledAutoLock lock(peers_lock_);
+    auto a_it = peers_.find(a);
+    auto b_it = peers_.find(b);
+    if (a_it == peers_.end() || b_it == peers_.end())
+      return;
+    if (!introduced_peers_.insert(std::minmax(a, b)).second)
+      return;
+    a_channel = a_it->second;
+    b_channel = b_it->second;
+  }
+
+  DVLOG(1) << "Introducing " << a << " and " << b << " ahead of time.";
+  PlatformChannelPair new_channel;
+  a_channel->Introduce(b, new_channel.PassServerHandle());
+  b_channel->Introduce(a, new_channel.PassClientHandle());
+}
+
+void NodeController::RequestPendingIntroductions() {
+  DCHECK(io_task_runner_->RunsTasksOnCurrentThread());
+
+  std::vector<ports::NodeName> names;
+  {
+    ProfiledAutoLock lock(peers_lock_);
+    std::swap(names, pending_introductions_);
+  }
+
+  if (!parent_channel_) {
+    DVLOG(1) << "Lost connection to parent.";
+    return;
+  }
+
+  if (names.size() == 1)
+    parent_channel_->RequestIntroduction(names[0]);
+  else if (!names.empty())
+    parent_channel_->RequestIntroductions(names);
 }
 
 void NodeController::AcceptIncomingMessages() {
-  std::queue<ports::ScopedMessage> messages;
+  std::vector<ports::ScopedMessage> messages;
   {
-    base::AutoLock lock(messages_lock_);
+    ProfiledAutoLock lock(messages_lock_);
     std::swap(messages, incoming_messages_);
   }
 
-  while (!messages.empty()) {
-    node_->AcceptMessage(std::move(messages.front()));
-    messages.pop();
+  for (const auto& message : messages)
+    MessageTracer::RecordMessage(*message, MessageTracePoint::kAcceptMessage);
+  node_->AcceptMessages(std::move(messages));
+}
+
+void NodeController::AcceptPendingPortsMessages() {
+  std::vector<ports::ScopedMessage>* pending_messages =
+      GetPendingPortsMessages();
+  if (pending_messages->empty())
+    return;
+
+  std::vector<ports::ScopedMessage> messages;
+  std::swap(messages, *pending_messages);
+  for (const auto& message : messages)
+    MessageTracer::RecordMessage(*message, MessageTracePoint::kAcceptMessage);
+  node_->AcceptMessages(std::move(messages));
+}
+
+std::vector<ports::ScopedMessage>* NodeController::GetPendingPortsMessages() {
+  auto* messages = static_cast<std::vector<ports::ScopedMessage>*>(
+      pending_ports_messages_.Get());
+  if (!messages) {
+    messages = new std::vector<ports::ScopedMessage>;
+    pending_ports_messages_.Set(messages);
   }
+  return messages;
+}
+
+scoped_refptr<base::TaskRunner> NodeController::GetChannelTaskRunner() {
+  DCHECK(io_task_runner_->RunsTasksOnCurrentThread());
+  DCHECK(!channel_task_runners_.empty());
+  scoped_refptr<base::TaskRunner> task_runner =
+      channel_task_runners_[next_channel_task_runner_];
+  next_channel_task_runner_ =
+      (next_channel_task_runner_ + 1) % channel_task_runners_.size();
+  return task_runner;
 }
 
 void NodeController::DropAllPeers() {
@@ -328,7 +1047,7 @@ void NodeController::DropAllPeers() {
 
   std::vector<scoped_refptr<NodeChannel>> all_peers;
   {
-    base::AutoLock lock(peers_lock_);
+    ProfiledAutoLock lock(peers_lock_);
     for (const auto& peer : peers_)
       all_peers.push_back(peer.second);
     for (const auto& peer : pending_children_)
@@ -336,6 +1055,13 @@ void NodeController::DropAllPeers() {
     peers_.clear();
     pending_children_.clear();
     pending_peer_messages_.clear();
+    pending_introductions_.clear();
+  }
+
+  {
+    base::AutoLock lock(port_pools_lock_);
+    child_port_pools_.clear();
+    parent_port_pool_.clear();
   }
 
   for (const auto& peer : all_peers)
@@ -346,6 +1072,14 @@ void NodeController::GenerateRandomPortName(ports::PortName* port_name) {
   GenerateRandomName(port_name);
 }
 
+void NodeController::GenerateRandomPortNames(ports::PortName* port_names,
+                                             size_t num_port_names) {
+  // The thread's buffer is looked up once for all of them.
+  RandomNameBuffer* buffer = g_random_name_buffer.Get().Get();
+  for (size_t i = 0; i < num_port_names; ++i)
+    buffer->GetBytes(&port_names[i], sizeof(ports::PortName));
+}
+
 void NodeController::AllocMessage(size_t num_header_bytes,
                                   size_t num_payload_bytes,
                                   size_t num_ports_bytes,
@@ -363,9 +1097,9 @@ void NodeController::ForwardMessage(const ports::NodeName& node,
 
     bool queue_was_empty = false;
     {
-      base::AutoLock lock(messages_lock_);
+      ProfiledAutoLock lock(messages_lock_);
       queue_was_empty = incoming_messages_.empty();
-      incoming_messages_.emplace(std::move(message));
+      incoming_messages_.emplace_back(std::move(message));
     }
 
     if (queue_was_empty) {
@@ -379,19 +1113,50 @@ void NodeController::ForwardMessage(const ports::NodeName& node,
   }
 }
 
-void NodeController::PortStatusChanged(const ports::PortRef& port) {
-  std::shared_ptr<ports::UserData> user_data;
-  node_->GetUserData(port, &user_data);
+void NodeController::ForwardMessages(
+    const ports::NodeName& node,
+    std::vector<ports::ScopedMessage> messages) {
+  if (node == name_) {
+    // As above, but only one lock acquisition and task for the whole batch.
+    bool queue_was_empty = false;
+    {
+      ProfiledAutoLock lock(messages_lock_);
+      queue_was_empty = incoming_messages_.empty();
+      for (auto& message : messages)
+        incoming_messages_.emplace_back(std::move(message));
+    }
 
-  PortObserver* observer = static_cast<PortObserver*>(user_data.get());
-  if (observer) {
-    observer->OnPortStatusChanged();
-  } else {
-    DVLOG(2) << "Ignoring status change for " << port.name() << " because it "
-             << "doesn't have an observer.";
+    if (queue_was_empty) {
+      io_task_runner_->PostTask(
+          FROM_HERE,
+          base::Bind(&NodeController::AcceptIncomingMessages,
+                     base::Unretained(this)));
+    }
+    return;
+  }
+
+  scoped_refptr<NodeChannel> peer = GetPeerChannel(node);
+  if (!peer) {
+    // Let SendPeerMessage deal with queueing and introduction.
+    for (auto& message : messages)
+      SendPeerMessage(node, std::move(message));
+    return;
+  }
+
+  for (auto& message : messages) {
+    IntroducePortPeers(node, *message);
+    peer->PortsMessage(
+        static_cast<PortsMessage*>(message.get())->TakeChannelMessage());
   }
 }
 
+void NodeController::PortStatusChanged(const ports::PortRef& port) {
+  // Ports with an observer notify it directly, so this is only reached for
+  // ports which don't have one.
+  DVLOG(2) << "Ignoring status change for " << port.name() << " because it "
+           << "doesn't have an observer.";
+}
+
 void NodeController::OnAcceptChild(const ports::NodeName& from_node,
                                    const ports::NodeName& parent_name,
                                    const ports::NodeName& token) {
@@ -438,6 +1203,7 @@ void NodeController::OnAcceptParent(const ports::NodeName& from_node,
   DVLOG(1) << "Parent " << name_ << " accepted child " << child_name;
 
   AddPeer(child_name, channel, false /* start_channel */);
+  ProvidePortPool(child_name, kPortPoolSize);
 }
 
 void NodeController::OnPortsMessage(
@@ -445,8 +1211,6 @@ void NodeController::OnPortsMessage(
     const void* bytes,
     size_t num_bytes,
     ScopedPlatformHandleVectorPtr platform_handles) {
-  DCHECK(io_task_runner_->RunsTasksOnCurrentThread());
-
   size_t num_header_bytes, num_payload_bytes, num_ports_bytes;
   ports::Message::Parse(bytes,
                         num_bytes,
@@ -461,7 +1225,68 @@ void NodeController::OnPortsMessage(
                        bytes,
                        num_bytes,
                        std::move(platform_handles)));
-  node_->AcceptMessage(std::move(message));
+  MessageTracer::RecordMessage(*message, MessageTracePoint::kChannelRead);
+  GetPendingPortsMessages()->emplace_back(std::move(message));
+}
+
+void NodeController::OnPortsChannelMessage(const ports::NodeName& from_node,
+                                           Channel::MessagePtr message) {
+  void* data;
+  size_t num_data_bytes;
+  NodeChannel::GetPortsMessageData(message.get(), &data, &num_data_bytes);
+
+  size_t num_header_bytes, num_payload_bytes, num_ports_bytes;
+  ports::Message::Parse(data,
+                        num_data_bytes,
+                        &num_header_bytes,
+                        &num_payload_bytes,
+                        &num_ports_bytes);
+
+  ports::ScopedMessage ports_message(
+      new PortsMessage(num_header_bytes,
+                       num_payload_bytes,
+                       num_ports_bytes,
+                       std::move(message)));
+  MessageTracer::RecordMessage(*ports_message,
+                               MessageTracePoint::kChannelRead);
+  GetPendingPortsMessages()->emplace_back(std::move(ports_message));
+}
+
+void NodeController::OnCompactPortsMessage(const ports::NodeName& from_node,
+                                           const void* payload,
+                                           size_t payload_size,
+                                           ports::PortRef* destination_port) {
+  size_t num_header_bytes, num_payload_bytes, num_ports_bytes;
+  ports::Message::Parse(payload,
+                        payload_size,
+                        &num_header_bytes,
+                        &num_payload_bytes,
+                        &num_ports_bytes);
+
+  ports::ScopedMessage message(
+      new PortsMessage(num_header_bytes,
+                       num_payload_bytes,
+                       num_ports_bytes,
+                       payload,
+                       payload_size,
+                       nullptr));
+
+  // The port is looked up once per channel and ID rather than for every
+  // message. A cached port which has since gone away is still recognized as
+  // such by the Node.
+  const ports::PortName& port_name =
+      ports::GetEventHeader(*message)->port_name;
+  if (destination_port->name() != port_name)
+    node_->GetPort(port_name, destination_port);
+  message->set_destination_port(*destination_port);
+
+  MessageTracer::RecordMessage(*message, MessageTracePoint::kChannelRead);
+  GetPendingPortsMessages()->emplace_back(std::move(message));
+}
+
+void NodeController::OnPortsMessagesDispatched(
+    const ports::NodeName& from_node) {
+  AcceptPendingPortsMessages();
 }
 
 void NodeController::OnRequestPortConnection(
@@ -557,6 +1382,13 @@ void NodeController::OnRequestIntroduction(const ports::NodeName& from_node,
     // We don't know who they're talking about!
     requestor->Introduce(name, ScopedPlatformHandle());
   } else {
+    if (eager_introductions_enabled_.load(std::memory_order_relaxed)) {
+      // Asked-for introductions always go ahead, since the requestor may
+      // have lost an earlier channel to the node. They just spare the pair
+      // a redundant eager one.
+      ProfiledAutoLock lock(peers_lock_);
+      introduced_peers_.insert(std::minmax(from_node, name));
+    }
     PlatformChannelPair new_channel;
     requestor->Introduce(name, new_channel.PassServerHandle());
     new_friend->Introduce(from_node, new_channel.PassClientHandle());
@@ -577,18 +1409,122 @@ void NodeController::OnIntroduce(const ports::NodeName& from_node,
 
   if (!channel_handle.is_valid()) {
     DLOG(ERROR) << "Could not be introduced to peer " << name;
-    base::AutoLock lock(peers_lock_);
+    ProfiledAutoLock lock(peers_lock_);
     pending_peer_messages_.erase(name);
     return;
   }
 
-  scoped_refptr<NodeChannel> channel =
-      NodeChannel::Create(this, std::move(channel_handle), io_task_runner_);
+  // Neither end of an introduced channel knows which of them should create
+  // shared memory, so these always go through the platform handle.
+  scoped_refptr<NodeChannel> channel = NodeChannel::Create(
+      this, std::move(channel_handle), Channel::Transport::PLATFORM_HANDLE,
+      GetChannelTaskRunner(), io_task_runner_);
 
   DVLOG(1) << "Adding new peer " << name << " via parent introduction.";
   AddPeer(name, channel, true /* start_channel */);
 }
 
+void NodeController::OnProvidePortPool(
+    const ports::NodeName& from_node,
+    const std::vector<NodeChannel::PooledPortNames>& port_names) {
+  DCHECK(io_task_runner_->RunsTasksOnCurrentThread());
+
+  if (from_node != parent_name_) {
+    DLOG(ERROR) << "Received unexpected ProvidePortPool message from "
+                << from_node;
+    DropPeer(from_node);
+    return;
+  }
+
+  std::vector<PooledPort> pooled_ports;
+  pooled_ports.reserve(port_names.size());
+  for (const auto& names : port_names) {
+    PooledPort pooled_port;
+    int rv = node_->CreateUninitializedPortWithName(names.peer_port_name,
+                                                    &pooled_port.port);
+    if (rv != ports::OK) {
+      DLOG(ERROR) << "Ignoring pooled port with unusable name "
+                  << names.peer_port_name;
+      continue;
+    }
+    CHECK_EQ(ports::OK, node_->InitializePort(pooled_port.port, from_node,
+                                              names.port_name));
+    pooled_port.peer_port_name = names.port_name;
+    pooled_ports.push_back(pooled_port);
+  }
+
+  base::AutoLock lock(port_pools_lock_);
+  parent_port_pool_.insert(parent_port_pool_.end(), pooled_ports.begin(),
+                           pooled_ports.end());
+}
+
+void NodeController::OnClaimPooledPort(const ports::NodeName& from_node,
+                                       const ports::PortName& pooled_port_name,
+                                       const std::string& token) {
+  DCHECK(io_task_runner_->RunsTasksOnCurrentThread());
+
+  DVLOG(2) << "Node " << name_ << " received ClaimPooledPort for token "
+           << token << " and port " << pooled_port_name;
+
+  ports::PortRef pooled_port;
+  {
+    base::AutoLock lock(port_pools_lock_);
+    auto it = child_port_pools_.find(from_node);
+    if (it != child_port_pools_.end()) {
+      std::vector<PooledPort>& pool = it->second;
+      for (auto port_it = pool.begin(); port_it != pool.end(); ++port_it) {
+        if (port_it->port.name() == pooled_port_name) {
+          pooled_port = port_it->port;
+          pool.erase(port_it);
+          break;
+        }
+      }
+    }
+  }
+
+  if (pooled_port.name() == ports::kInvalidPortName) {
+    DLOG(ERROR) << "Ignoring claim of unknown pooled port " << pooled_port_name
+                << " from node " << from_node;
+    return;
+  }
+
+  ports::PortRef reserved_port;
+  {
+    base::AutoLock lock(reserved_ports_lock_);
+    auto it = reserved_ports_.find(token);
+    if (it != reserved_ports_.end()) {
+      reserved_port = it->second;
+      reserved_ports_.erase(it);
+    }
+  }
+
+  if (reserved_port.name() == ports::kInvalidPortName) {
+    // Nothing will ever be connected to the child's port, so let it see its
+    // peer close.
+    DVLOG(1) << "Closing pooled port claimed for unknown token " << token;
+    node_->ClosePort(pooled_port);
+  } else {
+    // The reserved port takes over the pooled port's peer, and so the child's
+    // claimed port with it.
+    CHECK_EQ(ports::OK, node_->ReplaceUnusedPort(pooled_port, reserved_port));
+  }
+
+  ProvidePortPool(from_node, 1);
+}
+
+void NodeController::OnPeerCongestionChanged(const ports::NodeName& node,
+                                             bool congested) {
+  DCHECK(io_task_runner_->RunsTasksOnCurrentThread());
+
+  // A channel which is congested before the peer has been named is left to
+  // catch up on its own; nothing can be sending to ports there yet.
+  if (node == ports::kInvalidNodeName)
+    return;
+
+  // Writers to ports whose peers are on |node| see it as PEER_OVER_QUOTA.
+  node_->SetPeerNodeCongested(node, congested);
+}
+
 void NodeController::OnChannelError(const ports::NodeName& from_node) {
   if (io_task_runner_->RunsTasksOnCurrentThread()) {
     DropPeer(from_node);
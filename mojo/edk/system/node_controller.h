@@ -5,40 +5,47 @@
 #ifndef MOJO_EDK_SYSTEM_NODE_CONTROLLER_H_
 #define MOJO_EDK_SYSTEM_NODE_CONTROLLER_H_
 
+#include <atomic>
 #include <queue>
+#include <set>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include "base/containers/hash_tables.h"
+#include "base/files/file_path.h"
 #include "base/macros.h"
 #include "base/memory/ref_counted.h"
 #include "base/memory/scoped_ptr.h"
 #include "base/task_runner.h"
+#include "base/threading/thread_local_storage.h"
 #include "mojo/edk/embedder/platform_handle_vector.h"
 #include "mojo/edk/embedder/scoped_platform_handle.h"
 #include "mojo/edk/system/node_channel.h"
 #include "mojo/edk/system/ports/hash_functions.h"
 #include "mojo/edk/system/ports/name.h"
+#include "mojo/edk/system/ports/name_map.h"
 #include "mojo/edk/system/ports/node.h"
 #include "mojo/edk/system/ports/node_delegate.h"
+#include "mojo/edk/system/profiled_lock.h"
 
 namespace mojo {
 namespace edk {
 
 class Core;
 class PortsMessage;
+struct Metrics;
+struct RestoredNodeState;
 
 // The owner of ports::Node which facilitates core EDK implementation. All
 // public interface methods are safe to call from any thread.
 class NodeController : public ports::NodeDelegate,
                        public NodeChannel::Delegate {
  public:
-  class PortObserver : public ports::UserData {
-   public:
-    ~PortObserver() override {}
-    virtual void OnPortStatusChanged() = 0;
-  };
+  // Observers are notified by the Node directly, without going through
+  // PortStatusChanged.
+  using PortObserver = ports::PortObserver;
 
   // |core| owns and out-lives us.
   explicit NodeController(Core* core);
@@ -52,6 +59,21 @@ class NodeController : public ports::NodeDelegate,
   // methods are called on this object.
   void SetIOTaskRunner(scoped_refptr<base::TaskRunner> io_task_runner);
 
+  // Adds a thread on which channels to peers may do their I/O, besides the one
+  // given to SetIOTaskRunner. Each channel is assigned to one thread, in turn,
+  // so that reading and accepting messages from different peers can proceed
+  // in parallel. Control messages are still handled on the primary I/O
+  // thread. Must be called before any connections are made, and the thread
+  // must outlive the primary I/O thread.
+  void AddIOTaskRunner(scoped_refptr<base::TaskRunner> io_task_runner);
+
+  // Makes this node, if it has no parent, introduce two of its children to
+  // each other as soon as it tells one of them that a port's peer is on the
+  // other, rather than waiting for either to ask. Otherwise the first message
+  // each child sends over the moved pipe waits for a round trip to us.
+  // Applies to messages forwarded after the call.
+  void SetEagerIntroductionsEnabled(bool enabled);
+
   // Connects this node to a child node. This node will initiate a handshake.
   void ConnectToChild(ScopedPlatformHandle platform_handle);
 
@@ -66,10 +88,39 @@ class NodeController : public ports::NodeDelegate,
   scoped_ptr<PortsMessage> AllocMessage(size_t num_payload_bytes,
                                         size_t num_ports);
 
+  // Closes a port. While a ScopedPortClosureBatch is alive on this thread the
+  // closure is deferred, and OK is returned.
+  int ClosePort(const ports::PortRef& port_ref);
+
+  // Defers ClosePort() calls made on the current thread until the outermost
+  // batch goes away, then closes the ports together with ports::Node::
+  // ClosePorts, so that each peer node hears of them in one message.
+  class ScopedPortClosureBatch {
+   public:
+    explicit ScopedPortClosureBatch(NodeController* node_controller);
+    ~ScopedPortClosureBatch();
+
+   private:
+    NodeController* const node_controller_;
+
+    DISALLOW_COPY_AND_ASSIGN(ScopedPortClosureBatch);
+  };
+
   // Sends a message on a port to its peer.
   int SendMessage(const ports::PortRef& port_ref,
                   scoped_ptr<PortsMessage> message);
 
+  // Sends a sequence of messages on a port to its peer, in order. The messages
+  // must have been allocated by AllocMessage.
+  int SendMessages(const ports::PortRef& port_ref,
+                   std::vector<ports::ScopedMessage> messages);
+
+  // Sends a copy of |message| on each of |port_refs| to its peer, writing the
+  // payload to each other node only once. See ports::Node::BroadcastMessage.
+  // The message must not carry ports, platform handles or dispatchers.
+  int BroadcastMessage(const std::vector<ports::PortRef>& port_refs,
+                       scoped_ptr<PortsMessage> message);
+
   // Reserves a port associated with |token|. A peer may associate one of their
   // own ports with this one by sending us a LocatePort message with the same
   // token value.
@@ -85,20 +136,73 @@ class NodeController : public ports::NodeDelegate,
   void ConnectToParentPort(const ports::PortRef& local_port,
                            const std::string& token);
 
+  // Takes a port from those the parent has connected to us ahead of time and
+  // tells the parent to splice it into the port it reserved for |token|, as
+  // ConnectToParentPort would. Unlike that, the port is returned already
+  // connected, and messages may be written to it at once. Returns false,
+  // leaving |port_ref| untouched, if no pooled port is available.
+  bool ClaimPooledParentPort(const std::string& token,
+                             ports::PortRef* port_ref);
+
+  // Fills |metrics| from the Node, our peers and the MetricsRegistry.
+  void GetMetrics(Metrics* metrics);
+
+  // Writes the Node's routing state (see ports::Node::SaveState) and the names
+  // of our peers to |path|, and fills |channel_handles| with duplicates of the
+  // platform handles of the channels to those peers, in the same order. A new
+  // process given both can take over as this node with PrepareToRestoreState,
+  // and our peers carry on talking to it over the same channels, without any
+  // handshake. Children still in their handshake are left out. Must be called
+  // on the I/O thread, once nothing else is using the node: anything in
+  // flight on a channel is not carried over. Returns false on failure, e.g.
+  // if a pipe still has unread messages or a channel can't be handed over.
+  bool SaveState(const base::FilePath& path,
+                 ScopedPlatformHandleVectorPtr* channel_handles);
+
+  // Makes the next NodeController created in this process take over from the
+  // one which saved |path|: it takes that node's name, restores its ports and
+  // adopts |channel_handles| as the channels to its peers, once it has an I/O
+  // thread. Receiving ports restored this way have nothing left to read them,
+  // so they are closed, and their peers see them closed. Returns false if
+  // |path| can't be read or doesn't match |channel_handles|.
+  static bool PrepareToRestoreState(
+      const base::FilePath& path,
+      ScopedPlatformHandleVectorPtr channel_handles);
+
  private:
-  using NodeMap = std::unordered_map<ports::NodeName,
-                                     scoped_refptr<NodeChannel>>;
+  using NodeMap = ports::NameMap<ports::NodeName, scoped_refptr<NodeChannel>>;
   using OutgoingMessageQueue = std::queue<ports::ScopedMessage>;
 
+  // Messages waiting for an introduction to a peer, with the total size of
+  // their contents.
+  struct PendingPeerMessages {
+    PendingPeerMessages();
+    ~PendingPeerMessages();
+
+    OutgoingMessageQueue messages;
+    size_t num_bytes;
+  };
+
   struct PendingPortRequest {
     std::string token;
     ports::PortRef local_port;
   };
 
+  // A port connected ahead of time to a peer's port, which the peer returns
+  // when the port is claimed.
+  struct PooledPort {
+    ports::PortRef port;
+    ports::PortName peer_port_name;
+  };
+
+  void RestoreStateOnIOThread();
   void ConnectToChildOnIOThread(ScopedPlatformHandle platform_handle);
   void ConnectToParentOnIOThread(ScopedPlatformHandle platform_handle);
   void RequestParentPortConnectionOnIOThread(const ports::PortRef& local_port,
                                              const std::string& token);
+  void ClaimPooledParentPortOnIOThread(const ports::PortName& pooled_port_name,
+                                       const std::string& token);
+  void ProvidePortPool(const ports::NodeName& name, size_t num_ports);
 
   scoped_refptr<NodeChannel> GetPeerChannel(const ports::NodeName& name);
   void AddPeer(const ports::NodeName& name,
@@ -107,17 +211,31 @@ class NodeController : public ports::NodeDelegate,
   void DropPeer(const ports::NodeName& name);
   void SendPeerMessage(const ports::NodeName& name,
                        ports::ScopedMessage message);
+  // With eager introductions enabled, introduces |to_node| to any node which
+  // |message| names as the location of a port's peer.
+  void IntroducePortPeers(const ports::NodeName& to_node,
+                          const ports::Message& message);
+  // Introduces two of our peers to each other, unless we already have.
+  void IntroducePeers(const ports::NodeName& a, const ports::NodeName& b);
+  void RequestPendingIntroductions();
   void AcceptIncomingMessages();
+  void AcceptPendingPortsMessages();
+  std::vector<ports::ScopedMessage>* GetPendingPortsMessages();
+  scoped_refptr<base::TaskRunner> GetChannelTaskRunner();
   void DropAllPeers();
 
   // ports::NodeDelegate:
   void GenerateRandomPortName(ports::PortName* port_name) override;
+  void GenerateRandomPortNames(ports::PortName* port_names,
+                               size_t num_port_names) override;
   void AllocMessage(size_t num_header_bytes,
                     size_t num_payload_bytes,
                     size_t num_ports,
                     ports::ScopedMessage* message) override;
   void ForwardMessage(const ports::NodeName& node,
                       ports::ScopedMessage message) override;
+  void ForwardMessages(const ports::NodeName& node,
+                       std::vector<ports::ScopedMessage> messages) override;
   void PortStatusChanged(const ports::PortRef& port) override;
 
   // NodeChannel::Delegate:
@@ -131,6 +249,13 @@ class NodeController : public ports::NodeDelegate,
                       const void* payload,
                       size_t payload_size,
                       ScopedPlatformHandleVectorPtr platform_handles) override;
+  void OnPortsChannelMessage(const ports::NodeName& from_node,
+                             Channel::MessagePtr message) override;
+  void OnCompactPortsMessage(const ports::NodeName& from_node,
+                             const void* payload,
+                             size_t payload_size,
+                             ports::PortRef* destination_port) override;
+  void OnPortsMessagesDispatched(const ports::NodeName& from_node) override;
   void OnRequestPortConnection(const ports::NodeName& from_node,
                                const ports::PortName& connector_port_name,
                                const std::string& token) override;
@@ -142,6 +267,14 @@ class NodeController : public ports::NodeDelegate,
   void OnIntroduce(const ports::NodeName& from_node,
                    const ports::NodeName& name,
                    ScopedPlatformHandle channel_handle) override;
+  void OnProvidePortPool(
+      const ports::NodeName& from_node,
+      const std::vector<NodeChannel::PooledPortNames>& port_names) override;
+  void OnClaimPooledPort(const ports::NodeName& from_node,
+                         const ports::PortName& pooled_port_name,
+                         const std::string& token) override;
+  void OnPeerCongestionChanged(const ports::NodeName& node,
+                               bool congested) override;
   void OnChannelError(const ports::NodeName& from_node) override;
 
   // These are safe to access from any thread as long as the Node is alive.
@@ -151,22 +284,46 @@ class NodeController : public ports::NodeDelegate,
 
   scoped_refptr<base::TaskRunner> io_task_runner_;
 
-  // Guards |peers_| and |pending_peer_messages_|.
-  base::Lock peers_lock_;
+  // Guards |peers_|, |pending_peer_messages_|, |pending_introductions_| and
+  // |introduced_peers_|.
+  ProfiledLock peers_lock_;
 
   // Channels to known peers, including parent and children, if any.
   NodeMap peers_;
 
   // Outgoing message queues for peers we've heard of but can't yet talk to.
-  std::unordered_map<ports::NodeName, OutgoingMessageQueue>
+  // Each is bounded; a peer whose queue overflows is dropped.
+  std::unordered_map<ports::NodeName, PendingPeerMessages>
       pending_peer_messages_;
 
+  // Peers to ask the parent to introduce us to. Requests made around the same
+  // time go out as a single message.
+  std::vector<ports::NodeName> pending_introductions_;
+
+  // See SetEagerIntroductionsEnabled.
+  std::atomic<bool> eager_introductions_enabled_;
+
+  // Pairs of peers we have introduced to each other, the lesser name first.
+  // Only kept with eager introductions enabled.
+  std::set<std::pair<ports::NodeName, ports::NodeName>> introduced_peers_;
+
   // Guards |reserved_ports_|.
   base::Lock reserved_ports_lock_;
 
   // Ports reserved by token.
   base::hash_map<std::string, ports::PortRef> reserved_ports_;
 
+  // Guards |child_port_pools_| and |parent_port_pool_|.
+  base::Lock port_pools_lock_;
+
+  // The unclaimed ports we have connected to each child ahead of time.
+  std::unordered_map<ports::NodeName, std::vector<PooledPort>>
+      child_port_pools_;
+
+  // Ports the parent has connected to us ahead of time, to be claimed by
+  // ClaimPooledParentPort.
+  std::vector<PooledPort> parent_port_pool_;
+
   // All other fields below must only be accessed on the I/O thread, i.e., the
   // thread on which core_->io_task_runner() runs tasks.
 
@@ -183,9 +340,27 @@ class NodeController : public ports::NodeDelegate,
   // Port location requests which have been deferred until we have a parent.
   std::vector<PendingPortRequest> pending_port_requests_;
 
+  // The threads to which new channels' I/O is assigned, including the primary
+  // I/O thread, and the index of the next one to use.
+  std::vector<scoped_refptr<base::TaskRunner>> channel_task_runners_;
+  size_t next_channel_task_runner_;
+
+  // Ports messages received from peers which have not yet been passed to the
+  // Node. These are accepted as a single batch when the channel they came from
+  // calls OnPortsMessagesDispatched. Each I/O thread has its own batch, so
+  // this may be used on any of them.
+  base::ThreadLocalStorage::Slot pending_ports_messages_;
+
+  // The ports whose closure is deferred by ScopedPortClosureBatches on the
+  // current thread.
+  base::ThreadLocalStorage::Slot pending_port_closures_;
+
+  // Set from PrepareToRestoreState() on construction, until restored.
+  scoped_ptr<RestoredNodeState> restored_state_;
+
   // Guards |incoming_messages_|.
-  base::Lock messages_lock_;
-  std::queue<ports::ScopedMessage> incoming_messages_;
+  ProfiledLock messages_lock_;
+  std::vector<ports::ScopedMessage> incoming_messages_;
 
   DISALLOW_COPY_AND_ASSIGN(NodeController);
 };
@@ -0,0 +1,88 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/ports/compact_lock.h"
+
+#include "build/build_config.h"
+
+#if defined(OS_LINUX) || defined(OS_ANDROID)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include "base/threading/platform_thread.h"
+#endif
+
+namespace mojo {
+namespace edk {
+namespace ports {
+
+namespace {
+
+// Roughly how long a port or dispatcher critical section takes on another
+// core. Spinning much longer than that only burns the time a waiter would
+// otherwise spend parked.
+const int kMaxSpins = 100;
+
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+              "CompactLock must be a single word");
+
+void CpuRelax() {
+#if defined(__i386__) || defined(__x86_64__)
+  __asm__ __volatile__("pause");
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+// Blocks while |*word| is |value|. May return spuriously.
+void Park(std::atomic<uint32_t>* word, uint32_t value) {
+#if defined(OS_LINUX) || defined(OS_ANDROID)
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT_PRIVATE,
+          value, nullptr, nullptr, 0);
+#else
+  base::PlatformThread::YieldCurrentThread();
+#endif
+}
+
+void Unpark(std::atomic<uint32_t>* word) {
+#if defined(OS_LINUX) || defined(OS_ANDROID)
+  syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE_PRIVATE, 1,
+          nullptr, nullptr, 0);
+#endif
+}
+
+}  // namespace
+
+void CompactLock::AcquireContended() {
+  for (int i = 0; i < kMaxSpins; ++i) {
+    uint32_t state = state_.load(std::memory_order_relaxed);
+    if (state == kUnlocked) {
+      if (state_.compare_exchange_weak(state, kLocked,
+                                       std::memory_order_acquire)) {
+        return;
+      }
+    } else if (state == kLockedWithWaiters) {
+      // Others are already parked; there's no point in spinning ahead of
+      // them.
+      break;
+    }
+    CpuRelax();
+  }
+
+  // Taking the lock as kLockedWithWaiters may cause one needless wakeup when
+  // there are no other waiters, but it never loses one.
+  while (state_.exchange(kLockedWithWaiters, std::memory_order_acquire) !=
+         kUnlocked) {
+    Park(&state_, kLockedWithWaiters);
+  }
+}
+
+void CompactLock::WakeWaiter() {
+  Unpark(&state_);
+}
+
+}  // namespace ports
+}  // namespace edk
+}  // namespace mojo
@@ -0,0 +1,80 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_SYSTEM_PORTS_COMPACT_LOCK_H_
+#define MOJO_EDK_SYSTEM_PORTS_COMPACT_LOCK_H_
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include "base/logging.h"
+#include "base/macros.h"
+
+namespace mojo {
+namespace edk {
+namespace ports {
+
+// A lock which fits in a single 32-bit word, for objects which are numerous
+// and only hold their locks for a few instructions at a time, such as ports
+// and message pipe dispatchers. Uncontended acquisition and release are a
+// single atomic operation. A contended acquirer spins briefly, in case the
+// holder is about to release, and then parks: on a futex on Linux, or by
+// yielding elsewhere.
+//
+// Unlike base::Lock, it's neither recursive nor fair, and AssertAcquired()
+// only checks that some thread holds the lock.
+class CompactLock {
+ public:
+  CompactLock() : state_(kUnlocked) {}
+  ~CompactLock() {
+    DCHECK_EQ(kUnlocked, state_.load(std::memory_order_relaxed));
+  }
+
+  void Acquire() {
+    uint32_t state = kUnlocked;
+    if (!state_.compare_exchange_strong(state, kLocked,
+                                        std::memory_order_acquire)) {
+      AcquireContended();
+    }
+  }
+
+  bool Try() {
+    uint32_t state = kUnlocked;
+    return state_.compare_exchange_strong(state, kLocked,
+                                          std::memory_order_acquire);
+  }
+
+  void Release() {
+    if (state_.exchange(kUnlocked, std::memory_order_release) ==
+        kLockedWithWaiters) {
+      WakeWaiter();
+    }
+  }
+
+  void AssertAcquired() const {
+    DCHECK_NE(kUnlocked, state_.load(std::memory_order_relaxed));
+  }
+
+ private:
+  enum : uint32_t {
+    kUnlocked,
+    kLocked,
+    // Some thread may be parked, so the next release must wake one.
+    kLockedWithWaiters,
+  };
+
+  void AcquireContended();
+  void WakeWaiter();
+
+  std::atomic<uint32_t> state_;
+
+  DISALLOW_COPY_AND_ASSIGN(CompactLock);
+};
+
+}  // namespace ports
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_SYSTEM_PORTS_COMPACT_LOCK_H_
@@ -31,18 +31,42 @@ enum struct EventType : uint32_t {
   kObserveProxy,
   kObserveProxyAck,
   kObserveClosure,
+  kQuotaStatus,
+  kUserBroadcast,
+  kObserveClosures,
 };
 
 struct EventHeader {
   EventType type;
-  uint32_t padding;
+
+  // Non-zero for a message sampled for tracing by the embedder. Ports never
+  // interpret it, but keep it unchanged as the message is forwarded.
+  uint32_t trace_id;
   PortName port_name;
 };
 
 struct UserEventData {
   uint64_t sequence_num;
   uint32_t num_ports;
-  uint32_t padding;
+
+  // Zero unless set by the embedder. Like trace_id, ports never interpret it,
+  // but keep it unchanged as the message is forwarded.
+  uint32_t priority;
+};
+
+// A user message without ports sent from several ports at once, for every one
+// of their peers on the receiving node. It's followed by |num_targets|
+// BroadcastTargets and then the payload. See Node::BroadcastMessage().
+struct BroadcastEventData {
+  uint32_t num_targets;
+
+  // As for UserEventData.
+  uint32_t priority;
+};
+
+struct BroadcastTarget {
+  PortName port_name;
+  uint64_t sequence_num;
 };
 
 struct ObserveProxyEventData {
@@ -60,6 +84,23 @@ struct ObserveClosureEventData {
   uint64_t last_sequence_num;
 };
 
+// Several kObserveClosure events for ports on the same node. It's followed by
+// |num_ports| ObservedClosures. See Node::ClosePorts().
+struct ObserveClosuresEventData {
+  uint32_t num_ports;
+  uint32_t padding;
+};
+
+struct ObservedClosure {
+  PortName port_name;
+  uint64_t last_sequence_num;
+};
+
+struct QuotaStatusEventData {
+  uint32_t over_quota;
+  uint32_t padding;
+};
+
 inline const EventHeader* GetEventHeader(const Message& message) {
   return static_cast<const EventHeader*>(message.header_bytes());
 }
@@ -89,6 +130,27 @@ inline PortDescriptor* GetMutablePortDescriptors(UserEventData* event) {
   return reinterpret_cast<PortDescriptor*>(reinterpret_cast<char*>(event + 1));
 }
 
+inline const BroadcastTarget* GetBroadcastTargets(
+    const BroadcastEventData* event) {
+  return reinterpret_cast<const BroadcastTarget*>(
+      reinterpret_cast<const char*>(event + 1));
+}
+
+inline BroadcastTarget* GetMutableBroadcastTargets(BroadcastEventData* event) {
+  return reinterpret_cast<BroadcastTarget*>(reinterpret_cast<char*>(event + 1));
+}
+
+inline const ObservedClosure* GetObservedClosures(
+    const ObserveClosuresEventData* event) {
+  return reinterpret_cast<const ObservedClosure*>(
+      reinterpret_cast<const char*>(event + 1));
+}
+
+inline ObservedClosure* GetMutableObservedClosures(
+    ObserveClosuresEventData* event) {
+  return reinterpret_cast<ObservedClosure*>(reinterpret_cast<char*>(event + 1));
+}
+
 }  // namespace ports
 }  // namespace edk
 }  // namespace mojo
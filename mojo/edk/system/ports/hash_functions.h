@@ -5,27 +5,47 @@
 #ifndef MOJO_EDK_SYSTEM_PORTS_HASH_FUNCTIONS_H_
 #define MOJO_EDK_SYSTEM_PORTS_HASH_FUNCTIONS_H_
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <functional>
 
 #include "mojo/edk/system/ports/name.h"
 
+namespace mojo {
+namespace edk {
+namespace ports {
+
+// Folds both halves of a name into 64 bits and mixes the result (the
+// MurmurHash3 finalizer), so that every bit of the name affects the low bits
+// of the hash. Tables may then index by masking with a power of two.
+inline uint64_t HashName(const Name& name) {
+  uint64_t h = name.v1 ^ (name.v2 * 0x9e3779b97f4a7c15ULL);
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+}  // namespace ports
+}  // namespace edk
+}  // namespace mojo
+
 namespace std {
 
 template <>
 struct hash<mojo::edk::ports::PortName> {
   std::size_t operator()(const mojo::edk::ports::PortName& name) const {
-    size_t h1 = hash<uint64_t>()(name.v1);
-    size_t h2 = hash<uint64_t>()(name.v2);
-    return h1 ^ (h2 << 1);
+    return static_cast<size_t>(mojo::edk::ports::HashName(name));
   }
 };
 
 template <>
 struct hash<mojo::edk::ports::NodeName> {
   std::size_t operator()(const mojo::edk::ports::NodeName& name) const {
-    size_t h1 = hash<uint64_t>()(name.v1);
-    size_t h2 = hash<uint64_t>()(name.v2);
-    return h1 ^ (h2 << 1);
+    return static_cast<size_t>(mojo::edk::ports::HashName(name));
   }
 };
 
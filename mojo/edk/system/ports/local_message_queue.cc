@@ -0,0 +1,80 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/ports/local_message_queue.h"
+
+#include <algorithm>
+
+#include "base/logging.h"
+
+namespace mojo {
+namespace edk {
+namespace ports {
+
+LocalMessageQueue::LocalMessageQueue()
+    : head_(nullptr), is_delivering_(false) {}
+
+LocalMessageQueue::~LocalMessageQueue() {
+  std::vector<ScopedMessage> messages;
+  PopAll(&messages);
+}
+
+bool LocalMessageQueue::Push(ScopedMessage message) {
+  Message* new_head = message.release();
+  Message* head = head_.load(std::memory_order_relaxed);
+  do {
+    new_head->next_local_message_ = head;
+  } while (!head_.compare_exchange_weak(head, new_head));
+
+  // Sequentially consistent, so that either this sees the deliverer give up
+  // or the deliverer's StopDelivering() sees this message.
+  return !is_delivering_.exchange(true);
+}
+
+bool LocalMessageQueue::PushAll(std::vector<ScopedMessage> messages) {
+  DCHECK(!messages.empty());
+
+  // Chain the batch newest first, as it would be if pushed one at a time.
+  Message* new_head = messages.back().release();
+  Message* batch_tail = new_head;
+  for (size_t i = messages.size() - 1; i > 0; --i) {
+    Message* message = messages[i - 1].release();
+    batch_tail->next_local_message_ = message;
+    batch_tail = message;
+  }
+
+  Message* head = head_.load(std::memory_order_relaxed);
+  do {
+    batch_tail->next_local_message_ = head;
+  } while (!head_.compare_exchange_weak(head, new_head));
+
+  // See Push().
+  return !is_delivering_.exchange(true);
+}
+
+void LocalMessageQueue::PopAll(std::vector<ScopedMessage>* messages) {
+  size_t first_new_message = messages->size();
+  Message* message = head_.exchange(nullptr, std::memory_order_acquire);
+  while (message) {
+    Message* next = message->next_local_message_;
+    message->next_local_message_ = nullptr;
+    messages->emplace_back(message);
+    message = next;
+  }
+  std::reverse(messages->begin() + first_new_message, messages->end());
+}
+
+bool LocalMessageQueue::StopDelivering() {
+  is_delivering_.store(false);
+  if (!head_.load())
+    return true;
+
+  // A message was pushed after the last PopAll(). If its sender hasn't
+  // claimed delivery yet, keep delivering.
+  return is_delivering_.exchange(true);
+}
+
+}  // namespace ports
+}  // namespace edk
+}  // namespace mojo
@@ -0,0 +1,64 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_SYSTEM_PORTS_LOCAL_MESSAGE_QUEUE_H_
+#define MOJO_EDK_SYSTEM_PORTS_LOCAL_MESSAGE_QUEUE_H_
+
+#include <atomic>
+#include <vector>
+
+#include "base/macros.h"
+#include "mojo/edk/system/ports/message.h"
+
+namespace mojo {
+namespace edk {
+namespace ports {
+
+// A lock-free queue of messages awaiting delivery to local ports. Any thread
+// may push onto the queue, and whichever thread pushes onto an idle queue
+// becomes its deliverer until the queue runs dry. Messages are delivered in
+// the order they were pushed, and never by more than one thread at a time.
+//
+// Messages are linked through an intrusive pointer. Producers push onto a
+// stack with a single compare-and-swap; the deliverer takes the whole stack at
+// once and reverses it.
+class LocalMessageQueue {
+ public:
+  LocalMessageQueue();
+
+  // Destroys any messages which were never popped.
+  ~LocalMessageQueue();
+
+  // Pushes |message| onto the queue. Returns true if the caller has become
+  // the deliverer, in which case it must call PopAll() until StopDelivering()
+  // succeeds.
+  bool Push(ScopedMessage message);
+
+  // Like Push(), but pushes all of |messages| in order with a single
+  // compare-and-swap, so that nothing can be interleaved with them.
+  bool PushAll(std::vector<ScopedMessage> messages);
+
+  // Removes every queued message and appends them to |messages| in the order
+  // they were pushed. Must only be called by the deliverer.
+  void PopAll(std::vector<ScopedMessage>* messages);
+
+  // Gives up delivery once PopAll() has found nothing. Returns false if
+  // messages arrived in the meantime and the caller is still the deliverer.
+  bool StopDelivering();
+
+ private:
+  // The most recently pushed message, or null if the queue is empty.
+  std::atomic<Message*> head_;
+
+  // Whether some thread is currently delivering.
+  std::atomic<bool> is_delivering_;
+
+  DISALLOW_COPY_AND_ASSIGN(LocalMessageQueue);
+};
+
+}  // namespace ports
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_SYSTEM_PORTS_LOCAL_MESSAGE_QUEUE_H_
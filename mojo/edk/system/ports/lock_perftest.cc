@@ -0,0 +1,166 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "base/macros.h"
+#include "base/strings/stringprintf.h"
+#include "base/test/perf_time_logger.h"
+#include "mojo/edk/system/ports/node.h"
+#include "mojo/edk/system/ports/node_delegate.h"
+#include "mojo/edk/system/ports/profiled_lock.h"
+#include "mojo/edk/system/ports/test_utils.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace mojo {
+namespace edk {
+namespace ports {
+namespace test {
+namespace {
+
+const size_t kNumAcquisitionsPerThread = 1000000;
+
+// Port locks guard a few fields at a time, so each thread takes the lock,
+// bumps a counter and lets go.
+template <typename LockType>
+void LockAndIncrement(LockType* lock,
+                      uint64_t* counter,
+                      std::atomic<bool>* start) {
+  while (!start->load())
+    std::this_thread::yield();
+  for (size_t i = 0; i < kNumAcquisitionsPerThread; ++i) {
+    std::lock_guard<LockType> guard(*lock);
+    ++*counter;
+  }
+}
+
+template <typename LockType>
+void RunLockAndIncrement(const char* lock_name, size_t num_threads) {
+  LockType lock("LockPerfTest");
+  uint64_t counter = 0;
+  std::atomic<bool> start(false);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_threads; ++i) {
+    threads.emplace_back(&LockAndIncrement<LockType>, &lock, &counter,
+                         &start);
+  }
+
+  std::string test_name = base::StringPrintf(
+      "%s_LockAndIncrement_%ux%uthreads", lock_name,
+      static_cast<unsigned>(kNumAcquisitionsPerThread),
+      static_cast<unsigned>(num_threads));
+  base::PerfTimeLogger logger(test_name.c_str());
+  start = true;
+  for (auto& thread : threads)
+    thread.join();
+  logger.Done();
+
+  EXPECT_EQ(num_threads * kNumAcquisitionsPerThread, counter);
+}
+
+// std::mutex, for comparison, with the same constructor as ProfiledMutex.
+class StdMutex : public std::mutex {
+ public:
+  explicit StdMutex(const char* name) {}
+};
+
+TEST(LockPerfTest, LockAndIncrement) {
+  const size_t kNumThreads[] = {1, 2, 4, 8};
+  for (size_t num_threads : kNumThreads) {
+    RunLockAndIncrement<StdMutex>("StdMutex", num_threads);
+    RunLockAndIncrement<ProfiledMutex>("ProfiledMutex", num_threads);
+  }
+}
+
+// Only closing the ports at the end sends anything, and nothing needs to see
+// it.
+class DroppingNodeDelegate : public NodeDelegate {
+ public:
+  DroppingNodeDelegate() : next_port_name_(1) {}
+
+  void GenerateRandomPortName(PortName* port_name) override {
+    port_name->v1 = next_port_name_++;
+    port_name->v2 = 0;
+  }
+
+  void AllocMessage(size_t num_header_bytes,
+                    size_t num_payload_bytes,
+                    size_t num_ports,
+                    ScopedMessage* message) override {
+    message->reset(
+        new TestMessage(num_header_bytes, num_payload_bytes, num_ports));
+  }
+
+  void ForwardMessage(const NodeName& node_name,
+                      ScopedMessage message) override {}
+
+  void PortStatusChanged(const PortRef& port_ref) override {}
+
+ private:
+  std::atomic<uint64_t> next_port_name_;
+
+  DISALLOW_COPY_AND_ASSIGN(DroppingNodeDelegate);
+};
+
+void GetStatus(Node* node, const PortRef* port, std::atomic<bool>* start) {
+  while (!start->load())
+    std::this_thread::yield();
+  PortStatus status;
+  for (size_t i = 0; i < kNumAcquisitionsPerThread; ++i)
+    ASSERT_EQ(OK, node->GetStatus(*port, &status));
+}
+
+// Node::GetStatus() does little more than take the port lock, so this mostly
+// measures the lock's cost on the per-message path, both when every thread
+// polls the same port and when each has its own.
+void RunGetStatus(size_t num_threads, bool shared_port) {
+  DroppingNodeDelegate delegate;
+  Node node(NodeName(0, 1), &delegate);
+
+  std::vector<PortRef> ports(2 * num_threads);
+  for (size_t i = 0; i < num_threads; ++i)
+    ASSERT_EQ(OK, node.CreatePortPair(&ports[2 * i], &ports[2 * i + 1]));
+
+  std::atomic<bool> start(false);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_threads; ++i) {
+    threads.emplace_back(&GetStatus, &node,
+                         shared_port ? &ports[0] : &ports[2 * i], &start);
+  }
+
+  std::string test_name = base::StringPrintf(
+      "Node_GetStatus_%ux%uthreads_%s",
+      static_cast<unsigned>(kNumAcquisitionsPerThread),
+      static_cast<unsigned>(num_threads),
+      shared_port ? "SharedPort" : "PortPerThread");
+  base::PerfTimeLogger logger(test_name.c_str());
+  start = true;
+  for (auto& thread : threads)
+    thread.join();
+  logger.Done();
+
+  for (const PortRef& port : ports)
+    EXPECT_EQ(OK, node.ClosePort(port));
+}
+
+TEST(LockPerfTest, GetStatus) {
+  const size_t kNumThreads[] = {1, 2, 4, 8};
+  for (size_t num_threads : kNumThreads) {
+    RunGetStatus(num_threads, true);
+    RunGetStatus(num_threads, false);
+  }
+}
+
+}  // namespace
+}  // namespace test
+}  // namespace ports
+}  // namespace edk
+}  // namespace mojo
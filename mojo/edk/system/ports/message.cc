@@ -37,6 +37,21 @@ void Message::Parse(const void* bytes,
     case EventType::kObserveClosure:
       *num_header_bytes = sizeof(EventHeader) + sizeof(ObserveClosureEventData);
       break;
+    case EventType::kQuotaStatus:
+      *num_header_bytes = sizeof(EventHeader) + sizeof(QuotaStatusEventData);
+      break;
+    case EventType::kUserBroadcast:
+      // See below.
+      break;
+    case EventType::kObserveClosures: {
+      const ObserveClosuresEventData* event_data =
+          reinterpret_cast<const ObserveClosuresEventData*>(
+              reinterpret_cast<const char*>(header + 1));
+      *num_header_bytes = sizeof(EventHeader) +
+                          sizeof(ObserveClosuresEventData) +
+                          event_data->num_ports * sizeof(ObservedClosure);
+      break;
+    }
   }
 
   if (header->type == EventType::kUser) {
@@ -48,6 +63,15 @@ void Message::Parse(const void* bytes,
                         event_data->num_ports * sizeof(PortDescriptor);
     *num_ports_bytes = event_data->num_ports * sizeof(PortName);
     *num_payload_bytes = num_bytes - *num_header_bytes - *num_ports_bytes;
+  } else if (header->type == EventType::kUserBroadcast) {
+    const BroadcastEventData* event_data =
+        reinterpret_cast<const BroadcastEventData*>(
+            reinterpret_cast<const char*>(header + 1));
+    *num_header_bytes = sizeof(EventHeader) +
+                        sizeof(BroadcastEventData) +
+                        event_data->num_targets * sizeof(BroadcastTarget);
+    *num_ports_bytes = 0;
+    *num_payload_bytes = num_bytes - *num_header_bytes;
   } else {
     *num_payload_bytes = 0;
     *num_ports_bytes = 0;
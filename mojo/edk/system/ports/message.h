@@ -10,6 +10,7 @@
 #include <memory>
 
 #include "mojo/edk/system/ports/name.h"
+#include "mojo/edk/system/ports/port_ref.h"
 
 namespace mojo {
 namespace edk {
@@ -53,6 +54,15 @@ class Message {
   size_t num_ports_bytes() const { return num_ports_bytes_; }
   size_t num_ports() const { return num_ports_bytes_ / sizeof(PortName); }
 
+  // The port the message is addressed to, if the embedder already has it at
+  // hand, e.g. from a per-channel cache. Node::AcceptMessage then uses it
+  // instead of looking the port up by name. Ignored unless it's the port
+  // named in the message's header.
+  const PortRef& destination_port() const { return destination_port_; }
+  void set_destination_port(const PortRef& port_ref) {
+    destination_port_ = port_ref;
+  }
+
  protected:
   Message(size_t num_header_bytes,
           size_t num_payload_bytes,
@@ -65,6 +75,14 @@ class Message {
   size_t num_header_bytes_;
   size_t num_ports_bytes_;
   size_t num_payload_bytes_;
+
+ private:
+  friend class LocalMessageQueue;
+
+  // Links messages in a LocalMessageQueue.
+  Message* next_local_message_ = nullptr;
+
+  PortRef destination_port_;
 };
 
 typedef std::unique_ptr<Message> ScopedMessage;
@@ -13,15 +13,20 @@ namespace mojo {
 namespace edk {
 namespace ports {
 
-inline uint64_t GetSequenceNum(const ScopedMessage& message) {
-  return GetEventData<UserEventData>(*message)->sequence_num;
+namespace {
+
+inline uint64_t GetSequenceNum(const Message& message) {
+  return GetEventData<UserEventData>(message)->sequence_num;
 }
 
-// Used by std::{push,pop}_heap functions
-inline bool operator<(const ScopedMessage& a, const ScopedMessage& b) {
-  return GetSequenceNum(a) > GetSequenceNum(b);
+// A MessageFilter which runs the std::function<> selector it's given.
+bool RunSelector(const Message& message, void* context) {
+  return (*static_cast<std::function<bool(const Message&)>*>(context))(
+      message);
 }
 
+}  // namespace
+
 MessageQueue::MessageQueue() : MessageQueue(kInitialSequenceNum) {}
 
 MessageQueue::MessageQueue(uint64_t next_sequence_num)
@@ -34,20 +39,31 @@ MessageQueue::~MessageQueue() {
 }
 
 bool MessageQueue::HasNextMessage() const {
-  return !heap_.empty() && GetSequenceNum(heap_[0]) == next_sequence_num_;
+  return !ready_messages_.empty();
 }
 
 void MessageQueue::GetNextMessageIf(
     std::function<bool(const Message&)> selector,
     ScopedMessage* message) {
-  if (!HasNextMessage() || (selector && !selector(*heap_[0].get()))) {
+  if (!selector) {
+    GetNextMessageIf(nullptr, nullptr, message);
+    return;
+  }
+  GetNextMessageIf(&RunSelector, &selector, message);
+}
+
+void MessageQueue::GetNextMessageIf(MessageFilter filter,
+                                    void* context,
+                                    ScopedMessage* message) {
+  if (!HasNextMessage() ||
+      (filter && !filter(*ready_messages_.front(), context))) {
     message->reset();
     return;
   }
 
-  std::pop_heap(heap_.begin(), heap_.end());
-  *message = std::move(heap_.back());
-  heap_.pop_back();
+  *message = std::move(ready_messages_.front());
+  ready_messages_.pop_front();
+  queued_num_bytes_ -= (*message)->num_payload_bytes();
 
   next_sequence_num_++;
 }
@@ -56,15 +72,47 @@ void MessageQueue::AcceptMessage(ScopedMessage message,
                                  bool* has_next_message) {
   DCHECK(GetEventHeader(*message)->type == EventType::kUser);
 
-  // TODO: Handle sequence number roll-over.
-
-  heap_.emplace_back(std::move(message));
-  std::push_heap(heap_.begin(), heap_.end());
+  uint64_t sequence_num = GetSequenceNum(*message);
+  uint64_t next_contiguous_sequence_num =
+      next_sequence_num_ + ready_messages_.size();
+  size_t num_bytes = message->num_payload_bytes();
+
+  if (sequence_num == next_contiguous_sequence_num) {
+    // The common case: the message is the next one we're waiting for.
+    ready_messages_.emplace_back(std::move(message));
+    queued_num_bytes_ += num_bytes;
+    if (!out_of_order_messages_.empty())
+      DrainOutOfOrderMessages();
+  } else if (sequence_num > next_contiguous_sequence_num) {
+    if (out_of_order_messages_.emplace(sequence_num,
+                                       std::move(message)).second) {
+      queued_num_bytes_ += num_bytes;
+    } else {
+      DLOG(ERROR) << "Ignoring message with duplicate sequence number "
+                  << sequence_num;
+    }
+  } else {
+    DLOG(ERROR) << "Ignoring message with stale sequence number "
+                << sequence_num << " (expected at least "
+                << next_contiguous_sequence_num << ")";
+  }
 
   if (!signalable_) {
     *has_next_message = false;
   } else {
-    *has_next_message = (GetSequenceNum(heap_[0]) == next_sequence_num_);
+    *has_next_message = HasNextMessage();
+  }
+}
+
+void MessageQueue::DrainOutOfOrderMessages() {
+  uint64_t next_contiguous_sequence_num =
+      next_sequence_num_ + ready_messages_.size();
+  auto iter = out_of_order_messages_.begin();
+  while (iter != out_of_order_messages_.end() &&
+         iter->first == next_contiguous_sequence_num) {
+    ready_messages_.emplace_back(std::move(iter->second));
+    iter = out_of_order_messages_.erase(iter);
+    next_contiguous_sequence_num++;
   }
 }
 
@@ -5,10 +5,12 @@
 #ifndef MOJO_EDK_SYSTEM_PORTS_MESSAGE_QUEUE_H_
 #define MOJO_EDK_SYSTEM_PORTS_MESSAGE_QUEUE_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include <deque>
 #include <functional>
-#include <vector>
+#include <map>
 
 #include "mojo/edk/system/ports/message.h"
 
@@ -16,9 +18,22 @@ namespace mojo {
 namespace edk {
 namespace ports {
 
+// Sequence numbers are 64 bits wide and start at kInitialSequenceNum, so they
+// do not roll over in practice: even at a billion messages per second a port
+// would take centuries to exhaust them. kInvalidSequenceNum is the largest
+// representable value so that no valid sequence number can collide with it.
 const uint64_t kInitialSequenceNum = 1;
-const uint64_t kInvalidSequenceNum = 0xFFFFFFFF;
+const uint64_t kInvalidSequenceNum = 0xFFFFFFFFFFFFFFFFull;
 
+// Decides whether to take the next message, given the |context| it was
+// registered with. Unlike a std::function this never allocates, so it is what
+// the read paths use.
+typedef bool (*MessageFilter)(const Message& message, void* context);
+
+// Orders user messages by sequence number. Nearly all messages arrive in
+// order, so those are appended to a FIFO of messages ready to be read without
+// any further sorting. Messages which arrive ahead of a gap are parked in a
+// side map keyed by sequence number until the gap is filled.
 class MessageQueue {
  public:
   explicit MessageQueue();
@@ -31,10 +46,22 @@ class MessageQueue {
 
   bool HasNextMessage() const;
 
+  // The number of messages held by the queue, and the total size of their
+  // payloads. This includes messages still waiting on an earlier one.
+  size_t queued_message_count() const {
+    return ready_messages_.size() + out_of_order_messages_.size();
+  }
+  size_t queued_num_bytes() const { return queued_num_bytes_; }
+
   // Gives ownership of the message. The selector may be null.
   void GetNextMessageIf(std::function<bool(const Message&)> selector,
                         ScopedMessage* message);
 
+  // As above, but with a |filter| and its |context|. The filter may be null.
+  void GetNextMessageIf(MessageFilter filter,
+                        void* context,
+                        ScopedMessage* message);
+
   // Takes ownership of the message. Note: Messages are ordered, so while we
   // have added a message to the queue, we may still be waiting on a message
   // ahead of this one before we can let any of the messages be returned by
@@ -47,8 +74,19 @@ class MessageQueue {
   void AcceptMessage(ScopedMessage message, bool* has_next_message);
 
  private:
-  std::vector<ScopedMessage> heap_;
+  // Moves messages from |out_of_order_messages_| into |ready_messages_| for as
+  // long as they continue the contiguous run.
+  void DrainOutOfOrderMessages();
+
+  // Messages with sequence numbers |next_sequence_num_| onward, contiguous.
+  std::deque<ScopedMessage> ready_messages_;
+
+  // Messages which arrived ahead of a gap, keyed by sequence number. All keys
+  // are greater than |next_sequence_num_| + |ready_messages_.size()|.
+  std::map<uint64_t, ScopedMessage> out_of_order_messages_;
+
   uint64_t next_sequence_num_;
+  size_t queued_num_bytes_ = 0;
   bool signalable_ = true;
 };
 
@@ -0,0 +1,123 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "base/strings/stringprintf.h"
+#include "base/test/perf_time_logger.h"
+#include "mojo/edk/system/ports/event.h"
+#include "mojo/edk/system/ports/message_queue.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace mojo {
+namespace edk {
+namespace ports {
+namespace test {
+namespace {
+
+const size_t kNumMessages = 1000000;
+
+class TestMessage : public Message {
+ public:
+  explicit TestMessage(uint64_t sequence_num)
+      : Message(sizeof(EventHeader) + sizeof(UserEventData), 0, 0) {
+    start_ = new char[num_header_bytes_];
+    memset(start_, 0, num_header_bytes_);
+    GetMutableEventHeader(this)->type = EventType::kUser;
+    GetMutableEventData<UserEventData>(this)->sequence_num = sequence_num;
+  }
+
+  ~TestMessage() override {
+    delete[] start_;
+  }
+};
+
+// Builds messages with sequence numbers starting at kInitialSequenceNum, in
+// order except that each consecutive window of |window_size| messages is
+// reversed. A |window_size| of 1 yields strictly in-order messages.
+std::vector<ScopedMessage> MakeMessages(size_t window_size) {
+  std::vector<ScopedMessage> messages;
+  messages.reserve(kNumMessages);
+  for (size_t i = 0; i < kNumMessages; ++i)
+    messages.emplace_back(new TestMessage(kInitialSequenceNum + i));
+  for (size_t i = 0; i + window_size <= kNumMessages; i += window_size)
+    std::reverse(messages.begin() + i, messages.begin() + i + window_size);
+  return messages;
+}
+
+// Accepts every message and then reads them all back.
+void AcceptAllThenRead(size_t window_size) {
+  std::vector<ScopedMessage> messages = MakeMessages(window_size);
+  MessageQueue queue;
+
+  std::string test_name = base::StringPrintf(
+      "MessageQueue_AcceptAllThenRead_%ux_window%u",
+      static_cast<unsigned>(kNumMessages), static_cast<unsigned>(window_size));
+  {
+    base::PerfTimeLogger logger(test_name.c_str());
+    bool has_next_message;
+    for (auto& message : messages)
+      queue.AcceptMessage(std::move(message), &has_next_message);
+
+    ScopedMessage message;
+    for (size_t i = 0; i < kNumMessages; ++i)
+      queue.GetNextMessageIf(nullptr, &message);
+    logger.Done();
+  }
+
+  EXPECT_FALSE(queue.HasNextMessage());
+  EXPECT_EQ(kInitialSequenceNum + kNumMessages, queue.next_sequence_num());
+}
+
+// Reads messages as soon as they become available, which keeps the queue
+// short. This is the pattern of a reader keeping up with its writer.
+void AcceptAndReadInterleaved(size_t window_size) {
+  std::vector<ScopedMessage> messages = MakeMessages(window_size);
+  MessageQueue queue;
+
+  std::string test_name = base::StringPrintf(
+      "MessageQueue_AcceptAndReadInterleaved_%ux_window%u",
+      static_cast<unsigned>(kNumMessages), static_cast<unsigned>(window_size));
+  {
+    base::PerfTimeLogger logger(test_name.c_str());
+    for (auto& message : messages) {
+      bool has_next_message;
+      queue.AcceptMessage(std::move(message), &has_next_message);
+      while (has_next_message) {
+        ScopedMessage next_message;
+        queue.GetNextMessageIf(nullptr, &next_message);
+        has_next_message = queue.HasNextMessage();
+      }
+    }
+    logger.Done();
+  }
+
+  EXPECT_FALSE(queue.HasNextMessage());
+  EXPECT_EQ(kInitialSequenceNum + kNumMessages, queue.next_sequence_num());
+}
+
+TEST(MessageQueuePerfTest, InOrder) {
+  AcceptAllThenRead(1);
+  AcceptAndReadInterleaved(1);
+}
+
+TEST(MessageQueuePerfTest, OutOfOrder) {
+  const size_t kWindowSizes[] = {2, 16, 256};
+  for (size_t window_size : kWindowSizes) {
+    AcceptAllThenRead(window_size);
+    AcceptAndReadInterleaved(window_size);
+  }
+}
+
+}  // namespace
+}  // namespace test
+}  // namespace ports
+}  // namespace edk
+}  // namespace mojo
@@ -24,6 +24,9 @@ inline bool operator==(const Name& a, const Name& b) {
 inline bool operator!=(const Name& a, const Name& b) {
   return !(a == b);
 }
+inline bool operator<(const Name& a, const Name& b) {
+  return a.v1 < b.v1 || (a.v1 == b.v1 && a.v2 < b.v2);
+}
 std::ostream& operator<<(std::ostream& stream, const Name& name);
 
 struct PortName : Name {
@@ -0,0 +1,191 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_SYSTEM_PORTS_NAME_MAP_H_
+#define MOJO_EDK_SYSTEM_PORTS_NAME_MAP_H_
+
+#include <stddef.h>
+
+#include <utility>
+#include <vector>
+
+#include "mojo/edk/system/ports/hash_functions.h"
+
+namespace mojo {
+namespace edk {
+namespace ports {
+
+// A hash map keyed by port or node names. It uses open addressing with linear
+// probing over a power-of-two table, indexed by the low bits of HashName(), so
+// a lookup usually touches a single slot instead of walking a bucket list.
+//
+// This supports the subset of the std::unordered_map interface used with
+// names. Unlike std::unordered_map, erasing invalidates all iterators.
+template <typename Key, typename Value>
+class NameMap {
+ public:
+  using value_type = std::pair<Key, Value>;
+
+ private:
+  struct Slot {
+    bool occupied = false;
+    value_type entry;
+  };
+
+  template <typename MapType, typename EntryType>
+  class Iterator {
+   public:
+    EntryType& operator*() const { return map_->slots_[index_].entry; }
+    EntryType* operator->() const { return &map_->slots_[index_].entry; }
+
+    Iterator& operator++() {
+      ++index_;
+      SkipEmptySlots();
+      return *this;
+    }
+
+    bool operator==(const Iterator& other) const {
+      return index_ == other.index_;
+    }
+    bool operator!=(const Iterator& other) const {
+      return index_ != other.index_;
+    }
+
+   private:
+    friend class NameMap;
+
+    Iterator(MapType* map, size_t index) : map_(map), index_(index) {
+      SkipEmptySlots();
+    }
+
+    void SkipEmptySlots() {
+      while (index_ < map_->slots_.size() && !map_->slots_[index_].occupied)
+        ++index_;
+    }
+
+    MapType* map_;
+    size_t index_;
+  };
+
+ public:
+  using iterator = Iterator<NameMap, value_type>;
+  using const_iterator = Iterator<const NameMap, const value_type>;
+
+  NameMap() : size_(0) {}
+
+  bool empty() const { return size_ == 0; }
+  size_t size() const { return size_; }
+
+  iterator begin() { return iterator(this, 0); }
+  iterator end() { return iterator(this, slots_.size()); }
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, slots_.size()); }
+
+  iterator find(const Key& key) {
+    size_t index = 0;
+    return FindSlot(key, &index) ? iterator(this, index) : end();
+  }
+  const_iterator find(const Key& key) const {
+    size_t index = 0;
+    return FindSlot(key, &index) ? const_iterator(this, index) : end();
+  }
+
+  std::pair<iterator, bool> insert(value_type entry) {
+    // Keep the load factor at or below 3/4 so that probe runs stay short and
+    // there is always an empty slot to end them.
+    if ((size_ + 1) * 4 > slots_.size() * 3)
+      Grow();
+
+    size_t index = 0;
+    if (FindSlot(entry.first, &index))
+      return std::make_pair(iterator(this, index), false);
+
+    slots_[index].occupied = true;
+    slots_[index].entry = std::move(entry);
+    ++size_;
+    return std::make_pair(iterator(this, index), true);
+  }
+
+  size_t erase(const Key& key) {
+    size_t index = 0;
+    if (!FindSlot(key, &index))
+      return 0;
+    EraseSlot(index);
+    return 1;
+  }
+
+  void erase(iterator it) { EraseSlot(it.index_); }
+
+  void clear() {
+    slots_.clear();
+    size_ = 0;
+  }
+
+ private:
+  static const size_t kMinSlots = 16;
+
+  size_t HomeSlot(const Key& key) const {
+    return static_cast<size_t>(HashName(key)) & (slots_.size() - 1);
+  }
+
+  // Returns true and the slot holding |key| if it is present. Otherwise
+  // returns false and, if the table is not empty, the slot where |key| would
+  // be inserted.
+  bool FindSlot(const Key& key, size_t* index) const {
+    if (slots_.empty())
+      return false;
+    size_t mask = slots_.size() - 1;
+    for (size_t i = HomeSlot(key); ; i = (i + 1) & mask) {
+      if (!slots_[i].occupied) {
+        *index = i;
+        return false;
+      }
+      if (slots_[i].entry.first == key) {
+        *index = i;
+        return true;
+      }
+    }
+  }
+
+  void Grow() {
+    size_t num_slots = slots_.size() * 2;
+    if (num_slots == 0)
+      num_slots = kMinSlots;
+    std::vector<Slot> old_slots(num_slots);
+    std::swap(slots_, old_slots);
+    size_ = 0;
+    for (Slot& slot : old_slots) {
+      if (slot.occupied)
+        insert(std::move(slot.entry));
+    }
+  }
+
+  // Empties |index|, then shifts back any later entries in the same probe run
+  // which can no longer be reached across the hole.
+  void EraseSlot(size_t index) {
+    size_t mask = slots_.size() - 1;
+    size_t hole = index;
+    for (size_t i = (hole + 1) & mask; slots_[i].occupied; i = (i + 1) & mask) {
+      // The entry at |i| may only move into the hole if the hole lies between
+      // its home slot and |i|.
+      size_t home = HomeSlot(slots_[i].entry.first);
+      if (((i - home) & mask) < ((i - hole) & mask))
+        continue;
+      slots_[hole].entry = std::move(slots_[i].entry);
+      hole = i;
+    }
+    slots_[hole].occupied = false;
+    slots_[hole].entry = value_type();
+    --size_;
+  }
+
+  std::vector<Slot> slots_;
+  size_t size_;
+};
+
+}  // namespace ports
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_SYSTEM_PORTS_NAME_MAP_H_
@@ -6,6 +6,8 @@
 
 #include <string.h>
 
+#include <algorithm>
+
 #include "base/logging.h"
 #include "mojo/edk/system/ports/node_delegate.h"
 
@@ -33,16 +35,66 @@ bool CanAcceptMoreMessages(const Port* port) {
   return true;
 }
 
+// The layout of a snapshot taken by Node::SaveState(): a NodeStateHeader,
+// followed by a SavedPortState for each of its ports.
+struct NodeStateHeader {
+  NodeName node_name;
+  uint32_t num_ports;
+  uint32_t padding;
+};
+
+struct SavedPortState {
+  PortName port_name;
+  NodeName peer_node_name;
+  PortName peer_port_name;
+
+  // For a proxy, the peer it had before it was sent.
+  NodeName proxied_peer_node_name;
+  PortName proxied_peer_port_name;
+
+  uint64_t next_sequence_num_to_send;
+  uint64_t next_sequence_num_to_receive;
+  uint64_t last_sequence_num_to_receive;
+  uint64_t max_queued_messages;
+  uint64_t max_queued_bytes;
+  uint32_t state;
+  uint8_t peer_closed;
+  uint8_t remove_proxy_on_last_message;
+  uint8_t over_quota;
+  uint8_t peer_over_quota;
+};
+
+// A MessageFilter which runs the std::function<> selector it's given.
+bool RunSelector(const Message& message, void* context) {
+  return (*static_cast<std::function<bool(const Message&)>*>(context))(
+      message);
+}
+
 }  // namespace
 
 Node::Node(const NodeName& name, NodeDelegate* delegate)
     : name_(name),
-      delegate_(delegate) {
+      delegate_(delegate),
+      port_slab_(std::make_shared<Slab>()),
+      peer_index_lock_("Node::peer_index_lock") {
+}
+
+Node::Node(const NodeName& name,
+           NodeDelegate* delegate,
+           const SlabMemoryFunctions& port_memory_functions)
+    : name_(name),
+      delegate_(delegate),
+      port_slab_(std::make_shared<Slab>(port_memory_functions)),
+      peer_index_lock_("Node::peer_index_lock") {
 }
 
 Node::~Node() {
-  if (!ports_.empty())
-    DLOG(WARNING) << "Unclean shutdown for node " << name_;
+  for (size_t i = 0; i < kNumPortShards; ++i) {
+    if (!port_shards_[i].ports.empty()) {
+      DLOG(WARNING) << "Unclean shutdown for node " << name_;
+      break;
+    }
+  }
 }
 
 int Node::GetPort(const PortName& port_name, PortRef* port_ref) {
@@ -57,15 +109,7 @@ int Node::GetPort(const PortName& port_name, PortRef* port_ref) {
 int Node::CreateUninitializedPort(PortRef* port_ref) {
   PortName port_name;
   delegate_->GenerateRandomPortName(&port_name);
-
-  std::shared_ptr<Port> port = std::make_shared<Port>(kInitialSequenceNum,
-                                                      kInitialSequenceNum);
-  int rv = AddPortWithName(port_name, port);
-  if (rv != OK)
-    return rv;
-
-  *port_ref = PortRef(port_name, std::move(port));
-  return OK;
+  return CreateUninitializedPortWithName(port_name, port_ref);
 }
 
 int Node::InitializePort(const PortRef& port_ref,
@@ -73,19 +117,105 @@ int Node::InitializePort(const PortRef& port_ref,
                          const PortName& peer_port_name) {
   Port* port = port_ref.port();
 
+  PortObserver* observer = nullptr;
   {
-    std::lock_guard<std::mutex> guard(port->lock);
+    std::lock_guard<ProfiledMutex> guard(port->lock);
     if (port->state != Port::kUninitialized)
       return ERROR_PORT_STATE_UNEXPECTED;
 
     port->state = Port::kReceiving;
     port->peer_node_name = peer_node_name;
     port->peer_port_name = peer_port_name;
+    UpdatePeerIndex(port_ref.name(), port, peer_node_name);
+    UpdatePeerNodeCongested_Locked(port);
+    UpdateStatus_Locked(port);
+    observer = port->observer.get();
 
     FlushOutgoingMessages_Locked(port);
   }
 
-  delegate_->PortStatusChanged(port_ref);
+  NotifyPortStatusChanged(port_ref, observer);
+
+  return OK;
+}
+
+int Node::CreateUninitializedPortWithName(const PortName& port_name,
+                                          PortRef* port_ref) {
+  std::shared_ptr<Port> port = NewPort(kInitialSequenceNum,
+                                       kInitialSequenceNum);
+  int rv = AddPortWithName(port_name, port);
+  if (rv != OK)
+    return rv;
+
+  *port_ref = PortRef(port_name, std::move(port));
+  return OK;
+}
+
+int Node::ReplaceUnusedPort(const PortRef& unused_port_ref,
+                            const PortRef& port_ref) {
+  Port* unused_port = unused_port_ref.port();
+  Port* port = port_ref.port();
+
+  PortObserver* observer = nullptr;
+  {
+    // The unused port has never been sent or handed to the embedder, so
+    // nothing else can hold |port|'s lock while waiting for this one.
+    std::lock_guard<ProfiledMutex> unused_guard(unused_port->lock);
+    if (unused_port->state != Port::kReceiving ||
+        unused_port->next_sequence_num_to_send != kInitialSequenceNum ||
+        unused_port->message_queue.next_sequence_num() !=
+            kInitialSequenceNum) {
+      return ERROR_PORT_STATE_UNEXPECTED;
+    }
+
+    {
+      std::lock_guard<ProfiledMutex> guard(port->lock);
+      if (port->state != Port::kUninitialized)
+        return ERROR_PORT_STATE_UNEXPECTED;
+
+      // Neither side has sent anything yet, so |port| can carry on the
+      // sequence numbers from the start.
+      port->state = Port::kReceiving;
+      port->peer_node_name = unused_port->peer_node_name;
+      port->peer_port_name = unused_port->peer_port_name;
+      UpdatePeerIndex(port_ref.name(), port, port->peer_node_name);
+      UpdatePeerNodeCongested_Locked(port);
+      port->peer_closed = unused_port->peer_closed;
+      port->last_sequence_num_to_receive =
+          unused_port->last_sequence_num_to_receive;
+      UpdateStatus_Locked(port);
+      observer = port->observer.get();
+
+      FlushOutgoingMessages_Locked(port);
+    }
+
+    // Messages the peer has already sent to the unused port are forwarded,
+    // and the peer is then told to send to |port| directly.
+    unused_port->state = Port::kProxying;
+    Port::ColdState* unused_cold_state = unused_port->GetOrCreateColdState();
+    unused_cold_state->proxied_peer_node_name = unused_port->peer_node_name;
+    unused_cold_state->proxied_peer_port_name = unused_port->peer_port_name;
+    unused_port->peer_node_name = name_;
+    unused_port->peer_port_name = port_ref.name();
+    UpdatePeerIndex(unused_port_ref.name(), unused_port, name_);
+    UpdatePeerNodeCongested_Locked(unused_port);
+    UpdateStatus_Locked(unused_port);
+
+    int rv = ForwardMessages_Locked(unused_port, unused_port_ref.name());
+    if (rv != OK)
+      return rv;
+
+    if (unused_port->peer_closed) {
+      // The peer is gone and |port| has learned its last sequence number, so
+      // the proxy only has to see the rest of the peer's messages through.
+      unused_port->remove_proxy_on_last_message = true;
+      MaybeRemoveProxy_Locked(unused_port, unused_port_ref.name());
+    } else {
+      InitiateProxyRemoval_Locked(unused_port, unused_port_ref.name());
+    }
+  }
+
+  NotifyPortStatusChanged(port_ref, observer);
 
   return OK;
 }
@@ -112,11 +242,66 @@ int Node::CreatePortPair(PortRef* port0_ref, PortRef* port1_ref) {
   return OK;
 }
 
+int Node::CreatePortPairs(size_t num_pairs, std::vector<PortRef>* port_refs) {
+  const size_t num_ports = 2 * num_pairs;
+  std::vector<PortName> port_names(num_ports);
+  delegate_->GenerateRandomPortNames(port_names.data(), num_ports);
+
+  // Each port is ready to go before it's added to the table, which is the
+  // first place anyone else could find it.
+  std::vector<std::shared_ptr<Port>> ports(num_ports);
+  std::vector<size_t> ports_by_shard[kNumPortShards];
+  for (size_t i = 0; i < num_ports; ++i) {
+    std::shared_ptr<Port> port = NewPort(kInitialSequenceNum,
+                                         kInitialSequenceNum);
+    {
+      std::lock_guard<ProfiledMutex> guard(port->lock);
+      port->state = Port::kReceiving;
+      port->peer_node_name = name_;
+      port->peer_port_name = port_names[i ^ 1];
+      UpdateStatus_Locked(port.get());
+    }
+    ports[i] = std::move(port);
+    ports_by_shard[port_names[i].v1 % kNumPortShards].push_back(i);
+  }
+
+  std::vector<size_t> added_ports;
+  added_ports.reserve(num_ports);
+  int rv = OK;
+  for (size_t shard_index = 0; shard_index < kNumPortShards && rv == OK;
+       ++shard_index) {
+    if (ports_by_shard[shard_index].empty())
+      continue;
+    PortShard& shard = port_shards_[shard_index];
+    std::lock_guard<ProfiledMutex> guard(shard.lock);
+    for (size_t i : ports_by_shard[shard_index]) {
+      if (!shard.ports.insert(std::make_pair(port_names[i], ports[i])).second) {
+        rv = OOPS(ERROR_PORT_EXISTS);  // Suggests a bad UUID generator.
+        break;
+      }
+      added_ports.push_back(i);
+    }
+  }
+
+  if (rv != OK) {
+    for (size_t i : added_ports)
+      ErasePort(port_names[i]);
+    return rv;
+  }
+
+  DVLOG(1) << "Created " << num_pairs << " port pairs@" << name_;
+
+  port_refs->reserve(port_refs->size() + num_ports);
+  for (size_t i = 0; i < num_ports; ++i)
+    port_refs->push_back(PortRef(port_names[i], std::move(ports[i])));
+  return OK;
+}
+
 int Node::SetUserData(const PortRef& port_ref,
                       std::shared_ptr<UserData> user_data) {
   Port* port = port_ref.port();
 
-  std::lock_guard<std::mutex> guard(port->lock);
+  std::lock_guard<ProfiledMutex> guard(port->lock);
   if (port->state == Port::kClosed)
     return ERROR_PORT_STATE_UNEXPECTED;
 
@@ -125,11 +310,27 @@ int Node::SetUserData(const PortRef& port_ref,
   return OK;
 }
 
+int Node::SetPortObserver(const PortRef& port_ref,
+                          std::shared_ptr<PortObserver> observer) {
+  Port* port = port_ref.port();
+
+  std::lock_guard<ProfiledMutex> guard(port->lock);
+  if (port->state == Port::kClosed)
+    return ERROR_PORT_STATE_UNEXPECTED;
+
+  if (port->observer)
+    port->GetOrCreateColdState()->retired_observers.emplace_back(
+        std::move(port->observer));
+  port->observer = std::move(observer);
+
+  return OK;
+}
+
 int Node::GetUserData(const PortRef& port_ref,
                       std::shared_ptr<UserData>* user_data) {
   Port* port = port_ref.port();
 
-  std::lock_guard<std::mutex> guard(port->lock);
+  std::lock_guard<ProfiledMutex> guard(port->lock);
   if (port->state == Port::kClosed)
     return ERROR_PORT_STATE_UNEXPECTED;
 
@@ -139,61 +340,137 @@ int Node::GetUserData(const PortRef& port_ref,
 }
 
 int Node::ClosePort(const PortRef& port_ref) {
+  NodeName peer_node_name;
+  ObservedClosure closure;
+  int rv = MarkPortClosed(port_ref, &peer_node_name, &closure);
+  if (rv != OK)
+    return rv;
+
   ObserveClosureEventData data;
-  NodeName peer_name;
+  data.last_sequence_num = closure.last_sequence_num;
+  delegate_->ForwardMessage(
+      peer_node_name,
+      NewInternalMessage(closure.port_name, EventType::kObserveClosure, data));
 
-  Port* port = port_ref.port();
-  {
-    std::lock_guard<std::mutex> guard(port->lock);
-    if (port->state != Port::kReceiving)
-      return ERROR_PORT_STATE_UNEXPECTED;
+  ErasePort(port_ref.name());
+  return OK;
+}
 
-    port->state = Port::kClosed;
+int Node::ClosePorts(const std::vector<PortRef>& port_refs) {
+  int first_error = OK;
+  std::unordered_map<NodeName, std::vector<ObservedClosure>> closures;
+  std::vector<PortName> closed_port_names;
+  for (const PortRef& port_ref : port_refs) {
+    NodeName peer_node_name;
+    ObservedClosure closure;
+    int rv = MarkPortClosed(port_ref, &peer_node_name, &closure);
+    if (rv != OK) {
+      if (first_error == OK)
+        first_error = rv;
+      continue;
+    }
+    closures[peer_node_name].push_back(closure);
+    closed_port_names.push_back(port_ref.name());
+  }
 
-    // We pass along the sequence number of the last message sent from this
-    // port to allow the peer to have the opportunity to consume all inbound
-    // messages before notifying the embedder that this port is closed.
-    data.last_sequence_num = port->next_sequence_num_to_send - 1;
+  for (const auto& entry : closures) {
+    const std::vector<ObservedClosure>& node_closures = entry.second;
+    if (node_closures.size() == 1) {
+      ObserveClosureEventData data;
+      data.last_sequence_num = node_closures[0].last_sequence_num;
+      delegate_->ForwardMessage(
+          entry.first,
+          NewInternalMessage(node_closures[0].port_name,
+                             EventType::kObserveClosure, data));
+      continue;
+    }
 
-    peer_name = port->peer_node_name;
+    size_t num_header_bytes = sizeof(EventHeader) +
+                              sizeof(ObserveClosuresEventData) +
+                              node_closures.size() * sizeof(ObservedClosure);
+    ScopedMessage message;
+    delegate_->AllocMessage(num_header_bytes, 0, 0, &message);
+    memset(message->mutable_header_bytes(), 0, num_header_bytes);
+
+    GetMutableEventHeader(message.get())->type = EventType::kObserveClosures;
+    ObserveClosuresEventData* data =
+        GetMutableEventData<ObserveClosuresEventData>(message.get());
+    data->num_ports = static_cast<uint32_t>(node_closures.size());
+    std::copy(node_closures.begin(), node_closures.end(),
+              GetMutableObservedClosures(data));
+    delegate_->ForwardMessage(entry.first, std::move(message));
   }
 
-  delegate_->ForwardMessage(
-      port->peer_node_name,
-      NewInternalMessage(port->peer_port_name, EventType::kObserveClosure,
-                         data));
-
-  ErasePort(port_ref.name());
-  return OK;
+  for (const PortName& port_name : closed_port_names)
+    ErasePort(port_name);
+  return first_error;
 }
 
-int Node::GetStatus(const PortRef& port_ref, PortStatus* port_status) {
+int Node::SetQuota(const PortRef& port_ref,
+                   size_t max_queued_messages,
+                   size_t max_queued_bytes) {
   Port* port = port_ref.port();
 
-  std::lock_guard<std::mutex> guard(port->lock);
+  std::lock_guard<ProfiledMutex> guard(port->lock);
+  if (port->state != Port::kReceiving && port->state != Port::kUninitialized)
+    return ERROR_PORT_STATE_UNEXPECTED;
 
-  if (port->state != Port::kReceiving)
+  if (max_queued_messages || max_queued_bytes || port->cold_state()) {
+    Port::ColdState* cold_state = port->GetOrCreateColdState();
+    cold_state->max_queued_messages = max_queued_messages;
+    cold_state->max_queued_bytes = max_queued_bytes;
+  }
+  if (port->state == Port::kReceiving)
+    UpdateQuotaStatus_Locked(port);
+
+  return OK;
+}
+
+int Node::GetStatus(const PortRef& port_ref, PortStatus* port_status) {
+  uint32_t status = port_ref.port()->status.load(std::memory_order_acquire);
+  if (!(status & Port::kStatusReceiving))
     return ERROR_PORT_STATE_UNEXPECTED;
 
-  port_status->has_messages = port->message_queue.HasNextMessage();
-  port_status->peer_closed = port->peer_closed;
+  port_status->has_messages = (status & Port::kStatusHasMessages) != 0;
+  port_status->peer_closed = (status & Port::kStatusPeerClosed) != 0;
+  port_status->peer_over_quota = (status & Port::kStatusPeerOverQuota) != 0;
+  port_status->peer_remote = (status & Port::kStatusPeerRemote) != 0;
   return OK;
 }
 
 int Node::GetMessage(const PortRef& port_ref, ScopedMessage* message) {
-  return GetMessageIf(port_ref, nullptr, message);
+  return GetMessageIf(port_ref, nullptr, nullptr, message);
 }
 
 int Node::GetMessageIf(const PortRef& port_ref,
                        std::function<bool(const Message&)> selector,
                        ScopedMessage* message) {
+  if (!selector)
+    return GetMessageIf(port_ref, nullptr, nullptr, message);
+  return GetMessageIf(port_ref, &RunSelector, &selector, message);
+}
+
+int Node::GetMessagesIf(const PortRef& port_ref,
+                        std::function<bool(const Message&)> selector,
+                        size_t max_messages,
+                        std::vector<ScopedMessage>* messages) {
+  if (!selector)
+    return GetMessagesIf(port_ref, nullptr, nullptr, max_messages, messages);
+  return GetMessagesIf(port_ref, &RunSelector, &selector, max_messages,
+                       messages);
+}
+
+int Node::GetMessageIf(const PortRef& port_ref,
+                       MessageFilter filter,
+                       void* context,
+                       ScopedMessage* message) {
   *message = nullptr;
 
   DVLOG(1) << "GetMessageIf for " << port_ref.name() << "@" << name_;
 
   Port* port = port_ref.port();
   {
-    std::lock_guard<std::mutex> guard(port->lock);
+    std::lock_guard<ProfiledMutex> guard(port->lock);
 
     // This could also be treated like the port being unknown since the
     // embedder should no longer be referring to a port that has been sent.
@@ -205,25 +482,55 @@ int Node::GetMessageIf(const PortRef& port_ref,
     if (!CanAcceptMoreMessages(port))
       return ERROR_PORT_PEER_CLOSED;
 
-    port->message_queue.GetNextMessageIf(selector, message);
+    port->message_queue.GetNextMessageIf(filter, context, message);
+    if (*message) {
+      UpdateStatus_Locked(port);
+      UpdateQuotaStatus_Locked(port);
+    }
   }
 
-  // Allow referenced ports to trigger PortStatusChanged calls.
-  if (*message) {
-    for (size_t i = 0; i < (*message)->num_ports(); ++i) {
-      const PortName& new_port_name = (*message)->ports()[i];
-      std::shared_ptr<Port> new_port = GetPort(new_port_name);
+  if (*message)
+    MakeReferencedPortsSignalable(**message);
+
+  return OK;
+}
+
+int Node::GetMessagesIf(const PortRef& port_ref,
+                        MessageFilter filter,
+                        void* context,
+                        size_t max_messages,
+                        std::vector<ScopedMessage>* messages) {
+  DVLOG(1) << "GetMessagesIf for " << port_ref.name() << "@" << name_;
+
+  size_t first_new_message = messages->size();
+  Port* port = port_ref.port();
+  {
+    std::lock_guard<ProfiledMutex> guard(port->lock);
+
+    // See GetMessageIf.
+    if (port->state != Port::kReceiving)
+      return ERROR_PORT_STATE_UNEXPECTED;
 
-      DCHECK(new_port) << "Port " << new_port_name << "@" << name_
-                       << " does not exist!";
+    if (!CanAcceptMoreMessages(port))
+      return ERROR_PORT_PEER_CLOSED;
 
-      std::lock_guard<std::mutex> guard(new_port->lock);
+    while (messages->size() - first_new_message < max_messages) {
+      ScopedMessage message;
+      port->message_queue.GetNextMessageIf(filter, context, &message);
+      if (!message)
+        break;
+      messages->emplace_back(std::move(message));
+    }
 
-      DCHECK(new_port->state == Port::kReceiving);
-      new_port->message_queue.set_signalable(true);
+    if (messages->size() > first_new_message) {
+      UpdateStatus_Locked(port);
+      UpdateQuotaStatus_Locked(port);
     }
   }
 
+  for (size_t i = first_new_message; i < messages->size(); ++i)
+    MakeReferencedPortsSignalable(*(*messages)[i]);
+
   return OK;
 }
 
@@ -255,7 +562,7 @@ int Node::SendMessage(const PortRef& port_ref, ScopedMessage message) {
 
   Port* port = port_ref.port();
   {
-    std::lock_guard<std::mutex> guard(port->lock);
+    std::lock_guard<ProfiledMutex> guard(port->lock);
 
     if (port->state != Port::kReceiving && port->state != Port::kUninitialized)
       return ERROR_PORT_STATE_UNEXPECTED;
@@ -263,16 +570,17 @@ int Node::SendMessage(const PortRef& port_ref, ScopedMessage message) {
     if (port->state == Port::kReceiving && port->peer_closed)
       return ERROR_PORT_PEER_CLOSED;
 
-    std::vector<std::shared_ptr<Port>> ports_taken;
+    std::vector<PortRef> ports_taken;
     int rv = WillSendMessage_Locked(port, port_ref.name(), message.get(),
                                     &ports_taken);
     if (rv != OK)
       return rv;
 
     if (port->state == Port::kUninitialized) {
-      port->outgoing_messages.emplace(std::move(message));
+      Port::ColdState* cold_state = port->GetOrCreateColdState();
+      cold_state->outgoing_messages.emplace(std::move(message));
       std::copy(ports_taken.begin(), ports_taken.end(),
-                std::back_inserter(port->outgoing_ports));
+                std::back_inserter(cold_state->outgoing_ports));
       return OK;
     }
 
@@ -284,45 +592,223 @@ int Node::SendMessage(const PortRef& port_ref, ScopedMessage message) {
     }
   }
 
-  bool deliver_local_messages = false;
+  // Queue the message on the destination port's shard, and deliver it
+  // ourselves unless another thread is already delivering for that shard.
+  // Note that any given call to AcceptMessage may result in further calls to
+  // SendMessage. Re-entrancy into SendMessage is allowed because a thread
+  // which is already delivering for a shard only queues further messages for
+  // it.
+  LocalMessageQueue& local_messages =
+      GetPortShard(GetEventHeader(*message)->port_name).local_messages;
+  if (!local_messages.Push(std::move(message)))
+    return OK;
+
+  return DeliverLocalMessages(&local_messages);
+}
+
+int Node::SendMessages(const PortRef& port_ref,
+                       std::vector<ScopedMessage> messages) {
+  if (messages.empty())
+    return OK;
+
+  bool has_ports = false;
+  for (const auto& message : messages) {
+    for (size_t i = 0; i < message->num_ports(); ++i) {
+      if (message->ports()[i] == port_ref.name())
+        return ERROR_PORT_CANNOT_SEND_SELF;
+    }
+    has_ports |= message->num_ports() > 0;
+  }
+
+  Port* port = port_ref.port();
+  size_t num_prepared = 0;
+  int rv = OK;
   {
-    std::lock_guard<std::mutex> guard(local_message_lock_);
-    if (!is_delivering_local_messages_)
-      deliver_local_messages = is_delivering_local_messages_ = true;
-    local_messages_.emplace(std::move(message));
-  }
-
-  if (deliver_local_messages) {
-    // Flush the local message queue. Note that any given call to AcceptMessage
-    // may result in further calls to SendMessage. Re-entrancy into SendMessage
-    // is allowed because we prevent re-entrancy into this specific code path.
-    ports::ScopedMessage next_message;
-    for(;;) {
-      {
-        std::lock_guard<std::mutex> guard(local_message_lock_);
-        if (local_messages_.empty()) {
-          is_delivering_local_messages_ = false;
-          return OK;
-        }
+    std::lock_guard<ProfiledMutex> guard(port->lock);
 
-        next_message = std::move(local_messages_.front());
-        local_messages_.pop();
+    if (port->state != Port::kReceiving && port->state != Port::kUninitialized)
+      return ERROR_PORT_STATE_UNEXPECTED;
+
+    if (port->state == Port::kReceiving && port->peer_closed)
+      return ERROR_PORT_PEER_CLOSED;
+
+    if (port->state == Port::kReceiving && !has_ports) {
+      // Nothing in the batch can fail to send, so reserve a contiguous range
+      // of sequence numbers for the whole batch up front.
+      uint64_t sequence_num = port->next_sequence_num_to_send;
+      port->next_sequence_num_to_send += messages.size();
+      for (auto& message : messages) {
+        UserEventData* data =
+            GetMutableEventData<UserEventData>(message.get());
+        DCHECK_EQ(0u, data->sequence_num);
+        data->sequence_num = sequence_num++;
+        GetMutableEventHeader(message.get())->port_name =
+            port->peer_port_name;
       }
+      num_prepared = messages.size();
+    }
 
-      int rv = AcceptMessage(std::move(next_message));
+    for (size_t i = num_prepared; i < messages.size(); ++i) {
+      ScopedMessage& message = messages[i];
+      std::vector<PortRef> ports_taken;
+      rv = WillSendMessage_Locked(port, port_ref.name(), message.get(),
+                                  &ports_taken);
       if (rv != OK)
-        return rv;
+        break;
+
+      if (port->state == Port::kUninitialized) {
+        Port::ColdState* cold_state = port->GetOrCreateColdState();
+        cold_state->outgoing_messages.emplace(std::move(message));
+        std::copy(ports_taken.begin(), ports_taken.end(),
+                  std::back_inserter(cold_state->outgoing_ports));
+      }
+      ++num_prepared;
+    }
+
+    if (port->state == Port::kUninitialized || num_prepared == 0)
+      return rv;
+
+    CHECK_EQ(port->state, Port::kReceiving);
+
+    messages.resize(num_prepared);
+    if (port->peer_node_name != name_) {
+      delegate_->ForwardMessages(port->peer_node_name, std::move(messages));
+      return rv;
     }
   }
 
-  return OK;
+  // Every message is bound for the same peer port, and hence the same shard.
+  // See SendMessage regarding re-entrancy.
+  LocalMessageQueue& local_messages =
+      GetPortShard(GetEventHeader(*messages[0])->port_name).local_messages;
+  if (!local_messages.PushAll(std::move(messages)))
+    return rv;
+
+  int delivery_rv = DeliverLocalMessages(&local_messages);
+  return rv != OK ? rv : delivery_rv;
+}
+
+int Node::BroadcastMessage(const std::vector<PortRef>& port_refs,
+                           ScopedMessage message) {
+  DCHECK(GetEventHeader(*message)->type == EventType::kUser);
+  if (message->num_ports() > 0)
+    return ERROR_NOT_IMPLEMENTED;
+
+  const uint32_t trace_id = GetEventHeader(*message)->trace_id;
+  const uint32_t priority = GetEventData<UserEventData>(*message)->priority;
+  const void* payload = message->payload_bytes();
+  const size_t num_payload_bytes = message->num_payload_bytes();
+
+  // Each port's sequence number is taken, and its peer read, under the
+  // port's lock, but the messages are only sent once every port has been
+  // visited. Other messages from the same ports may overtake them in the
+  // meantime, which is harmless: receiving ports order messages by sequence
+  // number, and a proxy isn't removed until it has forwarded every message
+  // numbered up to the last one sent to it.
+  int first_error = OK;
+  std::unordered_map<NodeName, std::vector<BroadcastTarget>> remote_targets;
+  std::vector<BroadcastTarget> local_targets;
+  std::vector<PortRef> uninitialized_ports;
+  for (const PortRef& port_ref : port_refs) {
+    Port* port = port_ref.port();
+    int rv = OK;
+    {
+      std::lock_guard<ProfiledMutex> guard(port->lock);
+
+      if (port->state == Port::kUninitialized) {
+        uninitialized_ports.push_back(port_ref);
+      } else if (port->state != Port::kReceiving) {
+        rv = ERROR_PORT_STATE_UNEXPECTED;
+      } else if (port->peer_closed) {
+        rv = ERROR_PORT_PEER_CLOSED;
+      } else {
+        BroadcastTarget target;
+        target.port_name = port->peer_port_name;
+        target.sequence_num = port->next_sequence_num_to_send++;
+        if (port->peer_node_name == name_)
+          local_targets.push_back(target);
+        else
+          remote_targets[port->peer_node_name].push_back(target);
+      }
+    }
+    if (rv != OK && first_error == OK)
+      first_error = rv;
+  }
+
+  for (const auto& entry : remote_targets) {
+    const std::vector<BroadcastTarget>& targets = entry.second;
+    ScopedMessage remote_message;
+    if (targets.size() == 1) {
+      remote_message = NewUserMessage(targets[0].port_name,
+                                      targets[0].sequence_num, trace_id,
+                                      priority, payload, num_payload_bytes);
+    } else {
+      size_t num_header_bytes = sizeof(EventHeader) +
+                                sizeof(BroadcastEventData) +
+                                targets.size() * sizeof(BroadcastTarget);
+      delegate_->AllocMessage(num_header_bytes, num_payload_bytes, 0,
+                              &remote_message);
+      memset(remote_message->mutable_header_bytes(), 0, num_header_bytes);
+
+      EventHeader* header = GetMutableEventHeader(remote_message.get());
+      header->type = EventType::kUserBroadcast;
+      header->trace_id = trace_id;
+      BroadcastEventData* data =
+          GetMutableEventData<BroadcastEventData>(remote_message.get());
+      data->num_targets = static_cast<uint32_t>(targets.size());
+      data->priority = priority;
+      std::copy(targets.begin(), targets.end(),
+                GetMutableBroadcastTargets(data));
+      memcpy(remote_message->mutable_payload_bytes(), payload,
+             num_payload_bytes);
+    }
+    delegate_->ForwardMessage(entry.first, std::move(remote_message));
+  }
+
+  // Uninitialized ports queue the message until they have a peer, as for
+  // SendMessage.
+  for (const PortRef& port_ref : uninitialized_ports) {
+    int rv = SendMessage(port_ref,
+                         NewUserMessage(kInvalidPortName, 0, trace_id,
+                                        priority, payload, num_payload_bytes));
+    if (rv != OK && first_error == OK)
+      first_error = rv;
+  }
+
+  // The last local peer gets |message| itself. See SendMessage regarding
+  // re-entrancy.
+  for (size_t i = 0; i < local_targets.size(); ++i) {
+    const BroadcastTarget& target = local_targets[i];
+    ScopedMessage local_message;
+    if (i + 1 < local_targets.size()) {
+      local_message = NewUserMessage(target.port_name, target.sequence_num,
+                                     trace_id, priority, payload,
+                                     num_payload_bytes);
+    } else {
+      local_message = std::move(message);
+      GetMutableEventHeader(local_message.get())->port_name =
+          target.port_name;
+      GetMutableEventData<UserEventData>(local_message.get())->sequence_num =
+          target.sequence_num;
+    }
+
+    LocalMessageQueue& local_messages =
+        GetPortShard(target.port_name).local_messages;
+    if (!local_messages.Push(std::move(local_message)))
+      continue;
+    int rv = DeliverLocalMessages(&local_messages);
+    if (rv != OK && first_error == OK)
+      first_error = rv;
+  }
+
+  return first_error;
 }
 
 int Node::AcceptMessage(ScopedMessage message) {
   const EventHeader* header = GetEventHeader(*message);
   switch (header->type) {
     case EventType::kUser:
-      return OnUserMessage(std::move(message));
+      return OnUserMessage(std::move(message), nullptr);
     case EventType::kPortAccepted:
       return OnPortAccepted(header->port_name);
     case EventType::kObserveProxy:
@@ -337,10 +823,78 @@ int Node::AcceptMessage(ScopedMessage message) {
       return OnObserveClosure(
           header->port_name,
           GetEventData<ObserveClosureEventData>(*message)->last_sequence_num);
+    case EventType::kQuotaStatus:
+      return OnQuotaStatus(
+          header->port_name,
+          GetEventData<QuotaStatusEventData>(*message)->over_quota != 0);
+    case EventType::kUserBroadcast: {
+      std::vector<ScopedMessage> messages;
+      SplitBroadcastMessage(*message, &messages);
+      return AcceptMessages(std::move(messages));
+    }
+    case EventType::kObserveClosures: {
+      const ObserveClosuresEventData* data =
+          GetEventData<ObserveClosuresEventData>(*message);
+      const ObservedClosure* closures = GetObservedClosures(data);
+      int first_error = OK;
+      for (uint32_t i = 0; i < data->num_ports; ++i) {
+        int rv = OnObserveClosure(closures[i].port_name,
+                                  closures[i].last_sequence_num);
+        if (rv != OK && first_error == OK)
+          first_error = rv;
+      }
+      return first_error;
+    }
   }
   return OOPS(ERROR_NOT_IMPLEMENTED);
 }
 
+int Node::AcceptMessages(std::vector<ScopedMessage> messages) {
+  int first_error = OK;
+
+  // Any message we can't batch flushes the pending batch first, so that it is
+  // still processed after the messages which preceded it. Notifications for
+  // user messages are held back until the whole batch has been processed.
+  UserMessageBatch batch;
+  std::vector<PortRef> ports_to_notify;
+  for (auto& message : messages) {
+    const EventHeader* header = GetEventHeader(*message);
+    if (header->type == EventType::kUserBroadcast) {
+      std::vector<ScopedMessage> split_messages;
+      SplitBroadcastMessage(*message, &split_messages);
+      for (auto& split_message : split_messages) {
+        batch[GetEventHeader(*split_message)->port_name].emplace_back(
+            std::move(split_message));
+      }
+      continue;
+    }
+
+    bool is_user_message = header->type == EventType::kUser;
+    if (is_user_message &&
+        GetEventData<UserEventData>(*message)->num_ports == 0) {
+      batch[header->port_name].emplace_back(std::move(message));
+      continue;
+    }
+
+    int rv = AcceptUserMessageBatch(&batch, &ports_to_notify);
+    if (rv != OK && first_error == OK)
+      first_error = rv;
+
+    rv = is_user_message
+             ? OnUserMessage(std::move(message), &ports_to_notify)
+             : AcceptMessage(std::move(message));
+    if (rv != OK && first_error == OK)
+      first_error = rv;
+  }
+
+  int rv = AcceptUserMessageBatch(&batch, &ports_to_notify);
+  if (rv != OK && first_error == OK)
+    first_error = rv;
+
+  NotifyPortStatusChanged(ports_to_notify);
+  return first_error;
+}
+
 int Node::LostConnectionToNode(const NodeName& node_name) {
   // We can no longer send events to the given node. We also can't expect any
   // PortAccepted events.
@@ -348,53 +902,298 @@ int Node::LostConnectionToNode(const NodeName& node_name) {
   DVLOG(1) << "Observing lost connection from node " << name_
            << " to node " << node_name;
 
-  std::vector<PortRef> ports_to_notify;
-
+  // Only the ports indexed under |node_name| can have peers there, so the
+  // rest of the port table is left alone. No lock is held from one port to
+  // the next.
+  std::unordered_set<PortName> candidate_port_names;
   {
-    std::lock_guard<std::mutex> guard(ports_lock_);
-
-    for (auto iter = ports_.begin(); iter != ports_.end(); ) {
-      std::shared_ptr<Port>& port = iter->second;
+    std::lock_guard<ProfiledMutex> guard(peer_index_lock_);
+    congested_peer_nodes_.erase(node_name);
+    auto iter = peer_index_.find(node_name);
+    if (iter != peer_index_.end()) {
+      candidate_port_names.swap(iter->second);
+      peer_index_.erase(iter);
+    }
+  }
 
-      bool remove_port = false;
-      {
-        std::lock_guard<std::mutex> port_guard(port->lock);
+  std::vector<std::pair<PortRef, PortObserver*>> ports_to_notify;
 
-        if (port->peer_node_name == node_name) {
-          // We can no longer send messages to this port's peer. We assume we
-          // will not receive any more messages from this port's peer as well.
-          if (!port->peer_closed) {
-            port->peer_closed = true;
-            port->last_sequence_num_to_receive =
-                port->message_queue.next_sequence_num() - 1;
+  for (const PortName& port_name : candidate_port_names) {
+    std::shared_ptr<Port> port = GetPort(port_name);
+    if (!port)
+      continue;
+    PortRef port_ref(port_name, port);
 
-            if (port->state == Port::kReceiving)
-              ports_to_notify.push_back(PortRef(iter->first, port));
+    bool remove_port = false;
+    {
+      std::lock_guard<ProfiledMutex> port_guard(port->lock);
+
+      if (port->peer_node_name == node_name) {
+        // This port is dealt with for good, so its index entry, which was
+        // taken above, is forgotten.
+        UpdatePeerIndex(port_name, port.get(), name_);
+        UpdatePeerNodeCongested_Locked(port.get());
+
+        // We can no longer send messages to this port's peer. We assume we
+        // will not receive any more messages from this port's peer as well.
+        if (!port->peer_closed) {
+          port->peer_closed = true;
+          port->last_sequence_num_to_receive =
+              port->message_queue.next_sequence_num() - 1;
+          UpdateStatus_Locked(port.get());
+
+          if (port->state == Port::kReceiving) {
+            ports_to_notify.push_back(
+                std::make_pair(port_ref, port->observer.get()));
           }
-
-          // We do not expect to forward any further messages, and we do not
-          // expect to receive a Port{Accepted,Rejected} event.
-          if (port->state != Port::kReceiving)
-            remove_port = true;
         }
+
+        // We do not expect to forward any further messages, and we do not
+        // expect to receive a Port{Accepted,Rejected} event.
+        if (port->state != Port::kReceiving)
+          remove_port = true;
       }
+    }
 
-      if (remove_port) {
-        DVLOG(1) << "Deleted port " << iter->first << "@" << name_;
-        iter = ports_.erase(iter);
-      } else {
-        ++iter;
+    if (remove_port)
+      ErasePort(port_ref.name());
+  }
+
+  for (const auto& entry : ports_to_notify)
+    NotifyPortStatusChanged(entry.first, entry.second);
+
+  return OK;
+}
+
+void Node::SetPeerNodeCongested(const NodeName& node_name, bool congested) {
+  if (node_name == name_ || node_name == kInvalidNodeName)
+    return;
+
+  std::vector<PortName> candidate_port_names;
+  {
+    std::lock_guard<ProfiledMutex> guard(peer_index_lock_);
+    if (congested) {
+      if (!congested_peer_nodes_.insert(node_name).second)
+        return;
+    } else if (!congested_peer_nodes_.erase(node_name)) {
+      return;
+    }
+    auto iter = peer_index_.find(node_name);
+    if (iter != peer_index_.end()) {
+      candidate_port_names.assign(iter->second.begin(), iter->second.end());
+    }
+  }
+
+  DVLOG(1) << "Node " << name_ << " sees node " << node_name
+           << (congested ? " congested" : " no longer congested");
+
+  for (const PortName& port_name : candidate_port_names) {
+    std::shared_ptr<Port> port = GetPort(port_name);
+    if (!port)
+      continue;
+
+    PortObserver* observer = nullptr;
+    {
+      std::lock_guard<ProfiledMutex> port_guard(port->lock);
+      if (port->peer_node_name != node_name ||
+          port->peer_node_congested == congested) {
+        continue;
       }
+      port->peer_node_congested = congested;
+      UpdateStatus_Locked(port.get());
+      if (port->state != Port::kReceiving)
+        continue;
+      observer = port->observer.get();
     }
+    NotifyPortStatusChanged(PortRef(port_name, port), observer);
   }
+}
 
-  for (size_t i = 0; i < ports_to_notify.size(); ++i)
-    delegate_->PortStatusChanged(ports_to_notify[i]);
+void Node::GetStats(NodeStats* stats) {
+  memset(stats, 0, sizeof(*stats));
+
+  // As in LostConnectionToNode, never hold a shard lock while acquiring a port
+  // lock.
+  std::vector<std::shared_ptr<Port>> ports;
+  for (size_t i = 0; i < kNumPortShards; ++i) {
+    PortShard& shard = port_shards_[i];
+    std::lock_guard<ProfiledMutex> guard(shard.lock);
+    for (const auto& entry : shard.ports)
+      ports.push_back(entry.second);
+  }
 
+  stats->num_ports = ports.size();
+  for (const auto& port : ports) {
+    std::lock_guard<ProfiledMutex> guard(port->lock);
+    switch (port->state) {
+      case Port::kReceiving: {
+        size_t num_queued = port->message_queue.queued_message_count();
+        ++stats->num_receiving_ports;
+        stats->num_queued_messages += num_queued;
+        stats->num_queued_bytes += port->message_queue.queued_num_bytes();
+        stats->max_queued_messages =
+            std::max(stats->max_queued_messages, num_queued);
+        break;
+      }
+      case Port::kBuffering:
+        ++stats->num_buffering_ports;
+        break;
+      case Port::kProxying:
+        ++stats->num_proxies;
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+int Node::SaveState(std::vector<char>* state) {
+  // As in GetStats, never hold a shard lock while acquiring a port lock.
+  std::vector<PortRef> ports;
+  for (size_t i = 0; i < kNumPortShards; ++i) {
+    PortShard& shard = port_shards_[i];
+    std::lock_guard<ProfiledMutex> guard(shard.lock);
+    for (const auto& entry : shard.ports)
+      ports.push_back(PortRef(entry.first, entry.second));
+  }
+
+  std::vector<SavedPortState> saved_ports;
+  saved_ports.reserve(ports.size());
+  for (const PortRef& port_ref : ports) {
+    Port* port = port_ref.port();
+    std::lock_guard<ProfiledMutex> guard(port->lock);
+    if (port->state == Port::kUninitialized || port->state == Port::kClosed)
+      continue;
+    const Port::ColdState* cold_state = port->cold_state();
+    if (port->state == Port::kBuffering ||
+        port->message_queue.queued_message_count() > 0 ||
+        (cold_state && cold_state->send_on_proxy_removal)) {
+      DVLOG(1) << "Can't save port " << port_ref.name() << "@" << name_
+               << " in state " << port->state;
+      return ERROR_PORT_STATE_UNEXPECTED;
+    }
+
+    SavedPortState saved = {};
+    saved.port_name = port_ref.name();
+    saved.peer_node_name = port->peer_node_name;
+    saved.peer_port_name = port->peer_port_name;
+    if (cold_state) {
+      saved.proxied_peer_node_name = cold_state->proxied_peer_node_name;
+      saved.proxied_peer_port_name = cold_state->proxied_peer_port_name;
+      saved.max_queued_messages = cold_state->max_queued_messages;
+      saved.max_queued_bytes = cold_state->max_queued_bytes;
+    }
+    saved.next_sequence_num_to_send = port->next_sequence_num_to_send;
+    saved.next_sequence_num_to_receive =
+        port->message_queue.next_sequence_num();
+    saved.last_sequence_num_to_receive = port->last_sequence_num_to_receive;
+    saved.state = port->state;
+    saved.peer_closed = port->peer_closed;
+    saved.remove_proxy_on_last_message = port->remove_proxy_on_last_message;
+    saved.over_quota = port->over_quota;
+    saved.peer_over_quota = port->peer_over_quota;
+    saved_ports.push_back(saved);
+  }
+
+  NodeStateHeader header = {};
+  header.node_name = name_;
+  header.num_ports = static_cast<uint32_t>(saved_ports.size());
+
+  size_t offset = state->size();
+  state->resize(offset + sizeof(header) +
+                saved_ports.size() * sizeof(SavedPortState));
+  memcpy(state->data() + offset, &header, sizeof(header));
+  if (!saved_ports.empty()) {
+    memcpy(state->data() + offset + sizeof(header), saved_ports.data(),
+           saved_ports.size() * sizeof(SavedPortState));
+  }
   return OK;
 }
 
-int Node::OnUserMessage(ScopedMessage message) {
+int Node::RestoreState(const void* state,
+                       size_t num_bytes,
+                       std::vector<PortRef>* receiving_ports) {
+  NodeStateHeader header;
+  if (num_bytes < sizeof(header))
+    return ERROR_PORT_STATE_UNEXPECTED;
+  memcpy(&header, state, sizeof(header));
+  if (header.node_name != name_ ||
+      (num_bytes - sizeof(header)) / sizeof(SavedPortState) <
+          header.num_ports) {
+    return ERROR_PORT_STATE_UNEXPECTED;
+  }
+
+  // Build every port before adding any, so that a bad snapshot restores
+  // nothing.
+  const char* saved_data = static_cast<const char*>(state) + sizeof(header);
+  std::vector<PortRef> ports;
+  ports.reserve(header.num_ports);
+  for (uint32_t i = 0; i < header.num_ports; ++i) {
+    SavedPortState saved;
+    memcpy(&saved, saved_data + i * sizeof(saved), sizeof(saved));
+    if (saved.state != Port::kReceiving && saved.state != Port::kProxying)
+      return ERROR_PORT_STATE_UNEXPECTED;
+    if (GetPort(saved.port_name))
+      return ERROR_PORT_EXISTS;
+
+    std::shared_ptr<Port> port = NewPort(saved.next_sequence_num_to_send,
+                                         saved.next_sequence_num_to_receive);
+    port->state = static_cast<Port::State>(saved.state);
+    port->peer_node_name = saved.peer_node_name;
+    port->peer_port_name = saved.peer_port_name;
+    port->last_sequence_num_to_receive = saved.last_sequence_num_to_receive;
+    port->peer_closed = saved.peer_closed != 0;
+    port->remove_proxy_on_last_message =
+        saved.remove_proxy_on_last_message != 0;
+    port->over_quota = saved.over_quota != 0;
+    port->peer_over_quota = saved.peer_over_quota != 0;
+    if (saved.proxied_peer_node_name != kInvalidNodeName ||
+        saved.max_queued_messages || saved.max_queued_bytes) {
+      Port::ColdState* cold_state = port->GetOrCreateColdState();
+      cold_state->proxied_peer_node_name = saved.proxied_peer_node_name;
+      cold_state->proxied_peer_port_name = saved.proxied_peer_port_name;
+      cold_state->max_queued_messages =
+          static_cast<size_t>(saved.max_queued_messages);
+      cold_state->max_queued_bytes =
+          static_cast<size_t>(saved.max_queued_bytes);
+    }
+    ports.push_back(PortRef(saved.port_name, std::move(port)));
+  }
+
+  for (const PortRef& port_ref : ports) {
+    Port* port = port_ref.port();
+    int rv = AddPortWithName(port_ref.name(), port_ref.port_);
+    if (rv != OK)
+      return rv;
+
+    std::lock_guard<ProfiledMutex> guard(port->lock);
+    UpdatePeerIndex(port_ref.name(), port, port->peer_node_name);
+    UpdatePeerNodeCongested_Locked(port);
+    UpdateStatus_Locked(port);
+    if (port->state == Port::kReceiving)
+      receiving_ports->push_back(port_ref);
+  }
+  return OK;
+}
+
+void Node::MakeReferencedPortsSignalable(const Message& message) {
+  for (size_t i = 0; i < message.num_ports(); ++i) {
+    const PortName& new_port_name = message.ports()[i];
+    std::shared_ptr<Port> new_port = GetPort(new_port_name);
+
+    DCHECK(new_port) << "Port " << new_port_name << "@" << name_
+                     << " does not exist!";
+
+    std::lock_guard<ProfiledMutex> guard(new_port->lock);
+
+    DCHECK(new_port->state == Port::kReceiving);
+    new_port->message_queue.set_signalable(true);
+    UpdateStatus_Locked(new_port.get());
+  }
+}
+
+int Node::OnUserMessage(ScopedMessage message,
+                        std::vector<PortRef>* ports_to_notify) {
   PortName port_name = GetEventHeader(*message)->port_name;
   const auto* event = GetEventData<UserEventData>(*message);
 
@@ -411,7 +1210,7 @@ int Node::OnUserMessage(ScopedMessage message) {
              << port_name << "@" << name_;
 #endif
 
-  std::shared_ptr<Port> port = GetPort(port_name);
+  std::shared_ptr<Port> port = GetDestinationPort(message.get());
 
   // Even if this port does not exist, cannot receive anymore messages or is
   // buffering or proxying messages, we still need these ports to be bound to
@@ -427,9 +1226,10 @@ int Node::OnUserMessage(ScopedMessage message) {
 
   bool has_next_message = false;
   bool message_accepted = false;
+  PortObserver* observer = nullptr;
 
   if (port) {
-    std::lock_guard<std::mutex> guard(port->lock);
+    std::lock_guard<ProfiledMutex> guard(port->lock);
 
     // Reject spurious messages if we've already received the last expected
     // message.
@@ -451,6 +1251,19 @@ int Node::OnUserMessage(ScopedMessage message) {
           return rv;
 
         MaybeRemoveProxy_Locked(port.get(), port_name);
+      } else if (port->state == Port::kReceiving) {
+        UpdateStatus_Locked(port.get());
+        UpdateQuotaStatus_Locked(port.get());
+      }
+
+      if (has_next_message && ports_to_notify) {
+        has_next_message = false;
+        if (!port->status_change_pending) {
+          port->status_change_pending = true;
+          ports_to_notify->push_back(PortRef(port_name, port));
+        }
+      } else if (has_next_message) {
+        observer = port->observer.get();
       }
     }
   }
@@ -467,20 +1280,179 @@ int Node::OnUserMessage(ScopedMessage message) {
       }
     }
   } else if (has_next_message) {
-    PortRef port_ref(port_name, port);
-    delegate_->PortStatusChanged(port_ref);
+    NotifyPortStatusChanged(PortRef(port_name, port), observer);
   }
 
   return OK;
 }
 
+int Node::OnUserMessages(const PortName& port_name,
+                         std::vector<ScopedMessage> messages,
+                         std::vector<PortRef>* ports_to_notify) {
+  DVLOG(1) << "AcceptMessages (" << messages.size() << " messages) at "
+           << port_name << "@" << name_;
+
+  // None of these messages carry ports, so unlike OnUserMessage there is
+  // nothing to bind or clean up if the messages are rejected.
+  std::shared_ptr<Port> port = GetDestinationPort(messages[0].get());
+  for (size_t i = 1; i < messages.size(); ++i)
+    messages[i]->set_destination_port(PortRef());
+  if (!port)
+    return OK;
+
+  bool has_next_message = false;
+  PortObserver* observer = nullptr;
+  {
+    std::lock_guard<ProfiledMutex> guard(port->lock);
+
+    for (auto& message : messages) {
+      DCHECK_EQ(0u, message->num_ports());
+
+      // Reject spurious messages if we've already received the last expected
+      // message.
+      if (!CanAcceptMoreMessages(port.get()))
+        break;
+
+      bool message_has_next = false;
+      port->message_queue.AcceptMessage(std::move(message), &message_has_next);
+      has_next_message |= message_has_next;
+    }
+
+    if (port->state == Port::kBuffering) {
+      has_next_message = false;
+    } else if (port->state == Port::kProxying) {
+      has_next_message = false;
+
+      int rv = ForwardMessages_Locked(port.get(), port_name);
+      if (rv != OK)
+        return rv;
+
+      MaybeRemoveProxy_Locked(port.get(), port_name);
+    } else if (port->state == Port::kReceiving) {
+      UpdateStatus_Locked(port.get());
+      UpdateQuotaStatus_Locked(port.get());
+    }
+
+    if (has_next_message && ports_to_notify) {
+      has_next_message = false;
+      if (!port->status_change_pending) {
+        port->status_change_pending = true;
+        ports_to_notify->push_back(PortRef(port_name, port));
+      }
+    } else if (has_next_message) {
+      observer = port->observer.get();
+    }
+  }
+
+  if (has_next_message) {
+    NotifyPortStatusChanged(PortRef(port_name, port), observer);
+  }
+
+  return OK;
+}
+
+int Node::AcceptUserMessageBatch(UserMessageBatch* batch,
+                                 std::vector<PortRef>* ports_to_notify) {
+  int first_error = OK;
+  for (auto& entry : *batch) {
+    int rv = OnUserMessages(entry.first, std::move(entry.second),
+                            ports_to_notify);
+    if (rv != OK && first_error == OK)
+      first_error = rv;
+  }
+  batch->clear();
+  return first_error;
+}
+
+int Node::MarkPortClosed(const PortRef& port_ref,
+                         NodeName* peer_node_name,
+                         ObservedClosure* closure) {
+  Port* port = port_ref.port();
+  std::lock_guard<ProfiledMutex> guard(port->lock);
+  if (port->state != Port::kReceiving)
+    return ERROR_PORT_STATE_UNEXPECTED;
+
+  port->state = Port::kClosed;
+  UpdateStatus_Locked(port);
+
+  // We pass along the sequence number of the last message sent from this
+  // port to allow the peer to have the opportunity to consume all inbound
+  // messages before notifying the embedder that this port is closed.
+  *peer_node_name = port->peer_node_name;
+  closure->port_name = port->peer_port_name;
+  closure->last_sequence_num = port->next_sequence_num_to_send - 1;
+  return OK;
+}
+
+ScopedMessage Node::NewUserMessage(const PortName& port_name,
+                                   uint64_t sequence_num,
+                                   uint32_t trace_id,
+                                   uint32_t priority,
+                                   const void* payload,
+                                   size_t num_payload_bytes) {
+  ScopedMessage message;
+  AllocMessage(num_payload_bytes, 0, &message);
+
+  EventHeader* header = GetMutableEventHeader(message.get());
+  header->trace_id = trace_id;
+  header->port_name = port_name;
+  UserEventData* event = GetMutableEventData<UserEventData>(message.get());
+  event->sequence_num = sequence_num;
+  event->priority = priority;
+  memcpy(message->mutable_payload_bytes(), payload, num_payload_bytes);
+  return message;
+}
+
+void Node::SplitBroadcastMessage(const Message& message,
+                                 std::vector<ScopedMessage>* messages) {
+  const EventHeader* header = GetEventHeader(message);
+  const BroadcastEventData* event = GetEventData<BroadcastEventData>(message);
+  const BroadcastTarget* targets = GetBroadcastTargets(event);
+
+  DVLOG(1) << "AcceptBroadcast (" << event->num_targets << " targets) at "
+           << name_;
+
+  messages->reserve(messages->size() + event->num_targets);
+  for (uint32_t i = 0; i < event->num_targets; ++i) {
+    messages->emplace_back(NewUserMessage(
+        targets[i].port_name, targets[i].sequence_num, header->trace_id,
+        event->priority, message.payload_bytes(), message.num_payload_bytes()));
+  }
+}
+
+void Node::NotifyPortStatusChanged(
+    const std::vector<PortRef>& ports_to_notify) {
+  for (const PortRef& port_ref : ports_to_notify) {
+    Port* port = port_ref.port();
+
+    // Clear the flag before notifying, so that any message arriving from now
+    // on queues a notification of its own.
+    PortObserver* observer = nullptr;
+    {
+      std::lock_guard<ProfiledMutex> guard(port->lock);
+      port->status_change_pending = false;
+      observer = port->observer.get();
+    }
+
+    NotifyPortStatusChanged(port_ref, observer);
+  }
+}
+
+void Node::NotifyPortStatusChanged(const PortRef& port_ref,
+                                   PortObserver* observer) {
+  if (observer)
+    observer->OnPortStatusChanged();
+  else
+    delegate_->PortStatusChanged(port_ref);
+}
+
 int Node::OnPortAccepted(const PortName& port_name) {
   std::shared_ptr<Port> port = GetPort(port_name);
   if (!port)
     return OOPS(ERROR_PORT_UNKNOWN);
 
   {
-    std::lock_guard<std::mutex> guard(port->lock);
+    std::lock_guard<ProfiledMutex> guard(port->lock);
 
     DVLOG(1) << "PortAccepted at " << port_name << "@" << name_
              << " pointing to "
@@ -526,13 +1498,16 @@ int Node::OnObserveProxy(const PortName& port_name,
            << event.proxy_to_node_name;
 
   {
-    std::lock_guard<std::mutex> guard(port->lock);
+    std::lock_guard<ProfiledMutex> guard(port->lock);
 
     if (port->peer_node_name == event.proxy_node_name &&
         port->peer_port_name == event.proxy_port_name) {
       if (port->state == Port::kReceiving) {
         port->peer_node_name = event.proxy_to_node_name;
         port->peer_port_name = event.proxy_to_port_name;
+        UpdatePeerIndex(port_name, port.get(), event.proxy_to_node_name);
+        UpdatePeerNodeCongested_Locked(port.get());
+        UpdateStatus_Locked(port.get());
 
         ObserveProxyAckEventData ack;
         ack.last_sequence_num = port->next_sequence_num_to_send - 1;
@@ -559,7 +1534,7 @@ int Node::OnObserveProxy(const PortName& port_name,
         ObserveProxyAckEventData ack;
         ack.last_sequence_num = kInvalidSequenceNum;
 
-        port->send_on_proxy_removal.reset(
+        port->GetOrCreateColdState()->send_on_proxy_removal.reset(
             new std::pair<NodeName, ScopedMessage>(
                 event.proxy_node_name,
                 NewInternalMessage(event.proxy_port_name,
@@ -590,7 +1565,7 @@ int Node::OnObserveProxyAck(const PortName& port_name,
                                 // this is not an "Oops".
 
   {
-    std::lock_guard<std::mutex> guard(port->lock);
+    std::lock_guard<ProfiledMutex> guard(port->lock);
 
     if (port->state != Port::kProxying)
       return OOPS(ERROR_PORT_STATE_UNEXPECTED);
@@ -624,11 +1599,13 @@ int Node::OnObserveClosure(const PortName& port_name,
   // ObserveProxyAck.
 
   bool notify_delegate = false;
+  PortObserver* observer = nullptr;
   {
-    std::lock_guard<std::mutex> guard(port->lock);
+    std::lock_guard<ProfiledMutex> guard(port->lock);
 
     port->peer_closed = true;
     port->last_sequence_num_to_receive = last_sequence_num;
+    UpdateStatus_Locked(port.get());
 
     DVLOG(1) << "ObserveClosure at " << port_name << "@" << name_
              << " (state=" << port->state << ") pointing to "
@@ -637,6 +1614,7 @@ int Node::OnObserveClosure(const PortName& port_name,
 
     if (port->state == Port::kReceiving) {
       notify_delegate = true;
+      observer = port->observer.get();
     } else {
       NodeName next_node_name = port->peer_node_name;
       PortName next_port_name = port->peer_port_name;
@@ -661,17 +1639,58 @@ int Node::OnObserveClosure(const PortName& port_name,
     }
   }
   if (notify_delegate) {
-    PortRef port_ref(port_name, port);
-    delegate_->PortStatusChanged(port_ref);
+    NotifyPortStatusChanged(PortRef(port_name, port), observer);
+  }
+  return OK;
+}
+
+int Node::OnQuotaStatus(const PortName& port_name, bool over_quota) {
+  // OK if the port doesn't exist, as it may have been closed already.
+  std::shared_ptr<Port> port = GetPort(port_name);
+  if (!port)
+    return OK;
+
+  DVLOG(1) << "QuotaStatus at " << port_name << "@" << name_
+           << " (over_quota=" << over_quota << ")";
+
+  bool notify_delegate = false;
+  PortObserver* observer = nullptr;
+  {
+    std::lock_guard<ProfiledMutex> guard(port->lock);
+
+    if (port->state == Port::kProxying) {
+      // The port we proxy for is the one sending to our peer, so it is the one
+      // which needs to know.
+      SendQuotaStatus_Locked(port.get(), over_quota);
+      return OK;
+    }
+
+    if (port->peer_over_quota != over_quota) {
+      port->peer_over_quota = over_quota;
+      UpdateStatus_Locked(port.get());
+      notify_delegate = port->state == Port::kReceiving;
+      observer = port->observer.get();
+    }
+  }
+  if (notify_delegate) {
+    NotifyPortStatusChanged(PortRef(port_name, port), observer);
   }
   return OK;
 }
 
+std::shared_ptr<Port> Node::NewPort(uint64_t next_sequence_num_to_send,
+                                   uint64_t next_sequence_num_to_receive) {
+  return std::allocate_shared<Port>(SlabAllocator<Port>(port_slab_),
+                                    next_sequence_num_to_send,
+                                    next_sequence_num_to_receive);
+}
+
 int Node::AddPortWithName(const PortName& port_name,
                           const std::shared_ptr<Port>& port) {
-  std::lock_guard<std::mutex> guard(ports_lock_);
+  PortShard& shard = GetPortShard(port_name);
+  std::lock_guard<ProfiledMutex> guard(shard.lock);
 
-  if (!ports_.insert(std::make_pair(port_name, port)).second)
+  if (!shard.ports.insert(std::make_pair(port_name, port)).second)
     return OOPS(ERROR_PORT_EXISTS);  // Suggests a bad UUID generator.
 
   DVLOG(1) << "Created port " << port_name << "@" << name_;
@@ -679,22 +1698,82 @@ int Node::AddPortWithName(const PortName& port_name,
 }
 
 void Node::ErasePort(const PortName& port_name) {
-  std::lock_guard<std::mutex> guard(ports_lock_);
+  std::shared_ptr<Port> port;
+  {
+    PortShard& shard = GetPortShard(port_name);
+    std::lock_guard<ProfiledMutex> guard(shard.lock);
+
+    auto iter = shard.ports.find(port_name);
+    if (iter == shard.ports.end())
+      return;
+    port = std::move(iter->second);
+    shard.ports.erase(iter);
+  }
 
-  ports_.erase(port_name);
+  port->erased = true;
+  UpdatePeerIndex(port_name, port.get(), name_);
   DVLOG(1) << "Deleted port " << port_name << "@" << name_;
 }
 
 std::shared_ptr<Port> Node::GetPort(const PortName& port_name) {
-  std::lock_guard<std::mutex> guard(ports_lock_);
+  PortShard& shard = GetPortShard(port_name);
+  std::lock_guard<ProfiledMutex> guard(shard.lock);
 
-  auto iter = ports_.find(port_name);
-  if (iter == ports_.end())
+  auto iter = shard.ports.find(port_name);
+  if (iter == shard.ports.end())
     return std::shared_ptr<Port>();
 
   return iter->second;
 }
 
+std::shared_ptr<Port> Node::GetDestinationPort(Message* message) {
+  const PortName& port_name = GetEventHeader(*message)->port_name;
+  std::shared_ptr<Port> port;
+  if (message->destination_port().name() == port_name)
+    port = message->destination_port().port_;
+
+  // A queued message mustn't keep its own port alive.
+  message->set_destination_port(PortRef());
+
+  if (!port)
+    return GetPort(port_name);
+  if (port->erased)
+    return std::shared_ptr<Port>();
+  return port;
+}
+
+void Node::UpdatePeerIndex(const PortName& port_name,
+                           Port* port,
+                           const NodeName& peer_node_name) {
+  const NodeName& indexed_name =
+      peer_node_name == name_ ? kInvalidNodeName : peer_node_name;
+
+  std::lock_guard<ProfiledMutex> guard(peer_index_lock_);
+  if (port->indexed_peer_node_name == indexed_name)
+    return;
+
+  if (port->indexed_peer_node_name != kInvalidNodeName) {
+    auto iter = peer_index_.find(port->indexed_peer_node_name);
+    if (iter != peer_index_.end()) {
+      iter->second.erase(port_name);
+      if (iter->second.empty())
+        peer_index_.erase(iter);
+    }
+  }
+  if (indexed_name != kInvalidNodeName)
+    peer_index_[indexed_name].insert(port_name);
+  port->indexed_peer_node_name = indexed_name;
+}
+
+void Node::UpdatePeerNodeCongested_Locked(Port* port) {
+  bool congested = false;
+  if (port->peer_node_name != name_) {
+    std::lock_guard<ProfiledMutex> guard(peer_index_lock_);
+    congested = congested_peer_nodes_.count(port->peer_node_name) != 0;
+  }
+  port->peer_node_congested = congested;
+}
+
 void Node::WillSendPort_Locked(Port* port,
                                const NodeName& to_node_name,
                                PortName* port_name,
@@ -708,9 +1787,17 @@ void Node::WillSendPort_Locked(Port* port,
   // exists. In the meantime, just buffer messages locally.
   DCHECK(port->state == Port::kReceiving);
   port->state = Port::kBuffering;
+  UpdateStatus_Locked(port);
 
   *port_name = new_port_name;
 
+  // Messages for this port will queue up at its new location from now on, so
+  // don't leave the peer throttled by what was queued here.
+  if (port->over_quota) {
+    port->over_quota = false;
+    SendQuotaStatus_Locked(port, false);
+  }
+
   port_descriptor->peer_node_name = port->peer_node_name;
   port_descriptor->peer_port_name = port->peer_port_name;
   port_descriptor->referring_node_name = name_;
@@ -720,15 +1807,20 @@ void Node::WillSendPort_Locked(Port* port,
       port->message_queue.next_sequence_num();
 
   // Configure the local port to point to the new port.
+  Port::ColdState* cold_state = port->GetOrCreateColdState();
+  cold_state->proxied_peer_node_name = port->peer_node_name;
+  cold_state->proxied_peer_port_name = port->peer_port_name;
   port->peer_node_name = to_node_name;
   port->peer_port_name = new_port_name;
+  UpdatePeerIndex(local_port_name, port, to_node_name);
+  UpdatePeerNodeCongested_Locked(port);
 }
 
 int Node::AcceptPort(const PortName& port_name,
                      const PortDescriptor& port_descriptor) {
   std::shared_ptr<Port> port =
-      std::make_shared<Port>(port_descriptor.next_sequence_num_to_send,
-                             port_descriptor.next_sequence_num_to_receive);
+      NewPort(port_descriptor.next_sequence_num_to_send,
+              port_descriptor.next_sequence_num_to_receive);
   port->state = Port::kReceiving;
   port->peer_node_name = port_descriptor.peer_node_name;
   port->peer_port_name = port_descriptor.peer_port_name;
@@ -741,6 +1833,15 @@ int Node::AcceptPort(const PortName& port_name,
   if (rv != OK)
     return rv;
 
+  // The port is indexed before its congestion is looked up, so that it can't
+  // miss a change to it in between.
+  {
+    std::lock_guard<ProfiledMutex> guard(port->lock);
+    UpdatePeerIndex(port_name, port.get(), port_descriptor.peer_node_name);
+    UpdatePeerNodeCongested_Locked(port.get());
+    UpdateStatus_Locked(port.get());
+  }
+
   // Allow referring port to forward messages.
   delegate_->ForwardMessage(
       port_descriptor.referring_node_name,
@@ -753,7 +1854,7 @@ int Node::WillSendMessage_Locked(
     Port* port,
     const PortName& port_name,
     Message* message,
-    std::vector<std::shared_ptr<Port>>* ports_taken) {
+    std::vector<PortRef>* ports_taken) {
   DCHECK(message);
 
   // Messages may already have a sequence number if they're being forwarded
@@ -781,31 +1882,54 @@ int Node::WillSendMessage_Locked(
     if (ports_taken)
       ports_taken->resize(message->num_ports());
 
-    {
-      // Exclude other threads from locking multiple ports in arbitrary order.
-      std::lock_guard<std::mutex> guard(send_with_ports_lock_);
-
-      for (size_t i = 0; i < message->num_ports(); ++i) {
-        ports[i] = GetPort(message->ports()[i]);
-        if (ports_taken)
-          ports_taken->at(i) = ports[i];
-        ports[i]->lock.lock();
-
-        int error = OK;
-        if (ports[i]->state != Port::kReceiving)
-          error = ERROR_PORT_STATE_UNEXPECTED;
-        else if (message->ports()[i] == port->peer_port_name)
-          error = ERROR_PORT_CANNOT_SEND_PEER;
-
-        if (error != OK) {
-          // Oops, we cannot send this port.
-          for (size_t j = 0; j <= i; ++j)
-            ports[i]->lock.unlock();
-          // Backpedal on the sequence number.
-          port->next_sequence_num_to_send--;
-          return error;
-        }
+    for (size_t i = 0; i < message->num_ports(); ++i) {
+      ports[i] = GetPort(message->ports()[i]);
+      if (ports_taken)
+        ports_taken->at(i) = PortRef(message->ports()[i], ports[i]);
+      if (!ports[i]) {
+        port->next_sequence_num_to_send--;
+        return ERROR_PORT_UNKNOWN;
+      }
+    }
+
+    // Lock the ports in name order. Any other thread sending an overlapping
+    // set of ports does the same, so concurrent sends can't deadlock on each
+    // other and need not be serialized.
+    std::vector<size_t> lock_order(message->num_ports());
+    for (size_t i = 0; i < lock_order.size(); ++i)
+      lock_order[i] = i;
+    std::sort(lock_order.begin(), lock_order.end(),
+              [message](size_t a, size_t b) {
+                return message->ports()[a] < message->ports()[b];
+              });
+
+    int error = OK;
+    size_t num_locked = 0;
+    for (; num_locked < lock_order.size(); ++num_locked) {
+      size_t i = lock_order[num_locked];
+      if (num_locked > 0 &&
+          message->ports()[i] == message->ports()[lock_order[num_locked - 1]]) {
+        // The same port can't be sent twice.
+        error = ERROR_PORT_STATE_UNEXPECTED;
+        break;
       }
+      ports[i]->lock.lock();
+    }
+
+    for (size_t i = 0; error == OK && i < message->num_ports(); ++i) {
+      if (ports[i]->state != Port::kReceiving)
+        error = ERROR_PORT_STATE_UNEXPECTED;
+      else if (message->ports()[i] == port->peer_port_name)
+        error = ERROR_PORT_CANNOT_SEND_PEER;
+    }
+
+    if (error != OK) {
+      // Oops, we cannot send these ports.
+      for (size_t j = 0; j < num_locked; ++j)
+        ports[lock_order[j]]->lock.unlock();
+      // Backpedal on the sequence number.
+      port->next_sequence_num_to_send--;
+      return error;
     }
 
     PortDescriptor* port_descriptors =
@@ -835,23 +1959,63 @@ int Node::WillSendMessage_Locked(
 }
 
 int Node::ForwardMessages_Locked(Port* port, const PortName &port_name) {
+  std::vector<ScopedMessage> messages;
+  int rv = OK;
   for (;;) {
     ScopedMessage message;
-    port->message_queue.GetNextMessageIf(nullptr, &message);
+    port->message_queue.GetNextMessageIf(nullptr, nullptr, &message);
     if (!message)
       break;
 
-    int rv = WillSendMessage_Locked(port, port_name, message.get(), nullptr);
-    if (rv != OK)
-      return rv;
+    if (message->num_ports() == 0) {
+      // A relayed message already has its sequence number, so unless it
+      // carries ports only its destination changes. The message is passed on
+      // otherwise untouched, letting the delegate reuse the buffer it arrived
+      // in.
+      DCHECK_NE(0u, GetEventData<UserEventData>(*message)->sequence_num);
+      GetMutableEventHeader(message.get())->port_name = port->peer_port_name;
+    } else {
+      rv = WillSendMessage_Locked(port, port_name, message.get(), nullptr);
+      if (rv != OK)
+        break;
+    }
 
-    delegate_->ForwardMessage(port->peer_node_name, std::move(message));
+    messages.emplace_back(std::move(message));
   }
-  return OK;
+
+  // Messages which were successfully prepared are still forwarded on error.
+  if (!messages.empty())
+    delegate_->ForwardMessages(port->peer_node_name, std::move(messages));
+  return rv;
+}
+
+int Node::DeliverLocalMessages(LocalMessageQueue* local_messages) {
+  int result = OK;
+  for (;;) {
+    std::vector<ScopedMessage> messages;
+    local_messages->PopAll(&messages);
+    if (messages.empty()) {
+      if (local_messages->StopDelivering())
+        break;
+      continue;
+    }
+
+    // A burst of messages is handed over in one go, so that each destination
+    // port is locked and its delegate notified only once.
+    int rv = messages.size() == 1 ? AcceptMessage(std::move(messages[0]))
+                                  : AcceptMessages(std::move(messages));
+    if (rv != OK && result == OK)
+      result = rv;
+  }
+
+  return result;
 }
 
 void Node::InitiateProxyRemoval_Locked(Port* port,
                                        const PortName& port_name) {
+  if (RemoveProxyLocally_Locked(port, port_name))
+    return;
+
   // To remove this node, we start by notifying the connected graph that we are
   // a proxy. This allows whatever port is referencing this node to skip it.
   // Eventually, this node will receive ObserveProxyAck (or ObserveClosure if
@@ -868,6 +2032,53 @@ void Node::InitiateProxyRemoval_Locked(Port* port,
       NewInternalMessage(port->peer_port_name, EventType::kObserveProxy, data));
 }
 
+bool Node::RemoveProxyLocally_Locked(Port* port, const PortName& port_name) {
+  DCHECK(port->state == Port::kProxying);
+
+  // If the port sending to us lives on this node, there is no need to go
+  // through ObserveProxy and ObserveProxyAck: we can point it past us and
+  // learn its last sequence number sent to us directly. Its messages then
+  // stop taking the extra hop as soon as we return.
+  const Port::ColdState* cold_state = port->cold_state();
+  if (!cold_state || cold_state->proxied_peer_node_name != name_)
+    return false;
+
+  const PortName& proxied_peer_port_name = cold_state->proxied_peer_port_name;
+  std::shared_ptr<Port> peer = GetPort(proxied_peer_port_name);
+  if (!peer)
+    return false;
+
+  // Other paths may lock the two ports in the opposite order, e.g. when the
+  // peer sends a message which carries this port. Rather than risk a deadlock
+  // we leave contended cases to the slow path.
+  std::unique_lock<ProfiledMutex> peer_lock(peer->lock, std::try_to_lock);
+  if (!peer_lock.owns_lock())
+    return false;
+
+  if (peer->state != Port::kReceiving ||
+      peer->peer_node_name != name_ ||
+      peer->peer_port_name != port_name) {
+    return false;
+  }
+
+  DVLOG(1) << "Bypassing proxy " << port_name << "@" << name_ << " for "
+           << proxied_peer_port_name << "@" << name_;
+
+  peer->peer_node_name = port->peer_node_name;
+  peer->peer_port_name = port->peer_port_name;
+  UpdatePeerIndex(proxied_peer_port_name, peer.get(), port->peer_node_name);
+  UpdatePeerNodeCongested_Locked(peer.get());
+  UpdateStatus_Locked(peer.get());
+  uint64_t last_sequence_num = peer->next_sequence_num_to_send - 1;
+  peer_lock.unlock();
+
+  // Now act as if ObserveProxyAck had arrived.
+  port->remove_proxy_on_last_message = true;
+  port->last_sequence_num_to_receive = last_sequence_num;
+  MaybeRemoveProxy_Locked(port, port_name);
+  return true;
+}
+
 void Node::MaybeRemoveProxy_Locked(Port* port,
                                    const PortName& port_name) {
   DCHECK(port->state == Port::kProxying);
@@ -880,9 +2091,10 @@ void Node::MaybeRemoveProxy_Locked(Port* port,
     // This proxy port is done. We can now remove it!
     ErasePort(port_name);
 
-    if (port->send_on_proxy_removal) {
-      NodeName to_node = port->send_on_proxy_removal->first;
-      ScopedMessage& message = port->send_on_proxy_removal->second;
+    const Port::ColdState* cold_state = port->cold_state();
+    if (cold_state && cold_state->send_on_proxy_removal) {
+      NodeName to_node = cold_state->send_on_proxy_removal->first;
+      ScopedMessage& message = cold_state->send_on_proxy_removal->second;
 
       delegate_->ForwardMessage(to_node, std::move(message));
     }
@@ -895,14 +2107,24 @@ void Node::MaybeRemoveProxy_Locked(Port* port,
 void Node::FlushOutgoingMessages_Locked(Port* port) {
   DCHECK(port->peer_node_name != kInvalidNodeName);
 
+  // Nothing was sent while the port was uninitialized.
+  Port::ColdState* cold_state = port->cold_state();
+  if (!cold_state)
+    return;
+
   // Rewrite the peer node names for all ports that are about to start proxying.
-  std::vector<std::shared_ptr<Port>> outgoing_ports;
-  std::swap(outgoing_ports, port->outgoing_ports);
-  for (const auto& outgoing_port : outgoing_ports)
-    outgoing_port->peer_node_name = port->peer_node_name;
+  std::vector<PortRef> outgoing_ports;
+  std::swap(outgoing_ports, cold_state->outgoing_ports);
+  for (const PortRef& outgoing_port : outgoing_ports) {
+    outgoing_port.port()->peer_node_name = port->peer_node_name;
+    UpdatePeerIndex(outgoing_port.name(), outgoing_port.port(),
+                    port->peer_node_name);
+  }
 
-  while (!port->outgoing_messages.empty()) {
-    ScopedMessage& message = port->outgoing_messages.front();
+  std::vector<ScopedMessage> messages;
+  messages.reserve(cold_state->outgoing_messages.size());
+  while (!cold_state->outgoing_messages.empty()) {
+    ScopedMessage& message = cold_state->outgoing_messages.front();
 
     // Rewrite the message destination port.
     EventHeader* header = GetMutableEventHeader(message.get());
@@ -910,9 +2132,57 @@ void Node::FlushOutgoingMessages_Locked(Port* port) {
 
     DCHECK(header->type == EventType::kUser);
 
-    delegate_->ForwardMessage(port->peer_node_name, std::move(message));
-    port->outgoing_messages.pop();
+    messages.emplace_back(std::move(message));
+    cold_state->outgoing_messages.pop();
+  }
+
+  if (!messages.empty())
+    delegate_->ForwardMessages(port->peer_node_name, std::move(messages));
+}
+
+void Node::UpdateStatus_Locked(Port* port) {
+  uint32_t status = 0;
+  if (port->state == Port::kReceiving) {
+    status |= Port::kStatusReceiving;
+    if (port->message_queue.HasNextMessage())
+      status |= Port::kStatusHasMessages;
+    if (port->peer_closed)
+      status |= Port::kStatusPeerClosed;
+    if (port->peer_over_quota || port->peer_node_congested)
+      status |= Port::kStatusPeerOverQuota;
+    if (port->peer_node_name != name_)
+      status |= Port::kStatusPeerRemote;
   }
+  port->status.store(status, std::memory_order_release);
+}
+
+void Node::UpdateQuotaStatus_Locked(Port* port) {
+  DCHECK(port->state == Port::kReceiving);
+
+  // Ports without a quota never have any cold state to look at.
+  const Port::ColdState* cold_state = port->cold_state();
+  const MessageQueue& queue = port->message_queue;
+  bool over_quota =
+      cold_state &&
+      ((cold_state->max_queued_messages &&
+        queue.queued_message_count() > cold_state->max_queued_messages) ||
+       (cold_state->max_queued_bytes &&
+        queue.queued_num_bytes() > cold_state->max_queued_bytes));
+  if (over_quota == port->over_quota || port->peer_closed)
+    return;
+
+  port->over_quota = over_quota;
+  SendQuotaStatus_Locked(port, over_quota);
+}
+
+void Node::SendQuotaStatus_Locked(Port* port, bool over_quota) {
+  QuotaStatusEventData data;
+  data.over_quota = over_quota;
+  data.padding = 0;
+
+  delegate_->ForwardMessage(
+      port->peer_node_name,
+      NewInternalMessage(port->peer_port_name, EventType::kQuotaStatus, data));
 }
 
 ScopedMessage Node::NewInternalMessage_Helper(const PortName& port_name,
@@ -925,7 +2195,7 @@ ScopedMessage Node::NewInternalMessage_Helper(const PortName& port_name,
   EventHeader* header = GetMutableEventHeader(message.get());
   header->port_name = port_name;
   header->type = type;
-  header->padding = 0;
+  header->trace_id = 0;
 
   if (num_data_bytes)
     memcpy(header + 1, data, num_data_bytes);
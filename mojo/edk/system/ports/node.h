@@ -9,17 +9,21 @@
 #include <stdint.h>
 
 #include <mutex>
-#include <queue>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "base/macros.h"
 #include "mojo/edk/system/ports/event.h"
 #include "mojo/edk/system/ports/hash_functions.h"
+#include "mojo/edk/system/ports/local_message_queue.h"
 #include "mojo/edk/system/ports/message.h"
 #include "mojo/edk/system/ports/name.h"
+#include "mojo/edk/system/ports/name_map.h"
 #include "mojo/edk/system/ports/port.h"
+#include "mojo/edk/system/ports/port_observer.h"
 #include "mojo/edk/system/ports/port_ref.h"
+#include "mojo/edk/system/ports/slab_allocator.h"
 #include "mojo/edk/system/ports/user_data.h"
 
 #undef SendMessage  // Gah, windows
@@ -42,14 +46,40 @@ enum : int {
 struct PortStatus {
   bool has_messages;
   bool peer_closed;
+  bool peer_over_quota;
+
+  // Whether the peer port is on another node, as far as this port knows.
+  bool peer_remote;
+};
+
+// A snapshot of a node's port table, for diagnostics.
+struct NodeStats {
+  size_t num_ports;
+  size_t num_receiving_ports;
+
+  // Ports which have been sent elsewhere and are waiting to be removed, or
+  // are still buffering messages until they can be forwarded.
+  size_t num_proxies;
+  size_t num_buffering_ports;
+
+  // Unread messages and bytes over all receiving ports, and the length of the
+  // longest single queue.
+  size_t num_queued_messages;
+  size_t num_queued_bytes;
+  size_t max_queued_messages;
 };
 
 class NodeDelegate;
 
 class Node {
  public:
-  // Does not take ownership of the delegate.
+  // Does not take ownership of the delegate. Ports are allocated from chunks
+  // obtained through |port_memory_functions|, or from the heap if none are
+  // given.
   Node(const NodeName& name, NodeDelegate* delegate);
+  Node(const NodeName& name,
+       NodeDelegate* delegate,
+       const SlabMemoryFunctions& port_memory_functions);
   ~Node();
 
   // Lookup the named port.
@@ -66,22 +96,68 @@ class Node {
                      const NodeName& peer_node_name,
                      const PortName& peer_port_name);
 
+  // Like CreateUninitializedPort, but for a port whose name was chosen by
+  // another node, e.g. one which is to be initialized as the peer of one of
+  // that node's ports. Fails if the name is already in use.
+  int CreateUninitializedPortWithName(const PortName& port_name,
+                                      PortRef* port_ref);
+
+  // Initializes |port_ref|, which must be uninitialized, to take the place of
+  // |unused_port_ref|, a receiving port which has neither sent nor read any
+  // messages. |port_ref| is connected to |unused_port_ref|'s peer, and
+  // |unused_port_ref| becomes a proxy to |port_ref| which goes away once the
+  // peer has been pointed at |port_ref|. If the peer has already closed,
+  // |port_ref| sees it closed. This lets a connection set up ahead of time be
+  // handed to a port created later, without a round trip.
+  int ReplaceUnusedPort(const PortRef& unused_port_ref,
+                        const PortRef& port_ref);
+
   // Generates a new connected pair of ports bound to this node. These ports
   // are initialized and ready to go.
   int CreatePortPair(PortRef* port0_ref, PortRef* port1_ref);
 
+  // Like CreatePortPair for each of |num_pairs| pairs, which are appended to
+  // |port_refs| with each pair's ports next to each other. The names are
+  // generated together, and each shard of the port table is locked once for
+  // all of its new ports. No status changes are reported, since nothing can
+  // be observing the ports yet. If any port can't be added, none are.
+  int CreatePortPairs(size_t num_pairs, std::vector<PortRef>* port_refs);
+
   // User data associated with the port.
   int SetUserData(const PortRef& port_ref,
                   std::shared_ptr<UserData> user_data);
   int GetUserData(const PortRef& port_ref,
                   std::shared_ptr<UserData>* user_data);
 
+  // Sets an observer to be notified of the port's status changes in place of
+  // the delegate. A replaced observer is kept alive until the port is
+  // destroyed, as it may still be in the middle of a notification.
+  int SetPortObserver(const PortRef& port_ref,
+                      std::shared_ptr<PortObserver> observer);
+
   // Prevents further messages from being sent from this port or delivered to
   // this port. The port is removed, and the port's peer is notified of the
   // closure after it has consumed all pending messages.
   int ClosePort(const PortRef& port_ref);
 
-  // Returns the current status of the port.
+  // Like ClosePort for each of |port_refs|, but the peers on each node are
+  // told of their closure in a single message. Ports which can't be closed
+  // are skipped, and the first error is returned.
+  int ClosePorts(const std::vector<PortRef>& port_refs);
+
+  // Limits the unread messages and bytes which may queue up at the port, where
+  // zero means unlimited. While either limit is exceeded the peer's status
+  // has |peer_over_quota| set, so that whoever is sending to this port can
+  // throttle itself; nothing is ever refused. Limits may be set before the
+  // port is initialized. They stay with this node if the port is sent
+  // elsewhere.
+  int SetQuota(const PortRef& port_ref,
+               size_t max_queued_messages,
+               size_t max_queued_bytes);
+
+  // Returns the current status of the port. Doesn't lock the port, so the
+  // status may be stale by the time it's returned; any change to it is
+  // followed by a status change notification.
   int GetStatus(const PortRef& port_ref, PortStatus* port_status);
 
   // Returns the next available message on the specified port or returns a null
@@ -99,6 +175,28 @@ class Node {
                    std::function<bool(const Message&)> selector,
                    ScopedMessage* message);
 
+  // Like GetMessageIf, but returns up to |max_messages| messages at once,
+  // appending them to |messages|. Stops at the first message the |selector|
+  // declines. The port is locked only once for the whole batch.
+  int GetMessagesIf(const PortRef& port_ref,
+                    std::function<bool(const Message&)> selector,
+                    size_t max_messages,
+                    std::vector<ScopedMessage>* messages);
+
+  // Like GetMessageIf and GetMessagesIf, but with a |filter| which is called
+  // with |context| in place of a std::function, so that building the selector
+  // never allocates. The |filter| may be null and may not call any Node
+  // methods.
+  int GetMessageIf(const PortRef& port_ref,
+                   MessageFilter filter,
+                   void* context,
+                   ScopedMessage* message);
+  int GetMessagesIf(const PortRef& port_ref,
+                    MessageFilter filter,
+                    void* context,
+                    size_t max_messages,
+                    std::vector<ScopedMessage>* messages);
+
   // Allocate a message that can be passed to SendMessage. The caller may
   // mutate the payload and ports arrays before passing the message to
   // SendMessage. The header array should not be modified by the caller.
@@ -111,25 +209,142 @@ class Node {
   // delegate) if the peer is local to this Node.
   int SendMessage(const PortRef& port_ref, ScopedMessage message);
 
+  // Like SendMessage, but sends a sequence of messages in order, locking the
+  // port only once. If a message fails to send, it and any messages after it
+  // are dropped and the error is returned; messages before it have been sent.
+  int SendMessages(const PortRef& port_ref,
+                   std::vector<ScopedMessage> messages);
+
+  // Sends a copy of |message| from each of |port_refs| to its peer. The
+  // message must have been allocated by AllocMessage and must not carry
+  // ports. Peers on the same remote node share one message, which that node
+  // splits up again, so the payload crosses to each node once however many
+  // of its ports it's for. Ports which can't send are skipped, and the first
+  // error is returned.
+  int BroadcastMessage(const std::vector<PortRef>& port_refs,
+                       ScopedMessage message);
+
   // Corresponding to NodeDelegate::ForwardMessage.
   int AcceptMessage(ScopedMessage message);
 
+  // Like AcceptMessage, but for a batch of messages, e.g. everything read from
+  // a channel in one go. User messages which do not carry ports are grouped by
+  // destination port so that each port is looked up and locked only once per
+  // batch. All messages are processed even if one fails; the first error is
+  // returned.
+  int AcceptMessages(std::vector<ScopedMessage> messages);
+
   // Called to inform this node that communication with another node is lost
   // indefinitely. This triggers cleanup of ports bound to this node.
   int LostConnectionToNode(const NodeName& node_name);
 
+  // Tells this node whether messages to another node are backing up faster
+  // than that node consumes them. While it's congested, every receiving port
+  // whose peer is there has |peer_over_quota| set, as if the peer were over
+  // its quota, so that whoever is sending can throttle itself. Ports whose
+  // peers move there later pick the state up too. Forgotten when the
+  // connection is lost.
+  void SetPeerNodeCongested(const NodeName& node_name, bool congested);
+
+  // Fills |stats| by walking every port. This is meant for occasional
+  // diagnostics, not for anything on a hot path: each port is locked in turn,
+  // so the result is not an atomic snapshot of the whole node.
+  void GetStats(NodeStats* stats);
+
+  // Appends a snapshot of the node's routing state to |state|: the name, peer,
+  // sequence numbers and quota state of every receiving and proxying port.
+  // Uninitialized ports are left out, as are the observers and user data of
+  // the others. Unread messages can't be saved, so this fails with
+  // ERROR_PORT_STATE_UNEXPECTED, leaving |state| as it was, if any port has
+  // messages queued, is buffering, or is waiting to send a message. Ports are
+  // locked one at a time, so nothing may be using the node meanwhile.
+  int SaveState(std::vector<char>* state);
+
+  // Recreates the ports in a snapshot taken by SaveState() on a node of the
+  // same name, e.g. in a new process taking over from the one which took it.
+  // The ports keep their names and sequence numbers, so their peers carry on
+  // as before once messages flow again. Restored receiving ports are appended
+  // to |receiving_ports|. Returns ERROR_PORT_STATE_UNEXPECTED if |state| is
+  // malformed or from another node, or ERROR_PORT_EXISTS if one of its ports
+  // already exists here, in which case nothing is restored.
+  int RestoreState(const void* state,
+                   size_t num_bytes,
+                   std::vector<PortRef>* receiving_ports);
+
  private:
-  int OnUserMessage(ScopedMessage message);
+  using UserMessageBatch =
+      std::unordered_map<PortName, std::vector<ScopedMessage>>;
+
+  // Allows ports referenced by a message the embedder has just taken to
+  // trigger PortStatusChanged calls.
+  void MakeReferencedPortsSignalable(const Message& message);
+
+  // These notify the delegate of ports with newly available messages. If
+  // |ports_to_notify| is non-null, such ports are instead appended to it, each
+  // at most once until NotifyPortStatusChanged is called for it, so that a
+  // batch of messages produces one notification per port.
+  int OnUserMessage(ScopedMessage message,
+                    std::vector<PortRef>* ports_to_notify);
+  int OnUserMessages(const PortName& port_name,
+                     std::vector<ScopedMessage> messages,
+                     std::vector<PortRef>* ports_to_notify);
+  int AcceptUserMessageBatch(UserMessageBatch* batch,
+                             std::vector<PortRef>* ports_to_notify);
+
+  // Marks a receiving port closed. On success, returns the node of the peer
+  // to be told, along with what it's to be told.
+  int MarkPortClosed(const PortRef& port_ref,
+                     NodeName* peer_node_name,
+                     ObservedClosure* closure);
+
+  // Returns a user message without ports, addressed to |port_name|, carrying
+  // a copy of |payload|.
+  ScopedMessage NewUserMessage(const PortName& port_name,
+                               uint64_t sequence_num,
+                               uint32_t trace_id,
+                               uint32_t priority,
+                               const void* payload,
+                               size_t num_payload_bytes);
+
+  // Splits a kUserBroadcast event into a user message for each of its
+  // targets.
+  void SplitBroadcastMessage(const Message& message,
+                             std::vector<ScopedMessage>* messages);
+  void NotifyPortStatusChanged(const std::vector<PortRef>& ports_to_notify);
+
+  // Notifies |observer|, which must have been read from the port while it was
+  // locked, or the delegate if there is no observer.
+  void NotifyPortStatusChanged(const PortRef& port_ref, PortObserver* observer);
   int OnPortAccepted(const PortName& port_name);
   int OnObserveProxy(const PortName& port_name,
                      const ObserveProxyEventData& event);
   int OnObserveProxyAck(const PortName& port_name, uint64_t last_sequence_num);
   int OnObserveClosure(const PortName& port_name, uint64_t last_sequence_num);
+  int OnQuotaStatus(const PortName& port_name, bool over_quota);
 
+  // Allocates a port, along with its reference count, from |port_slab_|.
+  std::shared_ptr<Port> NewPort(uint64_t next_sequence_num_to_send,
+                                uint64_t next_sequence_num_to_receive);
   int AddPortWithName(const PortName& port_name,
                       const std::shared_ptr<Port>& port);
   void ErasePort(const PortName& port_name);
   std::shared_ptr<Port> GetPort(const PortName& port_name);
+  // Returns the port |message| is addressed to, or null if there is none.
+  // Takes the message's destination_port() hint, if it has a usable one,
+  // rather than looking the port up.
+  std::shared_ptr<Port> GetDestinationPort(Message* message);
+
+  // Must be called whenever |port|'s |peer_node_name| changes, with the new
+  // name, so that LostConnectionToNode can find the port without visiting
+  // every other. Ports with local peers are left out of the index.
+  void UpdatePeerIndex(const PortName& port_name,
+                       Port* port,
+                       const NodeName& peer_node_name);
+
+  // Looks up whether |port|'s peer node is congested. Must be called after
+  // UpdatePeerIndex() whenever the peer changes, so that the port is either
+  // found by SetPeerNodeCongested() or sees what it set.
+  void UpdatePeerNodeCongested_Locked(Port* port);
 
   void WillSendPort_Locked(Port* port,
                            const NodeName& to_node_name,
@@ -141,12 +356,29 @@ class Node {
   int WillSendMessage_Locked(Port* port,
                              const PortName& port_name,
                              Message* message,
-                             std::vector<std::shared_ptr<Port>>* ports_taken);
+                             std::vector<PortRef>* ports_taken);
   int ForwardMessages_Locked(Port* port, const PortName& port_name);
   void InitiateProxyRemoval_Locked(Port* port, const PortName& port_name);
+
+  // Removes a proxy without any messaging if the port sending to it is local
+  // and isn't locked by anyone else. Returns false if that isn't possible.
+  bool RemoveProxyLocally_Locked(Port* port, const PortName& port_name);
   void MaybeRemoveProxy_Locked(Port* port, const PortName& port_name);
   void FlushOutgoingMessages_Locked(Port* port);
 
+  // Republishes |port|'s status word. Must be called after any change to the
+  // state, peer or message queue of a port which is or was receiving.
+  void UpdateStatus_Locked(Port* port);
+
+  // Tells the peer of a receiving port whether the port is over its quota, if
+  // that has changed since the peer was last told.
+  void UpdateQuotaStatus_Locked(Port* port);
+  void SendQuotaStatus_Locked(Port* port, bool over_quota);
+
+  // Delivers messages queued on |local_messages| until the queue is drained.
+  // Must only be called once a Push() has made the caller the deliverer.
+  int DeliverLocalMessages(LocalMessageQueue* local_messages);
+
   ScopedMessage NewInternalMessage_Helper(const PortName& port_name,
                                           const EventType& type,
                                           const void* data,
@@ -164,20 +396,45 @@ class Node {
     return NewInternalMessage_Helper(port_name, type, &data, sizeof(data));
   }
 
+  // The port table is split into a fixed number of shards, each guarded by
+  // its own lock, so that threads looking up unrelated ports do not contend
+  // with each other. Port names are random, so the low bits of |v1| make a
+  // good shard key.
+  static const size_t kNumPortShards = 16;
+
+  // Each shard also has its own queue for messages sent to its ports from
+  // this node, so that local deliveries to unrelated ports are not serialized
+  // on one thread.
+  struct PortShard {
+    PortShard() : lock("Node::PortShard::lock") {}
+
+    ProfiledMutex lock;
+    NameMap<PortName, std::shared_ptr<Port>> ports;
+    LocalMessageQueue local_messages;
+  };
+
+  PortShard& GetPortShard(const PortName& port_name) {
+    return port_shards_[port_name.v1 % kNumPortShards];
+  }
+
   NodeName name_;
   NodeDelegate* delegate_;
 
-  // Guards |ports_|.
-  std::mutex ports_lock_;
-  std::unordered_map<PortName, std::shared_ptr<Port>> ports_;
+  // Shared with every port allocated from it, which may outlive the node.
+  const std::shared_ptr<Slab> port_slab_;
+
+  PortShard port_shards_[kNumPortShards];
 
-  // Guards multiple threads from sending ports simultaneously.
-  std::mutex send_with_ports_lock_;
+  // The ports whose peers are on each other node. A port's entry is updated
+  // after its peer changes, so may briefly lag it; users must check the port
+  // itself. This lock may be acquired while holding a port lock, but never
+  // together with a shard lock.
+  ProfiledMutex peer_index_lock_;
+  std::unordered_map<NodeName, std::unordered_set<PortName>> peer_index_;
 
-  // Guards the fields below.
-  std::mutex local_message_lock_;
-  bool is_delivering_local_messages_ = false;
-  std::queue<ScopedMessage> local_messages_;
+  // The nodes reported congested by SetPeerNodeCongested(). Guarded by
+  // |peer_index_lock_|.
+  std::unordered_set<NodeName> congested_peer_nodes_;
 
   DISALLOW_COPY_AND_ASSIGN(Node);
 };
@@ -7,6 +7,8 @@
 
 #include <stddef.h>
 
+#include <vector>
+
 #include "mojo/edk/system/ports/message.h"
 #include "mojo/edk/system/ports/name.h"
 #include "mojo/edk/system/ports/port_ref.h"
@@ -22,6 +24,15 @@ class NodeDelegate {
   // Port names should be difficult to guess.
   virtual void GenerateRandomPortName(PortName* port_name) = 0;
 
+  // Generates |num_port_names| names at once. Delegates may override this to
+  // amortize the cost of generating each; by default each name is generated
+  // individually.
+  virtual void GenerateRandomPortNames(PortName* port_names,
+                                       size_t num_port_names) {
+    for (size_t i = 0; i < num_port_names; ++i)
+      GenerateRandomPortName(&port_names[i]);
+  }
+
   // Allocate a message, including a header that can be used by the Node
   // implementation. |num_header_bytes| will be aligned. |num_payload_bytes|
   // may not be aligned. The newly allocated memory need not be zero-filled.
@@ -34,9 +45,21 @@ class NodeDelegate {
   // NOT synchronously call any methods on Node.
   virtual void ForwardMessage(const NodeName& node, ScopedMessage message) = 0;
 
+  // Forward a batch of messages, in order, to the specified node. The same
+  // restrictions apply as for ForwardMessage. Delegates may override this to
+  // coalesce delivery; by default each message is forwarded individually.
+  virtual void ForwardMessages(const NodeName& node,
+                               std::vector<ScopedMessage> messages) {
+    for (auto& message : messages)
+      ForwardMessage(node, std::move(message));
+  }
+
   // Indicates that the port's status has changed recently. Use Node::GetStatus
   // to query the latest status of the port. Note, this event could be spurious
   // if another thread is simultaneously modifying the status of the port.
+  // When a batch of messages is accepted, each port which received any of them
+  // is notified once, after the whole batch. Ports with a PortObserver notify
+  // it instead.
   virtual void PortStatusChanged(const PortRef& port_ref) = 0;
 };
 
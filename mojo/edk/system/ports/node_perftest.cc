@@ -0,0 +1,577 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "base/macros.h"
+#include "base/strings/stringprintf.h"
+#include "base/test/perf_time_logger.h"
+#include "mojo/edk/system/ports/event.h"
+#include "mojo/edk/system/ports/node.h"
+#include "mojo/edk/system/ports/node_delegate.h"
+#include "mojo/edk/system/ports/test_utils.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace mojo {
+namespace edk {
+namespace ports {
+namespace test {
+namespace {
+
+const size_t kNumTransfersPerThread = 20000;
+
+// A delegate for a single node shared by several threads. Messages forwarded
+// by a thread are queued for that same thread, which delivers them back to
+// the node between its own sends. Threads therefore only contend inside Node.
+class PerfNodeDelegate : public NodeDelegate {
+ public:
+  PerfNodeDelegate() : next_port_name_(1) {}
+
+  void set_node(Node* node) { node_ = node; }
+
+  // Must be called by each thread before any thread starts sending.
+  void RegisterThread(std::vector<ScopedMessage>* queue) {
+    std::lock_guard<std::mutex> lock(queues_lock_);
+    queues_[std::this_thread::get_id()] = queue;
+  }
+
+  // Delivers everything queued for the calling thread, including messages
+  // forwarded while doing so.
+  void DeliverQueuedMessages() {
+    std::vector<ScopedMessage>* queue = GetQueue();
+    while (!queue->empty()) {
+      std::vector<ScopedMessage> messages;
+      std::swap(messages, *queue);
+      for (auto& message : messages)
+        node_->AcceptMessage(std::move(message));
+    }
+  }
+
+  void GenerateRandomPortName(PortName* port_name) override {
+    port_name->v1 = next_port_name_++;
+    port_name->v2 = 0;
+  }
+
+  void AllocMessage(size_t num_header_bytes,
+                    size_t num_payload_bytes,
+                    size_t num_ports,
+                    ScopedMessage* message) override {
+    message->reset(
+        new TestMessage(num_header_bytes, num_payload_bytes, num_ports));
+  }
+
+  void ForwardMessage(const NodeName& node_name,
+                      ScopedMessage message) override {
+    GetQueue()->emplace_back(std::move(message));
+  }
+
+  void PortStatusChanged(const PortRef& port_ref) override {}
+
+ private:
+  // Registration is complete before any message is sent, so lookups need not
+  // lock.
+  std::vector<ScopedMessage>* GetQueue() {
+    return queues_.find(std::this_thread::get_id())->second;
+  }
+
+  Node* node_ = nullptr;
+  std::atomic<uint64_t> next_port_name_;
+  std::mutex queues_lock_;
+  std::map<std::thread::id, std::vector<ScopedMessage>*> queues_;
+
+  DISALLOW_COPY_AND_ASSIGN(PerfNodeDelegate);
+};
+
+// Repeatedly creates a port pair and sends one end of it over a pipe owned by
+// this thread, then closes both ends once the transferred port is received.
+void TransferPorts(Node* node,
+                   PerfNodeDelegate* delegate,
+                   std::atomic<size_t>* num_registered,
+                   std::atomic<bool>* start) {
+  std::vector<ScopedMessage> queue;
+  delegate->RegisterThread(&queue);
+  ++*num_registered;
+  while (!start->load())
+    std::this_thread::yield();
+
+  PortRef a, b;
+  ASSERT_EQ(OK, node->CreatePortPair(&a, &b));
+
+  for (size_t i = 0; i < kNumTransfersPerThread; ++i) {
+    PortRef x0, x1;
+    ASSERT_EQ(OK, node->CreatePortPair(&x0, &x1));
+
+    ScopedMessage message;
+    ASSERT_EQ(OK, node->AllocMessage(0, 1, &message));
+    message->mutable_ports()[0] = x1.name();
+    ASSERT_EQ(OK, node->SendMessage(a, std::move(message)));
+    delegate->DeliverQueuedMessages();
+
+    // Another thread may be delivering to |b|'s shard, in which case the
+    // message shows up once it gets to it.
+    for (;;) {
+      ASSERT_EQ(OK, node->GetMessage(b, &message));
+      if (message)
+        break;
+      std::this_thread::yield();
+    }
+    ASSERT_EQ(1u, message->num_ports());
+
+    PortRef received;
+    ASSERT_EQ(OK, node->GetPort(message->ports()[0], &received));
+    EXPECT_EQ(OK, node->ClosePort(received));
+    EXPECT_EQ(OK, node->ClosePort(x0));
+    delegate->DeliverQueuedMessages();
+  }
+
+  EXPECT_EQ(OK, node->ClosePort(a));
+  EXPECT_EQ(OK, node->ClosePort(b));
+  delegate->DeliverQueuedMessages();
+}
+
+void RunPortTransfers(size_t num_threads) {
+  PerfNodeDelegate delegate;
+  Node node(NodeName(0, 1), &delegate);
+  delegate.set_node(&node);
+
+  std::atomic<size_t> num_registered(0);
+  std::atomic<bool> start(false);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < num_threads; ++i) {
+    threads.emplace_back(&TransferPorts, &node, &delegate, &num_registered,
+                         &start);
+  }
+  while (num_registered.load() < num_threads)
+    std::this_thread::yield();
+
+  // Each thread does the same amount of work, so if transfers proceed
+  // independently the elapsed time stays flat as threads are added.
+  std::string test_name = base::StringPrintf(
+      "Node_PortTransfer_%ux%uthreads",
+      static_cast<unsigned>(kNumTransfersPerThread),
+      static_cast<unsigned>(num_threads));
+  base::PerfTimeLogger logger(test_name.c_str());
+  start = true;
+  for (auto& thread : threads)
+    thread.join();
+  logger.Done();
+}
+
+TEST(NodePerfTest, PortTransfer) {
+  const size_t kNumThreads[] = {1, 2, 4, 8};
+  for (size_t num_threads : kNumThreads)
+    RunPortTransfers(num_threads);
+}
+
+// Connects any number of nodes in memory. Forwarded messages are queued and
+// delivered in order when the test pumps them, all on the calling thread.
+class Router {
+ public:
+  Router() : next_port_name_(1) {}
+
+  // Creates and owns |num_nodes| nodes, named 0 through |num_nodes - 1|.
+  void CreateNodes(size_t num_nodes);
+
+  Node* node(size_t index) { return nodes_[index].get(); }
+  static NodeName node_name(size_t index) { return NodeName(index, 1); }
+
+  void GenerateRandomPortName(PortName* port_name) {
+    port_name->v1 = next_port_name_++;
+    port_name->v2 = 0;
+  }
+
+  void ForwardMessage(const NodeName& node_name, ScopedMessage message) {
+    queue_.emplace_back(node_name, std::move(message));
+  }
+
+  // Delivers queued messages, and any they cause to be forwarded, until none
+  // are left.
+  void Pump() {
+    // Anything held back by PumpUserMessages was forwarded first.
+    for (auto& entry : queue_)
+      deferred_.emplace_back(entry.first, std::move(entry.second));
+    queue_.clear();
+    std::swap(queue_, deferred_);
+
+    while (!queue_.empty()) {
+      NodeName node_name = queue_.front().first;
+      ScopedMessage message = std::move(queue_.front().second);
+      queue_.pop_front();
+      EXPECT_EQ(OK, node(node_name.v1)->AcceptMessage(std::move(message)));
+    }
+  }
+
+  // Like Pump, but only delivers user messages. Everything else is held back,
+  // in order, until the next Pump, so that proxies set up by port transfers
+  // are left in place.
+  void PumpUserMessages() {
+    while (!queue_.empty()) {
+      NodeName node_name = queue_.front().first;
+      ScopedMessage message = std::move(queue_.front().second);
+      queue_.pop_front();
+      if (GetEventHeader(*message)->type == EventType::kUser) {
+        EXPECT_EQ(OK, node(node_name.v1)->AcceptMessage(std::move(message)));
+      } else {
+        deferred_.emplace_back(node_name, std::move(message));
+      }
+    }
+  }
+
+  // Removes all queued messages bound for |node_name| and returns them,
+  // ignoring any held back by PumpUserMessages.
+  std::vector<ScopedMessage> TakeMessages(const NodeName& node_name) {
+    std::vector<ScopedMessage> messages;
+    std::deque<std::pair<NodeName, ScopedMessage>> remaining;
+    for (auto& entry : queue_) {
+      if (entry.first == node_name)
+        messages.emplace_back(std::move(entry.second));
+      else
+        remaining.emplace_back(entry.first, std::move(entry.second));
+    }
+    std::swap(queue_, remaining);
+    return messages;
+  }
+
+  void DiscardMessages() {
+    queue_.clear();
+    deferred_.clear();
+  }
+
+ private:
+  class Delegate : public NodeDelegate {
+   public:
+    explicit Delegate(Router* router) : router_(router) {}
+
+    void GenerateRandomPortName(PortName* port_name) override {
+      router_->GenerateRandomPortName(port_name);
+    }
+
+    void AllocMessage(size_t num_header_bytes,
+                      size_t num_payload_bytes,
+                      size_t num_ports,
+                      ScopedMessage* message) override {
+      message->reset(
+          new TestMessage(num_header_bytes, num_payload_bytes, num_ports));
+    }
+
+    void ForwardMessage(const NodeName& node_name,
+                        ScopedMessage message) override {
+      router_->ForwardMessage(node_name, std::move(message));
+    }
+
+    // Tests poll for messages instead.
+    void PortStatusChanged(const PortRef& port_ref) override {}
+
+   private:
+    Router* const router_;
+
+    DISALLOW_COPY_AND_ASSIGN(Delegate);
+  };
+
+  uint64_t next_port_name_;
+  std::vector<std::unique_ptr<Delegate>> delegates_;
+  std::vector<std::unique_ptr<Node>> nodes_;
+  std::deque<std::pair<NodeName, ScopedMessage>> queue_;
+  std::deque<std::pair<NodeName, ScopedMessage>> deferred_;
+
+  DISALLOW_COPY_AND_ASSIGN(Router);
+};
+
+void Router::CreateNodes(size_t num_nodes) {
+  for (size_t i = 0; i < num_nodes; ++i) {
+    delegates_.emplace_back(new Delegate(this));
+    nodes_.emplace_back(new Node(node_name(i), delegates_.back().get()));
+  }
+}
+
+// Connects a new port |port0| on node |index0| to a new port |port1| on node
+// |index1|.
+void ConnectPorts(Router* router,
+                  size_t index0,
+                  size_t index1,
+                  PortRef* port0,
+                  PortRef* port1) {
+  Node* node0 = router->node(index0);
+  Node* node1 = router->node(index1);
+  ASSERT_EQ(OK, node0->CreateUninitializedPort(port0));
+  ASSERT_EQ(OK, node1->CreateUninitializedPort(port1));
+  ASSERT_EQ(OK, node0->InitializePort(*port0, Router::node_name(index1),
+                                      port1->name()));
+  ASSERT_EQ(OK, node1->InitializePort(*port1, Router::node_name(index0),
+                                      port0->name()));
+}
+
+ScopedMessage NewMessage(Node* node, size_t num_ports) {
+  ScopedMessage message;
+  EXPECT_EQ(OK, node->AllocMessage(8, num_ports, &message));
+  return message;
+}
+
+// Sends messages round-robin over |num_pairs| local port pairs, reading each
+// back straight away.
+void SendAndGetLocal(size_t num_pairs) {
+  const size_t kNumMessages = 1000000;
+
+  Router router;
+  router.CreateNodes(1);
+  Node* node = router.node(0);
+
+  std::vector<PortRef> senders(num_pairs), receivers(num_pairs);
+  for (size_t i = 0; i < num_pairs; ++i)
+    ASSERT_EQ(OK, node->CreatePortPair(&senders[i], &receivers[i]));
+
+  std::string test_name = base::StringPrintf(
+      "Node_SendAndGetLocal_%ux_%upairs", static_cast<unsigned>(kNumMessages),
+      static_cast<unsigned>(num_pairs));
+  {
+    base::PerfTimeLogger logger(test_name.c_str());
+    for (size_t i = 0; i < kNumMessages; ++i) {
+      size_t pair = i % num_pairs;
+      ASSERT_EQ(OK, node->SendMessage(senders[pair], NewMessage(node, 0)));
+      ScopedMessage message;
+      ASSERT_EQ(OK, node->GetMessage(receivers[pair], &message));
+      ASSERT_TRUE(message);
+    }
+    logger.Done();
+  }
+
+  for (size_t i = 0; i < num_pairs; ++i) {
+    EXPECT_EQ(OK, node->ClosePort(senders[i]));
+    EXPECT_EQ(OK, node->ClosePort(receivers[i]));
+  }
+  router.Pump();
+}
+
+TEST(NodePerfTest, SendAndGetLocal) {
+  SendAndGetLocal(1);
+  SendAndGetLocal(1000);
+}
+
+// Delivers messages sent between two nodes with each consecutive window of
+// |window_size| messages reversed, so that most arrive ahead of their turn.
+void AcceptOutOfOrder(size_t window_size) {
+  const size_t kNumMessages = 100000;
+
+  Router router;
+  router.CreateNodes(2);
+  Node* node0 = router.node(0);
+  Node* node1 = router.node(1);
+
+  PortRef x0, x1;
+  ConnectPorts(&router, 0, 1, &x0, &x1);
+  router.Pump();
+
+  for (size_t i = 0; i < kNumMessages; ++i)
+    ASSERT_EQ(OK, node0->SendMessage(x0, NewMessage(node0, 0)));
+  std::vector<ScopedMessage> messages = router.TakeMessages(Router::node_name(1));
+  ASSERT_EQ(kNumMessages, messages.size());
+  for (size_t i = 0; i + window_size <= messages.size(); i += window_size)
+    std::reverse(messages.begin() + i, messages.begin() + i + window_size);
+
+  std::string test_name = base::StringPrintf(
+      "Node_AcceptOutOfOrder_%ux_window%u",
+      static_cast<unsigned>(kNumMessages), static_cast<unsigned>(window_size));
+  {
+    base::PerfTimeLogger logger(test_name.c_str());
+    for (auto& message : messages)
+      ASSERT_EQ(OK, node1->AcceptMessage(std::move(message)));
+    for (size_t i = 0; i < kNumMessages; ++i) {
+      ScopedMessage message;
+      ASSERT_EQ(OK, node1->GetMessage(x1, &message));
+      ASSERT_TRUE(message);
+    }
+    logger.Done();
+  }
+
+  EXPECT_EQ(OK, node0->ClosePort(x0));
+  EXPECT_EQ(OK, node1->ClosePort(x1));
+  router.Pump();
+}
+
+TEST(NodePerfTest, AcceptOutOfOrder) {
+  const size_t kWindowSizes[] = {1, 16, 256};
+  for (size_t window_size : kWindowSizes)
+    AcceptOutOfOrder(window_size);
+}
+
+// Nodes connected in a chain, with a pipe from each node to the next.
+class NodeChain {
+ public:
+  explicit NodeChain(size_t num_nodes)
+      : num_nodes_(num_nodes),
+        pipe_ends_(num_nodes - 1),
+        pipe_starts_(num_nodes - 1) {
+    router_.CreateNodes(num_nodes);
+    for (size_t i = 0; i + 1 < num_nodes; ++i)
+      ConnectPorts(&router_, i, i + 1, &pipe_starts_[i], &pipe_ends_[i]);
+    router_.Pump();
+  }
+
+  ~NodeChain() {
+    for (size_t i = 0; i + 1 < num_nodes_; ++i) {
+      EXPECT_EQ(OK, node(i)->ClosePort(pipe_starts_[i]));
+      EXPECT_EQ(OK, node(i + 1)->ClosePort(pipe_ends_[i]));
+    }
+    router_.Pump();
+  }
+
+  Router* router() { return &router_; }
+  Node* node(size_t index) { return router_.node(index); }
+  size_t num_nodes() const { return num_nodes_; }
+
+  // Sends |port| from node |index| to the next node along the chain, and
+  // returns it as bound there. If |collapse_proxies| is false, only the user
+  // message is delivered and the proxy left behind stays in place.
+  PortRef Hop(size_t index, const PortRef& port, bool collapse_proxies) {
+    ScopedMessage message = NewMessage(node(index), 1);
+    message->mutable_ports()[0] = port.name();
+    EXPECT_EQ(OK, node(index)->SendMessage(pipe_starts_[index],
+                                           std::move(message)));
+    if (collapse_proxies)
+      router_.Pump();
+    else
+      router_.PumpUserMessages();
+
+    EXPECT_EQ(OK, node(index + 1)->GetMessage(pipe_ends_[index], &message));
+    PortRef received;
+    if (message) {
+      EXPECT_EQ(1u, message->num_ports());
+      EXPECT_EQ(OK, node(index + 1)->GetPort(message->ports()[0], &received));
+    } else {
+      ADD_FAILURE() << "Transferred port didn't arrive at node " << index + 1;
+    }
+    return received;
+  }
+
+ private:
+  const size_t num_nodes_;
+  Router router_;
+  std::vector<PortRef> pipe_ends_;
+  std::vector<PortRef> pipe_starts_;
+
+  DISALLOW_COPY_AND_ASSIGN(NodeChain);
+};
+
+// Sends a port from the first node of a chain to the last, one hop at a time,
+// letting the proxies collapse after each hop.
+void TransferAlongChain(size_t num_nodes) {
+  const size_t kNumTransfers = 10000;
+
+  NodeChain chain(num_nodes);
+  Node* first = chain.node(0);
+  Node* last = chain.node(num_nodes - 1);
+
+  std::string test_name = base::StringPrintf(
+      "Node_TransferAlongChain_%ux_%unodes",
+      static_cast<unsigned>(kNumTransfers), static_cast<unsigned>(num_nodes));
+  {
+    base::PerfTimeLogger logger(test_name.c_str());
+    for (size_t i = 0; i < kNumTransfers; ++i) {
+      PortRef a, b;
+      ASSERT_EQ(OK, first->CreatePortPair(&a, &b));
+      for (size_t hop = 0; hop + 1 < num_nodes; ++hop)
+        b = chain.Hop(hop, b, true);
+
+      EXPECT_EQ(OK, first->ClosePort(a));
+      EXPECT_EQ(OK, last->ClosePort(b));
+      chain.router()->Pump();
+    }
+    logger.Done();
+  }
+}
+
+TEST(NodePerfTest, TransferAlongChain) {
+  const size_t kNumNodes[] = {2, 4, 8};
+  for (size_t num_nodes : kNumNodes)
+    TransferAlongChain(num_nodes);
+}
+
+// Sends ports along a chain while holding back everything but user messages,
+// so that each leaves a proxy on every node it passed through. Then times
+// collapsing all of those proxies at once.
+void CollapseProxies(size_t num_nodes) {
+  const size_t kNumPorts = 10000;
+
+  NodeChain chain(num_nodes);
+  Node* first = chain.node(0);
+  Node* last = chain.node(num_nodes - 1);
+
+  std::vector<PortRef> local_ports(kNumPorts), remote_ports(kNumPorts);
+  for (size_t i = 0; i < kNumPorts; ++i) {
+    ASSERT_EQ(OK, first->CreatePortPair(&local_ports[i], &remote_ports[i]));
+    for (size_t hop = 0; hop + 1 < num_nodes; ++hop)
+      remote_ports[i] = chain.Hop(hop, remote_ports[i], false);
+  }
+
+  std::string test_name = base::StringPrintf(
+      "Node_CollapseProxies_%ux_%unodes", static_cast<unsigned>(kNumPorts),
+      static_cast<unsigned>(num_nodes));
+  {
+    base::PerfTimeLogger logger(test_name.c_str());
+    chain.router()->Pump();
+    logger.Done();
+  }
+
+  for (size_t i = 0; i < kNumPorts; ++i) {
+    EXPECT_EQ(OK, first->ClosePort(local_ports[i]));
+    EXPECT_EQ(OK, last->ClosePort(remote_ports[i]));
+  }
+  chain.router()->Pump();
+}
+
+TEST(NodePerfTest, CollapseProxies) {
+  const size_t kNumNodes[] = {2, 4, 8};
+  for (size_t num_nodes : kNumNodes)
+    CollapseProxies(num_nodes);
+}
+
+// Times a node losing its connection to a peer which holds the other end of
+// each of its ports.
+TEST(NodePerfTest, LostConnectionToNode) {
+  const size_t kNumPorts = 100000;
+
+  Router router;
+  router.CreateNodes(2);
+  Node* node0 = router.node(0);
+  Node* node1 = router.node(1);
+
+  std::vector<PortRef> ports0(kNumPorts), ports1(kNumPorts);
+  for (size_t i = 0; i < kNumPorts; ++i)
+    ConnectPorts(&router, 0, 1, &ports0[i], &ports1[i]);
+  router.Pump();
+
+  std::string test_name = base::StringPrintf(
+      "Node_LostConnectionToNode_%uports", static_cast<unsigned>(kNumPorts));
+  {
+    base::PerfTimeLogger logger(test_name.c_str());
+    EXPECT_EQ(OK, node0->LostConnectionToNode(Router::node_name(1)));
+    logger.Done();
+  }
+
+  // Node0 can no longer reach node1, so anything the closures send is
+  // dropped.
+  for (size_t i = 0; i < kNumPorts; ++i) {
+    EXPECT_EQ(OK, node0->ClosePort(ports0[i]));
+    EXPECT_EQ(OK, node1->ClosePort(ports1[i]));
+  }
+  router.DiscardMessages();
+}
+
+}  // namespace
+}  // namespace test
+}  // namespace ports
+}  // namespace edk
+}  // namespace mojo
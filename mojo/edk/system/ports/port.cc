@@ -8,17 +8,34 @@ namespace mojo {
 namespace edk {
 namespace ports {
 
+Port::ColdState::ColdState() {}
+
+Port::ColdState::~ColdState() {}
+
 Port::Port(uint64_t next_sequence_num_to_send,
            uint64_t next_sequence_num_to_receive)
-    : state(kUninitialized),
+    : lock("Port::lock"),
+      state(kUninitialized),
+      status(0),
+      erased(false),
+      remove_proxy_on_last_message(false),
+      peer_closed(false),
+      over_quota(false),
+      peer_over_quota(false),
+      peer_node_congested(false),
+      status_change_pending(false),
       next_sequence_num_to_send(next_sequence_num_to_send),
       last_sequence_num_to_receive(0),
-      message_queue(next_sequence_num_to_receive),
-      remove_proxy_on_last_message(false),
-      peer_closed(false) {}
+      message_queue(next_sequence_num_to_receive) {}
 
 Port::~Port() {}
 
+Port::ColdState* Port::GetOrCreateColdState() {
+  if (!cold_state_)
+    cold_state_.reset(new ColdState);
+  return cold_state_.get();
+}
+
 }  // namespace ports
 }  // namespace edk
 }  // namespace mojo
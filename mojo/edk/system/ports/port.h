@@ -5,19 +5,29 @@
 #ifndef MOJO_EDK_SYSTEM_PORTS_PORT_H_
 #define MOJO_EDK_SYSTEM_PORTS_PORT_H_
 
+#include <stdint.h>
+
+#include <atomic>
 #include <memory>
-#include <mutex>
 #include <queue>
 #include <utility>
 #include <vector>
 
 #include "mojo/edk/system/ports/message_queue.h"
+#include "mojo/edk/system/ports/name.h"
+#include "mojo/edk/system/ports/port_observer.h"
+#include "mojo/edk/system/ports/port_ref.h"
+#include "mojo/edk/system/ports/profiled_lock.h"
 #include "mojo/edk/system/ports/user_data.h"
 
 namespace mojo {
 namespace edk {
 namespace ports {
 
+// The state of a port. Fields are ordered so that the ones which are used for
+// every message in the steady kReceiving state sit together at the front. The
+// rest, which only ports that are being set up, buffering, proxying or under
+// a quota need, live in a ColdState which is allocated on first use.
 class Port {
  public:
   enum State {
@@ -28,24 +38,105 @@ class Port {
     kClosed
   };
 
-  std::mutex lock;
+  struct ColdState {
+    ColdState();
+    ~ColdState();
+
+    // For a port which has been sent and is now a proxy, the peer it had
+    // before it was sent. That port will be sending to the proxy until told
+    // otherwise.
+    NodeName proxied_peer_node_name;
+    PortName proxied_peer_port_name;
+    std::unique_ptr<std::pair<NodeName, ScopedMessage>> send_on_proxy_removal;
+
+    // Observers which have been replaced. See |observer|.
+    std::vector<std::shared_ptr<PortObserver>> retired_observers;
+
+    // Limits on the unread messages and bytes queued at this port, where zero
+    // means unlimited.
+    size_t max_queued_messages = 0;
+    size_t max_queued_bytes = 0;
+
+    // Messages sent while the port was uninitialized, and the ports they
+    // carry.
+    std::queue<ScopedMessage> outgoing_messages;
+    std::vector<PortRef> outgoing_ports;
+  };
+
+  // Bits of |status|.
+  enum : uint32_t {
+    kStatusReceiving = 1 << 0,
+    kStatusHasMessages = 1 << 1,
+    kStatusPeerClosed = 1 << 2,
+    kStatusPeerOverQuota = 1 << 3,
+    kStatusPeerRemote = 1 << 4,
+  };
+
+  ProfiledMutex lock;
   State state;
+
+  // What Node::GetStatus() reports, republished under |lock| whenever any of
+  // it changes so that it can be read without the lock. Zero unless the port
+  // is receiving. See Node::UpdateStatus_Locked().
+  std::atomic<uint32_t> status;
+
+  // Set once the port has been removed from its Node's port table, after
+  // which no more messages are accepted for it. Lets a PortRef kept from an
+  // earlier lookup stand in for looking the port up again. Not guarded by
+  // |lock|.
+  std::atomic<bool> erased;
+
+  bool remove_proxy_on_last_message;
+  bool peer_closed;
+
+  // |over_quota| is what the peer was last told about this port's queue
+  // limits, and |peer_over_quota| is what the peer last told us about its
+  // own.
+  bool over_quota;
+  bool peer_over_quota;
+
+  // Whether the node the peer is on has been reported congested, which is
+  // reported to the port's owner like |peer_over_quota|. Recomputed whenever
+  // the peer changes. See Node::SetPeerNodeCongested().
+  bool peer_node_congested;
+
+  // Whether a batch of incoming messages has queued a PortStatusChanged
+  // notification for this port which hasn't been delivered yet. Further
+  // arrivals before then are covered by that notification.
+  bool status_change_pending;
+
   NodeName peer_node_name;
   PortName peer_port_name;
   uint64_t next_sequence_num_to_send;
   uint64_t last_sequence_num_to_receive;
   MessageQueue message_queue;
-  std::unique_ptr<std::pair<NodeName, ScopedMessage>> send_on_proxy_removal;
+
+  // Notified of status changes instead of the delegate, if set. Node calls it
+  // through a raw pointer after releasing |lock|, so an observer that gets
+  // replaced is moved to the ColdState's |retired_observers| and kept until
+  // the port itself is destroyed. Node holds a reference to the port while
+  // notifying.
+  std::shared_ptr<PortObserver> observer;
   std::shared_ptr<UserData> user_data;
-  bool remove_proxy_on_last_message;
-  bool peer_closed;
 
-  std::queue<ScopedMessage> outgoing_messages;
-  std::vector<std::shared_ptr<Port>> outgoing_ports;
+  // The node under which Node's peer index lists this port, if any. Guarded
+  // by the index's lock rather than by |lock|.
+  NodeName indexed_peer_node_name;
 
   Port(uint64_t next_sequence_num_to_send,
        uint64_t next_sequence_num_to_receive);
   ~Port();
+
+  // The port's ColdState, or null if it has never needed one.
+  ColdState* cold_state() { return cold_state_.get(); }
+  const ColdState* cold_state() const { return cold_state_.get(); }
+
+  // Returns the port's ColdState, allocating it if needed. Like the rest of
+  // the port, it's guarded by |lock|.
+  ColdState* GetOrCreateColdState();
+
+ private:
+  std::unique_ptr<ColdState> cold_state_;
 };
 
 }  // namespace ports
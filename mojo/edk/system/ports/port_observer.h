@@ -0,0 +1,27 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_SYSTEM_PORTS_PORT_OBSERVER_H_
+#define MOJO_EDK_SYSTEM_PORTS_PORT_OBSERVER_H_
+
+namespace mojo {
+namespace edk {
+namespace ports {
+
+// Receives status change notifications for a single port, in place of
+// NodeDelegate::PortStatusChanged. See Node::SetPortObserver.
+class PortObserver {
+ public:
+  virtual ~PortObserver() {}
+
+  // Called without any port locks held. As with PortStatusChanged, use
+  // Node::GetStatus to query the latest status of the port.
+  virtual void OnPortStatusChanged() = 0;
+};
+
+}  // namespace ports
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_SYSTEM_PORTS_PORT_OBSERVER_H_
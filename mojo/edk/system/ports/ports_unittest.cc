@@ -6,14 +6,23 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <atomic>
 #include <map>
 #include <memory>
 #include <queue>
 #include <sstream>
+#include <thread>
+#include <vector>
 
 #include "base/logging.h"
+#include "mojo/edk/system/ports/event.h"
+#include "mojo/edk/system/ports/local_message_queue.h"
+#include "mojo/edk/system/ports/message_queue.h"
+#include "mojo/edk/system/ports/name_map.h"
 #include "mojo/edk/system/ports/node.h"
 #include "mojo/edk/system/ports/node_delegate.h"
+#include "mojo/edk/system/ports/slab_allocator.h"
+#include "mojo/edk/system/ports/test_utils.h"
 #include "testing/gtest/include/gtest/gtest.h"
 
 namespace mojo {
@@ -33,22 +42,6 @@ static void LogMessage(const Message* message) {
            << "\" ports=[" << ports.str() << "]";
 }
 
-class TestMessage : public Message {
- public:
-  TestMessage(size_t num_header_bytes,
-              size_t num_payload_bytes,
-              size_t num_ports_bytes)
-      : Message(num_header_bytes,
-                num_payload_bytes,
-                num_ports_bytes) {
-    start_ = new char[num_header_bytes + num_payload_bytes + num_ports_bytes];
-  }
-
-  ~TestMessage() override {
-    delete[] start_;
-  }
-};
-
 struct Task {
   Task(NodeName node_name, ScopedMessage message)
       : node_name(node_name),
@@ -91,6 +84,22 @@ static void PumpTasks() {
   }
 }
 
+// Delivers all pending tasks to their nodes as one AcceptMessages batch per
+// node, rather than one message at a time.
+static void PumpTasksBatched() {
+  std::map<uint64_t, std::vector<ScopedMessage>> batches;
+  while (!task_queue.empty()) {
+    Task* task = task_queue.top();
+    task_queue.pop();
+    batches[task->node_name.v1].emplace_back(std::move(task->message));
+    delete task;
+  }
+
+  for (auto& batch : batches)
+    EXPECT_EQ(OK, node_map[batch.first]->AcceptMessages(
+                      std::move(batch.second)));
+}
+
 static void DiscardPendingTasks() {
   while (!task_queue.empty()) {
     Task* task = task_queue.top();
@@ -218,6 +227,16 @@ class TestNodeDelegate : public NodeDelegate {
   bool save_messages_;
 };
 
+class CountingPortObserver : public PortObserver {
+ public:
+  size_t num_status_changes() const { return num_status_changes_; }
+
+  void OnPortStatusChanged() override { ++num_status_changes_; }
+
+ private:
+  size_t num_status_changes_ = 0;
+};
+
 class PortsTest : public testing::Test {
  public:
   PortsTest() {
@@ -405,6 +424,91 @@ TEST_F(PortsTest, LostConnectionToNode2) {
   EXPECT_FALSE(message);
 }
 
+TEST_F(PortsTest, LostConnectionToNode3) {
+  NodeName node0_name(0, 1);
+  TestNodeDelegate node0_delegate(node0_name);
+  Node node0(node0_name, &node0_delegate);
+  SetNode(node0_name, &node0);
+
+  NodeName node1_name(1, 1);
+
+  // Enough ports to land in every shard of the port table.
+  const size_t kNumPorts = 64;
+  std::vector<PortRef> ports(kNumPorts);
+  for (size_t i = 0; i < kNumPorts; ++i) {
+    EXPECT_EQ(OK, node0.CreateUninitializedPort(&ports[i]));
+    EXPECT_EQ(OK, node0.InitializePort(ports[i], node1_name,
+                                       PortName(1000 + i, 1)));
+  }
+
+  EXPECT_EQ(OK, node0.LostConnectionToNode(node1_name));
+
+  node0_delegate.set_drop_messages(true);
+
+  for (size_t i = 0; i < kNumPorts; ++i) {
+    ScopedMessage message;
+    EXPECT_EQ(ERROR_PORT_PEER_CLOSED, node0.GetMessage(ports[i], &message));
+    EXPECT_FALSE(message);
+    EXPECT_EQ(OK, node0.ClosePort(ports[i]));
+  }
+}
+
+TEST_F(PortsTest, LostConnectionToNodeAfterPortReturns) {
+  NodeName node0_name(0, 1);
+  TestNodeDelegate node0_delegate(node0_name);
+  Node node0(node0_name, &node0_delegate);
+  SetNode(node0_name, &node0);
+
+  NodeName node1_name(1, 1);
+  TestNodeDelegate node1_delegate(node1_name);
+  Node node1(node1_name, &node1_delegate);
+  SetNode(node1_name, &node1);
+
+  node0_delegate.set_save_messages(true);
+  node1_delegate.set_save_messages(true);
+
+  PortRef x0, x1;
+  EXPECT_EQ(OK, node0.CreateUninitializedPort(&x0));
+  EXPECT_EQ(OK, node1.CreateUninitializedPort(&x1));
+  EXPECT_EQ(OK, node0.InitializePort(x0, node1_name, x1.name()));
+  EXPECT_EQ(OK, node1.InitializePort(x1, node0_name, x0.name()));
+
+  // Send a1 to node1 and back again, so that a0's peer is on node1 for a
+  // while and then local once more.
+  PortRef a0, a1;
+  EXPECT_EQ(OK, node0.CreatePortPair(&a0, &a1));
+  EXPECT_EQ(OK, node0.SendMessage(x0, NewStringMessageWithPort("a1", a1)));
+  PumpTasks();
+
+  ScopedMessage message;
+  ASSERT_TRUE(node1_delegate.GetSavedMessage(&message));
+  ASSERT_EQ(1u, message->num_ports());
+  PortName a2_name = message->ports()[0];
+  EXPECT_EQ(OK, node1.SendMessage(x1, NewStringMessageWithPort("a2", a2_name)));
+  PumpTasks();
+
+  ASSERT_TRUE(node0_delegate.GetSavedMessage(&message));
+  ASSERT_EQ(1u, message->num_ports());
+  PortRef a3;
+  EXPECT_EQ(OK, node0.GetPort(message->ports()[0], &a3));
+
+  node1_delegate.set_drop_messages(true);
+  EXPECT_EQ(OK, node0.LostConnectionToNode(node1_name));
+
+  // Only x0's peer was on node1 by then.
+  EXPECT_EQ(ERROR_PORT_PEER_CLOSED,
+            node0.SendMessage(x0, NewStringMessage("lost")));
+  EXPECT_EQ(OK, node0.SendMessage(a0, NewStringMessage("hello")));
+  PumpTasks();
+
+  ASSERT_TRUE(node0_delegate.GetSavedMessage(&message));
+  EXPECT_EQ(0, strcmp("hello", ToString(message)));
+
+  EXPECT_EQ(OK, node0.ClosePort(a0));
+  EXPECT_EQ(OK, node0.ClosePort(a3));
+  EXPECT_EQ(OK, node0.ClosePort(x0));
+}
+
 TEST_F(PortsTest, GetMessage1) {
   NodeName node0_name(0, 1);
   TestNodeDelegate node0_delegate(node0_name);
@@ -486,6 +590,297 @@ TEST_F(PortsTest, GetMessage3) {
   EXPECT_EQ(OK, node0.ClosePort(a1));
 }
 
+TEST_F(PortsTest, GetMessages) {
+  NodeName node0_name(0, 1);
+  TestNodeDelegate node0_delegate(node0_name);
+  Node node0(node0_name, &node0_delegate);
+  node_map[0] = &node0;
+
+  node0_delegate.set_read_messages(false);
+
+  PortRef a0, a1;
+  EXPECT_EQ(OK, node0.CreatePortPair(&a0, &a1));
+
+  const char* kStrings[] = {"1", "2", "3", "stop", "4"};
+  for (const char* string : kStrings)
+    EXPECT_EQ(OK, node0.SendMessage(a1, NewStringMessage(string)));
+
+  // At most |max_messages| are returned.
+  std::vector<ScopedMessage> messages;
+  EXPECT_EQ(OK, node0.GetMessagesIf(a0, nullptr, 2, &messages));
+  ASSERT_EQ(2u, messages.size());
+  EXPECT_EQ(0, strcmp("1", ToString(messages[0])));
+  EXPECT_EQ(0, strcmp("2", ToString(messages[1])));
+
+  // The batch ends at the first message the selector declines.
+  auto selector = [](const Message& message) {
+    return strcmp("stop",
+                  static_cast<const char*>(message.payload_bytes())) != 0;
+  };
+  messages.clear();
+  EXPECT_EQ(OK, node0.GetMessagesIf(a0, selector, 10, &messages));
+  ASSERT_EQ(1u, messages.size());
+  EXPECT_EQ(0, strcmp("3", ToString(messages[0])));
+
+  messages.clear();
+  EXPECT_EQ(OK, node0.GetMessagesIf(a0, nullptr, 10, &messages));
+  ASSERT_EQ(2u, messages.size());
+  EXPECT_EQ(0, strcmp("stop", ToString(messages[0])));
+  EXPECT_EQ(0, strcmp("4", ToString(messages[1])));
+
+  EXPECT_EQ(OK, node0.ClosePort(a1));
+  PumpTasks();
+
+  messages.clear();
+  EXPECT_EQ(ERROR_PORT_PEER_CLOSED,
+            node0.GetMessagesIf(a0, nullptr, 10, &messages));
+  EXPECT_TRUE(messages.empty());
+
+  EXPECT_EQ(OK, node0.ClosePort(a0));
+}
+
+TEST_F(PortsTest, GetMessageWithFilter) {
+  NodeName node0_name(0, 1);
+  TestNodeDelegate node0_delegate(node0_name);
+  Node node0(node0_name, &node0_delegate);
+  node_map[0] = &node0;
+
+  node0_delegate.set_read_messages(false);
+
+  PortRef a0, a1;
+  EXPECT_EQ(OK, node0.CreatePortPair(&a0, &a1));
+
+  EXPECT_EQ(OK, node0.SendMessage(a1, NewStringMessage("1")));
+  EXPECT_EQ(OK, node0.SendMessage(a1, NewStringMessage("stop")));
+
+  // Counts the messages offered to it and declines "stop".
+  struct StopFilter {
+    size_t num_calls = 0;
+
+    static bool Select(const Message& message, void* context) {
+      ++static_cast<StopFilter*>(context)->num_calls;
+      return strcmp("stop",
+                    static_cast<const char*>(message.payload_bytes())) != 0;
+    }
+  };
+  StopFilter filter;
+
+  ScopedMessage message;
+  EXPECT_EQ(OK, node0.GetMessageIf(a0, &StopFilter::Select, &filter,
+                                   &message));
+  ASSERT_TRUE(message);
+  EXPECT_EQ(0, strcmp("1", ToString(message)));
+
+  EXPECT_EQ(OK, node0.GetMessageIf(a0, &StopFilter::Select, &filter,
+                                   &message));
+  EXPECT_FALSE(message);
+  EXPECT_EQ(2u, filter.num_calls);
+
+  std::vector<ScopedMessage> messages;
+  EXPECT_EQ(OK, node0.GetMessagesIf(a0, nullptr, nullptr, 10, &messages));
+  ASSERT_EQ(1u, messages.size());
+  EXPECT_EQ(0, strcmp("stop", ToString(messages[0])));
+
+  EXPECT_EQ(OK, node0.ClosePort(a0));
+  EXPECT_EQ(OK, node0.ClosePort(a1));
+}
+
+TEST_F(PortsTest, PeerRemoteStatus) {
+  NodeName node0_name(0, 1);
+  TestNodeDelegate node0_delegate(node0_name);
+  Node node0(node0_name, &node0_delegate);
+  SetNode(node0_name, &node0);
+
+  NodeName node1_name(1, 1);
+  TestNodeDelegate node1_delegate(node1_name);
+  Node node1(node1_name, &node1_delegate);
+  SetNode(node1_name, &node1);
+
+  PortRef x0, x1;
+  EXPECT_EQ(OK, node0.CreateUninitializedPort(&x0));
+  EXPECT_EQ(OK, node1.CreateUninitializedPort(&x1));
+  EXPECT_EQ(OK, node0.InitializePort(x0, node1_name, x1.name()));
+  EXPECT_EQ(OK, node1.InitializePort(x1, node0_name, x0.name()));
+
+  PortRef a0, a1;
+  EXPECT_EQ(OK, node0.CreatePortPair(&a0, &a1));
+
+  PortStatus status;
+  EXPECT_EQ(OK, node0.GetStatus(x0, &status));
+  EXPECT_TRUE(status.peer_remote);
+  EXPECT_EQ(OK, node1.GetStatus(x1, &status));
+  EXPECT_TRUE(status.peer_remote);
+  EXPECT_EQ(OK, node0.GetStatus(a0, &status));
+  EXPECT_FALSE(status.peer_remote);
+
+  EXPECT_EQ(OK, node0.ClosePort(a0));
+  EXPECT_EQ(OK, node0.ClosePort(a1));
+  EXPECT_EQ(OK, node0.ClosePort(x0));
+  EXPECT_EQ(OK, node1.ClosePort(x1));
+}
+
+TEST_F(PortsTest, CreatePortPairs) {
+  NodeName node0_name(0, 1);
+  TestNodeDelegate node0_delegate(node0_name);
+  Node node0(node0_name, &node0_delegate);
+  node_map[0] = &node0;
+
+  node0_delegate.set_read_messages(false);
+
+  const size_t kNumPairs = 40;
+  std::vector<PortRef> ports;
+  EXPECT_EQ(OK, node0.CreatePortPairs(kNumPairs, &ports));
+  ASSERT_EQ(2 * kNumPairs, ports.size());
+
+  NodeStats stats;
+  node0.GetStats(&stats);
+  EXPECT_EQ(2 * kNumPairs, stats.num_ports);
+
+  // Each port is ready to receive from the other port in its pair.
+  for (size_t i = 0; i < kNumPairs; ++i) {
+    EXPECT_EQ(OK, node0.SendMessage(ports[2 * i], NewStringMessage("a")));
+    EXPECT_EQ(OK, node0.SendMessage(ports[2 * i + 1], NewStringMessage("b")));
+  }
+  PumpTasks();
+  for (size_t i = 0; i < kNumPairs; ++i) {
+    ScopedMessage message;
+    EXPECT_EQ(OK, node0.GetMessage(ports[2 * i], &message));
+    ASSERT_TRUE(message);
+    EXPECT_EQ(0, strcmp("b", ToString(message)));
+    EXPECT_EQ(OK, node0.GetMessage(ports[2 * i + 1], &message));
+    ASSERT_TRUE(message);
+    EXPECT_EQ(0, strcmp("a", ToString(message)));
+  }
+
+  EXPECT_EQ(OK, node0.ClosePorts(ports));
+  PumpTasks();
+  node0.GetStats(&stats);
+  EXPECT_EQ(0u, stats.num_ports);
+}
+
+TEST_F(PortsTest, Quota) {
+  NodeName node0_name(0, 1);
+  TestNodeDelegate node0_delegate(node0_name);
+  Node node0(node0_name, &node0_delegate);
+  node_map[0] = &node0;
+
+  node0_delegate.set_read_messages(false);
+
+  PortRef a0, a1;
+  EXPECT_EQ(OK, node0.CreatePortPair(&a0, &a1));
+  EXPECT_EQ(OK, node0.SetQuota(a0, 2, 0));
+
+  PortStatus status;
+  EXPECT_EQ(OK, node0.SendMessage(a1, NewStringMessage("1")));
+  EXPECT_EQ(OK, node0.SendMessage(a1, NewStringMessage("2")));
+  PumpTasks();
+  EXPECT_EQ(OK, node0.GetStatus(a1, &status));
+  EXPECT_FALSE(status.peer_over_quota);
+
+  // A third unread message exceeds the quota, but is still delivered.
+  EXPECT_EQ(OK, node0.SendMessage(a1, NewStringMessage("3")));
+  PumpTasks();
+  EXPECT_EQ(OK, node0.GetStatus(a1, &status));
+  EXPECT_TRUE(status.peer_over_quota);
+  EXPECT_EQ(OK, node0.GetStatus(a0, &status));
+  EXPECT_FALSE(status.peer_over_quota);
+
+  ScopedMessage message;
+  EXPECT_EQ(OK, node0.GetMessage(a0, &message));
+  ASSERT_TRUE(message);
+  PumpTasks();
+  EXPECT_EQ(OK, node0.GetStatus(a1, &status));
+  EXPECT_FALSE(status.peer_over_quota);
+
+  // Byte limits work the same way. Each message left has a 2-byte payload.
+  EXPECT_EQ(OK, node0.SetQuota(a0, 0, 3));
+  PumpTasks();
+  EXPECT_EQ(OK, node0.GetStatus(a1, &status));
+  EXPECT_TRUE(status.peer_over_quota);
+
+  // Lifting the limits clears the signal.
+  EXPECT_EQ(OK, node0.SetQuota(a0, 0, 0));
+  PumpTasks();
+  EXPECT_EQ(OK, node0.GetStatus(a1, &status));
+  EXPECT_FALSE(status.peer_over_quota);
+
+  EXPECT_EQ(OK, node0.ClosePort(a1));
+  EXPECT_EQ(OK, node0.ClosePort(a0));
+  PumpTasks();
+}
+
+TEST_F(PortsTest, PeerNodeCongested) {
+  NodeName node0_name(0, 1);
+  TestNodeDelegate node0_delegate(node0_name);
+  Node node0(node0_name, &node0_delegate);
+  SetNode(node0_name, &node0);
+
+  NodeName node1_name(1, 1);
+  TestNodeDelegate node1_delegate(node1_name);
+  Node node1(node1_name, &node1_delegate);
+  SetNode(node1_name, &node1);
+
+  PortRef x0, x1;
+  EXPECT_EQ(OK, node0.CreateUninitializedPort(&x0));
+  EXPECT_EQ(OK, node1.CreateUninitializedPort(&x1));
+  EXPECT_EQ(OK, node0.InitializePort(x0, node1_name, x1.name()));
+  EXPECT_EQ(OK, node1.InitializePort(x1, node0_name, x0.name()));
+
+  PortRef a0, a1;
+  EXPECT_EQ(OK, node0.CreatePortPair(&a0, &a1));
+
+  // Only ports whose peers are on the congested node see it.
+  node0.SetPeerNodeCongested(node1_name, true);
+  PortStatus status;
+  EXPECT_EQ(OK, node0.GetStatus(x0, &status));
+  EXPECT_TRUE(status.peer_over_quota);
+  EXPECT_EQ(OK, node0.GetStatus(a0, &status));
+  EXPECT_FALSE(status.peer_over_quota);
+  EXPECT_EQ(OK, node1.GetStatus(x1, &status));
+  EXPECT_FALSE(status.peer_over_quota);
+
+  // Messages still go through.
+  EXPECT_EQ(OK, node0.SendMessage(x0, NewStringMessage("hello")));
+  PumpTasks();
+
+  node0.SetPeerNodeCongested(node1_name, false);
+  EXPECT_EQ(OK, node0.GetStatus(x0, &status));
+  EXPECT_FALSE(status.peer_over_quota);
+
+  // A port which arrives with its peer on a congested node sees it from the
+  // start.
+  node0_delegate.set_save_messages(true);
+  node0.SetPeerNodeCongested(node1_name, true);
+  PortRef b0, b1;
+  EXPECT_EQ(OK, node1.CreatePortPair(&b0, &b1));
+  EXPECT_EQ(OK, node1.SendMessage(x1, NewStringMessageWithPort("b1", b1)));
+  PumpTasks();
+
+  ScopedMessage message;
+  ASSERT_TRUE(node0_delegate.GetSavedMessage(&message));
+  ASSERT_EQ(1u, message->num_ports());
+  PortRef b2;
+  EXPECT_EQ(OK, node0.GetPort(message->ports()[0], &b2));
+  EXPECT_EQ(OK, node0.GetStatus(b2, &status));
+  EXPECT_TRUE(status.peer_over_quota);
+
+  // Losing the connection forgets the congestion along with the ports.
+  EXPECT_EQ(OK, node0.LostConnectionToNode(node1_name));
+  EXPECT_EQ(OK, node0.GetStatus(x0, &status));
+  EXPECT_FALSE(status.peer_over_quota);
+  EXPECT_TRUE(status.peer_closed);
+  EXPECT_EQ(OK, node0.GetStatus(b2, &status));
+  EXPECT_FALSE(status.peer_over_quota);
+
+  EXPECT_EQ(OK, node0.ClosePort(b2));
+  EXPECT_EQ(OK, node1.ClosePort(b0));
+  EXPECT_EQ(OK, node0.ClosePort(a0));
+  EXPECT_EQ(OK, node0.ClosePort(a1));
+  EXPECT_EQ(OK, node0.ClosePort(x0));
+  EXPECT_EQ(OK, node1.ClosePort(x1));
+  PumpTasks();
+}
+
 TEST_F(PortsTest, Delegation1) {
   NodeName node0_name(0, 1);
   TestNodeDelegate node0_delegate(node0_name);
@@ -556,7 +951,7 @@ TEST_F(PortsTest, Delegation1) {
   EXPECT_EQ(OK, node1.ClosePort(x1));
 }
 
-TEST_F(PortsTest, Delegation2) {
+TEST_F(PortsTest, ProxyForwardsMessageInPlace) {
   NodeName node0_name(0, 1);
   TestNodeDelegate node0_delegate(node0_name);
   Node node0(node0_name, &node0_delegate);
@@ -565,18 +960,117 @@ TEST_F(PortsTest, Delegation2) {
   NodeName node1_name(1, 1);
   TestNodeDelegate node1_delegate(node1_name);
   Node node1(node1_name, &node1_delegate);
-  node_map[1] = &node1;
+  SetNode(node1_name, &node1);
 
-  node0_delegate.set_save_messages(true);
-  node1_delegate.set_save_messages(true);
+  node0_delegate.set_read_messages(false);
+  node1_delegate.set_read_messages(false);
 
-  for (int i = 0; i < 10; ++i) {
-    // Setup pipe a<->b between node0 and node1.
-    PortRef A, B;
-    EXPECT_EQ(OK, node0.CreateUninitializedPort(&A));
-    EXPECT_EQ(OK, node1.CreateUninitializedPort(&B));
-    EXPECT_EQ(OK, node0.InitializePort(A, node1_name, B.name()));
-    EXPECT_EQ(OK, node1.InitializePort(B, node0_name, A.name()));
+  PortRef x0, x1;
+  EXPECT_EQ(OK, node0.CreateUninitializedPort(&x0));
+  EXPECT_EQ(OK, node1.CreateUninitializedPort(&x1));
+  EXPECT_EQ(OK, node0.InitializePort(x0, node1_name, x1.name()));
+  EXPECT_EQ(OK, node1.InitializePort(x1, node0_name, x0.name()));
+
+  // Move a1 to node1, and send to it before node0 learns that it has been
+  // accepted, so that the message is relayed by the proxy left behind.
+  PortRef a0, a1;
+  EXPECT_EQ(OK, node0.CreatePortPair(&a0, &a1));
+  EXPECT_EQ(OK, node0.SendMessage(x0, NewStringMessageWithPort("a1", a1)));
+  ScopedMessage message = NewStringMessage("hello");
+  const Message* sent_message = message.get();
+  EXPECT_EQ(OK, node0.SendMessage(a0, std::move(message)));
+  PumpTasks();
+
+  ASSERT_EQ(OK, node1.GetMessage(x1, &message));
+  ASSERT_TRUE(message);
+  ASSERT_EQ(1u, message->num_ports());
+  PortRef a2;
+  EXPECT_EQ(OK, node1.GetPort(message->ports()[0], &a2));
+
+  // The relayed message is the one which was sent.
+  ASSERT_EQ(OK, node1.GetMessage(a2, &message));
+  ASSERT_TRUE(message);
+  EXPECT_EQ(sent_message, message.get());
+  EXPECT_EQ(0, strcmp("hello", ToString(message)));
+
+  EXPECT_EQ(OK, node0.ClosePort(a0));
+  EXPECT_EQ(OK, node1.ClosePort(a2));
+  EXPECT_EQ(OK, node0.ClosePort(x0));
+  EXPECT_EQ(OK, node1.ClosePort(x1));
+  PumpTasks();
+}
+
+TEST_F(PortsTest, LocalProxyRemoval) {
+  NodeName node0_name(0, 1);
+  TestNodeDelegate node0_delegate(node0_name);
+  Node node0(node0_name, &node0_delegate);
+  SetNode(node0_name, &node0);
+
+  NodeName node1_name(1, 1);
+  TestNodeDelegate node1_delegate(node1_name);
+  Node node1(node1_name, &node1_delegate);
+  node_map[1] = &node1;
+
+  node1_delegate.set_save_messages(true);
+
+  PortRef x0, x1;
+  EXPECT_EQ(OK, node0.CreateUninitializedPort(&x0));
+  EXPECT_EQ(OK, node1.CreateUninitializedPort(&x1));
+  EXPECT_EQ(OK, node0.InitializePort(x0, node1_name, x1.name()));
+  EXPECT_EQ(OK, node1.InitializePort(x1, node0_name, x0.name()));
+
+  PortRef a0, a1;
+  EXPECT_EQ(OK, node0.CreatePortPair(&a0, &a1));
+  EXPECT_EQ(OK, node0.SendMessage(x0, NewStringMessageWithPort("a1", a1)));
+
+  // a1's peer is on node0 too, so node0 can remove the proxy left behind by
+  // a1 without sending ObserveProxy anywhere.
+  node0_delegate.set_drop_messages(true);
+  PumpTasks();
+  PortRef proxy;
+  EXPECT_EQ(ERROR_PORT_UNKNOWN, node0.GetPort(a1.name(), &proxy));
+  node0_delegate.set_drop_messages(false);
+
+  ScopedMessage message;
+  ASSERT_TRUE(node1_delegate.GetSavedMessage(&message));
+  ASSERT_EQ(1u, message->num_ports());
+  PortRef a2;
+  EXPECT_EQ(OK, node1.GetPort(message->ports()[0], &a2));
+
+  // a0 now sends straight to a2.
+  EXPECT_EQ(OK, node0.SendMessage(a0, NewStringMessage("hello")));
+  PumpTasks();
+  ASSERT_TRUE(node1_delegate.GetSavedMessage(&message));
+  EXPECT_EQ(0, strcmp("hello", ToString(message)));
+
+  EXPECT_EQ(OK, node0.ClosePort(a0));
+  EXPECT_EQ(OK, node1.ClosePort(a2));
+  EXPECT_EQ(OK, node0.ClosePort(x0));
+  EXPECT_EQ(OK, node1.ClosePort(x1));
+  PumpTasks();
+}
+
+TEST_F(PortsTest, Delegation2) {
+  NodeName node0_name(0, 1);
+  TestNodeDelegate node0_delegate(node0_name);
+  Node node0(node0_name, &node0_delegate);
+  SetNode(node0_name, &node0);
+
+  NodeName node1_name(1, 1);
+  TestNodeDelegate node1_delegate(node1_name);
+  Node node1(node1_name, &node1_delegate);
+  node_map[1] = &node1;
+
+  node0_delegate.set_save_messages(true);
+  node1_delegate.set_save_messages(true);
+
+  for (int i = 0; i < 10; ++i) {
+    // Setup pipe a<->b between node0 and node1.
+    PortRef A, B;
+    EXPECT_EQ(OK, node0.CreateUninitializedPort(&A));
+    EXPECT_EQ(OK, node1.CreateUninitializedPort(&B));
+    EXPECT_EQ(OK, node0.InitializePort(A, node1_name, B.name()));
+    EXPECT_EQ(OK, node1.InitializePort(B, node0_name, A.name()));
 
     PortRef C, D;
     EXPECT_EQ(OK, node0.CreatePortPair(&C, &D));
@@ -721,6 +1215,117 @@ TEST_F(PortsTest, SendUninitialized2) {
   EXPECT_EQ(0, strcmp("bye", ToString(message)));
 }
 
+TEST_F(PortsTest, ReplaceUnusedPort) {
+  NodeName node0_name(0, 1);
+  TestNodeDelegate node0_delegate(node0_name);
+  Node node0(node0_name, &node0_delegate);
+  node_map[0] = &node0;
+
+  NodeName node1_name(1, 1);
+  TestNodeDelegate node1_delegate(node1_name);
+  Node node1(node1_name, &node1_delegate);
+  node_map[1] = &node1;
+
+  node0_delegate.set_save_messages(true);
+  node1_delegate.set_save_messages(true);
+
+  // Connect x0 and x1 ahead of time, with node0 choosing both names.
+  PortRef x0, x1;
+  PortName x1_name;
+  node0_delegate.GenerateRandomPortName(&x1_name);
+  EXPECT_EQ(OK, node0.CreateUninitializedPort(&x0));
+  EXPECT_EQ(OK, node1.CreateUninitializedPortWithName(x1_name, &x1));
+  EXPECT_EQ(OK, node0.InitializePort(x0, node1_name, x1_name));
+  EXPECT_EQ(OK, node1.InitializePort(x1, node0_name, x0.name()));
+
+  // A message from x1 may reach x0 before x0 is replaced. It must stay unread
+  // at x0 until then.
+  node0_delegate.set_read_messages(false);
+  EXPECT_EQ(OK, node1.SendMessage(x1, NewStringMessage("early")));
+  PumpTasks();
+  node0_delegate.set_read_messages(true);
+
+  // So may messages sent on the new port before it is initialized.
+  PortRef a;
+  EXPECT_EQ(OK, node0.CreateUninitializedPort(&a));
+  EXPECT_EQ(OK, node0.SendMessage(a, NewStringMessage("waiting")));
+
+  EXPECT_EQ(OK, node0.ReplaceUnusedPort(x0, a));
+  EXPECT_EQ(ERROR_PORT_STATE_UNEXPECTED, node0.ReplaceUnusedPort(x0, a));
+
+  EXPECT_EQ(OK, node1.SendMessage(x1, NewStringMessage("late")));
+  PumpTasks();
+
+  ScopedMessage message;
+  ASSERT_TRUE(node0_delegate.GetSavedMessage(&message));
+  EXPECT_EQ(0, strcmp("early", ToString(message)));
+  ASSERT_TRUE(node0_delegate.GetSavedMessage(&message));
+  EXPECT_EQ(0, strcmp("late", ToString(message)));
+  ASSERT_TRUE(node1_delegate.GetSavedMessage(&message));
+  EXPECT_EQ(0, strcmp("waiting", ToString(message)));
+
+  // x0 is gone, and x1 now sends to a directly.
+  NodeStats stats;
+  node0.GetStats(&stats);
+  EXPECT_EQ(1u, stats.num_ports);
+  EXPECT_EQ(0u, stats.num_proxies);
+
+  EXPECT_EQ(OK, node0.ClosePort(a));
+  PumpTasks();
+
+  PortStatus status;
+  EXPECT_EQ(OK, node1.GetStatus(x1, &status));
+  EXPECT_TRUE(status.peer_closed);
+  EXPECT_EQ(OK, node1.ClosePort(x1));
+}
+
+TEST_F(PortsTest, ReplaceUnusedPortAfterPeerClosed) {
+  NodeName node0_name(0, 1);
+  TestNodeDelegate node0_delegate(node0_name);
+  Node node0(node0_name, &node0_delegate);
+  node_map[0] = &node0;
+
+  NodeName node1_name(1, 1);
+  TestNodeDelegate node1_delegate(node1_name);
+  Node node1(node1_name, &node1_delegate);
+  node_map[1] = &node1;
+
+  node0_delegate.set_save_messages(true);
+
+  PortRef x0, x1;
+  EXPECT_EQ(OK, node0.CreateUninitializedPort(&x0));
+  EXPECT_EQ(OK, node1.CreateUninitializedPort(&x1));
+  EXPECT_EQ(OK, node0.InitializePort(x0, node1_name, x1.name()));
+  EXPECT_EQ(OK, node1.InitializePort(x1, node0_name, x0.name()));
+
+  // x1 sends a message and closes before x0 is replaced.
+  node0_delegate.set_read_messages(false);
+  EXPECT_EQ(OK, node1.SendMessage(x1, NewStringMessage("goodbye")));
+  EXPECT_EQ(OK, node1.ClosePort(x1));
+  PumpTasks();
+  node0_delegate.set_read_messages(true);
+
+  PortRef a;
+  EXPECT_EQ(OK, node0.CreateUninitializedPort(&a));
+  EXPECT_EQ(OK, node0.ReplaceUnusedPort(x0, a));
+  PumpTasks();
+
+  ScopedMessage message;
+  ASSERT_TRUE(node0_delegate.GetSavedMessage(&message));
+  EXPECT_EQ(0, strcmp("goodbye", ToString(message)));
+
+  PortStatus status;
+  EXPECT_EQ(OK, node0.GetStatus(a, &status));
+  EXPECT_TRUE(status.peer_closed);
+
+  NodeStats stats;
+  node0.GetStats(&stats);
+  EXPECT_EQ(1u, stats.num_ports);
+
+  EXPECT_EQ(OK, node0.ClosePort(a));
+  PumpTasks();
+}
+
 TEST_F(PortsTest, SendFailure) {
   NodeName node0_name(0, 1);
   TestNodeDelegate node0_delegate(node0_name);
@@ -762,6 +1367,858 @@ TEST_F(PortsTest, SendFailure) {
   EXPECT_EQ(0, strcmp("hey", ToString(message)));
 }
 
+TEST_F(PortsTest, AcceptMessagesBatch) {
+  NodeName node0_name(0, 1);
+  TestNodeDelegate node0_delegate(node0_name);
+  Node node0(node0_name, &node0_delegate);
+  SetNode(node0_name, &node0);
+
+  NodeName node1_name(1, 1);
+  TestNodeDelegate node1_delegate(node1_name);
+  Node node1(node1_name, &node1_delegate);
+  SetNode(node1_name, &node1);
+
+  node1_delegate.set_save_messages(true);
+
+  // Setup pipe between node0 and node1.
+  PortRef x0, x1;
+  EXPECT_EQ(OK, node0.CreateUninitializedPort(&x0));
+  EXPECT_EQ(OK, node1.CreateUninitializedPort(&x1));
+  EXPECT_EQ(OK, node0.InitializePort(x0, node1_name, x1.name()));
+  EXPECT_EQ(OK, node1.InitializePort(x1, node0_name, x0.name()));
+
+  // Queue up plain messages with a port-carrying message in the middle, which
+  // can't be grouped with the others. The task queue delivers them to node1 in
+  // random order.
+  PortRef a0, a1;
+  EXPECT_EQ(OK, node0.CreatePortPair(&a0, &a1));
+  EXPECT_EQ(OK, node0.SendMessage(x0, NewStringMessage("1")));
+  EXPECT_EQ(OK, node0.SendMessage(x0, NewStringMessage("2")));
+  EXPECT_EQ(OK, node0.SendMessage(x0, NewStringMessageWithPort("3", a1)));
+  EXPECT_EQ(OK, node0.SendMessage(x0, NewStringMessage("4")));
+  EXPECT_EQ(OK, node0.SendMessage(x0, NewStringMessage("5")));
+
+  PumpTasksBatched();
+
+  const char* kExpected[] = {"1", "2", "3", "4", "5"};
+  for (const char* expected : kExpected) {
+    ScopedMessage message;
+    ASSERT_TRUE(node1_delegate.GetSavedMessage(&message));
+    EXPECT_EQ(0, strcmp(expected, ToString(message)));
+    if (message->num_ports()) {
+      PortRef received_port;
+      EXPECT_EQ(OK, node1.GetPort(message->ports()[0], &received_port));
+      EXPECT_EQ(OK, node1.ClosePort(received_port));
+    }
+  }
+
+  ScopedMessage message;
+  EXPECT_FALSE(node1_delegate.GetSavedMessage(&message));
+
+  EXPECT_EQ(OK, node0.ClosePort(a0));
+  EXPECT_EQ(OK, node0.ClosePort(x0));
+  EXPECT_EQ(OK, node1.ClosePort(x1));
+
+  PumpTasksBatched();
+}
+
+TEST_F(PortsTest, CoalescedStatusChanges) {
+  NodeName node0_name(0, 1);
+  TestNodeDelegate node0_delegate(node0_name);
+  Node node0(node0_name, &node0_delegate);
+  SetNode(node0_name, &node0);
+
+  NodeName node1_name(1, 1);
+  TestNodeDelegate node1_delegate(node1_name);
+  Node node1(node1_name, &node1_delegate);
+  SetNode(node1_name, &node1);
+
+  // Setup pipe between node0 and node1.
+  PortRef x0, x1;
+  EXPECT_EQ(OK, node0.CreateUninitializedPort(&x0));
+  EXPECT_EQ(OK, node1.CreateUninitializedPort(&x1));
+  EXPECT_EQ(OK, node0.InitializePort(x0, node1_name, x1.name()));
+  EXPECT_EQ(OK, node1.InitializePort(x1, node0_name, x0.name()));
+
+  // x1's notifications now go to the observer rather than node1_delegate, so
+  // its messages stay queued until read below.
+  std::shared_ptr<CountingPortObserver> observer =
+      std::make_shared<CountingPortObserver>();
+  EXPECT_EQ(OK, node1.SetPortObserver(x1, observer));
+
+  // A batch of messages for the same port yields a single notification, even
+  // when a port-carrying message splits it up.
+  PortRef a0, a1;
+  EXPECT_EQ(OK, node0.CreatePortPair(&a0, &a1));
+  EXPECT_EQ(OK, node0.SendMessage(x0, NewStringMessage("1")));
+  EXPECT_EQ(OK, node0.SendMessage(x0, NewStringMessageWithPort("2", a1)));
+  EXPECT_EQ(OK, node0.SendMessage(x0, NewStringMessage("3")));
+
+  PumpTasksBatched();
+  EXPECT_EQ(1u, observer->num_status_changes());
+
+  const char* kExpected[] = {"1", "2", "3"};
+  for (const char* expected : kExpected) {
+    ScopedMessage message;
+    ASSERT_EQ(OK, node1.GetMessage(x1, &message));
+    ASSERT_TRUE(message);
+    EXPECT_EQ(0, strcmp(expected, ToString(message)));
+    if (message->num_ports()) {
+      PortRef received_port;
+      EXPECT_EQ(OK, node1.GetPort(message->ports()[0], &received_port));
+      EXPECT_EQ(OK, node1.ClosePort(received_port));
+    }
+  }
+
+  // Messages accepted one at a time are still notified individually. Each is
+  // pumped on its own, as PumpTasks() may otherwise deliver "5" before "4".
+  EXPECT_EQ(OK, node0.SendMessage(x0, NewStringMessage("4")));
+  PumpTasks();
+  EXPECT_EQ(OK, node0.SendMessage(x0, NewStringMessage("5")));
+  PumpTasks();
+  EXPECT_EQ(3u, observer->num_status_changes());
+
+  EXPECT_EQ(OK, node0.ClosePort(a0));
+  EXPECT_EQ(OK, node0.ClosePort(x0));
+  EXPECT_EQ(OK, node1.ClosePort(x1));
+
+  PumpTasks();
+}
+
+TEST_F(PortsTest, SendMessagesBatch) {
+  NodeName node0_name(0, 1);
+  TestNodeDelegate node0_delegate(node0_name);
+  Node node0(node0_name, &node0_delegate);
+  SetNode(node0_name, &node0);
+
+  NodeName node1_name(1, 1);
+  TestNodeDelegate node1_delegate(node1_name);
+  Node node1(node1_name, &node1_delegate);
+  SetNode(node1_name, &node1);
+
+  node0_delegate.set_read_messages(false);
+  node1_delegate.set_read_messages(false);
+
+  // A local pair and a pair spanning both nodes.
+  PortRef a0, a1;
+  EXPECT_EQ(OK, node0.CreatePortPair(&a0, &a1));
+
+  PortRef x0, x1;
+  EXPECT_EQ(OK, node0.CreateUninitializedPort(&x0));
+  EXPECT_EQ(OK, node1.CreateUninitializedPort(&x1));
+  EXPECT_EQ(OK, node0.InitializePort(x0, node1_name, x1.name()));
+  EXPECT_EQ(OK, node1.InitializePort(x1, node0_name, x0.name()));
+
+  const char* kStrings[] = {"1", "2", "3", "4"};
+
+  std::vector<ScopedMessage> messages;
+  for (const char* string : kStrings)
+    messages.push_back(NewStringMessage(string));
+  EXPECT_EQ(OK, node0.SendMessages(a1, std::move(messages)));
+
+  messages.clear();
+  for (const char* string : kStrings)
+    messages.push_back(NewStringMessage(string));
+  EXPECT_EQ(OK, node0.SendMessages(x0, std::move(messages)));
+
+  PumpTasksBatched();
+
+  for (const char* expected : kStrings) {
+    ScopedMessage message;
+    EXPECT_EQ(OK, node0.GetMessage(a0, &message));
+    ASSERT_TRUE(message);
+    EXPECT_EQ(0, strcmp(expected, ToString(message)));
+
+    EXPECT_EQ(OK, node1.GetMessage(x1, &message));
+    ASSERT_TRUE(message);
+    EXPECT_EQ(0, strcmp(expected, ToString(message)));
+  }
+
+  // A batch carrying the sending port is rejected outright.
+  messages.clear();
+  messages.push_back(NewStringMessage("ok"));
+  messages.push_back(NewStringMessageWithPort("oops", a1));
+  EXPECT_EQ(ERROR_PORT_CANNOT_SEND_SELF,
+            node0.SendMessages(a1, std::move(messages)));
+
+  ScopedMessage message;
+  EXPECT_EQ(OK, node0.GetMessage(a0, &message));
+  EXPECT_FALSE(message);
+
+  EXPECT_EQ(OK, node0.ClosePort(a0));
+  EXPECT_EQ(OK, node0.ClosePort(a1));
+  EXPECT_EQ(OK, node0.ClosePort(x0));
+  EXPECT_EQ(OK, node1.ClosePort(x1));
+
+  PumpTasksBatched();
+}
+
+TEST_F(PortsTest, NodeStats) {
+  NodeName node0_name(0, 1);
+  TestNodeDelegate node0_delegate(node0_name);
+  Node node0(node0_name, &node0_delegate);
+  SetNode(node0_name, &node0);
+
+  NodeName node1_name(1, 1);
+  TestNodeDelegate node1_delegate(node1_name);
+  Node node1(node1_name, &node1_delegate);
+  SetNode(node1_name, &node1);
+
+  node0_delegate.set_read_messages(false);
+  node1_delegate.set_read_messages(false);
+
+  PortRef a0, a1;
+  EXPECT_EQ(OK, node0.CreatePortPair(&a0, &a1));
+  EXPECT_EQ(OK, node0.SendMessage(a0, NewStringMessage("1")));
+  EXPECT_EQ(OK, node0.SendMessage(a0, NewStringMessage("2")));
+  EXPECT_EQ(OK, node0.SendMessage(a1, NewStringMessage("3")));
+  PumpTasks();
+
+  NodeStats stats;
+  node0.GetStats(&stats);
+  EXPECT_EQ(2u, stats.num_ports);
+  EXPECT_EQ(2u, stats.num_receiving_ports);
+  EXPECT_EQ(0u, stats.num_proxies);
+  EXPECT_EQ(3u, stats.num_queued_messages);
+  EXPECT_GT(stats.num_queued_bytes, 0u);
+  EXPECT_EQ(2u, stats.max_queued_messages);
+
+  // Sending a1 to node1 leaves a proxy behind on node0 until the pipe has
+  // caught up with the move.
+  PortRef x0, x1;
+  EXPECT_EQ(OK, node0.CreateUninitializedPort(&x0));
+  EXPECT_EQ(OK, node1.CreateUninitializedPort(&x1));
+  EXPECT_EQ(OK, node0.InitializePort(x0, node1_name, x1.name()));
+  EXPECT_EQ(OK, node1.InitializePort(x1, node0_name, x0.name()));
+  EXPECT_EQ(OK, node0.SendMessage(x0, NewStringMessageWithPort("a1", a1)));
+
+  node0.GetStats(&stats);
+  EXPECT_EQ(1u, stats.num_proxies + stats.num_buffering_ports);
+
+  PumpTasks();
+  node0.GetStats(&stats);
+  EXPECT_EQ(0u, stats.num_proxies);
+  EXPECT_EQ(0u, stats.num_buffering_ports);
+  EXPECT_EQ(2u, stats.num_ports);
+
+  // a1's unread messages were forwarded along with it.
+  node1.GetStats(&stats);
+  EXPECT_EQ(2u, stats.num_ports);
+  EXPECT_EQ(3u, stats.num_queued_messages);
+
+  ScopedMessage message;
+  ASSERT_EQ(OK, node1.GetMessage(x1, &message));
+  ASSERT_TRUE(message);
+  PortRef moved_a1;
+  EXPECT_EQ(OK, node1.GetPort(message->ports()[0], &moved_a1));
+
+  EXPECT_EQ(OK, node0.ClosePort(a0));
+  EXPECT_EQ(OK, node1.ClosePort(moved_a1));
+  EXPECT_EQ(OK, node0.ClosePort(x0));
+  EXPECT_EQ(OK, node1.ClosePort(x1));
+
+  PumpTasks();
+}
+
+TEST_F(PortsTest, DestinationPortHint) {
+  NodeName node0_name(0, 1);
+  TestNodeDelegate node0_delegate(node0_name);
+  Node node0(node0_name, &node0_delegate);
+  SetNode(node0_name, &node0);
+
+  NodeName node1_name(1, 1);
+  TestNodeDelegate node1_delegate(node1_name);
+  Node node1(node1_name, &node1_delegate);
+  SetNode(node1_name, &node1);
+
+  node1_delegate.set_read_messages(false);
+
+  PortRef x0, x1, y1, z1;
+  EXPECT_EQ(OK, node0.CreateUninitializedPort(&x0));
+  EXPECT_EQ(OK, node1.CreateUninitializedPort(&x1));
+  EXPECT_EQ(OK, node0.InitializePort(x0, node1_name, x1.name()));
+  EXPECT_EQ(OK, node1.InitializePort(x1, node0_name, x0.name()));
+  EXPECT_EQ(OK, node1.CreatePortPair(&y1, &z1));
+
+  // A message carrying its destination port as a hint is delivered to it,
+  // and one whose hint names some other port is delivered as addressed.
+  EXPECT_EQ(OK, node0.SendMessage(x0, NewStringMessage("hinted")));
+  EXPECT_EQ(OK, node0.SendMessage(x0, NewStringMessage("misdirected")));
+  ASSERT_EQ(2u, task_queue.size());
+  std::vector<Task*> tasks;
+  while (!task_queue.empty()) {
+    tasks.push_back(task_queue.top());
+    task_queue.pop();
+  }
+  for (Task* task : tasks) {
+    bool hinted = strcmp("hinted", ToString(task->message)) == 0;
+    task->message->set_destination_port(hinted ? x1 : y1);
+    task_queue.push(task);
+  }
+  PumpTasksBatched();
+
+  ScopedMessage message;
+  ASSERT_EQ(OK, node1.GetMessage(x1, &message));
+  ASSERT_TRUE(message);
+  EXPECT_EQ(0, strcmp("hinted", ToString(message)));
+  ASSERT_EQ(OK, node1.GetMessage(x1, &message));
+  ASSERT_TRUE(message);
+  EXPECT_EQ(0, strcmp("misdirected", ToString(message)));
+  EXPECT_EQ(OK, node1.GetMessage(y1, &message));
+  EXPECT_FALSE(message);
+
+  // A hint for a port which has since been closed doesn't revive it.
+  EXPECT_EQ(OK, node0.SendMessage(x0, NewStringMessage("late")));
+  ASSERT_EQ(1u, task_queue.size());
+  task_queue.top()->message->set_destination_port(x1);
+  EXPECT_EQ(OK, node1.ClosePort(x1));
+  PumpTasks();
+
+  NodeStats stats;
+  node1.GetStats(&stats);
+  EXPECT_EQ(0u, stats.num_queued_messages);
+
+  EXPECT_EQ(OK, node0.ClosePort(x0));
+  EXPECT_EQ(OK, node1.ClosePort(y1));
+  EXPECT_EQ(OK, node1.ClosePort(z1));
+  PumpTasks();
+}
+
+TEST_F(PortsTest, BroadcastMessage) {
+  NodeName node0_name(0, 1);
+  TestNodeDelegate node0_delegate(node0_name);
+  Node node0(node0_name, &node0_delegate);
+  SetNode(node0_name, &node0);
+
+  NodeName node1_name(1, 1);
+  TestNodeDelegate node1_delegate(node1_name);
+  Node node1(node1_name, &node1_delegate);
+  SetNode(node1_name, &node1);
+
+  node0_delegate.set_read_messages(false);
+  node1_delegate.set_read_messages(false);
+
+  // Two ports with peers on node1, and one with a peer on node0.
+  PortRef x0, x1, y0, y1, a0, a1;
+  EXPECT_EQ(OK, node0.CreateUninitializedPort(&x0));
+  EXPECT_EQ(OK, node1.CreateUninitializedPort(&x1));
+  EXPECT_EQ(OK, node0.InitializePort(x0, node1_name, x1.name()));
+  EXPECT_EQ(OK, node1.InitializePort(x1, node0_name, x0.name()));
+  EXPECT_EQ(OK, node0.CreateUninitializedPort(&y0));
+  EXPECT_EQ(OK, node1.CreateUninitializedPort(&y1));
+  EXPECT_EQ(OK, node0.InitializePort(y0, node1_name, y1.name()));
+  EXPECT_EQ(OK, node1.InitializePort(y1, node0_name, y0.name()));
+  EXPECT_EQ(OK, node0.CreatePortPair(&a0, &a1));
+
+  EXPECT_EQ(OK, node0.SendMessage(x0, NewStringMessage("first")));
+  EXPECT_EQ(OK, node0.BroadcastMessage({x0, y0, a0},
+                                       NewStringMessage("everyone")));
+
+  // node1 is sent the broadcast once, after x0's first message.
+  ASSERT_EQ(2u, task_queue.size());
+  size_t num_broadcasts = 0;
+  std::vector<Task*> tasks;
+  while (!task_queue.empty()) {
+    Task* task = task_queue.top();
+    task_queue.pop();
+    if (GetEventHeader(*task->message)->type == EventType::kUserBroadcast)
+      ++num_broadcasts;
+    tasks.push_back(task);
+  }
+  EXPECT_EQ(1u, num_broadcasts);
+  for (Task* task : tasks)
+    task_queue.push(task);
+  PumpTasks();
+
+  ScopedMessage message;
+  ASSERT_EQ(OK, node1.GetMessage(x1, &message));
+  ASSERT_TRUE(message);
+  EXPECT_EQ(0, strcmp("first", ToString(message)));
+  ASSERT_EQ(OK, node1.GetMessage(x1, &message));
+  ASSERT_TRUE(message);
+  EXPECT_EQ(0, strcmp("everyone", ToString(message)));
+  ASSERT_EQ(OK, node1.GetMessage(y1, &message));
+  ASSERT_TRUE(message);
+  EXPECT_EQ(0, strcmp("everyone", ToString(message)));
+  ASSERT_EQ(OK, node0.GetMessage(a1, &message));
+  ASSERT_TRUE(message);
+  EXPECT_EQ(0, strcmp("everyone", ToString(message)));
+
+  // Ports which can't send are skipped.
+  EXPECT_EQ(OK, node0.ClosePort(a1));
+  PumpTasks();
+  EXPECT_EQ(ERROR_PORT_PEER_CLOSED,
+            node0.BroadcastMessage({a0, x0}, NewStringMessage("again")));
+  PumpTasks();
+  ASSERT_EQ(OK, node1.GetMessage(x1, &message));
+  ASSERT_TRUE(message);
+  EXPECT_EQ(0, strcmp("again", ToString(message)));
+
+  EXPECT_EQ(OK, node0.ClosePort(a0));
+  EXPECT_EQ(OK, node0.ClosePort(x0));
+  EXPECT_EQ(OK, node0.ClosePort(y0));
+  EXPECT_EQ(OK, node1.ClosePort(x1));
+  EXPECT_EQ(OK, node1.ClosePort(y1));
+  PumpTasks();
+}
+
+TEST_F(PortsTest, ClosePorts) {
+  NodeName node0_name(0, 1);
+  TestNodeDelegate node0_delegate(node0_name);
+  Node node0(node0_name, &node0_delegate);
+  SetNode(node0_name, &node0);
+
+  NodeName node1_name(1, 1);
+  TestNodeDelegate node1_delegate(node1_name);
+  Node node1(node1_name, &node1_delegate);
+  SetNode(node1_name, &node1);
+
+  node0_delegate.set_read_messages(false);
+  node1_delegate.set_read_messages(false);
+
+  // Two ports with peers on node1, and one with a peer on node0.
+  PortRef x0, x1, y0, y1, a0, a1;
+  EXPECT_EQ(OK, node0.CreateUninitializedPort(&x0));
+  EXPECT_EQ(OK, node1.CreateUninitializedPort(&x1));
+  EXPECT_EQ(OK, node0.InitializePort(x0, node1_name, x1.name()));
+  EXPECT_EQ(OK, node1.InitializePort(x1, node0_name, x0.name()));
+  EXPECT_EQ(OK, node0.CreateUninitializedPort(&y0));
+  EXPECT_EQ(OK, node1.CreateUninitializedPort(&y1));
+  EXPECT_EQ(OK, node0.InitializePort(y0, node1_name, y1.name()));
+  EXPECT_EQ(OK, node1.InitializePort(y1, node0_name, y0.name()));
+  EXPECT_EQ(OK, node0.CreatePortPair(&a0, &a1));
+
+  EXPECT_EQ(OK, node0.SendMessage(x0, NewStringMessage("last")));
+  PumpTasks();
+
+  // node1 is told of both closures at once. Ports which can't be closed are
+  // skipped.
+  EXPECT_EQ(OK, node0.ClosePort(a1));
+  PumpTasks();
+  EXPECT_EQ(ERROR_PORT_STATE_UNEXPECTED, node0.ClosePorts({a1, x0, y0, a0}));
+  ASSERT_EQ(2u, task_queue.size());
+  size_t num_multi_closures = 0;
+  std::vector<Task*> tasks;
+  while (!task_queue.empty()) {
+    Task* task = task_queue.top();
+    task_queue.pop();
+    if (GetEventHeader(*task->message)->type == EventType::kObserveClosures) {
+      EXPECT_EQ(node1_name, task->node_name);
+      ++num_multi_closures;
+    }
+    tasks.push_back(task);
+  }
+  EXPECT_EQ(1u, num_multi_closures);
+  for (Task* task : tasks)
+    task_queue.push(task);
+  PumpTasks();
+
+  PortStatus status;
+  EXPECT_EQ(OK, node1.GetStatus(x1, &status));
+  EXPECT_TRUE(status.peer_closed);
+  EXPECT_EQ(OK, node1.GetStatus(y1, &status));
+  EXPECT_TRUE(status.peer_closed);
+
+  // Messages sent before the closure may still be read.
+  ScopedMessage message;
+  ASSERT_EQ(OK, node1.GetMessage(x1, &message));
+  ASSERT_TRUE(message);
+  EXPECT_EQ(0, strcmp("last", ToString(message)));
+
+  EXPECT_EQ(OK, node1.ClosePort(x1));
+  EXPECT_EQ(OK, node1.ClosePort(y1));
+  PumpTasks();
+}
+
+TEST_F(PortsTest, SaveAndRestoreState) {
+  NodeName node0_name(0, 1);
+  TestNodeDelegate node0_delegate(node0_name);
+  std::unique_ptr<Node> node0(new Node(node0_name, &node0_delegate));
+  SetNode(node0_name, node0.get());
+
+  NodeName node1_name(1, 1);
+  TestNodeDelegate node1_delegate(node1_name);
+  Node node1(node1_name, &node1_delegate);
+  SetNode(node1_name, &node1);
+
+  node0_delegate.set_read_messages(false);
+  node1_delegate.set_read_messages(false);
+
+  PortRef x0, x1;
+  EXPECT_EQ(OK, node0->CreateUninitializedPort(&x0));
+  EXPECT_EQ(OK, node1.CreateUninitializedPort(&x1));
+  EXPECT_EQ(OK, node0->InitializePort(x0, node1_name, x1.name()));
+  EXPECT_EQ(OK, node1.InitializePort(x1, node0_name, x0.name()));
+
+  EXPECT_EQ(OK, node0->SendMessage(x0, NewStringMessage("1")));
+  EXPECT_EQ(OK, node1.SendMessage(x1, NewStringMessage("a")));
+  PumpTasks();
+
+  // Unread messages can't be saved.
+  std::vector<char> state;
+  EXPECT_EQ(ERROR_PORT_STATE_UNEXPECTED, node0->SaveState(&state));
+  EXPECT_TRUE(state.empty());
+
+  ScopedMessage message;
+  ASSERT_EQ(OK, node0->GetMessage(x0, &message));
+  ASSERT_TRUE(message);
+  EXPECT_EQ(0, strcmp("a", ToString(message)));
+  EXPECT_EQ(OK, node0->SaveState(&state));
+
+  // A new node of the same name takes over from the first.
+  PortName x0_name = x0.name();
+  x0 = PortRef();
+  node0.reset(new Node(node0_name, &node0_delegate));
+  SetNode(node0_name, node0.get());
+
+  std::vector<PortRef> receiving_ports;
+  EXPECT_EQ(ERROR_PORT_STATE_UNEXPECTED,
+            node0->RestoreState(state.data(), state.size() - 1,
+                                &receiving_ports));
+  EXPECT_EQ(OK, node0->RestoreState(state.data(), state.size(),
+                                    &receiving_ports));
+  ASSERT_EQ(1u, receiving_ports.size());
+  x0 = receiving_ports[0];
+  EXPECT_EQ(x0_name, x0.name());
+
+  // Sequence numbers carry on where they left off, so both directions keep
+  // delivering in order.
+  EXPECT_EQ(OK, node0->SendMessage(x0, NewStringMessage("2")));
+  EXPECT_EQ(OK, node1.SendMessage(x1, NewStringMessage("b")));
+  PumpTasks();
+
+  ASSERT_EQ(OK, node1.GetMessage(x1, &message));
+  ASSERT_TRUE(message);
+  EXPECT_EQ(0, strcmp("1", ToString(message)));
+  ASSERT_EQ(OK, node1.GetMessage(x1, &message));
+  ASSERT_TRUE(message);
+  EXPECT_EQ(0, strcmp("2", ToString(message)));
+  ASSERT_EQ(OK, node0->GetMessage(x0, &message));
+  ASSERT_TRUE(message);
+  EXPECT_EQ(0, strcmp("b", ToString(message)));
+
+  EXPECT_EQ(OK, node0->ClosePort(x0));
+  EXPECT_EQ(OK, node1.ClosePort(x1));
+  PumpTasks();
+}
+
+static ScopedMessage NewUserMessageWithSequenceNum(uint64_t sequence_num) {
+  ScopedMessage message(
+      new TestMessage(sizeof(EventHeader) + sizeof(UserEventData), 0, 0));
+  memset(message->mutable_header_bytes(), 0, message->num_header_bytes());
+  GetMutableEventHeader(message.get())->type = EventType::kUser;
+  GetMutableEventData<UserEventData>(message.get())->sequence_num =
+      sequence_num;
+  return message;
+}
+
+static uint64_t GetSequenceNum(const ScopedMessage& message) {
+  return GetEventData<UserEventData>(*message)->sequence_num;
+}
+
+TEST(MessageQueueTest, InOrder) {
+  MessageQueue queue;
+  EXPECT_FALSE(queue.HasNextMessage());
+
+  bool has_next_message = false;
+  for (uint64_t i = kInitialSequenceNum; i < kInitialSequenceNum + 5; ++i) {
+    queue.AcceptMessage(NewUserMessageWithSequenceNum(i), &has_next_message);
+    EXPECT_TRUE(has_next_message);
+  }
+
+  for (uint64_t i = kInitialSequenceNum; i < kInitialSequenceNum + 5; ++i) {
+    ScopedMessage message;
+    queue.GetNextMessageIf(nullptr, &message);
+    ASSERT_TRUE(message);
+    EXPECT_EQ(i, GetSequenceNum(message));
+  }
+
+  ScopedMessage message;
+  queue.GetNextMessageIf(nullptr, &message);
+  EXPECT_FALSE(message);
+  EXPECT_EQ(kInitialSequenceNum + 5, queue.next_sequence_num());
+}
+
+TEST(MessageQueueTest, OutOfOrder) {
+  MessageQueue queue;
+
+  const uint64_t kOrder[] = {3, 5, 2, 4};
+  bool has_next_message = true;
+  for (uint64_t sequence_num : kOrder) {
+    queue.AcceptMessage(NewUserMessageWithSequenceNum(sequence_num),
+                        &has_next_message);
+    EXPECT_FALSE(has_next_message);
+    EXPECT_FALSE(queue.HasNextMessage());
+  }
+  EXPECT_EQ(4u, queue.queued_message_count());
+
+  // Filling the gap releases everything queued behind it.
+  queue.AcceptMessage(NewUserMessageWithSequenceNum(1), &has_next_message);
+  EXPECT_TRUE(has_next_message);
+
+  for (uint64_t i = 1; i <= 5; ++i) {
+    ScopedMessage message;
+    queue.GetNextMessageIf(nullptr, &message);
+    ASSERT_TRUE(message);
+    EXPECT_EQ(i, GetSequenceNum(message));
+  }
+  EXPECT_FALSE(queue.HasNextMessage());
+  EXPECT_EQ(0u, queue.queued_message_count());
+  EXPECT_EQ(0u, queue.queued_num_bytes());
+}
+
+TEST(MessageQueueTest, Selector) {
+  MessageQueue queue;
+
+  bool has_next_message = false;
+  queue.AcceptMessage(NewUserMessageWithSequenceNum(1), &has_next_message);
+
+  ScopedMessage message;
+  queue.GetNextMessageIf([](const Message&) { return false; }, &message);
+  EXPECT_FALSE(message);
+  EXPECT_TRUE(queue.HasNextMessage());
+
+  queue.GetNextMessageIf([](const Message&) { return true; }, &message);
+  ASSERT_TRUE(message);
+  EXPECT_EQ(1u, GetSequenceNum(message));
+}
+
+TEST(MessageQueueTest, NotSignalable) {
+  MessageQueue queue;
+  queue.set_signalable(false);
+
+  bool has_next_message = true;
+  queue.AcceptMessage(NewUserMessageWithSequenceNum(1), &has_next_message);
+  EXPECT_FALSE(has_next_message);
+  EXPECT_TRUE(queue.HasNextMessage());
+}
+
+TEST(MessageQueueTest, LargeInitialSequenceNum) {
+  // Ports transferred late in a pipe's life start with large sequence
+  // numbers; the queue only cares about distance from the next expected one.
+  const uint64_t kStart = kInvalidSequenceNum - 10;
+  MessageQueue queue(kStart);
+
+  bool has_next_message = false;
+  queue.AcceptMessage(NewUserMessageWithSequenceNum(kStart + 1),
+                      &has_next_message);
+  EXPECT_FALSE(has_next_message);
+  queue.AcceptMessage(NewUserMessageWithSequenceNum(kStart),
+                      &has_next_message);
+  EXPECT_TRUE(has_next_message);
+
+  for (uint64_t i = kStart; i < kStart + 2; ++i) {
+    ScopedMessage message;
+    queue.GetNextMessageIf(nullptr, &message);
+    ASSERT_TRUE(message);
+    EXPECT_EQ(i, GetSequenceNum(message));
+  }
+}
+
+TEST(LocalMessageQueueTest, Delivery) {
+  LocalMessageQueue queue;
+
+  // The first push makes the caller the deliverer; later ones don't.
+  EXPECT_TRUE(queue.Push(NewUserMessageWithSequenceNum(0)));
+  EXPECT_FALSE(queue.Push(NewUserMessageWithSequenceNum(1)));
+
+  std::vector<ScopedMessage> messages;
+  queue.PopAll(&messages);
+  ASSERT_EQ(2u, messages.size());
+  EXPECT_EQ(0u, GetSequenceNum(messages[0]));
+  EXPECT_EQ(1u, GetSequenceNum(messages[1]));
+
+  // A message pushed before the deliverer stops must still be delivered by it.
+  EXPECT_FALSE(queue.Push(NewUserMessageWithSequenceNum(2)));
+  EXPECT_FALSE(queue.StopDelivering());
+  messages.clear();
+  queue.PopAll(&messages);
+  ASSERT_EQ(1u, messages.size());
+  EXPECT_EQ(2u, GetSequenceNum(messages[0]));
+
+  EXPECT_TRUE(queue.StopDelivering());
+  EXPECT_TRUE(queue.Push(NewUserMessageWithSequenceNum(3)));
+}
+
+TEST(LocalMessageQueueTest, PushAll) {
+  LocalMessageQueue queue;
+
+  EXPECT_TRUE(queue.Push(NewUserMessageWithSequenceNum(0)));
+
+  // A batch keeps its order and lands after what was already queued.
+  std::vector<ScopedMessage> batch;
+  for (uint64_t i = 1; i <= 3; ++i)
+    batch.push_back(NewUserMessageWithSequenceNum(i));
+  EXPECT_FALSE(queue.PushAll(std::move(batch)));
+
+  std::vector<ScopedMessage> messages;
+  queue.PopAll(&messages);
+  ASSERT_EQ(4u, messages.size());
+  for (uint64_t i = 0; i < 4; ++i)
+    EXPECT_EQ(i, GetSequenceNum(messages[i]));
+
+  EXPECT_TRUE(queue.StopDelivering());
+  batch.clear();
+  batch.push_back(NewUserMessageWithSequenceNum(4));
+  EXPECT_TRUE(queue.PushAll(std::move(batch)));
+}
+
+TEST(LocalMessageQueueTest, ConcurrentSenders) {
+  // Each sender delivers whenever it finds the queue idle. Every message must
+  // be delivered exactly once, by one thread at a time, and each sender's
+  // messages in the order it sent them.
+  const size_t kNumSenders = 4;
+  const uint64_t kNumMessagesPerSender = 10000;
+
+  LocalMessageQueue queue;
+  std::atomic<int> num_deliverers(0);
+  std::vector<uint64_t> next_sequence_num(kNumSenders, 0);
+  std::atomic<bool> failed(false);
+
+  auto deliver = [&]() {
+    if (num_deliverers.fetch_add(1) != 0)
+      failed = true;
+    std::vector<ScopedMessage> messages;
+    for (;;) {
+      messages.clear();
+      queue.PopAll(&messages);
+      for (const ScopedMessage& message : messages) {
+        uint64_t sequence_num = GetSequenceNum(message);
+        size_t sender =
+            static_cast<size_t>(sequence_num / kNumMessagesPerSender);
+        if (sequence_num % kNumMessagesPerSender != next_sequence_num[sender])
+          failed = true;
+        ++next_sequence_num[sender];
+      }
+      if (messages.empty()) {
+        num_deliverers.fetch_sub(1);
+        if (queue.StopDelivering())
+          return;
+        if (num_deliverers.fetch_add(1) != 0)
+          failed = true;
+      }
+    }
+  };
+
+  auto send = [&](size_t sender) {
+    for (uint64_t i = 0; i < kNumMessagesPerSender; ++i) {
+      if (queue.Push(NewUserMessageWithSequenceNum(
+              sender * kNumMessagesPerSender + i))) {
+        deliver();
+      }
+    }
+  };
+
+  std::vector<std::thread> senders;
+  for (size_t i = 0; i < kNumSenders; ++i)
+    senders.emplace_back(send, i);
+  for (auto& sender : senders)
+    sender.join();
+
+  EXPECT_FALSE(failed);
+  for (uint64_t sequence_num : next_sequence_num)
+    EXPECT_EQ(kNumMessagesPerSender, sequence_num);
+}
+
+TEST(NameMapTest, InsertFindErase) {
+  NameMap<PortName, int> map;
+  EXPECT_TRUE(map.empty());
+  EXPECT_TRUE(map.find(PortName(1, 0)) == map.end());
+
+  // Sequential names, as the test delegate generates, exercise colliding
+  // probe runs and growth.
+  const int kNumNames = 1000;
+  for (int i = 0; i < kNumNames; ++i)
+    EXPECT_TRUE(map.insert(std::make_pair(PortName(i + 1, 0), i)).second);
+  EXPECT_EQ(static_cast<size_t>(kNumNames), map.size());
+  EXPECT_FALSE(map.insert(std::make_pair(PortName(1, 0), -1)).second);
+  EXPECT_EQ(0, map.find(PortName(1, 0))->second);
+
+  // Erasing must keep every remaining entry reachable.
+  for (int i = 0; i < kNumNames; i += 2)
+    EXPECT_EQ(1u, map.erase(PortName(i + 1, 0)));
+  EXPECT_EQ(0u, map.erase(PortName(1, 0)));
+  map.erase(map.find(PortName(kNumNames, 0)));
+  EXPECT_EQ(static_cast<size_t>(kNumNames / 2 - 1), map.size());
+
+  for (int i = 0; i < kNumNames - 1; ++i) {
+    auto it = map.find(PortName(i + 1, 0));
+    if (i % 2 == 0) {
+      EXPECT_TRUE(it == map.end());
+    } else {
+      ASSERT_TRUE(it != map.end());
+      EXPECT_EQ(i, it->second);
+    }
+  }
+
+  size_t num_entries = 0;
+  for (const auto& entry : map) {
+    EXPECT_EQ(0u, entry.first.v1 % 2);
+    ++num_entries;
+  }
+  EXPECT_EQ(map.size(), num_entries);
+
+  map.clear();
+  EXPECT_TRUE(map.empty());
+  EXPECT_TRUE(map.begin() == map.end());
+}
+
+TEST(SlabTest, ReusesFreedBlocks) {
+  std::shared_ptr<Slab> slab = std::make_shared<Slab>();
+  std::vector<std::shared_ptr<uint64_t>> values;
+  for (uint64_t i = 0; i < 100; ++i) {
+    values.push_back(
+        std::allocate_shared<uint64_t>(SlabAllocator<uint64_t>(slab), i));
+  }
+  for (uint64_t i = 0; i < values.size(); ++i)
+    EXPECT_EQ(i, *values[i]);
+
+  // The most recently freed block is the next one handed out.
+  uint64_t* freed = values.back().get();
+  values.pop_back();
+  values.push_back(
+      std::allocate_shared<uint64_t>(SlabAllocator<uint64_t>(slab), 42));
+  EXPECT_EQ(freed, values.back().get());
+
+  // Other sizes come from the heap and go back to it.
+  void* other = slab->Allocate(1024);
+  slab->Free(other, 1024);
+
+  // The values keep the slab alive.
+  slab = nullptr;
+  EXPECT_EQ(42u, *values.back());
+}
+
+static size_t num_slab_chunks = 0;
+
+static void* AllocateSlabChunk(size_t num_bytes, size_t alignment) {
+  ++num_slab_chunks;
+  return ::operator new(num_bytes);
+}
+
+static void FreeSlabChunk(void* chunk) {
+  --num_slab_chunks;
+  ::operator delete(chunk);
+}
+
+TEST(SlabTest, UsesMemoryFunctions) {
+  const SlabMemoryFunctions kMemoryFunctions = {&AllocateSlabChunk,
+                                                &FreeSlabChunk};
+  std::shared_ptr<Slab> slab = std::make_shared<Slab>(kMemoryFunctions);
+  std::shared_ptr<uint64_t> value =
+      std::allocate_shared<uint64_t>(SlabAllocator<uint64_t>(slab), 1);
+  EXPECT_EQ(1u, num_slab_chunks);
+
+  // Other sizes still come from the heap.
+  void* other = slab->Allocate(1024);
+  EXPECT_EQ(1u, num_slab_chunks);
+  slab->Free(other, 1024);
+
+  slab = nullptr;
+  value = nullptr;
+  EXPECT_EQ(0u, num_slab_chunks);
+}
+
 }  // namespace test
 }  // namespace ports
 }  // namespace edk
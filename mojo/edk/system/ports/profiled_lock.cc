@@ -0,0 +1,221 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/ports/profiled_lock.h"
+
+#if defined(MOJO_EDK_LOCK_PROFILING)
+
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+
+#include "base/lazy_instance.h"
+#include "base/logging.h"
+#include "base/threading/thread_local_storage.h"
+
+#endif  // defined(MOJO_EDK_LOCK_PROFILING)
+
+namespace mojo {
+namespace edk {
+namespace ports {
+
+#if defined(MOJO_EDK_LOCK_PROFILING)
+
+namespace {
+
+const size_t kMaxLockSites = 64;
+
+enum Stat {
+  kAcquisitions,
+  kContendedAcquisitions,
+  kTotalWaitTime,
+  kMaxWaitTime,
+  kTotalHoldTime,
+  kMaxHoldTime,
+  kNumStats
+};
+
+bool IsMaxStat(size_t stat) {
+  return stat == kMaxWaitTime || stat == kMaxHoldTime;
+}
+
+// As in MetricsRegistry, each thread keeps its own values, which only it
+// writes, so that recording never bounces a cache line between threads. The
+// values are atomic only so that they may be read while being written.
+struct ThreadStats {
+  ThreadStats() {
+    for (auto& site : values) {
+      for (auto& value : site)
+        value.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  void Add(size_t site, Stat stat, uint64_t amount) {
+    std::atomic<uint64_t>& value = values[site][stat];
+    value.store(value.load(std::memory_order_relaxed) + amount,
+                std::memory_order_relaxed);
+  }
+
+  void Max(size_t site, Stat stat, uint64_t sample) {
+    std::atomic<uint64_t>& value = values[site][stat];
+    if (sample > value.load(std::memory_order_relaxed))
+      value.store(sample, std::memory_order_relaxed);
+  }
+
+  std::atomic<uint64_t> values[kMaxLockSites][kNumStats];
+};
+
+void DestroyThreadStats(void* stats);
+
+class Profiler {
+ public:
+  Profiler() : slot_(&DestroyThreadStats) {
+    memset(totals_, 0, sizeof(totals_));
+  }
+
+  size_t GetSiteIndex(const char* name) {
+    base::AutoLock lock(lock_);
+    auto it = std::find(names_.begin(), names_.end(), name);
+    if (it != names_.end())
+      return it - names_.begin();
+    CHECK_LT(names_.size(), kMaxLockSites) << "Too many lock sites.";
+    names_.push_back(name);
+    return names_.size() - 1;
+  }
+
+  ThreadStats* GetThreadStats() {
+    ThreadStats* stats = static_cast<ThreadStats*>(slot_.Get());
+    if (!stats) {
+      stats = new ThreadStats;
+      {
+        base::AutoLock lock(lock_);
+        threads_.push_back(stats);
+      }
+      slot_.Set(stats);
+    }
+    return stats;
+  }
+
+  void GetProfiles(std::vector<LockSiteProfile>* profiles) {
+    base::AutoLock lock(lock_);
+    uint64_t values[kMaxLockSites][kNumStats];
+    memcpy(values, totals_, sizeof(values));
+    for (const ThreadStats* stats : threads_)
+      Fold(*stats, values);
+
+    for (size_t i = 0; i < names_.size(); ++i) {
+      LockSiteProfile profile;
+      profile.name = names_[i];
+      profile.num_acquisitions = values[i][kAcquisitions];
+      profile.num_contended_acquisitions = values[i][kContendedAcquisitions];
+      profile.total_wait_time_ns = values[i][kTotalWaitTime];
+      profile.max_wait_time_ns = values[i][kMaxWaitTime];
+      profile.total_hold_time_ns = values[i][kTotalHoldTime];
+      profile.max_hold_time_ns = values[i][kMaxHoldTime];
+      profiles->push_back(profile);
+    }
+  }
+
+  void RemoveThread(ThreadStats* stats) {
+    {
+      base::AutoLock lock(lock_);
+      Fold(*stats, totals_);
+      threads_.erase(std::find(threads_.begin(), threads_.end(), stats));
+    }
+    delete stats;
+  }
+
+ private:
+  static void Fold(const ThreadStats& stats,
+                   uint64_t (*values)[kNumStats]) {
+    for (size_t site = 0; site < kMaxLockSites; ++site) {
+      for (size_t stat = 0; stat < kNumStats; ++stat) {
+        uint64_t value =
+            stats.values[site][stat].load(std::memory_order_relaxed);
+        if (IsMaxStat(stat))
+          values[site][stat] = std::max(values[site][stat], value);
+        else
+          values[site][stat] += value;
+      }
+    }
+  }
+
+  base::ThreadLocalStorage::Slot slot_;
+
+  // Guards the members below. This is a plain base::Lock, so it is never
+  // profiled itself.
+  base::Lock lock_;
+  std::vector<std::string> names_;
+  std::vector<ThreadStats*> threads_;
+
+  // The final values of threads which have exited.
+  uint64_t totals_[kMaxLockSites][kNumStats];
+
+  DISALLOW_COPY_AND_ASSIGN(Profiler);
+};
+
+base::LazyInstance<Profiler>::Leaky g_profiler = LAZY_INSTANCE_INITIALIZER;
+
+void DestroyThreadStats(void* stats) {
+  g_profiler.Get().RemoveThread(static_cast<ThreadStats*>(stats));
+}
+
+uint64_t ToNanoseconds(internal::LockClock::duration duration) {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count());
+}
+
+}  // namespace
+
+namespace internal {
+
+size_t GetLockSiteIndex(const char* name) {
+  return g_profiler.Get().GetSiteIndex(name);
+}
+
+void RecordLockAcquired(size_t site,
+                        LockClock::duration wait_time,
+                        bool contended) {
+  ThreadStats* stats = g_profiler.Get().GetThreadStats();
+  stats->Add(site, kAcquisitions, 1);
+  if (contended) {
+    uint64_t wait_time_ns = ToNanoseconds(wait_time);
+    stats->Add(site, kContendedAcquisitions, 1);
+    stats->Add(site, kTotalWaitTime, wait_time_ns);
+    stats->Max(site, kMaxWaitTime, wait_time_ns);
+  }
+}
+
+void RecordLockReleased(size_t site, LockClock::duration hold_time) {
+  ThreadStats* stats = g_profiler.Get().GetThreadStats();
+  uint64_t hold_time_ns = ToNanoseconds(hold_time);
+  stats->Add(site, kTotalHoldTime, hold_time_ns);
+  stats->Max(site, kMaxHoldTime, hold_time_ns);
+}
+
+}  // namespace internal
+
+bool IsLockProfilingEnabled() {
+  return true;
+}
+
+void GetLockSiteProfiles(std::vector<LockSiteProfile>* profiles) {
+  g_profiler.Get().GetProfiles(profiles);
+}
+
+#else  // defined(MOJO_EDK_LOCK_PROFILING)
+
+bool IsLockProfilingEnabled() {
+  return false;
+}
+
+void GetLockSiteProfiles(std::vector<LockSiteProfile>* profiles) {}
+
+#endif  // defined(MOJO_EDK_LOCK_PROFILING)
+
+}  // namespace ports
+}  // namespace edk
+}  // namespace mojo
@@ -0,0 +1,241 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_SYSTEM_PORTS_PROFILED_LOCK_H_
+#define MOJO_EDK_SYSTEM_PORTS_PROFILED_LOCK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "base/macros.h"
+#include "base/synchronization/lock.h"
+#include "mojo/edk/system/ports/compact_lock.h"
+
+namespace mojo {
+namespace edk {
+namespace ports {
+
+// Locks which, in builds with the GN arg mojo_edk_profile_locks set, record
+// how long threads wait to acquire them and how long they hold them. Each lock
+// is given the name of its lock site, e.g. "Port::lock", and every lock with
+// the same name is reported together. Without the arg these are plain locks
+// and the names are ignored.
+//
+// ProfiledMutex stands in for std::mutex in ports, and ProfiledLock for
+// base::Lock in the EDK. Both ProfiledMutex and ProfiledCompactLock are built
+// on CompactLock, for locks which are numerous and briefly held.
+
+#if defined(MOJO_EDK_LOCK_PROFILING)
+
+namespace internal {
+
+// base::TimeTicks only has microsecond resolution, which is too coarse for
+// most critical sections.
+using LockClock = std::chrono::steady_clock;
+
+// Returns the index under which locks named |name| are recorded.
+size_t GetLockSiteIndex(const char* name);
+
+void RecordLockAcquired(size_t site,
+                        LockClock::duration wait_time,
+                        bool contended);
+void RecordLockReleased(size_t site, LockClock::duration hold_time);
+
+// Acquires a lock with |try_acquire|, or failing that |acquire|, records the
+// wait, and returns when the lock was acquired.
+template <typename TryAcquire, typename Acquire>
+LockClock::time_point AcquireProfiled(size_t site,
+                                      const TryAcquire& try_acquire,
+                                      const Acquire& acquire) {
+  // Uncontended acquisitions are counted without timing a wait.
+  if (try_acquire()) {
+    LockClock::time_point now = LockClock::now();
+    RecordLockAcquired(site, LockClock::duration(), false);
+    return now;
+  }
+  LockClock::time_point start = LockClock::now();
+  acquire();
+  LockClock::time_point now = LockClock::now();
+  RecordLockAcquired(site, now - start, true);
+  return now;
+}
+
+}  // namespace internal
+
+class ProfiledMutex {
+ public:
+  explicit ProfiledMutex(const char* name)
+      : site_(internal::GetLockSiteIndex(name)) {}
+
+  void lock() {
+    acquire_time_ = internal::AcquireProfiled(
+        site_, [this] { return lock_.Try(); }, [this] { lock_.Acquire(); });
+  }
+
+  bool try_lock() {
+    if (!lock_.Try())
+      return false;
+    acquire_time_ = internal::LockClock::now();
+    internal::RecordLockAcquired(site_, internal::LockClock::duration(),
+                                 false);
+    return true;
+  }
+
+  void unlock() {
+    internal::RecordLockReleased(site_,
+                                 internal::LockClock::now() - acquire_time_);
+    lock_.Release();
+  }
+
+ private:
+  CompactLock lock_;
+  const size_t site_;
+
+  // Only accessed by the thread holding |lock_|.
+  internal::LockClock::time_point acquire_time_;
+
+  DISALLOW_COPY_AND_ASSIGN(ProfiledMutex);
+};
+
+template <typename LockType>
+class BasicProfiledLock {
+ public:
+  explicit BasicProfiledLock(const char* name)
+      : site_(internal::GetLockSiteIndex(name)) {}
+
+  void Acquire() {
+    acquire_time_ = internal::AcquireProfiled(
+        site_, [this] { return lock_.Try(); }, [this] { lock_.Acquire(); });
+  }
+
+  bool Try() {
+    if (!lock_.Try())
+      return false;
+    acquire_time_ = internal::LockClock::now();
+    internal::RecordLockAcquired(site_, internal::LockClock::duration(),
+                                 false);
+    return true;
+  }
+
+  void Release() {
+    internal::RecordLockReleased(site_,
+                                 internal::LockClock::now() - acquire_time_);
+    lock_.Release();
+  }
+
+  void AssertAcquired() const { lock_.AssertAcquired(); }
+
+ private:
+  LockType lock_;
+  const size_t site_;
+
+  // Only accessed by the thread holding |lock_|.
+  internal::LockClock::time_point acquire_time_;
+
+  DISALLOW_COPY_AND_ASSIGN(BasicProfiledLock);
+};
+
+#else  // defined(MOJO_EDK_LOCK_PROFILING)
+
+class ProfiledMutex {
+ public:
+  explicit ProfiledMutex(const char* name) {}
+
+  void lock() { lock_.Acquire(); }
+  bool try_lock() { return lock_.Try(); }
+  void unlock() { lock_.Release(); }
+
+ private:
+  CompactLock lock_;
+
+  DISALLOW_COPY_AND_ASSIGN(ProfiledMutex);
+};
+
+template <typename LockType>
+class BasicProfiledLock {
+ public:
+  explicit BasicProfiledLock(const char* name) {}
+
+  void Acquire() { lock_.Acquire(); }
+  bool Try() { return lock_.Try(); }
+  void Release() { lock_.Release(); }
+  void AssertAcquired() const { lock_.AssertAcquired(); }
+
+ private:
+  LockType lock_;
+
+  DISALLOW_COPY_AND_ASSIGN(BasicProfiledLock);
+};
+
+#endif  // defined(MOJO_EDK_LOCK_PROFILING)
+
+using ProfiledLock = BasicProfiledLock<base::Lock>;
+using ProfiledCompactLock = BasicProfiledLock<CompactLock>;
+
+// Like base::AutoLock and base::AutoUnlock, for ProfiledLock and
+// ProfiledCompactLock.
+template <typename LockType>
+class BasicProfiledAutoLock {
+ public:
+  explicit BasicProfiledAutoLock(LockType& lock) : lock_(lock) {
+    lock_.Acquire();
+  }
+  ~BasicProfiledAutoLock() {
+    lock_.AssertAcquired();
+    lock_.Release();
+  }
+
+ private:
+  LockType& lock_;
+
+  DISALLOW_COPY_AND_ASSIGN(BasicProfiledAutoLock);
+};
+
+template <typename LockType>
+class BasicProfiledAutoUnlock {
+ public:
+  explicit BasicProfiledAutoUnlock(LockType& lock) : lock_(lock) {
+    lock_.AssertAcquired();
+    lock_.Release();
+  }
+  ~BasicProfiledAutoUnlock() { lock_.Acquire(); }
+
+ private:
+  LockType& lock_;
+
+  DISALLOW_COPY_AND_ASSIGN(BasicProfiledAutoUnlock);
+};
+
+using ProfiledAutoLock = BasicProfiledAutoLock<ProfiledLock>;
+using ProfiledAutoUnlock = BasicProfiledAutoUnlock<ProfiledLock>;
+using ProfiledCompactAutoLock = BasicProfiledAutoLock<ProfiledCompactLock>;
+
+// What was recorded for one lock site. The EDK reports these to the embedder
+// as mojo::edk::LockSiteProfile, which has the same fields.
+struct LockSiteProfile {
+  std::string name;
+  uint64_t num_acquisitions;
+  uint64_t num_contended_acquisitions;
+  uint64_t total_wait_time_ns;
+  uint64_t max_wait_time_ns;
+  uint64_t total_hold_time_ns;
+  uint64_t max_hold_time_ns;
+};
+
+// Returns whether this is a lock profiling build.
+bool IsLockProfilingEnabled();
+
+// Appends the profile of every lock site used so far to |profiles|. Empty
+// unless IsLockProfilingEnabled().
+void GetLockSiteProfiles(std::vector<LockSiteProfile>* profiles);
+
+}  // namespace ports
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_SYSTEM_PORTS_PROFILED_LOCK_H_
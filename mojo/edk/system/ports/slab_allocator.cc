@@ -0,0 +1,90 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/ports/slab_allocator.h"
+
+#include <stddef.h>
+
+#include <new>
+
+#include "base/memory/aligned_memory.h"
+
+namespace mojo {
+namespace edk {
+namespace ports {
+
+namespace {
+
+// Chunks hold enough blocks to amortize growing the slab without costing
+// much for a node which only ever has a handful of ports.
+const size_t kBlocksPerChunk = 64;
+
+const size_t kBlockAlignment = alignof(max_align_t);
+
+size_t RoundUpToBlockAlignment(size_t size) {
+  return (size + kBlockAlignment - 1) & ~(kBlockAlignment - 1);
+}
+
+const SlabMemoryFunctions kHeapMemoryFunctions = {&base::AlignedAlloc,
+                                                  &base::AlignedFree};
+
+}  // namespace
+
+Slab::Slab() : Slab(kHeapMemoryFunctions) {}
+
+Slab::Slab(const SlabMemoryFunctions& memory_functions)
+    : memory_functions_(memory_functions), lock_("ports::Slab::lock") {}
+
+Slab::~Slab() {
+  for (void* chunk : chunks_)
+    memory_functions_.free(chunk);
+}
+
+void* Slab::Allocate(size_t size) {
+  {
+    std::lock_guard<ProfiledMutex> guard(lock_);
+    if (!block_size_)
+      block_size_ = RoundUpToBlockAlignment(size);
+
+    if (RoundUpToBlockAlignment(size) == block_size_) {
+      if (!free_list_) {
+        // Blocks are a multiple of the alignment, so if the chunk is aligned
+        // for any object, every block in it is too.
+        char* chunk = static_cast<char*>(memory_functions_.allocate(
+            block_size_ * kBlocksPerChunk, kBlockAlignment));
+        chunks_.push_back(chunk);
+        for (size_t i = 0; i < kBlocksPerChunk; ++i) {
+          FreeBlock* block =
+              reinterpret_cast<FreeBlock*>(chunk + i * block_size_);
+          block->next = free_list_;
+          free_list_ = block;
+        }
+      }
+
+      FreeBlock* block = free_list_;
+      free_list_ = block->next;
+      return block;
+    }
+  }
+
+  return ::operator new(size);
+}
+
+void Slab::Free(void* block, size_t size) {
+  {
+    std::lock_guard<ProfiledMutex> guard(lock_);
+    if (RoundUpToBlockAlignment(size) == block_size_) {
+      FreeBlock* free_block = static_cast<FreeBlock*>(block);
+      free_block->next = free_list_;
+      free_list_ = free_block;
+      return;
+    }
+  }
+
+  ::operator delete(block);
+}
+
+}  // namespace ports
+}  // namespace edk
+}  // namespace mojo
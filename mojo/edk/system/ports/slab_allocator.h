@@ -0,0 +1,103 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_SYSTEM_PORTS_SLAB_ALLOCATOR_H_
+#define MOJO_EDK_SYSTEM_PORTS_SLAB_ALLOCATOR_H_
+
+#include <stddef.h>
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "base/macros.h"
+#include "mojo/edk/system/ports/profiled_lock.h"
+
+namespace mojo {
+namespace edk {
+namespace ports {
+
+// Where a Slab gets its chunks, so that the embedder can supply the memory.
+// These are plain functions rather than an interface because a slab may
+// outlive whoever made it.
+struct SlabMemoryFunctions {
+  // Must not return null.
+  void* (*allocate)(size_t num_bytes, size_t alignment);
+  void (*free)(void* chunk);
+};
+
+// Hands out fixed-size blocks carved from large chunks, so that objects which
+// are created and destroyed often, such as ports, don't each go through the
+// heap and end up packed together in memory. Freed blocks are kept on a free
+// list for reuse and are only returned to the heap when the slab is
+// destroyed. Chunks come from the heap unless the slab is given other
+// SlabMemoryFunctions.
+//
+// The block size is set by the first allocation. Requests for any other size
+// go straight to the heap. Safe to use from any thread.
+class Slab {
+ public:
+  Slab();
+  explicit Slab(const SlabMemoryFunctions& memory_functions);
+  ~Slab();
+
+  void* Allocate(size_t size);
+  void Free(void* block, size_t size);
+
+ private:
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  const SlabMemoryFunctions memory_functions_;
+  ProfiledMutex lock_;
+  size_t block_size_ = 0;
+  FreeBlock* free_list_ = nullptr;
+  std::vector<void*> chunks_;
+
+  DISALLOW_COPY_AND_ASSIGN(Slab);
+};
+
+// A standard allocator on top of a shared Slab, for use with
+// std::allocate_shared(). Each object keeps the slab alive through its copy
+// of the allocator, so the slab may outlive whoever made it.
+template <typename T>
+class SlabAllocator {
+ public:
+  using value_type = T;
+
+  explicit SlabAllocator(std::shared_ptr<Slab> slab)
+      : slab_(std::move(slab)) {}
+
+  template <typename U>
+  SlabAllocator(const SlabAllocator<U>& other) : slab_(other.slab_) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(slab_->Allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, size_t n) { slab_->Free(p, n * sizeof(T)); }
+
+  template <typename U>
+  bool operator==(const SlabAllocator<U>& other) const {
+    return slab_ == other.slab_;
+  }
+
+  template <typename U>
+  bool operator!=(const SlabAllocator<U>& other) const {
+    return slab_ != other.slab_;
+  }
+
+ private:
+  template <typename U>
+  friend class SlabAllocator;
+
+  std::shared_ptr<Slab> slab_;
+};
+
+}  // namespace ports
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_SYSTEM_PORTS_SLAB_ALLOCATOR_H_
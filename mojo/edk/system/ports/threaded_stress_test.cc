@@ -2,297 +2,466 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <deque>
 #include <memory>
 #include <mutex>
-#include <queue>
+#include <random>
 #include <thread>
+#include <utility>
+#include <vector>
 
-#include "base/logging.h"
+#include "base/macros.h"
 #include "mojo/edk/system/ports/node.h"
 #include "mojo/edk/system/ports/node_delegate.h"
+#include "mojo/edk/system/ports/profiled_lock.h"
+#include "mojo/edk/system/ports/test_utils.h"
 #include "testing/gtest/include/gtest/gtest.h"
 
-// Each thread has a thread-local mapping from thread_id to port to used to
-// communication to the thread.
-//
-//   TLS: map(thread_id) -> port
+// Runs many threads sending messages between ports spread over several nodes
+// in this process, and sweeps how throughput scales with the number of threads
+// and nodes, the message size, and how often messages carry a port.
 //
-// This can be used to send a message from any thread to any thread.
+// Every thread has a port to every other thread, on the nodes they belong to.
+// Each node has an event queue shared by its threads: forwarded messages and
+// ports with messages to read are queued there, and whichever of the node's
+// threads is free handles them. Each message read is answered by a new message
+// to a random thread, so a fixed number stay in flight until the budget for
+// the configuration is used up. A message may carry a new port, which the
+// receiver closes; each such port is created, transferred to another node or
+// thread, proxied and collapsed as usual.
 //
-// Upon receiving a message, a thread will wake up and perform a random
-// activity. Activities include:
+// Each configuration is reported as a line of CSV:
 //
-//   1. Forward the message to a random thread.
-//   2. Forward the received ports to a random assortment of threads.
-//   3  Send a message with a random number of ports to the received ports,
-//      send the peer ports to other random threads, and then close the
-//      received ports.
-//   4. Close the received ports. Send a new message to a random port.
+//   threads,nodes,message_bytes,transfer_one_in,messages_per_sec,
+//   port_transfers_per_sec,lock_wait_ms,contended_acquisitions
 //
-// The test concludes after N messages have been received.
+// where |transfer_one_in| is how many messages there are for each which
+// carries a port (0 for none). The lock columns sum every profiled lock site
+// and are left empty unless the build has lock profiling enabled; see
+// profiled_lock.h.
 
+namespace mojo {
+namespace edk {
 namespace ports {
+namespace test {
+namespace {
+
+const size_t kNumThreads[] = {1, 2, 4, 8, 16};
+const size_t kNumNodes[] = {1, 2, 4, 8};
+const size_t kMessageSizes[] = {16, 4096};
+const uint32_t kTransferOneIn[] = {0, 16, 1};
+
+const size_t kMessagesPerConfig = 200000;
+const size_t kMessagesInFlightPerThread = 4;
+
+struct StressConfig {
+  size_t num_threads;
+  size_t num_nodes;
+  size_t message_size;
+  uint32_t transfer_one_in;
+};
 
-static const size_t kNumThreads = 100;
-static const size_t kNumNodes = 10;
+// Something for one of a node's threads to do: accept a forwarded message, or
+// read the messages on a port.
+struct NodeTask {
+  ScopedMessage message;
+  PortRef port;
+};
 
-static const uint32_t kMaxMessages = 1000000;
-static std::atomic<uint32_t> message_counter(1);
-static bool ShouldExit() {
-  return message_counter.load() > kMaxMessages;
-}
-static void MessageWasRead() {
-  uint32_t value = message_counter.fetch_add(1);
-  if (value % (kMaxMessages / 1000) == 0) {
-    printf(".");
-    fflush(stdout);
+class StressRun;
+
+class StressNodeDelegate : public NodeDelegate {
+ public:
+  StressNodeDelegate(StressRun* run, size_t node_index)
+      : run_(run), node_index_(node_index) {}
+
+  void GenerateRandomPortName(PortName* port_name) override;
+  void AllocMessage(size_t num_header_bytes,
+                    size_t num_payload_bytes,
+                    size_t num_ports,
+                    ScopedMessage* message) override {
+    message->reset(
+        new TestMessage(num_header_bytes, num_payload_bytes, num_ports));
   }
-  if (value % (kMaxMessages / 10) == 0)
-    printf("\n");
-}
+  void ForwardMessage(const NodeName& node_name,
+                      ScopedMessage message) override;
 
-struct NodeData {
-  std::unique_ptr<Node> node;
-  std::unique_ptr<NodeDelegate> delegate;
-  std::mutex lock;
-  std::queue<Event> events;
-  std::condition_variable cvar;
-};
+  // Reading is left to the node's threads, so that a local send never reads
+  // and sends again from inside Node.
+  void PortStatusChanged(const PortRef& port_ref) override;
+
+ private:
+  StressRun* const run_;
+  const size_t node_index_;
 
-struct ThreadData {
-  NodeName node_name;
-  PortName ports[kNumThreads];  // Ports to all of the other threads.
-  PortName self_port;           // The peer of the port to ourselves.
+  DISALLOW_COPY_AND_ASSIGN(StressNodeDelegate);
 };
-static thread_local ThreadData* this_thread_data;
 
-static void PutEvent(NodeData* node_data, Event event) {
-  {
-    std::lock_guard<std::mutex> guard(node_data->lock);
-    node_data->events.emplace(std::move(event));
+class StressRun {
+ public:
+  explicit StressRun(const StressConfig& config);
+  ~StressRun();
+
+  // Sends |kMessagesPerConfig| messages and returns once all of them have
+  // been read, with the time that took.
+  std::chrono::steady_clock::duration Run();
+
+  size_t num_port_transfers() const { return num_port_transfers_.load(); }
+
+  PortName NextPortName() {
+    PortName port_name;
+    port_name.v1 = next_port_name_.fetch_add(1, std::memory_order_relaxed);
+    port_name.v2 = 0;
+    return port_name;
   }
-  node_data->cvar.notify_one();
-}
 
-static bool GetEvent(NodeData* node_data, Event* event) {
-  while (!ShouldExit()) {
-    std::unique_lock<std::mutex> guard(node_data->lock);
-    if (node_data->events.empty()) {
-      node_data->cvar.wait(guard);
-    } else {
-      *event = std::move(node_data->events.front());
-      node_data->events.pop();
-      return true;
-    }
+  void PostTask(size_t node_index, NodeTask task);
+
+  static NodeName GetNodeName(size_t node_index) {
+    return NodeName(node_index, 1);
   }
-  return false;
-}
 
-static std::atomic<uint64_t> next_unique_uint64;
-static uint64_t GenerateUniqueUint64() {
-  return next_unique_uint64.fetch_add(1, std::memory_order_relaxed);
-}
+ private:
+  struct NodeData {
+    std::unique_ptr<StressNodeDelegate> delegate;
+    std::unique_ptr<Node> node;
 
-static ThreadData* kThreadData[kNumThreads];
-static NodeData* kNodeData[kNumNodes];
+    std::mutex lock;
+    std::condition_variable cvar;
+    std::deque<NodeTask> tasks;
+  };
 
-static int RandomDestination() {
-  return rand() % kNumThreads;
-}
+  struct ThreadData {
+    size_t node_index;
+    std::minstd_rand random;
+
+    // The port on this thread's node through which it reaches each thread.
+    std::vector<PortRef> ports;
+
+    // The peer of the port to itself.
+    PortRef self_port;
+  };
+
+  void ThreadFunc(ThreadData* thread);
+  bool TakeTask(NodeData* node_data, NodeTask* task);
+  void RunTask(ThreadData* thread, NodeTask task);
+
+  // Reads and counts the messages on |port|, closing any ports they carry.
+  // Each is answered from |thread| unless it's null.
+  void ReadMessages(Node* node, ThreadData* thread, const PortRef& port);
+
+  // Sends a message from |thread| to a random thread if the budget allows.
+  void MaybeSendMessage(ThreadData* thread);
+
+  // Runs everything left in the nodes' queues on this thread until they're
+  // all empty. Nothing more is sent.
+  void Drain();
 
-static ScopedMessage NewMessageWithNumPorts(size_t num_ports) {
-  const char kMessageText[] = "hello";
-  ScopedMessage message(AllocMessage(sizeof(kMessageText), num_ports));
-  strcpy(static_cast<char*>(message->bytes), kMessageText);
-  return message;
+  const StressConfig config_;
+  std::vector<std::unique_ptr<NodeData>> nodes_;
+  std::vector<std::unique_ptr<ThreadData>> threads_;
+
+  std::atomic<uint64_t> next_port_name_;
+  std::atomic<bool> stopping_;
+  std::atomic<size_t> num_sent_;
+  std::atomic<size_t> num_read_;
+  std::atomic<size_t> num_port_transfers_;
+
+  std::mutex done_lock_;
+  std::condition_variable done_cvar_;
+  bool done_ = false;
+
+  DISALLOW_COPY_AND_ASSIGN(StressRun);
+};
+
+void StressNodeDelegate::GenerateRandomPortName(PortName* port_name) {
+  *port_name = run_->NextPortName();
 }
 
-static ScopedMessage NewMessageWithPort(PortName port) {
-  ScopedMessage message(NewMessageWithNumPorts(1));
-  message->ports[0].name = port;
-  return message;
+void StressNodeDelegate::ForwardMessage(const NodeName& node_name,
+                                        ScopedMessage message) {
+  NodeTask task;
+  task.message = std::move(message);
+  run_->PostTask(node_name.v1, std::move(task));
 }
 
-static ScopedMessage NewMessageWithRandomNumPorts(
-    Node* node, std::vector<PortName>* other_ports) {
-  size_t num_ports = rand() % 10;
+void StressNodeDelegate::PortStatusChanged(const PortRef& port_ref) {
+  NodeTask task;
+  task.port = port_ref;
+  run_->PostTask(node_index_, std::move(task));
+}
 
-  ScopedMessage message(NewMessageWithNumPorts(num_ports));
+StressRun::StressRun(const StressConfig& config)
+    : config_(config),
+      next_port_name_(1),
+      stopping_(false),
+      num_sent_(0),
+      num_read_(0),
+      num_port_transfers_(0) {
+  for (size_t i = 0; i < config.num_nodes; ++i) {
+    nodes_.emplace_back(new NodeData);
+    nodes_[i]->delegate.reset(new StressNodeDelegate(this, i));
+    nodes_[i]->node.reset(
+        new Node(GetNodeName(i), nodes_[i]->delegate.get()));
+  }
 
-  other_ports->clear();
-  for (size_t i = 0; i < num_ports; ++i) {
-    PortName a, b;
-    node->CreatePortPair(&a, &b);
-    message->ports[i].name = a;
-    other_ports->push_back(b);
+  for (size_t i = 0; i < config.num_threads; ++i) {
+    threads_.emplace_back(new ThreadData);
+    threads_[i]->node_index = i % config.num_nodes;
+    threads_[i]->random.seed(static_cast<uint32_t>(i + 1));
+    threads_[i]->ports.resize(config.num_threads);
   }
 
-  return message;
+  // Connect every pair of threads, including each thread to itself.
+  for (size_t i = 0; i < config.num_threads; ++i) {
+    for (size_t j = i; j < config.num_threads; ++j) {
+      size_t node_i = threads_[i]->node_index;
+      size_t node_j = threads_[j]->node_index;
+      PortRef port_i, port_j;
+      EXPECT_EQ(OK, nodes_[node_i]->node->CreateUninitializedPort(&port_i));
+      EXPECT_EQ(OK, nodes_[node_j]->node->CreateUninitializedPort(&port_j));
+      EXPECT_EQ(OK, nodes_[node_i]->node->InitializePort(
+                        port_i, GetNodeName(node_j), port_j.name()));
+      EXPECT_EQ(OK, nodes_[node_j]->node->InitializePort(
+                        port_j, GetNodeName(node_i), port_i.name()));
+      threads_[i]->ports[j] = port_i;
+      if (i == j)
+        threads_[i]->self_port = port_j;
+      else
+        threads_[j]->ports[i] = port_j;
+    }
+  }
+  Drain();
 }
 
-static void DoRandomActivity(Node* node, ScopedMessage message) {
-  switch (rand() % 3) {
-    case 0: {
-      // Forward the message to a random thread.
-      node->SendMessage(this_thread_data->ports[RandomDestination()],
-                        std::move(message));
-      break;
-    }
-    case 1:
-      // Forward the received ports to a random assortment of threads.
-      for (size_t i = 0; i < message->num_ports; ++i) {
-        ScopedMessage new_message = NewMessageWithPort(message->ports[i].name);
-        node->SendMessage(this_thread_data->ports[RandomDestination()],
-                          std::move(new_message));
-      }
-      break;
-    case 2:
-      // Send a message with a random number of ports to the received ports,
-      // send the peer ports to other random threads, and then close the
-      // received ports.
-      for (size_t i = 0; i < message->num_ports; ++i) {
-        std::vector<PortName> other_ports;
-        ScopedMessage new_message(
-            NewMessageWithRandomNumPorts(node, &other_ports));
-        for (size_t i = 0; i < other_ports.size(); ++i) {
-          node->SendMessage(this_thread_data->ports[RandomDestination()],
-                            NewMessageWithPort(other_ports[i]));
-        }
-        node->SendMessage(message->ports[i].name, std::move(new_message));
-        node->ClosePort(message->ports[i].name);
+StressRun::~StressRun() {
+  for (size_t i = 0; i < config_.num_threads; ++i) {
+    Node* node = nodes_[threads_[i]->node_index]->node.get();
+    for (size_t j = i; j < config_.num_threads; ++j) {
+      EXPECT_EQ(OK, node->ClosePort(threads_[i]->ports[j]));
+      if (j != i) {
+        EXPECT_EQ(OK, nodes_[threads_[j]->node_index]->node->ClosePort(
+                          threads_[j]->ports[i]));
       }
-      break;
-    case 3:
-      // Close the received ports. Send a new message to a random port.
-      for (size_t i = 0; i < message->num_ports; ++i)
-        node->ClosePort(message->ports[i].name);
-      node->SendMessage(this_thread_data->ports[RandomDestination()],
-                        NewMessageWithNumPorts(0));
-      break;
+    }
+    EXPECT_EQ(OK, node->ClosePort(threads_[i]->self_port));
+  }
+  Drain();
+
+  // Every port, including every proxy left by a transfer, should be gone.
+  for (const auto& node_data : nodes_) {
+    NodeStats stats;
+    node_data->node->GetStats(&stats);
+    EXPECT_EQ(0u, stats.num_ports);
   }
 }
 
-class TestNodeDelegate : public NodeDelegate {
- public:
-  explicit TestNodeDelegate(const NodeName& node_name)
-      : node_name_(node_name) {
+std::chrono::steady_clock::duration StressRun::Run() {
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+  // The first messages are sent before the threads start, since each
+  // thread's random number generator is its own.
+  for (const auto& thread : threads_) {
+    for (size_t i = 0; i < kMessagesInFlightPerThread; ++i)
+      MaybeSendMessage(thread.get());
   }
+  std::vector<std::thread> threads;
+  for (const auto& thread : threads_)
+    threads.emplace_back(&StressRun::ThreadFunc, this, thread.get());
 
-  void GenerateRandomPortName(PortName* port_name) override {
-    port_name->value_major = GenerateUniqueUint64();
-    port_name->value_minor = 0;
+  {
+    std::unique_lock<std::mutex> lock(done_lock_);
+    done_cvar_.wait(lock, [this] { return done_; });
   }
+  std::chrono::steady_clock::duration elapsed =
+      std::chrono::steady_clock::now() - start;
 
-  void SendEvent(const NodeName& node_name, Event event) override {
-    PutEvent(kNodeData[node_name.value_major], std::move(event));
+  stopping_ = true;
+  for (const auto& node_data : nodes_) {
+    std::lock_guard<std::mutex> lock(node_data->lock);
+    node_data->cvar.notify_all();
   }
+  for (auto& thread : threads)
+    thread.join();
+  Drain();
+  return elapsed;
+}
 
-  void MessagesAvailable(const PortName& port,
-                         std::shared_ptr<UserData> user_data) override {
-    Node* node = kNodeData[node_name_.value_major]->node.get();
-    for (;;) {
-      ScopedMessage message;
-      node->GetMessage(port, &message);
-      if (message) {
-        DoRandomActivity(node, std::move(message));
-        MessageWasRead();
-      } else {
-        break;
-      }
-    }
+void StressRun::PostTask(size_t node_index, NodeTask task) {
+  NodeData* node_data = nodes_[node_index].get();
+  {
+    std::lock_guard<std::mutex> lock(node_data->lock);
+    node_data->tasks.emplace_back(std::move(task));
   }
+  node_data->cvar.notify_one();
+}
 
- private:
-  NodeName node_name_;
-};
+void StressRun::ThreadFunc(ThreadData* thread) {
+  NodeData* node_data = nodes_[thread->node_index].get();
+  NodeTask task;
+  while (TakeTask(node_data, &task))
+    RunTask(thread, std::move(task));
+}
 
-static void ThreadFunc(size_t thread_index) {
-  this_thread_data = kThreadData[thread_index];
+bool StressRun::TakeTask(NodeData* node_data, NodeTask* task) {
+  std::unique_lock<std::mutex> lock(node_data->lock);
+  node_data->cvar.wait(lock, [this, node_data] {
+    return stopping_.load() || !node_data->tasks.empty();
+  });
+  if (stopping_.load())
+    return false;
+  *task = std::move(node_data->tasks.front());
+  node_data->tasks.pop_front();
+  return true;
+}
 
-  NodeData* node_data = kNodeData[this_thread_data->node_name.value_major];
+void StressRun::RunTask(ThreadData* thread, NodeTask task) {
+  Node* node = nodes_[thread->node_index]->node.get();
+  if (task.message)
+    EXPECT_EQ(OK, node->AcceptMessage(std::move(task.message)));
+  else
+    ReadMessages(node, thread, task.port);
+}
 
+void StressRun::ReadMessages(Node* node,
+                             ThreadData* thread,
+                             const PortRef& port) {
   for (;;) {
-    Event event(Event::kAcceptMessage);  // dummy event
-    if (GetEvent(node_data, &event)) {
-      node_data->node->AcceptEvent(std::move(event));
-    } else {
-      break;
+    ScopedMessage message;
+    // The port may have been closed since it was queued.
+    if (node->GetMessage(port, &message) != OK || !message)
+      return;
+
+    for (size_t i = 0; i < message->num_ports(); ++i) {
+      PortRef received;
+      ASSERT_EQ(OK, node->GetPort(message->ports()[i], &received));
+      EXPECT_EQ(OK, node->ClosePort(received));
+      ++num_port_transfers_;
     }
-  }
-}
 
-static void KickOffTest() {
-  ThreadData* thread_data = kThreadData[0];
-  NodeData* node_data = kNodeData[thread_data->node_name.value_major];
-
-  std::vector<PortName> other_ports;
-  ScopedMessage message(
-      NewMessageWithRandomNumPorts(node_data->node.get(), &other_ports));
-  for (size_t i = 0; i < other_ports.size(); ++i) {
-    node_data->node->SendMessage(
-        thread_data->ports[RandomDestination()],
-        NewMessageWithPort(other_ports[i]));
+    if (thread)
+      MaybeSendMessage(thread);
+    if (++num_read_ == kMessagesPerConfig) {
+      std::lock_guard<std::mutex> lock(done_lock_);
+      done_ = true;
+      done_cvar_.notify_one();
+    }
   }
-  node_data->node->SendMessage(
-      thread_data->ports[RandomDestination()], std::move(message));
 }
 
-TEST(ThreadedStressTest, RandomDance) {
-  for (size_t i = 0; i < kNumNodes; ++i) {
-    NodeName node_name(i, 0);
-    kNodeData[i] = new NodeData();
-    kNodeData[i]->delegate.reset(new TestNodeDelegate(node_name));
-    kNodeData[i]->node.reset(new Node(node_name, kNodeData[i]->delegate.get()));
+void StressRun::MaybeSendMessage(ThreadData* thread) {
+  if (num_sent_.fetch_add(1) >= kMessagesPerConfig)
+    return;
+
+  Node* node = nodes_[thread->node_index]->node.get();
+  bool transfer = config_.transfer_one_in != 0 &&
+                  thread->random() % config_.transfer_one_in == 0;
+  ScopedMessage message;
+  ASSERT_EQ(OK, node->AllocMessage(config_.message_size, transfer ? 1 : 0,
+                                   &message));
+  PortRef kept;
+  if (transfer) {
+    PortRef sent;
+    ASSERT_EQ(OK, node->CreatePortPair(&kept, &sent));
+    message->mutable_ports()[0] = sent.name();
   }
 
-  for (size_t i = 0; i < kNumThreads; ++i) {
-    kThreadData[i] = new ThreadData();
-    kThreadData[i]->node_name = NodeName(i % kNumNodes, 0);
+  size_t destination = thread->random() % config_.num_threads;
+  EXPECT_EQ(OK, node->SendMessage(thread->ports[destination],
+                                  std::move(message)));
+  if (transfer) {
+    EXPECT_EQ(OK, node->ClosePort(kept));
   }
+}
 
-  // Create web of ports between threads.
-  for (size_t i = 0; i < kNumThreads; ++i) {
-    for (size_t j = i; j < kNumThreads; ++j) {
-      NodeName node_name_i = kThreadData[i]->node_name;
-      NodeName node_name_j = kThreadData[j]->node_name;
-
-      Node* node_i = kNodeData[node_name_i.value_major]->node.get();
-      Node* node_j = kNodeData[node_name_j.value_major]->node.get();
-
-      PortName port_i, port_j;
-      node_i->CreatePort(&port_i);
-      node_j->CreatePort(&port_j);
-      node_i->InitializePort(port_i, node_name_j, port_j);
-      node_j->InitializePort(port_j, node_name_i, port_i);
-
-      if (i == j) {
-        kThreadData[i]->ports[j] = port_i;
-        kThreadData[i]->self_port = port_j;
-      } else {
-        kThreadData[i]->ports[j] = port_i;
-        kThreadData[j]->ports[i] = port_j;
+void StressRun::Drain() {
+  bool ran_any;
+  do {
+    ran_any = false;
+    for (const auto& node_data : nodes_) {
+      Node* node = node_data->node.get();
+      for (;;) {
+        NodeTask task;
+        {
+          std::lock_guard<std::mutex> lock(node_data->lock);
+          if (node_data->tasks.empty())
+            break;
+          task = std::move(node_data->tasks.front());
+          node_data->tasks.pop_front();
+        }
+        ran_any = true;
+        if (task.message)
+          EXPECT_EQ(OK, node->AcceptMessage(std::move(task.message)));
+        else
+          ReadMessages(node, nullptr, task.port);
       }
     }
-  }
-
-  std::thread threads[kNumThreads];
-
-  for (size_t i = 0; i < kNumThreads; ++i)
-    threads[i] = std::thread(ThreadFunc, i);
-
-  KickOffTest();
+  } while (ran_any);
+}
 
-  for (size_t i = 0; i < kNumThreads; ++i)
-    threads[i].join();
+// Sums the wait time and contended acquisitions of every lock site.
+void GetTotalLockWait(uint64_t* wait_time_ns,
+                      uint64_t* num_contended_acquisitions) {
+  std::vector<LockSiteProfile> profiles;
+  GetLockSiteProfiles(&profiles);
+  *wait_time_ns = 0;
+  *num_contended_acquisitions = 0;
+  for (const LockSiteProfile& profile : profiles) {
+    *wait_time_ns += profile.total_wait_time_ns;
+    *num_contended_acquisitions += profile.num_contended_acquisitions;
+  }
+}
 
-  for (size_t i = 0; i < kNumThreads; ++i)
-    delete kThreadData[i];
+void RunConfig(const StressConfig& config) {
+  StressRun run(config);
+
+  uint64_t wait_time_before, contended_before;
+  GetTotalLockWait(&wait_time_before, &contended_before);
+  double seconds = std::chrono::duration<double>(run.Run()).count();
+  uint64_t wait_time_after, contended_after;
+  GetTotalLockWait(&wait_time_after, &contended_after);
+
+  printf("%u,%u,%u,%u,%.0f,%.0f,",
+         static_cast<unsigned>(config.num_threads),
+         static_cast<unsigned>(config.num_nodes),
+         static_cast<unsigned>(config.message_size), config.transfer_one_in,
+         kMessagesPerConfig / seconds, run.num_port_transfers() / seconds);
+  if (IsLockProfilingEnabled()) {
+    printf("%.3f,%llu\n", (wait_time_after - wait_time_before) / 1e6,
+           static_cast<unsigned long long>(contended_after - contended_before));
+  } else {
+    printf(",\n");
+  }
+  fflush(stdout);
+}
 
-  for (size_t i = 0; i < kNumNodes; ++i)
-    delete kNodeData[i];
+// Each node needs a thread of its own to run its queue, so configurations
+// with more nodes than threads are skipped.
+TEST(ThreadedStressTest, ScalingSweep) {
+  printf("threads,nodes,message_bytes,transfer_one_in,messages_per_sec,"
+         "port_transfers_per_sec,lock_wait_ms,contended_acquisitions\n");
+  for (size_t num_threads : kNumThreads) {
+    for (size_t num_nodes : kNumNodes) {
+      if (num_nodes > num_threads)
+        continue;
+      for (size_t message_size : kMessageSizes) {
+        for (uint32_t transfer_one_in : kTransferOneIn)
+          RunConfig({num_threads, num_nodes, message_size, transfer_one_in});
+      }
+    }
+  }
 }
 
+}  // namespace
+}  // namespace test
 }  // namespace ports
-
+}  // namespace edk
+}  // namespace mojo
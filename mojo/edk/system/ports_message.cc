@@ -4,11 +4,42 @@
 
 #include "mojo/edk/system/ports_message.h"
 
+#include <string.h>
+
+#include "mojo/edk/embedder/embedder_internal.h"
+#include "mojo/edk/system/core.h"
+#include "mojo/edk/system/message_for_transit.h"
 #include "mojo/edk/system/node_channel.h"
+#include "mojo/edk/system/node_controller.h"
+#include "mojo/edk/system/ports/event.h"
 
 namespace mojo {
 namespace edk {
 
+namespace {
+
+// The value of UserEventData::priority for a message marked with MarkBulk().
+const uint32_t kUserPriorityBulk = 1;
+
+Channel::Message::Priority GetChannelPriority(const ports::Message& message) {
+  uint32_t priority;
+  switch (ports::GetEventHeader(message)->type) {
+    case ports::EventType::kUser:
+      priority = ports::GetEventData<ports::UserEventData>(message)->priority;
+      break;
+    case ports::EventType::kUserBroadcast:
+      priority =
+          ports::GetEventData<ports::BroadcastEventData>(message)->priority;
+      break;
+    default:
+      return Channel::Message::kPriorityControl;
+  }
+  return priority == kUserPriorityBulk ? Channel::Message::kPriorityBulk
+                                       : Channel::Message::kPriorityInteractive;
+}
+
+}  // namespace
+
 PortsMessage::PortsMessage(size_t num_header_bytes,
                            size_t num_payload_bytes,
                            size_t num_ports_bytes,
@@ -20,11 +51,14 @@ PortsMessage::PortsMessage(size_t num_header_bytes,
                      num_ports_bytes) {
   size_t size = num_header_bytes + num_payload_bytes + num_ports_bytes;
 
-  void* ptr;
-  channel_message_ = NodeChannel::CreatePortsMessage(
-      size, &ptr, std::move(platform_handles));
+  handles_ = std::move(platform_handles);
+  if (size <= kMaxInlineBytes) {
+    start_ = reinterpret_cast<char*>(inline_bytes_);
+  } else {
+    local_bytes_ = MessagePool::Allocate(size);
+    start_ = static_cast<char*>(local_bytes_);
+  }
 
-  start_ = static_cast<char*>(ptr);
   if (bytes) {
     DCHECK_EQ(num_bytes,
               num_header_bytes + num_payload_bytes + num_ports_bytes);
@@ -32,7 +66,113 @@ PortsMessage::PortsMessage(size_t num_header_bytes,
   }
 }
 
-PortsMessage::~PortsMessage() {}
+PortsMessage::PortsMessage(size_t num_header_bytes,
+                           size_t num_payload_bytes,
+                           size_t num_ports_bytes,
+                           Channel::MessagePtr channel_message)
+    : ports::Message(num_header_bytes,
+                     num_payload_bytes,
+                     num_ports_bytes),
+      channel_message_(std::move(channel_message)) {
+  void* data;
+  size_t num_data_bytes;
+  NodeChannel::GetPortsMessageData(channel_message_.get(), &data,
+                                   &num_data_bytes);
+  DCHECK_EQ(num_data_bytes,
+            num_header_bytes + num_payload_bytes + num_ports_bytes);
+  start_ = static_cast<char*>(data);
+}
+
+PortsMessage::~PortsMessage() {
+  if (!local_dispatchers_.empty()) {
+    NodeController::ScopedPortClosureBatch batch(
+        internal::g_core->node_controller());
+    for (const scoped_refptr<Dispatcher>& dispatcher : local_dispatchers_) {
+      if (dispatcher)
+        dispatcher->Close();
+    }
+  }
+  MessagePool::Free(local_bytes_);
+}
+
+PlatformHandle* PortsMessage::handles() {
+  if (!is_local())
+    return channel_message_->handles();
+  return handles_ && !handles_->empty() ? handles_->data() : nullptr;
+}
+
+size_t PortsMessage::num_handles() const {
+  if (!is_local())
+    return channel_message_->num_handles();
+  return handles_ ? handles_->size() : 0;
+}
+
+void PortsMessage::SetHandles(ScopedPlatformHandleVectorPtr handles) {
+  if (is_local())
+    handles_ = std::move(handles);
+  else
+    channel_message_->SetHandles(std::move(handles));
+}
+
+void PortsMessage::SetLocalDispatchers(
+    std::vector<scoped_refptr<Dispatcher>> dispatchers) {
+  DCHECK(is_local());
+  local_dispatchers_ = std::move(dispatchers);
+}
+
+void* PortsMessage::ReplaceLocalPayload(size_t num_payload_bytes) {
+  DCHECK(is_local());
+  size_t num_prefix_bytes = num_header_bytes_ + num_ports_bytes_;
+  size_t size = num_prefix_bytes + num_payload_bytes;
+  if (size > kMaxInlineBytes &&
+      size > num_prefix_bytes + num_payload_bytes_) {
+    void* bytes = MessagePool::Allocate(size);
+    memcpy(bytes, start_, num_prefix_bytes);
+    MessagePool::Free(local_bytes_);
+    local_bytes_ = bytes;
+    start_ = static_cast<char*>(local_bytes_);
+  }
+  num_payload_bytes_ = num_payload_bytes;
+  return mutable_payload_bytes();
+}
+
+Channel::MessagePtr PortsMessage::TakeChannelMessage() {
+  // Dispatchers can only be attached as they are to messages staying on this
+  // node.
+  if (!local_dispatchers_.empty())
+    MessageForTransit::SerializeLocalDispatchers(this);
+
+  if (is_local()) {
+    size_t size = num_header_bytes_ + num_ports_bytes_ + num_payload_bytes_;
+    void* ptr;
+    channel_message_ = NodeChannel::CreatePortsMessage(
+        size, &ptr, std::move(handles_));
+    memcpy(ptr, start_, size);
+    start_ = static_cast<char*>(ptr);
+    MessagePool::Free(local_bytes_);
+    local_bytes_ = nullptr;
+  }
+  channel_message_->set_trace_id(ports::GetEventHeader(*this)->trace_id);
+  channel_message_->set_priority(GetChannelPriority(*this));
+  return std::move(channel_message_);
+}
+
+void PortsMessage::MarkBulk() {
+  DCHECK(ports::GetEventHeader(*this)->type == ports::EventType::kUser);
+  ports::GetMutableEventData<ports::UserEventData>(this)->priority =
+      kUserPriorityBulk;
+}
+
+void PortsMessage::TruncatePayload(size_t num_payload_bytes) {
+  DCHECK_LE(num_payload_bytes, num_payload_bytes_);
+  if (is_local()) {
+    num_payload_bytes_ = num_payload_bytes;
+    return;
+  }
+  channel_message_->TruncatePayload(channel_message_->payload_size() -
+                                    (num_payload_bytes_ - num_payload_bytes));
+  num_payload_bytes_ = num_payload_bytes;
+}
 
 }  // namespace edk
 }  // namespace mojo
@@ -5,38 +5,105 @@
 #ifndef MOJO_EDK_SYSTEM_PORTS_MESSAGE_H__
 #define MOJO_EDK_SYSTEM_PORTS_MESSAGE_H__
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include <utility>
+#include <vector>
 
+#include "base/memory/ref_counted.h"
 #include "mojo/edk/embedder/platform_handle_vector.h"
 #include "mojo/edk/system/channel.h"
+#include "mojo/edk/system/dispatcher.h"
+#include "mojo/edk/system/message_pool.h"
 #include "mojo/edk/system/ports/message.h"
 
 namespace mojo {
 namespace edk {
 
+// A ports::Message whose contents can be sent to another node as a
+// PORTS_MESSAGE Channel::Message. Messages created on this node are kept in
+// local storage -- inline if small, else in a MessagePool block -- and only
+// get a Channel::Message, with its framing, if they're sent to another node.
+// Local delivery and control events thus never allocate one. Messages received
+// from another node keep the Channel::Message they arrived in.
 class PortsMessage : public ports::Message {
  public:
+  // The largest message, headers and ports included, which is kept inline.
+  static const size_t kMaxInlineBytes = 192;
+
   PortsMessage(size_t num_header_bytes,
                size_t num_payload_bytes,
                size_t num_ports_bytes,
                const void* bytes,
                size_t num_bytes,
                ScopedPlatformHandleVectorPtr platform_handles);
+
+  // Adopts |channel_message|, a PORTS_MESSAGE received from a NodeChannel,
+  // without copying its contents.
+  PortsMessage(size_t num_header_bytes,
+               size_t num_payload_bytes,
+               size_t num_ports_bytes,
+               Channel::MessagePtr channel_message);
+
   ~PortsMessage() override;
 
-  PlatformHandle* handles() { return channel_message_->handles(); }
-  size_t num_handles() const { return channel_message_->num_handles(); }
+  // PortsMessages are created and destroyed for every message sent or
+  // received, so they are allocated from the MessagePool.
+  static void* operator new(size_t size) { return MessagePool::Allocate(size); }
+  static void operator delete(void* ptr) { MessagePool::Free(ptr); }
 
-  void SetHandles(ScopedPlatformHandleVectorPtr handles) {
-    channel_message_->SetHandles(std::move(handles));
-  }
+  PlatformHandle* handles();
+  size_t num_handles() const;
 
-  Channel::MessagePtr TakeChannelMessage() {
-    return std::move(channel_message_);
+  void SetHandles(ScopedPlatformHandleVectorPtr handles);
+
+  // Dispatchers attached to a message in local storage as they are, rather
+  // than serialized into it. See MessageForTransit::Create. They're indexed
+  // like the message's serialized dispatchers, with null entries for those
+  // which really were serialized. If the message leaves this node they're
+  // serialized first, and if it's destroyed unread they're closed.
+  void SetLocalDispatchers(std::vector<scoped_refptr<Dispatcher>> dispatchers);
+  const std::vector<scoped_refptr<Dispatcher>>& local_dispatchers() const {
+    return local_dispatchers_;
+  }
+  std::vector<scoped_refptr<Dispatcher>> TakeLocalDispatchers() {
+    return std::move(local_dispatchers_);
   }
 
+  // Gives a message in local storage a new payload of |num_payload_bytes|
+  // uninitialized bytes, keeping its header and ports. Returns the payload.
+  void* ReplaceLocalPayload(size_t num_payload_bytes);
+
+  // Returns a Channel::Message carrying this message, creating one if the
+  // contents are in local storage.
+  Channel::MessagePtr TakeChannelMessage();
+
+  // Marks a user message as part of a large transfer, so that every Channel
+  // it crosses writes it behind other queued messages. See
+  // Channel::Message::Priority. Messages are otherwise interactive, apart
+  // from ports control events.
+  void MarkBulk();
+
+  // Shrinks the payload to its first |num_payload_bytes| bytes, e.g. once a
+  // message allocated for the largest possible payload has been filled in.
+  void TruncatePayload(size_t num_payload_bytes);
+
  private:
+  bool is_local() const { return !channel_message_; }
+
   Channel::MessagePtr channel_message_;
+
+  // Platform handles attached to a message in local storage.
+  ScopedPlatformHandleVectorPtr handles_;
+
+  std::vector<scoped_refptr<Dispatcher>> local_dispatchers_;
+
+  // Storage for local contents too large to keep inline.
+  void* local_bytes_ = nullptr;
+
+  // Storage for inline contents, aligned like a Channel::Message payload.
+  uint64_t inline_bytes_[kMaxInlineBytes / sizeof(uint64_t)];
 };
 
 }  // namespace edk
@@ -0,0 +1,90 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/ports_message.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include <string>
+
+#include "mojo/edk/system/node_channel.h"
+#include "mojo/edk/system/ports/event.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace mojo {
+namespace edk {
+namespace {
+
+// Fills a message with a recognizable pattern and checks that the Channel
+// message handed out for it carries the same bytes.
+void CheckChannelMessage(size_t num_payload_bytes) {
+  const size_t kNumHeaderBytes = 16;
+  PortsMessage message(kNumHeaderBytes, num_payload_bytes, 0, nullptr, 0,
+                       nullptr);
+  size_t num_bytes = kNumHeaderBytes + num_payload_bytes;
+  std::string expected(num_bytes, '\0');
+  for (size_t i = 0; i < num_bytes; ++i)
+    expected[i] = static_cast<char>(i);
+  memcpy(message.mutable_header_bytes(), expected.data(), num_bytes);
+  EXPECT_EQ(0u, message.num_handles());
+
+  Channel::MessagePtr channel_message = message.TakeChannelMessage();
+  ASSERT_TRUE(channel_message);
+
+  void* data;
+  size_t num_data_bytes;
+  NodeChannel::GetPortsMessageData(channel_message.get(), &data,
+                                   &num_data_bytes);
+  ASSERT_EQ(num_bytes, num_data_bytes);
+  EXPECT_EQ(0, memcmp(expected.data(), data, num_bytes));
+}
+
+TEST(PortsMessageTest, LocalAndChannelStorage) {
+  // Inline and pooled local storage both yield the same Channel message.
+  CheckChannelMessage(0);
+  CheckChannelMessage(PortsMessage::kMaxInlineBytes - 16);
+  CheckChannelMessage(PortsMessage::kMaxInlineBytes - 15);
+  CheckChannelMessage(4096);
+  CheckChannelMessage(65536);
+}
+
+TEST(PortsMessageTest, TruncateInlinePayload) {
+  PortsMessage message(16, 64, 0, nullptr, 0, nullptr);
+  message.TruncatePayload(10);
+  EXPECT_EQ(10u, message.num_payload_bytes());
+
+  Channel::MessagePtr channel_message = message.TakeChannelMessage();
+  void* data;
+  size_t num_data_bytes;
+  NodeChannel::GetPortsMessageData(channel_message.get(), &data,
+                                   &num_data_bytes);
+  EXPECT_EQ(26u, num_data_bytes);
+}
+
+Channel::Message::Priority GetPriority(ports::EventType type, bool bulk) {
+  PortsMessage message(sizeof(ports::EventHeader) +
+                           sizeof(ports::UserEventData),
+                       8, 0, nullptr, 0, nullptr);
+  memset(message.mutable_header_bytes(), 0, message.num_header_bytes());
+  ports::GetMutableEventHeader(&message)->type = type;
+  if (bulk)
+    message.MarkBulk();
+  return message.TakeChannelMessage()->priority();
+}
+
+TEST(PortsMessageTest, ChannelPriority) {
+  EXPECT_EQ(Channel::Message::kPriorityInteractive,
+            GetPriority(ports::EventType::kUser, false));
+  EXPECT_EQ(Channel::Message::kPriorityBulk,
+            GetPriority(ports::EventType::kUser, true));
+  EXPECT_EQ(Channel::Message::kPriorityInteractive,
+            GetPriority(ports::EventType::kUserBroadcast, false));
+  EXPECT_EQ(Channel::Message::kPriorityControl,
+            GetPriority(ports::EventType::kObserveClosure, false));
+}
+
+}  // namespace
+}  // namespace edk
+}  // namespace mojo
@@ -0,0 +1,28 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/profiled_lock.h"
+
+namespace mojo {
+namespace edk {
+
+void GetLockSiteProfiles(std::vector<LockSiteProfile>* profiles) {
+  std::vector<ports::LockSiteProfile> ports_profiles;
+  ports::GetLockSiteProfiles(&ports_profiles);
+  for (const ports::LockSiteProfile& ports_profile : ports_profiles) {
+    LockSiteProfile profile;
+    profile.name = ports_profile.name;
+    profile.num_acquisitions = ports_profile.num_acquisitions;
+    profile.num_contended_acquisitions =
+        ports_profile.num_contended_acquisitions;
+    profile.total_wait_time_ns = ports_profile.total_wait_time_ns;
+    profile.max_wait_time_ns = ports_profile.max_wait_time_ns;
+    profile.total_hold_time_ns = ports_profile.total_hold_time_ns;
+    profile.max_hold_time_ns = ports_profile.max_hold_time_ns;
+    profiles->push_back(profile);
+  }
+}
+
+}  // namespace edk
+}  // namespace mojo
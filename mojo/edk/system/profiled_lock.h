@@ -0,0 +1,33 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_SYSTEM_PROFILED_LOCK_H_
+#define MOJO_EDK_SYSTEM_PROFILED_LOCK_H_
+
+#include <vector>
+
+#include "mojo/edk/embedder/lock_profile.h"
+#include "mojo/edk/system/ports/profiled_lock.h"
+
+namespace mojo {
+namespace edk {
+
+// The EDK uses the same profiled locks as ports, which own them so as not to
+// depend on the EDK. See ports/profiled_lock.h.
+using ports::ProfiledLock;
+using ports::ProfiledAutoLock;
+using ports::ProfiledAutoUnlock;
+using ports::ProfiledCompactLock;
+using ports::ProfiledCompactAutoLock;
+using ports::ProfiledMutex;
+using ports::IsLockProfilingEnabled;
+
+// Appends the profile of every lock site used so far, by ports or the EDK, to
+// |profiles|. Empty unless IsLockProfilingEnabled().
+void GetLockSiteProfiles(std::vector<LockSiteProfile>* profiles);
+
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_SYSTEM_PROFILED_LOCK_H_
@@ -0,0 +1,117 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/profiled_lock.h"
+
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace mojo {
+namespace edk {
+namespace {
+
+const LockSiteProfile* FindProfile(const std::vector<LockSiteProfile>& profiles,
+                                   const char* name) {
+  for (const LockSiteProfile& profile : profiles) {
+    if (profile.name == name)
+      return &profile;
+  }
+  return nullptr;
+}
+
+TEST(ProfiledLockTest, Basic) {
+  ProfiledLock lock("ProfiledLockTest::Basic");
+  {
+    ProfiledAutoLock locker(lock);
+    lock.AssertAcquired();
+    {
+      ProfiledAutoUnlock unlocker(lock);
+      EXPECT_TRUE(lock.Try());
+      lock.Release();
+    }
+  }
+
+  ProfiledMutex mutex("ProfiledLockTest::BasicMutex");
+  {
+    std::lock_guard<ProfiledMutex> locker(mutex);
+  }
+  EXPECT_TRUE(mutex.try_lock());
+  mutex.unlock();
+
+  std::vector<LockSiteProfile> profiles;
+  GetLockSiteProfiles(&profiles);
+  const LockSiteProfile* lock_profile =
+      FindProfile(profiles, "ProfiledLockTest::Basic");
+  const LockSiteProfile* mutex_profile =
+      FindProfile(profiles, "ProfiledLockTest::BasicMutex");
+  if (!IsLockProfilingEnabled()) {
+    EXPECT_TRUE(profiles.empty());
+    return;
+  }
+
+  ASSERT_TRUE(lock_profile);
+  EXPECT_EQ(3u, lock_profile->num_acquisitions);
+  EXPECT_EQ(0u, lock_profile->num_contended_acquisitions);
+  ASSERT_TRUE(mutex_profile);
+  EXPECT_EQ(2u, mutex_profile->num_acquisitions);
+  EXPECT_EQ(0u, mutex_profile->num_contended_acquisitions);
+}
+
+TEST(ProfiledLockTest, SitesAreSharedByName) {
+  {
+    ProfiledMutex a("ProfiledLockTest::Shared");
+    ProfiledMutex b("ProfiledLockTest::Shared");
+    std::lock_guard<ProfiledMutex> a_locker(a);
+    std::lock_guard<ProfiledMutex> b_locker(b);
+  }
+
+  std::vector<LockSiteProfile> profiles;
+  GetLockSiteProfiles(&profiles);
+  if (!IsLockProfilingEnabled())
+    return;
+
+  const LockSiteProfile* profile =
+      FindProfile(profiles, "ProfiledLockTest::Shared");
+  ASSERT_TRUE(profile);
+  EXPECT_EQ(2u, profile->num_acquisitions);
+  EXPECT_GE(profile->total_hold_time_ns, profile->max_hold_time_ns);
+}
+
+TEST(ProfiledLockTest, CompactLock) {
+  EXPECT_EQ(4u, sizeof(ports::CompactLock));
+
+  ProfiledCompactLock lock("ProfiledLockTest::CompactLock");
+  {
+    ProfiledCompactAutoLock locker(lock);
+    lock.AssertAcquired();
+    EXPECT_FALSE(lock.Try());
+  }
+  EXPECT_TRUE(lock.Try());
+  lock.Release();
+
+  // Enough threads and iterations to make some of them park.
+  const int kNumThreads = 8;
+  const int kNumIncrements = 100000;
+  ProfiledMutex mutex("ProfiledLockTest::CompactLockMutex");
+  int counter = 0;
+  std::vector<std::thread> threads;
+  for (int i = 0; i < kNumThreads; ++i) {
+    threads.emplace_back([&mutex, &counter] {
+      for (int j = 0; j < kNumIncrements; ++j) {
+        std::lock_guard<ProfiledMutex> locker(mutex);
+        ++counter;
+      }
+    });
+  }
+  for (auto& thread : threads)
+    thread.join();
+  EXPECT_EQ(kNumThreads * kNumIncrements, counter);
+}
+
+}  // namespace
+}  // namespace edk
+}  // namespace mojo
@@ -15,7 +15,9 @@
 #include "mojo/edk/embedder/embedder_internal.h"
 #include "mojo/edk/embedder/platform_support.h"
 #include "mojo/edk/system/configuration.h"
+#include "mojo/edk/system/memory_placement.h"
 #include "mojo/edk/system/options_validation.h"
+#include "mojo/edk/system/shared_buffer_mapping_cache.h"
 #include "mojo/public/c/system/macros.h"
 
 namespace mojo {
@@ -25,8 +27,23 @@ namespace {
 
 struct MOJO_ALIGNAS(8) SerializedSharedBufferDispatcher {
   size_t num_bytes;
+  uint32_t placement;
+  uint32_t padding;
 };
 
+// Maps creation flags to MemoryPlacement hints.
+uint32_t GetPlacement(MojoCreateSharedBufferOptionsFlags flags) {
+  uint32_t placement = MEMORY_PLACEMENT_DEFAULT;
+  if (flags & MOJO_CREATE_SHARED_BUFFER_OPTIONS_FLAG_HUGE_PAGES)
+    placement |= MEMORY_PLACEMENT_HUGE_PAGES;
+  if (flags & MOJO_CREATE_SHARED_BUFFER_OPTIONS_FLAG_NUMA_LOCAL)
+    placement |= MEMORY_PLACEMENT_NUMA_LOCAL;
+  return placement;
+}
+
+const uint32_t kKnownPlacements =
+    MEMORY_PLACEMENT_HUGE_PAGES | MEMORY_PLACEMENT_NUMA_LOCAL;
+
 }  // namespace
 
 // static
@@ -40,7 +57,8 @@ MojoResult SharedBufferDispatcher::ValidateCreateOptions(
     const MojoCreateSharedBufferOptions* in_options,
     MojoCreateSharedBufferOptions* out_options) {
   const MojoCreateSharedBufferOptionsFlags kKnownFlags =
-      MOJO_CREATE_SHARED_BUFFER_OPTIONS_FLAG_NONE;
+      MOJO_CREATE_SHARED_BUFFER_OPTIONS_FLAG_HUGE_PAGES |
+      MOJO_CREATE_SHARED_BUFFER_OPTIONS_FLAG_NUMA_LOCAL;
 
   *out_options = kDefaultCreateOptions;
   if (!in_options)
@@ -66,7 +84,7 @@ MojoResult SharedBufferDispatcher::ValidateCreateOptions(
 // static
 MojoResult SharedBufferDispatcher::Create(
     PlatformSupport* platform_support,
-    const MojoCreateSharedBufferOptions& /*validated_options*/,
+    const MojoCreateSharedBufferOptions& validated_options,
     uint64_t num_bytes,
     scoped_refptr<SharedBufferDispatcher>* result) {
   if (!num_bytes)
@@ -79,7 +97,8 @@ MojoResult SharedBufferDispatcher::Create(
   if (!shared_buffer)
     return MOJO_RESULT_RESOURCE_EXHAUSTED;
 
-  *result = CreateInternal(std::move(shared_buffer));
+  *result = CreateInternal(std::move(shared_buffer),
+                           GetPlacement(validated_options.flags));
   return MOJO_RESULT_OK;
 }
 
@@ -103,6 +122,11 @@ scoped_refptr<SharedBufferDispatcher> SharedBufferDispatcher::Deserialize(
         << "Invalid serialized shared buffer dispatcher (invalid num_bytes)";
     return nullptr;
   }
+  if (serialization->placement & ~kKnownPlacements) {
+    LOG(ERROR)
+        << "Invalid serialized shared buffer dispatcher (invalid placement)";
+    return nullptr;
+  }
 
   if (!platform_handles || num_platform_handles != 1 || num_ports) {
     LOG(ERROR)
@@ -127,7 +151,7 @@ scoped_refptr<SharedBufferDispatcher> SharedBufferDispatcher::Deserialize(
     return nullptr;
   }
 
-  return CreateInternal(std::move(shared_buffer));
+  return CreateInternal(std::move(shared_buffer), serialization->placement);
 }
 
 Dispatcher::Type SharedBufferDispatcher::GetType() const {
@@ -153,7 +177,7 @@ MojoResult SharedBufferDispatcher::DuplicateBufferHandle(
 
   // Note: Since this is "duplicate", we keep our ref to |shared_buffer_|.
   base::AutoLock lock(lock_);
-  *new_dispatcher = CreateInternal(shared_buffer_);
+  *new_dispatcher = CreateInternal(shared_buffer_, placement_);
   return MOJO_RESULT_OK;
 }
 
@@ -174,8 +198,9 @@ MojoResult SharedBufferDispatcher::MapBuffer(
     return MOJO_RESULT_INVALID_ARGUMENT;
 
   DCHECK(mapping);
-  *mapping = shared_buffer_->MapNoCheck(static_cast<size_t>(offset),
-                                        static_cast<size_t>(num_bytes));
+  *mapping = SharedBufferMappingCache::Get()->Map(
+      shared_buffer_, static_cast<size_t>(offset),
+      static_cast<size_t>(num_bytes), placement_);
   if (!*mapping)
     return MOJO_RESULT_RESOURCE_EXHAUSTED;
 
@@ -199,6 +224,8 @@ bool SharedBufferDispatcher::EndSerializeAndClose(
   {
     base::AutoLock lock(lock_);
     serialization->num_bytes = shared_buffer_->GetNumBytes();
+    serialization->placement = placement_;
+    serialization->padding = 0;
     ScopedPlatformHandle handle(
         shared_buffer_->HasOneRef()
             ? shared_buffer_->PassPlatformHandle()
@@ -215,8 +242,9 @@ bool SharedBufferDispatcher::EndSerializeAndClose(
 }
 
 SharedBufferDispatcher::SharedBufferDispatcher(
-    scoped_refptr<PlatformSharedBuffer> shared_buffer)
-    : shared_buffer_(shared_buffer) {
+    scoped_refptr<PlatformSharedBuffer> shared_buffer,
+    uint32_t placement)
+    : shared_buffer_(shared_buffer), placement_(placement) {
   DCHECK(shared_buffer_);
 }
 
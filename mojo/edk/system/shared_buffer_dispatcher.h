@@ -16,6 +16,19 @@
 #include "mojo/edk/system/dispatcher.h"
 #include "mojo/edk/system/system_impl_export.h"
 
+// Placement hints for the buffer's memory, which apply wherever it's mapped.
+// Both are best effort and only honored on Linux and Android. These extend the
+// flags in "mojo/public/c/system/buffer.h".
+//
+// Asks for the buffer to be backed by transparent huge pages, cutting TLB
+// misses on large buffers which are accessed all over.
+#define MOJO_CREATE_SHARED_BUFFER_OPTIONS_FLAG_HUGE_PAGES \
+  ((MojoCreateSharedBufferOptionsFlags)1 << 0)
+// Asks for the buffer's pages to be placed on the NUMA node of the thread
+// which first maps it.
+#define MOJO_CREATE_SHARED_BUFFER_OPTIONS_FLAG_NUMA_LOCAL \
+  ((MojoCreateSharedBufferOptionsFlags)1 << 1)
+
 namespace mojo {
 
 namespace edk {
@@ -76,13 +89,14 @@ class MOJO_SYSTEM_IMPL_EXPORT SharedBufferDispatcher final : public Dispatcher {
 
  private:
   static scoped_refptr<SharedBufferDispatcher> CreateInternal(
-      scoped_refptr<PlatformSharedBuffer> shared_buffer) {
+      scoped_refptr<PlatformSharedBuffer> shared_buffer,
+      uint32_t placement) {
     return make_scoped_refptr(
-        new SharedBufferDispatcher(std::move(shared_buffer)));
+        new SharedBufferDispatcher(std::move(shared_buffer), placement));
   }
 
-  explicit SharedBufferDispatcher(
-      scoped_refptr<PlatformSharedBuffer> shared_buffer);
+  SharedBufferDispatcher(scoped_refptr<PlatformSharedBuffer> shared_buffer,
+                         uint32_t placement);
   ~SharedBufferDispatcher() override;
 
   // Validates and/or sets default options for
@@ -99,6 +113,9 @@ class MOJO_SYSTEM_IMPL_EXPORT SharedBufferDispatcher final : public Dispatcher {
 
   scoped_refptr<PlatformSharedBuffer> shared_buffer_;
 
+  // MemoryPlacement hints for mappings of |shared_buffer_|.
+  const uint32_t placement_;
+
   DISALLOW_COPY_AND_ASSIGN(SharedBufferDispatcher);
 };
 
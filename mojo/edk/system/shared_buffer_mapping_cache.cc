@@ -0,0 +1,161 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/shared_buffer_mapping_cache.h"
+
+#include <utility>
+#include <vector>
+
+#include "base/lazy_instance.h"
+#include "base/logging.h"
+#include "mojo/edk/system/memory_placement.h"
+
+namespace mojo {
+namespace edk {
+
+namespace {
+
+// Enough for a few sets of buffers which are cycled through, as a frame
+// pipeline does, while bounding the address space held by unused mappings.
+const size_t kMaxIdleMappings = 16;
+
+class GlobalCache : public SharedBufferMappingCache {
+ public:
+  GlobalCache() : SharedBufferMappingCache(kMaxIdleMappings) {}
+};
+
+base::LazyInstance<GlobalCache>::Leaky g_cache = LAZY_INSTANCE_INITIALIZER;
+
+}  // namespace
+
+struct SharedBufferMappingCache::Entry {
+  scoped_refptr<PlatformSharedBuffer> buffer;
+
+  // Maps the whole of |buffer|.
+  scoped_ptr<PlatformSharedBufferMapping> mapping;
+
+  size_t num_views = 0;
+
+  // Valid while |num_views| is zero.
+  std::list<PlatformSharedBuffer*>::iterator idle_position;
+};
+
+// A map of part of a buffer, in terms of its cached mapping.
+class SharedBufferMappingCache::View : public PlatformSharedBufferMapping {
+ public:
+  View(SharedBufferMappingCache* cache,
+       Entry* entry,
+       size_t offset,
+       size_t num_bytes)
+      : cache_(cache),
+        entry_(entry),
+        base_(static_cast<char*>(entry->mapping->GetBase()) + offset),
+        num_bytes_(num_bytes) {}
+
+  ~View() override { cache_->ReleaseView(entry_); }
+
+  // PlatformSharedBufferMapping:
+  void* GetBase() const override { return base_; }
+  size_t GetLength() const override { return num_bytes_; }
+
+ private:
+  SharedBufferMappingCache* const cache_;
+  Entry* const entry_;
+  void* const base_;
+  const size_t num_bytes_;
+
+  DISALLOW_COPY_AND_ASSIGN(View);
+};
+
+// static
+const size_t SharedBufferMappingCache::kMaxCachedBufferBytes;
+
+SharedBufferMappingCache::SharedBufferMappingCache(size_t max_idle_mappings)
+    : max_idle_mappings_(max_idle_mappings) {}
+
+SharedBufferMappingCache::~SharedBufferMappingCache() {
+  DCHECK_EQ(entries_.size(), idle_buffers_.size());
+}
+
+// static
+SharedBufferMappingCache* SharedBufferMappingCache::Get() {
+  return g_cache.Pointer();
+}
+
+scoped_ptr<PlatformSharedBufferMapping> SharedBufferMappingCache::Map(
+    const scoped_refptr<PlatformSharedBuffer>& buffer,
+    size_t offset,
+    size_t num_bytes,
+    uint32_t placement) {
+  DCHECK(buffer->IsValidMap(offset, num_bytes));
+  size_t buffer_num_bytes = buffer->GetNumBytes();
+  if (buffer_num_bytes > kMaxCachedBufferBytes) {
+    scoped_ptr<PlatformSharedBufferMapping> mapping =
+        buffer->MapNoCheck(offset, num_bytes);
+    if (mapping)
+      ApplyMemoryPlacement(mapping->GetBase(), num_bytes, placement);
+    return mapping;
+  }
+
+  scoped_ptr<Entry> new_entry;
+  for (;;) {
+    {
+      base::AutoLock lock(lock_);
+      EntryMap::iterator it = entries_.find(buffer.get());
+      if (it == entries_.end() && new_entry) {
+        it = entries_.insert(
+            std::make_pair(buffer.get(), std::move(new_entry))).first;
+        it->second->idle_position = idle_buffers_.end();
+      }
+      if (it != entries_.end()) {
+        Entry* entry = it->second.get();
+        if (entry->num_views++ == 0 &&
+            entry->idle_position != idle_buffers_.end()) {
+          idle_buffers_.erase(entry->idle_position);
+          entry->idle_position = idle_buffers_.end();
+        }
+        return make_scoped_ptr(new View(this, entry, offset, num_bytes));
+      }
+    }
+
+    // Map the buffer without holding the lock. If another thread maps it in
+    // the meantime, its mapping wins and this one is unmapped.
+    new_entry.reset(new Entry);
+    new_entry->buffer = buffer;
+    new_entry->mapping = buffer->MapNoCheck(0, buffer_num_bytes);
+    if (!new_entry->mapping)
+      return nullptr;
+    ApplyMemoryPlacement(new_entry->mapping->GetBase(), buffer_num_bytes,
+                         placement);
+  }
+}
+
+size_t SharedBufferMappingCache::num_mappings() const {
+  base::AutoLock lock(lock_);
+  return entries_.size();
+}
+
+void SharedBufferMappingCache::ReleaseView(Entry* entry) {
+  // Evicted mappings are unmapped after the lock is released.
+  std::vector<scoped_ptr<Entry>> evicted_entries;
+  {
+    base::AutoLock lock(lock_);
+    DCHECK_GT(entry->num_views, 0u);
+    if (--entry->num_views > 0)
+      return;
+
+    entry->idle_position =
+        idle_buffers_.insert(idle_buffers_.end(), entry->buffer.get());
+    while (idle_buffers_.size() > max_idle_mappings_) {
+      EntryMap::iterator it = entries_.find(idle_buffers_.front());
+      DCHECK(it != entries_.end());
+      evicted_entries.push_back(std::move(it->second));
+      entries_.erase(it);
+      idle_buffers_.pop_front();
+    }
+  }
+}
+
+}  // namespace edk
+}  // namespace mojo
@@ -0,0 +1,88 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_SYSTEM_SHARED_BUFFER_MAPPING_CACHE_H_
+#define MOJO_EDK_SYSTEM_SHARED_BUFFER_MAPPING_CACHE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <list>
+#include <unordered_map>
+
+#include "base/macros.h"
+#include "base/memory/ref_counted.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/synchronization/lock.h"
+#include "mojo/edk/embedder/platform_shared_buffer.h"
+#include "mojo/edk/system/system_impl_export.h"
+
+namespace mojo {
+namespace edk {
+
+// Shares mappings of shared buffers between everything in the process which
+// maps them. The first map of a buffer maps the whole of it, and every map of
+// that buffer is then a view into the same mapping, refcounted by the views.
+//
+// When the last view of a buffer goes away its mapping is kept idle, so that
+// mapping the same buffer again costs no system calls. The least recently used
+// idle mappings are unmapped once there are more than |max_idle_mappings|.
+// An idle mapping keeps its buffer alive.
+//
+// Buffers are identified by their PlatformSharedBuffer, which duplicated
+// SharedBufferDispatchers share.
+class MOJO_SYSTEM_IMPL_EXPORT SharedBufferMappingCache {
+ public:
+  // Buffers larger than this are mapped directly rather than cached, so that a
+  // small map of a large buffer doesn't reserve address space for all of it.
+  static const size_t kMaxCachedBufferBytes = 64 * 1024 * 1024;
+
+  explicit SharedBufferMappingCache(size_t max_idle_mappings);
+
+  // Unmaps all idle mappings. There must be no views left.
+  ~SharedBufferMappingCache();
+
+  // Returns the process-wide cache.
+  static SharedBufferMappingCache* Get();
+
+  // Maps |num_bytes| of |buffer| from |offset|, which must be a valid map of
+  // it. If this has to map the buffer, |placement| is applied to the new
+  // mapping (see memory_placement.h). Returns null on failure. The returned
+  // mapping must not outlive the cache.
+  scoped_ptr<PlatformSharedBufferMapping> Map(
+      const scoped_refptr<PlatformSharedBuffer>& buffer,
+      size_t offset,
+      size_t num_bytes,
+      uint32_t placement);
+
+  // The number of buffers currently mapped, whether in use or idle.
+  size_t num_mappings() const;
+
+ private:
+  class View;
+  struct Entry;
+
+  using EntryMap =
+      std::unordered_map<PlatformSharedBuffer*, scoped_ptr<Entry>>;
+
+  // Called by a View when it's destroyed.
+  void ReleaseView(Entry* entry);
+
+  const size_t max_idle_mappings_;
+
+  // Guards the fields below.
+  mutable base::Lock lock_;
+
+  EntryMap entries_;
+
+  // Buffers whose mappings have no views, least recently used first.
+  std::list<PlatformSharedBuffer*> idle_buffers_;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedBufferMappingCache);
+};
+
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_SYSTEM_SHARED_BUFFER_MAPPING_CACHE_H_
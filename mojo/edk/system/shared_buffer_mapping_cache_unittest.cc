@@ -0,0 +1,119 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/shared_buffer_mapping_cache.h"
+
+#include <string.h>
+
+#include "base/logging.h"
+#include "base/macros.h"
+#include "mojo/edk/embedder/simple_platform_support.h"
+#include "mojo/edk/system/memory_placement.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace mojo {
+namespace edk {
+namespace {
+
+class SharedBufferMappingCacheTest : public testing::Test {
+ public:
+  SharedBufferMappingCacheTest() {}
+
+ protected:
+  scoped_refptr<PlatformSharedBuffer> CreateBuffer(size_t num_bytes) {
+    scoped_refptr<PlatformSharedBuffer> buffer(
+        platform_support_.CreateSharedBuffer(num_bytes));
+    CHECK(buffer);
+    return buffer;
+  }
+
+ private:
+  SimplePlatformSupport platform_support_;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedBufferMappingCacheTest);
+};
+
+TEST_F(SharedBufferMappingCacheTest, ViewsShareMapping) {
+  SharedBufferMappingCache cache(4);
+  scoped_refptr<PlatformSharedBuffer> buffer = CreateBuffer(100);
+
+  scoped_ptr<PlatformSharedBufferMapping> whole =
+      cache.Map(buffer, 0, 100, MEMORY_PLACEMENT_DEFAULT);
+  ASSERT_TRUE(whole);
+  EXPECT_EQ(100u, whole->GetLength());
+
+  scoped_ptr<PlatformSharedBufferMapping> part =
+      cache.Map(buffer, 10, 20, MEMORY_PLACEMENT_DEFAULT);
+  ASSERT_TRUE(part);
+  EXPECT_EQ(20u, part->GetLength());
+  EXPECT_EQ(static_cast<char*>(whole->GetBase()) + 10, part->GetBase());
+  EXPECT_EQ(1u, cache.num_mappings());
+
+  memset(whole->GetBase(), 'x', 100);
+  EXPECT_EQ('x', static_cast<char*>(part->GetBase())[0]);
+}
+
+TEST_F(SharedBufferMappingCacheTest, IdleMappingIsReused) {
+  SharedBufferMappingCache cache(4);
+  scoped_refptr<PlatformSharedBuffer> buffer = CreateBuffer(100);
+
+  scoped_ptr<PlatformSharedBufferMapping> mapping =
+      cache.Map(buffer, 0, 100, MEMORY_PLACEMENT_DEFAULT);
+  ASSERT_TRUE(mapping);
+  void* base = mapping->GetBase();
+  static_cast<char*>(base)[0] = 'y';
+  mapping.reset();
+
+  // The unused mapping is kept around for the next map of the buffer.
+  EXPECT_EQ(1u, cache.num_mappings());
+  mapping = cache.Map(buffer, 0, 100, MEMORY_PLACEMENT_DEFAULT);
+  ASSERT_TRUE(mapping);
+  EXPECT_EQ(base, mapping->GetBase());
+  EXPECT_EQ('y', static_cast<char*>(mapping->GetBase())[0]);
+}
+
+TEST_F(SharedBufferMappingCacheTest, PlacementHints) {
+  SharedBufferMappingCache cache(4);
+  const size_t kNumBytes = 4 * 1024 * 1024;
+  scoped_refptr<PlatformSharedBuffer> buffer = CreateBuffer(kNumBytes);
+
+  // The hints are best effort, but must leave the mapping usable.
+  scoped_ptr<PlatformSharedBufferMapping> mapping = cache.Map(
+      buffer, 0, kNumBytes,
+      MEMORY_PLACEMENT_HUGE_PAGES | MEMORY_PLACEMENT_NUMA_LOCAL);
+  ASSERT_TRUE(mapping);
+  memset(mapping->GetBase(), 'z', kNumBytes);
+  EXPECT_EQ('z', static_cast<char*>(mapping->GetBase())[kNumBytes - 1]);
+}
+
+TEST_F(SharedBufferMappingCacheTest, EvictsLeastRecentlyUsed) {
+  SharedBufferMappingCache cache(2);
+  scoped_refptr<PlatformSharedBuffer> buffers[] = {
+      CreateBuffer(100), CreateBuffer(100), CreateBuffer(100)};
+
+  // Mappings in use are never evicted.
+  scoped_ptr<PlatformSharedBufferMapping> mappings[3];
+  for (size_t i = 0; i < 3; ++i) {
+    mappings[i] = cache.Map(buffers[i], 0, 100, MEMORY_PLACEMENT_DEFAULT);
+    ASSERT_TRUE(mappings[i]);
+  }
+  EXPECT_EQ(3u, cache.num_mappings());
+
+  // Only the two most recently released mappings stay idle.
+  for (auto& mapping : mappings)
+    mapping.reset();
+  EXPECT_EQ(2u, cache.num_mappings());
+
+  // The first buffer's mapping was evicted, so mapping it again evicts the
+  // second's.
+  mappings[0] = cache.Map(buffers[0], 0, 100, MEMORY_PLACEMENT_DEFAULT);
+  ASSERT_TRUE(mappings[0]);
+  EXPECT_EQ(3u, cache.num_mappings());
+  mappings[0].reset();
+  EXPECT_EQ(2u, cache.num_mappings());
+}
+
+}  // namespace
+}  // namespace edk
+}  // namespace mojo
@@ -0,0 +1,152 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/shared_memory_ring.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include "base/atomicops.h"
+#include "base/logging.h"
+
+namespace mojo {
+namespace edk {
+
+using base::subtle::Atomic32;
+
+// Lives at the start of the ring's memory. The producer and consumer fields
+// are kept on separate cache lines.
+//
+// Offsets are free-running byte counts which wrap at 2^32; the ring index of
+// an offset is |offset & (capacity - 1)|.
+struct SharedMemoryRing::Control {
+  // Written only by the producer.
+  Atomic32 write_offset;
+  Atomic32 producer_waiting;
+  char padding0[56];
+
+  // Written only by the consumer.
+  Atomic32 read_offset;
+  Atomic32 consumer_waiting;
+  char padding1[56];
+};
+
+namespace {
+
+uint32_t LoadOffset(volatile const Atomic32* offset) {
+  return static_cast<uint32_t>(base::subtle::Acquire_Load(offset));
+}
+
+void StoreOffset(volatile Atomic32* offset, uint32_t value) {
+  base::subtle::Release_Store(offset, static_cast<Atomic32>(value));
+}
+
+}  // namespace
+
+// static
+size_t SharedMemoryRing::GetRequiredMemorySize(size_t capacity) {
+  return sizeof(Control) + capacity;
+}
+
+SharedMemoryRing::SharedMemoryRing(void* memory, size_t capacity)
+    : control_(static_cast<Control*>(memory)),
+      data_(static_cast<char*>(memory) + sizeof(Control)),
+      capacity_(static_cast<uint32_t>(capacity)),
+      write_offset_(LoadOffset(&control_->write_offset)),
+      read_offset_(LoadOffset(&control_->read_offset)) {
+  static_assert(sizeof(Control) == 128, "Unexpected Control size.");
+  DCHECK(capacity > 0 && (capacity & (capacity - 1)) == 0);
+  DCHECK_LE(capacity, 1u << 31);
+  DCHECK_EQ(0u, reinterpret_cast<uintptr_t>(memory) % 8);
+}
+
+SharedMemoryRing::~SharedMemoryRing() {}
+
+bool SharedMemoryRing::Write(const void* data,
+                             size_t num_bytes,
+                             size_t* num_bytes_written) {
+  uint32_t num_used_bytes =
+      write_offset_ - LoadOffset(&control_->read_offset);
+  if (num_used_bytes > capacity_)
+    return false;
+
+  size_t num_bytes_to_write =
+      std::min(num_bytes, static_cast<size_t>(capacity_ - num_used_bytes));
+  size_t index = write_offset_ & (capacity_ - 1);
+  size_t num_bytes_before_wrap =
+      std::min(num_bytes_to_write, capacity_ - index);
+  memcpy(data_ + index, data, num_bytes_before_wrap);
+  memcpy(data_, static_cast<const char*>(data) + num_bytes_before_wrap,
+         num_bytes_to_write - num_bytes_before_wrap);
+
+  write_offset_ += static_cast<uint32_t>(num_bytes_to_write);
+  StoreOffset(&control_->write_offset, write_offset_);
+  *num_bytes_written = num_bytes_to_write;
+  return true;
+}
+
+bool SharedMemoryRing::PrepareToWaitForSpace() {
+  base::subtle::NoBarrier_Store(&control_->producer_waiting, 1);
+  // Pairs with the barrier in TakeProducerWakeup(). Either the consumer sees
+  // the flag, or we see the space it freed.
+  base::subtle::MemoryBarrier();
+  if (write_offset_ - LoadOffset(&control_->read_offset) < capacity_) {
+    base::subtle::NoBarrier_Store(&control_->producer_waiting, 0);
+    return false;
+  }
+  return true;
+}
+
+bool SharedMemoryRing::TakeConsumerWakeup() {
+  base::subtle::MemoryBarrier();
+  return base::subtle::NoBarrier_Load(&control_->consumer_waiting) &&
+         base::subtle::NoBarrier_CompareAndSwap(
+             &control_->consumer_waiting, 1, 0) == 1;
+}
+
+bool SharedMemoryRing::Read(void* buffer,
+                            size_t capacity,
+                            size_t* num_bytes_read) {
+  uint32_t num_available_bytes =
+      LoadOffset(&control_->write_offset) - read_offset_;
+  if (num_available_bytes > capacity_)
+    return false;
+
+  size_t num_bytes_to_read =
+      std::min(capacity, static_cast<size_t>(num_available_bytes));
+  size_t index = read_offset_ & (capacity_ - 1);
+  size_t num_bytes_before_wrap =
+      std::min(num_bytes_to_read, capacity_ - index);
+  memcpy(buffer, data_ + index, num_bytes_before_wrap);
+  memcpy(static_cast<char*>(buffer) + num_bytes_before_wrap, data_,
+         num_bytes_to_read - num_bytes_before_wrap);
+
+  read_offset_ += static_cast<uint32_t>(num_bytes_to_read);
+  StoreOffset(&control_->read_offset, read_offset_);
+  *num_bytes_read = num_bytes_to_read;
+  return true;
+}
+
+bool SharedMemoryRing::PrepareToWaitForData() {
+  base::subtle::NoBarrier_Store(&control_->consumer_waiting, 1);
+  // Pairs with the barrier in TakeConsumerWakeup(). Either the producer sees
+  // the flag, or we see the data it wrote.
+  base::subtle::MemoryBarrier();
+  if (LoadOffset(&control_->write_offset) != read_offset_) {
+    base::subtle::NoBarrier_Store(&control_->consumer_waiting, 0);
+    return false;
+  }
+  return true;
+}
+
+bool SharedMemoryRing::TakeProducerWakeup() {
+  base::subtle::MemoryBarrier();
+  return base::subtle::NoBarrier_Load(&control_->producer_waiting) &&
+         base::subtle::NoBarrier_CompareAndSwap(
+             &control_->producer_waiting, 1, 0) == 1;
+}
+
+}  // namespace edk
+}  // namespace mojo
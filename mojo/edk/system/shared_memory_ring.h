@@ -0,0 +1,95 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_SYSTEM_SHARED_MEMORY_RING_H_
+#define MOJO_EDK_SYSTEM_SHARED_MEMORY_RING_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "base/macros.h"
+
+namespace mojo {
+namespace edk {
+
+// A single-producer, single-consumer byte ring in memory shared between two
+// processes. One end only ever calls the producer methods and the other end
+// only ever calls the consumer methods.
+//
+// The ring itself never blocks. Instead, each end can register that it is
+// about to go to sleep waiting on the other (PrepareToWaitForData() and
+// PrepareToWaitForSpace()), and the other end checks whether it must wake it
+// up after making progress (TakeConsumerWakeup() and TakeProducerWakeup()).
+// How the wakeup is delivered is up to the caller. Since a wakeup is only
+// needed when the other end is idle, a busy pair of ends exchanges data with
+// no system calls at all.
+//
+// The memory is writable by the other process, which must not be trusted.
+// Offsets read from shared memory are validated, and Read() and Write() fail
+// if they are inconsistent.
+class SharedMemoryRing {
+ public:
+  // Returns the number of bytes of memory needed for a ring which can hold
+  // |capacity| bytes. |capacity| must be a power of two no larger than 2^31.
+  static size_t GetRequiredMemorySize(size_t capacity);
+
+  // Uses |memory|, which must be GetRequiredMemorySize(|capacity|) bytes
+  // aligned to at least 8 bytes, for the ring. The memory must be zeroed
+  // before either end starts using it. Does not take ownership of |memory|.
+  SharedMemoryRing(void* memory, size_t capacity);
+  ~SharedMemoryRing();
+
+  size_t capacity() const { return capacity_; }
+
+  // Producer methods -------------------------------------------------------
+
+  // Copies as much of |data| as fits into the ring and sets
+  // |*num_bytes_written| to the number of bytes copied. Returns false if the
+  // ring is corrupt.
+  bool Write(const void* data, size_t num_bytes, size_t* num_bytes_written);
+
+  // Registers the producer as waiting for space. Returns false if space became
+  // available in the meantime, in which case the producer should not wait.
+  bool PrepareToWaitForSpace();
+
+  // To be called after writing. Returns true if the consumer is waiting for
+  // data and must be woken up. At most one caller is told to wake it up for
+  // each wait.
+  bool TakeConsumerWakeup();
+
+  // Consumer methods -------------------------------------------------------
+
+  // Copies up to |capacity| bytes out of the ring into |buffer| and sets
+  // |*num_bytes_read| to the number of bytes copied. Returns false if the ring
+  // is corrupt.
+  bool Read(void* buffer, size_t capacity, size_t* num_bytes_read);
+
+  // Registers the consumer as waiting for data. Returns false if data arrived
+  // in the meantime, in which case the consumer should not wait.
+  bool PrepareToWaitForData();
+
+  // To be called after reading. Returns true if the producer is waiting for
+  // space and must be woken up.
+  bool TakeProducerWakeup();
+
+ private:
+  struct Control;
+
+  Control* const control_;
+  char* const data_;
+  const uint32_t capacity_;
+
+  // The producer's and consumer's own copies of their offsets. The copies in
+  // shared memory are only ever written by their owner, so these are
+  // authoritative and immune to tampering by the other end.
+  uint32_t write_offset_;
+  uint32_t read_offset_;
+
+  DISALLOW_COPY_AND_ASSIGN(SharedMemoryRing);
+};
+
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_SYSTEM_SHARED_MEMORY_RING_H_
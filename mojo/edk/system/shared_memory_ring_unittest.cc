@@ -0,0 +1,162 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/shared_memory_ring.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "base/bind.h"
+#include "base/location.h"
+#include "base/threading/platform_thread.h"
+#include "base/threading/thread.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace mojo {
+namespace edk {
+namespace {
+
+const size_t kCapacity = 64;
+
+class SharedMemoryRingTest : public testing::Test {
+ public:
+  SharedMemoryRingTest()
+      : memory_(SharedMemoryRing::GetRequiredMemorySize(kCapacity) /
+                    sizeof(uint64_t),
+                0),
+        producer_(memory_.data(), kCapacity),
+        consumer_(memory_.data(), kCapacity) {}
+
+ protected:
+  // Simulates the other process scribbling over the shared control block.
+  void CorruptOffsets() { memset(memory_.data(), 0xAB, 128); }
+
+  std::vector<uint64_t> memory_;
+  SharedMemoryRing producer_;
+  SharedMemoryRing consumer_;
+
+ private:
+  DISALLOW_COPY_AND_ASSIGN(SharedMemoryRingTest);
+};
+
+TEST_F(SharedMemoryRingTest, WriteAndRead) {
+  const char kData[] = "hello";
+  size_t num_bytes;
+  ASSERT_TRUE(producer_.Write(kData, sizeof(kData), &num_bytes));
+  EXPECT_EQ(sizeof(kData), num_bytes);
+
+  char buffer[kCapacity];
+  ASSERT_TRUE(consumer_.Read(buffer, sizeof(buffer), &num_bytes));
+  EXPECT_EQ(sizeof(kData), num_bytes);
+  EXPECT_EQ(0, memcmp(kData, buffer, sizeof(kData)));
+
+  ASSERT_TRUE(consumer_.Read(buffer, sizeof(buffer), &num_bytes));
+  EXPECT_EQ(0u, num_bytes);
+}
+
+TEST_F(SharedMemoryRingTest, FullAndWrapAround) {
+  char data[kCapacity + 10];
+  for (size_t i = 0; i < sizeof(data); ++i)
+    data[i] = static_cast<char>(i);
+
+  // Only |kCapacity| bytes fit.
+  size_t num_bytes;
+  ASSERT_TRUE(producer_.Write(data, sizeof(data), &num_bytes));
+  EXPECT_EQ(kCapacity, num_bytes);
+  ASSERT_TRUE(producer_.Write(data, sizeof(data), &num_bytes));
+  EXPECT_EQ(0u, num_bytes);
+
+  char buffer[kCapacity];
+  ASSERT_TRUE(consumer_.Read(buffer, 20, &num_bytes));
+  EXPECT_EQ(20u, num_bytes);
+  EXPECT_EQ(0, memcmp(data, buffer, 20));
+
+  // This write wraps around the end of the ring.
+  ASSERT_TRUE(producer_.Write(data + kCapacity, 10, &num_bytes));
+  EXPECT_EQ(10u, num_bytes);
+
+  ASSERT_TRUE(consumer_.Read(buffer, sizeof(buffer), &num_bytes));
+  EXPECT_EQ(kCapacity - 10, num_bytes);
+  EXPECT_EQ(0, memcmp(data + 20, buffer, num_bytes));
+}
+
+TEST_F(SharedMemoryRingTest, Wakeups) {
+  // Nobody is waiting yet.
+  EXPECT_FALSE(producer_.TakeConsumerWakeup());
+  EXPECT_FALSE(consumer_.TakeProducerWakeup());
+
+  // The consumer may only wait when the ring is empty, and exactly one wakeup
+  // is handed out for the wait.
+  EXPECT_TRUE(consumer_.PrepareToWaitForData());
+  size_t num_bytes;
+  ASSERT_TRUE(producer_.Write("x", 1, &num_bytes));
+  EXPECT_TRUE(producer_.TakeConsumerWakeup());
+  EXPECT_FALSE(producer_.TakeConsumerWakeup());
+  EXPECT_FALSE(consumer_.PrepareToWaitForData());
+
+  // The producer may only wait when the ring is full.
+  EXPECT_FALSE(producer_.PrepareToWaitForSpace());
+  char data[kCapacity] = {};
+  ASSERT_TRUE(producer_.Write(data, sizeof(data), &num_bytes));
+  EXPECT_TRUE(producer_.PrepareToWaitForSpace());
+
+  char buffer[kCapacity];
+  ASSERT_TRUE(consumer_.Read(buffer, 1, &num_bytes));
+  EXPECT_TRUE(consumer_.TakeProducerWakeup());
+  EXPECT_FALSE(consumer_.TakeProducerWakeup());
+}
+
+TEST_F(SharedMemoryRingTest, CorruptOffsets) {
+  CorruptOffsets();
+  size_t num_bytes;
+  char buffer[kCapacity];
+  EXPECT_FALSE(producer_.Write("x", 1, &num_bytes));
+  EXPECT_FALSE(consumer_.Read(buffer, sizeof(buffer), &num_bytes));
+}
+
+const uint32_t kNumStreamBytes = 1 << 20;
+
+void ProduceStream(SharedMemoryRing* ring) {
+  uint32_t offset = 0;
+  while (offset < kNumStreamBytes) {
+    char data[37];
+    for (size_t i = 0; i < sizeof(data); ++i)
+      data[i] = static_cast<char>(offset + i);
+    size_t num_bytes;
+    ASSERT_TRUE(ring->Write(data, std::min<size_t>(sizeof(data),
+                                                   kNumStreamBytes - offset),
+                            &num_bytes));
+    if (!num_bytes)
+      base::PlatformThread::YieldCurrentThread();
+    offset += static_cast<uint32_t>(num_bytes);
+  }
+}
+
+TEST_F(SharedMemoryRingTest, Stream) {
+  base::Thread thread("SharedMemoryRingTest");
+  ASSERT_TRUE(thread.Start());
+  thread.task_runner()->PostTask(
+      FROM_HERE, base::Bind(&ProduceStream, base::Unretained(&producer_)));
+
+  uint32_t offset = 0;
+  while (offset < kNumStreamBytes) {
+    char buffer[23];
+    size_t num_bytes;
+    ASSERT_TRUE(consumer_.Read(buffer, sizeof(buffer), &num_bytes));
+    for (size_t i = 0; i < num_bytes; ++i)
+      ASSERT_EQ(static_cast<char>(offset + i), buffer[i]);
+    if (!num_bytes)
+      base::PlatformThread::YieldCurrentThread();
+    offset += static_cast<uint32_t>(num_bytes);
+  }
+
+  thread.Stop();
+}
+
+}  // namespace
+}  // namespace edk
+}  // namespace mojo
@@ -0,0 +1,146 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/task_runner_waiter.h"
+
+#include <utility>
+
+#include "base/bind.h"
+#include "base/location.h"
+#include "base/logging.h"
+
+namespace mojo {
+namespace edk {
+
+namespace {
+
+bool RunAndContinue(const TaskRunnerWaiter::AwakeCallback& callback,
+                    MojoResult result) {
+  callback.Run(result);
+  return true;
+}
+
+}  // namespace
+
+// static
+TaskRunnerWaiter::ConditionalCallback TaskRunnerWaiter::Unconditionally(
+    const AwakeCallback& callback) {
+  return base::Bind(&RunAndContinue, callback);
+}
+
+TaskRunnerWaiter::TaskRunnerWaiter(
+    scoped_refptr<Dispatcher> dispatcher,
+    MojoHandleSignals signals,
+    bool persistent,
+    scoped_refptr<base::TaskRunner> task_runner,
+    const ConditionalCallback& callback,
+    const base::Closure& on_done)
+    : dispatcher_(dispatcher),
+      signals_(signals),
+      persistent_(persistent),
+      task_runner_(task_runner),
+      callback_(callback),
+      on_done_(on_done) {}
+
+MojoResult TaskRunnerWaiter::Start() {
+  MojoResult rv = Register();
+  if (rv == MOJO_RESULT_ALREADY_EXISTS) {
+    PostCallback(MOJO_RESULT_OK);
+    return MOJO_RESULT_OK;
+  }
+  return rv;
+}
+
+void TaskRunnerWaiter::Cancel() {
+  bool was_registered = false;
+  {
+    base::AutoLock lock(lock_);
+    if (cancelled_)
+      return;
+    cancelled_ = true;
+
+    // Once removed the waiter won't be awoken again, so if it's still
+    // registered, the registration's reference is ours to drop.
+    dispatcher_->RemoveAwakable(this, nullptr);
+    std::swap(was_registered, registered_);
+  }
+  if (was_registered)
+    Release();
+}
+
+bool TaskRunnerWaiter::Awake(MojoResult result, uintptr_t context) {
+  // Note: This is called with the dispatcher's lock held, so all it does is
+  // post the call. The posted task keeps the waiter alive once the
+  // registration's reference is dropped.
+  DCHECK(registered_);
+  registered_ = false;
+  PostCallback(result);
+  Release();
+  return false;
+}
+
+TaskRunnerWaiter::~TaskRunnerWaiter() {
+  DCHECK(!registered_);
+}
+
+MojoResult TaskRunnerWaiter::Register() {
+  MojoResult rv;
+  {
+    base::AutoLock lock(lock_);
+    if (cancelled_)
+      return MOJO_RESULT_CANCELLED;
+
+    AddRef();
+    registered_ = true;
+    rv = dispatcher_->AddAwakable(this, signals_, 0, nullptr);
+    if (rv != MOJO_RESULT_OK)
+      registered_ = false;
+  }
+  if (rv != MOJO_RESULT_OK)
+    Release();
+  return rv;
+}
+
+void TaskRunnerWaiter::PostCallback(MojoResult result) {
+  task_runner_->PostTask(
+      FROM_HERE, base::Bind(&TaskRunnerWaiter::RunCallback, this, result));
+}
+
+void TaskRunnerWaiter::RunCallback(MojoResult result) {
+  {
+    base::AutoLock lock(lock_);
+    if (cancelled_)
+      return;
+  }
+
+  if (!persistent_ || result != MOJO_RESULT_OK) {
+    on_done_.Run();
+    callback_.Run(result);
+    return;
+  }
+  if (!callback_.Run(result)) {
+    on_done_.Run();
+    return;
+  }
+
+  // Register again now that the callback has seen the state which woke it.
+  switch (Register()) {
+    case MOJO_RESULT_OK:
+    case MOJO_RESULT_CANCELLED:
+      break;
+    case MOJO_RESULT_ALREADY_EXISTS:
+      PostCallback(MOJO_RESULT_OK);
+      break;
+    case MOJO_RESULT_FAILED_PRECONDITION:
+      PostCallback(MOJO_RESULT_FAILED_PRECONDITION);
+      break;
+    default:
+      // The handle was closed while the waiter wasn't registered.
+      PostCallback(MOJO_RESULT_CANCELLED);
+      break;
+  }
+}
+
+}  // namespace edk
+}  // namespace mojo
@@ -0,0 +1,102 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_SYSTEM_TASK_RUNNER_WAITER_H_
+#define MOJO_EDK_SYSTEM_TASK_RUNNER_WAITER_H_
+
+#include <stdint.h>
+
+#include "base/callback.h"
+#include "base/macros.h"
+#include "base/memory/ref_counted.h"
+#include "base/synchronization/lock.h"
+#include "base/task_runner.h"
+#include "mojo/edk/system/awakable.h"
+#include "mojo/edk/system/dispatcher.h"
+#include "mojo/public/c/system/types.h"
+
+namespace mojo {
+namespace edk {
+
+// Waits on a dispatcher for Core::AsyncWaitOnTaskRunner(). Unlike AsyncWaiter,
+// whose callback runs on whichever thread changes the dispatcher's state --
+// often the I/O thread -- this posts its callback to a task runner, where it
+// may call Mojo functions.
+//
+// The waiter is only registered with the dispatcher until it's first awoken,
+// and a persistent waiter registers again once its callback has returned, so
+// any state changes while a call is posted or running are coalesced into that
+// call. A persistent waiter goes on until its handle is closed, it can no
+// longer satisfy its signals, or it's cancelled.
+class TaskRunnerWaiter final
+    : public Awakable,
+      public base::RefCountedThreadSafe<TaskRunnerWaiter> {
+ public:
+  using AwakeCallback = base::Callback<void(MojoResult)>;
+
+  // Like AwakeCallback, but returns whether a persistent waiter should go on
+  // waiting after a call with MOJO_RESULT_OK.
+  using ConditionalCallback = base::Callback<bool(MojoResult)>;
+
+  // Adapts |callback| to be called for as long as the waiter goes on.
+  static ConditionalCallback Unconditionally(const AwakeCallback& callback);
+
+  // |on_done| is run on |task_runner| just before the last call to
+  // |callback|, or just after a call which returns false, unless the waiter
+  // was cancelled first.
+  TaskRunnerWaiter(scoped_refptr<Dispatcher> dispatcher,
+                   MojoHandleSignals signals,
+                   bool persistent,
+                   scoped_refptr<base::TaskRunner> task_runner,
+                   const ConditionalCallback& callback,
+                   const base::Closure& on_done);
+
+  // Registers with the dispatcher, or posts a call right away if its signals
+  // are already satisfied. Returns the dispatcher's result otherwise, in which
+  // case |callback| is never called.
+  MojoResult Start();
+
+  // Ensures |callback| isn't called again, even if a call has already been
+  // posted. May be called on any thread.
+  void Cancel();
+
+  // |Awakable| implementation.
+  bool Awake(MojoResult result, uintptr_t context) override;
+
+ private:
+  friend class base::RefCountedThreadSafe<TaskRunnerWaiter>;
+
+  ~TaskRunnerWaiter();
+
+  // Registers with the dispatcher, returning its result. Each registration
+  // holds a reference to the waiter.
+  MojoResult Register();
+
+  void PostCallback(MojoResult result);
+  void RunCallback(MojoResult result);
+
+  const scoped_refptr<Dispatcher> dispatcher_;
+  const MojoHandleSignals signals_;
+  const bool persistent_;
+  const scoped_refptr<base::TaskRunner> task_runner_;
+  const ConditionalCallback callback_;
+  const base::Closure on_done_;
+
+  // Serializes registration with cancellation. It's never taken by Awake(),
+  // which runs under the dispatcher's lock.
+  base::Lock lock_;
+  bool cancelled_ = false;
+
+  // Whether the waiter is in the dispatcher's awakable list. Once set, it's
+  // only cleared by Awake() or after removal from that list, both of which
+  // hold the dispatcher's lock.
+  bool registered_ = false;
+
+  DISALLOW_COPY_AND_ASSIGN(TaskRunnerWaiter);
+};
+
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_SYSTEM_TASK_RUNNER_WAITER_H_
@@ -6,8 +6,8 @@
 
 #include <stdint.h>
 
-#include <algorithm>
 #include <utility>
+#include <vector>
 
 #include "base/logging.h"
 #include "mojo/edk/system/awakable.h"
@@ -23,9 +23,10 @@ class WaitSetDispatcher::Waiter final : public Awakable {
   // |Awakable| implementation.
   bool Awake(MojoResult result, uintptr_t context) override {
     // Note: This is called with various Mojo locks held.
-    dispatcher_->WakeDispatcher(result, context);
-    // Removes |this| from the dispatcher's list of waiters.
-    return false;
+    dispatcher_->WakeDispatcher(result, reinterpret_cast<WaitState*>(context));
+    // Stay registered with the dispatcher. Wake-ups for a dispatcher which is
+    // already ready are coalesced by WakeDispatcher().
+    return true;
   }
 
  private:
@@ -56,16 +57,18 @@ MojoResult WaitSetDispatcher::Close() {
     awakable_list_.CancelAll();
   }
 
+  base::AutoLock lock(lock_);
+  for (const auto& entry : waiting_dispatchers_)
+    entry.second.dispatcher->RemoveAwakable(waiter_.get(), nullptr);
+
   {
-    base::AutoLock lock(lock_);
-    for (const auto& entry : waiting_dispatchers_)
-      entry.second.dispatcher->RemoveAwakable(waiter_.get(), nullptr);
-    waiting_dispatchers_.clear();
+    base::AutoLock locker(awoken_lock_);
+    while (!ready_list_.empty())
+      UnlinkNoLock(ready_list_.head()->value());
+    while (!processed_list_.empty())
+      UnlinkNoLock(processed_list_.head()->value());
   }
-
-  base::AutoLock locker(awoken_lock_);
-  awoken_queue_.clear();
-  processed_dispatchers_.clear();
+  waiting_dispatchers_.clear();
 
   return MOJO_RESULT_OK;
 }
@@ -88,57 +91,44 @@ MojoResult WaitSetDispatcher::AddWaitingDispatcher(
     return MOJO_RESULT_ALREADY_EXISTS;
   }
 
-  const MojoResult result = dispatcher->AddAwakable(waiter_.get(), signals,
-                                                    dispatcher_handle, nullptr);
+  // The WaitState is created in place so that its address, which is used as
+  // the awakable context, is stable.
+  WaitState* state = &waiting_dispatchers_[dispatcher_handle];
+  state->dispatcher = dispatcher;
+  state->context = context;
+  state->signals = signals;
+
+  const MojoResult result = dispatcher->AddAwakable(
+      waiter_.get(), signals, reinterpret_cast<uintptr_t>(state), nullptr);
   if (result == MOJO_RESULT_INVALID_ARGUMENT) {
     // Dispatcher is closed.
+    waiting_dispatchers_.erase(dispatcher_handle);
     return result;
   } else if (result != MOJO_RESULT_OK) {
-    WakeDispatcher(result, dispatcher_handle);
+    WakeDispatcher(result, state);
+  } else {
+    state->is_registered = true;
   }
 
-  WaitState state;
-  state.dispatcher = dispatcher;
-  state.context = context;
-  state.signals = signals;
-  bool inserted = waiting_dispatchers_.insert(
-      std::make_pair(dispatcher_handle, state)).second;
-  DCHECK(inserted);
-
   return MOJO_RESULT_OK;
 }
 
 MojoResult WaitSetDispatcher::RemoveWaitingDispatcher(
     const scoped_refptr<Dispatcher>& dispatcher) {
   uintptr_t dispatcher_handle = reinterpret_cast<uintptr_t>(dispatcher.get());
-  {
-    base::AutoLock lock(lock_);
-    auto it = waiting_dispatchers_.find(dispatcher_handle);
-    if (it == waiting_dispatchers_.end())
-      return MOJO_RESULT_NOT_FOUND;
-
-    dispatcher->RemoveAwakable(waiter_.get(), nullptr);
-    // At this point, it should not be possible for |waiter_| to be woken with
-    // |dispatcher|.
-    waiting_dispatchers_.erase(it);
-  }
+  base::AutoLock lock(lock_);
+  auto it = waiting_dispatchers_.find(dispatcher_handle);
+  if (it == waiting_dispatchers_.end())
+    return MOJO_RESULT_NOT_FOUND;
 
-  base::AutoLock locker(awoken_lock_);
-  int num_erased = 0;
-  for (auto it = awoken_queue_.begin(); it != awoken_queue_.end();) {
-    if (it->first == dispatcher_handle) {
-      it = awoken_queue_.erase(it);
-      num_erased++;
-    } else {
-      ++it;
-    }
+  dispatcher->RemoveAwakable(waiter_.get(), nullptr);
+  // At this point, it should not be possible for |waiter_| to be woken with
+  // |dispatcher|.
+  {
+    base::AutoLock locker(awoken_lock_);
+    UnlinkNoLock(&it->second);
   }
-  // The dispatcher should only exist in the queue once.
-  DCHECK_LE(num_erased, 1);
-  processed_dispatchers_.erase(
-      std::remove(processed_dispatchers_.begin(), processed_dispatchers_.end(),
-                  dispatcher_handle),
-      processed_dispatchers_.end());
+  waiting_dispatchers_.erase(it);
 
   return MOJO_RESULT_OK;
 }
@@ -152,64 +142,87 @@ MojoResult WaitSetDispatcher::GetReadyDispatchers(
 
   dispatchers->clear();
 
-  // Re-queue any already retrieved dispatchers. These should be the dispatchers
-  // that were returned on the last call to this function. This loop is
+  // Check again any already retrieved dispatchers. These should be the
+  // dispatchers that were returned on the last call to this function. This is
   // necessary to preserve the logically level-triggering behaviour of waiting
   // in Mojo. In particular, if no action is taken on a signal, that signal
   // continues to be satisfied, and therefore a |MojoWait()| on that
   // handle/signal continues to return immediately.
-  std::deque<uintptr_t> pending;
+  std::vector<WaitState*> pending;
   {
     base::AutoLock locker(awoken_lock_);
-    pending.swap(processed_dispatchers_);
+    while (!processed_list_.empty()) {
+      WaitState* state = processed_list_.head()->value();
+      UnlinkNoLock(state);
+      pending.push_back(state);
+    }
   }
-  for (uintptr_t d : pending) {
-    auto it = waiting_dispatchers_.find(d);
-    // Anything in |processed_dispatchers_| should also be in
-    // |waiting_dispatchers_| since dispatchers are removed from both in
-    // |RemoveWaitingDispatcherImplNoLock()|.
-    DCHECK(it != waiting_dispatchers_.end());
-
-    // |awoken_mutex_| cannot be held here because
-    // |Dispatcher::AddAwakable()| acquires the Dispatcher's mutex. This
-    // mutex is held while running |WakeDispatcher()| below, which needs to
-    // acquire |awoken_mutex_|. Holding |awoken_mutex_| here would result in
-    // a deadlock.
-    const MojoResult result = it->second.dispatcher->AddAwakable(
-        waiter_.get(), it->second.signals, d, nullptr);
-
-    if (result == MOJO_RESULT_INVALID_ARGUMENT) {
-      // Dispatcher is closed. Implicitly remove it from the wait set since
-      // it may be impossible to remove using |MojoRemoveHandle()|.
-      waiting_dispatchers_.erase(it);
-    } else if (result != MOJO_RESULT_OK) {
-      WakeDispatcher(result, d);
+  std::vector<std::pair<WaitState*, MojoResult>> still_ready;
+  for (WaitState* state : pending) {
+    // |awoken_lock_| cannot be held here because the Dispatcher's lock is
+    // held while running |WakeDispatcher()|, which needs to acquire
+    // |awoken_lock_|. Holding |awoken_lock_| here would result in a deadlock.
+    MojoResult result;
+    if (state->is_registered) {
+      // Any change from here on will wake |waiter_|, so only the current
+      // state needs checking.
+      HandleSignalsState signals_state =
+          state->dispatcher->GetHandleSignalsState();
+      if (signals_state.satisfies(state->signals))
+        result = MOJO_RESULT_OK;
+      else if (!signals_state.can_satisfy(state->signals))
+        result = MOJO_RESULT_FAILED_PRECONDITION;
+      else
+        continue;
+    } else {
+      result = state->dispatcher->AddAwakable(
+          waiter_.get(), state->signals, reinterpret_cast<uintptr_t>(state),
+          nullptr);
+      if (result == MOJO_RESULT_INVALID_ARGUMENT) {
+        // Dispatcher is closed. Implicitly remove it from the wait set since
+        // it may be impossible to remove using |MojoRemoveHandle()|.
+        waiting_dispatchers_.erase(
+            reinterpret_cast<uintptr_t>(state->dispatcher.get()));
+        continue;
+      }
+      if (result == MOJO_RESULT_OK) {
+        state->is_registered = true;
+        continue;
+      }
     }
+    still_ready.push_back(std::make_pair(state, result));
   }
 
   const uint32_t max_woken = *count;
   uint32_t num_woken = 0;
 
   base::AutoLock locker(awoken_lock_);
-  while (!awoken_queue_.empty() && num_woken < max_woken) {
-    uintptr_t d = awoken_queue_.front().first;
-    MojoResult result = awoken_queue_.front().second;
-    awoken_queue_.pop_front();
+  for (const auto& entry : still_ready) {
+    // Skip anything which was woken again in the meantime.
+    if (entry.first->queue != WaitState::Queue::NONE)
+      continue;
+    entry.first->result = entry.second;
+    entry.first->queue = WaitState::Queue::READY;
+    ready_list_.Append(entry.first);
+  }
 
-    auto it = waiting_dispatchers_.find(d);
-    DCHECK(it != waiting_dispatchers_.end());
+  while (!ready_list_.empty() && num_woken < max_woken) {
+    WaitState* state = ready_list_.head()->value();
+    UnlinkNoLock(state);
 
-    results[num_woken] = result;
-    dispatchers->push_back(it->second.dispatcher);
+    results[num_woken] = state->result;
+    dispatchers->push_back(state->dispatcher);
     if (contexts)
-      contexts[num_woken] = it->second.context;
+      contexts[num_woken] = state->context;
 
-    if (result != MOJO_RESULT_CANCELLED) {
-      processed_dispatchers_.push_back(d);
+    if (state->result != MOJO_RESULT_CANCELLED) {
+      state->queue = WaitState::Queue::PROCESSED;
+      processed_list_.Append(state);
     } else {
       // |MOJO_RESULT_CANCELLED| indicates that the dispatcher was closed.
       // Return it, but also implcitly remove it from the wait set.
-      waiting_dispatchers_.erase(it);
+      waiting_dispatchers_.erase(
+          reinterpret_cast<uintptr_t>(state->dispatcher.get()));
     }
 
     num_woken++;
@@ -255,25 +268,33 @@ HandleSignalsState WaitSetDispatcher::GetHandleSignalsState() const {
   HandleSignalsState rv;
   rv.satisfiable_signals = MOJO_HANDLE_SIGNAL_READABLE;
   base::AutoLock locker(awoken_lock_);
-  if (!awoken_queue_.empty() || !processed_dispatchers_.empty())
+  if (!ready_list_.empty() || !processed_list_.empty())
     rv.satisfied_signals = MOJO_HANDLE_SIGNAL_READABLE;
   return rv;
 }
 
 WaitSetDispatcher::~WaitSetDispatcher() {
   DCHECK(waiting_dispatchers_.empty());
-  DCHECK(awoken_queue_.empty());
-  DCHECK(processed_dispatchers_.empty());
+  DCHECK(ready_list_.empty());
+  DCHECK(processed_list_.empty());
 }
 
-void WaitSetDispatcher::WakeDispatcher(MojoResult result, uintptr_t context) {
+void WaitSetDispatcher::WakeDispatcher(MojoResult result, WaitState* state) {
   {
     base::AutoLock locker(awoken_lock_);
 
     if (result == MOJO_RESULT_ALREADY_EXISTS)
       result = MOJO_RESULT_OK;
 
-    awoken_queue_.push_back(std::make_pair(context, result));
+    // Keep the latest result, so that e.g. a cancellation is not masked by
+    // an earlier wake-up.
+    state->result = result;
+    if (state->queue == WaitState::Queue::READY)
+      return;
+
+    UnlinkNoLock(state);
+    state->queue = WaitState::Queue::READY;
+    ready_list_.Append(state);
   }
 
   base::AutoLock locker(awakable_lock_);
@@ -283,5 +304,13 @@ void WaitSetDispatcher::WakeDispatcher(MojoResult result, uintptr_t context) {
   awakable_list_.AwakeForStateChange(signals_state);
 }
 
+void WaitSetDispatcher::UnlinkNoLock(WaitState* state) {
+  awoken_lock_.AssertAcquired();
+  if (state->queue == WaitState::Queue::NONE)
+    return;
+  state->RemoveFromList();
+  state->queue = WaitState::Queue::NONE;
+}
+
 }  // namespace edk
 }  // namespace mojo
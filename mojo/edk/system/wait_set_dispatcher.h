@@ -7,10 +7,9 @@
 
 #include <stdint.h>
 
-#include <deque>
 #include <map>
-#include <utility>
 
+#include "base/containers/linked_list.h"
 #include "base/macros.h"
 #include "base/memory/scoped_ptr.h"
 #include "base/synchronization/lock.h"
@@ -49,20 +48,43 @@ class MOJO_SYSTEM_IMPL_EXPORT WaitSetDispatcher : public Dispatcher {
   // Internal implementation of Awakable.
   class Waiter;
 
-  struct WaitState {
+  // State for each dispatcher in the set. |waiter_| stays registered with the
+  // dispatcher for as long as it is in the set, and each state change which
+  // satisfies (or can no longer satisfy) the signals links the WaitState into
+  // |ready_list_|. Retrieving ready dispatchers therefore costs time
+  // proportional to the number which are ready, not the size of the set.
+  struct WaitState : public base::LinkNode<WaitState> {
+    enum class Queue {
+      NONE,
+      READY,
+      PROCESSED,
+    };
+
     WaitState();
     ~WaitState();
 
     scoped_refptr<Dispatcher> dispatcher;
     MojoHandleSignals signals;
     uintptr_t context;
+
+    // Whether |waiter_| is registered with |dispatcher|. It is not when the
+    // dispatcher was already ready at the time we tried to register. Guarded
+    // by |lock_|.
+    bool is_registered = false;
+
+    // Which of |ready_list_| and |processed_list_|, if any, this is linked
+    // into, and the result it was last woken with. Guarded by |awoken_lock_|.
+    Queue queue = Queue::NONE;
+    MojoResult result = MOJO_RESULT_OK;
   };
 
   ~WaitSetDispatcher() override;
 
-  // Signal that the dispatcher indexed by |context| has been woken up with
-  // |result| and is now ready.
-  void WakeDispatcher(MojoResult result, uintptr_t context);
+  // Signal that |state| has been woken up with |result| and is now ready.
+  void WakeDispatcher(MojoResult result, WaitState* state);
+
+  // Unlinks |state| from whichever list it is in. |awoken_lock_| must be held.
+  void UnlinkNoLock(WaitState* state);
 
   // Guards |is_closed_|, |waiting_dispatchers_|, and |waiter_|.
   //
@@ -76,11 +98,11 @@ class MOJO_SYSTEM_IMPL_EXPORT WaitSetDispatcher : public Dispatcher {
 
   // Separate lock that can be locked without locking |lock_|.
   mutable base::Lock awoken_lock_;
-  // List of dispatchers that have been woken up. Any dispatcher in this queue
-  // will NOT currently be waited on.
-  std::deque<std::pair<uintptr_t, MojoResult>> awoken_queue_;
-  // List of dispatchers that have been woken up and retrieved.
-  std::deque<uintptr_t> processed_dispatchers_;
+  // Dispatchers which have been woken up but not yet retrieved.
+  base::LinkedList<WaitState> ready_list_;
+  // Dispatchers which have been woken up and retrieved. These are checked
+  // again on the next retrieval, since Mojo signals are level-triggered.
+  base::LinkedList<WaitState> processed_list_;
 
   // Separate lock that can be locked without locking |lock_|.
   base::Lock awakable_lock_;
@@ -8,6 +8,7 @@
 #include <stdint.h>
 
 #include <algorithm>
+#include <vector>
 
 #include "base/macros.h"
 #include "base/memory/ref_counted.h"
@@ -70,6 +71,16 @@ class WaitSetDispatcherTest : public ::testing::Test {
     dispatchers_to_close_.push_back(*d1);
   }
 
+  void WaitUntilReadable(const scoped_refptr<Dispatcher>& dispatcher) {
+    Waiter w;
+    w.Init();
+    if (dispatcher->AddAwakable(&w, MOJO_HANDLE_SIGNAL_READABLE, 0,
+                                nullptr) == MOJO_RESULT_OK) {
+      EXPECT_EQ(MOJO_RESULT_OK, w.Wait(MOJO_DEADLINE_INDEFINITE, nullptr));
+      dispatcher->RemoveAwakable(&w, nullptr);
+    }
+  }
+
   void CloseOnShutdown(const scoped_refptr<Dispatcher>& dispatcher) {
     dispatchers_to_close_.push_back(dispatcher);
   }
@@ -341,6 +352,75 @@ TEST_F(WaitSetDispatcherTest, MultipleReady) {
   EXPECT_EQ(expected_dispatchers, dispatchers_vector);
 }
 
+TEST_F(WaitSetDispatcherTest, OnlyReadyReturned) {
+  scoped_refptr<WaitSetDispatcher> wait_set = new WaitSetDispatcher();
+  CloseOnShutdown(wait_set);
+
+  const size_t kNumPipes = 64;
+  std::vector<scoped_refptr<MessagePipeDispatcher>> readers(kNumPipes);
+  std::vector<scoped_refptr<MessagePipeDispatcher>> writers(kNumPipes);
+  for (size_t i = 0; i < kNumPipes; ++i) {
+    CreateMessagePipe(&readers[i], &writers[i]);
+    ASSERT_EQ(MOJO_RESULT_OK,
+              wait_set->AddWaitingDispatcher(readers[i],
+                                             MOJO_HANDLE_SIGNAL_READABLE, i));
+  }
+
+  scoped_refptr<Dispatcher> woken_dispatcher;
+  EXPECT_EQ(MOJO_RESULT_SHOULD_WAIT,
+            GetOneReadyDispatcher(wait_set, &woken_dispatcher, nullptr));
+
+  // Several messages to the same pipe are reported once.
+  char buffer[] = "abcd";
+  const size_t kReadyPipes[] = {3, 17, 42};
+  for (size_t i : kReadyPipes) {
+    for (size_t j = 0; j < 3; ++j) {
+      ASSERT_EQ(MOJO_RESULT_OK,
+                writers[i]->WriteMessage(buffer, sizeof(buffer), nullptr, 0,
+                                         MOJO_WRITE_MESSAGE_FLAG_NONE));
+    }
+    WaitUntilReadable(readers[i]);
+  }
+
+  uint32_t count = kNumPipes;
+  DispatcherVector dispatchers_vector;
+  std::vector<MojoResult> results(kNumPipes);
+  std::vector<uintptr_t> contexts(kNumPipes);
+  EXPECT_EQ(MOJO_RESULT_OK,
+            wait_set->GetReadyDispatchers(&count, &dispatchers_vector,
+                                          results.data(), contexts.data()));
+  ASSERT_EQ(arraysize(kReadyPipes), count);
+  std::sort(contexts.begin(), contexts.begin() + count);
+  for (size_t i = 0; i < count; ++i) {
+    EXPECT_EQ(MOJO_RESULT_OK, results[i]);
+    EXPECT_EQ(kReadyPipes[i], contexts[i]);
+  }
+
+  // Drain the pipes. Nothing should be ready afterwards, and the pipes remain
+  // in the set so a later message is reported again.
+  for (size_t i : kReadyPipes) {
+    for (size_t j = 0; j < 3; ++j) {
+      char read_buffer[sizeof(buffer)];
+      uint32_t num_bytes = sizeof(read_buffer);
+      ASSERT_EQ(MOJO_RESULT_OK,
+                readers[i]->ReadMessage(read_buffer, &num_bytes, nullptr,
+                                        nullptr, MOJO_READ_MESSAGE_FLAG_NONE));
+    }
+  }
+  EXPECT_EQ(MOJO_RESULT_SHOULD_WAIT,
+            GetOneReadyDispatcher(wait_set, &woken_dispatcher, nullptr));
+
+  ASSERT_EQ(MOJO_RESULT_OK,
+            writers[17]->WriteMessage(buffer, sizeof(buffer), nullptr, 0,
+                                      MOJO_WRITE_MESSAGE_FLAG_NONE));
+  WaitUntilReadable(readers[17]);
+  uintptr_t context = 0;
+  EXPECT_EQ(MOJO_RESULT_OK,
+            GetOneReadyDispatcher(wait_set, &woken_dispatcher, &context));
+  EXPECT_EQ(readers[17], woken_dispatcher);
+  EXPECT_EQ(17u, context);
+}
+
 TEST_F(WaitSetDispatcherTest, InvalidParams) {
   scoped_refptr<WaitSetDispatcher> wait_set = new WaitSetDispatcher();
 
@@ -0,0 +1,183 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/work_stealing_thread_pool.h"
+
+#include <atomic>
+#include <deque>
+
+#include "base/logging.h"
+#include "base/strings/string_number_conversions.h"
+#include "base/synchronization/condition_variable.h"
+#include "base/synchronization/lock.h"
+#include "base/threading/simple_thread.h"
+#include "base/threading/thread_local_storage.h"
+
+namespace mojo {
+namespace edk {
+
+// The workers' queues, which are also what tasks are posted to. This is
+// ref-counted so that task runners handed out by the pool may outlive it.
+class WorkStealingThreadPool::Queues : public base::TaskRunner {
+ public:
+  explicit Queues(size_t num_queues)
+      : wake_up_(&sleep_lock_) {
+    for (size_t i = 0; i < num_queues; ++i)
+      queues_.emplace_back(new Queue);
+  }
+
+  // base::TaskRunner:
+  bool PostDelayedTask(const tracked_objects::Location& from_here,
+                       const base::Closure& task,
+                       base::TimeDelta delay) override {
+    if (!delay.is_zero() || stopped_.load(std::memory_order_acquire))
+      return false;
+
+    size_t index = GetCurrentWorker();
+    if (index == kNotAWorker) {
+      index = next_queue_.fetch_add(1, std::memory_order_relaxed) %
+              queues_.size();
+    }
+    {
+      base::AutoLock lock(queues_[index]->lock);
+      queues_[index]->tasks.push_back(task);
+    }
+
+    // This pairs with the check a worker makes before it sleeps: either the
+    // worker sees the new task, or this sees the worker and wakes one up.
+    num_tasks_.fetch_add(1);
+    if (num_sleeping_.load() > 0) {
+      base::AutoLock lock(sleep_lock_);
+      wake_up_.Signal();
+    }
+    return true;
+  }
+
+  bool RunsTasksOnCurrentThread() const override {
+    return GetCurrentWorker() != kNotAWorker;
+  }
+
+  // Runs tasks as worker |index| until Stop() is called and nothing is left.
+  void RunWorker(size_t index) {
+    current_worker_.Set(reinterpret_cast<void*>(index + 1));
+    base::Closure task;
+    for (;;) {
+      if (TakeTask(index, &task)) {
+        task.Run();
+        task.Reset();
+        continue;
+      }
+
+      base::AutoLock lock(sleep_lock_);
+      num_sleeping_.fetch_add(1);
+      while (num_tasks_.load() == 0 && !stopping_)
+        wake_up_.Wait();
+      num_sleeping_.fetch_sub(1);
+      if (stopping_ && num_tasks_.load() == 0)
+        break;
+    }
+    current_worker_.Set(nullptr);
+  }
+
+  void Stop() {
+    stopped_.store(true, std::memory_order_release);
+    base::AutoLock lock(sleep_lock_);
+    stopping_ = true;
+    wake_up_.Broadcast();
+  }
+
+ private:
+  struct Queue {
+    base::Lock lock;
+    std::deque<base::Closure> tasks;
+  };
+
+  static const size_t kNotAWorker = static_cast<size_t>(-1);
+
+  ~Queues() override {}
+
+  size_t GetCurrentWorker() const {
+    uintptr_t value = reinterpret_cast<uintptr_t>(current_worker_.Get());
+    return value ? static_cast<size_t>(value - 1) : kNotAWorker;
+  }
+
+  // Takes the oldest task from worker |index|'s own queue or, failing that,
+  // the newest task from another worker's.
+  bool TakeTask(size_t index, base::Closure* task) {
+    for (size_t i = 0; i < queues_.size(); ++i) {
+      Queue* queue = queues_[(index + i) % queues_.size()].get();
+      base::AutoLock lock(queue->lock);
+      if (queue->tasks.empty())
+        continue;
+      if (i == 0) {
+        *task = queue->tasks.front();
+        queue->tasks.pop_front();
+      } else {
+        *task = queue->tasks.back();
+        queue->tasks.pop_back();
+      }
+      num_tasks_.fetch_sub(1);
+      return true;
+    }
+    return false;
+  }
+
+  std::vector<scoped_ptr<Queue>> queues_;
+
+  // Holds one more than the index of the worker running on this thread, or
+  // null on other threads.
+  mutable base::ThreadLocalStorage::Slot current_worker_;
+
+  std::atomic<size_t> next_queue_{0};
+  std::atomic<size_t> num_tasks_{0};
+  std::atomic<size_t> num_sleeping_{0};
+  std::atomic<bool> stopped_{false};
+
+  base::Lock sleep_lock_;
+  base::ConditionVariable wake_up_;
+  bool stopping_ = false;  // Guarded by |sleep_lock_|.
+
+  DISALLOW_COPY_AND_ASSIGN(Queues);
+};
+
+class WorkStealingThreadPool::Worker
+    : public base::DelegateSimpleThread::Delegate {
+ public:
+  Worker(Queues* queues, size_t index) : queues_(queues), index_(index) {}
+  ~Worker() override {}
+
+  // base::DelegateSimpleThread::Delegate:
+  void Run() override { queues_->RunWorker(index_); }
+
+ private:
+  Queues* const queues_;
+  const size_t index_;
+
+  DISALLOW_COPY_AND_ASSIGN(Worker);
+};
+
+WorkStealingThreadPool::WorkStealingThreadPool(const std::string& name_prefix,
+                                               size_t num_threads)
+    : queues_(new Queues(num_threads)) {
+  DCHECK_GT(num_threads, 0u);
+  for (size_t i = 0; i < num_threads; ++i) {
+    workers_.emplace_back(new Worker(queues_.get(), i));
+    threads_.emplace_back(new base::DelegateSimpleThread(
+        workers_.back().get(), name_prefix + base::SizeTToString(i)));
+    threads_.back()->Start();
+  }
+}
+
+WorkStealingThreadPool::~WorkStealingThreadPool() {
+  queues_->Stop();
+  for (auto& thread : threads_)
+    thread->Join();
+}
+
+scoped_refptr<base::TaskRunner> WorkStealingThreadPool::task_runner() const {
+  return queues_;
+}
+
+}  // namespace edk
+}  // namespace mojo
@@ -0,0 +1,63 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef MOJO_EDK_SYSTEM_WORK_STEALING_THREAD_POOL_H_
+#define MOJO_EDK_SYSTEM_WORK_STEALING_THREAD_POOL_H_
+
+#include <stddef.h>
+
+#include <string>
+#include <vector>
+
+#include "base/macros.h"
+#include "base/memory/ref_counted.h"
+#include "base/memory/scoped_ptr.h"
+#include "base/task_runner.h"
+#include "mojo/edk/system/system_impl_export.h"
+
+namespace base {
+class DelegateSimpleThread;
+}
+
+namespace mojo {
+namespace edk {
+
+// A fixed set of worker threads behind a base::TaskRunner, used as the default
+// executor for message pipes bound with Core::BindMessagePipe(). Each worker
+// has its own queue: tasks posted from a worker go to that worker's queue and
+// tasks posted from elsewhere are spread over the queues in turn, so posting
+// rarely contends with other posters. A worker with nothing queued steals
+// from the others before going to sleep.
+//
+// Like base::TaskRunner in general, the pool doesn't order tasks with respect
+// to each other; callers which need ordering, such as message pipe bindings,
+// keep no more than one task posted at a time. Delayed tasks aren't supported
+// and are refused.
+class MOJO_SYSTEM_IMPL_EXPORT WorkStealingThreadPool {
+ public:
+  // Starts |num_threads| workers, named |name_prefix| followed by an index.
+  WorkStealingThreadPool(const std::string& name_prefix, size_t num_threads);
+
+  // Runs every task queued so far and then joins the workers. Tasks posted
+  // once this has started may be refused.
+  ~WorkStealingThreadPool();
+
+  // May outlive the pool, in which case it refuses all tasks.
+  scoped_refptr<base::TaskRunner> task_runner() const;
+
+ private:
+  class Queues;
+  class Worker;
+
+  const scoped_refptr<Queues> queues_;
+  std::vector<scoped_ptr<Worker>> workers_;
+  std::vector<scoped_ptr<base::DelegateSimpleThread>> threads_;
+
+  DISALLOW_COPY_AND_ASSIGN(WorkStealingThreadPool);
+};
+
+}  // namespace edk
+}  // namespace mojo
+
+#endif  // MOJO_EDK_SYSTEM_WORK_STEALING_THREAD_POOL_H_
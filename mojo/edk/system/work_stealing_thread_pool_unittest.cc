@@ -0,0 +1,87 @@
+// Copyright 2016 The Chromium Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "mojo/edk/system/work_stealing_thread_pool.h"
+
+#include <atomic>
+
+#include "base/bind.h"
+#include "base/location.h"
+#include "base/synchronization/waitable_event.h"
+#include "base/time/time.h"
+#include "testing/gtest/include/gtest/gtest.h"
+
+namespace mojo {
+namespace edk {
+namespace {
+
+const int kNumTasks = 1000;
+
+struct Counter {
+  Counter() : done(false, false) {}
+
+  std::atomic<int> remaining{2 * kNumTasks};
+  base::WaitableEvent done;
+};
+
+void CountTask(Counter* counter) {
+  if (counter->remaining.fetch_sub(1) == 1)
+    counter->done.Signal();
+}
+
+void CountAndPostTask(scoped_refptr<base::TaskRunner> task_runner,
+                      Counter* counter) {
+  // Tasks posted from a worker go to its own queue, from which idle workers
+  // can steal them.
+  EXPECT_TRUE(task_runner->RunsTasksOnCurrentThread());
+  EXPECT_TRUE(task_runner->PostTask(
+      FROM_HERE, base::Bind(&CountTask, base::Unretained(counter))));
+  CountTask(counter);
+}
+
+TEST(WorkStealingThreadPoolTest, RunsAllTasks) {
+  Counter counter;
+  WorkStealingThreadPool pool("WorkStealingThreadPoolTest", 4);
+  scoped_refptr<base::TaskRunner> task_runner = pool.task_runner();
+  EXPECT_FALSE(task_runner->RunsTasksOnCurrentThread());
+  for (int i = 0; i < kNumTasks; ++i) {
+    ASSERT_TRUE(task_runner->PostTask(
+        FROM_HERE, base::Bind(&CountAndPostTask, task_runner,
+                              base::Unretained(&counter))));
+  }
+  counter.done.Wait();
+  EXPECT_EQ(0, counter.remaining.load());
+}
+
+TEST(WorkStealingThreadPoolTest, RunsQueuedTasksBeforeStopping) {
+  Counter counter;
+  counter.remaining = kNumTasks;
+  {
+    WorkStealingThreadPool pool("WorkStealingThreadPoolTest", 2);
+    for (int i = 0; i < kNumTasks; ++i) {
+      ASSERT_TRUE(pool.task_runner()->PostTask(
+          FROM_HERE, base::Bind(&CountTask, base::Unretained(&counter))));
+    }
+  }
+  EXPECT_EQ(0, counter.remaining.load());
+}
+
+TEST(WorkStealingThreadPoolTest, RefusesDelayedAndLateTasks) {
+  Counter counter;
+  scoped_refptr<base::TaskRunner> task_runner;
+  {
+    WorkStealingThreadPool pool("WorkStealingThreadPoolTest", 1);
+    task_runner = pool.task_runner();
+    EXPECT_FALSE(task_runner->PostDelayedTask(
+        FROM_HERE, base::Bind(&CountTask, base::Unretained(&counter)),
+        base::TimeDelta::FromMilliseconds(1)));
+  }
+  EXPECT_FALSE(task_runner->PostTask(
+      FROM_HERE, base::Bind(&CountTask, base::Unretained(&counter))));
+  EXPECT_EQ(2 * kNumTasks, counter.remaining.load());
+}
+
+}  // namespace
+}  // namespace edk
+}  // namespace mojo
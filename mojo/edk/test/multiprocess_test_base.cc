@@ -27,6 +27,15 @@ MultiprocessTestBase::ClientController& MultiprocessTestBase::StartClient(
   return *clients_.back();
 }
 
+std::vector<MultiprocessTestBase::ClientController*>
+MultiprocessTestBase::StartClients(const std::string& client_name,
+                                   size_t num_clients) {
+  std::vector<ClientController*> clients;
+  for (size_t i = 0; i < num_clients; ++i)
+    clients.push_back(&StartClient(client_name));
+  return clients;
+}
+
 MultiprocessTestBase::ClientController::ClientController(
     const std::string& client_name,
     MultiprocessTestBase* test)
@@ -45,6 +54,64 @@ int MultiprocessTestBase::ClientController::WaitForShutdown() {
   return helper_.WaitForChildShutdown();
 }
 
+// static
+void MultiprocessTestBase::ConnectClients(
+    const std::vector<ClientController*>& clients) {
+  uint32_t num_clients = static_cast<uint32_t>(clients.size());
+  std::vector<std::vector<MojoHandle>> sibling_pipes(num_clients);
+  for (uint32_t i = 0; i < num_clients; ++i) {
+    for (uint32_t j = i + 1; j < num_clients; ++j) {
+      MojoHandle pipe_i, pipe_j;
+      CreatePipe(&pipe_i, &pipe_j);
+      sibling_pipes[i].push_back(pipe_i);
+      sibling_pipes[j].push_back(pipe_j);
+    }
+  }
+
+  // Each client is told its index and the number of clients, with its pipes
+  // ordered by the index of the client at the other end.
+  for (uint32_t i = 0; i < num_clients; ++i) {
+    uint32_t header[] = {i, num_clients};
+    CHECK_EQ(MojoWriteMessage(clients[i]->pipe(), header, sizeof(header),
+                              sibling_pipes[i].data(),
+                              static_cast<uint32_t>(sibling_pipes[i].size()),
+                              MOJO_WRITE_MESSAGE_FLAG_NONE),
+             MOJO_RESULT_OK);
+  }
+}
+
+// static
+uint32_t MultiprocessTestBase::ReceiveSiblingPipes(
+    MojoHandle parent_pipe,
+    std::vector<MojoHandle>* sibling_pipes) {
+  CHECK_EQ(MojoWait(parent_pipe, MOJO_HANDLE_SIGNAL_READABLE,
+                    MOJO_DEADLINE_INDEFINITE, nullptr),
+           MOJO_RESULT_OK);
+
+  uint32_t message_size = 0;
+  uint32_t num_handles = 0;
+  CHECK_EQ(MojoReadMessage(parent_pipe, nullptr, &message_size, nullptr,
+                           &num_handles, MOJO_READ_MESSAGE_FLAG_NONE),
+           MOJO_RESULT_RESOURCE_EXHAUSTED);
+  uint32_t header[2];
+  CHECK_EQ(message_size, sizeof(header));
+  std::vector<MojoHandle> handles(num_handles);
+  CHECK_EQ(MojoReadMessage(parent_pipe, header, &message_size, handles.data(),
+                           &num_handles, MOJO_READ_MESSAGE_FLAG_NONE),
+           MOJO_RESULT_OK);
+
+  uint32_t index = header[0];
+  uint32_t num_clients = header[1];
+  CHECK_LT(index, num_clients);
+  CHECK_EQ(num_handles, num_clients - 1);
+  sibling_pipes->assign(num_clients, MOJO_HANDLE_INVALID);
+  for (uint32_t i = 0, next = 0; i < num_clients; ++i) {
+    if (i != index)
+      (*sibling_pipes)[i] = handles[next++];
+  }
+  return index;
+}
+
 // static
 void MultiprocessTestBase::CreatePipe(MojoHandle *p0, MojoHandle* p1) {
   MojoCreateMessagePipe(nullptr, p0, p1);
@@ -7,6 +7,7 @@
 
 #include <string>
 #include <utility>
+#include <vector>
 
 #include "base/bind.h"
 #include "base/callback.h"
@@ -51,6 +52,25 @@ class MultiprocessTestBase : public testing::Test {
 
   ClientController& StartClient(const std::string& client_name);
 
+  // Starts |num_clients| instances of |client_name|, as a broker starts its
+  // children. Each must still be waited on with WaitForShutdown().
+  std::vector<ClientController*> StartClients(const std::string& client_name,
+                                              size_t num_clients);
+
+  // Connects every pair of |clients| with a new message pipe, sending the ends
+  // to them over their pipes to this process. The pipes between two clients
+  // only become direct once the broker has introduced their nodes, which
+  // happens when the first message goes through. Each client must start by
+  // calling ReceiveSiblingPipes().
+  static void ConnectClients(const std::vector<ClientController*>& clients);
+
+  // Called by a client connected with ConnectClients() to read its pipes to
+  // the other clients from |parent_pipe|. |(*sibling_pipes)[i]| is the pipe to
+  // client i, or MOJO_HANDLE_INVALID for the client itself. Returns the
+  // client's own index.
+  static uint32_t ReceiveSiblingPipes(MojoHandle parent_pipe,
+                                      std::vector<MojoHandle>* sibling_pipes);
+
   template <typename HandlerFunc>
   void StartClientWithHandler(const std::string& client_name,
                               HandlerFunc handler) {
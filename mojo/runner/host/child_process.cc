@@ -326,6 +326,28 @@ ScopedMessagePipeHandle InitializeHostMessagePipe(
   return host_message_pipe;
 }
 
+// Reads the path of the application a prewarmed child is to run, which the
+// host sends as the first message on |host_message_pipe|.
+base::FilePath ReadPrewarmedAppPath(MessagePipeHandle host_message_pipe) {
+  MojoResult rv = Wait(host_message_pipe, MOJO_HANDLE_SIGNAL_READABLE,
+                       MOJO_DEADLINE_INDEFINITE, nullptr);
+  if (rv != MOJO_RESULT_OK) {
+    // The host gave up on us before we were needed.
+    DVLOG(1) << "Prewarmed child was never started.";
+    _exit(0);
+  }
+
+  uint32_t num_bytes = 0;
+  rv = ReadMessageRaw(host_message_pipe, nullptr, &num_bytes, nullptr, nullptr,
+                      MOJO_READ_MESSAGE_FLAG_NONE);
+  CHECK_EQ(MOJO_RESULT_RESOURCE_EXHAUSTED, rv);
+  std::string app_path(num_bytes, '\0');
+  rv = ReadMessageRaw(host_message_pipe, &app_path[0], &num_bytes, nullptr,
+                      nullptr, MOJO_READ_MESSAGE_FLAG_NONE);
+  CHECK_EQ(MOJO_RESULT_OK, rv);
+  return base::FilePath::FromUTF8Unsafe(app_path);
+}
+
 }  // namespace
 
 int ChildProcessMain() {
@@ -333,13 +355,40 @@ int ChildProcessMain() {
   const base::CommandLine& command_line =
       *base::CommandLine::ForCurrentProcess();
 
+  embedder::ScopedPlatformHandle platform_channel =
+      embedder::PlatformChannelPair::PassClientHandleFromParentProcess(
+          command_line);
+  CHECK(platform_channel.is_valid());
+
+  DCHECK(!base::MessageLoop::current());
+
+  // The sandbox must be engaged while we are still single-threaded, so a
+  // sandboxed child only starts Mojo afterwards. Otherwise we connect to the
+  // host first, so that the handshake with it overlaps with loading the
+  // application. Messages on the host pipe are queued until it completes.
+  bool sandboxed = false;
 #if defined(OS_LINUX) && !defined(OS_ANDROID)
   scoped_ptr<mojo::runner::LinuxSandbox> sandbox;
+  sandboxed = command_line.HasSwitch(switches::kEnableSandbox);
 #endif
+  bool prewarmed = command_line.HasSwitch(switches::kPrewarmedChild);
+  CHECK(!prewarmed || !sandboxed) << "A prewarmed child can't be sandboxed.";
+
+  AppContext app_context;
+  ScopedMessagePipeHandle host_message_pipe;
+  if (!sandboxed) {
+    app_context.Init();
+    host_message_pipe = InitializeHostMessagePipe(std::move(platform_channel),
+                                                  app_context.io_runner());
+  }
+
+  base::FilePath app_path =
+      prewarmed ? ReadPrewarmedAppPath(host_message_pipe.get())
+                : command_line.GetSwitchValuePath(switches::kChildProcess);
+
   base::NativeLibrary app_library = 0;
   // Load the application library before we engage the sandbox.
-  app_library = mojo::runner::LoadNativeApplication(
-      command_line.GetSwitchValuePath(switches::kChildProcess));
+  app_library = mojo::runner::LoadNativeApplication(app_path);
   base::i18n::InitializeICU();
   if (app_library)
     CallLibraryEarlyInitialization(app_library);
@@ -349,21 +398,15 @@ int ChildProcessMain() {
   base::debug::EnableInProcessStackDumping();
 #endif
 #if defined(OS_LINUX) && !defined(OS_ANDROID)
-  if (command_line.HasSwitch(switches::kEnableSandbox))
+  if (sandboxed)
     sandbox = InitializeSandbox();
 #endif
 
-  embedder::ScopedPlatformHandle platform_channel =
-      embedder::PlatformChannelPair::PassClientHandleFromParentProcess(
-          command_line);
-  CHECK(platform_channel.is_valid());
-
-  DCHECK(!base::MessageLoop::current());
-
-  AppContext app_context;
-  app_context.Init();
-  ScopedMessagePipeHandle host_message_pipe = InitializeHostMessagePipe(
-      std::move(platform_channel), app_context.io_runner());
+  if (sandboxed) {
+    app_context.Init();
+    host_message_pipe = InitializeHostMessagePipe(std::move(platform_channel),
+                                                  app_context.io_runner());
+  }
   app_context.StartControllerThread();
   Blocker blocker;
   app_context.controller_runner()->PostTask(
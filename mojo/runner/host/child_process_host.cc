@@ -43,6 +43,8 @@ ChildProcessHost::ChildProcessHost(base::TaskRunner* launch_process_runner,
       app_path_(app_path),
       channel_info_(nullptr),
       start_child_process_event_(false, false),
+      prewarmed_(false),
+      prewarm_launched_(false),
       weak_factory_(this) {
   if (base::CommandLine::ForCurrentProcess()->HasSwitch("use-new-edk")) {
     node_channel_.reset(new edk::PlatformChannelPair);
@@ -61,6 +63,8 @@ ChildProcessHost::ChildProcessHost(ScopedHandle channel)
       start_sandboxed_(false),
       channel_info_(nullptr),
       start_child_process_event_(false, false),
+      prewarmed_(false),
+      prewarm_launched_(false),
       weak_factory_(this) {
   CHECK(channel.is_valid());
   ScopedMessagePipeHandle handle(MessagePipeHandle(channel.release().value()));
@@ -87,10 +91,55 @@ void ChildProcessHost::Start(
                  pid_available_callback));
 }
 
+void ChildProcessHost::Prewarm() {
+  DCHECK(!child_process_.IsValid());
+  DCHECK(!prewarmed_);
+  DCHECK(app_path_.empty());
+  DCHECK(!start_sandboxed_);
+  DCHECK(child_message_pipe_.is_valid());
+
+  prewarmed_ = true;
+  launch_process_runner_->PostTaskAndReply(
+      FROM_HERE,
+      base::Bind(&ChildProcessHost::DoLaunch, base::Unretained(this)),
+      base::Bind(&ChildProcessHost::DidPrewarm, weak_factory_.GetWeakPtr()));
+}
+
+void ChildProcessHost::StartPrewarmed(
+    const base::FilePath& app_path,
+    const base::Callback<void(base::ProcessId)>& pid_available_callback) {
+  DCHECK(prewarmed_);
+  DCHECK(child_message_pipe_.is_valid());
+
+  // The child reads the path before it binds its end of the pipe, so this must
+  // be its first message. Messages written before the child has connected are
+  // queued for it.
+  app_path_ = app_path;
+  std::string app_path_string = app_path_.AsUTF8Unsafe();
+  MojoResult rv = WriteMessageRaw(
+      child_message_pipe_.get(), app_path_string.data(),
+      static_cast<uint32_t>(app_path_string.size()), nullptr, 0,
+      MOJO_WRITE_MESSAGE_FLAG_NONE);
+  DCHECK_EQ(MOJO_RESULT_OK, rv);
+
+  controller_.Bind(
+      InterfacePtrInfo<ChildController>(std::move(child_message_pipe_), 0u));
+
+  if (prewarm_launched_)
+    DidStart(pid_available_callback);
+  else
+    pending_pid_available_callback_ = pid_available_callback;
+}
+
 int ChildProcessHost::Join() {
-  if (controller_)  // We use this as a signal that Start was called.
+  // We use |controller_| as a signal that Start was called.
+  if (controller_ || prewarmed_)
     start_child_process_event_.Wait();
   controller_ = ChildControllerPtr();
+
+  // A prewarmed child which was never started waits on this pipe for an
+  // application, so closing it lets the child exit.
+  child_message_pipe_.reset();
   DCHECK(child_process_.IsValid());
   int rv = -1;
   LOG_IF(ERROR, !child_process_.WaitForExit(&rv))
@@ -128,6 +177,16 @@ void ChildProcessHost::DidStart(
   }
 }
 
+void ChildProcessHost::DidPrewarm() {
+  prewarm_launched_ = true;
+  if (!pending_pid_available_callback_.is_null()) {
+    base::Callback<void(base::ProcessId)> pid_available_callback =
+        pending_pid_available_callback_;
+    pending_pid_available_callback_.Reset();
+    DidStart(pid_available_callback);
+  }
+}
+
 void ChildProcessHost::DoLaunch() {
   const base::CommandLine* parent_command_line =
       base::CommandLine::ForCurrentProcess();
@@ -147,6 +206,9 @@ void ChildProcessHost::DoLaunch() {
   if (start_sandboxed_)
     child_command_line.AppendSwitch(switches::kEnableSandbox);
 
+  if (prewarmed_)
+    child_command_line.AppendSwitch(switches::kPrewarmedChild);
+
   node_channel_->PrepareToPassClientHandleToChildProcess(&child_command_line,
                                                          &handle_passing_info_);
 
@@ -57,6 +57,19 @@ class ChildProcessHost {
   void Start(
       const base::Callback<void(base::ProcessId)>& pid_available_callback);
 
+  // Launches the child process before the application it is to run is known,
+  // so that by the time the child is needed it has already initialized Mojo
+  // and connected to us. The host must have been created with an empty
+  // |app_path| and without |start_sandboxed|, as the sandbox can't be engaged
+  // once Mojo is running. Use |StartPrewarmed()| rather than |Start()|.
+  void Prewarm();
+
+  // Like |Start()|, for a prewarmed child: tells it to load |app_path|, a .mojo
+  // application, and calls |DidStart()| once the child has been launched.
+  void StartPrewarmed(
+      const base::FilePath& app_path,
+      const base::Callback<void(base::ProcessId)>& pid_available_callback);
+
   // Waits for the child process to terminate, and returns its exit code.
   int Join();
 
@@ -72,6 +85,7 @@ class ChildProcessHost {
 
  private:
   void DoLaunch();
+  void DidPrewarm();
 
   void AppCompleted(int32_t result);
 
@@ -80,7 +94,7 @@ class ChildProcessHost {
 
   scoped_refptr<base::TaskRunner> launch_process_runner_;
   bool start_sandboxed_;
-  const base::FilePath app_path_;
+  base::FilePath app_path_;
   base::Process child_process_;
   // Used for the ChildController binding.
   embedder::PlatformChannelPair platform_channel_pair_;
@@ -97,6 +111,12 @@ class ChildProcessHost {
   // the main thread if it tries to destruct |this| while launching the process.
   base::WaitableEvent start_child_process_event_;
 
+  // Whether the child was launched by |Prewarm()|, and whether that launch has
+  // finished. |pending_pid_available_callback_| is held until it has.
+  bool prewarmed_;
+  bool prewarm_launched_;
+  base::Callback<void(base::ProcessId)> pending_pid_available_callback_;
+
   // A token the child can use to connect a primordial pipe to the host.
   std::string primordial_pipe_token_;
 
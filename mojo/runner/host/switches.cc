@@ -14,6 +14,11 @@ const char kChildProcess[] = "child-process";
 // Enables the sandbox on this process.
 const char kEnableSandbox[] = "enable-sandbox";
 
+// Used internally with kChildProcess to start a child process before the
+// application it is to run is known. The child connects to its parent, then
+// reads the path of the application from its primordial pipe. Not for user use.
+const char kPrewarmedChild[] = "prewarmed-child";
+
 // Provides a child process with a token string they can use to establish a
 // primordial message pipe to the parent.
 const char kPrimordialPipeToken[] = "primordial-pipe-token";